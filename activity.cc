@@ -14,8 +14,19 @@
 
 #include "activity.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include "absl/types/span.h"
 #include "boost/preprocessor/repetition/repeat.hpp"
 #include "glog/logging.h"
+#include "joint_distribution_sample_generator.h"
 
 namespace distbench {
 
@@ -25,6 +36,12 @@ std::unique_ptr<Activity> AllocateActivity(ParsedActivityConfig* config) {
 
   if (activity_func == "ConsumeCpu") {
     activity = std::make_unique<ConsumeCpu>();
+  } else if (activity_func == "ConsumeCpuTime") {
+    activity = std::make_unique<ConsumeCpuTime>();
+  } else if (activity_func == "ConsumeMemoryBandwidth") {
+    activity = std::make_unique<ConsumeMemoryBandwidth>();
+  } else if (activity_func == "StorageIo") {
+    activity = std::make_unique<StorageIo>();
   } else if (activity_func == "PolluteDataCache") {
     activity = std::make_unique<PolluteDataCache>();
   } else if (activity_func == "PolluteInstructionCache") {
@@ -72,6 +89,540 @@ absl::Status ConsumeCpu::ValidateConfig(ActivityConfig& ac) {
   return absl::OkStatus();
 }
 
+// Activity: ConsumeCpuTime
+
+namespace {
+
+// The CPU time is checked after spinning for at most this long:
+constexpr int64_t kMaxSpinSliceNs = 10'000;
+
+int64_t ThreadCpuTimeNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+}
+
+// A chain of dependent register operations (xorshift), which the compiler
+// cannot fold as long as the result is used.
+uint64_t Spin(uint64_t x, int64_t rounds) {
+  for (int64_t i = 0; i < rounds; ++i) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+  }
+  return x;
+}
+
+volatile uint64_t calibration_result;
+
+// Returns how many rounds of Spin run in a microsecond of CPU time. The best
+// of a few runs is kept, so that an interrupt does not skew the calibration.
+int64_t SpinRoundsPerUs() {
+  static const int64_t rounds_per_us = [] {
+    constexpr int64_t kCalibrationRounds = 1 << 20;
+    int64_t best_ns = std::numeric_limits<int64_t>::max();
+    uint64_t x = 1;
+    for (int i = 0; i < 3; ++i) {
+      int64_t start_ns = ThreadCpuTimeNs();
+      x = Spin(x, kCalibrationRounds);
+      best_ns = std::min(best_ns, ThreadCpuTimeNs() - start_ns);
+    }
+    calibration_result = x;
+    return std::max<int64_t>(
+        1, kCalibrationRounds * 1000 / std::max<int64_t>(best_ns, 1));
+  }();
+  return rounds_per_us;
+}
+
+}  // namespace
+
+void ConsumeCpuTime::DoActivity() {
+  iteration_count_++;
+  int64_t target_ns = cpu_time_ns_;
+  if (sample_generator_) {
+    sample_generator_->GetRandomSample(absl::MakeSpan(sample_));
+    target_ns = std::max(sample_[sample_dimension_], 0);
+  }
+  requested_cpu_time_ns_ += target_ns;
+
+  const int64_t rounds_per_us = SpinRoundsPerUs();
+  const int64_t start_ns = ThreadCpuTimeNs();
+  const int64_t end_ns = start_ns + target_ns;
+  int64_t now_ns = start_ns;
+  uint64_t x = optimization_preventing_num_;
+  while (now_ns < end_ns) {
+    int64_t slice_ns = std::min(end_ns - now_ns, kMaxSpinSliceNs);
+    x = Spin(x, std::max<int64_t>(1, slice_ns * rounds_per_us / 1000));
+    now_ns = ThreadCpuTimeNs();
+  }
+  optimization_preventing_num_ = x | 1;
+  achieved_cpu_time_ns_ += now_ns - start_ns;
+}
+
+ActivityLog ConsumeCpuTime::GetActivityLog() {
+  ActivityLog alog;
+  if (iteration_count_) {
+    auto* am = alog.add_activity_metrics();
+    am->set_name("iteration_count");
+    am->set_value_int(iteration_count_);
+    am = alog.add_activity_metrics();
+    am->set_name("requested_cpu_time_ns");
+    am->set_value_int(requested_cpu_time_ns_);
+    am = alog.add_activity_metrics();
+    am->set_name("achieved_cpu_time_ns");
+    am->set_value_int(achieved_cpu_time_ns_);
+  }
+  return alog;
+}
+
+void ConsumeCpuTime::Initialize(ParsedActivityConfig* config) {
+  const auto& cpu_time_config = config->consume_cpu_time_config;
+  cpu_time_ns_ = cpu_time_config.cpu_time_ns;
+  sample_generator_ = cpu_time_config.sample_generator;
+  sample_dimension_ = cpu_time_config.sample_dimension;
+  if (sample_generator_) {
+    sample_.resize(sample_generator_->num_dimensions());
+  }
+  iteration_count_ = 0;
+  requested_cpu_time_ns_ = 0;
+  achieved_cpu_time_ns_ = 0;
+  // Calibrates before the first iteration rather than during it:
+  SpinRoundsPerUs();
+}
+
+absl::Status ConsumeCpuTime::ValidateConfig(ActivityConfig& ac) {
+  auto cpu_time_ns =
+      GetNamedSettingInt64(ac.activity_settings(), "cpu_time_ns", 50'000);
+  if (cpu_time_ns < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "CPU time (", cpu_time_ns, ") must be a non-negative integer."));
+  }
+  return absl::OkStatus();
+}
+
+// Activity: ConsumeMemoryBandwidth
+
+namespace {
+
+int64_t MonotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+}
+
+}  // namespace
+
+std::unique_ptr<StreamArrays> StreamArraysPool::Get(size_t elements) {
+  {
+    absl::MutexLock m(&mutex_);
+    if (!free_arrays_.empty()) {
+      std::unique_ptr<StreamArrays> arrays = std::move(free_arrays_.back());
+      free_arrays_.pop_back();
+      return arrays;
+    }
+  }
+  return std::make_unique<StreamArrays>(elements);
+}
+
+void StreamArraysPool::Release(std::unique_ptr<StreamArrays> arrays) {
+  absl::MutexLock m(&mutex_);
+  free_arrays_.push_back(std::move(arrays));
+}
+
+ConsumeMemoryBandwidth::~ConsumeMemoryBandwidth() {
+  if (arrays_) arrays_pool_->Release(std::move(arrays_));
+}
+
+void ConsumeMemoryBandwidth::DoActivity() {
+  iteration_count_++;
+  const int64_t start_ns = MonotonicNs();
+  double* a = arrays_->a.get();
+  double* b = arrays_->b.get();
+  double* c = arrays_->c.get();
+  if (!arrays_->touched) {
+    for (size_t i = 0; i < array_elements_; ++i) {
+      a[i] = 1.0;
+      b[i] = 2.0;
+      c[i] = 0.0;
+    }
+    arrays_->touched = true;
+  }
+  // STREAM counts a read and a write per element for copy, and two reads and
+  // a write for triad:
+  const int64_t bytes_per_element = (triad_ ? 3 : 2) * sizeof(double);
+  int64_t elements_left =
+      (bytes_per_iteration_ + bytes_per_element - 1) / bytes_per_element;
+  size_t position = arrays_->position;
+  while (elements_left > 0) {
+    size_t end = std::min<size_t>(array_elements_, position + elements_left);
+    if (triad_) {
+      const double scalar = 3.0;
+      for (size_t i = position; i < end; ++i) {
+        a[i] = b[i] + scalar * c[i];
+      }
+    } else {
+      for (size_t i = position; i < end; ++i) {
+        c[i] = a[i];
+      }
+    }
+    elements_left -= end - position;
+    bytes_moved_ += (end - position) * bytes_per_element;
+    position = end == array_elements_ ? 0 : end;
+  }
+  arrays_->position = position;
+  busy_ns_ += MonotonicNs() - start_ns;
+}
+
+ActivityLog ConsumeMemoryBandwidth::GetActivityLog() {
+  ActivityLog alog;
+  if (iteration_count_) {
+    auto* am = alog.add_activity_metrics();
+    am->set_name("iteration_count");
+    am->set_value_int(iteration_count_);
+    am = alog.add_activity_metrics();
+    am->set_name("bytes_moved");
+    am->set_value_int(bytes_moved_);
+    am = alog.add_activity_metrics();
+    am->set_name("busy_ns");
+    am->set_value_int(busy_ns_);
+  }
+  return alog;
+}
+
+void ConsumeMemoryBandwidth::Initialize(ParsedActivityConfig* config) {
+  const auto& bandwidth_config = config->consume_memory_bandwidth_config;
+  array_elements_ = bandwidth_config.array_size / sizeof(double);
+  triad_ = bandwidth_config.kernel == "triad";
+  bytes_per_iteration_ = bandwidth_config.bytes_per_iteration;
+  arrays_pool_ = bandwidth_config.arrays_pool;
+  arrays_ = arrays_pool_->Get(array_elements_);
+  iteration_count_ = 0;
+  bytes_moved_ = 0;
+  busy_ns_ = 0;
+}
+
+absl::Status ConsumeMemoryBandwidth::ValidateConfig(ActivityConfig& ac) {
+  auto array_size = GetNamedSettingInt64(ac.activity_settings(), "array_size",
+                                         64 * 1024 * 1024);
+  if (array_size < static_cast<int64_t>(sizeof(double))) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Array size (", array_size, ") must be at least ", sizeof(double),
+        " bytes."));
+  }
+  auto kernel =
+      GetNamedSettingString(ac.activity_settings(), "kernel", "triad");
+  if (kernel != "copy" && kernel != "triad") {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Kernel (", kernel, ") must be either copy or triad."));
+  }
+  auto bytes_per_iteration = GetNamedSettingInt64(
+      ac.activity_settings(), "bytes_per_iteration", 64 * 1024 * 1024);
+  if (bytes_per_iteration < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Bytes per iteration (", bytes_per_iteration,
+                     ") must be a positive integer."));
+  }
+  return absl::OkStatus();
+}
+
+// Activity: StorageIo
+
+namespace {
+
+// O_DIRECT needs buffers aligned to the logical block size of the device:
+constexpr size_t kDirectIoAlignment = 4096;
+
+}  // namespace
+
+StorageIoFile::StorageIoFile(const StorageIoConfig& config)
+    : directory_(config.directory),
+      file_size_(config.file_size),
+      queue_depth_(config.queue_depth),
+      block_size_(config.block_size) {}
+
+absl::StatusOr<std::shared_ptr<StorageIoFile>> StorageIoFile::Create(
+    const StorageIoConfig& config) {
+  if (access(config.directory.c_str(), W_OK | X_OK)) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("StorageIo could not create a file in ", config.directory,
+                     ": ", strerror(errno)));
+  }
+  return std::shared_ptr<StorageIoFile>(new StorageIoFile(config));
+}
+
+absl::Status StorageIoFile::Fill() {
+  std::vector<char> block(block_size_, 0xa5);
+
+  // The file is written once through the page cache, so that the reads hit
+  // allocated blocks, and unlinked right away so that it does not outlive
+  // the activities:
+  std::string path = absl::StrCat(directory_, "/distbench_storage_io_XXXXXX");
+  int fd = mkstemp(path.data());
+  if (fd < 0) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("StorageIo could not create a file in ", directory_,
+                     ": ", strerror(errno)));
+  }
+  for (int64_t i = 0; i < file_size_ / block_size_; ++i) {
+    if (pwrite(fd, block.data(), block_size_, i * block_size_) !=
+        block_size_) {
+      std::string error = strerror(errno);
+      close(fd);
+      unlink(path.c_str());
+      return absl::FailedPreconditionError(
+          absl::StrCat("StorageIo could not fill ", path, ": ", error));
+    }
+  }
+  fsync(fd);
+  fd_ = open(path.c_str(), O_RDWR | O_DIRECT);
+  if (fd_ < 0) {
+    LOG(WARNING) << "O_DIRECT is not supported in " << directory_
+                 << ", the StorageIo activity goes through the page cache";
+    fd_ = dup(fd);
+  }
+  close(fd);
+  unlink(path.c_str());
+  return absl::OkStatus();
+}
+
+StorageIoFile::~StorageIoFile() {
+  for (auto& queue : queues_) {
+    if (queue->aio_context) syscall(__NR_io_destroy, queue->aio_context);
+    free(queue->buffers);
+  }
+  if (fd_ >= 0) close(fd_);
+}
+
+StorageIoFile::Queue* StorageIoFile::GetQueue() {
+  absl::MutexLock m(&mutex_);
+  if (!filled_) {
+    filled_ = true;
+    absl::Status status = Fill();
+    if (!status.ok()) LOG(ERROR) << status;
+  }
+  if (fd_ < 0) return nullptr;
+  if (!free_queues_.empty()) {
+    Queue* queue = free_queues_.back();
+    free_queues_.pop_back();
+    return queue;
+  }
+  auto queue = std::make_unique<Queue>();
+  if (posix_memalign(reinterpret_cast<void**>(&queue->buffers),
+                     kDirectIoAlignment, queue_depth_ * block_size_)) {
+    LOG(ERROR) << "StorageIo could not allocate its buffers";
+    return nullptr;
+  }
+  memset(queue->buffers, 0xa5, queue_depth_ * block_size_);
+  if (syscall(__NR_io_setup, queue_depth_, &queue->aio_context)) {
+    LOG(WARNING) << "Linux AIO is not available (" << strerror(errno)
+                 << "), the StorageIo activity issues one op at a time";
+    queue->aio_context = 0;
+  }
+  queues_.push_back(std::move(queue));
+  return queues_.back().get();
+}
+
+void StorageIoFile::ReleaseQueue(Queue* queue) {
+  absl::MutexLock m(&mutex_);
+  free_queues_.push_back(queue);
+}
+
+StorageIo::~StorageIo() {
+  if (queue_) file_->ReleaseQueue(queue_);
+}
+
+void StorageIo::Initialize(ParsedActivityConfig* config) {
+  const auto& io_config = config->storage_io_config;
+  file_ = io_config.file;
+  queue_ = file_->GetQueue();
+  op_latencies_ = io_config.op_latencies;
+  block_size_ = io_config.block_size;
+  num_blocks_ = io_config.file_size / block_size_;
+  queue_depth_ = io_config.queue_depth;
+  ops_per_iteration_ = io_config.ops_per_iteration;
+  write_percent_ = io_config.write_percent;
+  std::random_device rd;
+  mersenne_twister_prng_ = std::mt19937(rd());
+  iteration_count_ = 0;
+}
+
+int64_t StorageIo::DoSyncOp(bool write, char* buffer, int64_t offset) {
+  int64_t start_ns = MonotonicNs();
+  ssize_t ret = write ? pwrite(file_->fd(), buffer, block_size_, offset)
+                      : pread(file_->fd(), buffer, block_size_, offset);
+  return ret == block_size_ ? MonotonicNs() - start_ns : -1;
+}
+
+void StorageIo::AccountOp(bool write, int64_t latency_ns) {
+  ++ops_;
+  if (latency_ns < 0) {
+    ++failed_ops_;
+    return;
+  }
+  (write ? bytes_written_ : bytes_read_) += block_size_;
+  total_op_latency_ns_ += latency_ns;
+  // The request carries the block of a write, the response that of a read;
+  // the timestamps are not reported:
+  op_latencies_->Record(latency_ns, write ? block_size_ : 0,
+                        write ? 0 : block_size_, /*start_timestamp_ns=*/0);
+}
+
+void StorageIo::DoActivity() {
+  iteration_count_++;
+  if (!queue_) {
+    ops_ += ops_per_iteration_;
+    failed_ops_ += ops_per_iteration_;
+    return;
+  }
+  std::uniform_int_distribution<int64_t> random_block(0, num_blocks_ - 1);
+  std::uniform_int_distribution<int> random_percent(0, 99);
+
+  if (!queue_->aio_context) {
+    for (int i = 0; i < ops_per_iteration_; ++i) {
+      bool write = random_percent(mersenne_twister_prng_) < write_percent_;
+      int64_t offset = random_block(mersenne_twister_prng_) * block_size_;
+      AccountOp(write, DoSyncOp(write, queue_->buffers, offset));
+    }
+    return;
+  }
+
+  std::vector<struct iocb> iocbs(queue_depth_);
+  std::vector<int64_t> start_ns(queue_depth_);
+  std::vector<int> free_slots(queue_depth_);
+  for (int i = 0; i < queue_depth_; ++i) free_slots[i] = i;
+  std::vector<struct iocb*> batch;
+  std::vector<struct io_event> events(queue_depth_);
+  int issued = 0;
+  int in_flight = 0;
+  while (issued < ops_per_iteration_ || in_flight) {
+    // Keeps the queue full:
+    batch.clear();
+    while (issued + static_cast<int>(batch.size()) < ops_per_iteration_ &&
+           !free_slots.empty()) {
+      int slot = free_slots.back();
+      free_slots.pop_back();
+      struct iocb& cb = iocbs[slot];
+      memset(&cb, 0, sizeof(cb));
+      cb.aio_data = slot;
+      cb.aio_fildes = file_->fd();
+      cb.aio_lio_opcode =
+          random_percent(mersenne_twister_prng_) < write_percent_
+              ? IOCB_CMD_PWRITE
+              : IOCB_CMD_PREAD;
+      cb.aio_buf =
+          reinterpret_cast<uint64_t>(queue_->buffers + slot * block_size_);
+      cb.aio_nbytes = block_size_;
+      cb.aio_offset = random_block(mersenne_twister_prng_) * block_size_;
+      batch.push_back(&cb);
+    }
+    if (!batch.empty()) {
+      int64_t now_ns = MonotonicNs();
+      for (struct iocb* cb : batch) start_ns[cb->aio_data] = now_ns;
+      long submitted = syscall(__NR_io_submit, queue_->aio_context,
+                               batch.size(), batch.data());
+      if (submitted < 0) submitted = 0;
+      // The ops that could not be queued count as failed:
+      for (size_t i = submitted; i < batch.size(); ++i) {
+        AccountOp(batch[i]->aio_lio_opcode == IOCB_CMD_PWRITE, -1);
+        free_slots.push_back(batch[i]->aio_data);
+      }
+      issued += batch.size();
+      in_flight += submitted;
+    }
+    if (!in_flight) continue;
+    long completed = syscall(__NR_io_getevents, queue_->aio_context, 1,
+                             queue_depth_, events.data(), nullptr);
+    if (completed < 0) {
+      if (errno == EINTR) continue;
+      LOG(ERROR) << "io_getevents failed: " << strerror(errno);
+      // The ops in flight may still write to the buffers, so the queue is
+      // given up on rather than released:
+      ops_ += in_flight;
+      failed_ops_ += in_flight;
+      queue_ = nullptr;
+      return;
+    }
+    int64_t now_ns = MonotonicNs();
+    for (long i = 0; i < completed; ++i) {
+      int slot = events[i].data;
+      AccountOp(iocbs[slot].aio_lio_opcode == IOCB_CMD_PWRITE,
+                events[i].res == block_size_ ? now_ns - start_ns[slot] : -1);
+      free_slots.push_back(slot);
+    }
+    in_flight -= completed;
+  }
+}
+
+ActivityLog StorageIo::GetActivityLog() {
+  ActivityLog alog;
+  if (iteration_count_) {
+    auto add_metric = [&alog](std::string name, int64_t value) {
+      auto* am = alog.add_activity_metrics();
+      am->set_name(name);
+      am->set_value_int(value);
+    };
+    add_metric("iteration_count", iteration_count_);
+    add_metric("ops", ops_);
+    add_metric("failed_ops", failed_ops_);
+    add_metric("bytes_read", bytes_read_);
+    add_metric("bytes_written", bytes_written_);
+    add_metric("total_op_latency_ns", total_op_latency_ns_);
+  }
+  return alog;
+}
+
+void StorageIo::AddOpLatencyPercentiles(const StorageIoConfig& config,
+                                        ActivityLog* log) {
+  const AtomicLatencyHistogram& op_latencies = *config.op_latencies;
+  if (!op_latencies.Count()) return;
+  auto add_metric = [log](std::string name, int64_t value) {
+    auto* am = log->add_activity_metrics();
+    am->set_name(name);
+    am->set_value_int(value);
+  };
+  add_metric("op_latency_p50_ns", op_latencies.ValueAtFraction(0.5));
+  add_metric("op_latency_p90_ns", op_latencies.ValueAtFraction(0.9));
+  add_metric("op_latency_p99_ns", op_latencies.ValueAtFraction(0.99));
+  add_metric("op_latency_p999_ns", op_latencies.ValueAtFraction(0.999));
+  add_metric("op_latency_max_ns", op_latencies.MaxLatency());
+}
+
+absl::Status StorageIo::ValidateConfig(ActivityConfig& ac) {
+  auto block_size =
+      GetNamedSettingInt64(ac.activity_settings(), "block_size", 4096);
+  if (block_size < 512 || block_size % 512) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Block size (", block_size, ") must be a multiple of 512."));
+  }
+  auto file_size = GetNamedSettingInt64(ac.activity_settings(), "file_size",
+                                        64 * 1024 * 1024);
+  if (file_size < block_size) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("File size (", file_size,
+                     ") must be at least the block size (", block_size, ")."));
+  }
+  auto queue_depth =
+      GetNamedSettingInt64(ac.activity_settings(), "queue_depth", 8);
+  if (queue_depth < 1 || queue_depth > 1024) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Queue depth (", queue_depth, ") must be between 1 and 1024."));
+  }
+  auto ops_per_iteration =
+      GetNamedSettingInt64(ac.activity_settings(), "ops_per_iteration", 64);
+  if (ops_per_iteration < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Ops per iteration (", ops_per_iteration,
+                     ") must be a positive integer."));
+  }
+  auto write_percent =
+      GetNamedSettingInt64(ac.activity_settings(), "write_percent", 0);
+  if (write_percent < 0 || write_percent > 100) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Write percent (", write_percent, ") must be between 0 and 100."));
+  }
+  return absl::OkStatus();
+}
+
 // Activity: PolluteDataCache
 
 absl::Status PolluteDataCache::ValidateConfig(ActivityConfig& ac) {
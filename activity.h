@@ -14,16 +14,22 @@
 #ifndef DISTBENCH_ACTIVITY_H_
 #define DISTBENCH_ACTIVITY_H_
 
+#include <memory>
 #include <random>
+#include <string>
+#include <vector>
 
 #include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
 #include "activity.h"
 #include "distbench.pb.h"
+#include "distbench_histogram.h"
 #include "distbench_utils.h"
 #include "traffic_config.pb.h"
 
 namespace distbench {
 
+class DistributionSampleGenerator;
 struct ParsedActivityConfig;
 
 // Base class for activities that run along with RPCs in distbench.
@@ -70,6 +76,195 @@ struct ConsumeCpuConfig {
   int array_size;
 };
 
+// Activity: ConsumeCpuTime
+
+// Burns a given amount of CPU time per iteration, fixed or drawn from a
+// distribution, with a spin loop that neither locks nor touches memory. The
+// thread CPU time is the stopping condition, so the iterations take the same
+// amount of CPU on any machine; the spin loop is calibrated once per process
+// to check the clock about every 10us.
+class ConsumeCpuTime : public Activity {
+ public:
+  void DoActivity() override;
+  ActivityLog GetActivityLog() override;
+  void Initialize(ParsedActivityConfig* config) override;
+  static absl::Status ValidateConfig(ActivityConfig& ac);
+
+ private:
+  int64_t cpu_time_ns_ = 0;
+  const DistributionSampleGenerator* sample_generator_ = nullptr;
+  int sample_dimension_ = 0;
+  std::vector<int> sample_;
+  int iteration_count_ = 0;
+  int64_t requested_cpu_time_ns_ = 0;
+  int64_t achieved_cpu_time_ns_ = 0;
+  uint64_t optimization_preventing_num_ = 1;
+};
+
+struct ConsumeCpuTimeConfig {
+  int64_t cpu_time_ns;
+  // If set, the CPU time of each iteration is drawn from this dimension of
+  // its samples instead:
+  const DistributionSampleGenerator* sample_generator = nullptr;
+  int sample_dimension = 0;
+};
+
+// Activity: ConsumeMemoryBandwidth
+
+// The arrays streamed through by ConsumeMemoryBandwidth. They are allocated
+// uninitialized and first touched by the thread that streams through them,
+// so that they live on its NUMA node.
+struct StreamArrays {
+  explicit StreamArrays(size_t elements)
+      : a(new double[elements]),
+        b(new double[elements]),
+        c(new double[elements]) {}
+
+  std::unique_ptr<double[]> a;
+  std::unique_ptr<double[]> b;
+  std::unique_ptr<double[]> c;
+  bool touched = false;
+  // Where the next iteration resumes streaming:
+  size_t position = 0;
+};
+
+// The arrays of the activities of one config, recycled from one activity to
+// the next so that e.g. an RPC handler does not allocate them for each RPC,
+// while concurrent activities still get arrays of their own.
+class StreamArraysPool {
+ public:
+  std::unique_ptr<StreamArrays> Get(size_t elements);
+  void Release(std::unique_ptr<StreamArrays> arrays);
+
+ private:
+  absl::Mutex mutex_;
+  std::vector<std::unique_ptr<StreamArrays>> free_arrays_
+      ABSL_GUARDED_BY(mutex_);
+};
+
+struct ConsumeMemoryBandwidthConfig {
+  int64_t array_size;
+  std::string kernel;
+  int64_t bytes_per_iteration;
+  std::shared_ptr<StreamArraysPool> arrays_pool;
+};
+
+// Streams through arrays of doubles with the copy (c = a) or triad
+// (a = b + s * c) kernel of STREAM until bytes_per_iteration bytes were
+// moved, counted the way STREAM does.
+class ConsumeMemoryBandwidth : public Activity {
+ public:
+  ~ConsumeMemoryBandwidth() override;
+  void DoActivity() override;
+  ActivityLog GetActivityLog() override;
+  void Initialize(ParsedActivityConfig* config) override;
+  static absl::Status ValidateConfig(ActivityConfig& ac);
+
+ private:
+  size_t array_elements_ = 0;
+  bool triad_ = true;
+  int64_t bytes_per_iteration_ = 0;
+  std::shared_ptr<StreamArraysPool> arrays_pool_;
+  std::unique_ptr<StreamArrays> arrays_;
+  int iteration_count_ = 0;
+  int64_t bytes_moved_ = 0;
+  int64_t busy_ns_ = 0;
+};
+
+// Activity: StorageIo
+
+struct StorageIoConfig;
+
+// The preallocated file of a StorageIo config, shared by its activities, and
+// the AIO queues that they take turns using, so that an RPC handler neither
+// creates a file nor sets up a queue for each RPC. The file is only written
+// when the first activity gets a queue, so that the engines that never run
+// the activity do not write it.
+class StorageIoFile {
+ public:
+  struct Queue {
+    uint64_t aio_context = 0;  // 0 if Linux AIO is not available.
+    // One block aligned buffer per slot of the queue:
+    char* buffers = nullptr;
+  };
+
+  // Checks that the file can be created in the directory of config.
+  static absl::StatusOr<std::shared_ptr<StorageIoFile>> Create(
+      const StorageIoConfig& config);
+  ~StorageIoFile();
+
+  int fd() const { return fd_; }
+  // Returns nullptr if the file or the queue could not be set up.
+  Queue* GetQueue();
+  void ReleaseQueue(Queue* queue);
+
+ private:
+  explicit StorageIoFile(const StorageIoConfig& config);
+  // Creates, fills and unlinks the file. It is opened with O_DIRECT unless
+  // the file system does not support it.
+  absl::Status Fill() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  int fd_ = -1;
+  const std::string directory_;
+  const int64_t file_size_;
+  const int queue_depth_;
+  const int64_t block_size_;
+  absl::Mutex mutex_;
+  bool filled_ ABSL_GUARDED_BY(mutex_) = false;
+  std::vector<std::unique_ptr<Queue>> queues_ ABSL_GUARDED_BY(mutex_);
+  std::vector<Queue*> free_queues_ ABSL_GUARDED_BY(mutex_);
+};
+
+struct StorageIoConfig {
+  std::string directory;
+  int64_t file_size;
+  int64_t block_size;
+  int64_t queue_depth;
+  int64_t ops_per_iteration;
+  int64_t write_percent;
+  std::shared_ptr<StorageIoFile> file;
+  // The latencies of the successful ops of all the activities of the config:
+  std::shared_ptr<AtomicLatencyHistogram> op_latencies;
+};
+
+// Issues ops_per_iteration random, block aligned, reads and writes to the
+// file of its config, with up to queue_depth of them in flight through Linux
+// native AIO, and accounts for their bytes and latencies.
+class StorageIo : public Activity {
+ public:
+  ~StorageIo() override;
+  void DoActivity() override;
+  ActivityLog GetActivityLog() override;
+  void Initialize(ParsedActivityConfig* config) override;
+  static absl::Status ValidateConfig(ActivityConfig& ac);
+  // Adds the percentiles of the op latencies of all the activities of the
+  // config to log; unlike the other metrics, they can not be summed up
+  // across the activities.
+  static void AddOpLatencyPercentiles(const StorageIoConfig& config,
+                                      ActivityLog* log);
+
+ private:
+  // Returns the latency of a blocking read or write, or -1 on error.
+  int64_t DoSyncOp(bool write, char* buffer, int64_t offset);
+  void AccountOp(bool write, int64_t latency_ns);
+
+  std::shared_ptr<StorageIoFile> file_;
+  StorageIoFile::Queue* queue_ = nullptr;
+  std::shared_ptr<AtomicLatencyHistogram> op_latencies_;
+  int64_t block_size_ = 0;
+  int64_t num_blocks_ = 0;
+  int queue_depth_ = 0;
+  int ops_per_iteration_ = 0;
+  int write_percent_ = 0;
+  std::mt19937 mersenne_twister_prng_;
+  int iteration_count_ = 0;
+  int64_t ops_ = 0;
+  int64_t failed_ops_ = 0;
+  int64_t bytes_read_ = 0;
+  int64_t bytes_written_ = 0;
+  int64_t total_op_latency_ns_ = 0;
+};
+
 // Activity: PolluteDataCache
 
 class PolluteDataCache : public Activity {
@@ -118,10 +313,17 @@ struct PolluteInstructionCacheConfig {
 
 struct ParsedActivityConfig {
   struct ConsumeCpuConfig consume_cpu_config;
+  struct ConsumeCpuTimeConfig consume_cpu_time_config;
+  struct ConsumeMemoryBandwidthConfig consume_memory_bandwidth_config;
+  struct StorageIoConfig storage_io_config;
   struct PolluteDataCacheConfig pollute_data_cache_config;
   struct PolluteInstructionCacheConfig pollute_instruction_cache_config;
   std::string activity_config_name;
   std::string activity_func;
+  // False when the "instances" setting, a comma separated list of the
+  // instances of the service that run the activity, leaves this one out; its
+  // iterations then do nothing, e.g. to make a single server slow.
+  bool runs_on_this_instance = true;
 };
 
 }  // namespace distbench
@@ -100,6 +100,10 @@ void ComposableRpcCounter::ChurnConnection(int peer) {
   pd_instance_->ChurnConnection(peer);
 }
 
+bool ComposableRpcCounter::SupportsConnectionChurn() {
+  return pd_instance_->SupportsConnectionChurn();
+}
+
 void ComposableRpcCounter::ShutdownClient() { pd_instance_->ShutdownClient(); }
 
 void ComposableRpcCounter::ShutdownServer() { pd_instance_->ShutdownServer(); }
@@ -44,6 +44,7 @@ class ComposableRpcCounter : public ProtocolDriver {
   void InitiateRpc(int peer_index, ClientRpcState* state,
                    std::function<void(void)> done_callback) override;
   void ChurnConnection(int peer) override;
+  bool SupportsConnectionChurn() override;
   void ShutdownServer() override;
   void ShutdownClient() override;
 
@@ -19,6 +19,8 @@
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "distbench_node_manager.h"
+#include "distbench_result_stream.h"
+#include "distbench_summary.h"
 #include "distbench_test_sequencer.h"
 #include "distbench_utils.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
@@ -30,12 +32,20 @@ bool CheckRemainingArguments(std::vector<char*> remaining_arguments,
 int MainRunTests(std::vector<char*>& arguments);
 int MainTestSequencer(std::vector<char*>& arguments);
 int MainNodeManager(std::vector<char*>& arguments);
+int MainSummarize(std::vector<char*>& arguments);
 void Usage();
 }  // anonymous namespace
 
 ABSL_FLAG(int, port, 10'000, "port to listen on");
 ABSL_FLAG(std::string, test_sequencer, "", "host:port of test sequencer");
 ABSL_FLAG(bool, binary_output, false, "Save protobufs in binary mode");
+ABSL_FLAG(bool, stream_output, false,
+          "Save the result of each test as soon as it is done, as binary "
+          "records");
+ABSL_FLAG(bool, columnar_output, false,
+          "Save the RPC samples as RpcSampleColumns blocks");
+ABSL_FLAG(std::string, output_compression, "none",
+          "Compression of the --stream_output results (none|zstd)");
 ABSL_FLAG(std::string, infile, "/dev/stdin", "Input file");
 ABSL_FLAG(std::string, outfile, "/dev/stdout", "Output file");
 ABSL_FLAG(int, local_nodes, 0,
@@ -45,6 +55,15 @@ ABSL_FLAG(std::string, control_plane_device, "",
           "netdev to bind to when listening for incoming control connections.");
 ABSL_FLAG(std::string, default_data_plane_device, "",
           "Default netdevice to use for the data plane (protocol driver)");
+ABSL_FLAG(std::string, thread_placement, "",
+          "Placement rules of the node manager threads, by thread name, e.g. "
+          "\"GrpcClientCq=pin:2-5;ThreadPool=nic;*=numa1\"");
+ABSL_FLAG(std::string, reserved_cpus, "",
+          "CPUs left to the thread_placement rules that list them, e.g. "
+          "\"2-5\"");
+ABSL_FLAG(std::string, node_attributes, "",
+          "Attributes of the node, e.g. \"rack=r1,zone=z2\", that the test "
+          "sequence can keep concurrent tests apart by");
 ABSL_FLAG(absl::Duration, max_test_duration, absl::Hours(0),
           "Maximum time to wait for each test - will default to 1 hour if "
           "not specified by this flag or the test's test_timeout attribute");
@@ -69,6 +88,8 @@ int main(int argc, char** argv, char** envp) {
     return MainNodeManager(remaining_arguments);
   } else if (!strcmp(distbench_module, "run_tests")) {
     return MainRunTests(remaining_arguments);
+  } else if (!strcmp(distbench_module, "summarize")) {
+    return MainSummarize(remaining_arguments);
   } else if (!strcmp(distbench_module, "help")) {
     Usage();
     return 0;
@@ -140,6 +161,68 @@ void SetAllTestTimeoutAttributesTo(distbench::TestSequence* test_sequence,
   }
 }
 
+void PrintRunTestSequenceError(const grpc::Status& status) {
+  std::cerr << "The RunTestSequence RPC Failed with status: " << status
+            << "\n";
+  if (status.error_message() == "failed to connect to all addresses") {
+    std::cerr << "There may be a problem with the test sequencer running on '"
+              << absl::GetFlag(FLAGS_test_sequencer)
+              << "' the specified host or port may be wrong, or the host it "
+              << "is running on may not be reachable from here.\n";
+  }
+}
+
+void PrintTestResultSummary(const distbench::TestResult& test_result) {
+  std::cout << "Test summary:\n";
+  for (const auto& log_summary : test_result.log_summary()) {
+    std::cout << log_summary << "\n";
+  }
+  std::cout << "\n";
+}
+
+// Saves the results as they come, so that neither the whole sequence's
+// results have to fit in memory, nor are they lost if the test sequencer
+// goes away before the end.
+int StreamTestResults(distbench::DistBenchTestSequencer::Stub* stub,
+                      grpc::ClientContext* context,
+                      const distbench::TestSequence& test_sequence) {
+  const std::string result_filename = absl::GetFlag(FLAGS_outfile);
+  std::unique_ptr<distbench::TestResultStreamWriter> writer;
+  if (!result_filename.empty()) {
+    auto maybe_writer = distbench::TestResultStreamWriter::Open(
+        result_filename, absl::GetFlag(FLAGS_output_compression));
+    if (!maybe_writer.ok()) {
+      std::cerr << "Unable to save the results: " << maybe_writer.status()
+                << "\n";
+      return 1;
+    }
+    writer = std::move(maybe_writer.value());
+  }
+
+  auto reader = stub->RunTestSequenceStream(context, test_sequence);
+  distbench::TestResult test_result;
+  absl::Status save_status;
+  while (reader->Read(&test_result)) {
+    PrintTestResultSummary(test_result);
+    if (!writer || !save_status.ok()) continue;
+    if (absl::GetFlag(FLAGS_columnar_output)) {
+      distbench::ConvertTestResultToColumns(&test_result);
+    }
+    save_status = writer->Write(test_result);
+  }
+  grpc::Status status = reader->Finish();
+  if (writer && save_status.ok()) save_status = writer->Close();
+  if (!status.ok()) {
+    PrintRunTestSequenceError(status);
+    return 1;
+  }
+  if (!save_status.ok()) {
+    std::cerr << "Unable to save the results: " << save_status << "\n";
+    return 1;
+  }
+  return 0;
+}
+
 int MainRunTests(std::vector<char*>& arguments) {
   if (!CheckRemainingArguments(arguments, 0, 0)) return 1;
 
@@ -184,27 +267,26 @@ int MainRunTests(std::vector<char*>& arguments) {
 
   grpc::ClientContext context;
   distbench::SetGrpcClientContextDeadline(&context, *maybe_timeout_seconds);
+  if (absl::GetFlag(FLAGS_stream_output)) {
+    return StreamTestResults(stub.get(), &context, *test_sequence);
+  }
+  if (absl::GetFlag(FLAGS_output_compression) != "none") {
+    std::cerr << "--output_compression requires --stream_output\n";
+    return 1;
+  }
   distbench::TestSequenceResults test_results;
   grpc::Status status =
       stub->RunTestSequence(&context, *test_sequence, &test_results);
   if (!status.ok()) {
-    std::cerr << "The RunTestSequence RPC Failed with status: " << status
-              << "\n";
-    if (status.error_message() == "failed to connect to all addresses") {
-      std::cerr << "There may be a problem with the test sequencer running on '"
-                << absl::GetFlag(FLAGS_test_sequencer)
-                << "' the specified host or port may be wrong, or the host it "
-                << "is running on may not be reachable from here.\n";
-    }
+    PrintRunTestSequenceError(status);
     return 1;
   }
 
-  for (const auto& test_result : test_results.test_results()) {
-    std::cout << "Test summary:\n";
-    for (const auto& log_summary : test_result.log_summary()) {
-      std::cout << log_summary << "\n";
+  for (auto& test_result : *test_results.mutable_test_results()) {
+    PrintTestResultSummary(test_result);
+    if (absl::GetFlag(FLAGS_columnar_output)) {
+      distbench::ConvertTestResultToColumns(&test_result);
     }
-    std::cout << "\n";
   }
 
   const std::string result_filename = absl::GetFlag(FLAGS_outfile);
@@ -244,6 +326,9 @@ int MainTestSequencer(std::vector<char*>& arguments) {
         .default_data_plane_device =
             absl::GetFlag(FLAGS_default_data_plane_device),
         .control_plane_device = absl::GetFlag(FLAGS_control_plane_device),
+        .thread_placement = absl::GetFlag(FLAGS_thread_placement),
+        .reserved_cpus = absl::GetFlag(FLAGS_reserved_cpus),
+        .node_attributes = absl::GetFlag(FLAGS_node_attributes),
         .port = &new_port,
     };
     nodes.push_back(std::make_unique<distbench::NodeManager>());
@@ -285,6 +370,9 @@ int MainNodeManager(std::vector<char*>& arguments) {
       .default_data_plane_device =
           absl::GetFlag(FLAGS_default_data_plane_device),
       .control_plane_device = absl::GetFlag(FLAGS_control_plane_device),
+      .thread_placement = absl::GetFlag(FLAGS_thread_placement),
+      .reserved_cpus = absl::GetFlag(FLAGS_reserved_cpus),
+      .node_attributes = absl::GetFlag(FLAGS_node_attributes),
       .port = &port,
   };
   distbench::NodeManager node_manager;
@@ -297,6 +385,51 @@ int MainNodeManager(std::vector<char*>& arguments) {
   return !status.ok();
 }
 
+void PrintTestResultFullSummary(const distbench::TestResult& test_result) {
+  std::cout << "Test summary:\n";
+  for (const auto& log_summary : distbench::SummarizeTestResult(test_result)) {
+    std::cout << log_summary << "\n";
+  }
+  std::cout << "\n";
+}
+
+int MainSummarize(std::vector<char*>& arguments) {
+  if (!CheckRemainingArguments(arguments, 0, 0)) return 1;
+  const std::string infile = absl::GetFlag(FLAGS_infile);
+  // Binary results, streamed or not, are read one test at a time:
+  auto reader = distbench::TestResultStreamReader::Open(infile);
+  if (!reader.ok()) {
+    std::cerr << "Unable to read the results: " << reader.status() << "\n";
+    return 1;
+  }
+  distbench::TestResult test_result;
+  int test_count = 0;
+  while ((*reader)->Next(&test_result)) {
+    PrintTestResultFullSummary(test_result);
+    ++test_count;
+  }
+  if ((*reader)->status().ok()) return 0;
+  if (test_count) {
+    // E.g. the stream of a sequence that did not finish:
+    std::cerr << "Unable to read the rest of the results: "
+              << (*reader)->status() << "\n";
+    return 1;
+  }
+  reader->reset();
+
+  // Otherwise, this must be a text proto:
+  auto test_results = distbench::ParseTestSequenceResultsFromFile(infile);
+  if (!test_results.ok()) {
+    std::cerr << "Unable to read the results: " << test_results.status()
+              << "\n";
+    return 1;
+  }
+  for (const auto& test_result : test_results->test_results()) {
+    PrintTestResultFullSummary(test_result);
+  }
+  return 0;
+}
+
 void Usage() {
   std::cerr << "Usage: distbench module [options]\n";
   std::cerr << "\n";
@@ -318,8 +451,15 @@ void Usage() {
                "--test_sequencer=host:port "
                "[--infile test_sequence.proto_text] "
                "[--outfile result.proto_text] "
-               "[--binary_output]"
+               "[--binary_output] "
+               "[--stream_output [--output_compression=none|zstd]] "
+               "[--columnar_output]"
+               "\n";
+  std::cerr << "\n";
+  std::cerr << "  distbench summarize "
+               "[--infile result.proto]"
                "\n";
+  std::cerr << "      Prints the summary of previously saved results.\n";
   std::cerr << "\n";
   std::cerr << "  distbench help\n";
   std::cerr << "\n";
@@ -14,10 +14,16 @@
 
 #include "distbench_engine.h"
 
+#include <cmath>
+#include <random>
+
+#include "absl/base/internal/sysinfo.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/match.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_split.h"
+#include "absl/synchronization/notification.h"
+#include "distbench_sample_columns.h"
 #include "distbench_utils.h"
 #include "glog/logging.h"
 
@@ -27,8 +33,197 @@ namespace {
 enum kFieldNames {
   kRequestPayloadSize = 0,
   kResponsePayloadSize = 1,
-  kMaxFieldNames = 2,
+  kCpuTimeNs = 2,
+  kMaxFieldNames = 3,
 };
+
+// Sample chunks start small, since many action lists only issue a few RPCs,
+// and grow geometrically up to this size:
+constexpr size_t kMinSampleChunkSize = 16;
+constexpr size_t kMaxSampleChunkSize = 4096;
+// The size of the per-thread chunk caches that triggers their first sweep:
+constexpr size_t kMinThreadSampleChunksSweepSize = 16;
+
+// Marks the reservoir slots that have not been written yet.
+constexpr size_t kEmptySampleSlot = std::numeric_limits<size_t>::max();
+
+// Seeding a BitGen is expensive, so each completion thread keeps its own:
+thread_local absl::BitGen reservoir_bitgen;
+// Likewise for the ids of the compact traces:
+thread_local absl::BitGen trace_bitgen;
+
+bool HasTrace(const TraceContext& trace_context) {
+  return !trace_context.engine_ids().empty() || trace_context.has_span_id();
+}
+
+// Span ids are never 0, which stands for "no parent":
+uint64_t NewSpanId() {
+  return absl::Uniform(absl::IntervalClosedClosed, trace_bitgen, uint64_t{1},
+                       std::numeric_limits<uint64_t>::max());
+}
+
+// The payload contents are generated from a fixed seed, so that every engine
+// sends the same bytes, and so does every run of a test.
+constexpr uint64_t kPayloadContentSeed = 0x5eed'd157'bec4;
+
+// Each block of compressible content starts with random bytes and ends with
+// zeros, in proportions that give the requested compression ratio.
+constexpr int64_t kCompressibleBlockSize = 256;
+
+absl::Status ValidatePayloadContent(const PayloadSpec& spec) {
+  const std::string& content = spec.content();
+  if (content == "compressible") {
+    if (!(spec.compression_ratio() >= 1.0)) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("compression_ratio of payload ", spec.name(),
+                       " must be at least 1, not ", spec.compression_ratio()));
+    }
+  } else if (content != "repeated" && content != "zeros" &&
+             content != "random" && content != "text") {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "content of payload ", spec.name(),
+        " must be repeated, zeros, random, text or compressible, not ",
+        content));
+  }
+  return absl::OkStatus();
+}
+
+std::string PayloadContentKey(const PayloadSpec& spec) {
+  if (spec.content() == "compressible") {
+    return absl::StrCat("compressible:", spec.compression_ratio());
+  }
+  return spec.content();
+}
+
+std::string MakePayloadContent(const PayloadSpec& spec, int64_t size) {
+  const std::string& content = spec.content();
+  if (content == "repeated") return std::string(size, 'D');
+  if (content == "zeros") return std::string(size, '\0');
+  std::mt19937_64 rng(kPayloadContentSeed);
+  std::string payload;
+  payload.reserve(size);
+  if (content == "text") {
+    static const char* const kWords[] = {
+        "the",     "of",      "and",    "to",       "in",      "a",
+        "is",      "that",    "for",    "it",       "as",      "was",
+        "with",    "be",      "by",     "on",       "not",     "he",
+        "this",    "are",     "or",     "his",      "from",    "at",
+        "which",   "but",     "have",   "an",       "had",     "they",
+        "you",     "were",    "their",  "one",      "all",     "we",
+        "can",     "her",     "has",    "there",    "been",    "if",
+        "more",    "when",    "will",   "would",    "who",     "so",
+        "request", "server",  "client", "latency",  "network", "payload",
+        "service", "channel", "thread", "response", "message", "buffer",
+        "kernel",  "memory",  "queue",  "benchmark"};
+    constexpr int kNumWords = sizeof(kWords) / sizeof(kWords[0]);
+    int words_on_line = 0;
+    while (static_cast<int64_t>(payload.size()) < size) {
+      // Favor the first, shorter words, as a natural language does:
+      int word = std::min(rng() % kNumWords, rng() % kNumWords);
+      payload.append(kWords[word]);
+      payload.push_back(++words_on_line % 12 ? ' ' : '\n');
+    }
+    payload.resize(size);
+    return payload;
+  }
+  int64_t random_bytes = kCompressibleBlockSize;
+  if (content == "compressible") {
+    random_bytes = std::lround(kCompressibleBlockSize /
+                               spec.compression_ratio());
+  }
+  while (static_cast<int64_t>(payload.size()) < size) {
+    for (int64_t i = 0; i < random_bytes; i += sizeof(uint64_t)) {
+      uint64_t bits = rng();
+      payload.append(reinterpret_cast<const char*>(&bits),
+                     std::min<int64_t>(sizeof(bits), random_bytes - i));
+    }
+    payload.append(kCompressibleBlockSize - random_bytes, '\0');
+  }
+  payload.resize(size);
+  return payload;
+}
+
+// Test-and-test-and-set spinlock, since slot collisions are rare and short.
+void LockSampleSlot(std::atomic<bool>& lock) {
+  int spins = 0;
+  while (lock.exchange(true, std::memory_order_acquire)) {
+    while (lock.load(std::memory_order_relaxed)) {
+      if (++spins > 64) sched_yield();
+    }
+  }
+}
+
+void UnlockSampleSlot(std::atomic<bool>& lock) {
+  lock.store(false, std::memory_order_release);
+}
+
+// Owner ids start at 1, so that 0 never matches a live action list.
+std::atomic<uint64_t> next_sample_chunks_owner_id = 1;
+
+// The time the latency of an RPC is measured from: when it was due for the
+// open loop RPCs, which corrects for coordinated omission, and when it was
+// sent otherwise.
+absl::Time MeasuredStartTime(const ClientRpcState& state) {
+  return state.due_time != absl::InfinitePast() ? state.due_time
+                                                : state.start_time;
+}
+
+void RecordRpcInHistogram(AtomicLatencyHistogram* histogram,
+                          const ClientRpcState& state) {
+  if (!state.success) {
+    histogram->RecordFailure();
+  } else if (state.request.warmup()) {
+    histogram->RecordWarmup();
+  } else {
+    const absl::Time start_time = MeasuredStartTime(state);
+    histogram->Record(absl::ToInt64Nanoseconds(state.end_time - start_time),
+                      state.request.payload().size(),
+                      state.response.payload().size(),
+                      absl::ToUnixNanos(start_time));
+  }
+}
+
+// Moves the elements of from to the end of to, without copying them.
+template <typename T>
+void MoveAppend(google::protobuf::RepeatedPtrField<T>* from,
+                google::protobuf::RepeatedPtrField<T>* to) {
+  if (from->empty()) return;
+  if (to->empty()) {
+    to->Swap(from);
+    return;
+  }
+  std::vector<T*> elements(from->size());
+  from->ExtractSubrange(0, from->size(), elements.data());
+  to->Reserve(to->size() + elements.size());
+  for (T* element : elements) {
+    to->AddAllocated(element);
+  }
+}
+
+// Splices the partial logs of a peer into peer_log, freeing each of them
+// as it goes so that the samples are never held twice.
+void SplicePartialLogs(std::list<PeerPerformanceLog>* partial_logs,
+                       PeerPerformanceLog* peer_log) {
+  for (; !partial_logs->empty(); partial_logs->pop_front()) {
+    for (auto& [rpc_index, rpc_log] :
+         *partial_logs->front().mutable_rpc_logs()) {
+      if (rpc_log.successful_rpc_samples().empty() &&
+          rpc_log.failed_rpc_samples().empty() &&
+          rpc_log.sample_columns().empty())
+        continue;
+      auto& output_rpc_log = (*peer_log->mutable_rpc_logs())[rpc_index];
+      MoveAppend(rpc_log.mutable_successful_rpc_samples(),
+                 output_rpc_log.mutable_successful_rpc_samples());
+      MoveAppend(rpc_log.mutable_failed_rpc_samples(),
+                 output_rpc_log.mutable_failed_rpc_samples());
+      MoveAppend(rpc_log.mutable_sample_columns(),
+                 output_rpc_log.mutable_sample_columns());
+      // Only the small fields are left to merge:
+      output_rpc_log.MergeFrom(rpc_log);
+    }
+  }
+}
+
 }  // anonymous namespace
 
 grpc::Status DistBenchEngine::SetupConnection(grpc::ServerContext* context,
@@ -56,11 +251,25 @@ DistBenchEngine::~DistBenchEngine() {
   }
   if (pd_) {
     pd_->ShutdownServer();
-    while (detached_actionlist_threads_) {
-      sched_yield();
+    WaitForRunningActionLists();
+    if (open_loop_timer_thread_.joinable()) {
+      {
+        absl::MutexLock m(&open_loop_timer_mu_);
+        open_loop_timers_shutdown_ = true;
+        open_loop_timers_changed_ = true;
+      }
+      open_loop_timer_thread_.join();
     }
+    ShutdownConnectionChurn();
+    ShutdownRpcBatchers();
     pd_->ShutdownClient();
   }
+  // No action list is left to queue activity iterations:
+  std::unique_ptr<AbstractThreadpool> activity_threadpool;
+  {
+    absl::MutexLock m(&activity_threadpool_mu_);
+    activity_threadpool = std::move(activity_threadpool_);
+  }
 }
 
 // Initialize the payload map and perform basic validation
@@ -74,6 +283,8 @@ absl::Status DistBenchEngine::InitializePayloadsMap() {
       return absl::InvalidArgumentError(
           "Double definition of payload_descriptions: " + payload_spec_name);
     }
+    absl::Status status = ValidatePayloadContent(payload_spec);
+    if (!status.ok()) return status;
 
     payload_map_[payload_spec_name] = payload_spec;
   }
@@ -102,6 +313,26 @@ absl::Status DistBenchEngine::InitializeRpcFanoutFilter(
   const std::string all_keyword = "all";
   const std::string random_keyword = "random";
   const std::string round_robin_keyword = "round_robin";
+  const std::string least_pending_keyword = "least_pending";
+  const std::string p2c_keyword = "p2c";
+  const std::string weighted_keyword = "weighted";
+
+  for (const auto& service : traffic_config_.services()) {
+    if (service.name() == rpc_spec.server()) {
+      rpc_def.num_servers = service.count();
+    }
+  }
+  rpc_def.all_targets.reserve(rpc_def.num_servers);
+  for (int i = 0; i < rpc_def.num_servers; ++i) {
+    if (rpc_spec.server() != service_name_ || i != service_instance_) {
+      rpc_def.all_targets.push_back(i);
+    }
+  }
+
+  if (absl::StartsWith(fanout_filter, weighted_keyword)) {
+    return InitializeWeightedFanoutFilter(
+        fanout_filter.substr(weighted_keyword.length()), rpc_def);
+  }
 
   if (!absl::StartsWith(fanout_filter, stochastic_keyword)) {
     if (fanout_filter.empty() || fanout_filter == all_keyword) {
@@ -110,6 +341,10 @@ absl::Status DistBenchEngine::InitializeRpcFanoutFilter(
       rpc_def.fanout_filter = kRandomSingle;
     } else if (fanout_filter == round_robin_keyword) {
       rpc_def.fanout_filter = kRoundRobin;
+    } else if (fanout_filter == least_pending_keyword) {
+      rpc_def.fanout_filter = kLeastPending;
+    } else if (fanout_filter == p2c_keyword) {
+      rpc_def.fanout_filter = kPowerOfTwoChoices;
     }
     return absl::OkStatus();
   }
@@ -145,6 +380,7 @@ absl::Status DistBenchEngine::InitializeRpcFanoutFilter(
           "Invalid stochastic filter; probability should be between 0. and 1.");
     }
     total_probability += dist.probability;
+    dist.cumulative_probability = total_probability;
 
     if (!absl::SimpleAtoi(v[1], &dist.nb_targets)) {
       return absl::InvalidArgumentError(
@@ -154,6 +390,7 @@ absl::Status DistBenchEngine::InitializeRpcFanoutFilter(
       return absl::InvalidArgumentError(
           "Invalid stochastic filter; nb_targets should be >= 0");
     }
+    dist.nb_targets = std::min(dist.nb_targets, rpc_def.num_servers);
 
     rpc_def.stochastic_dist.push_back(dist);
   }
@@ -173,6 +410,50 @@ absl::Status DistBenchEngine::InitializeRpcFanoutFilter(
   return absl::OkStatus();
 }
 
+absl::Status DistBenchEngine::InitializeWeightedFanoutFilter(
+    std::string weights, RpcDefinition& rpc_def) {
+  if (!absl::StartsWith(weights, "{")) {
+    return absl::InvalidArgumentError(
+        "Invalid weighted filter; should starts with weighted{");
+  }
+  weights.erase(0, 1);  // Consume the '{'
+
+  if (!absl::EndsWith(weights, "}")) {
+    return absl::InvalidArgumentError(
+        "Invalid weighted filter; should ends with }");
+  }
+  weights.pop_back();  // Consume the '}'
+
+  double total_weight = 0.;
+  for (auto s : absl::StrSplit(weights, ',')) {
+    double weight;
+    if (!absl::SimpleAtod(s, &weight)) {
+      return absl::InvalidArgumentError(
+          "Invalid weighted filter; unable to decode weight");
+    }
+    if (weight < 0) {
+      return absl::InvalidArgumentError(
+          "Invalid weighted filter; weights should be >= 0");
+    }
+    total_weight += weight;
+    rpc_def.cumulative_weights.push_back(total_weight);
+  }
+
+  if (rpc_def.cumulative_weights.size() !=
+      static_cast<size_t>(rpc_def.num_servers)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Invalid weighted filter; need one weight per instance of ",
+        rpc_def.rpc_spec.server(), " (", rpc_def.num_servers, ")"));
+  }
+  if (total_weight <= 0) {
+    return absl::InvalidArgumentError(
+        "Invalid weighted filter; at least one weight should be > 0");
+  }
+
+  rpc_def.fanout_filter = kWeighted;
+  return absl::OkStatus();
+}
+
 absl::Status DistBenchEngine::ParseActivityConfig(ActivityConfig& ac) {
   ParsedActivityConfig s;
   s.activity_func =
@@ -185,6 +466,68 @@ absl::Status DistBenchEngine::ParseActivityConfig(ActivityConfig& ac) {
 
     s.consume_cpu_config.array_size =
         GetNamedSettingInt64(ac.activity_settings(), "array_size", 1000);
+  } else if (s.activity_func == "ConsumeCpuTime") {
+    auto status = ConsumeCpuTime::ValidateConfig(ac);
+    if (!status.ok()) return status;
+
+    s.consume_cpu_time_config.cpu_time_ns =
+        GetNamedSettingInt64(ac.activity_settings(), "cpu_time_ns", 50'000);
+    std::string distribution_config_name = GetNamedSettingString(
+        ac.activity_settings(), "distribution_config_name", "");
+    if (!distribution_config_name.empty()) {
+      bool has_cpu_time = false;
+      for (const auto& config : traffic_config_.distribution_config()) {
+        if (config.name() == distribution_config_name) {
+          for (const auto& field_name : config.field_names()) {
+            has_cpu_time |= field_name == "cpu_time_ns";
+          }
+        }
+      }
+      int index = GetSampleGeneratorIndex(distribution_config_name);
+      if (index == -1 || !has_cpu_time) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "Activity config '", s.activity_config_name,
+            "' needs a distribution config with a cpu_time_ns field, got '",
+            distribution_config_name, "'."));
+      }
+      s.consume_cpu_time_config.sample_generator =
+          sample_generator_array_[index].get();
+      s.consume_cpu_time_config.sample_dimension = kCpuTimeNs;
+    }
+  } else if (s.activity_func == "ConsumeMemoryBandwidth") {
+    auto status = ConsumeMemoryBandwidth::ValidateConfig(ac);
+    if (!status.ok()) return status;
+
+    s.consume_memory_bandwidth_config.array_size = GetNamedSettingInt64(
+        ac.activity_settings(), "array_size", 64 * 1024 * 1024);
+    s.consume_memory_bandwidth_config.kernel =
+        GetNamedSettingString(ac.activity_settings(), "kernel", "triad");
+    s.consume_memory_bandwidth_config.bytes_per_iteration =
+        GetNamedSettingInt64(ac.activity_settings(), "bytes_per_iteration",
+                             64 * 1024 * 1024);
+    s.consume_memory_bandwidth_config.arrays_pool =
+        std::make_shared<StreamArraysPool>();
+  } else if (s.activity_func == "StorageIo") {
+    auto status = StorageIo::ValidateConfig(ac);
+    if (!status.ok()) return status;
+
+    s.storage_io_config.directory =
+        GetNamedSettingString(ac.activity_settings(), "directory", "/tmp");
+    s.storage_io_config.file_size = GetNamedSettingInt64(
+        ac.activity_settings(), "file_size", 64 * 1024 * 1024);
+    s.storage_io_config.block_size =
+        GetNamedSettingInt64(ac.activity_settings(), "block_size", 4096);
+    s.storage_io_config.queue_depth =
+        GetNamedSettingInt64(ac.activity_settings(), "queue_depth", 8);
+    s.storage_io_config.ops_per_iteration =
+        GetNamedSettingInt64(ac.activity_settings(), "ops_per_iteration", 64);
+    s.storage_io_config.write_percent =
+        GetNamedSettingInt64(ac.activity_settings(), "write_percent", 0);
+    auto file = StorageIoFile::Create(s.storage_io_config);
+    if (!file.ok()) return file.status();
+    s.storage_io_config.file = *std::move(file);
+    s.storage_io_config.op_latencies =
+        std::make_shared<AtomicLatencyHistogram>();
   } else if (s.activity_func == "PolluteDataCache") {
     auto status = PolluteDataCache::ValidateConfig(ac);
     if (!status.ok()) return status;
@@ -208,6 +551,21 @@ absl::Status DistBenchEngine::ParseActivityConfig(ActivityConfig& ac) {
         "' has an unknown activity_func '", s.activity_func, "'."));
   }
 
+  std::string instances =
+      GetNamedSettingString(ac.activity_settings(), "instances", "");
+  if (!instances.empty()) {
+    s.runs_on_this_instance = false;
+    for (std::string_view instance : absl::StrSplit(instances, ',')) {
+      int instance_id;
+      if (!absl::SimpleAtoi(instance, &instance_id) || instance_id < 0) {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "Activity config '", s.activity_config_name,
+            "' has an invalid instance '", instance, "' in instances."));
+      }
+      s.runs_on_this_instance |= instance_id == service_instance_;
+    }
+  }
+
   activity_config_indices_map_[s.activity_config_name] =
       stored_activity_config_.size();
   stored_activity_config_.push_back(s);
@@ -244,6 +602,7 @@ absl::Status DistBenchEngine::InitializeRpcDefinitionsMap() {
     if (rpc_spec.has_request_payload_name()) {
       const auto& payload_name = rpc_spec.request_payload_name();
       rpc_def.request_payload_size = get_payload_size(payload_name);
+      rpc_def.request_payload_spec = payload_map_[payload_name];
     }
     if (rpc_def.request_payload_size == -1) {
       rpc_def.request_payload_size = 16;
@@ -256,6 +615,7 @@ absl::Status DistBenchEngine::InitializeRpcDefinitionsMap() {
     if (rpc_spec.has_response_payload_name()) {
       const auto& payload_name = rpc_spec.response_payload_name();
       rpc_def.response_payload_size = get_payload_size(payload_name);
+      rpc_def.response_payload_spec = payload_map_[payload_name];
     }
     if (rpc_def.response_payload_size == -1) {
       rpc_def.response_payload_size = 32;
@@ -359,6 +719,15 @@ absl::Status DistBenchEngine::InitializeTables() {
                            action.proto.activity_config_name()));
         }
         action.activity_config_index = it5->second;
+        // Activities hold a simulated clock while they run, so only their
+        // iteration count can end them:
+        if (clock_->IsSimulated() && action.proto.has_iterations() &&
+            !action.proto.iterations().has_max_iteration_count()) {
+          return absl::InvalidArgumentError(absl::StrCat(
+              "Action ", action.proto.name(),
+              " runs an activity on a simulated clock without a "
+              "max_iteration_count"));
+        }
       } else {
         return absl::InvalidArgumentError(
             "only rpc actions & activities are supported for now");
@@ -374,6 +743,18 @@ absl::Status DistBenchEngine::InitializeTables() {
           return absl::InvalidArgumentError(
               "dependencies must refer to prior actions");
         }
+        action_lists_[i].list_actions[it->second]
+            .successor_action_indices.push_back(j);
+      }
+      const auto& interval_distribution =
+          action.proto.iterations().open_loop_interval_distribution();
+      if (interval_distribution != "constant" &&
+          interval_distribution != "exponential" &&
+          interval_distribution != "sync_burst" &&
+          interval_distribution != "sync_burst_spread") {
+        return absl::InvalidArgumentError(
+            absl::StrCat("Unknown open_loop_interval_distribution: ",
+                         interval_distribution));
       }
     }
   }
@@ -398,6 +779,15 @@ absl::Status DistBenchEngine::InitializeTables() {
       return absl::InvalidArgumentError(
           absl::StrCat("Rpc ", rpc.name(), " must have a server_service_name"));
     }
+    if (rpc.connection_churn_rate() < 0) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Rpc ", rpc.name(), " has a negative connection_churn_rate"));
+    }
+    if (rpc.batch_size() < 1 || rpc.batch_delay_us() < 0) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Rpc ", rpc.name(),
+          " must have a positive batch_size and a batch_delay_us >= 0"));
+    }
     if (client_service_name == service_name_) {
       client_rpc_index_map[rpc.name()] = i;
       dependent_services_.insert(server_service_name);
@@ -434,13 +824,135 @@ absl::Status DistBenchEngine::InitializeTables() {
     }
     client_rpc_table_[i].service_index = it1->second;
     client_rpc_table_[i].rpc_definition = rpc_map_[rpc.name()];
-    client_rpc_table_[i].pending_requests_per_peer.resize(
-        traffic_config_.services(it1->second).count(), 0);
+    if (client_service_name == service_name_) {
+      const int num_servers = traffic_config_.services(it1->second).count();
+      client_rpc_table_[i].latency_histograms =
+          std::make_unique<AtomicLatencyHistogram[]>(num_servers);
+      client_rpc_table_[i].pending_requests_per_peer =
+          std::make_unique<std::atomic<int64_t>[]>(num_servers);
+      for (int j = 0; j < num_servers; ++j) {
+        client_rpc_table_[i].pending_requests_per_peer[j] = 0;
+      }
+      if (rpc.connection_churn_rate() > 0) {
+        if (!pd_->SupportsConnectionChurn()) {
+          return absl::InvalidArgumentError(absl::StrCat(
+              "Rpc ", rpc.name(), " has a connection_churn_rate, but the "
+              "protocol driver of ", service_name_, " cannot churn its "
+              "connections"));
+        }
+        client_rpc_table_[i].churner = std::make_unique<ConnectionChurner>();
+      }
+      if (rpc.batch_size() > 1) {
+        auto& batcher = client_rpc_table_[i].batcher;
+        batcher = std::make_unique<RpcBatcher>();
+        absl::MutexLock m(&batcher->mu);
+        batcher->open_batches.resize(num_servers);
+      }
+    }
+  }
+
+  // A reconnect slows down all the rpcs to the peer, not just the one that
+  // churns the connections:
+  has_connection_churn_ = false;
+  for (int i = 0; i < traffic_config_.rpc_descriptions_size(); ++i) {
+    has_connection_churn_ |= client_rpc_table_[i].churner != nullptr;
+  }
+  for (int i = 0; has_connection_churn_ &&
+                  i < traffic_config_.rpc_descriptions_size();
+       ++i) {
+    if (!client_rpc_table_[i].latency_histograms) continue;
+    const int num_servers =
+        traffic_config_.services(client_rpc_table_[i].service_index).count();
+    client_rpc_table_[i].reconnect_overlap_histograms =
+        std::make_unique<AtomicLatencyHistogram[]>(num_servers);
   }
 
+  InitializePayloadTables();
   return absl::OkStatus();
 }
 
+// Returns the largest payload size that may be requested by any RPC, either
+// through a PayloadSpec, the built-in defaults, or a distribution config.
+int64_t DistBenchEngine::GetMaxPayloadSize() {
+  int64_t max_size = 0;
+  for (const auto& [name, rpc_def] : rpc_map_) {
+    max_size = std::max<int64_t>(max_size, rpc_def.request_payload_size);
+    max_size = std::max<int64_t>(max_size, rpc_def.response_payload_size);
+  }
+  // Only the payload size fields of the distributions size the payloads, not
+  // e.g. their cpu_time_ns:
+  for (const auto& config : traffic_config_.distribution_config()) {
+    for (int i = 0; i < config.field_names_size(); ++i) {
+      if (config.field_names(i) != "request_payload_size" &&
+          config.field_names(i) != "response_payload_size") {
+        continue;
+      }
+      for (const auto& pmf_point : config.pmf_points()) {
+        if (i >= pmf_point.data_points_size()) continue;
+        const auto& data_point = pmf_point.data_points(i);
+        max_size = std::max<int64_t>(max_size, data_point.exact());
+        max_size = std::max<int64_t>(max_size, data_point.upper());
+      }
+    }
+  }
+  return max_size;
+}
+
+// Builds the payloads once, so that the RPC paths only have to copy them
+// into (possibly already allocated) request and response buffers, rather
+// than allocating and filling a temporary string for every RPC.
+void DistBenchEngine::InitializePayloadTables() {
+  const int64_t max_size = GetMaxPayloadSize();
+  for (int i = 0; i < traffic_config_.rpc_descriptions_size(); ++i) {
+    auto& client_rpc = client_rpc_table_[i];
+    auto& client_rpc_def = client_rpc.rpc_definition;
+    client_rpc_def.request_payload_content =
+        GetPayloadContent(client_rpc_def.request_payload_spec, max_size);
+    client_rpc.request_table.resize(1);
+    GenericRequest& request = client_rpc.request_table[0];
+    request.set_rpc_index(i);
+    if (client_rpc_def.rpc_spec.record_stage_timings()) {
+      request.set_record_stage_timings(true);
+    }
+    if (client_rpc_def.rpc_spec.record_server_processing_time()) {
+      request.set_record_server_processing_time(true);
+    }
+    // Sampled payload sizes are sliced out of payload_contents_ at runtime.
+    if (client_rpc_def.sample_generator_index == -1) {
+      FillPayload(request.mutable_payload(),
+                  client_rpc_def.request_payload_size,
+                  *client_rpc_def.request_payload_content);
+    }
+
+    auto& server_rpc = server_rpc_table_[i];
+    auto& server_rpc_def = server_rpc.rpc_definition;
+    server_rpc_def.response_payload_content =
+        GetPayloadContent(server_rpc_def.response_payload_spec, max_size);
+    server_rpc.response_table.resize(1);
+    FillPayload(server_rpc.response_table[0].mutable_payload(),
+                server_rpc_def.response_payload_size,
+                *server_rpc_def.response_payload_content);
+  }
+}
+
+// Returns the buffer of the content of spec, generating it on first use.
+const std::string* DistBenchEngine::GetPayloadContent(const PayloadSpec& spec,
+                                                     int64_t size) {
+  auto [it, inserted] = payload_contents_.try_emplace(PayloadContentKey(spec));
+  if (inserted) it->second = MakePayloadContent(spec, size);
+  return &it->second;
+}
+
+void DistBenchEngine::FillPayload(std::string* payload, int64_t size,
+                                  const std::string& content) const {
+  if (static_cast<size_t>(size) <= content.size()) {
+    payload->assign(content.data(), size);
+  } else {
+    // A peer asked for more than our config allows; don't fail the RPC.
+    payload->assign(size, 'D');
+  }
+}
+
 absl::Status DistBenchEngine::Initialize(
     const DistributedSystemDescription& global_description,
     std::string_view control_plane_device, std::string_view service_name,
@@ -490,6 +1002,59 @@ absl::Status DistBenchEngine::Initialize(
   return absl::OkStatus();
 }
 
+absl::Status DistBenchEngine::ReloadTrafficConfig(
+    const DistributedSystemDescription& global_description) {
+  FinishTraffic();
+  WaitForRunningActionLists();
+  // Before traffic_config_ changes, as it sizes client_rpc_table_:
+  ShutdownConnectionChurn();
+  ShutdownRpcBatchers();
+  auto maybe_service_spec = GetServiceSpec(service_name_, global_description);
+  if (!maybe_service_spec.ok()) return maybe_service_spec.status();
+  service_spec_ = maybe_service_spec.value();
+  traffic_config_ = global_description;
+
+  const std::set<std::string> connected_services =
+      std::move(dependent_services_);
+  dependent_services_.clear();
+  payload_map_.clear();
+  // The buffers are sized for the largest payload of the previous test:
+  payload_contents_.clear();
+  rpc_map_.clear();
+  activity_config_indices_map_.clear();
+  stored_activity_config_.clear();
+  sample_generator_indices_map_.clear();
+  sample_generator_array_.clear();
+  action_lists_.clear();
+  server_rpc_table_.clear();
+  client_rpc_table_.reset();
+  absl::Status ret = InitializeTables();
+  if (!ret.ok()) return ret;
+  if (dependent_services_ != connected_services) {
+    return absl::FailedPreconditionError(absl::StrCat(
+        engine_name_, ": the services it sends RPCs to have changed"));
+  }
+
+  // Forget everything about the previous test:
+  canceled_ = std::make_unique<SafeNotification>();
+  {
+    absl::MutexLock m(&cumulative_activity_log_mu_);
+    cumulative_activity_logs_.clear();
+    cumulative_pacing_logs_.clear();
+  }
+  {
+    absl::MutexLock m(&live_metrics_mu_);
+    live_metrics_histograms_.clear();
+  }
+  for (auto& service_type : peers_) {
+    for (auto& service_instance : service_type) {
+      absl::MutexLock m(&service_instance.mutex);
+      service_instance.partial_logs.clear();
+    }
+  }
+  return absl::OkStatus();
+}
+
 absl::Status DistBenchEngine::ConfigurePeers(const ServiceEndpointMap& peers) {
   pd_->SetHandler([this](ServerRpcState* state) { return RpcHandler(state); });
   service_map_ = peers;
@@ -544,6 +1109,22 @@ absl::Status DistBenchEngine::ConnectToPeers() {
   }
 
   pd_->SetNumPeers(num_targets);
+  auto maybe_parallelism = GetNamedAttributeInt64(
+      traffic_config_, "connection_setup_parallelism", 64);
+  if (!maybe_parallelism.ok()) return maybe_parallelism.status();
+  const int max_pending_rpcs = std::max<int64_t>(1, *maybe_parallelism);
+  std::vector<const PeerMetadata*> targets(num_targets);
+  for (const auto& service_type : peers_) {
+    for (const auto& service_instance : service_type) {
+      if (!service_instance.endpoint_address.empty()) {
+        targets[service_instance.pd_id] = &service_instance;
+      }
+    }
+  }
+
+  // Up to max_pending_rpcs connection setup RPCs are kept in flight, and
+  // each connection is completed as soon as its RPC returns, while the
+  // others are still in flight.
   grpc::CompletionQueue cq;
   struct PendingRpc {
     std::unique_ptr<ConnectionSetup::Stub> stub;
@@ -553,34 +1134,33 @@ absl::Status DistBenchEngine::ConnectToPeers() {
     ConnectRequest request;
     ConnectResponse response;
     std::string server_address;
+    int peer;
   };
   grpc::Status status;
   std::vector<PendingRpc> pending_rpcs(num_targets);
+  int next_peer = 0;
   int rpc_count = 0;
-  for (const auto& service_type : peers_) {
-    for (const auto& service_instance : service_type) {
-      if (!service_instance.endpoint_address.empty()) {
-        auto& rpc_state = pending_rpcs[service_instance.pd_id];
-        std::shared_ptr<grpc::ChannelCredentials> creds =
-            MakeChannelCredentials();
-        std::shared_ptr<grpc::Channel> channel =
-            grpc::CreateCustomChannel(service_instance.endpoint_address, creds,
-                                      DistbenchCustomChannelArguments());
-        rpc_state.stub = ConnectionSetup::NewStub(channel);
-        rpc_state.server_address = service_instance.endpoint_address;
-        CHECK(rpc_state.stub);
-
-        ++rpc_count;
-        rpc_state.request.set_initiator_info(pd_->Preconnect().value());
-        SetGrpcClientContextDeadline(&rpc_state.context, /*max_time_s=*/60);
-        rpc_state.rpc = rpc_state.stub->AsyncSetupConnection(
-            &rpc_state.context, rpc_state.request, &cq);
-        rpc_state.rpc->Finish(&rpc_state.response, &rpc_state.status,
-                              &rpc_state);
-      }
-    }
+  auto start_next_rpc = [&]() {
+    auto& rpc_state = pending_rpcs[next_peer];
+    rpc_state.peer = next_peer;
+    rpc_state.server_address = targets[next_peer]->endpoint_address;
+    ++next_peer;
+    std::shared_ptr<grpc::ChannelCredentials> creds = MakeChannelCredentials();
+    std::shared_ptr<grpc::Channel> channel = grpc::CreateCustomChannel(
+        rpc_state.server_address, creds, DistbenchCustomChannelArguments());
+    rpc_state.stub = ConnectionSetup::NewStub(channel);
+    CHECK(rpc_state.stub);
+
+    ++rpc_count;
+    rpc_state.request.set_initiator_info(pd_->Preconnect().value());
+    SetGrpcClientContextDeadline(&rpc_state.context, /*max_time_s=*/60);
+    rpc_state.rpc = rpc_state.stub->AsyncSetupConnection(
+        &rpc_state.context, rpc_state.request, &cq);
+    rpc_state.rpc->Finish(&rpc_state.response, &rpc_state.status, &rpc_state);
+  };
+  while (next_peer < num_targets && rpc_count < max_pending_rpcs) {
+    start_next_rpc();
   }
-  CHECK(rpc_count == num_targets);
   while (rpc_count) {
     bool ok;
     void* tag;
@@ -595,17 +1175,20 @@ absl::Status DistBenchEngine::ConnectToPeers() {
                    << finished_rpc->status.error_code() << " "
                    << finished_rpc->status.error_message() << " connecting to "
                    << finished_rpc->server_address;
+      } else {
+        absl::Status final_status = pd_->HandleConnect(
+            finished_rpc->response.responder_info(), finished_rpc->peer);
+        if (!final_status.ok()) {
+          LOG(INFO) << engine_name_
+                    << ": Weird, a connect failed after rpc succeeded.";
+          status = abslStatusToGrpcStatus(final_status);
+        }
       }
-    }
-  }
-  for (size_t i = 0; i < pending_rpcs.size(); ++i) {
-    if (pending_rpcs[i].status.ok()) {
-      absl::Status final_status = pd_->HandleConnect(
-          pending_rpcs[i].response.responder_info(), /*peer=*/i);
-      if (!final_status.ok()) {
-        LOG(INFO) << engine_name_
-                  << ": Weird, a connect failed after rpc succeeded.";
-        status = abslStatusToGrpcStatus(final_status);
+      // The control channel is no longer needed:
+      finished_rpc->rpc.reset();
+      finished_rpc->stub.reset();
+      if (next_peer < num_targets) {
+        start_next_rpc();
       }
     }
   }
@@ -627,6 +1210,7 @@ absl::Status DistBenchEngine::RunTraffic(const RunTrafficRequest* request) {
         delete fake_request;
         delete top_level_state;
       });
+      ThreadPlacerScope placer_scope(thread_placer_);
       engine_main_thread_ = RunRegisteredThread(
           "EngineMain",
           [this, i, top_level_state]() { RunActionList(i, top_level_state); });
@@ -639,7 +1223,10 @@ absl::Status DistBenchEngine::RunTraffic(const RunTrafficRequest* request) {
 
 void DistBenchEngine::CancelTraffic() {
   LOG(INFO) << engine_name_ << ": Got CancelTraffic";
-  canceled_.TryToNotify();
+  canceled_->TryToNotify();
+  // Let the open loop actions that wait for their next iteration finish:
+  absl::MutexLock m(&open_loop_timer_mu_);
+  open_loop_timers_changed_ = true;
 }
 
 void DistBenchEngine::FinishTraffic() {
@@ -657,50 +1244,144 @@ void DistBenchEngine::AddActivityLogs(ServicePerformanceLog* sp_log) {
       am->set_name(metric.first);
       am->set_value_int(metric.second);
     }
+    auto it = activity_config_indices_map_.find(alog.first);
+    if (it == activity_config_indices_map_.end()) continue;
+    const auto& config = stored_activity_config_[it->second];
+    if (config.activity_func == "StorageIo") {
+      StorageIo::AddOpLatencyPercentiles(config.storage_io_config,
+                                         &activity_log);
+    }
+  }
+}
+
+void DistBenchEngine::AddPacingLogs(ServicePerformanceLog* sp_log) {
+  absl::MutexLock m(&cumulative_activity_log_mu_);
+  for (const auto& pacing_log : cumulative_pacing_logs_) {
+    (*sp_log->mutable_pacing_logs())[pacing_log.first] = pacing_log.second;
   }
 }
 
 ServicePerformanceLog DistBenchEngine::GetLogs() {
-  ServicePerformanceLog log;
-  for (size_t i = 0; i < peers_.size(); ++i) {
-    for (size_t j = 0; j < peers_[i].size(); ++j) {
-      absl::MutexLock m(&peers_[i][j].mutex);
-      for (auto& partial_log : peers_[i][j].partial_logs) {
-        for (auto& map_pair : partial_log.rpc_logs()) {
-          int32_t rpc_index = map_pair.first;
-          const RpcPerformanceLog& rpc_perf_log = map_pair.second;
-          if (rpc_perf_log.successful_rpc_samples().empty() &&
-              rpc_perf_log.failed_rpc_samples().empty())
-            continue;
-          auto& output_peer_log =
-              (*log.mutable_peer_logs())[peers_[i][j].log_name];
-          auto& output_rpc_logs = *output_peer_log.mutable_rpc_logs();
-          output_rpc_logs[rpc_index].MergeFrom(rpc_perf_log);
-        }
-      }
+  // Handler action lists send their response before merging their logs, so
+  // the ones that just answered may still be running:
+  WaitForRunningActionLists();
+  std::vector<PeerMetadata*> peers;
+  for (auto& service_type : peers_) {
+    for (auto& peer : service_type) {
+      peers.push_back(&peer);
     }
   }
+  // The samples are moved out of the partial logs rather than merged, one
+  // peer per thread:
+  std::vector<PeerPerformanceLog> peer_logs(peers.size());
+  ParallelFor(peers.size(), [&peers, &peer_logs](size_t i) {
+    std::list<PeerPerformanceLog> partial_logs;
+    {
+      absl::MutexLock m(&peers[i]->mutex);
+      partial_logs.swap(peers[i]->partial_logs);
+    }
+    SplicePartialLogs(&partial_logs, &peer_logs[i]);
+  });
+  ServicePerformanceLog log;
+  for (size_t i = 0; i < peers.size(); ++i) {
+    if (peer_logs[i].rpc_logs().empty()) continue;
+    (*log.mutable_peer_logs())[peers[i]->log_name] = std::move(peer_logs[i]);
+  }
+  AddLatencyHistograms(&log);
   AddActivityLogs(&log);
+  AddPacingLogs(&log);
+  AddConnectionChurnLogs(&log);
+  AddBatchSizes(&log);
   return log;
 }
 
+void DistBenchEngine::AddConnectionChurnLogs(ServicePerformanceLog* sp_log) {
+  for (int i = 0; i < traffic_config_.rpc_descriptions_size(); ++i) {
+    ConnectionChurner* churner = client_rpc_table_[i].churner.get();
+    if (!churner) continue;
+    absl::MutexLock m(&churner->mu);
+    if (churner->reconnects.empty()) continue;
+    auto& churn_log = (*sp_log->mutable_connection_churn_logs())
+        [traffic_config_.rpc_descriptions(i).name()];
+    for (const auto& reconnect : churner->reconnects) {
+      *churn_log.add_reconnects() = reconnect;
+    }
+  }
+}
+
+void DistBenchEngine::AddLatencyHistograms(ServicePerformanceLog* sp_log) {
+  for (int i = 0; i < traffic_config_.rpc_descriptions_size(); ++i) {
+    const auto& client_rpc = client_rpc_table_[i];
+    if (!client_rpc.latency_histograms) continue;
+    const auto& servers = peers_[client_rpc.service_index];
+    for (size_t j = 0; j < servers.size(); ++j) {
+      const auto& histogram = client_rpc.latency_histograms[j];
+      if (histogram.Empty()) continue;
+      auto& output_peer_log =
+          (*sp_log->mutable_peer_logs())[servers[j].log_name];
+      auto& output_rpc_log = (*output_peer_log.mutable_rpc_logs())[i];
+      *output_rpc_log.mutable_latency_histogram() = histogram.ToProto();
+      if (client_rpc.reconnect_overlap_histograms &&
+          !client_rpc.reconnect_overlap_histograms[j].Empty()) {
+        *output_rpc_log.mutable_reconnect_overlap_histogram() =
+            client_rpc.reconnect_overlap_histograms[j].ToProto();
+      }
+    }
+  }
+}
+
+std::vector<LiveRpcMetrics> DistBenchEngine::GetLiveMetrics() {
+  std::vector<LiveRpcMetrics> ret;
+  absl::MutexLock m(&live_metrics_mu_);
+  live_metrics_histograms_.resize(traffic_config_.rpc_descriptions_size());
+  for (int i = 0; i < traffic_config_.rpc_descriptions_size(); ++i) {
+    const auto& client_rpc = client_rpc_table_[i];
+    if (!client_rpc.latency_histograms) continue;
+    AtomicLatencyHistogram merged;
+    int64_t in_flight = 0;
+    for (size_t j = 0; j < peers_[client_rpc.service_index].size(); ++j) {
+      const auto& histogram = client_rpc.latency_histograms[j];
+      in_flight += client_rpc.pending_requests_per_peer[j].load(
+          std::memory_order_relaxed);
+      if (histogram.Empty()) continue;
+      CHECK(merged.MergeFrom(histogram.ToProto()).ok());
+    }
+    LatencyHistogram current = merged.ToProto();
+    LiveRpcMetrics& metrics = ret.emplace_back();
+    metrics.set_rpc_name(traffic_config_.rpc_descriptions(i).name());
+    metrics.set_completed_rpc_count(current.successful_rpc_count() +
+                                    current.warmup_rpc_count());
+    metrics.set_failed_rpc_count(current.failed_rpc_count());
+    metrics.set_in_flight_rpc_count(in_flight);
+    *metrics.mutable_window_histogram() =
+        LatencyHistogramDelta(current, live_metrics_histograms_[i]);
+    live_metrics_histograms_[i] = std::move(current);
+  }
+  return ret;
+}
+
 // Process the incoming RPC;
-// if have_dedicated_thread == true; all the processing is performed inline
-// and the function returned is always empty,
-// if have_dedicated_thread == false, only short RPCs are performed inline,
-// and longer RPCs will return a non-empty function that the protocol driver
-// should process in a seperate thread.
+// if have_dedicated_thread == true; all the processing is performed inline,
+// if have_dedicated_thread == false, the handler action list is only started
+// inline: it runs asynchronously and sends the response when done.
+// If defer_action_lists is set, starting the action list is left to the
+// function returned instead; otherwise the function returned is empty.
 std::function<void()> DistBenchEngine::RpcHandler(ServerRpcState* state) {
   CHECK(state->request->has_rpc_index());
+  if (!state->request->batched_requests().empty()) {
+    return BatchedRpcHandler(state);
+  }
+  if (state->RecordsServerTimings()) {
+    state->handler_start_time = clock_->Now();
+  }
   const auto& server_rpc = server_rpc_table_[state->request->rpc_index()];
-  const auto& rpc_def = server_rpc.rpc_definition;
 
   if (state->request->has_response_payload_size()) {
-    state->response.set_payload(
-        std::string(state->request->response_payload_size(), 'D'));
+    FillPayload(state->response.mutable_payload(),
+                state->request->response_payload_size(),
+                *server_rpc.rpc_definition.response_payload_content);
   } else {
-    state->response.set_payload(
-        std::string(rpc_def.response_payload_size, 'D'));
+    state->response = server_rpc.response_table[0];
   }
 
   int handler_action_list_index = server_rpc.handler_action_list_index;
@@ -712,184 +1393,283 @@ std::function<void()> DistBenchEngine::RpcHandler(ServerRpcState* state) {
 
   if (state->have_dedicated_thread) {
     RunActionList(handler_action_list_index, state);
-    return std::function<void()>();
+  } else if (state->defer_action_lists) {
+    ++running_action_lists_;
+    return [this, handler_action_list_index, state]() {
+      StartActionList(handler_action_list_index, state,
+                      /*force_warmup=*/false, []() {});
+      RemoveRunningActionList();
+    };
+  } else {
+    StartActionList(handler_action_list_index, state, /*force_warmup=*/false,
+                    []() {});
   }
+  return std::function<void()>();
+}
 
-  ++detached_actionlist_threads_;
-  return [=]() {
-    RunActionList(handler_action_list_index, state);
-    --detached_actionlist_threads_;
+// Handles each request of a batch as an RPC of its own, see
+// RpcSpec.batch_size. The responses are sent together once the last one is
+// ready, and the batch is freed once all of its RPCs are.
+std::function<void()> DistBenchEngine::BatchedRpcHandler(
+    ServerRpcState* state) {
+  struct Batch {
+    explicit Batch(int size) : rpcs(size), unsent(size), unfreed(size) {}
+    std::vector<ServerRpcState> rpcs;
+    std::atomic<int> unsent;
+    std::atomic<int> unfreed;
   };
+  const int size = state->request->batched_requests_size();
+  auto* batch = new Batch(size);
+  for (int i = 0; i < size; ++i) {
+    ServerRpcState& rpc = batch->rpcs[i];
+    rpc.request = &state->request->batched_requests(i);
+    rpc.have_dedicated_thread = state->have_dedicated_thread;
+    rpc.defer_action_lists = state->defer_action_lists;
+    rpc.receive_time = state->receive_time;
+    rpc.clock = state->clock;
+    rpc.SetSendResponseFunction([state, batch, &rpc]() {
+      rpc.RecordServerTimings();
+      if (--batch->unsent) return;
+      for (auto& batched_rpc : batch->rpcs) {
+        state->response.add_batched_responses()->Swap(&batched_rpc.response);
+      }
+      state->SendResponseIfSet();
+    });
+    rpc.SetFreeStateFunction([state, batch]() {
+      if (--batch->unfreed) return;
+      delete batch;
+      state->FreeStateIfSet();
+    });
+  }
+  // The batch may be freed as soon as the last handler returns:
+  std::vector<std::function<void()>> deferred_work;
+  for (int i = 0; i < size; ++i) {
+    std::function<void()> work = RpcHandler(&batch->rpcs[i]);
+    if (work) deferred_work.push_back(std::move(work));
+  }
+  if (deferred_work.empty()) return std::function<void()>();
+  return [deferred_work = std::move(deferred_work)]() {
+    for (const auto& work : deferred_work) work();
+  };
+}
+
+std::thread DistBenchEngine::RunClockedThread(const std::string& thread_name,
+                                              std::function<void()> f) {
+  clock_->HoldForNewThread();
+  ThreadPlacerScope placer_scope(thread_placer_);
+  // The clocks outlive the engines, which the detached threads may not:
+  return RunRegisteredThread(thread_name, [clock = clock_, f = std::move(f)]() {
+    clock->AdoptHold();
+    f();
+    clock->Release();
+  });
 }
 
 void DistBenchEngine::RunActionList(int list_index,
                                     const ServerRpcState* incoming_rpc_state,
                                     bool force_warmup) {
+  absl::Notification done;
+  {
+    // This thread does not wait on the clock, so it holds a simulated one
+    // for the work it starts to start at once:
+    ClockHold hold(clock_);
+    StartActionList(list_index, incoming_rpc_state, force_warmup,
+                    [&done]() { done.Notify(); });
+  }
+  done.WaitForNotification();
+}
+
+void DistBenchEngine::StartActionList(int list_index,
+                                      const ServerRpcState* incoming_rpc_state,
+                                      bool force_warmup,
+                                      std::function<void()> done_callback) {
   CHECK_LT(static_cast<size_t>(list_index), action_lists_.size());
   CHECK_GE(list_index, 0);
-  ActionListState s = {};
-  s.warmup_ = force_warmup || incoming_rpc_state->request->warmup();
-  s.incoming_rpc_state = incoming_rpc_state;
-  s.action_list = &action_lists_[list_index];
-  bool sent_response_early = false;
-  unsigned int seed =
-      std::chrono::system_clock::now().time_since_epoch().count();
-  std::default_random_engine rand_gen(seed);
+  ++running_action_lists_;
+  auto* s = new ActionListState;
+  s->warmup_ = force_warmup || incoming_rpc_state->request->warmup();
+  s->incoming_rpc_state = incoming_rpc_state;
+  s->action_list = &action_lists_[list_index];
+  s->done_callback = std::move(done_callback);
+  s->rand_gen.seed(std::chrono::system_clock::now().time_since_epoch().count());
 
   // Allocate peer_logs_ for performance gathering, if needed:
-  if (s.action_list->has_rpcs) {
-    s.packed_samples_size_ = s.action_list->proto.max_rpc_samples();
-    if (s.action_list->proto.max_rpc_samples() < 0) {
-      s.packed_samples_size_ = 0;
-    }
-    s.packed_samples_.reset(new PackedLatencySample[s.packed_samples_size_]);
-    s.remaining_initial_samples_ = s.packed_samples_size_;
-    absl::MutexLock m(&s.action_mu);
-    s.peer_logs_.resize(peers_.size());
+  if (s->action_list->has_rpcs) {
+    s->packed_samples_size_ = s->action_list->proto.max_rpc_samples();
+    if (s->action_list->proto.max_rpc_samples() < 0) {
+      s->packed_samples_size_ = 0;
+    }
+    s->packed_samples_.reset(new PackedLatencySample[s->packed_samples_size_]);
+    s->packed_sample_locks_.reset(
+        new std::atomic<bool>[s->packed_samples_size_]());
+    for (size_t i = 0; i < s->packed_samples_size_; ++i) {
+      s->packed_samples_[i].sample_number = kEmptySampleSlot;
+    }
+    s->sample_chunks_owner_id_ = next_sample_chunks_owner_id.fetch_add(
+        1, std::memory_order_relaxed);
+    if (!s->packed_samples_size_) {
+      s->sample_chunks_alive_ = std::make_shared<bool>(true);
+    }
+    s->columnar_samples_ = s->action_list->proto.columnar_rpc_samples();
+    absl::MutexLock m(&s->action_mu);
+    s->peer_logs_.resize(peers_.size());
     for (size_t i = 0; i < peers_.size(); ++i) {
-      s.peer_logs_[i].resize(peers_[i].size());
+      s->peer_logs_[i].resize(peers_[i].size());
     }
   }
 
-  int size = s.action_list->proto.action_names_size();
-  s.finished_action_indices.reserve(size);
-  s.state_table = std::make_unique<ActionState[]>(size);
-  while (true) {
-    absl::Time now = clock_->Now();
+  int size = s->action_list->proto.action_names_size();
+  s->state_table = std::make_unique<ActionState[]>(size);
+  {
+    absl::MutexLock m(&s->action_mu);
+    s->finished_action_indices.reserve(size);
     for (int i = 0; i < size; ++i) {
-      if (s.state_table[i].started) {
-        if (s.state_table[i].next_iteration_time < now) {
-          if (s.state_table[i].action->proto.has_activity_config_name()) {
-            RunActivity(&s.state_table[i]);
-          } else {
-            StartOpenLoopIteration(&s.state_table[i]);
-          }
-        }
-        continue;
-      }
-      auto deps = s.action_list->list_actions[i].dependent_action_indices;
-      bool deps_ready = true;
-      for (const auto& dep : deps) {
-        if (!s.state_table[dep].finished) {
-          deps_ready = false;
-          break;
-        }
+      s->state_table[i].remaining_dependencies =
+          s->action_list->list_actions[i].dependent_action_indices.size();
+      if (!s->state_table[i].remaining_dependencies) {
+        s->ready_action_indices.push_back(i);
       }
-      if (!deps_ready) continue;
-      s.state_table[i].started = true;
-      s.state_table[i].action = &s.action_list->list_actions[i];
-      s.state_table[i].rand_gen = &rand_gen;
-      if ((!sent_response_early && incoming_rpc_state) &&
-          ((size == 1) ||
-           s.state_table[i].action->proto.send_response_when_done())) {
-        sent_response_early = true;
-        s.state_table[i].all_done_callback = [&s, i, incoming_rpc_state,
-                                              this]() {
-          incoming_rpc_state->SendResponseIfSet();
-          if (s.state_table[i].action->proto.cancel_traffic_when_done()) {
-            CancelTraffic();
-          }
-          s.FinishAction(i);
-        };
-      } else {
-        s.state_table[i].all_done_callback = [&s, i, this]() {
-          if (s.state_table[i].action->proto.cancel_traffic_when_done()) {
-            CancelTraffic();
-          }
-          s.FinishAction(i);
-        };
-      }
-      s.state_table[i].action_list_state = &s;
-      atomic_fetch_add_explicit(&s.pending_action_count_, 1,
-                                std::memory_order_relaxed);
-      RunAction(&s.state_table[i]);
     }
-    absl::Time next_iteration_time = absl::InfiniteFuture();
-    bool done = true;
-    for (int i = 0; i < size; ++i) {
-      if (!s.state_table[i].finished) {
-        if (s.state_table[i].next_iteration_time < next_iteration_time) {
-          next_iteration_time = s.state_table[i].next_iteration_time;
+  }
+  ScheduleActions(s);
+}
+
+// Handles the actions that finished since the last call, and starts the ones
+// that became ready. Only one thread at a time runs the loop; the events that
+// other threads record meanwhile are picked up before it exits.
+void DistBenchEngine::ScheduleActions(ActionListState* s) {
+  std::vector<int> ready_action_indices;
+  s->action_mu.Lock();
+  if (s->scheduling) {
+    s->action_mu.Unlock();
+    return;
+  }
+  s->scheduling = true;
+  while (true) {
+    for (int finished_action_index : s->finished_action_indices) {
+      auto& state = s->state_table[finished_action_index];
+      state.finished = true;
+      ++s->finished_actions;
+      for (int successor : state.action->successor_action_indices) {
+        if (!--s->state_table[successor].remaining_dependencies) {
+          s->ready_action_indices.push_back(successor);
         }
-        done = false;
       }
     }
-    if (done) break;
-    auto some_actions_finished = [&s]() { return s.DidSomeActionsFinish(); };
-
-    // Idle here till some actions are finished.
-    if (clock_->MutexLockWhenWithDeadline(
-            &s.action_mu, absl::Condition(&some_actions_finished),
-            next_iteration_time)) {
-      s.HandleFinishedActions();
+    s->finished_action_indices.clear();
+    if (canceled_->HasBeenNotified()) {
+      // Only wait for the actions that were already started:
+      s->ready_action_indices.clear();
     }
-    s.action_mu.Unlock();
-    if (canceled_.HasBeenNotified()) {
+    if (s->ready_action_indices.empty()) break;
+    ready_action_indices.swap(s->ready_action_indices);
+    s->started_actions += ready_action_indices.size();
+    s->action_mu.Unlock();
+    for (int action_index : ready_action_indices) {
+      StartAction(s, action_index);
+    }
+    ready_action_indices.clear();
+    s->action_mu.Lock();
+  }
+  s->scheduling = false;
+  bool done = s->finished_actions == s->started_actions &&
+              (canceled_->HasBeenNotified() ||
+               s->started_actions == s->action_list->proto.action_names_size());
+  s->action_mu.Unlock();
+  if (done) {
+    if (canceled_->HasBeenNotified()) {
       LOG(INFO) << engine_name_ << ": Cancelled action list "
-                << s.action_list->proto.name();
-
-      s.CancelActivities();
-      s.WaitForAllPendingActions();
-      break;
+                << s->action_list->proto.name();
     }
+    FinishActionList(s);
   }
-  if (incoming_rpc_state) {
-    if (!sent_response_early) {
+}
+
+void DistBenchEngine::StartAction(ActionListState* s, int action_index) {
+  const ServerRpcState* incoming_rpc_state = s->incoming_rpc_state;
+  int size = s->action_list->proto.action_names_size();
+  ActionState& state = s->state_table[action_index];
+  state.started = true;
+  state.action = &s->action_list->list_actions[action_index];
+  state.rand_gen = &s->rand_gen;
+  state.action_list_state = s;
+  if ((!s->sent_response_early && incoming_rpc_state) &&
+      ((size == 1) || state.action->proto.send_response_when_done())) {
+    s->sent_response_early = true;
+    state.all_done_callback = [this, s, action_index, incoming_rpc_state]() {
       incoming_rpc_state->SendResponseIfSet();
+      if (s->state_table[action_index]
+              .action->proto.cancel_traffic_when_done()) {
+        CancelTraffic();
+      }
+      FinishAction(s, action_index);
+    };
+  } else {
+    state.all_done_callback = [this, s, action_index]() {
+      if (s->state_table[action_index]
+              .action->proto.cancel_traffic_when_done()) {
+        CancelTraffic();
+      }
+      FinishAction(s, action_index);
+    };
+  }
+  RunAction(&state);
+}
+
+void DistBenchEngine::FinishAction(ActionListState* s, int action_index) {
+  const ActionState& action_state = s->state_table[action_index];
+  if (action_state.churns_connections) {
+    StopConnectionChurn(action_state.rpc_index);
+  }
+  {
+    absl::MutexLock m(&s->action_mu);
+    s->finished_action_indices.push_back(action_index);
+  }
+  ScheduleActions(s);
+}
+
+void DistBenchEngine::FinishActionList(ActionListState* s) {
+  if (s->incoming_rpc_state) {
+    if (!s->sent_response_early) {
+      s->incoming_rpc_state->SendResponseIfSet();
     }
-    incoming_rpc_state->FreeStateIfSet();
+    s->incoming_rpc_state->FreeStateIfSet();
   }
   // Merge the per-action-list logs into the overall logs:
-  if (s.action_list->has_rpcs) {
-    s.UnpackLatencySamples();
-    absl::MutexLock m(&s.action_mu);
-    for (size_t i = 0; i < s.peer_logs_.size(); ++i) {
-      for (size_t j = 0; j < s.peer_logs_[i].size(); ++j) {
-        if (s.peer_logs_[i][j].rpc_logs().empty()) continue;
+  if (s->action_list->has_rpcs) {
+    s->UnpackLatencySamples();
+    absl::MutexLock m(&s->action_mu);
+    for (size_t i = 0; i < s->peer_logs_.size(); ++i) {
+      for (size_t j = 0; j < s->peer_logs_[i].size(); ++j) {
+        if (s->peer_logs_[i][j].rpc_logs().empty()) continue;
         absl::MutexLock m(&peers_[i][j].mutex);
-        peers_[i][j].partial_logs.emplace_back(std::move(s.peer_logs_[i][j]));
+        peers_[i][j].partial_logs.emplace_back(std::move(s->peer_logs_[i][j]));
       }
     }
   }
 
-  absl::MutexLock m(&cumulative_activity_log_mu_);
-  s.UpdateActivitiesLog(&cumulative_activity_logs_);
-}
-
-void DistBenchEngine::ActionListState::FinishAction(int action_index) {
-  action_mu.Lock();
-  finished_action_indices.push_back(action_index);
-  atomic_fetch_sub_explicit(&pending_action_count_, 1,
-                            std::memory_order_relaxed);
-  action_mu.Unlock();
+  {
+    absl::MutexLock m(&cumulative_activity_log_mu_);
+    s->UpdateActivitiesLog(&cumulative_activity_logs_);
+    s->UpdatePacingLogs(&cumulative_pacing_logs_);
+  }
+  std::function<void()> done_callback = std::move(s->done_callback);
+  delete s;
+  done_callback();
+  RemoveRunningActionList();
 }
 
-bool DistBenchEngine::ActionListState::DidSomeActionsFinish() {
-  int pending_actions =
-      atomic_load_explicit(&pending_action_count_, std::memory_order_relaxed);
-  return !pending_actions || !finished_action_indices.empty();
-};
-
-void DistBenchEngine::ActionListState::HandleFinishedActions() {
-  if (!DidSomeActionsFinish()) {
-    LOG(FATAL) << "finished_action_indices is empty";
-  }
-  for (const auto& finished_action_index : finished_action_indices) {
-    state_table[finished_action_index].finished = true;
-    state_table[finished_action_index].next_iteration_time =
-        absl::InfiniteFuture();
+void DistBenchEngine::RemoveRunningActionList() {
+  if (--running_action_lists_ == 0) {
+    // Releasing the mutex makes the waiters check their condition again:
+    absl::MutexLock m(&running_action_lists_mu_);
   }
-  finished_action_indices.clear();
 }
 
-void DistBenchEngine::ActionListState::CancelActivities() {
-  for (int i = 0; i < action_list->proto.action_names_size(); ++i) {
-    auto action_state = &state_table[i];
-    if (action_state->action->proto.has_activity_config_name()) {
-      action_state->all_done_callback();
-      action_state->finished = true;
-    }
-  }
+void DistBenchEngine::WaitForRunningActionLists() {
+  auto none_running = [this]() { return running_action_lists_ == 0; };
+  absl::MutexLock m(&running_action_lists_mu_,
+                    absl::Condition(&none_running));
 }
 
 // Updates the activities_log_ map with the activity metrics from the
@@ -904,7 +1684,8 @@ void DistBenchEngine::ActionListState::UpdateActivitiesLog(
         cumulative_activity_logs) {
   for (int i = 0; i < action_list->proto.action_names_size(); ++i) {
     auto action_state = &state_table[i];
-    if (action_state->action->proto.has_activity_config_name()) {
+    if (action_state->started &&
+        action_state->action->proto.has_activity_config_name()) {
       auto activity_config_name =
           action_state->action->proto.activity_config_name();
       auto new_log = action_state->activity->GetActivityLog();
@@ -920,22 +1701,39 @@ void DistBenchEngine::ActionListState::UpdateActivitiesLog(
   }
 }
 
-void DistBenchEngine::ActionListState::WaitForAllPendingActions() {
-  auto some_actions_finished = [this]() { return DidSomeActionsFinish(); };
-  bool done;
-  do {
-    action_mu.LockWhen(absl::Condition(&some_actions_finished));
-    HandleFinishedActions();
-    done = true;
-    for (int i = 0; i < action_list->proto.action_names_size(); ++i) {
-      const auto& state = state_table[i];
-      if (state.started && !state.finished) {
-        done = false;
-        break;
-      }
-    }
-    action_mu.Unlock();
-  } while (!done);
+// Adds the schedule slip of the open loop actions to the pacing logs of the
+// engine.
+void DistBenchEngine::ActionListState::UpdatePacingLogs(
+    std::map<std::string, PacingLog>* cumulative_pacing_logs) {
+  for (int i = 0; i < action_list->proto.action_names_size(); ++i) {
+    auto& action_state = state_table[i];
+    if (!action_state.started) continue;
+    absl::MutexLock m(&action_state.iteration_mutex);
+    if (!action_state.paced_iterations) continue;
+    auto& pacing_log =
+        (*cumulative_pacing_logs)[action_state.action->proto.name()];
+    pacing_log.set_iterations(pacing_log.iterations() +
+                              action_state.paced_iterations);
+    pacing_log.set_behind_schedule_iterations(
+        pacing_log.behind_schedule_iterations() +
+        action_state.behind_schedule_iterations);
+    pacing_log.set_total_slip_ns(pacing_log.total_slip_ns() +
+                                 action_state.total_slip_ns);
+    pacing_log.set_max_slip_ns(
+        std::max(pacing_log.max_slip_ns(), action_state.max_slip_ns));
+  }
+}
+
+thread_local DistBenchEngine::ActionListState::ThreadSampleChunks
+    DistBenchEngine::ActionListState::thread_sample_chunks_;
+
+DistBenchEngine::ActionListState::~ActionListState() {
+  SampleChunk* chunk = sample_chunks_.load(std::memory_order_acquire);
+  while (chunk) {
+    SampleChunk* next = chunk->next;
+    delete chunk;
+    chunk = next;
+  }
 }
 
 void DistBenchEngine::ActionListState::UnpackLatencySamples() {
@@ -947,29 +1745,127 @@ void DistBenchEngine::ActionListState::UnpackLatencySamples() {
     std::sort(packed_samples_.get(),
               packed_samples_.get() + packed_samples_size_);
   }
-  for (size_t i = 0; i < packed_samples_size_; ++i) {
-    const auto& packed_sample = packed_samples_[i];
-    CHECK_LT(packed_sample.service_type, peer_logs_.size());
-    auto& service_log = peer_logs_[packed_sample.service_type];
-    CHECK_LT(packed_sample.instance, service_log.size());
-    auto& peer_log = service_log[packed_sample.instance];
-    auto& rpc_log = (*peer_log.mutable_rpc_logs())[packed_sample.rpc_index];
-    auto* sample = packed_sample.success ? rpc_log.add_successful_rpc_samples()
-                                         : rpc_log.add_failed_rpc_samples();
-    sample->set_request_size(packed_sample.request_size);
-    sample->set_response_size(packed_sample.response_size);
-    sample->set_start_timestamp_ns(packed_sample.start_timestamp_ns);
-    sample->set_latency_ns(packed_sample.latency_ns);
-    if (packed_sample.latency_weight) {
-      sample->set_latency_weight(packed_sample.latency_weight);
-    }
-    if (packed_sample.trace_context) {
-      *sample->mutable_trace_context() = *packed_sample.trace_context;
+  // Untraced samples are encoded as one RpcSampleColumns block per
+  // (service_type, instance, rpc_index), in completion order:
+  std::map<std::tuple<size_t, size_t, size_t>, RpcSampleColumnsWriter>
+      column_writers;
+  auto unpack = [&](const PackedLatencySample& packed_sample)
+                    ABSL_EXCLUSIVE_LOCKS_REQUIRED(action_mu) {
+    if (!columnar_samples_ || packed_sample.trace_context ||
+        packed_sample.stage_timings) {
+      UnpackLatencySample(packed_sample);
+      return;
     }
-    if (packed_sample.warmup) {
-      sample->set_warmup(true);
+    ColumnarSample sample;
+    sample.start_timestamp_ns = packed_sample.start_timestamp_ns;
+    sample.latency_ns = packed_sample.latency_ns;
+    sample.latency_weight = packed_sample.latency_weight;
+    sample.request_size = packed_sample.request_size;
+    sample.response_size = packed_sample.response_size;
+    sample.success = packed_sample.success;
+    sample.warmup = packed_sample.warmup;
+    sample.server_processing_ns = packed_sample.server_processing_ns;
+    column_writers[{packed_sample.service_type, packed_sample.instance,
+                    packed_sample.rpc_index}]
+        .Add(sample);
+  };
+  for (size_t i = 0; i < packed_samples_size_; ++i) {
+    unpack(packed_samples_[i]);
+  }
+
+  // All the RPCs have completed by now, so the chunks are no longer written.
+  std::vector<const PackedLatencySample*> chunked_samples;
+  for (SampleChunk* chunk = sample_chunks_.load(std::memory_order_acquire);
+       chunk; chunk = chunk->next) {
+    for (size_t i = 0; i < chunk->size; ++i) {
+      chunked_samples.push_back(&chunk->samples[i]);
     }
   }
+  // Keep the samples in completion order, as if they were recorded serially:
+  std::sort(chunked_samples.begin(), chunked_samples.end(),
+            [](const PackedLatencySample* a, const PackedLatencySample* b) {
+              return *a < *b;
+            });
+  for (const auto* packed_sample : chunked_samples) {
+    unpack(*packed_sample);
+  }
+
+  for (auto& [key, writer] : column_writers) {
+    auto [service_type, instance, rpc_index] = key;
+    CHECK_LT(service_type, peer_logs_.size());
+    CHECK_LT(instance, peer_logs_[service_type].size());
+    auto& rpc_log =
+        (*peer_logs_[service_type][instance].mutable_rpc_logs())[rpc_index];
+    *rpc_log.add_sample_columns() = writer.Finish();
+  }
+}
+
+void DistBenchEngine::ActionListState::UnpackLatencySample(
+    const PackedLatencySample& packed_sample) {
+  CHECK_LT(packed_sample.service_type, peer_logs_.size());
+  auto& service_log = peer_logs_[packed_sample.service_type];
+  CHECK_LT(packed_sample.instance, service_log.size());
+  auto& peer_log = service_log[packed_sample.instance];
+  auto& rpc_log = (*peer_log.mutable_rpc_logs())[packed_sample.rpc_index];
+  auto* sample = packed_sample.success ? rpc_log.add_successful_rpc_samples()
+                                       : rpc_log.add_failed_rpc_samples();
+  sample->set_request_size(packed_sample.request_size);
+  sample->set_response_size(packed_sample.response_size);
+  sample->set_start_timestamp_ns(packed_sample.start_timestamp_ns);
+  sample->set_latency_ns(packed_sample.latency_ns);
+  if (packed_sample.latency_weight) {
+    sample->set_latency_weight(packed_sample.latency_weight);
+  }
+  if (packed_sample.trace_context) {
+    *sample->mutable_trace_context() = *packed_sample.trace_context;
+  }
+  if (packed_sample.stage_timings) {
+    *sample->mutable_stage_timings() = *packed_sample.stage_timings;
+  }
+  if (packed_sample.server_processing_ns >= 0) {
+    sample->set_server_processing_ns(packed_sample.server_processing_ns);
+  }
+  if (packed_sample.warmup) {
+    sample->set_warmup(true);
+  }
+}
+
+// Returns the chunk that the current thread should append its next sample
+// to, allocating a new one if needed.
+DistBenchEngine::SampleChunk*
+DistBenchEngine::ActionListState::GetThreadSampleChunk() {
+  ThreadSampleChunks& cache = thread_sample_chunks_;
+  auto it = cache.chunks.find(sample_chunks_owner_id_);
+  size_t capacity = kMinSampleChunkSize;
+  if (it != cache.chunks.end()) {
+    SampleChunk* cached = it->second.chunk;
+    if (cached->size < cached->capacity) return cached;
+    capacity = std::min(cached->capacity * 2, kMaxSampleChunkSize);
+  } else {
+    if (cache.chunks.size() >= cache.sweep_size) {
+      for (auto entry = cache.chunks.begin(); entry != cache.chunks.end();) {
+        if (entry->second.owner_alive.expired()) {
+          cache.chunks.erase(entry++);
+        } else {
+          ++entry;
+        }
+      }
+      cache.sweep_size =
+          std::max(kMinThreadSampleChunksSweepSize, 2 * cache.chunks.size());
+    }
+    it = cache.chunks
+             .try_emplace(sample_chunks_owner_id_,
+                          ThreadSampleChunk{nullptr, sample_chunks_alive_})
+             .first;
+  }
+  auto* chunk = new SampleChunk(capacity);
+  chunk->next = sample_chunks_.load(std::memory_order_relaxed);
+  while (!sample_chunks_.compare_exchange_weak(chunk->next, chunk,
+                                               std::memory_order_release,
+                                               std::memory_order_relaxed)) {
+  }
+  it->second.chunk = chunk;
+  return chunk;
 }
 
 void DistBenchEngine::ActionListState::RecordLatency(size_t rpc_index,
@@ -982,97 +1878,93 @@ void DistBenchEngine::ActionListState::RecordLatency(size_t rpc_index,
     const size_t sample_number = atomic_fetch_add_explicit(
         &packed_sample_number_, 1UL, std::memory_order_relaxed);
     size_t index = sample_number;
-    if (index < packed_samples_size_) {
-      RecordPackedLatency(sample_number, index, rpc_index, service_type,
-                          instance, state);
-      atomic_fetch_sub_explicit(&remaining_initial_samples_, 1UL,
-                                std::memory_order_release);
-      return;
-    }
-    // Simple Reservoir Sampling:
-    absl::BitGen bitgen;
-    index = absl::Uniform(absl::IntervalClosedClosed, bitgen, 0UL, index);
     if (index >= packed_samples_size_) {
-      // Histogram per [rpc_index, service] would be ideal here:
-      // Also client rpc state could point to the destination stats instead
-      // of requiring us to look them up below.
-      // dropped_rpc_count_ += 1;
-      // dropped_rpc_total_latency_ += latency
-      // dropped_rpc_request_size_ += state->request.payload().size();
-      // dropped_rpc_response_size_ += state->response.payload().size();
-      return;
-    }
-    // Wait until all initial samples are done:
-    while (atomic_load_explicit(&remaining_initial_samples_,
-                                std::memory_order_acquire)) {
+      // Simple Reservoir Sampling:
+      index = absl::Uniform(absl::IntervalClosedClosed, reservoir_bitgen, 0UL,
+                            index);
+      if (index >= packed_samples_size_) {
+        // Dropped samples are still accounted for by the latency histograms
+        // of the client rpc, see RecordRpcInHistogram.
+        return;
+      }
     }
-    // Reservoir samples are serialized.
-    absl::MutexLock m(&reservoir_sample_lock_);
+    // A slot may be claimed by a later sample before the sample that first
+    // filled it is written, so the most recent sample always wins:
+    LockSampleSlot(packed_sample_locks_[index]);
     PackedLatencySample& packed_sample = packed_samples_[index];
-    if (packed_sample.sample_number < sample_number) {
+    if (packed_sample.sample_number == kEmptySampleSlot ||
+        packed_sample.sample_number < sample_number) {
       // Without arena allocation, via sample_arena_ we would need to do:
       // delete packed_sample.trace_context;
-      RecordPackedLatency(sample_number, index, rpc_index, service_type,
-                          instance, state);
+      // delete packed_sample.stage_timings;
+      RecordPackedLatency(&packed_sample, sample_number, rpc_index,
+                          service_type, instance, state);
     }
+    UnlockSampleSlot(packed_sample_locks_[index]);
     return;
   }
 
-  // Without packed samples we can support any number of samples, but then we
-  // also have to grab a mutex for each sample, and may have to grow the
-  // underlying array while holding the mutex.
-  absl::MutexLock m(&action_mu);
-  CHECK_LT(service_type, peer_logs_.size());
-  auto& service_log = peer_logs_[service_type];
-  CHECK_LT(instance, service_log.size());
-  auto& peer_log = service_log[instance];
-  auto& rpc_log = (*peer_log.mutable_rpc_logs())[rpc_index];
-  auto* sample = state->success ? rpc_log.add_successful_rpc_samples()
-                                : rpc_log.add_failed_rpc_samples();
-  auto latency = state->end_time - state->start_time;
-  sample->set_start_timestamp_ns(absl::ToUnixNanos(state->start_time));
-  sample->set_latency_ns(absl::ToInt64Nanoseconds(latency));
-  if (state->prior_start_time != absl::InfinitePast()) {
-    sample->set_latency_weight(
-        absl::ToInt64Nanoseconds(state->start_time - state->prior_start_time));
-  }
-  sample->set_request_size(state->request.payload().size());
-  sample->set_response_size(state->response.payload().size());
-  if (state->request.warmup()) {
-    sample->set_warmup(true);
-  }
-  if (!state->request.trace_context().engine_ids().empty()) {
-    *sample->mutable_trace_context() =
-        std::move(state->request.trace_context());
-  }
+  // Without reservoir sampling we keep every sample, in chunks private to
+  // the completion thread, so neither a mutex nor a protobuf allocation is
+  // needed here:
+  SampleChunk* chunk = GetThreadSampleChunk();
+  RecordPackedLatency(&chunk->samples[chunk->size], 0, rpc_index, service_type,
+                      instance, state);
+  ++chunk->size;
 }
 
 void DistBenchEngine::ActionListState::RecordPackedLatency(
-    size_t sample_number, size_t index, size_t rpc_index, size_t service_type,
-    size_t instance, ClientRpcState* state) {
-  PackedLatencySample& packed_sample = packed_samples_[index];
+    PackedLatencySample* destination, size_t sample_number, size_t rpc_index,
+    size_t service_type, size_t instance, ClientRpcState* state) {
+  PackedLatencySample& packed_sample = *destination;
   packed_sample.sample_number = sample_number;
   packed_sample.trace_context = nullptr;
+  packed_sample.stage_timings = nullptr;
   packed_sample.rpc_index = rpc_index;
   packed_sample.service_type = service_type;
   packed_sample.instance = instance;
   packed_sample.success = state->success;
   packed_sample.warmup = state->request.warmup();
-  auto latency = state->end_time - state->start_time;
-  packed_sample.start_timestamp_ns = absl::ToUnixNanos(state->start_time);
+  const absl::Time start_time = MeasuredStartTime(*state);
+  auto latency = state->end_time - start_time;
+  packed_sample.start_timestamp_ns = absl::ToUnixNanos(start_time);
   packed_sample.latency_ns = absl::ToInt64Nanoseconds(latency);
   packed_sample.latency_weight = 0;
   if (state->prior_start_time != absl::InfinitePast()) {
     packed_sample.latency_weight =
-        absl::ToInt64Nanoseconds(state->start_time - state->prior_start_time);
+        absl::ToInt64Nanoseconds(start_time - state->prior_start_time);
   }
   packed_sample.request_size = state->request.payload().size();
   packed_sample.response_size = state->response.payload().size();
-  if (!state->request.trace_context().engine_ids().empty()) {
+  packed_sample.server_processing_ns =
+      state->success && state->response.has_server_processing_ns()
+          ? state->response.server_processing_ns()
+          : -1;
+  if (HasTrace(state->request.trace_context())) {
     packed_sample.trace_context =
         ::google::protobuf::Arena::CreateMessage<TraceContext>(&sample_arena_);
     *packed_sample.trace_context = state->request.trace_context();
   }
+  if (state->request.record_stage_timings() && state->success) {
+    RpcStageTimings* timings =
+        ::google::protobuf::Arena::CreateMessage<RpcStageTimings>(
+            &sample_arena_);
+    *timings = state->response.server_stage_timings();
+    auto since_start = [state](absl::Time t) {
+      return absl::ToInt64Nanoseconds(t - state->start_time);
+    };
+    if (state->serialize_done_time != absl::InfinitePast()) {
+      timings->set_serialize_done_ns(since_start(state->serialize_done_time));
+    }
+    if (state->sent_time != absl::InfinitePast()) {
+      timings->set_sent_ns(since_start(state->sent_time));
+    }
+    if (state->completion_dequeued_time != absl::InfinitePast()) {
+      timings->set_completion_dequeued_ns(
+          since_start(state->completion_dequeued_time));
+    }
+    packed_sample.stage_timings = timings;
+  }
 }
 
 void DistBenchEngine::RunAction(ActionState* action_state) {
@@ -1090,15 +1982,11 @@ void DistBenchEngine::RunAction(ActionState* action_state) {
           copied_server_rpc_state->have_dedicated_thread = true;
           copied_server_rpc_state->SetFreeStateFunction(
               [=] { delete copied_server_rpc_state; });
-          RunRegisteredThread(
-              "ActionListThread",
-              [this, action_list_index, iteration_state, copied_request,
-               copied_server_rpc_state]() mutable {
-                RunActionList(action_list_index, copied_server_rpc_state,
-                              iteration_state->warmup);
-                FinishIteration(iteration_state);
-              })
-              .detach();
+          StartActionList(action_list_index, copied_server_rpc_state,
+                          iteration_state->warmup,
+                          [this, iteration_state, copied_request]() {
+                            FinishIteration(iteration_state);
+                          });
         };
   } else if (action.rpc_service_index >= 0) {
     CHECK_LT(static_cast<size_t>(action.rpc_service_index), peers_.size());
@@ -1114,14 +2002,16 @@ void DistBenchEngine::RunAction(ActionState* action_state) {
         [this](std::shared_ptr<ActionIterationState> iteration_state) {
           RunRpcActionIteration(iteration_state);
         };
+    if (client_rpc_table_[action.rpc_index].churner) {
+      action_state->churns_connections = true;
+      StartConnectionChurn(action.rpc_index);
+    }
   } else if (action.proto.has_activity_config_name()) {
     auto* config = &stored_activity_config_[action.activity_config_index];
     action_state->activity = AllocateActivity(config);
     action_state->iteration_function =
-        [this,
-         action_state](std::shared_ptr<ActionIterationState> iteration_state) {
-          action_state->activity->DoActivity();
-          FinishIteration(iteration_state);
+        [this](std::shared_ptr<ActionIterationState> iteration_state) {
+          QueueActivityIteration(std::move(iteration_state));
         };
   } else {
     LOG(FATAL) << "Supporting only RPCs and Activities as of now.";
@@ -1150,8 +2040,9 @@ void DistBenchEngine::RunAction(ActionState* action_state) {
   action_state->iteration_limit = max_iterations;
   action_state->time_limit = time_limit;
   action_state->next_iteration = 0;
-  if (action_state->action->proto.has_activity_config_name()) {
-    action_state->next_iteration_time = absl::InfinitePast();
+  action_state->finished_iterations = 0;
+  if (open_loop) {
+    action_state->open_loop_rand_gen.seed((*action_state->rand_gen)());
   }
   action_state->iteration_mutex.Unlock();
 
@@ -1161,18 +2052,25 @@ void DistBenchEngine::RunAction(ActionState* action_state) {
         action_state->action->proto.iterations().open_loop_interval_ns());
     auto& interval_distribution = action_state->action->proto.iterations()
                                       .open_loop_interval_distribution();
+    absl::Time first_iteration_time = absl::InfiniteFuture();
     if (interval_distribution == "sync_burst") {
       absl::Duration start = clock_->Now() - absl::UnixEpoch();
-      action_state->next_iteration_time =
+      first_iteration_time =
           period + absl::UnixEpoch() + absl::Floor(start, period);
     } else if (interval_distribution == "sync_burst_spread") {
       absl::Duration start = clock_->Now() - absl::UnixEpoch();
       double nb_peers = peers_[action_state->rpc_service_index].size();
       double fraction = service_instance_ / nb_peers;
       LOG(INFO) << "sync_burst_spread burst delay: " << fraction * period;
-      action_state->next_iteration_time = period + absl::UnixEpoch() +
-                                          absl::Floor(start, period) +
-                                          fraction * period;
+      first_iteration_time = period + absl::UnixEpoch() +
+                             absl::Floor(start, period) + fraction * period;
+    }
+    if (first_iteration_time != absl::InfiniteFuture()) {
+      action_state->iteration_mutex.Lock();
+      action_state->next_iteration_time = first_iteration_time;
+      action_state->open_loop_timer_armed = true;
+      action_state->iteration_mutex.Unlock();
+      ArmOpenLoopTimer(action_state, first_iteration_time);
     } else {
       action_state->next_iteration_time = clock_->Now();
       StartOpenLoopIteration(action_state);
@@ -1193,24 +2091,166 @@ void DistBenchEngine::RunAction(ActionState* action_state) {
 }
 
 void DistBenchEngine::StartOpenLoopIteration(ActionState* action_state) {
-  absl::Duration period = absl::Nanoseconds(
-      action_state->action->proto.iterations().open_loop_interval_ns());
-  auto it_state = std::make_shared<ActionIterationState>();
-  it_state->action_state = action_state;
+  const auto& iterations = action_state->action->proto.iterations();
+  const int64_t interval_ns = iterations.open_loop_interval_ns();
+  std::shared_ptr<ActionIterationState> it_state;
+  absl::Time now = clock_->Now();
   action_state->iteration_mutex.Lock();
-  action_state->next_iteration_time += period;
-  if (action_state->next_iteration_time > action_state->time_limit) {
+  if (!action_state->idle_iteration_states.empty()) {
+    it_state = std::move(action_state->idle_iteration_states.back());
+    action_state->idle_iteration_states.pop_back();
+  }
+  int64_t slip_ns = std::max<int64_t>(
+      0, absl::ToInt64Nanoseconds(now - action_state->next_iteration_time));
+  ++action_state->paced_iterations;
+  if (slip_ns >= interval_ns) {
+    ++action_state->behind_schedule_iterations;
+  }
+  action_state->total_slip_ns += slip_ns;
+  action_state->max_slip_ns = std::max(action_state->max_slip_ns, slip_ns);
+  const int iteration_number = action_state->next_iteration++;
+  const absl::Time due_time = action_state->next_iteration_time;
+  // The schedule is kept in absolute time, so an iteration that started
+  // late does not delay the following ones:
+  absl::Duration schedule_interval = absl::Nanoseconds(interval_ns);
+  if (iterations.open_loop_interval_distribution() == "exponential") {
+    std::exponential_distribution<double> interval(1.0 / interval_ns);
+    schedule_interval =
+        absl::Nanoseconds(interval(action_state->open_loop_rand_gen));
+  }
+  action_state->next_iteration_time += schedule_interval;
+  if (action_state->next_iteration_time > action_state->time_limit ||
+      action_state->next_iteration == action_state->iteration_limit) {
     action_state->next_iteration_time = absl::InfiniteFuture();
   }
-  it_state->iteration_number = action_state->next_iteration++;
+  absl::Time next_iteration_time = action_state->next_iteration_time;
+  action_state->open_loop_timer_armed =
+      next_iteration_time != absl::InfiniteFuture();
   action_state->iteration_mutex.Unlock();
+  if (next_iteration_time != absl::InfiniteFuture()) {
+    ArmOpenLoopTimer(action_state, next_iteration_time);
+  }
+  if (!it_state) {
+    it_state = std::make_shared<ActionIterationState>();
+    it_state->action_state = action_state;
+  }
+  it_state->iteration_number = iteration_number;
+  it_state->due_time = due_time;
+  it_state->schedule_interval = schedule_interval;
   StartIteration(it_state);
 }
 
-void DistBenchEngine::RunActivity(ActionState* action_state) {
-  auto it_state = std::make_shared<ActionIterationState>();
-  it_state->action_state = action_state;
-  StartIteration(it_state);
+void DistBenchEngine::ArmOpenLoopTimer(ActionState* action_state,
+                                       absl::Time deadline) {
+  absl::MutexLock m(&open_loop_timer_mu_);
+  if (!open_loop_timer_thread_.joinable()) {
+    open_loop_timer_thread_ = RunClockedThread(
+        "OpenLoopPacer", [this]() { RunOpenLoopTimers(); });
+  }
+  if (open_loop_timers_.empty() ||
+      deadline < open_loop_timers_.top().deadline) {
+    open_loop_timers_changed_ = true;
+  }
+  open_loop_timers_.push({deadline, action_state});
+}
+
+void DistBenchEngine::RunOpenLoopTimers() {
+  // A simulated clock would not advance during the spin:
+  const absl::Duration spin_window =
+      clock_->IsSimulated() ? absl::ZeroDuration() : kOpenLoopSpinWindow;
+  absl::Time deadline = absl::InfiniteFuture();
+  std::vector<ActionState*> due_actions;
+  while (true) {
+    clock_->MutexLockWhenWithDeadline(
+        &open_loop_timer_mu_, absl::Condition(&open_loop_timers_changed_),
+        deadline - spin_window);
+    open_loop_timers_changed_ = false;
+    if (open_loop_timers_shutdown_) {
+      open_loop_timer_mu_.Unlock();
+      return;
+    }
+    // All the timers fire at once when the traffic is canceled:
+    bool canceled = canceled_->HasBeenNotified();
+    absl::Time now = clock_->Now();
+    if (!canceled && !open_loop_timers_.empty() &&
+        open_loop_timers_.top().deadline > now &&
+        open_loop_timers_.top().deadline - now <= spin_window) {
+      // A timer armed meanwhile for an earlier deadline waits for the end of
+      // the spin, i.e. at most a kOpenLoopSpinWindow late:
+      absl::Time spin_deadline = open_loop_timers_.top().deadline;
+      open_loop_timer_mu_.Unlock();
+      while ((now = clock_->Now()) < spin_deadline) {
+      }
+      open_loop_timer_mu_.Lock();
+      canceled = canceled_->HasBeenNotified();
+    }
+    while (!open_loop_timers_.empty() &&
+           (canceled || open_loop_timers_.top().deadline <= now)) {
+      due_actions.push_back(open_loop_timers_.top().action_state);
+      open_loop_timers_.pop();
+    }
+    deadline = open_loop_timers_.empty() ? absl::InfiniteFuture()
+                                         : open_loop_timers_.top().deadline;
+    open_loop_timer_mu_.Unlock();
+    for (ActionState* action_state : due_actions) {
+      FireOpenLoopTimer(action_state);
+    }
+    due_actions.clear();
+  }
+}
+
+void DistBenchEngine::FireOpenLoopTimer(ActionState* action_state) {
+  action_state->iteration_mutex.Lock();
+  action_state->open_loop_timer_armed = false;
+  if (canceled_->HasBeenNotified()) {
+    action_state->next_iteration_time = absl::InfiniteFuture();
+    // Otherwise, the last pending iteration finishes the action:
+    bool idle =
+        action_state->next_iteration == action_state->finished_iterations;
+    action_state->iteration_mutex.Unlock();
+    if (idle) {
+      action_state->all_done_callback();
+    }
+    return;
+  }
+  action_state->iteration_mutex.Unlock();
+  StartOpenLoopIteration(action_state);
+}
+
+// Hands the iteration to the activity threadpool, as the thread that started
+// it may be one that many RPCs wait on. The simulated clock is held until the
+// iteration is done, since the CPU time of the activities takes no virtual
+// time.
+void DistBenchEngine::QueueActivityIteration(
+    std::shared_ptr<ActionIterationState> iteration_state) {
+  clock_->HoldForNewThread();
+  absl::MutexLock m(&activity_threadpool_mu_);
+  if (!activity_threadpool_) {
+    ThreadPlacerScope placer_scope(thread_placer_);
+    auto maybe_threadpool =
+        CreateThreadpool("", absl::base_internal::NumCPUs(),
+                         {WaitPolicy::kBlock, /*spin_budget=*/0});
+    CHECK(maybe_threadpool.ok()) << maybe_threadpool.status();
+    activity_threadpool_ = std::move(maybe_threadpool.value());
+  }
+  activity_threadpool_->AddWork(
+      [this, clock = clock_,
+       iteration_state = std::move(iteration_state)]() mutable {
+        clock->AdoptHold();
+        RunActivityIteration(std::move(iteration_state));
+        clock->Release();
+      });
+}
+
+void DistBenchEngine::RunActivityIteration(
+    std::shared_ptr<ActionIterationState> iteration_state) {
+  const ActionState* state = iteration_state->action_state;
+  if (!canceled_->HasBeenNotified() &&
+      stored_activity_config_[state->action->activity_config_index]
+          .runs_on_this_instance) {
+    state->activity->DoActivity();
+  }
+  FinishIteration(std::move(iteration_state));
 }
 
 void DistBenchEngine::FinishIteration(
@@ -1219,7 +2259,7 @@ void DistBenchEngine::FinishIteration(
   bool open_loop =
       state->action->proto.iterations().has_open_loop_interval_ns();
   bool start_another_iteration = !open_loop;
-  bool done = canceled_.HasBeenNotified();
+  bool done = canceled_->HasBeenNotified();
   state->iteration_mutex.Lock();
   ++state->finished_iterations;
   if (state->next_iteration == state->iteration_limit) {
@@ -1240,15 +2280,22 @@ void DistBenchEngine::FinishIteration(
       start_another_iteration = false;
     }
   }
-  if (start_another_iteration && !done) {
+  if (done) {
+    start_another_iteration = false;
+  } else if (start_another_iteration) {
     iteration_state->iteration_number = state->next_iteration++;
   }
+  if (open_loop) {
+    state->idle_iteration_states.push_back(std::move(iteration_state));
+  }
   int pending_iterations = state->next_iteration - state->finished_iterations;
+  // A pending open loop timer still needs the action:
+  bool finished =
+      done && !pending_iterations && !state->open_loop_timer_armed;
   state->iteration_mutex.Unlock();
-  if (done && !pending_iterations) {
+  if (finished) {
     state->all_done_callback();
-  } else if (!state->action->proto.has_activity_config_name() &&
-             start_another_iteration) {
+  } else if (start_another_iteration) {
     StartIteration(iteration_state);
   }
 }
@@ -1268,161 +2315,489 @@ void DistBenchEngine::RunRpcActionIteration(
     std::shared_ptr<ActionIterationState> iteration_state) {
   ActionState* action_state = iteration_state->action_state;
   // Pick the subset of the target service instances to fanout to:
-  std::vector<int> current_targets = PickRpcFanoutTargets(action_state);
-  iteration_state->rpc_states.resize(current_targets.size());
+  absl::Span<const int> current_targets =
+      PickRpcFanoutTargets(action_state, &iteration_state->fanout_targets);
+  auto& rpc_states = iteration_state->rpc_states;
+  if (rpc_states.size() < std::max<size_t>(current_targets.size(), 1)) {
+    rpc_states.resize(std::max<size_t>(current_targets.size(), 1));
+  }
   iteration_state->remaining_rpcs = current_targets.size();
 
   // Setup tracing:
   const int rpc_index = action_state->rpc_index;
   const auto& rpc_def = client_rpc_table_[rpc_index].rpc_definition;
   const auto& rpc_spec = rpc_def.rpc_spec;
+  const bool open_loop =
+      action_state->action->proto.iterations().has_open_loop_interval_ns();
   bool do_trace = false;
   int trace_count = client_rpc_table_[rpc_index].rpc_tracing_counter++;
   if (rpc_spec.tracing_interval() > 0) {
     do_trace = (trace_count % rpc_spec.tracing_interval()) == 0;
   }
-  GenericRequest common_request;
+  // The request template already carries the rpc_index and (for fixed size
+  // RPCs) the payload. The request of the iteration is built from it once,
+  // in place of the request of the last target, whose buffers it reuses, and
+  // copied for the other targets.
+  GenericRequest& common_request =
+      rpc_states[std::max<size_t>(current_targets.size(), 1) - 1].request;
+  common_request = client_rpc_table_[rpc_index].request_table[0];
+  common_request.set_warmup(iteration_state->warmup);
+  TraceContext common_trace_context;
   const ServerRpcState* const incoming_rpc_state =
       action_state->action_list_state->incoming_rpc_state;
-  if (!incoming_rpc_state->request->trace_context().engine_ids().empty()) {
-    *common_request.mutable_trace_context() =
-        incoming_rpc_state->request->trace_context();
+  const TraceContext& incoming_trace_context =
+      incoming_rpc_state->request->trace_context();
+  if (incoming_trace_context.has_span_id()) {
+    // The RPCs sent by the handler of a compact trace are children of the
+    // incoming span:
+    common_trace_context.set_trace_id_high(
+        incoming_trace_context.trace_id_high());
+    common_trace_context.set_trace_id_low(
+        incoming_trace_context.trace_id_low());
+    common_trace_context.set_parent_span_id(incoming_trace_context.span_id());
+    common_trace_context.set_depth(incoming_trace_context.depth() + 1);
+  } else if (!incoming_trace_context.engine_ids().empty()) {
+    common_trace_context = incoming_trace_context;
+  } else if (do_trace && rpc_spec.compact_tracing()) {
+    common_trace_context.set_trace_id_high(
+        absl::Uniform<uint64_t>(trace_bitgen));
+    common_trace_context.set_trace_id_low(
+        absl::Uniform<uint64_t>(trace_bitgen));
+    common_trace_context.set_parent_span_id(0);
+    common_trace_context.set_depth(0);
   } else if (do_trace) {
-    common_request.mutable_trace_context()->add_engine_ids(trace_id_);
-    common_request.mutable_trace_context()->add_iterations(
-        iteration_state->iteration_number);
-  }
-  common_request.set_rpc_index(rpc_index);
-  common_request.set_warmup(iteration_state->warmup);
-
-  if (rpc_def.sample_generator_index == -1) {
-    common_request.set_payload(std::string(rpc_def.request_payload_size, 'D'));
-
-  } else {
-    auto sample = sample_generator_array_[rpc_def.sample_generator_index]
-                      ->GetRandomSample(action_state->rand_gen);
-
-    if (sample[kRequestPayloadSize] != -1) {
-      common_request.set_payload(std::string(sample[kRequestPayloadSize], 'D'));
-    }
-
+    common_trace_context.add_engine_ids(trace_id_);
+    common_trace_context.add_iterations(iteration_state->iteration_number);
+  }
+  const bool compact_trace = common_trace_context.has_depth();
+
+  if (rpc_def.sample_generator_index != -1) {
+    // Canonical configs have exactly kMaxFieldNames dimensions:
+    int sample[kMaxFieldNames];
+    sample_generator_array_[rpc_def.sample_generator_index]->GetRandomSample(
+        absl::MakeSpan(sample));
+    // Canonical configs leave the fields the config omits at -1, and these
+    // sizes then come from the PayloadSpecs, as for fixed size RPCs:
+    FillPayload(common_request.mutable_payload(),
+                sample[kRequestPayloadSize] != -1
+                    ? sample[kRequestPayloadSize]
+                    : rpc_def.request_payload_size,
+                *rpc_def.request_payload_content);
     if (sample[kResponsePayloadSize] != -1) {
       common_request.set_response_payload_size(sample[kResponsePayloadSize]);
     }
   }
+  if (compact_trace || !common_trace_context.engine_ids().empty()) {
+    *common_request.mutable_trace_context() = common_trace_context;
+  }
 
   const int rpc_service_index = action_state->rpc_service_index;
   const auto& servers = peers_[rpc_service_index];
   for (size_t i = 0; i < current_targets.size(); ++i) {
     int peer_instance = current_targets[i];
-    ClientRpcState* rpc_state;
-    {
-      absl::MutexLock m(&peers_[rpc_service_index][peer_instance].mutex);
-      rpc_state = &iteration_state->rpc_states[i];
+    // The requests only differ by their trace context, and the last target
+    // has the common request itself. trace_id is immutable once the peers
+    // are connected, so no lock is needed.
+    ClientRpcState* rpc_state = &rpc_states[i];
+    if (i + 1 != current_targets.size()) {
       rpc_state->request = common_request;
-      if (!common_request.trace_context().engine_ids().empty()) {
-        rpc_state->request.mutable_trace_context()->add_engine_ids(
-            peers_[rpc_service_index][peer_instance].trace_id);
-        rpc_state->request.mutable_trace_context()->add_iterations(i);
-      }
-      CHECK_EQ(rpc_state->request.trace_context().engine_ids().size(),
-               rpc_state->request.trace_context().iterations().size());
-    }  // End of MutexLock m
-    rpc_state->prior_start_time = rpc_state->start_time;
+    }
+    if (compact_trace) {
+      rpc_state->request.mutable_trace_context()->set_span_id(NewSpanId());
+    } else if (!common_trace_context.engine_ids().empty()) {
+      rpc_state->request.mutable_trace_context()->add_engine_ids(
+          servers[peer_instance].trace_id);
+      rpc_state->request.mutable_trace_context()->add_iterations(i);
+    }
+    CHECK_EQ(rpc_state->request.trace_context().engine_ids().size(),
+             rpc_state->request.trace_context().iterations().size());
+    // The closed loop RPCs are weighted by the time since the prior RPC of
+    // their slot, and the open loop ones by their schedule interval, see
+    // RecordPackedLatency:
+    if (open_loop) {
+      rpc_state->due_time = iteration_state->due_time;
+      rpc_state->prior_start_time =
+          iteration_state->due_time - iteration_state->schedule_interval;
+    } else {
+      rpc_state->prior_start_time = rpc_state->start_time;
+    }
+    rpc_state->serialize_done_time = absl::InfinitePast();
+    rpc_state->sent_time = absl::InfinitePast();
+    rpc_state->completion_dequeued_time = absl::InfinitePast();
     rpc_state->start_time = clock_->Now();
-    pd_->InitiateRpc(
-        servers[peer_instance].pd_id, rpc_state,
-        [this, rpc_state, iteration_state, peer_instance]() mutable {
+    client_rpc_table_[rpc_index].pending_requests_per_peer[peer_instance]
+        .fetch_add(1, std::memory_order_relaxed);
+    // The RPC overlaps a reconnect if one was still going on when it
+    // started, or started before it completed:
+    const int64_t reconnects_finished =
+        has_connection_churn_
+            ? servers[peer_instance].reconnects_finished.load()
+            : 0;
+    std::function<void()> done_callback =
+        [this, rpc_state, iteration_state, peer_instance,
+         reconnects_finished]() mutable {
           ActionState* action_state = iteration_state->action_state;
           rpc_state->end_time = clock_->Now();
+          auto& client_rpc = client_rpc_table_[action_state->rpc_index];
+          client_rpc.pending_requests_per_peer[peer_instance].fetch_sub(
+              1, std::memory_order_relaxed);
+          RecordRpcInHistogram(&client_rpc.latency_histograms[peer_instance],
+                               *rpc_state);
+          if (has_connection_churn_ &&
+              peers_[action_state->rpc_service_index][peer_instance]
+                      .reconnects_started.load() > reconnects_finished) {
+            RecordRpcInHistogram(
+                &client_rpc.reconnect_overlap_histograms[peer_instance],
+                *rpc_state);
+          }
           action_state->action_list_state->RecordLatency(
               action_state->rpc_index, action_state->rpc_service_index,
               peer_instance, rpc_state);
           if (--iteration_state->remaining_rpcs == 0) {
             FinishIteration(iteration_state);
           }
-        });
+        };
+    if (client_rpc_table_[rpc_index].batcher) {
+      InitiateBatchedRpc(rpc_index, peer_instance, rpc_state,
+                         std::move(done_callback));
+    } else {
+      pd_->InitiateRpc(servers[peer_instance].pd_id, rpc_state,
+                       std::move(done_callback));
+    }
   }
 }
 
-// Return a vector of service instances, which have to be translated to
-// protocol_drivers endpoint ids by the caller.
-std::vector<int> DistBenchEngine::PickRpcFanoutTargets(
-    ActionState* action_state) {
+// The churn thread of an rpc runs while at least one action sends it, and
+// is started again by the next action once it exits.
+void DistBenchEngine::StartConnectionChurn(int rpc_index) {
+  ConnectionChurner& churner = *client_rpc_table_[rpc_index].churner;
+  std::thread exited_thread;
+  {
+    absl::MutexLock m(&churner.mu);
+    ++churner.running_actions;
+    if (churner.thread_running || churner.shutdown) return;
+    churner.thread_running = true;
+    exited_thread = std::move(churner.thread);
+    churner.thread = RunClockedThread(
+        "ConnectionChurn",
+        [this, rpc_index]() { RunConnectionChurn(rpc_index); });
+  }
+  if (exited_thread.joinable()) exited_thread.join();
+}
+
+void DistBenchEngine::StopConnectionChurn(int rpc_index) {
+  ConnectionChurner& churner = *client_rpc_table_[rpc_index].churner;
+  absl::MutexLock m(&churner.mu);
+  --churner.running_actions;
+}
+
+void DistBenchEngine::ShutdownConnectionChurn() {
+  if (!client_rpc_table_) return;
+  for (int i = 0; i < traffic_config_.rpc_descriptions_size(); ++i) {
+    ConnectionChurner* churner = client_rpc_table_[i].churner.get();
+    if (!churner) continue;
+    {
+      absl::MutexLock m(&churner->mu);
+      churner->shutdown = true;
+    }
+    if (churner->thread.joinable()) churner->thread.join();
+  }
+}
+
+// Reconnects the peers one at a time, round robin, so that each connection
+// is re-established every 1 / connection_churn_rate seconds. Reconnects
+// slower than that delay the next ones rather than overlapping them.
+void DistBenchEngine::RunConnectionChurn(int rpc_index) {
+  const SimulatedClientRpc& client_rpc = client_rpc_table_[rpc_index];
+  ConnectionChurner& churner = *client_rpc.churner;
+  auto stopping = [&churner]() {
+    return churner.running_actions == 0 || churner.shutdown;
+  };
+  std::vector<PeerMetadata*> targets;
+  for (auto& server : peers_[client_rpc.service_index]) {
+    if (server.pd_id >= 0) targets.push_back(&server);
+  }
+  absl::Time next_reconnect = absl::InfiniteFuture();
+  absl::Duration interval;
+  if (!targets.empty()) {
+    interval = absl::Seconds(
+        1 / (client_rpc.rpc_definition.rpc_spec.connection_churn_rate() *
+             targets.size()));
+    next_reconnect = clock_->Now() + interval;
+  }
+  for (size_t i = 0;; ++i) {
+    clock_->MutexLockWhenWithDeadline(&churner.mu, absl::Condition(&stopping),
+                                      next_reconnect);
+    if (stopping()) {
+      churner.thread_running = false;
+      churner.mu.Unlock();
+      return;
+    }
+    churner.mu.Unlock();
+    PeerMetadata& peer = *targets[i % targets.size()];
+    ConnectionChurnEvent reconnect;
+    reconnect.set_peer(peer.log_name);
+    const absl::Time start = clock_->Now();
+    ++peer.reconnects_started;
+    pd_->ChurnConnection(peer.pd_id);
+    ++peer.reconnects_finished;
+    const absl::Time end = clock_->Now();
+    reconnect.set_start_timestamp_ns(absl::ToUnixNanos(start));
+    reconnect.set_reconnect_latency_ns(absl::ToInt64Nanoseconds(end - start));
+    {
+      absl::MutexLock m(&churner.mu);
+      churner.reconnects.push_back(std::move(reconnect));
+    }
+    next_reconnect = std::max(next_reconnect + interval, end);
+  }
+}
+
+void DistBenchEngine::InitiateBatchedRpc(int rpc_index, int peer_instance,
+                                         ClientRpcState* state,
+                                         std::function<void()> done_callback) {
+  RpcBatcher& batcher = *client_rpc_table_[rpc_index].batcher;
+  const auto& rpc_spec = client_rpc_table_[rpc_index].rpc_definition.rpc_spec;
+  std::vector<BatchedRpc> full_batch;
+  {
+    absl::MutexLock m(&batcher.mu);
+    auto& batch = batcher.open_batches[peer_instance];
+    batch.rpcs.push_back({state, std::move(done_callback)});
+    if (batcher.shutdown ||
+        batch.rpcs.size() >= static_cast<size_t>(rpc_spec.batch_size())) {
+      full_batch = TakeRpcBatch(&batcher, peer_instance);
+    } else if (batch.rpcs.size() == 1) {
+      if (!batcher.thread_running) {
+        batcher.thread_running = true;
+        batcher.thread = RunClockedThread(
+            "RpcBatcher", [this, rpc_index]() { RunRpcBatcher(rpc_index); });
+      }
+      // Later deadlines do not change the wait of the batcher thread:
+      batcher.flush_timers_changed |= batcher.flush_timers.empty();
+      batcher.flush_timers.push_back(
+          {clock_->Now() + absl::Microseconds(rpc_spec.batch_delay_us()),
+           peer_instance, batch.generation});
+    }
+  }
+  if (!full_batch.empty()) {
+    SendRpcBatch(rpc_index, peer_instance, std::move(full_batch));
+  }
+}
+
+std::vector<DistBenchEngine::BatchedRpc> DistBenchEngine::TakeRpcBatch(
+    RpcBatcher* batcher, int peer_instance) {
+  auto& batch = batcher->open_batches[peer_instance];
+  std::vector<BatchedRpc> rpcs;
+  rpcs.swap(batch.rpcs);
+  ++batch.generation;
+  ++batch.sizes[rpcs.size()];
+  return rpcs;
+}
+
+// A batch of one is sent as a regular RPC. Otherwise the requests are moved
+// into the batch and back once it completes, and every RPC of the batch ends
+// at the same time, with the same status.
+void DistBenchEngine::SendRpcBatch(int rpc_index, int peer_instance,
+                                   std::vector<BatchedRpc> rpcs) {
+  const int pd_id =
+      peers_[client_rpc_table_[rpc_index].service_index][peer_instance].pd_id;
+  if (rpcs.size() == 1) {
+    pd_->InitiateRpc(pd_id, rpcs[0].state, std::move(rpcs[0].done_callback));
+    return;
+  }
+  auto* batch_state = new ClientRpcState;
+  batch_state->request.set_rpc_index(rpc_index);
+  batch_state->request.set_record_stage_timings(
+      rpcs[0].state->request.record_stage_timings());
+  for (auto& rpc : rpcs) {
+    batch_state->request.add_batched_requests()->Swap(&rpc.state->request);
+  }
+  batch_state->start_time = clock_->Now();
+  pd_->InitiateRpc(pd_id, batch_state,
+                   [batch_state, rpcs = std::move(rpcs)]() {
+                     auto& responses =
+                         *batch_state->response.mutable_batched_responses();
+                     const bool success =
+                         batch_state->success &&
+                         static_cast<size_t>(responses.size()) == rpcs.size();
+                     for (size_t i = 0; i < rpcs.size(); ++i) {
+                       ClientRpcState* state = rpcs[i].state;
+                       state->request.Swap(
+                           batch_state->request.mutable_batched_requests(i));
+                       state->success = success;
+                       state->response.Clear();
+                       if (success) state->response.Swap(&responses[i]);
+                       state->serialize_done_time =
+                           batch_state->serialize_done_time;
+                       state->sent_time = batch_state->sent_time;
+                       state->completion_dequeued_time =
+                           batch_state->completion_dequeued_time;
+                       rpcs[i].done_callback();
+                     }
+                     delete batch_state;
+                   });
+}
+
+// Sends the batches that did not fill up within batch_delay_us, until the
+// batcher shuts down.
+void DistBenchEngine::RunRpcBatcher(int rpc_index) {
+  RpcBatcher& batcher = *client_rpc_table_[rpc_index].batcher;
+  absl::Time deadline = absl::InfiniteFuture();
+  std::vector<std::pair<int, std::vector<BatchedRpc>>> due_batches;
+  while (true) {
+    clock_->MutexLockWhenWithDeadline(
+        &batcher.mu, absl::Condition(&batcher.flush_timers_changed),
+        deadline);
+    batcher.flush_timers_changed = false;
+    const bool shutdown = batcher.shutdown;
+    const absl::Time now = clock_->Now();
+    while (!batcher.flush_timers.empty() &&
+           (shutdown || batcher.flush_timers.front().deadline <= now)) {
+      const auto& timer = batcher.flush_timers.front();
+      // The batch may have been sent full meanwhile:
+      if (batcher.open_batches[timer.instance].generation ==
+          timer.generation) {
+        due_batches.emplace_back(timer.instance,
+                                 TakeRpcBatch(&batcher, timer.instance));
+      }
+      batcher.flush_timers.pop_front();
+    }
+    deadline = batcher.flush_timers.empty()
+                   ? absl::InfiniteFuture()
+                   : batcher.flush_timers.front().deadline;
+    batcher.mu.Unlock();
+    for (auto& [instance, rpcs] : due_batches) {
+      SendRpcBatch(rpc_index, instance, std::move(rpcs));
+    }
+    due_batches.clear();
+    if (shutdown) return;
+  }
+}
+
+void DistBenchEngine::ShutdownRpcBatchers() {
+  if (!client_rpc_table_) return;
+  for (int i = 0; i < traffic_config_.rpc_descriptions_size(); ++i) {
+    RpcBatcher* batcher = client_rpc_table_[i].batcher.get();
+    if (!batcher) continue;
+    {
+      absl::MutexLock m(&batcher->mu);
+      batcher->shutdown = true;
+      batcher->flush_timers_changed = true;
+    }
+    if (batcher->thread.joinable()) batcher->thread.join();
+  }
+}
+
+void DistBenchEngine::AddBatchSizes(ServicePerformanceLog* sp_log) {
+  for (int i = 0; i < traffic_config_.rpc_descriptions_size(); ++i) {
+    RpcBatcher* batcher = client_rpc_table_[i].batcher.get();
+    if (!batcher) continue;
+    const auto& servers = peers_[client_rpc_table_[i].service_index];
+    absl::MutexLock m(&batcher->mu);
+    for (size_t j = 0; j < servers.size(); ++j) {
+      const auto& sizes = batcher->open_batches[j].sizes;
+      if (sizes.empty()) continue;
+      auto& output_rpc_log =
+          (*(*sp_log->mutable_peer_logs())[servers[j].log_name]
+                .mutable_rpc_logs())[i];
+      for (const auto& [size, count] : sizes) {
+        (*output_rpc_log.mutable_batch_sizes())[size] = count;
+      }
+    }
+  }
+}
+
+absl::Span<const int> DistBenchEngine::PickRpcFanoutTargets(
+    ActionState* action_state, std::vector<int>* storage) {
   const int rpc_index = action_state->rpc_index;
   const auto& rpc_def = client_rpc_table_[rpc_index].rpc_definition;
-  std::vector<int> targets;
-  int num_servers = peers_[action_state->rpc_service_index].size();
+  const int num_servers = rpc_def.num_servers;
 
   switch (rpc_def.fanout_filter) {
     default:
       // Default case: return the first instance of the service
-      targets.reserve(1);
-      targets.push_back(0);
-      break;
+      storage->assign(1, 0);
+      return *storage;
 
     case kRandomSingle:
-      targets.reserve(1);
-      targets.push_back(random() % num_servers);
-      break;
+      storage->assign(1, random() % num_servers);
+      return *storage;
 
     case kRoundRobin:
-      targets.reserve(1);
-      targets.push_back(client_rpc_table_[rpc_index].rpc_tracing_counter %
-                        num_servers);
-      break;
+      storage->assign(1, client_rpc_table_[rpc_index].rpc_tracing_counter %
+                             num_servers);
+      return *storage;
 
     case kAll:
-      targets.reserve(num_servers);
-      for (int i = 0; i < num_servers; ++i) {
-        int target = i;
-        if (action_state->rpc_service_index != service_index_ ||
-            target != service_instance_) {
-          CHECK_NE(target, -1);
-          targets.push_back(target);
+      return rpc_def.all_targets;
+
+    case kLeastPending: {
+      // Starting the scan at a rotating instance spreads the ties:
+      const auto& pending =
+          client_rpc_table_[rpc_index].pending_requests_per_peer;
+      int start = client_rpc_table_[rpc_index].rpc_tracing_counter %
+                  num_servers;
+      int best = start;
+      int64_t best_pending = pending[start].load(std::memory_order_relaxed);
+      for (int i = 1; i < num_servers && best_pending; ++i) {
+        int instance = (start + i) % num_servers;
+        int64_t instance_pending =
+            pending[instance].load(std::memory_order_relaxed);
+        if (instance_pending < best_pending) {
+          best = instance;
+          best_pending = instance_pending;
         }
       }
-      break;
+      storage->assign(1, best);
+      return *storage;
+    }
 
-    case kStochastic:
-      std::map<int, std::vector<int>> partial_rand_vects =
-          action_state->partially_randomized_vectors;
+    case kPowerOfTwoChoices: {
+      // Two distinct random instances, of which the least loaded is picked:
+      const auto& pending =
+          client_rpc_table_[rpc_index].pending_requests_per_peer;
+      int first = random() % num_servers;
+      int second = first;
+      if (num_servers > 1) {
+        second = (first + 1 + random() % (num_servers - 1)) % num_servers;
+      }
+      storage->assign(1, pending[second].load(std::memory_order_relaxed) <
+                                 pending[first].load(std::memory_order_relaxed)
+                             ? second
+                             : first);
+      return *storage;
+    }
+
+    case kWeighted: {
+      const auto& weights = rpc_def.cumulative_weights;
+      double random_val = absl::Uniform(random_generator, 0., weights.back());
+      auto it = std::upper_bound(weights.begin(), weights.end(), random_val);
+      storage->assign(1, std::min<int>(it - weights.begin(), num_servers - 1));
+      return *storage;
+    }
 
+    case kStochastic:
       int nb_targets = 0;
       float random_val = absl::Uniform(random_generator, 0, 1.0);
-      float cur_val = 0.0;
       for (const auto& d : rpc_def.stochastic_dist) {
-        cur_val += d.probability;
-        if (random_val <= cur_val) {
+        if (random_val <= d.cumulative_probability) {
           nb_targets = d.nb_targets;
           break;
         }
       }
-      if (nb_targets > num_servers) {
-        nb_targets = num_servers;
-      }
 
-      // Generate a vector to pick random targets from (only done once)
-      partial_rand_vects.try_emplace(num_servers, std::vector<int>());
-      std::vector<int>& from_vector = partial_rand_vects[num_servers];
-      if (from_vector.empty()) {
-        for (int i = 0; i < num_servers; i++) {
-          from_vector.push_back(i);
-        }
+      // Pick nb_targets of the instances, with a partial Fisher-Yates
+      // shuffle:
+      storage->resize(num_servers);
+      for (int i = 0; i < num_servers; i++) {
+        (*storage)[i] = i;
       }
-
-      // Randomize and pick up to nb_targets
       for (int i = 0; i < nb_targets; i++) {
         int rnd_pos = i + (random() % (num_servers - i));
-        std::swap(from_vector[i], from_vector[rnd_pos]);
-        int target = from_vector[i];
-        CHECK_NE(target, -1);
-        targets.push_back(target);
+        std::swap((*storage)[i], (*storage)[rnd_pos]);
       }
-      break;
+      storage->resize(nb_targets);
+      return *storage;
   }
-
-  return targets;
 }
 
 int DistBenchEngine::GetSampleGeneratorIndex(
@@ -1459,6 +2834,9 @@ absl::StatusOr<DistributionConfig> GetCanonicalConfig(
     else if (field_name == "response_payload_size")
       proto_to_canonical[kResponsePayloadSize] = i;
 
+    else if (field_name == "cpu_time_ns")
+      proto_to_canonical[kCpuTimeNs] = i;
+
     else
       return absl::InvalidArgumentError(
           absl::StrCat("Unknown Field Name: '", field_name, "'."));
@@ -1468,16 +2846,21 @@ absl::StatusOr<DistributionConfig> GetCanonicalConfig(
     auto* output_pmf_point = canonical_config.add_pmf_points();
     auto input_pmf_point = input_config.pmf_points(i);
     output_pmf_point->set_pmf(input_pmf_point.pmf());
+    if (input_pmf_point.data_points_size() != input_config.field_names_size()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "PMF point ", i, " has ", input_pmf_point.data_points_size(),
+          " data points for ", input_config.field_names_size(), " fields."));
+    }
 
-    int input_vars_index = 0;
     for (int j = 0; j < kMaxFieldNames; j++) {
       auto& input_pmf_point = input_config.pmf_points(i);
 
       if (proto_to_canonical[j] != -1) {
-        auto input_data_point = input_pmf_point.data_points(input_vars_index);
+        // The fields may be listed in any order:
+        auto input_data_point =
+            input_pmf_point.data_points(proto_to_canonical[j]);
         auto* output_data_point = output_pmf_point->add_data_points();
         output_data_point->CopyFrom(input_data_point);
-        input_vars_index++;
 
       } else {
         auto* output_data_point = output_pmf_point->add_data_points();
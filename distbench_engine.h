@@ -15,11 +15,18 @@
 #ifndef DISTBENCH_DISTBENCH_ENGINE_H_
 #define DISTBENCH_DISTBENCH_ENGINE_H_
 
+#include <deque>
+#include <list>
+#include <queue>
 #include <unordered_set>
 
+#include "absl/container/flat_hash_map.h"
 #include "absl/random/random.h"
+#include "absl/types/span.h"
 #include "activity.h"
 #include "distbench.grpc.pb.h"
+#include "distbench_histogram.h"
+#include "distbench_threadpool.h"
 #include "distbench_utils.h"
 #include "joint_distribution_sample_generator.h"
 #include "protocol_driver.h"
@@ -36,20 +43,38 @@ class DistBenchEngine : public ConnectionSetup::Service {
       std::string_view control_plane_device, std::string_view service_name,
       int service_instance, int* port);
 
+  // Replaces the traffic of the test that just ran with the traffic of the
+  // next one, keeping the protocol driver and its connections. The services
+  // must be the same, and send their RPCs to the same services as before.
+  absl::Status ReloadTrafficConfig(
+      const DistributedSystemDescription& global_description);
+
   absl::Status ConfigurePeers(const ServiceEndpointMap& peers);
   absl::Status RunTraffic(const RunTrafficRequest* request);
   void CancelTraffic();
 
   void FinishTraffic();
+  // Moves the samples of the last traffic run into the returned log, so only
+  // the first call after a run gets them.
   ServicePerformanceLog GetLogs();
+  // Snapshots the rpcs initiated by this service, for the live metrics
+  // stream. Each window_histogram covers the RPCs completed since the
+  // previous call. Only reads the counters of the RPCs in flight.
+  std::vector<LiveRpcMetrics> GetLiveMetrics();
 
   grpc::Status SetupConnection(grpc::ServerContext* context,
                                const ConnectRequest* request,
                                ConnectResponse* response) override;
 
  private:
+  // Gives the benchmarks of distbench_engine_test.cc access to the hot paths.
+  friend class DistBenchEngineTestPeer;
+
   struct StochasticDist {
     float probability;
+    // The sum of the probabilities up to this one:
+    float cumulative_probability;
+    // At most the number of instances of the server:
     int nb_targets;
   };
 
@@ -58,6 +83,9 @@ class DistBenchEngine : public ConnectionSetup::Service {
     kRandomSingle = 1,
     kRoundRobin = 2,
     kStochastic = 3,
+    kLeastPending = 4,
+    kPowerOfTwoChoices = 5,
+    kWeighted = 6,
   };
 
   struct RpcDefinition {
@@ -67,23 +95,38 @@ class DistBenchEngine : public ConnectionSetup::Service {
     // Used to store decoded stochastic fanout
     FanoutFilter fanout_filter;
     std::vector<StochasticDist> stochastic_dist;
+    // Used to store decoded weighted fanout: the sum of the weights of the
+    // instances up to each one.
+    std::vector<double> cumulative_weights;
+
+    // The fanout plan, computed once by InitializeRpcFanoutFilter: the
+    // number of instances of the server, and the targets of the "all"
+    // fanout, i.e. every instance but this one.
+    int num_servers = 0;
+    std::vector<int> all_targets;
 
     // Decoded
     int request_payload_size;
     int response_payload_size;
+    PayloadSpec request_payload_spec;
+    PayloadSpec response_payload_spec;
+    // The buffers of payload_contents_ the payloads are sliced out of, set
+    // by InitializePayloadTables.
+    const std::string* request_payload_content = nullptr;
+    const std::string* response_payload_content = nullptr;
 
     int sample_generator_index = -1;
   };
 
   struct PeerMetadata {
     PeerMetadata() {}
-    PeerMetadata(const PeerMetadata& from) {
-      from.mutex.Lock();
-      log_name = from.log_name;
-      partial_logs = from.partial_logs;
-      trace_id = from.trace_id;
-      from.mutex.Unlock();
-    }
+    // Only copies the identity of the peer, as needed to resize peers_; the
+    // partial_logs stay with the original.
+    PeerMetadata(const PeerMetadata& from)
+        : log_name(from.log_name),
+          endpoint_address(from.endpoint_address),
+          trace_id(from.trace_id),
+          pd_id(from.pd_id) {}
 
     std::string log_name;
     std::string endpoint_address;
@@ -91,20 +134,89 @@ class DistBenchEngine : public ConnectionSetup::Service {
     int pd_id = -1;
     std::list<PeerPerformanceLog> partial_logs ABSL_GUARDED_BY(mutex);
     mutable absl::Mutex mutex;
+    // The connection to the peer is being re-established, see
+    // RpcSpec.connection_churn_rate, while reconnects_started is ahead of
+    // reconnects_finished.
+    std::atomic<int64_t> reconnects_started = 0;
+    std::atomic<int64_t> reconnects_finished = 0;
   };
 
   struct SimulatedServerRpc {
+    // Pre-built responses, filled once by InitializePayloadTables. Entry 0
+    // carries the default response payload for this RPC.
     std::vector<GenericResponse> response_table;
     int handler_action_list_index = -1;
     RpcDefinition rpc_definition;
   };
 
+  // Reconnects the peers of an rpc with a connection_churn_rate, while the
+  // actions that send the rpc run.
+  struct ConnectionChurner {
+    absl::Mutex mu;
+    int running_actions ABSL_GUARDED_BY(mu) = 0;
+    bool thread_running ABSL_GUARDED_BY(mu) = false;
+    bool shutdown ABSL_GUARDED_BY(mu) = false;
+    std::thread thread;
+    std::vector<ConnectionChurnEvent> reconnects ABSL_GUARDED_BY(mu);
+  };
+
+  struct BatchedRpc {
+    ClientRpcState* state;
+    std::function<void()> done_callback;
+  };
+
+  // Coalesces the RPCs of an rpc with a batch_size, per instance of the
+  // server. The batches that do not fill up in time are sent by a thread of
+  // their own.
+  struct RpcBatcher {
+    struct OpenBatch {
+      std::vector<BatchedRpc> rpcs;
+      // Counts the batches sent, so that a stale flush is told apart:
+      int64_t generation = 0;
+      // The number of batches sent by number of requests:
+      std::map<int, int64_t> sizes;
+    };
+    struct FlushTimer {
+      absl::Time deadline;
+      int instance;
+      int64_t generation;
+    };
+
+    absl::Mutex mu;
+    // Indexed by instance of the server:
+    std::vector<OpenBatch> open_batches ABSL_GUARDED_BY(mu);
+    // In deadline order, as the batch_delay_us is the same for all:
+    std::deque<FlushTimer> flush_timers ABSL_GUARDED_BY(mu);
+    bool flush_timers_changed ABSL_GUARDED_BY(mu) = false;
+    bool thread_running ABSL_GUARDED_BY(mu) = false;
+    bool shutdown ABSL_GUARDED_BY(mu) = false;
+    std::thread thread;
+  };
+
   struct SimulatedClientRpc {
     int service_index;
+    // Pre-built requests, filled once by InitializePayloadTables. Entry 0 is
+    // the template that every iteration of this RPC starts from.
     std::vector<GenericRequest> request_table;
     RpcDefinition rpc_definition;
     std::atomic<int64_t> rpc_tracing_counter = 0;
-    std::vector<int> pending_requests_per_peer;
+    // One histogram per instance of the server service, counting every RPC
+    // including the ones dropped by reservoir sampling. Only allocated for
+    // the RPCs that this service initiates.
+    std::unique_ptr<AtomicLatencyHistogram[]> latency_histograms;
+    // The RPCs in flight to each instance of the server service, allocated
+    // along with latency_histograms.
+    std::unique_ptr<std::atomic<int64_t>[]> pending_requests_per_peer;
+    // The RPCs in flight during a reconnect, per instance of the server
+    // service. Only allocated along with latency_histograms if this service
+    // churns some of its connections.
+    std::unique_ptr<AtomicLatencyHistogram[]> reconnect_overlap_histograms;
+    // Only set for the RPCs that this service initiates with a
+    // connection_churn_rate.
+    std::unique_ptr<ConnectionChurner> churner;
+    // Only set for the RPCs that this service initiates with a batch_size
+    // above 1.
+    std::unique_ptr<RpcBatcher> batcher;
   };
 
   struct ActionTableEntry {
@@ -116,6 +228,8 @@ class DistBenchEngine : public ConnectionSetup::Service {
     int actionlist_index = -1;
     int activity_config_index = -1;
     std::vector<int> dependent_action_indices;
+    // The actions that list this one in their dependent_action_indices:
+    std::vector<int> successor_action_indices;
   };
 
   struct ActionListTableEntry {
@@ -127,23 +241,52 @@ class DistBenchEngine : public ConnectionSetup::Service {
   struct ActionListState;
   struct ActionState;
 
+  // Reused from one iteration to the next: each closed loop slot keeps its
+  // own, and the open loop actions pool theirs, so that the steady state
+  // allocates no iteration, request or response.
   struct ActionIterationState {
     struct ActionState* action_state = nullptr;
     int iteration_number = 0;
     bool warmup = false;
+    // Only grows; the iteration uses one per target picked:
     std::vector<ClientRpcState> rpc_states;
+    // Holds the targets that PickRpcFanoutTargets picks at random:
+    std::vector<int> fanout_targets;
     std::atomic<int> remaining_rpcs = 0;
+    // For the open loop iterations, when this one was due, and how long
+    // after it the next one is. The RPCs are weighted by that interval,
+    // i.e. by the stretch of the schedule each of them stands for:
+    absl::Time due_time = absl::InfinitePast();
+    absl::Duration schedule_interval;
   };
 
   struct ActionState {
     bool started = false;
     bool finished = false;
+    // Number of dependencies that have not finished yet; the action is
+    // started once this drops to zero. Guarded by the action_mu of the
+    // action_list_state.
+    int remaining_dependencies = 0;
     ActionListState* action_list_state;
 
     absl::Mutex iteration_mutex;
     int next_iteration ABSL_GUARDED_BY(iteration_mutex);
     int finished_iterations ABSL_GUARDED_BY(iteration_mutex);
     absl::Time next_iteration_time = absl::InfiniteFuture();
+    // Whether an open loop action waits for its next_iteration_time in
+    // open_loop_timers_; the action cannot finish until the timer fires.
+    bool open_loop_timer_armed ABSL_GUARDED_BY(iteration_mutex) = false;
+    // Draws the intervals of the "exponential" open loop distribution:
+    std::default_random_engine open_loop_rand_gen
+        ABSL_GUARDED_BY(iteration_mutex);
+    // How late the open loop iterations started, see PacingLog:
+    int64_t paced_iterations ABSL_GUARDED_BY(iteration_mutex) = 0;
+    int64_t behind_schedule_iterations ABSL_GUARDED_BY(iteration_mutex) = 0;
+    int64_t total_slip_ns ABSL_GUARDED_BY(iteration_mutex) = 0;
+    int64_t max_slip_ns ABSL_GUARDED_BY(iteration_mutex) = 0;
+    // The finished open loop iterations, for the next ones to reuse:
+    std::vector<std::shared_ptr<ActionIterationState>> idle_iteration_states
+        ABSL_GUARDED_BY(iteration_mutex);
 
     int64_t iteration_limit = std::numeric_limits<int64_t>::max();
     absl::Time time_limit = absl::InfiniteFuture();
@@ -151,17 +294,16 @@ class DistBenchEngine : public ConnectionSetup::Service {
     const ActionTableEntry* action = nullptr;
     int rpc_index;
     int rpc_service_index;
+    // Whether the action runs the ConnectionChurner of its rpc:
+    bool churns_connections = false;
 
     std::function<void(std::shared_ptr<ActionIterationState> iteration_state)>
         iteration_function;
     std::function<void(void)> all_done_callback;
 
-    std::map<int, std::vector<int>> partially_randomized_vectors;
-
     std::unique_ptr<Activity> activity;
 
-    // The 'rand_gen' must be used only from RunActionList's thread
-    // to avoid race conditions.
+    // Shared by all the actions of the action list.
     std::default_random_engine* rand_gen = nullptr;
   };
 
@@ -183,72 +325,206 @@ class DistBenchEngine : public ConnectionSetup::Service {
     int64_t start_timestamp_ns;
     int64_t latency_ns;
     int64_t latency_weight;
+    // -1 unless the response carried server_processing_ns:
+    int64_t server_processing_ns;
     size_t sample_number;
     TraceContext* trace_context;
+    RpcStageTimings* stage_timings;
   };
 
   static_assert(std::is_trivially_destructible<PackedLatencySample>::value);
   static_assert(std::is_trivially_constructible<PackedLatencySample>::value);
 
+  // Append-only block of samples, only ever written by one thread. Used to
+  // keep every sample (max_rpc_samples = 0) without taking any lock.
+  struct SampleChunk {
+    explicit SampleChunk(size_t capacity)
+        : samples(new PackedLatencySample[capacity]), capacity(capacity) {}
+
+    std::unique_ptr<PackedLatencySample[]> samples;
+    const size_t capacity;
+    size_t size = 0;
+    SampleChunk* next = nullptr;
+  };
+
+  // The state of a running action list. It is driven by events rather than
+  // by a dedicated thread: each finished action decrements the dependency
+  // counters of its successors, and ScheduleActions starts the ones that
+  // became ready. The last event deletes the state, via FinishActionList.
   struct ActionListState {
-    void FinishAction(int action_index);
-    void WaitForAllPendingActions();
-    void CancelActivities();
+    ~ActionListState();
     void UpdateActivitiesLog(
         std::map<std::string, std::map<std::string, int64_t>>*
             cumulative_activity_logs);
-    bool DidSomeActionsFinish();
-    void HandleFinishedActions();
+    void UpdatePacingLogs(
+        std::map<std::string, PacingLog>* cumulative_pacing_logs);
     void RecordLatency(size_t rpc_index, size_t service_type, size_t instance,
                        ClientRpcState* state);
-    void RecordPackedLatency(size_t sample_number, size_t index,
-                             size_t rpc_index, size_t service_type,
-                             size_t instance, ClientRpcState* state);
+    void RecordPackedLatency(PackedLatencySample* destination,
+                             size_t sample_number, size_t rpc_index,
+                             size_t service_type, size_t instance,
+                             ClientRpcState* state);
+    SampleChunk* GetThreadSampleChunk();
     void UnpackLatencySamples();
+    void UnpackLatencySample(const PackedLatencySample& packed_sample)
+        ABSL_EXCLUSIVE_LOCKS_REQUIRED(action_mu);
 
     const ServerRpcState* incoming_rpc_state = nullptr;
     std::unique_ptr<ActionState[]> state_table;
     const ActionListTableEntry* action_list;
     absl::Mutex action_mu;
-    std::vector<int> finished_action_indices;
+    // Actions that finished, or whose dependencies did, and that
+    // ScheduleActions has not handled yet:
+    std::vector<int> finished_action_indices ABSL_GUARDED_BY(action_mu);
+    std::vector<int> ready_action_indices ABSL_GUARDED_BY(action_mu);
+    int started_actions ABSL_GUARDED_BY(action_mu) = 0;
+    int finished_actions ABSL_GUARDED_BY(action_mu) = 0;
+    // Set while a thread runs ScheduleActions, which the other threads then
+    // leave to it:
+    bool scheduling ABSL_GUARDED_BY(action_mu) = false;
+    bool sent_response_early = false;
+    std::default_random_engine rand_gen;
+    // Called once the action list is done, after the state is deleted:
+    std::function<void()> done_callback;
 
     std::vector<std::vector<PeerPerformanceLog>> peer_logs_
         ABSL_GUARDED_BY(action_mu);
     std::unique_ptr<PackedLatencySample[]> packed_samples_;
     size_t packed_samples_size_ = 0;
     std::atomic<size_t> packed_sample_number_ = 0;
-    std::atomic<size_t> remaining_initial_samples_;
-    absl::Mutex reservoir_sample_lock_;
-
-    // This area is used to allocate TraceContext objects for packed samples:
+    // One spinlock per reservoir slot, so that concurrent replacements only
+    // contend when they pick the same slot:
+    std::unique_ptr<std::atomic<bool>[]> packed_sample_locks_;
+
+    // Without reservoir sampling, every completion thread appends to its own
+    // chunks, which are pushed to this lock-free list and only merged into
+    // peer_logs_ once the action list is done.
+    std::atomic<SampleChunk*> sample_chunks_ = nullptr;
+    // Identifies this action list to the per-thread chunk caches, since
+    // the address of an ActionListState may be reused.
+    uint64_t sample_chunks_owner_id_ = 0;
+    // Expires with the action list, so that the per-thread chunk caches
+    // can tell which of their entries are stale:
+    std::shared_ptr<const bool> sample_chunks_alive_;
+
+    // The chunks each thread is currently appending to, keyed by the
+    // sample_chunks_owner_id_ of their action list. The entries of the
+    // finished action lists are swept whenever the map doubles in size.
+    struct ThreadSampleChunk {
+      SampleChunk* chunk = nullptr;
+      std::weak_ptr<const bool> owner_alive;
+    };
+    struct ThreadSampleChunks {
+      absl::flat_hash_map<uint64_t, ThreadSampleChunk> chunks;
+      size_t sweep_size = 0;
+    };
+    static thread_local ThreadSampleChunks thread_sample_chunks_;
+
+    // Set from ActionList.columnar_rpc_samples:
+    bool columnar_samples_ = false;
+
+    // This area is used to allocate the TraceContext and RpcStageTimings
+    // objects of packed samples:
     ::google::protobuf::Arena sample_arena_;
 
     // If true this entire action list was triggered by a warmup RPC, so all
     // actions it initiates will propgate the warmup flag:
     bool warmup_;
-    std::atomic<int> pending_action_count_ = 0;
+  };
+
+  struct OpenLoopTimer {
+    bool operator>(const OpenLoopTimer& other) const {
+      return deadline > other.deadline;
+    }
+
+    absl::Time deadline;
+    ActionState* action_state;
   };
 
   absl::Status InitializeTables();
   absl::Status InitializePayloadsMap();
   absl::Status InitializeRpcFanoutFilter(RpcDefinition& rpc_def);
+  absl::Status InitializeWeightedFanoutFilter(std::string weights,
+                                              RpcDefinition& rpc_def);
   absl::Status InitializeRpcDefinitionsMap();
   absl::Status InitializeActivityConfigMap();
+  void InitializePayloadTables();
+  int64_t GetMaxPayloadSize();
+  const std::string* GetPayloadContent(const PayloadSpec& spec,
+                                       int64_t size);
+  void FillPayload(std::string* payload, int64_t size,
+                   const std::string& content) const;
   absl::Status ParseActivityConfig(ActivityConfig& ac);
 
+  // Runs an action list to completion, blocking the calling thread.
   void RunActionList(int list_index, const ServerRpcState* incoming_rpc_state,
                      bool force_warmup = false);
+  // Starts an action list and returns immediately; done_callback is called
+  // from whichever thread finishes the last action.
+  void StartActionList(int list_index, const ServerRpcState* incoming_rpc_state,
+                       bool force_warmup, std::function<void()> done_callback);
+  void ScheduleActions(ActionListState* s);
+  void StartAction(ActionListState* s, int action_index);
+  void FinishAction(ActionListState* s, int action_index);
+  void FinishActionList(ActionListState* s);
+  // Starts a thread that only waits on clock_, if at all: a simulated clock
+  // does not advance until it does.
+  std::thread RunClockedThread(const std::string& thread_name,
+                               std::function<void()> f);
+  void RemoveRunningActionList();
+  void WaitForRunningActionLists();
   void RunAction(ActionState* action_state);
   void StartOpenLoopIteration(ActionState* action_state);
-  void RunActivity(ActionState* action_state);
+  void ArmOpenLoopTimer(ActionState* action_state, absl::Time deadline);
+  void FireOpenLoopTimer(ActionState* action_state);
+  void RunOpenLoopTimers();
+  void QueueActivityIteration(
+      std::shared_ptr<ActionIterationState> iteration_state);
+  void RunActivityIteration(
+      std::shared_ptr<ActionIterationState> iteration_state);
   void StartIteration(std::shared_ptr<ActionIterationState> iteration_state);
   void FinishIteration(std::shared_ptr<ActionIterationState> iteration_state);
 
   void RunRpcActionIteration(
       std::shared_ptr<ActionIterationState> iteration_state);
-  std::vector<int> PickRpcFanoutTargets(ActionState* action_state);
+  // Returns the service instances to send the RPCs of an iteration to, which
+  // have to be translated to protocol_drivers endpoint ids by the caller.
+  // These are either the fanout plan of the rpc, or written into storage.
+  absl::Span<const int> PickRpcFanoutTargets(ActionState* action_state,
+                                             std::vector<int>* storage);
 
   void AddActivityLogs(ServicePerformanceLog* sp_log);
+  void AddPacingLogs(ServicePerformanceLog* sp_log);
+  void AddConnectionChurnLogs(ServicePerformanceLog* sp_log);
+
+  void StartConnectionChurn(int rpc_index);
+  void StopConnectionChurn(int rpc_index);
+  void RunConnectionChurn(int rpc_index);
+  // Stops the churn threads, even if actions still run:
+  void ShutdownConnectionChurn();
+  // Whether an rpc this service initiates has a connection_churn_rate:
+  bool has_connection_churn_ = false;
+
+  // Adds the RPC to the open batch of its peer, and sends the batch if full.
+  void InitiateBatchedRpc(int rpc_index, int peer_instance,
+                          ClientRpcState* state,
+                          std::function<void()> done_callback);
+  // Takes the rpcs out of the open batch, to be sent by the caller:
+  std::vector<BatchedRpc> TakeRpcBatch(RpcBatcher* batcher, int peer_instance)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(batcher->mu);
+  void SendRpcBatch(int rpc_index, int peer_instance,
+                    std::vector<BatchedRpc> rpcs);
+  void RunRpcBatcher(int rpc_index);
+  // Sends the open batches and stops the batcher threads:
+  void ShutdownRpcBatchers();
+  void AddBatchSizes(ServicePerformanceLog* sp_log);
+  void AddLatencyHistograms(ServicePerformanceLog* sp_log);
+
+  absl::Mutex live_metrics_mu_;
+  // The merged latency_histograms of each rpc at the previous call to
+  // GetLiveMetrics, indexed by rpc:
+  std::vector<LatencyHistogram> live_metrics_histograms_
+      ABSL_GUARDED_BY(live_metrics_mu_);
 
   std::atomic<int64_t> consume_cpu_iteration_cnt_ = 0;
 
@@ -258,10 +534,13 @@ class DistBenchEngine : public ConnectionSetup::Service {
 
   absl::Status ConnectToPeers();
   std::function<void()> RpcHandler(ServerRpcState* state);
+  std::function<void()> BatchedRpcHandler(ServerRpcState* state);
 
   int get_payload_size(const std::string& name);
 
-  SafeNotification canceled_;
+  // Replaced by ReloadTrafficConfig, as a notification cannot be reset:
+  std::unique_ptr<SafeNotification> canceled_ =
+      std::make_unique<SafeNotification>();
   DistributedSystemDescription traffic_config_;
   ServiceEndpointMap service_map_;
   std::string service_name_;
@@ -272,10 +551,19 @@ class DistBenchEngine : public ConnectionSetup::Service {
   std::unique_ptr<grpc::Server> server_;
   std::unique_ptr<ProtocolDriver> pd_;
   std::thread engine_main_thread_;
+  // The placer of the node that created the engine, for the threads that
+  // the engine starts from the threads of the protocol driver:
+  ThreadPlacer* thread_placer_ = CurrentThreadPlacer();
   std::string engine_name_;
 
   // Payloads definitions
   std::map<std::string, PayloadSpec> payload_map_;
+
+  // Shared, immutable buffers big enough for the largest payload this engine
+  // may send, one per payload content. Payloads whose size is only known at
+  // runtime (e.g. drawn from a distribution) are sliced out of them instead
+  // of being built from scratch.
+  std::map<std::string, std::string> payload_contents_;
   std::map<std::string, RpcDefinition> rpc_map_;
   std::map<std::string, int> activity_config_indices_map_;
   std::vector<ParsedActivityConfig> stored_activity_config_;
@@ -288,10 +576,37 @@ class DistBenchEngine : public ConnectionSetup::Service {
   // Random
   absl::BitGen random_generator;
 
-  std::atomic<int64_t> detached_actionlist_threads_ = 0;
+  // The action lists that were started and have not finished yet. The
+  // mutex is only taken when the count drops to zero, to wake up
+  // WaitForRunningActionLists:
+  std::atomic<int64_t> running_action_lists_ = 0;
+  absl::Mutex running_action_lists_mu_;
+
+  // The next_iteration_time of the open loop actions of all the running
+  // action lists, served by a single pacer thread. The pacer sleeps until
+  // kOpenLoopSpinWindow before the earliest deadline, then spins, since
+  // sleeping all the way would wake it up late by the scheduling jitter:
+  static constexpr absl::Duration kOpenLoopSpinWindow = absl::Microseconds(50);
+  absl::Mutex open_loop_timer_mu_;
+  std::priority_queue<OpenLoopTimer, std::vector<OpenLoopTimer>,
+                      std::greater<OpenLoopTimer>>
+      open_loop_timers_ ABSL_GUARDED_BY(open_loop_timer_mu_);
+  // Wakes the timer thread up, to reconsider its deadline:
+  bool open_loop_timers_changed_ ABSL_GUARDED_BY(open_loop_timer_mu_) = false;
+  bool open_loop_timers_shutdown_ ABSL_GUARDED_BY(open_loop_timer_mu_) = false;
+  std::thread open_loop_timer_thread_;
+  // Runs the activity iterations, so that they never hold up the RPC
+  // completion, reactor or pacer thread that finished the action before
+  // them. Started with the first activity.
+  absl::Mutex activity_threadpool_mu_;
+  std::unique_ptr<AbstractThreadpool> activity_threadpool_
+      ABSL_GUARDED_BY(activity_threadpool_mu_);
   absl::Mutex cumulative_activity_log_mu_;
   std::map<std::string, std::map<std::string, int64_t>>
       cumulative_activity_logs_;
+  // Keyed by action name:
+  std::map<std::string, PacingLog> cumulative_pacing_logs_
+      ABSL_GUARDED_BY(cumulative_activity_log_mu_);
 
   std::map<std::string, int> sample_generator_indices_map_;
   std::vector<std::unique_ptr<DistributionSampleGenerator>>
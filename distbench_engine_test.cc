@@ -14,7 +14,9 @@
 
 #include "distbench_engine.h"
 
+#include "benchmark/benchmark.h"
 #include "distbench_utils.h"
+#include "google/protobuf/text_format.h"
 #include "gtest/gtest.h"
 #include "gtest_utils.h"
 #include "protocol_driver_allocator.h"
@@ -42,4 +44,195 @@ TEST(DistBenchEngineTest, Initialization) {
   ASSERT_OK(dbe.Initialize(desc, "lo", "test_service", 0, &engine_port));
 }
 
+// Reaches the internals of DistBenchEngine, to benchmark its hot paths in
+// isolation from the protocol drivers.
+class DistBenchEngineTestPeer {
+ public:
+  using ActionListState = DistBenchEngine::ActionListState;
+  using ActionState = DistBenchEngine::ActionState;
+  using PackedLatencySample = DistBenchEngine::PackedLatencySample;
+
+  // Sets up the sampling of s as StartActionList does, keeping every sample
+  // if max_rpc_samples is 0 and reservoir sampling otherwise.
+  static void InitializeSampling(ActionListState* s, size_t max_rpc_samples) {
+    // Distinct from the ids of the action lists of the engines:
+    static std::atomic<uint64_t> next_owner_id = uint64_t{1} << 63;
+    s->packed_samples_size_ = max_rpc_samples;
+    s->packed_samples_.reset(new PackedLatencySample[max_rpc_samples]);
+    s->packed_sample_locks_.reset(new std::atomic<bool>[max_rpc_samples]());
+    for (size_t i = 0; i < max_rpc_samples; ++i) {
+      s->packed_samples_[i].sample_number = ~size_t{0};
+    }
+    s->sample_chunks_owner_id_ = next_owner_id++;
+    s->sample_chunks_alive_ = std::make_shared<bool>(true);
+  }
+
+  static int SampleChunkCount(ActionListState* s) {
+    int count = 0;
+    for (auto* chunk = s->sample_chunks_.load(); chunk; chunk = chunk->next) {
+      ++count;
+    }
+    return count;
+  }
+
+  static void RecordLatency(ActionListState* s, ClientRpcState* state) {
+    s->RecordLatency(/*rpc_index=*/0, /*service_type=*/0, /*instance=*/0,
+                     state);
+  }
+
+  static const GenericRequest& RequestTemplate(DistBenchEngine* engine,
+                                               int rpc_index) {
+    return engine->client_rpc_table_[rpc_index].request_table[0];
+  }
+
+  static absl::Span<const int> PickRpcFanoutTargets(
+      DistBenchEngine* engine, ActionState* action_state,
+      std::vector<int>* storage) {
+    return engine->PickRpcFanoutTargets(action_state, storage);
+  }
+};
+
+DistributedSystemDescription ZerosPayloadConfig(int payload_size) {
+  DistributedSystemDescription desc;
+  auto* client = desc.add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* server = desc.add_services();
+  server->set_name("server");
+  server->set_count(1);
+  auto* payload = desc.add_payload_descriptions();
+  payload->set_name("request_payload");
+  payload->set_size(payload_size);
+  payload->set_content("zeros");
+  auto* rpc = desc.add_rpc_descriptions();
+  rpc->set_name("client_server_rpc");
+  rpc->set_client("client");
+  rpc->set_server("server");
+  rpc->set_request_payload_name("request_payload");
+  desc.add_action_lists()->set_name("client_server_rpc");
+  return desc;
+}
+
+TEST(DistBenchEngineTest, ReloadWithLargerPayloads) {
+  int driver_port = 0;
+  DistBenchEngine dbe(
+      AllocateProtocolDriver(grpc_pd_opts(), &driver_port).value());
+  int engine_port = 0;
+  ASSERT_OK(dbe.Initialize(ZerosPayloadConfig(100), "lo", "client", 0,
+                           &engine_port));
+  EXPECT_EQ(DistBenchEngineTestPeer::RequestTemplate(&dbe, 0).payload(),
+            std::string(100, '\0'));
+  ASSERT_OK(dbe.ReloadTrafficConfig(ZerosPayloadConfig(10000)));
+  EXPECT_EQ(DistBenchEngineTestPeer::RequestTemplate(&dbe, 0).payload(),
+            std::string(10000, '\0'));
+}
+
+// A completion thread keeps a chunk per action list, however many action
+// lists it interleaves:
+TEST(DistBenchEngineTest, InterleavedActionListSampleChunks) {
+  using Peer = DistBenchEngineTestPeer;
+  ClientRpcState rpc_state;
+  rpc_state.success = true;
+  rpc_state.start_time = absl::Now();
+  rpc_state.end_time = rpc_state.start_time + absl::Microseconds(50);
+  std::vector<std::unique_ptr<Peer::ActionListState>> action_lists;
+  for (int i = 0; i < 64; ++i) {
+    action_lists.push_back(std::make_unique<Peer::ActionListState>());
+    Peer::InitializeSampling(action_lists.back().get(), 0);
+  }
+  // The first chunk of each action list holds 16 samples:
+  for (int sample = 0; sample < 16; ++sample) {
+    for (auto& s : action_lists) {
+      Peer::RecordLatency(s.get(), &rpc_state);
+    }
+  }
+  for (auto& s : action_lists) {
+    EXPECT_EQ(Peer::SampleChunkCount(s.get()), 1);
+  }
+  Peer::RecordLatency(action_lists[0].get(), &rpc_state);
+  EXPECT_EQ(Peer::SampleChunkCount(action_lists[0].get()), 2);
+}
+
+void BM_RecordLatency(benchmark::State& state) {
+  using Peer = DistBenchEngineTestPeer;
+  const size_t max_rpc_samples = state.range(0);
+  ClientRpcState rpc_state;
+  rpc_state.success = true;
+  rpc_state.start_time = absl::Now();
+  rpc_state.end_time = rpc_state.start_time + absl::Microseconds(50);
+  rpc_state.request.set_payload(std::string(64, 'D'));
+  rpc_state.response.set_payload(std::string(256, 'D'));
+  auto s = std::make_unique<Peer::ActionListState>();
+  Peer::InitializeSampling(s.get(), max_rpc_samples);
+  // Without reservoir sampling every sample is kept, so start over before
+  // they use too much memory:
+  constexpr int64_t kMaxKeptSamples = 1 << 20;
+  int64_t kept_samples = 0;
+  for (auto _ : state) {
+    Peer::RecordLatency(s.get(), &rpc_state);
+    if (!max_rpc_samples && ++kept_samples == kMaxKeptSamples) {
+      state.PauseTiming();
+      s = std::make_unique<Peer::ActionListState>();
+      Peer::InitializeSampling(s.get(), max_rpc_samples);
+      kept_samples = 0;
+      state.ResumeTiming();
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Arg 0 keeps every sample in per-thread chunks; the others are the sizes
+// of the reservoir of packed samples.
+BENCHMARK(BM_RecordLatency)->Arg(0)->Arg(1000)->Arg(100000);
+
+// Picks the targets of an rpc from a client to 16 servers, with the given
+// fanout filter.
+void PickRpcFanoutTargets(benchmark::State& state, std::string fanout_filter) {
+  DistributedSystemDescription desc;
+  ASSERT_TRUE(::google::protobuf::TextFormat::ParseFromString(
+      absl::StrCat(R"(
+services {
+  name: "client"
+  count: 1
+}
+services {
+  name: "server"
+  count: 16
+}
+rpc_descriptions {
+  name: "client_server_rpc"
+  client: "client"
+  server: "server"
+  fanout_filter: ")",
+                   fanout_filter, R"("
+}
+action_lists {
+  name: "client_server_rpc"
+})"),
+      &desc));
+  int driver_port = 0;
+  DistBenchEngine dbe(
+      AllocateProtocolDriver(grpc_pd_opts(), &driver_port).value());
+  int engine_port = 0;
+  ASSERT_OK(dbe.Initialize(desc, "lo", "client", 0, &engine_port));
+  DistBenchEngineTestPeer::ActionState action_state;
+  action_state.rpc_index = 0;
+  std::vector<int> storage;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(DistBenchEngineTestPeer::PickRpcFanoutTargets(
+        &dbe, &action_state, &storage));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_CAPTURE(PickRpcFanoutTargets, all, "all");
+BENCHMARK_CAPTURE(PickRpcFanoutTargets, random, "random");
+BENCHMARK_CAPTURE(PickRpcFanoutTargets, round_robin, "round_robin");
+BENCHMARK_CAPTURE(PickRpcFanoutTargets, stochastic,
+                  "stochastic{0.7:1,0.3:4}");
+BENCHMARK_CAPTURE(PickRpcFanoutTargets, least_pending, "least_pending");
+BENCHMARK_CAPTURE(PickRpcFanoutTargets, p2c, "p2c");
+BENCHMARK_CAPTURE(PickRpcFanoutTargets, weighted,
+                  "weighted{1,2,3,4,1,2,3,4,1,2,3,4,1,2,3,4}");
+
 }  // namespace distbench
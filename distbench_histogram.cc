@@ -0,0 +1,242 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_histogram.h"
+
+#include <algorithm>
+
+#include "absl/strings/str_cat.h"
+
+namespace distbench {
+
+namespace {
+
+constexpr size_t kSubBucketMask =
+    (1UL << AtomicLatencyHistogram::kSubBucketBits) - 1;
+
+void AtomicMin(std::atomic<int64_t>& target, int64_t value) {
+  int64_t current = target.load(std::memory_order_relaxed);
+  while (value < current &&
+         !target.compare_exchange_weak(current, value,
+                                       std::memory_order_relaxed)) {
+  }
+}
+
+void AtomicMax(std::atomic<int64_t>& target, int64_t value) {
+  int64_t current = target.load(std::memory_order_relaxed);
+  while (value > current &&
+         !target.compare_exchange_weak(current, value,
+                                       std::memory_order_relaxed)) {
+  }
+}
+
+}  // anonymous namespace
+
+AtomicLatencyHistogram::~AtomicLatencyHistogram() {
+  delete[] buckets_.load(std::memory_order_acquire);
+}
+
+size_t AtomicLatencyHistogram::BucketIndex(int64_t value) {
+  if (value < (1L << kSubBucketBits)) {
+    return value < 0 ? 0 : value;
+  }
+  int exponent = 63 - __builtin_clzll(value);
+  if (exponent > kMaxExponent) {
+    return kNumBuckets - 1;
+  }
+  return ((exponent - kSubBucketBits + 1) << kSubBucketBits) +
+         ((value >> (exponent - kSubBucketBits)) & kSubBucketMask);
+}
+
+int64_t AtomicLatencyHistogram::BucketLowerBound(size_t index) {
+  size_t bucket = index >> kSubBucketBits;
+  if (bucket == 0) return index;
+  int shift = bucket - 1;
+  return static_cast<int64_t>((1UL << kSubBucketBits) +
+                              (index & kSubBucketMask))
+         << shift;
+}
+
+int64_t AtomicLatencyHistogram::BucketUpperBound(size_t index) {
+  size_t bucket = index >> kSubBucketBits;
+  if (bucket == 0) return index;
+  return BucketLowerBound(index) + (1L << (bucket - 1)) - 1;
+}
+
+std::atomic<int64_t>* AtomicLatencyHistogram::Buckets() {
+  std::atomic<int64_t>* buckets = buckets_.load(std::memory_order_acquire);
+  if (buckets) return buckets;
+  auto* new_buckets = new std::atomic<int64_t>[kNumBuckets]();
+  if (buckets_.compare_exchange_strong(buckets, new_buckets,
+                                       std::memory_order_acq_rel)) {
+    return new_buckets;
+  }
+  // Another thread installed its array first:
+  delete[] new_buckets;
+  return buckets;
+}
+
+void AtomicLatencyHistogram::AddToBucket(size_t index, int64_t count) {
+  Buckets()[index].fetch_add(count, kRelaxed);
+}
+
+void AtomicLatencyHistogram::Record(int64_t latency_ns, int64_t request_size,
+                                    int64_t response_size,
+                                    int64_t start_timestamp_ns) {
+  AddToBucket(BucketIndex(latency_ns), 1);
+  successful_rpc_count_.fetch_add(1, kRelaxed);
+  total_latency_ns_.fetch_add(latency_ns, kRelaxed);
+  total_request_size_.fetch_add(request_size, kRelaxed);
+  total_response_size_.fetch_add(response_size, kRelaxed);
+  AtomicMin(min_latency_ns_, latency_ns);
+  AtomicMax(max_latency_ns_, latency_ns);
+  AtomicMin(first_start_timestamp_ns_, start_timestamp_ns);
+  AtomicMax(last_end_timestamp_ns_, start_timestamp_ns + latency_ns);
+}
+
+absl::Status AtomicLatencyHistogram::MergeFrom(const LatencyHistogram& proto) {
+  if (proto.bucket_indices_size() != proto.bucket_counts_size()) {
+    return absl::InvalidArgumentError(
+        "LatencyHistogram bucket_indices and bucket_counts differ in size");
+  }
+  if (proto.bucket_indices_size() &&
+      proto.sub_bucket_bits() != kSubBucketBits) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("LatencyHistogram has sub_bucket_bits ",
+                     proto.sub_bucket_bits(), ", expected ", kSubBucketBits));
+  }
+  for (int i = 0; i < proto.bucket_indices_size(); ++i) {
+    int32_t index = proto.bucket_indices(i);
+    if (index < 0 || static_cast<size_t>(index) >= kNumBuckets) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("LatencyHistogram bucket index out of range: ", index));
+    }
+  }
+  for (int i = 0; i < proto.bucket_indices_size(); ++i) {
+    AddToBucket(proto.bucket_indices(i), proto.bucket_counts(i));
+  }
+  if (proto.successful_rpc_count()) {
+    successful_rpc_count_.fetch_add(proto.successful_rpc_count(), kRelaxed);
+    total_latency_ns_.fetch_add(proto.total_latency_ns(), kRelaxed);
+    total_request_size_.fetch_add(proto.total_request_size(), kRelaxed);
+    total_response_size_.fetch_add(proto.total_response_size(), kRelaxed);
+    AtomicMin(min_latency_ns_, proto.min_latency_ns());
+    AtomicMax(max_latency_ns_, proto.max_latency_ns());
+    AtomicMin(first_start_timestamp_ns_, proto.first_start_timestamp_ns());
+    AtomicMax(last_end_timestamp_ns_, proto.last_end_timestamp_ns());
+  }
+  failed_rpc_count_.fetch_add(proto.failed_rpc_count(), kRelaxed);
+  warmup_rpc_count_.fetch_add(proto.warmup_rpc_count(), kRelaxed);
+  return absl::OkStatus();
+}
+
+LatencyHistogram AtomicLatencyHistogram::ToProto() const {
+  LatencyHistogram proto;
+  proto.set_sub_bucket_bits(kSubBucketBits);
+  const std::atomic<int64_t>* buckets =
+      buckets_.load(std::memory_order_acquire);
+  if (buckets) {
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+      int64_t count = buckets[i].load(kRelaxed);
+      if (count) {
+        proto.add_bucket_indices(i);
+        proto.add_bucket_counts(count);
+      }
+    }
+  }
+  if (Count()) {
+    proto.set_successful_rpc_count(Count());
+    proto.set_min_latency_ns(MinLatency());
+    proto.set_max_latency_ns(MaxLatency());
+    proto.set_total_latency_ns(TotalLatency());
+    proto.set_total_request_size(TotalRequestSize());
+    proto.set_total_response_size(TotalResponseSize());
+    proto.set_first_start_timestamp_ns(FirstStartTimestamp());
+    proto.set_last_end_timestamp_ns(LastEndTimestamp());
+  }
+  if (FailedCount()) proto.set_failed_rpc_count(FailedCount());
+  if (WarmupCount()) proto.set_warmup_rpc_count(WarmupCount());
+  return proto;
+}
+
+LatencyHistogram LatencyHistogramDelta(const LatencyHistogram& current,
+                                       const LatencyHistogram& previous) {
+  LatencyHistogram delta;
+  delta.set_sub_bucket_bits(current.sub_bucket_bits());
+  // Both are sorted by index, and previous has no bucket that current lacks:
+  int j = 0;
+  for (int i = 0; i < current.bucket_indices_size(); ++i) {
+    int64_t count = current.bucket_counts(i);
+    while (j < previous.bucket_indices_size() &&
+           previous.bucket_indices(j) < current.bucket_indices(i)) {
+      ++j;
+    }
+    if (j < previous.bucket_indices_size() &&
+        previous.bucket_indices(j) == current.bucket_indices(i)) {
+      count -= previous.bucket_counts(j);
+    }
+    if (count <= 0) continue;
+    if (!delta.bucket_indices_size()) {
+      delta.set_min_latency_ns(std::max(
+          current.min_latency_ns(),
+          AtomicLatencyHistogram::BucketLowerBound(current.bucket_indices(i))));
+    }
+    delta.set_max_latency_ns(std::min(
+        current.max_latency_ns(),
+        AtomicLatencyHistogram::BucketUpperBound(current.bucket_indices(i))));
+    delta.add_bucket_indices(current.bucket_indices(i));
+    delta.add_bucket_counts(count);
+  }
+  int64_t count = current.successful_rpc_count() -
+                  previous.successful_rpc_count();
+  if (count > 0) {
+    delta.set_successful_rpc_count(count);
+    delta.set_total_latency_ns(current.total_latency_ns() -
+                               previous.total_latency_ns());
+    delta.set_total_request_size(current.total_request_size() -
+                                 previous.total_request_size());
+    delta.set_total_response_size(current.total_response_size() -
+                                  previous.total_response_size());
+  } else {
+    delta.clear_min_latency_ns();
+    delta.clear_max_latency_ns();
+  }
+  if (current.failed_rpc_count() > previous.failed_rpc_count()) {
+    delta.set_failed_rpc_count(current.failed_rpc_count() -
+                               previous.failed_rpc_count());
+  }
+  if (current.warmup_rpc_count() > previous.warmup_rpc_count()) {
+    delta.set_warmup_rpc_count(current.warmup_rpc_count() -
+                               previous.warmup_rpc_count());
+  }
+  return delta;
+}
+
+int64_t AtomicLatencyHistogram::ValueAtFraction(double fraction) const {
+  const std::atomic<int64_t>* buckets =
+      buckets_.load(std::memory_order_acquire);
+  const int64_t count = Count();
+  if (!buckets || !count) return 0;
+  const int64_t rank = std::min<int64_t>(fraction * count, count - 1);
+  int64_t seen = 0;
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    seen += buckets[i].load(kRelaxed);
+    if (seen > rank) {
+      return std::clamp(BucketUpperBound(i), MinLatency(), MaxLatency());
+    }
+  }
+  return MaxLatency();
+}
+
+}  // namespace distbench
@@ -0,0 +1,112 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_DISTBENCH_HISTOGRAM_H_
+#define DISTBENCH_DISTBENCH_HISTOGRAM_H_
+
+#include <atomic>
+#include <limits>
+
+#include "absl/status/status.h"
+#include "distbench.pb.h"
+
+namespace distbench {
+
+// A lock-free, mergeable, log-bucketed latency histogram. Recording is a
+// handful of relaxed atomic operations, so it can be done from any number of
+// RPC completion threads at once. The relative error on the reported
+// latencies is bounded by 2^-kSubBucketBits (i.e. < 1%).
+class AtomicLatencyHistogram {
+ public:
+  static constexpr int kSubBucketBits = 7;
+  // Latencies of 2^kMaxExponent ns (~68s) or more share the last buckets.
+  static constexpr int kMaxExponent = 35;
+  static constexpr size_t kNumBuckets = (kMaxExponent - kSubBucketBits + 2)
+                                        << kSubBucketBits;
+
+  AtomicLatencyHistogram() {}
+  ~AtomicLatencyHistogram();
+  AtomicLatencyHistogram(const AtomicLatencyHistogram&) = delete;
+  AtomicLatencyHistogram& operator=(const AtomicLatencyHistogram&) = delete;
+
+  // Records a successful, non-warmup RPC.
+  void Record(int64_t latency_ns, int64_t request_size, int64_t response_size,
+              int64_t start_timestamp_ns);
+  void RecordFailure() { failed_rpc_count_.fetch_add(1, kRelaxed); }
+  void RecordWarmup() { warmup_rpc_count_.fetch_add(1, kRelaxed); }
+
+  // Adds the content of a serialized histogram to this one.
+  absl::Status MergeFrom(const LatencyHistogram& proto);
+  LatencyHistogram ToProto() const;
+
+  bool Empty() const { return !Count() && !FailedCount() && !WarmupCount(); }
+  int64_t Count() const { return successful_rpc_count_.load(kRelaxed); }
+  int64_t FailedCount() const { return failed_rpc_count_.load(kRelaxed); }
+  int64_t WarmupCount() const { return warmup_rpc_count_.load(kRelaxed); }
+  int64_t MinLatency() const { return min_latency_ns_.load(kRelaxed); }
+  int64_t MaxLatency() const { return max_latency_ns_.load(kRelaxed); }
+  int64_t TotalLatency() const { return total_latency_ns_.load(kRelaxed); }
+  int64_t TotalRequestSize() const {
+    return total_request_size_.load(kRelaxed);
+  }
+  int64_t TotalResponseSize() const {
+    return total_response_size_.load(kRelaxed);
+  }
+  int64_t FirstStartTimestamp() const {
+    return first_start_timestamp_ns_.load(kRelaxed);
+  }
+  int64_t LastEndTimestamp() const {
+    return last_end_timestamp_ns_.load(kRelaxed);
+  }
+
+  // Returns (an upper bound of the bucket of) the latency of rank
+  // floor(fraction * Count()), the same rank that a sorted vector of all the
+  // latencies would be indexed with.
+  int64_t ValueAtFraction(double fraction) const;
+
+  static size_t BucketIndex(int64_t value);
+  static int64_t BucketLowerBound(size_t index);
+  static int64_t BucketUpperBound(size_t index);
+
+ private:
+  static constexpr std::memory_order kRelaxed = std::memory_order_relaxed;
+
+  std::atomic<int64_t>* Buckets();
+  void AddToBucket(size_t index, int64_t count);
+
+  // Allocated on first use, since most (peer, rpc) pairs may never be used.
+  std::atomic<std::atomic<int64_t>*> buckets_ = nullptr;
+  std::atomic<int64_t> successful_rpc_count_ = 0;
+  std::atomic<int64_t> min_latency_ns_ = std::numeric_limits<int64_t>::max();
+  std::atomic<int64_t> max_latency_ns_ = std::numeric_limits<int64_t>::min();
+  std::atomic<int64_t> total_latency_ns_ = 0;
+  std::atomic<int64_t> total_request_size_ = 0;
+  std::atomic<int64_t> total_response_size_ = 0;
+  std::atomic<int64_t> first_start_timestamp_ns_ =
+      std::numeric_limits<int64_t>::max();
+  std::atomic<int64_t> last_end_timestamp_ns_ =
+      std::numeric_limits<int64_t>::min();
+  std::atomic<int64_t> failed_rpc_count_ = 0;
+  std::atomic<int64_t> warmup_rpc_count_ = 0;
+};
+
+// Returns what was recorded in 'current' since 'previous', an earlier
+// snapshot of the same histogram. The min and max latencies are the bounds of
+// the buckets, and the timestamps are left out.
+LatencyHistogram LatencyHistogramDelta(const LatencyHistogram& current,
+                                       const LatencyHistogram& previous);
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_DISTBENCH_HISTOGRAM_H_
@@ -0,0 +1,155 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_histogram.h"
+
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "gtest_utils.h"
+
+namespace distbench {
+
+TEST(AtomicLatencyHistogram, BucketsAreContiguous) {
+  using H = AtomicLatencyHistogram;
+  EXPECT_EQ(H::BucketLowerBound(0), 0);
+  for (size_t i = 1; i < H::kNumBuckets; ++i) {
+    ASSERT_EQ(H::BucketLowerBound(i), H::BucketUpperBound(i - 1) + 1) << i;
+    ASSERT_EQ(H::BucketIndex(H::BucketLowerBound(i)), i);
+    ASSERT_EQ(H::BucketIndex(H::BucketUpperBound(i)), i);
+  }
+  EXPECT_EQ(H::BucketIndex(-5), 0UL);
+  EXPECT_EQ(H::BucketIndex(std::numeric_limits<int64_t>::max()),
+            H::kNumBuckets - 1);
+}
+
+TEST(AtomicLatencyHistogram, RelativeErrorIsBounded) {
+  using H = AtomicLatencyHistogram;
+  for (int64_t value = 1; value < (1L << H::kMaxExponent); value = value * 3) {
+    size_t index = H::BucketIndex(value);
+    double width = H::BucketUpperBound(index) - H::BucketLowerBound(index);
+    EXPECT_LE(width / value, 1.0 / (1 << H::kSubBucketBits)) << value;
+  }
+}
+
+TEST(AtomicLatencyHistogram, Percentiles) {
+  AtomicLatencyHistogram histogram;
+  EXPECT_TRUE(histogram.Empty());
+  for (int i = 1; i <= 100'000; ++i) {
+    histogram.Record(i * 1000, 10, 20, i);
+  }
+  EXPECT_FALSE(histogram.Empty());
+  EXPECT_EQ(histogram.Count(), 100'000);
+  EXPECT_EQ(histogram.MinLatency(), 1000);
+  EXPECT_EQ(histogram.MaxLatency(), 100'000'000);
+  EXPECT_EQ(histogram.TotalRequestSize(), 1'000'000);
+  EXPECT_EQ(histogram.TotalResponseSize(), 2'000'000);
+  EXPECT_EQ(histogram.FirstStartTimestamp(), 1);
+  EXPECT_EQ(histogram.LastEndTimestamp(), 100'000 + 100'000'000);
+  EXPECT_NEAR(histogram.ValueAtFraction(0.5), 50'000'000, 50'000'000 / 100);
+  EXPECT_NEAR(histogram.ValueAtFraction(0.99), 99'000'000, 99'000'000 / 100);
+  EXPECT_NEAR(histogram.ValueAtFraction(0), 1000, 1000 / 100);
+  EXPECT_EQ(histogram.ValueAtFraction(1), 100'000'000);
+}
+
+TEST(AtomicLatencyHistogram, ProtoRoundTrip) {
+  AtomicLatencyHistogram h1;
+  AtomicLatencyHistogram h2;
+  for (int i = 0; i < 1000; ++i) {
+    h1.Record(i, 1, 2, 1000 + i);
+    h2.Record(i * 1000, 3, 4, 10 + i);
+  }
+  h1.RecordFailure();
+  h2.RecordWarmup();
+  h2.RecordWarmup();
+
+  AtomicLatencyHistogram merged;
+  ASSERT_OK(merged.MergeFrom(h1.ToProto()));
+  ASSERT_OK(merged.MergeFrom(h2.ToProto()));
+  EXPECT_EQ(merged.Count(), 2000);
+  EXPECT_EQ(merged.FailedCount(), 1);
+  EXPECT_EQ(merged.WarmupCount(), 2);
+  EXPECT_EQ(merged.MinLatency(), 0);
+  EXPECT_EQ(merged.MaxLatency(), 999'000);
+  EXPECT_EQ(merged.TotalRequestSize(), 4000);
+  EXPECT_EQ(merged.TotalResponseSize(), 6000);
+  EXPECT_EQ(merged.FirstStartTimestamp(), 10);
+  EXPECT_EQ(merged.LastEndTimestamp(), 1009 + 999'000);
+  EXPECT_EQ(merged.ValueAtFraction(0.25), 499);
+
+  LatencyHistogram bad = h1.ToProto();
+  bad.set_sub_bucket_bits(3);
+  EXPECT_FALSE(merged.MergeFrom(bad).ok());
+  bad = h1.ToProto();
+  bad.add_bucket_indices(AtomicLatencyHistogram::kNumBuckets);
+  bad.add_bucket_counts(1);
+  EXPECT_FALSE(merged.MergeFrom(bad).ok());
+}
+
+TEST(AtomicLatencyHistogram, Delta) {
+  AtomicLatencyHistogram histogram;
+  for (int i = 0; i < 1000; ++i) {
+    histogram.Record(1000 + i, 1, 2, i);
+  }
+  histogram.RecordFailure();
+  LatencyHistogram previous = histogram.ToProto();
+  for (int i = 0; i < 100; ++i) {
+    histogram.Record(1'000'000 + i, 1, 2, i);
+  }
+  histogram.RecordFailure();
+  histogram.RecordFailure();
+
+  AtomicLatencyHistogram delta;
+  ASSERT_OK(delta.MergeFrom(LatencyHistogramDelta(histogram.ToProto(),
+                                                  previous)));
+  EXPECT_EQ(delta.Count(), 100);
+  EXPECT_EQ(delta.FailedCount(), 2);
+  EXPECT_EQ(delta.WarmupCount(), 0);
+  EXPECT_EQ(delta.TotalRequestSize(), 100);
+  EXPECT_NEAR(delta.MinLatency(), 1'000'000, 1'000'000 / 100);
+  EXPECT_EQ(delta.MaxLatency(), 1'000'099);
+  EXPECT_NEAR(delta.ValueAtFraction(0.5), 1'000'050, 1'000'050 / 100);
+
+  LatencyHistogram empty =
+      LatencyHistogramDelta(histogram.ToProto(), histogram.ToProto());
+  EXPECT_EQ(empty.bucket_indices_size(), 0);
+  EXPECT_FALSE(empty.has_successful_rpc_count());
+  EXPECT_FALSE(empty.has_failed_rpc_count());
+}
+
+TEST(AtomicLatencyHistogram, ConcurrentRecord) {
+  AtomicLatencyHistogram histogram;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t) {
+    threads.emplace_back([&histogram, t]() {
+      for (int i = 0; i < 10'000; ++i) {
+        histogram.Record(t * 10'000 + i, 1, 1, 0);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  LatencyHistogram proto = histogram.ToProto();
+  int64_t total = 0;
+  for (int64_t count : proto.bucket_counts()) {
+    total += count;
+  }
+  EXPECT_EQ(total, 40'000);
+  EXPECT_EQ(histogram.Count(), 40'000);
+  EXPECT_EQ(histogram.MinLatency(), 0);
+  EXPECT_EQ(histogram.MaxLatency(), 39'999);
+}
+
+}  // namespace distbench
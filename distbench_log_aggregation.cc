@@ -0,0 +1,192 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_log_aggregation.h"
+
+#include <algorithm>
+#include <tuple>
+
+#include "absl/strings/str_cat.h"
+#include "distbench_histogram.h"
+#include "distbench_sample_columns.h"
+#include "glog/logging.h"
+
+namespace distbench {
+
+namespace {
+
+void MergeHistogram(AtomicLatencyHistogram* to, const LatencyHistogram& from,
+                    std::string_view what) {
+  absl::Status status = to->MergeFrom(from);
+  if (!status.ok()) LOG(WARNING) << "Ignoring a " << what << ": " << status;
+}
+
+// Merges the logs of the instances of each service, and drops the samples:
+void AggregateInstanceLogs(
+    std::string_view node_alias,
+    std::map<std::string, ServicePerformanceLog>* instance_logs) {
+  struct RpcAggregate {
+    AtomicLatencyHistogram latency_histogram;
+    AtomicLatencyHistogram reconnect_overlap_histogram;
+    std::map<int32_t, int64_t> batch_sizes;
+  };
+  // Keyed by (aggregated instance, peer, rpc index):
+  std::map<std::tuple<std::string, std::string, int32_t>, RpcAggregate> rpcs;
+  std::map<std::string, ServicePerformanceLog> aggregated_logs;
+  for (const auto& [instance_name, log] : *instance_logs) {
+    const std::string name = AggregatedInstanceName(
+        std::string_view(instance_name).substr(0, instance_name.rfind('/')),
+        node_alias);
+    ServicePerformanceLog& aggregated_log = aggregated_logs[name];
+    for (const auto& [peer_name, peer_log] : log.peer_logs()) {
+      for (const auto& [rpc_index, rpc_log] : peer_log.rpc_logs()) {
+        RpcAggregate& rpc = rpcs[{name, peer_name, rpc_index}];
+        if (rpc_log.has_latency_histogram()) {
+          MergeHistogram(&rpc.latency_histogram, rpc_log.latency_histogram(),
+                         "latency histogram");
+        }
+        if (rpc_log.has_reconnect_overlap_histogram()) {
+          MergeHistogram(&rpc.reconnect_overlap_histogram,
+                         rpc_log.reconnect_overlap_histogram(),
+                         "reconnect overlap histogram");
+        }
+        for (const auto& [batch_size, count] : rpc_log.batch_sizes()) {
+          rpc.batch_sizes[batch_size] += count;
+        }
+      }
+    }
+    for (const auto& [activity_name, activity_log] : log.activity_logs()) {
+      (*aggregated_log.mutable_activity_logs())[activity_name].MergeFrom(
+          activity_log);
+    }
+    for (const auto& [action_name, pacing_log] : log.pacing_logs()) {
+      PacingLog& merged = (*aggregated_log.mutable_pacing_logs())[action_name];
+      merged.set_iterations(merged.iterations() + pacing_log.iterations());
+      merged.set_behind_schedule_iterations(
+          merged.behind_schedule_iterations() +
+          pacing_log.behind_schedule_iterations());
+      merged.set_total_slip_ns(merged.total_slip_ns() +
+                               pacing_log.total_slip_ns());
+      merged.set_max_slip_ns(
+          std::max(merged.max_slip_ns(), pacing_log.max_slip_ns()));
+    }
+    for (const auto& [rpc_name, churn_log] : log.connection_churn_logs()) {
+      (*aggregated_log.mutable_connection_churn_logs())[rpc_name].MergeFrom(
+          churn_log);
+    }
+  }
+  for (const auto& [key, rpc] : rpcs) {
+    const auto& [name, peer_name, rpc_index] = key;
+    if (rpc.latency_histogram.Empty() && rpc.batch_sizes.empty()) continue;
+    RpcPerformanceLog& rpc_log =
+        (*(*aggregated_logs[name].mutable_peer_logs())[peer_name]
+              .mutable_rpc_logs())[rpc_index];
+    if (!rpc.latency_histogram.Empty()) {
+      *rpc_log.mutable_latency_histogram() = rpc.latency_histogram.ToProto();
+    }
+    if (!rpc.reconnect_overlap_histogram.Empty()) {
+      *rpc_log.mutable_reconnect_overlap_histogram() =
+          rpc.reconnect_overlap_histogram.ToProto();
+    }
+    for (const auto& [batch_size, count] : rpc.batch_sizes) {
+      (*rpc_log.mutable_batch_sizes())[batch_size] = count;
+    }
+  }
+  *instance_logs = std::move(aggregated_logs);
+}
+
+}  // anonymous namespace
+
+absl::Status ValidateResultsLevel(const DistributedSystemDescription& config) {
+  const std::string& level = config.results_level();
+  if (level != "raw" && level != "sampled" && level != "histograms_only") {
+    return absl::InvalidArgumentError(
+        absl::StrCat("results_level must be raw, sampled or histograms_only, "
+                     "not ",
+                     level));
+  }
+  if (config.results_max_samples() < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("results_max_samples (", config.results_max_samples(),
+                     ") must not be negative."));
+  }
+  return absl::OkStatus();
+}
+
+void ThinRpcSamples(RpcPerformanceLog* rpc_log, int64_t max_samples) {
+  int64_t total = rpc_log->successful_rpc_samples_size() +
+                  rpc_log->failed_rpc_samples_size();
+  for (const auto& columns : rpc_log->sample_columns()) {
+    total += columns.sample_count();
+  }
+  if (total <= max_samples) return;
+  // The samples are numbered across the RpcSamples and the columns, and the
+  // i-th one is kept if a multiple of total / max_samples falls in it:
+  int64_t index = 0;
+  auto keep = [&index, total, max_samples]() {
+    const bool kept =
+        (index + 1) * max_samples / total > index * max_samples / total;
+    ++index;
+    return kept;
+  };
+  auto thin = [&keep](google::protobuf::RepeatedPtrField<RpcSample>* samples) {
+    int nb_kept = 0;
+    for (int i = 0; i < samples->size(); ++i) {
+      if (!keep()) continue;
+      if (nb_kept != i) samples->SwapElements(nb_kept, i);
+      ++nb_kept;
+    }
+    samples->DeleteSubrange(nb_kept, samples->size() - nb_kept);
+  };
+  thin(rpc_log->mutable_successful_rpc_samples());
+  thin(rpc_log->mutable_failed_rpc_samples());
+  if (rpc_log->sample_columns().empty()) return;
+  RpcSampleColumnsWriter writer;
+  for (const auto& columns : rpc_log->sample_columns()) {
+    RpcSampleColumnsReader reader(columns);
+    ColumnarSample sample;
+    while (reader.Next(&sample)) {
+      if (keep()) writer.Add(sample);
+    }
+    if (!reader.status().ok()) {
+      LOG(WARNING) << "Ignoring the rest of a sample block: "
+                   << reader.status();
+    }
+  }
+  rpc_log->clear_sample_columns();
+  if (writer.size()) *rpc_log->add_sample_columns() = writer.Finish();
+}
+
+std::string AggregatedInstanceName(std::string_view service_type,
+                                   std::string_view node_alias) {
+  return absl::StrCat(service_type, "@", node_alias);
+}
+
+void ApplyResultsLevel(
+    const DistributedSystemDescription& config, std::string_view node_alias,
+    std::map<std::string, ServicePerformanceLog>* instance_logs) {
+  if (config.results_level() == "sampled") {
+    for (auto& [instance_name, log] : *instance_logs) {
+      for (auto& [peer_name, peer_log] : *log.mutable_peer_logs()) {
+        for (auto& [rpc_index, rpc_log] : *peer_log.mutable_rpc_logs()) {
+          ThinRpcSamples(&rpc_log, config.results_max_samples());
+        }
+      }
+    }
+  } else if (config.results_level() == "histograms_only") {
+    AggregateInstanceLogs(node_alias, instance_logs);
+  }
+}
+
+}  // namespace distbench
@@ -0,0 +1,49 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_DISTBENCH_LOG_AGGREGATION_H_
+#define DISTBENCH_DISTBENCH_LOG_AGGREGATION_H_
+
+#include <map>
+#include <string>
+#include <string_view>
+
+#include "absl/status/status.h"
+#include "distbench.pb.h"
+#include "traffic_config.pb.h"
+
+namespace distbench {
+
+// Checks the results_level and results_max_samples of a test.
+absl::Status ValidateResultsLevel(const DistributedSystemDescription& config);
+
+// Keeps at most max_samples of the samples of rpc_log, RpcSamples and
+// columns alike, evenly spread over them.
+void ThinRpcSamples(RpcPerformanceLog* rpc_log, int64_t max_samples);
+
+// The name under which the logs of the instances of service_type on the
+// node are merged by the "histograms_only" results_level, e.g.
+// "client@node0".
+std::string AggregatedInstanceName(std::string_view service_type,
+                                   std::string_view node_alias);
+
+// Reduces the logs of the service instances of a node, keyed by instance
+// name, as the results_level of config says.
+void ApplyResultsLevel(
+    const DistributedSystemDescription& config, std::string_view node_alias,
+    std::map<std::string, ServicePerformanceLog>* instance_logs);
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_DISTBENCH_LOG_AGGREGATION_H_
@@ -0,0 +1,131 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_log_aggregation.h"
+
+#include "distbench_histogram.h"
+#include "distbench_sample_columns.h"
+#include "gtest/gtest.h"
+#include "gtest_utils.h"
+
+namespace distbench {
+
+namespace {
+
+// A client log with nb_rpcs successful RPCs of 100 bytes to server/0, both
+// sampled and counted in the histogram.
+ServicePerformanceLog ClientLog(int nb_rpcs) {
+  ServicePerformanceLog log;
+  RpcPerformanceLog& rpc_log =
+      (*(*log.mutable_peer_logs())["server/0"].mutable_rpc_logs())[0];
+  AtomicLatencyHistogram histogram;
+  for (int i = 0; i < nb_rpcs; ++i) {
+    RpcSample* sample = rpc_log.add_successful_rpc_samples();
+    sample->set_start_timestamp_ns(i * 1000);
+    sample->set_latency_ns(1000 + i);
+    sample->set_request_size(100);
+    sample->set_response_size(100);
+    histogram.Record(1000 + i, 100, 100, i * 1000);
+  }
+  *rpc_log.mutable_latency_histogram() = histogram.ToProto();
+  PacingLog& pacing_log = (*log.mutable_pacing_logs())["run_queries"];
+  pacing_log.set_iterations(nb_rpcs);
+  pacing_log.set_max_slip_ns(nb_rpcs);
+  return log;
+}
+
+}  // anonymous namespace
+
+TEST(LogAggregation, ValidateResultsLevel) {
+  DistributedSystemDescription config;
+  ASSERT_OK(ValidateResultsLevel(config));
+  config.set_results_level("histograms_only");
+  ASSERT_OK(ValidateResultsLevel(config));
+  config.set_results_level("none");
+  EXPECT_FALSE(ValidateResultsLevel(config).ok());
+  config.set_results_level("sampled");
+  config.set_results_max_samples(-1);
+  EXPECT_FALSE(ValidateResultsLevel(config).ok());
+}
+
+TEST(LogAggregation, ThinRpcSamples) {
+  RpcPerformanceLog rpc_log;
+  for (int i = 0; i < 60; ++i) {
+    rpc_log.add_successful_rpc_samples()->set_latency_ns(i);
+  }
+  for (int i = 0; i < 20; ++i) {
+    rpc_log.add_failed_rpc_samples()->set_latency_ns(i);
+  }
+  RpcSampleColumnsWriter writer;
+  for (int i = 0; i < 20; ++i) {
+    writer.Add({.start_timestamp_ns = i, .latency_ns = i});
+  }
+  *rpc_log.add_sample_columns() = writer.Finish();
+  ThinRpcSamples(&rpc_log, 10);
+  // One sample out of 10, wherever it was:
+  EXPECT_EQ(rpc_log.successful_rpc_samples_size(), 6);
+  EXPECT_EQ(rpc_log.successful_rpc_samples(0).latency_ns(), 9);
+  EXPECT_EQ(rpc_log.failed_rpc_samples_size(), 2);
+  ASSERT_EQ(rpc_log.sample_columns_size(), 1);
+  EXPECT_EQ(rpc_log.sample_columns(0).sample_count(), 2);
+
+  ThinRpcSamples(&rpc_log, 10);
+  EXPECT_EQ(rpc_log.successful_rpc_samples_size(), 6);
+}
+
+TEST(LogAggregation, SampledKeepsInstances) {
+  DistributedSystemDescription config;
+  config.set_results_level("sampled");
+  config.set_results_max_samples(5);
+  std::map<std::string, ServicePerformanceLog> instance_logs;
+  instance_logs["client/0"] = ClientLog(100);
+  instance_logs["client/1"] = ClientLog(3);
+  ApplyResultsLevel(config, "node0", &instance_logs);
+  ASSERT_EQ(instance_logs.size(), 2);
+  const RpcPerformanceLog& rpc_log =
+      instance_logs["client/0"].peer_logs().at("server/0").rpc_logs().at(0);
+  EXPECT_EQ(rpc_log.successful_rpc_samples_size(), 5);
+  EXPECT_EQ(rpc_log.latency_histogram().successful_rpc_count(), 100);
+  EXPECT_EQ(instance_logs["client/1"]
+                .peer_logs()
+                .at("server/0")
+                .rpc_logs()
+                .at(0)
+                .successful_rpc_samples_size(),
+            3);
+}
+
+TEST(LogAggregation, HistogramsOnlyMergesInstances) {
+  DistributedSystemDescription config;
+  config.set_results_level("histograms_only");
+  std::map<std::string, ServicePerformanceLog> instance_logs;
+  instance_logs["client/0"] = ClientLog(100);
+  instance_logs["client/1"] = ClientLog(3);
+  ApplyResultsLevel(config, "node0", &instance_logs);
+  ASSERT_EQ(instance_logs.size(), 1);
+  const ServicePerformanceLog& log = instance_logs["client@node0"];
+  const RpcPerformanceLog& rpc_log =
+      log.peer_logs().at("server/0").rpc_logs().at(0);
+  EXPECT_EQ(rpc_log.successful_rpc_samples_size(), 0);
+  AtomicLatencyHistogram histogram;
+  ASSERT_OK(histogram.MergeFrom(rpc_log.latency_histogram()));
+  EXPECT_EQ(histogram.Count(), 103);
+  EXPECT_EQ(histogram.TotalRequestSize(), 10300);
+  EXPECT_EQ(histogram.MaxLatency(), 1099);
+  const PacingLog& pacing_log = log.pacing_logs().at("run_queries");
+  EXPECT_EQ(pacing_log.iterations(), 103);
+  EXPECT_EQ(pacing_log.max_slip_ns(), 100);
+}
+
+}  // namespace distbench
@@ -14,8 +14,14 @@
 
 #include "distbench_node_manager.h"
 
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include "absl/strings/str_split.h"
+#include "distbench_log_aggregation.h"
+#include "distbench_perf_counters.h"
 #include "distbench_utils.h"
+#include "distbench_wait_policy.h"
 #include "glog/logging.h"
 #include "protocol_driver_allocator.h"
 
@@ -32,7 +38,49 @@ absl::StatusOr<ProtocolDriverOptions> NodeManager::ResolveProtocolDriverAlias(
       "Could not resolve protocol driver alias for ", protocol_name, "."));
 }
 
+namespace {
+
+// The parts of a traffic config that the engines, their protocol drivers and
+// the connections between them depend on:
+std::string ServicesTopology(const DistributedSystemDescription& config) {
+  DistributedSystemDescription topology;
+  *topology.mutable_services() = config.services();
+  *topology.mutable_protocol_driver_options() =
+      config.protocol_driver_options();
+  if (config.has_default_protocol()) {
+    topology.set_default_protocol(config.default_protocol());
+  }
+  for (const auto& rpc : config.rpc_descriptions()) {
+    auto* topology_rpc = topology.add_rpc_descriptions();
+    topology_rpc->set_client(rpc.client());
+    topology_rpc->set_server(rpc.server());
+  }
+  return topology.SerializeAsString();
+}
+
+bool SameEndpoints(const ServiceEndpointMap& a, const ServiceEndpointMap& b) {
+  if (a.service_endpoints_size() != b.service_endpoints_size()) return false;
+  for (const auto& [name, endpoint] : a.service_endpoints()) {
+    auto it = b.service_endpoints().find(name);
+    if (it == b.service_endpoints().end() ||
+        it->second.endpoint_address() != endpoint.endpoint_address()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // anonymous namespace
+
+namespace {
+
+// The node managers of the process, e.g. with --local_nodes:
+std::atomic<int> node_managers_in_process = 0;
+
+}  // anonymous namespace
+
 NodeManager::NodeManager() {
+  ++node_managers_in_process;
   auto func =
       [=](std::string protocol_name) -> absl::StatusOr<ProtocolDriverOptions> {
     return ResolveProtocolDriverAlias(protocol_name);
@@ -44,8 +92,36 @@ grpc::Status NodeManager::ConfigureNode(grpc::ServerContext* context,
                                         const NodeServiceConfig* request,
                                         ServiceEndpointMap* response) {
   absl::MutexLock m(&mutex_);
+  ThreadPlacerScope placer_scope(&thread_placer_);
+  absl::Status perf_counters_status =
+      ValidatePerfCountersMode(request->traffic_config().perf_counters());
+  if (!perf_counters_status.ok()) {
+    return abslStatusToGrpcStatus(perf_counters_status);
+  }
+  absl::Status results_level_status =
+      ValidateResultsLevel(request->traffic_config());
+  if (!results_level_status.ok()) {
+    return abslStatusToGrpcStatus(results_level_status);
+  }
+  if (request->reuse_engines() && CanReuseServices(*request)) {
+    traffic_config_ = request->traffic_config();
+    for (const auto& service_engine : service_engines_) {
+      absl::Status ret =
+          service_engine.second->ReloadTrafficConfig(traffic_config_);
+      if (!ret.ok()) {
+        ClearServices();
+        return abslStatusToGrpcStatus(ret);
+      }
+    }
+    reused_services_ = true;
+    *response = service_endpoints_;
+    LOG(INFO) << "Reusing the engines of the previous test on " << NodeAlias();
+    return grpc::Status::OK;
+  }
   traffic_config_ = request->traffic_config();
   ClearServices();
+  // Forget the thread placement rules of the previous protocol drivers:
+  thread_placer_.Reset();
   auto& service_map = *response->mutable_service_endpoints();
   for (const auto& service_name : request->services()) {
     std::vector<std::string> service_instance =
@@ -80,10 +156,26 @@ grpc::Status NodeManager::ConfigureNode(grpc::ServerContext* context,
     service_entry.set_endpoint_address(maybe_address.value());
     service_entry.set_hostname(Hostname());
   }
+  service_endpoints_ = *response;
   return grpc::Status::OK;
 }
 
-void NodeManager::ClearServices() { service_engines_.clear(); }
+bool NodeManager::CanReuseServices(const NodeServiceConfig& request) {
+  if (request.services_size() != static_cast<int>(service_engines_.size())) {
+    return false;
+  }
+  for (const auto& service_name : request.services()) {
+    if (!service_engines_.count(service_name)) return false;
+  }
+  return ServicesTopology(request.traffic_config()) ==
+         ServicesTopology(traffic_config_);
+}
+
+void NodeManager::ClearServices() {
+  service_engines_.clear();
+  service_endpoints_.Clear();
+  reused_services_ = false;
+}
 
 absl::StatusOr<ProtocolDriverOptions> NodeManager::GetProtocolDriverOptionsFor(
     const ServiceOpts& service_opts) {
@@ -138,12 +230,34 @@ grpc::Status NodeManager::IntroducePeers(grpc::ServerContext* context,
                                          const ServiceEndpointMap* request,
                                          IntroducePeersResult* response) {
   absl::MutexLock m(&mutex_);
+  ThreadPlacerScope placer_scope(&thread_placer_);
+  if (reused_services_) {
+    // The engines are still connected to the peers of the previous test:
+    if (SameEndpoints(*request, peers_)) return grpc::Status::OK;
+    return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                        "The peers of the reused engines have changed");
+  }
   peers_ = *request;
+  // The engines connect to their peers in parallel:
+  const ServiceEndpointMap& peers = peers_;
+  std::atomic<bool> failed = false;
+  std::vector<std::thread> threads;
+  threads.reserve(service_engines_.size());
   for (const auto& service_engine : service_engines_) {
-    auto ret = service_engine.second->ConfigurePeers(peers_);
-    if (!ret.ok()) {
-      return grpc::Status(grpc::StatusCode::UNKNOWN, "ConfigurePeers failure");
-    }
+    DistBenchEngine* engine = service_engine.second.get();
+    threads.push_back(RunRegisteredThread("ConfigurePeers", [&, engine]() {
+      auto ret = engine->ConfigurePeers(peers);
+      if (!ret.ok()) {
+        LOG(ERROR) << "ConfigurePeers failure: " << ret;
+        failed = true;
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  if (failed) {
+    return grpc::Status(grpc::StatusCode::UNKNOWN, "ConfigurePeers failure");
   }
   return grpc::Status::OK;
 }
@@ -152,8 +266,33 @@ grpc::Status NodeManager::RunTraffic(grpc::ServerContext* context,
                                      const RunTrafficRequest* request,
                                      RunTrafficResponse* response) {
   absl::ReaderMutexLock m(&mutex_);
+  ThreadPlacerScope placer_scope(&thread_placer_);
 
   rusage_start_test_ = DoGetRusage();
+  wait_times_start_test_ = GetWaitTimesLog(&thread_placer_);
+  perf_counters_log_.reset();
+  std::unique_ptr<PerfCounterSet> perf_counters;
+  // The nodes that share the process only count their own threads, rather
+  // than each counting the threads of all of them:
+  std::optional<std::vector<pid_t>> threads;
+  if (!traffic_config_.perf_counters().empty()) {
+    perf_counters_log_.emplace();
+    if (node_managers_in_process > 1) {
+      threads = thread_placer_.ThreadIds();
+      // This thread starts the engine threads, which it counts once they
+      // exit:
+      threads->push_back(syscall(SYS_gettid));
+    }
+    auto maybe_perf_counters =
+        PerfCounterSet::Start(traffic_config_.perf_counters(), threads);
+    if (maybe_perf_counters.ok()) {
+      perf_counters = std::move(maybe_perf_counters.value());
+    } else {
+      LOG(WARNING) << "Not counting the hardware events: "
+                   << maybe_perf_counters.status();
+      perf_counters_log_->set_error(maybe_perf_counters.status().ToString());
+    }
+  }
 
   for (const auto& service_engine : service_engines_) {
     auto ret = service_engine.second->RunTraffic(request);
@@ -165,34 +304,229 @@ grpc::Status NodeManager::RunTraffic(grpc::ServerContext* context,
   for (const auto& service_engine : service_engines_)
     service_engine.second->FinishTraffic();
 
+  if (perf_counters) {
+    *perf_counters_log_ = perf_counters->Read();
+    if (threads) perf_counters_log_->set_node_threads_only(true);
+  }
   return grpc::Status::OK;
 }
 
-grpc::Status NodeManager::GetTrafficResult(
-    grpc::ServerContext* context, const GetTrafficResultRequest* request,
-    GetTrafficResultResponse* response) {
-  absl::MutexLock m(&mutex_);
-
-  auto& service_logs = *response->mutable_service_logs();
-  auto& instance_logs = *service_logs.mutable_instance_logs();
+std::map<std::string, ServicePerformanceLog>
+NodeManager::CollectTrafficResult(const GetTrafficResultRequest& request) {
+  std::map<std::string, ServicePerformanceLog> instance_logs;
   for (const auto& service_engine : service_engines_) {
     auto log = service_engine.second->GetLogs();
-    if (log.peer_logs().empty() && log.activity_logs().empty()) continue;
+    if (log.peer_logs().empty() && log.activity_logs().empty() &&
+        log.pacing_logs().empty()) {
+      continue;
+    }
     instance_logs[service_engine.first] = std::move(log);
   }
+  ApplyResultsLevel(traffic_config_, NodeAlias(), &instance_logs);
 
-  if (request->clear_services()) {
+  if (request.clear_services()) {
     for (const auto& service_engine : service_engines_) {
       service_engine.second->CancelTraffic();
     }
     ClearServices();
   }
+  return instance_logs;
+}
+
+grpc::Status NodeManager::GetTrafficResult(
+    grpc::ServerContext* context, const GetTrafficResultRequest* request,
+    GetTrafficResultResponse* response) {
+  absl::MutexLock m(&mutex_);
+
+  auto& instance_logs =
+      *response->mutable_service_logs()->mutable_instance_logs();
+  for (auto& instance_log : CollectTrafficResult(*request)) {
+    instance_logs[instance_log.first] = std::move(instance_log.second);
+  }
   (*response->mutable_node_usages())[NodeAlias()] =
       GetRUsageStatsFromStructs(rusage_start_test_, DoGetRusage());
+  (*response->mutable_node_thread_placements())[NodeAlias()] =
+      thread_placer_.GetLog();
+  if (perf_counters_log_) {
+    (*response->mutable_node_perf_counters())[NodeAlias()] =
+        *perf_counters_log_;
+  }
+  (*response->mutable_node_wait_times())[NodeAlias()] =
+      WaitTimesLogDelta(GetWaitTimesLog(&thread_placer_),
+                        wait_times_start_test_);
 
   return grpc::Status::OK;
 }
 
+namespace {
+
+// Sends the logs of one (instance, peer) pair, split into responses that
+// hold at most max_samples samples each (or a single RpcSampleColumns
+// block). The latency histograms of each rpc
+// are only sent once, with the first page of that rpc.
+bool StreamPeerLog(const std::string& instance_name,
+                   const std::string& peer_name, PeerPerformanceLog& peer_log,
+                   size_t max_samples,
+                   grpc::ServerWriter<GetTrafficResultResponse>* writer) {
+  GetTrafficResultResponse response;
+  PeerPerformanceLog* output_peer_log = nullptr;
+  size_t nb_samples = 0;
+  auto start_response = [&]() {
+    response.Clear();
+    auto& output_instance_log =
+        (*response.mutable_service_logs()->mutable_instance_logs())
+            [instance_name];
+    output_peer_log = &(*output_instance_log.mutable_peer_logs())[peer_name];
+    nb_samples = 0;
+  };
+  start_response();
+  for (auto& rpc_log : *peer_log.mutable_rpc_logs()) {
+    RpcPerformanceLog& log = rpc_log.second;
+    RpcPerformanceLog* output_rpc_log =
+        &(*output_peer_log->mutable_rpc_logs())[rpc_log.first];
+    if (log.has_latency_histogram()) {
+      *output_rpc_log->mutable_latency_histogram() =
+          std::move(*log.mutable_latency_histogram());
+    }
+    if (log.has_reconnect_overlap_histogram()) {
+      *output_rpc_log->mutable_reconnect_overlap_histogram() =
+          std::move(*log.mutable_reconnect_overlap_histogram());
+    }
+    output_rpc_log->mutable_batch_sizes()->swap(*log.mutable_batch_sizes());
+    auto move_samples =
+        [&](google::protobuf::RepeatedPtrField<RpcSample>* samples,
+            bool successful) {
+          for (auto& sample : *samples) {
+            if (nb_samples == max_samples) {
+              if (!writer->Write(response)) return false;
+              start_response();
+              output_rpc_log =
+                  &(*output_peer_log->mutable_rpc_logs())[rpc_log.first];
+            }
+            *(successful ? output_rpc_log->add_successful_rpc_samples()
+                         : output_rpc_log->add_failed_rpc_samples()) =
+                std::move(sample);
+            ++nb_samples;
+          }
+          samples->Clear();
+          return true;
+        };
+    if (!move_samples(log.mutable_successful_rpc_samples(), true) ||
+        !move_samples(log.mutable_failed_rpc_samples(), false)) {
+      return false;
+    }
+    // Column blocks are not split, so a single block may exceed max_samples:
+    for (auto& columns : *log.mutable_sample_columns()) {
+      if (nb_samples > 0 &&
+          nb_samples + columns.sample_count() > max_samples) {
+        if (!writer->Write(response)) return false;
+        start_response();
+        output_rpc_log =
+            &(*output_peer_log->mutable_rpc_logs())[rpc_log.first];
+      }
+      nb_samples += columns.sample_count();
+      *output_rpc_log->add_sample_columns() = std::move(columns);
+    }
+    log.clear_sample_columns();
+  }
+  if (output_peer_log->rpc_logs().empty()) return true;
+  return writer->Write(response);
+}
+
+}  // anonymous namespace
+
+grpc::Status NodeManager::GetTrafficResultStream(
+    grpc::ServerContext* context, const GetTrafficResultRequest* request,
+    grpc::ServerWriter<GetTrafficResultResponse>* writer) {
+  std::map<std::string, ServicePerformanceLog> instance_logs;
+  GetTrafficResultResponse usage_response;
+  {
+    absl::MutexLock m(&mutex_);
+    instance_logs = CollectTrafficResult(*request);
+    (*usage_response.mutable_node_usages())[NodeAlias()] =
+        GetRUsageStatsFromStructs(rusage_start_test_, DoGetRusage());
+    (*usage_response.mutable_node_thread_placements())[NodeAlias()] =
+        thread_placer_.GetLog();
+    if (perf_counters_log_) {
+      (*usage_response.mutable_node_perf_counters())[NodeAlias()] =
+          *perf_counters_log_;
+    }
+    (*usage_response.mutable_node_wait_times())[NodeAlias()] =
+        WaitTimesLogDelta(GetWaitTimesLog(&thread_placer_),
+                        wait_times_start_test_);
+  }
+
+  const size_t max_samples = std::max(1, request->max_samples_per_response());
+  for (auto& instance_log : instance_logs) {
+    for (auto& peer_log : *instance_log.second.mutable_peer_logs()) {
+      if (!StreamPeerLog(instance_log.first, peer_log.first, peer_log.second,
+                         max_samples, writer)) {
+        return grpc::Status(grpc::StatusCode::CANCELLED,
+                            "GetTrafficResultStream client went away");
+      }
+      peer_log.second.Clear();
+    }
+    if (!instance_log.second.activity_logs().empty() ||
+        !instance_log.second.pacing_logs().empty() ||
+        !instance_log.second.connection_churn_logs().empty()) {
+      GetTrafficResultResponse response;
+      auto& output_instance_log =
+          (*response.mutable_service_logs()->mutable_instance_logs())
+              [instance_log.first];
+      *output_instance_log.mutable_activity_logs() =
+          std::move(*instance_log.second.mutable_activity_logs());
+      *output_instance_log.mutable_pacing_logs() =
+          std::move(*instance_log.second.mutable_pacing_logs());
+      *output_instance_log.mutable_connection_churn_logs() =
+          std::move(*instance_log.second.mutable_connection_churn_logs());
+      if (!writer->Write(response)) {
+        return grpc::Status(grpc::StatusCode::CANCELLED,
+                            "GetTrafficResultStream client went away");
+      }
+    }
+  }
+  if (!writer->Write(usage_response)) {
+    return grpc::Status(grpc::StatusCode::CANCELLED,
+                        "GetTrafficResultStream client went away");
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status NodeManager::GetLiveMetrics(
+    grpc::ServerContext* context, const LiveMetricsRequest* request,
+    grpc::ServerWriter<LiveMetrics>* writer) {
+  const absl::Duration interval =
+      absl::Milliseconds(std::max<int64_t>(1, request->interval_ms()));
+  absl::Time next_snapshot = absl::Now() + interval;
+  while (!context->IsCancelled() && !shutdown_requested_.HasBeenNotified()) {
+    // Sleep in short steps, to notice soon enough that the stream was
+    // cancelled:
+    absl::Time now = absl::Now();
+    if (now < next_snapshot) {
+      absl::SleepFor(std::min(next_snapshot - now, absl::Milliseconds(50)));
+      continue;
+    }
+    next_snapshot += interval;
+    LiveMetrics metrics;
+    {
+      absl::ReaderMutexLock m(&mutex_);
+      for (const auto& service_engine : service_engines_) {
+        for (auto& rpc_metrics : service_engine.second->GetLiveMetrics()) {
+          rpc_metrics.set_service_instance(service_engine.first);
+          *metrics.add_rpc_metrics() = std::move(rpc_metrics);
+        }
+      }
+    }
+    metrics.set_node_alias(NodeAlias());
+    metrics.set_timestamp_ns(absl::ToUnixNanos(absl::Now()));
+    if (!writer->Write(metrics)) {
+      return grpc::Status(grpc::StatusCode::CANCELLED,
+                          "GetLiveMetrics client went away");
+    }
+  }
+  return grpc::Status::OK;
+}
+
 grpc::Status NodeManager::CancelTraffic(grpc::ServerContext* context,
                                         const CancelTrafficRequest* request,
                                         CancelTrafficResult* response) {
@@ -230,6 +564,7 @@ void NodeManager::Wait() {
 }
 
 NodeManager::~NodeManager() {
+  --node_managers_in_process;
   SetProtocolDriverAliasResolver(
       std::function<absl::StatusOr<ProtocolDriverOptions>(
           const std::string&)>());
@@ -248,6 +583,13 @@ absl::Status NodeManager::Initialize(const NodeManagerOpts& opts) {
     return absl::InvalidArgumentError(
         "node_manager requires the --test_sequencer flag.");
   }
+  absl::Status placement_status =
+      thread_placer_.SetNodeRules(opts_.thread_placement, opts_.reserved_cpus,
+                                  opts_.default_data_plane_device);
+  if (!placement_status.ok()) {
+    Shutdown();
+    return placement_status;
+  }
   std::shared_ptr<grpc::ChannelCredentials> client_creds =
       MakeChannelCredentials();
   std::shared_ptr<grpc::Channel> channel = grpc::CreateCustomChannel(
@@ -286,6 +628,18 @@ absl::Status NodeManager::Initialize(const NodeManagerOpts& opts) {
   }
   reg.set_control_ip(maybe_ip.value().ip());
   reg.set_control_port(*opts_.port);
+  for (std::string_view attribute :
+       absl::StrSplit(opts_.node_attributes, ',', absl::SkipEmpty())) {
+    std::vector<std::string> name_value = absl::StrSplit(attribute, '=');
+    if (name_value.size() != 2 || name_value[0].empty()) {
+      Shutdown();
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid node attribute: '", attribute, "'"));
+    }
+    auto* reg_attribute = reg.add_attributes();
+    reg_attribute->set_name(name_value[0]);
+    reg_attribute->set_value(name_value[1]);
+  }
 
   grpc::ClientContext context;
   SetGrpcClientContextDeadline(&context, /*max_time_s=*/60);
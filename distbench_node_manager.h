@@ -15,6 +15,8 @@
 #ifndef DISTBENCH_DISTBENCH_NODE_MANAGER_H_
 #define DISTBENCH_DISTBENCH_NODE_MANAGER_H_
 
+#include <optional>
+
 #include "absl/status/statusor.h"
 #include "distbench.grpc.pb.h"
 #include "distbench_engine.h"
@@ -26,6 +28,10 @@ struct NodeManagerOpts {
   std::string test_sequencer_service_address;
   std::string default_data_plane_device;
   std::string control_plane_device;
+  std::string thread_placement;
+  std::string reserved_cpus;
+  // Attributes to register the node with, e.g. "rack=r1,zone=z2":
+  std::string node_attributes;
   int* port;
 };
 
@@ -56,6 +62,14 @@ class NodeManager final : public DistBenchNodeManager::Service {
                                 const GetTrafficResultRequest* request,
                                 GetTrafficResultResponse* response) override;
 
+  grpc::Status GetTrafficResultStream(
+      grpc::ServerContext* context, const GetTrafficResultRequest* request,
+      grpc::ServerWriter<GetTrafficResultResponse>* writer) override;
+
+  grpc::Status GetLiveMetrics(grpc::ServerContext* context,
+                              const LiveMetricsRequest* request,
+                              grpc::ServerWriter<LiveMetrics>* writer) override;
+
   grpc::Status CancelTraffic(grpc::ServerContext* context,
                              const CancelTrafficRequest* request,
                              CancelTrafficResult* response) override;
@@ -70,6 +84,17 @@ class NodeManager final : public DistBenchNodeManager::Service {
  private:
   void ClearServices() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
+  // Whether the engines of the previous test can run the services of the
+  // request, with its traffic config.
+  bool CanReuseServices(const NodeServiceConfig& request)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
+  // Returns the logs of all the services, keyed by service instance name,
+  // and clears the services if the request asks for it.
+  std::map<std::string, ServicePerformanceLog> CollectTrafficResult(
+      const GetTrafficResultRequest& request)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
+
   struct ServiceOpts {
     std::string_view service_name;
     std::string_view service_type;
@@ -95,6 +120,11 @@ class NodeManager final : public DistBenchNodeManager::Service {
 
   std::map<std::string, std::unique_ptr<DistBenchEngine>> service_engines_
       ABSL_GUARDED_BY(mutex_);
+  // The endpoints of service_engines_, as returned by ConfigureNode:
+  ServiceEndpointMap service_endpoints_ ABSL_GUARDED_BY(mutex_);
+  // Set when ConfigureNode kept the engines of the previous test, which are
+  // still connected to the peers_ of that test:
+  bool reused_services_ ABSL_GUARDED_BY(mutex_) = false;
 
   std::unique_ptr<grpc::Server> grpc_server_;
   std::string service_address_;
@@ -103,7 +133,13 @@ class NodeManager final : public DistBenchNodeManager::Service {
   absl::Mutex config_mutex_;
   NodeConfig config_ ABSL_GUARDED_BY(config_mutex_);
 
+  // Places the threads of the engines and protocol drivers of this node:
+  ThreadPlacer thread_placer_;
   struct rusage rusage_start_test_;
+  // Counted during the last RunTraffic, if its traffic config asked for it:
+  std::optional<PerfCountersLog> perf_counters_log_;
+  // The waits of the threads of each role before the last RunTraffic:
+  WaitTimesLog wait_times_start_test_;
 };
 
 }  // namespace distbench
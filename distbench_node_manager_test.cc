@@ -31,6 +31,18 @@ TEST(DistBenchNodeManager, FailNoTestSequencer) {
   ASSERT_FALSE(result.ok());
 }
 
+TEST(DistBenchNodeManager, InvalidNodeAttributes) {
+  NodeManager nm;
+  NodeManagerOpts node_manager_opts;
+  int port = 0;
+  node_manager_opts.port = &port;
+  node_manager_opts.test_sequencer_service_address = "localhost:1";
+  node_manager_opts.node_attributes = "rack=r1,zone";
+  absl::Status result = nm.Initialize(node_manager_opts);
+  ASSERT_FALSE(result.ok());
+  EXPECT_EQ(result.message(), "Invalid node attribute: 'zone'");
+}
+
 TEST(DistBenchNodeManager, InvalidProtocolName) {
   NodeManager nm;
   grpc::ServerContext context;
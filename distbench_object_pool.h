@@ -0,0 +1,105 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_DISTBENCH_OBJECT_POOL_H_
+#define DISTBENCH_DISTBENCH_OBJECT_POOL_H_
+
+#include <algorithm>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+
+namespace distbench {
+
+// A process-wide free list of T objects, so that the per-RPC state of the
+// protocol drivers is recycled instead of being allocated for each RPC.
+// The objects are not destroyed when they are released: the caller resets
+// whatever it needs to, which lets protobufs and strings keep their
+// capacity. Each thread keeps a small cache of free objects, and exchanges
+// batches of them with a shared list only when its cache runs empty or
+// overflows, which happens when the objects are allocated on one thread and
+// released on another.
+//
+// Typical usage:
+//   Foo* foo = ObjectPool<Foo>::Get();
+//   ...
+//   foo->Reset();
+//   ObjectPool<Foo>::Release(foo);
+template <typename T>
+class ObjectPool {
+ public:
+  static constexpr size_t kBatchSize = 32;
+
+  // Returns a recycled object if there is one, or a new one.
+  static T* Get() {
+    ThreadCache& cache = GetThreadCache();
+    if (cache.objects.empty()) {
+      GetSharedList().TakeBatch(&cache.objects);
+      if (cache.objects.empty()) return new T;
+    }
+    T* object = cache.objects.back();
+    cache.objects.pop_back();
+    return object;
+  }
+
+  static void Release(T* object) {
+    ThreadCache& cache = GetThreadCache();
+    cache.objects.push_back(object);
+    if (cache.objects.size() >= 2 * kBatchSize) {
+      GetSharedList().GiveBatch(&cache.objects, kBatchSize);
+    }
+  }
+
+ private:
+  class SharedList {
+   public:
+    void TakeBatch(std::vector<T*>* objects) {
+      absl::MutexLock m(&mutex_);
+      size_t n = std::min(kBatchSize, objects_.size());
+      objects->insert(objects->end(), objects_.end() - n, objects_.end());
+      objects_.resize(objects_.size() - n);
+    }
+
+    void GiveBatch(std::vector<T*>* objects, size_t n) {
+      absl::MutexLock m(&mutex_);
+      objects_.insert(objects_.end(), objects->end() - n, objects->end());
+      objects->resize(objects->size() - n);
+    }
+
+   private:
+    absl::Mutex mutex_;
+    std::vector<T*> objects_ ABSL_GUARDED_BY(mutex_);
+  };
+
+  struct ThreadCache {
+    ~ThreadCache() { GetSharedList().GiveBatch(&objects, objects.size()); }
+    std::vector<T*> objects;
+  };
+
+  // Never destroyed, as the thread caches may outlive the static
+  // destructors.
+  static SharedList& GetSharedList() {
+    static SharedList* shared_list = new SharedList;
+    return *shared_list;
+  }
+
+  static ThreadCache& GetThreadCache() {
+    thread_local ThreadCache cache;
+    return cache;
+  }
+};
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_DISTBENCH_OBJECT_POOL_H_
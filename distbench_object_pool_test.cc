@@ -0,0 +1,79 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_object_pool.h"
+
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace distbench {
+
+namespace {
+
+struct SameThreadObject {
+  std::string buffer;
+};
+
+struct CrossThreadObject {
+  int value = 0;
+};
+
+}  // anonymous namespace
+
+TEST(ObjectPool, RecyclesOnTheSameThread) {
+  SameThreadObject* first = ObjectPool<SameThreadObject>::Get();
+  first->buffer.assign(1000, 'x');
+  first->buffer.clear();
+  ObjectPool<SameThreadObject>::Release(first);
+  SameThreadObject* second = ObjectPool<SameThreadObject>::Get();
+  EXPECT_EQ(first, second);
+  // Released objects are not reset, so they keep their capacity:
+  EXPECT_GE(second->buffer.capacity(), 1000);
+  ObjectPool<SameThreadObject>::Release(second);
+}
+
+TEST(ObjectPool, RecyclesAcrossThreads) {
+  // Objects allocated on one thread and released on another make their way
+  // back to the allocating thread through the shared list:
+  const int kObjects = 10 * ObjectPool<CrossThreadObject>::kBatchSize;
+  std::vector<CrossThreadObject*> objects;
+  for (int i = 0; i < kObjects; ++i) {
+    objects.push_back(ObjectPool<CrossThreadObject>::Get());
+  }
+  std::set<CrossThreadObject*> allocated(objects.begin(), objects.end());
+  EXPECT_EQ(allocated.size(), kObjects);
+  std::thread releaser([&objects]() {
+    for (CrossThreadObject* object : objects) {
+      ObjectPool<CrossThreadObject>::Release(object);
+    }
+  });
+  releaser.join();
+
+  int recycled = 0;
+  objects.clear();
+  for (int i = 0; i < kObjects; ++i) {
+    objects.push_back(ObjectPool<CrossThreadObject>::Get());
+    recycled += allocated.count(objects.back());
+  }
+  EXPECT_EQ(recycled, kObjects);
+  for (CrossThreadObject* object : objects) {
+    ObjectPool<CrossThreadObject>::Release(object);
+  }
+}
+
+}  // namespace distbench
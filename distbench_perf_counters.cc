@@ -0,0 +1,253 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_perf_counters.h"
+
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <map>
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "glog/logging.h"
+
+namespace distbench {
+
+namespace {
+
+struct CounterSpec {
+  uint32_t type;
+  uint64_t config;
+  // The context switches happen in the kernel; the other events are only
+  // counted in user space, which perf_event_paranoid 2 allows:
+  bool count_kernel;
+  void (PerfCounters::*set)(int64_t value);
+};
+
+const CounterSpec kCounters[] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, false,
+     &PerfCounters::set_cycles},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, false,
+     &PerfCounters::set_instructions},
+    // The read misses of the last level cache, i.e. "LLC-load-misses":
+    {PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+     false, &PerfCounters::set_llc_misses},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, false,
+     &PerfCounters::set_branch_misses},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, true,
+     &PerfCounters::set_context_switches},
+};
+
+constexpr size_t kNumCounters = sizeof(kCounters) / sizeof(kCounters[0]);
+
+// Counts the events of the thread, and of the threads it starts afterwards.
+int OpenCounter(const CounterSpec& spec, pid_t tid) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = spec.type;
+  attr.config = spec.config;
+  attr.exclude_kernel = !spec.count_kernel;
+  attr.exclude_hv = 1;
+  attr.inherit = 1;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attr, tid, /*cpu=*/-1,
+                 /*group_fd=*/-1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// Returns -1 if the counter could not be read.
+int64_t ReadCounter(int fd) {
+  uint64_t values[3];  // value, time_enabled, time_running
+  if (read(fd, values, sizeof(values)) != sizeof(values)) return -1;
+  if (values[2] == 0) return 0;
+  if (values[2] < values[1]) {
+    return static_cast<int64_t>(static_cast<double>(values[0]) * values[1] /
+                                values[2]);
+  }
+  return values[0];
+}
+
+// Whether perf_event_open failed as the counter is not available at all,
+// e.g. the machine has no such event or perf_event_paranoid forbids it,
+// rather than for this thread only:
+bool CounterUnavailable(int error) {
+  switch (error) {
+    case ENOENT:
+    case ENODEV:
+    case ENOSYS:
+    case EOPNOTSUPP:
+    case EINVAL:
+    case EACCES:
+    case EPERM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+std::vector<pid_t> ListThreads() {
+  std::vector<pid_t> tids;
+  DIR* dir = opendir("/proc/self/task");
+  if (!dir) return tids;
+  while (struct dirent* entry = readdir(dir)) {
+    pid_t tid;
+    if (absl::SimpleAtoi(entry->d_name, &tid)) tids.push_back(tid);
+  }
+  closedir(dir);
+  return tids;
+}
+
+std::string ThreadName(pid_t tid) {
+  std::ifstream in(absl::StrCat("/proc/self/task/", tid, "/comm"));
+  std::string name;
+  if (!std::getline(in, name) || name.empty()) return "unknown";
+  return name;
+}
+
+struct CounterSums {
+  void Add(size_t counter, int64_t value) {
+    values[counter] += value;
+    counted[counter] = true;
+  }
+
+  void ToProto(PerfCounters* counters) const {
+    for (size_t i = 0; i < kNumCounters; ++i) {
+      if (counted[i]) (counters->*kCounters[i].set)(values[i]);
+    }
+  }
+
+  int64_t values[kNumCounters] = {};
+  bool counted[kNumCounters] = {};
+};
+
+}  // anonymous namespace
+
+absl::Status ValidatePerfCountersMode(std::string_view mode) {
+  if (mode.empty() || mode == "process" || mode == "thread_role") {
+    return absl::OkStatus();
+  }
+  return absl::InvalidArgumentError(absl::StrCat(
+      "Unknown perf_counters: ", mode, " (must be process or thread_role)"));
+}
+
+absl::StatusOr<std::unique_ptr<PerfCounterSet>> PerfCounterSet::Start(
+    std::string_view mode, std::optional<std::vector<pid_t>> threads) {
+  absl::Status status = ValidatePerfCountersMode(mode);
+  if (!status.ok()) return status;
+  std::unique_ptr<PerfCounterSet> counters(new PerfCounterSet);
+  counters->by_thread_role_ = mode == "thread_role";
+  // A counter that is not available is not tried on the next threads. Any
+  // other failure, e.g. running out of file descriptors, fails the whole
+  // set: the sums of the threads counted so far would pass for the process.
+  bool available[kNumCounters];
+  std::fill(available, available + kNumCounters, true);
+  int open_errno = 0;
+  bool opened_any = false;
+  if (!threads) threads = ListThreads();
+  if (threads->empty()) {
+    return absl::FailedPreconditionError("No thread to count");
+  }
+  for (pid_t tid : *threads) {
+    ThreadCounters thread;
+    thread.role = counters->by_thread_role_ ? ThreadName(tid) : "";
+    thread.fds.assign(kNumCounters, -1);
+    bool exited = false;
+    for (size_t i = 0; i < kNumCounters && !exited; ++i) {
+      if (!available[i]) continue;
+      const int fd = OpenCounter(kCounters[i], tid);
+      if (fd >= 0) {
+        thread.fds[i] = fd;
+      } else if (errno == ESRCH) {
+        exited = true;
+      } else if (CounterUnavailable(errno)) {
+        available[i] = false;
+        open_errno = errno;
+      } else {
+        const int error = errno;
+        for (int fd : thread.fds) {
+          if (fd >= 0) close(fd);
+        }
+        const size_t counted_threads = counters->threads_.size();
+        // The destructor closes the counters of the other threads:
+        counters.reset();
+        std::string message =
+            absl::StrCat("perf_event_open failed after ", counted_threads,
+                         " threads: ", std::strerror(error));
+        if (error == EMFILE || error == ENFILE) {
+          return absl::ResourceExhaustedError(absl::StrCat(
+              message, " (each thread takes one file descriptor per counter; "
+                       "raise RLIMIT_NOFILE)"));
+        }
+        return absl::InternalError(message);
+      }
+    }
+    if (exited) {
+      for (int fd : thread.fds) {
+        if (fd >= 0) close(fd);
+      }
+      continue;
+    }
+    for (int fd : thread.fds) opened_any |= fd >= 0;
+    counters->threads_.push_back(std::move(thread));
+  }
+  if (!opened_any) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("perf_event_open failed: ", std::strerror(open_errno)));
+  }
+  return counters;
+}
+
+PerfCounterSet::~PerfCounterSet() {
+  for (const auto& thread : threads_) {
+    for (int fd : thread.fds) {
+      if (fd >= 0) close(fd);
+    }
+  }
+}
+
+PerfCountersLog PerfCounterSet::Read() const {
+  CounterSums process;
+  std::map<std::string, CounterSums> roles;
+  for (const auto& thread : threads_) {
+    for (size_t i = 0; i < kNumCounters; ++i) {
+      if (thread.fds[i] < 0) continue;
+      const int64_t value = ReadCounter(thread.fds[i]);
+      if (value < 0) {
+        LOG(WARNING) << "Could not read a perf counter: "
+                     << std::strerror(errno);
+        continue;
+      }
+      process.Add(i, value);
+      if (by_thread_role_) roles[thread.role].Add(i, value);
+    }
+  }
+  PerfCountersLog log;
+  process.ToProto(log.mutable_process());
+  for (const auto& [role, sums] : roles) {
+    sums.ToProto(&(*log.mutable_thread_roles())[role]);
+  }
+  return log;
+}
+
+}  // namespace distbench
@@ -0,0 +1,70 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_DISTBENCH_PERF_COUNTERS_H_
+#define DISTBENCH_DISTBENCH_PERF_COUNTERS_H_
+
+#include <sys/types.h>
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "distbench.pb.h"
+
+namespace distbench {
+
+// Checks a DistributedSystemDescription.perf_counters.
+absl::Status ValidatePerfCountersMode(std::string_view mode);
+
+// Counts the events of PerfCounters for each thread of the process, or of the
+// given threads, with perf_event_open, from Start until the counters are
+// destroyed. The threads started afterwards are counted by the thread that
+// started them, once they exit; so are their roles.
+class PerfCounterSet {
+ public:
+  // mode is a non-empty DistributedSystemDescription.perf_counters. Fails if
+  // none of the counters can be opened, or if one cannot be opened for a
+  // thread for another reason than the event being unavailable, e.g. as
+  // the process runs out of file descriptors.
+  static absl::StatusOr<std::unique_ptr<PerfCounterSet>> Start(
+      std::string_view mode,
+      std::optional<std::vector<pid_t>> threads = std::nullopt);
+  ~PerfCounterSet();
+
+  // The counts so far, scaled up if the kernel had to multiplex them:
+  PerfCountersLog Read() const;
+
+ private:
+  struct ThreadCounters {
+    // The name of the thread, see RunRegisteredThread:
+    std::string role;
+    // Indexed like the counters in distbench_perf_counters.cc, -1 for those
+    // that are not available:
+    std::vector<int> fds;
+  };
+
+  PerfCounterSet() = default;
+
+  bool by_thread_role_ = false;
+  std::vector<ThreadCounters> threads_;
+};
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_DISTBENCH_PERF_COUNTERS_H_
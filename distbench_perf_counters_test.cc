@@ -0,0 +1,95 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_perf_counters.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "distbench_utils.h"
+#include "gtest/gtest.h"
+#include "gtest_utils.h"
+
+namespace distbench {
+
+TEST(PerfCounters, ValidateMode) {
+  ASSERT_OK(ValidatePerfCountersMode(""));
+  ASSERT_OK(ValidatePerfCountersMode("process"));
+  ASSERT_OK(ValidatePerfCountersMode("thread_role"));
+  EXPECT_FALSE(ValidatePerfCountersMode("per_cpu").ok());
+  EXPECT_FALSE(PerfCounterSet::Start("per_cpu").ok());
+}
+
+TEST(PerfCounters, CountsContextSwitchesByThreadRole) {
+  absl::Notification started;
+  absl::Notification counting;
+  absl::Notification read;
+  std::thread sleeper = RunRegisteredThread("PerfTestSleeper", [&]() {
+    started.Notify();
+    counting.WaitForNotification();
+    for (int i = 0; i < 20; ++i) absl::SleepFor(absl::Milliseconds(1));
+    read.WaitForNotification();
+  });
+  started.WaitForNotification();
+  auto maybe_counters = PerfCounterSet::Start("thread_role");
+  if (!maybe_counters.ok()) {
+    counting.Notify();
+    read.Notify();
+    sleeper.join();
+    GTEST_SKIP() << maybe_counters.status();
+  }
+  counting.Notify();
+  // Each sleep switches away from the thread at least once:
+  PerfCountersLog log;
+  for (int i = 0; i < 1000; ++i) {
+    log = (*maybe_counters)->Read();
+    auto it = log.thread_roles().find("PerfTestSleeper");
+    ASSERT_NE(it, log.thread_roles().end());
+    if (it->second.context_switches() >= 20) break;
+    absl::SleepFor(absl::Milliseconds(1));
+  }
+  read.Notify();
+  sleeper.join();
+  const PerfCounters& sleeper_counters =
+      log.thread_roles().at("PerfTestSleeper");
+  EXPECT_GE(sleeper_counters.context_switches(), 20);
+  EXPECT_GE(log.process().context_switches(),
+            sleeper_counters.context_switches());
+}
+
+TEST(PerfCounters, CountsOnlyTheGivenThreads) {
+  absl::Notification started;
+  absl::Notification read;
+  pid_t sleeper_tid = 0;
+  std::thread sleeper = RunRegisteredThread("PerfTestSleeper", [&]() {
+    sleeper_tid = syscall(SYS_gettid);
+    started.Notify();
+    read.WaitForNotification();
+  });
+  started.WaitForNotification();
+  auto maybe_counters =
+      PerfCounterSet::Start("thread_role", std::vector<pid_t>{sleeper_tid});
+  read.Notify();
+  sleeper.join();
+  if (!maybe_counters.ok()) GTEST_SKIP() << maybe_counters.status();
+  PerfCountersLog log = (*maybe_counters)->Read();
+  ASSERT_EQ(log.thread_roles().size(), 1);
+  EXPECT_EQ(log.thread_roles().begin()->first, "PerfTestSleeper");
+
+  EXPECT_FALSE(PerfCounterSet::Start("process", std::vector<pid_t>{}).ok());
+}
+
+}  // namespace distbench
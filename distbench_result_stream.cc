@@ -0,0 +1,301 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_result_stream.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include "absl/strings/str_cat.h"
+#include "distbench_sample_columns.h"
+#include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "google/protobuf/wire_format_lite.h"
+
+#ifdef WITH_ZSTD
+#include "zstd.h"
+#endif
+
+namespace distbench {
+
+namespace {
+
+using google::protobuf::internal::WireFormatLite;
+
+// The tag of TestSequenceResults.test_results:
+constexpr uint32_t kTestResultsTag = WireFormatLite::MakeTag(
+    TestSequenceResults::kTestResultsFieldNumber,
+    WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+
+// The first bytes of a zstd frame, little endian:
+constexpr char kZstdMagic[] = {'\x28', '\xb5', '\x2f', '\xfd'};
+
+}  // anonymous namespace
+
+#ifdef WITH_ZSTD
+struct TestResultStreamWriter::ZstdState {
+  ~ZstdState() { ZSTD_freeCCtx(context); }
+
+  ZSTD_CCtx* context = ZSTD_createCCtx();
+  std::string buffer = std::string(ZSTD_CStreamOutSize(), '\0');
+};
+#else
+struct TestResultStreamWriter::ZstdState {};
+#endif
+
+absl::StatusOr<std::unique_ptr<TestResultStreamWriter>>
+TestResultStreamWriter::Open(const std::string& filename,
+                             std::string_view compression) {
+  if (compression != "none" && compression != "zstd") {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Unknown result stream compression: ", compression,
+        " (must be none or zstd)"));
+  }
+#ifndef WITH_ZSTD
+  if (compression == "zstd") {
+    return absl::UnimplementedError(
+        "Distbench was built without zstd support (--//:with-zstd)");
+  }
+#endif
+  std::unique_ptr<TestResultStreamWriter> writer(new TestResultStreamWriter);
+  writer->fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (writer->fd_ < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Error opening the result stream file for writing: ",
+                     filename, "; ", std::strerror(errno)));
+  }
+  if (compression == "zstd") writer->zstd_ = std::make_unique<ZstdState>();
+  return writer;
+}
+
+TestResultStreamWriter::~TestResultStreamWriter() {
+  if (fd_ >= 0) {
+    absl::Status status = Close();
+    if (!status.ok()) LOG(ERROR) << "Closing the result stream: " << status;
+  }
+}
+
+absl::Status TestResultStreamWriter::Write(const TestResult& result) {
+  if (fd_ < 0) return absl::FailedPreconditionError("Result stream closed");
+  std::string record;
+  {
+    google::protobuf::io::StringOutputStream string_stream(&record);
+    google::protobuf::io::CodedOutputStream output(&string_stream);
+    output.WriteTag(kTestResultsTag);
+    output.WriteVarint32(result.ByteSizeLong());
+    result.SerializeWithCachedSizes(&output);
+    if (output.HadError()) {
+      return absl::InternalError("Error serializing the test result");
+    }
+  }
+  if (!zstd_) return WriteToFile(record.data(), record.size());
+#ifdef WITH_ZSTD
+  ZSTD_inBuffer input = {record.data(), record.size(), 0};
+  bool flushed = false;
+  while (!flushed) {
+    ZSTD_outBuffer output = {zstd_->buffer.data(), zstd_->buffer.size(), 0};
+    size_t remaining =
+        ZSTD_compressStream2(zstd_->context, &output, &input, ZSTD_e_flush);
+    if (ZSTD_isError(remaining)) {
+      return absl::InternalError(absl::StrCat(
+          "Error compressing the test result: ", ZSTD_getErrorName(remaining)));
+    }
+    absl::Status status = WriteToFile(zstd_->buffer.data(), output.pos);
+    if (!status.ok()) return status;
+    flushed = remaining == 0;
+  }
+#endif
+  return absl::OkStatus();
+}
+
+absl::Status TestResultStreamWriter::Close() {
+  if (fd_ < 0) return absl::OkStatus();
+  absl::Status status;
+#ifdef WITH_ZSTD
+  if (zstd_) {
+    ZSTD_inBuffer input = {nullptr, 0, 0};
+    size_t remaining = 1;
+    while (remaining && status.ok()) {
+      ZSTD_outBuffer output = {zstd_->buffer.data(), zstd_->buffer.size(), 0};
+      remaining =
+          ZSTD_compressStream2(zstd_->context, &output, &input, ZSTD_e_end);
+      if (ZSTD_isError(remaining)) {
+        status = absl::InternalError(
+            absl::StrCat("Error ending the zstd frame: ",
+                         ZSTD_getErrorName(remaining)));
+        break;
+      }
+      status = WriteToFile(zstd_->buffer.data(), output.pos);
+    }
+  }
+#endif
+  if (close(fd_) < 0 && status.ok()) {
+    status = absl::InternalError(absl::StrCat(
+        "Error closing the result stream file: ", std::strerror(errno)));
+  }
+  fd_ = -1;
+  return status;
+}
+
+absl::Status TestResultStreamWriter::WriteToFile(const char* data,
+                                                 size_t size) {
+  while (size) {
+    ssize_t written = write(fd_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return absl::InternalError(absl::StrCat(
+          "Error writing the result stream file: ", std::strerror(errno)));
+    }
+    data += written;
+    size -= written;
+  }
+  return absl::OkStatus();
+}
+
+#ifdef WITH_ZSTD
+class TestResultStreamReader::ZstdInputStream
+    : public google::protobuf::io::CopyingInputStream {
+ public:
+  explicit ZstdInputStream(google::protobuf::io::ZeroCopyInputStream* source)
+      : source_(source) {}
+  ~ZstdInputStream() override { ZSTD_freeDCtx(context_); }
+
+  // Returns 0 at the end of the compressed data, even in the middle of a
+  // frame, as the records before are complete.
+  int Read(void* buffer, int size) override {
+    ZSTD_outBuffer output = {buffer, static_cast<size_t>(size), 0};
+    while (output.pos == 0) {
+      if (input_.pos == input_.size) {
+        const void* data;
+        int data_size;
+        if (!source_->Next(&data, &data_size)) return 0;
+        input_ = {data, static_cast<size_t>(data_size), 0};
+      }
+      size_t ret = ZSTD_decompressStream(context_, &output, &input_);
+      if (ZSTD_isError(ret)) {
+        LOG(ERROR) << "Error decompressing the result stream: "
+                   << ZSTD_getErrorName(ret);
+        return -1;
+      }
+    }
+    return output.pos;
+  }
+
+ private:
+  google::protobuf::io::ZeroCopyInputStream* source_;
+  ZSTD_DCtx* context_ = ZSTD_createDCtx();
+  ZSTD_inBuffer input_ = {nullptr, 0, 0};
+};
+#else
+class TestResultStreamReader::ZstdInputStream {};
+#endif
+
+absl::StatusOr<std::unique_ptr<TestResultStreamReader>>
+TestResultStreamReader::Open(const std::string& filename) {
+  std::unique_ptr<TestResultStreamReader> reader(new TestResultStreamReader);
+  reader->fd_ = open(filename.c_str(), O_RDONLY);
+  if (reader->fd_ < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Error opening the result stream file: ", filename, "; ",
+                     std::strerror(errno)));
+  }
+  reader->file_stream_ =
+      std::make_unique<google::protobuf::io::FileInputStream>(reader->fd_);
+  reader->stream_ = reader->file_stream_.get();
+
+  // Peek at the start of the file to tell whether it is compressed:
+  const void* data;
+  int size;
+  if (!reader->file_stream_->Next(&data, &size)) return reader;
+  const bool compressed =
+      size >= static_cast<int>(sizeof(kZstdMagic)) &&
+      !memcmp(data, kZstdMagic, sizeof(kZstdMagic));
+  reader->file_stream_->BackUp(size);
+  if (!compressed) return reader;
+#ifdef WITH_ZSTD
+  reader->zstd_stream_ =
+      std::make_unique<ZstdInputStream>(reader->file_stream_.get());
+  reader->zstd_adaptor_ =
+      std::make_unique<google::protobuf::io::CopyingInputStreamAdaptor>(
+          reader->zstd_stream_.get());
+  reader->stream_ = reader->zstd_adaptor_.get();
+  return reader;
+#else
+  return absl::UnimplementedError(absl::StrCat(
+      filename, " is zstd compressed, but Distbench was built without zstd "
+                "support (--//:with-zstd)"));
+#endif
+}
+
+TestResultStreamReader::~TestResultStreamReader() {
+  // The streams must not outlive the file:
+  zstd_adaptor_.reset();
+  zstd_stream_.reset();
+  file_stream_.reset();
+  if (fd_ >= 0) close(fd_);
+}
+
+bool TestResultStreamReader::Fail(absl::Status status) {
+  status_ = absl::Status(
+      status.code(), absl::StrCat(status.message(), " after ", records_read_,
+                                  " test results"));
+  return false;
+}
+
+bool TestResultStreamReader::Next(TestResult* result) {
+  if (!status_.ok()) return false;
+  // A CodedInputStream per record, so that large streams do not run into
+  // its total bytes limit; it gives back what it read ahead when destroyed.
+  google::protobuf::io::CodedInputStream input(stream_);
+  while (true) {
+    const uint32_t tag = input.ReadTag();
+    if (tag == 0) return false;  // The end of the stream.
+    if (tag == kTestResultsTag) break;
+    // Skip the other fields of TestSequenceResults, if any:
+    if (!WireFormatLite::SkipField(&input, tag)) {
+      return Fail(absl::InvalidArgumentError(
+          "Not a binary TestSequenceResults stream"));
+    }
+  }
+  uint32_t length;
+  if (!input.ReadVarint32(&length)) {
+    return Fail(absl::DataLossError("Truncated test result length"));
+  }
+  result->Clear();
+  auto limit = input.PushLimit(length);
+  if (!result->ParseFromCodedStream(&input) || input.BytesUntilLimit() != 0) {
+    return Fail(absl::DataLossError("Truncated or malformed test result"));
+  }
+  input.PopLimit(limit);
+  ++records_read_;
+  return true;
+}
+
+void ConvertTestResultToColumns(TestResult* result) {
+  auto& instance_logs =
+      *result->mutable_service_logs()->mutable_instance_logs();
+  for (auto& [instance_name, instance_log] : instance_logs) {
+    for (auto& [peer_name, peer_log] : *instance_log.mutable_peer_logs()) {
+      for (auto& [rpc_index, rpc_log] : *peer_log.mutable_rpc_logs()) {
+        MoveRpcSamplesToColumns(&rpc_log);
+      }
+    }
+  }
+}
+
+}  // namespace distbench
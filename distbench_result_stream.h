@@ -0,0 +1,93 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_DISTBENCH_RESULT_STREAM_H_
+#define DISTBENCH_DISTBENCH_RESULT_STREAM_H_
+
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "absl/status/statusor.h"
+#include "distbench.pb.h"
+#include "google/protobuf/io/zero_copy_stream_impl.h"
+
+namespace distbench {
+
+// The records of a result stream are the test_results fields of a binary
+// TestSequenceResults, so an uncompressed stream is also a regular binary
+// TestSequenceResults file. With zstd compression, each record is flushed
+// into its own block, so that a stream cut short (e.g. because the
+// connection to the test sequencer dropped) still holds all the records
+// written before.
+class TestResultStreamWriter {
+ public:
+  // compression is "none" or "zstd".
+  static absl::StatusOr<std::unique_ptr<TestResultStreamWriter>> Open(
+      const std::string& filename, std::string_view compression);
+  ~TestResultStreamWriter();
+
+  // Appends the result, and writes it out to the file before returning.
+  absl::Status Write(const TestResult& result);
+  absl::Status Close();
+
+ private:
+  TestResultStreamWriter() = default;
+  absl::Status WriteToFile(const char* data, size_t size);
+
+  int fd_ = -1;
+  struct ZstdState;
+  std::unique_ptr<ZstdState> zstd_;
+};
+
+// Reads the TestResults of a result stream, compressed or not, one at a
+// time. Typical usage:
+//   auto reader = TestResultStreamReader::Open(filename);
+//   TestResult result;
+//   while ((*reader)->Next(&result)) { ... }
+//   if (!(*reader)->status().ok()) { ... }
+class TestResultStreamReader {
+ public:
+  static absl::StatusOr<std::unique_ptr<TestResultStreamReader>> Open(
+      const std::string& filename);
+  ~TestResultStreamReader();
+
+  // Returns false once all the results were read, or if the stream is
+  // malformed or truncated, in which case status() tells what went wrong.
+  bool Next(TestResult* result);
+  const absl::Status& status() const { return status_; }
+
+ private:
+  TestResultStreamReader() = default;
+  bool Fail(absl::Status status);
+
+  int fd_ = -1;
+  std::unique_ptr<google::protobuf::io::FileInputStream> file_stream_;
+  // Either file_stream_ or the decompressed stream:
+  google::protobuf::io::ZeroCopyInputStream* stream_ = nullptr;
+  class ZstdInputStream;
+  std::unique_ptr<ZstdInputStream> zstd_stream_;
+  std::unique_ptr<google::protobuf::io::CopyingInputStreamAdaptor>
+      zstd_adaptor_;
+  int64_t records_read_ = 0;
+  absl::Status status_;
+};
+
+// Moves the RpcSamples of all the logs of the result into RpcSampleColumns
+// blocks; see MoveRpcSamplesToColumns.
+void ConvertTestResultToColumns(TestResult* result);
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_DISTBENCH_RESULT_STREAM_H_
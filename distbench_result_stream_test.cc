@@ -0,0 +1,187 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_result_stream.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+
+#include "absl/strings/str_cat.h"
+#include "distbench_utils.h"
+#include "gtest/gtest.h"
+#include "gtest_utils.h"
+
+namespace distbench {
+
+namespace {
+
+std::string TempFilename(std::string_view name) {
+  const char* dir = getenv("TEST_TMPDIR");
+  return absl::StrCat(dir ? dir : "/tmp", "/", name, "_", getpid());
+}
+
+TestResult MakeTestResult(int i) {
+  TestResult result;
+  result.mutable_traffic_config()->set_name(absl::StrCat("test", i));
+  auto& peer_log =
+      (*(*result.mutable_service_logs()->mutable_instance_logs())["s1/0"]
+            .mutable_peer_logs())["s2/0"];
+  auto& rpc_log = (*peer_log.mutable_rpc_logs())[0];
+  for (int j = 0; j < 100; ++j) {
+    auto* sample = rpc_log.add_successful_rpc_samples();
+    sample->set_start_timestamp_ns(1'000'000 * j);
+    sample->set_latency_ns(20'000 + j);
+    sample->set_request_size(1024);
+  }
+  result.add_log_summary(absl::StrCat("summary of test", i));
+  return result;
+}
+
+std::vector<TestResult> ReadAll(const std::string& filename,
+                                absl::Status* status) {
+  std::vector<TestResult> results;
+  auto reader = TestResultStreamReader::Open(filename);
+  if (!reader.ok()) {
+    *status = reader.status();
+    return results;
+  }
+  TestResult result;
+  while ((*reader)->Next(&result)) results.push_back(result);
+  *status = (*reader)->status();
+  return results;
+}
+
+void WriteAll(const std::string& filename, std::string_view compression,
+              int count) {
+  auto writer = TestResultStreamWriter::Open(filename, compression);
+  ASSERT_OK(writer.status());
+  for (int i = 0; i < count; ++i) {
+    ASSERT_OK((*writer)->Write(MakeTestResult(i)));
+  }
+  ASSERT_OK((*writer)->Close());
+}
+
+}  // anonymous namespace
+
+TEST(ResultStream, RoundTrip) {
+  const std::string filename = TempFilename("result_stream_round_trip");
+  WriteAll(filename, "none", 3);
+  absl::Status status;
+  auto results = ReadAll(filename, &status);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.size(), 3);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(results[i].traffic_config().name(), absl::StrCat("test", i));
+    EXPECT_EQ(results[i].log_summary(0), absl::StrCat("summary of test", i));
+  }
+
+  // The stream is also a binary TestSequenceResults:
+  auto sequence_results = ParseTestSequenceResultsFromFile(filename);
+  ASSERT_OK(sequence_results.status());
+  EXPECT_EQ(sequence_results->test_results_size(), 3);
+  unlink(filename.c_str());
+}
+
+TEST(ResultStream, ReadsBinaryTestSequenceResults) {
+  const std::string filename = TempFilename("result_stream_binary");
+  TestSequenceResults sequence_results;
+  *sequence_results.add_test_results() = MakeTestResult(0);
+  *sequence_results.add_test_results() = MakeTestResult(1);
+  ASSERT_OK(SaveResultProtoToFileBinary(filename, sequence_results));
+  absl::Status status;
+  auto results = ReadAll(filename, &status);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.size(), 2);
+  EXPECT_EQ(results[1].traffic_config().name(), "test1");
+  unlink(filename.c_str());
+}
+
+TEST(ResultStream, TruncatedStream) {
+  const std::string filename = TempFilename("result_stream_truncated");
+  WriteAll(filename, "none", 3);
+  struct stat file_stat;
+  ASSERT_EQ(stat(filename.c_str(), &file_stat), 0);
+  ASSERT_EQ(truncate(filename.c_str(), file_stat.st_size - 10), 0);
+  absl::Status status;
+  auto results = ReadAll(filename, &status);
+  EXPECT_EQ(results.size(), 2);
+  EXPECT_FALSE(status.ok());
+  unlink(filename.c_str());
+}
+
+TEST(ResultStream, NotAStream) {
+  const std::string filename = TempFilename("result_stream_text");
+  TestSequenceResults sequence_results;
+  *sequence_results.add_test_results() = MakeTestResult(0);
+  ASSERT_OK(SaveResultProtoToFile(filename, sequence_results));
+  absl::Status status;
+  auto results = ReadAll(filename, &status);
+  EXPECT_TRUE(results.empty());
+  EXPECT_FALSE(status.ok());
+  unlink(filename.c_str());
+}
+
+TEST(ResultStream, UnknownCompression) {
+  EXPECT_FALSE(
+      TestResultStreamWriter::Open(TempFilename("result_stream_bad"), "lz4")
+          .ok());
+}
+
+#ifdef WITH_ZSTD
+TEST(ResultStream, ZstdRoundTrip) {
+  const std::string filename = TempFilename("result_stream_zstd");
+  WriteAll(filename, "zstd", 3);
+  absl::Status status;
+  auto results = ReadAll(filename, &status);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.size(), 3);
+  EXPECT_EQ(results[2].traffic_config().name(), "test2");
+  unlink(filename.c_str());
+}
+
+TEST(ResultStream, ZstdStreamCutShort) {
+  const std::string filename = TempFilename("result_stream_zstd_cut");
+  auto writer = TestResultStreamWriter::Open(filename, "zstd");
+  ASSERT_OK(writer.status());
+  ASSERT_OK((*writer)->Write(MakeTestResult(0)));
+  ASSERT_OK((*writer)->Write(MakeTestResult(1)));
+  // The frame is not ended yet, as if the writer had died:
+  absl::Status status;
+  auto results = ReadAll(filename, &status);
+  ASSERT_OK(status);
+  EXPECT_EQ(results.size(), 2);
+  unlink(filename.c_str());
+}
+#endif
+
+TEST(ResultStream, ConvertTestResultToColumns) {
+  TestResult result = MakeTestResult(0);
+  const size_t row_size = result.ByteSizeLong();
+  ConvertTestResultToColumns(&result);
+  const auto& rpc_log = result.service_logs()
+                            .instance_logs()
+                            .at("s1/0")
+                            .peer_logs()
+                            .at("s2/0")
+                            .rpc_logs()
+                            .at(0);
+  EXPECT_EQ(rpc_log.successful_rpc_samples_size(), 0);
+  ASSERT_EQ(rpc_log.sample_columns_size(), 1);
+  EXPECT_EQ(rpc_log.sample_columns(0).sample_count(), 100);
+  EXPECT_LT(result.ByteSizeLong(), row_size);
+}
+
+}  // namespace distbench
@@ -0,0 +1,194 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_sample_columns.h"
+
+#include "absl/strings/str_cat.h"
+
+namespace distbench {
+
+namespace {
+
+void AppendVarint(std::string* column, uint64_t value) {
+  while (value >= 0x80) {
+    column->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  column->push_back(static_cast<char>(value));
+}
+
+uint64_t ZigZagEncode(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ (value >> 63);
+}
+
+int64_t ZigZagDecode(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+void AppendDelta(std::string* column, int64_t value, int64_t previous) {
+  AppendVarint(column, ZigZagEncode(value - previous));
+}
+
+void AppendBit(std::string* column, int64_t index, bool value) {
+  if (index % 8 == 0) column->push_back(0);
+  if (value) column->back() |= 1 << (index % 8);
+}
+
+}  // anonymous namespace
+
+void RpcSampleColumnsWriter::Add(const ColumnarSample& sample) {
+  AppendDelta(&start_timestamp_deltas_, sample.start_timestamp_ns,
+              previous_.start_timestamp_ns);
+  AppendVarint(&latencies_, sample.latency_ns);
+  AppendDelta(&latency_weight_deltas_, sample.latency_weight,
+              previous_.latency_weight);
+  AppendDelta(&request_size_deltas_, sample.request_size,
+              previous_.request_size);
+  AppendDelta(&response_size_deltas_, sample.response_size,
+              previous_.response_size);
+  AppendBit(&success_bits_, sample_count_, sample.success);
+  AppendBit(&warmup_bits_, sample_count_, sample.warmup);
+  if (sample.server_processing_ns >= 0 && server_processing_ns_.empty()) {
+    server_processing_ns_.assign(sample_count_, 0);
+  }
+  if (!server_processing_ns_.empty() || sample.server_processing_ns >= 0) {
+    AppendVarint(&server_processing_ns_, sample.server_processing_ns + 1);
+  }
+  previous_ = sample;
+  ++sample_count_;
+}
+
+RpcSampleColumns RpcSampleColumnsWriter::Finish() {
+  RpcSampleColumns columns;
+  columns.set_sample_count(sample_count_);
+  columns.set_start_timestamp_deltas_ns(std::move(start_timestamp_deltas_));
+  columns.set_latencies_ns(std::move(latencies_));
+  columns.set_latency_weight_deltas_ns(std::move(latency_weight_deltas_));
+  columns.set_request_size_deltas(std::move(request_size_deltas_));
+  columns.set_response_size_deltas(std::move(response_size_deltas_));
+  columns.set_success_bits(std::move(success_bits_));
+  columns.set_warmup_bits(std::move(warmup_bits_));
+  if (!server_processing_ns_.empty()) {
+    columns.set_server_processing_ns(std::move(server_processing_ns_));
+  }
+  *this = RpcSampleColumnsWriter();
+  return columns;
+}
+
+RpcSampleColumnsReader::RpcSampleColumnsReader(
+    const RpcSampleColumns& columns)
+    : remaining_samples_(columns.sample_count()),
+      start_timestamp_deltas_(columns.start_timestamp_deltas_ns()),
+      latencies_(columns.latencies_ns()),
+      latency_weight_deltas_(columns.latency_weight_deltas_ns()),
+      request_size_deltas_(columns.request_size_deltas()),
+      response_size_deltas_(columns.response_size_deltas()),
+      success_bits_(columns.success_bits()),
+      warmup_bits_(columns.warmup_bits()),
+      server_processing_ns_(columns.server_processing_ns()),
+      has_server_processing_ns_(!server_processing_ns_.empty()) {}
+
+bool RpcSampleColumnsReader::ReadVarint(std::string_view* column,
+                                        int64_t* value) {
+  uint64_t result = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (column->empty()) break;
+    uint8_t byte = column->front();
+    column->remove_prefix(1);
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  status_ = absl::InvalidArgumentError(absl::StrCat(
+      "RpcSampleColumns: truncated column at sample ", sample_index_));
+  return false;
+}
+
+bool RpcSampleColumnsReader::ReadDelta(std::string_view* column,
+                                       int64_t* value) {
+  int64_t delta;
+  if (!ReadVarint(column, &delta)) return false;
+  *value += ZigZagDecode(delta);
+  return true;
+}
+
+bool RpcSampleColumnsReader::ReadBit(std::string_view column, bool* value) {
+  if (static_cast<size_t>(sample_index_ / 8) >= column.size()) {
+    status_ = absl::InvalidArgumentError(absl::StrCat(
+        "RpcSampleColumns: truncated bitset at sample ", sample_index_));
+    return false;
+  }
+  *value = (column[sample_index_ / 8] >> (sample_index_ % 8)) & 1;
+  return true;
+}
+
+bool RpcSampleColumnsReader::Next(ColumnarSample* sample) {
+  if (remaining_samples_ <= 0 || !status_.ok()) return false;
+  *sample = previous_;
+  if (!ReadDelta(&start_timestamp_deltas_, &sample->start_timestamp_ns) ||
+      !ReadVarint(&latencies_, &sample->latency_ns) ||
+      !ReadDelta(&latency_weight_deltas_, &sample->latency_weight) ||
+      !ReadDelta(&request_size_deltas_, &sample->request_size) ||
+      !ReadDelta(&response_size_deltas_, &sample->response_size) ||
+      !ReadBit(success_bits_, &sample->success) ||
+      !ReadBit(warmup_bits_, &sample->warmup)) {
+    return false;
+  }
+  if (has_server_processing_ns_) {
+    int64_t value;
+    if (!ReadVarint(&server_processing_ns_, &value)) return false;
+    sample->server_processing_ns = value - 1;
+  }
+  previous_ = *sample;
+  ++sample_index_;
+  --remaining_samples_;
+  return true;
+}
+
+void MoveRpcSamplesToColumns(RpcPerformanceLog* rpc_log) {
+  using RpcSamples = google::protobuf::RepeatedPtrField<RpcSample>;
+  RpcSampleColumnsWriter writer;
+  auto move_samples = [&writer](RpcSamples* samples, bool success) {
+    int kept = 0;
+    for (int i = 0; i < samples->size(); ++i) {
+      const RpcSample& rpc_sample = samples->Get(i);
+      if (rpc_sample.has_trace_context() || rpc_sample.has_stage_timings()) {
+        samples->SwapElements(i, kept++);
+        continue;
+      }
+      ColumnarSample sample;
+      sample.start_timestamp_ns = rpc_sample.start_timestamp_ns();
+      sample.latency_ns = rpc_sample.latency_ns();
+      // As the engine does, the default weight of 1 is stored as 0:
+      sample.latency_weight =
+          rpc_sample.has_latency_weight() ? rpc_sample.latency_weight() : 0;
+      sample.request_size = rpc_sample.request_size();
+      sample.response_size = rpc_sample.response_size();
+      sample.success = success;
+      sample.warmup = rpc_sample.warmup();
+      sample.server_processing_ns = rpc_sample.has_server_processing_ns()
+                                        ? rpc_sample.server_processing_ns()
+                                        : -1;
+      writer.Add(sample);
+    }
+    samples->DeleteSubrange(kept, samples->size() - kept);
+  };
+  move_samples(rpc_log->mutable_successful_rpc_samples(), true);
+  move_samples(rpc_log->mutable_failed_rpc_samples(), false);
+  if (writer.size()) *rpc_log->add_sample_columns() = writer.Finish();
+}
+
+}  // namespace distbench
@@ -0,0 +1,105 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_DISTBENCH_SAMPLE_COLUMNS_H_
+#define DISTBENCH_DISTBENCH_SAMPLE_COLUMNS_H_
+
+#include <string>
+#include <string_view>
+
+#include "absl/status/status.h"
+#include "distbench.pb.h"
+
+namespace distbench {
+
+// The content of one sample of an RpcSampleColumns block.
+struct ColumnarSample {
+  int64_t start_timestamp_ns = 0;
+  int64_t latency_ns = 0;
+  int64_t latency_weight = 0;
+  int64_t request_size = 0;
+  int64_t response_size = 0;
+  bool success = true;
+  bool warmup = false;
+  // -1 if the sample does not have it.
+  int64_t server_processing_ns = -1;
+};
+
+// Encodes samples, in the order they are added, into one RpcSampleColumns
+// block.
+class RpcSampleColumnsWriter {
+ public:
+  void Add(const ColumnarSample& sample);
+  int64_t size() const { return sample_count_; }
+
+  // Moves the encoded columns out; the writer is reset.
+  RpcSampleColumns Finish();
+
+ private:
+  int64_t sample_count_ = 0;
+  ColumnarSample previous_;
+  std::string start_timestamp_deltas_;
+  std::string latencies_;
+  std::string latency_weight_deltas_;
+  std::string request_size_deltas_;
+  std::string response_size_deltas_;
+  std::string success_bits_;
+  std::string warmup_bits_;
+  // Only started at the first sample that has a server_processing_ns:
+  std::string server_processing_ns_;
+};
+
+// Decodes the samples of an RpcSampleColumns block; the block must outlive
+// the reader. Typical usage:
+//   RpcSampleColumnsReader reader(columns);
+//   ColumnarSample sample;
+//   while (reader.Next(&sample)) { ... }
+//   if (!reader.status().ok()) { ... }
+class RpcSampleColumnsReader {
+ public:
+  explicit RpcSampleColumnsReader(const RpcSampleColumns& columns);
+
+  // Returns false once all the samples were read, or if the block is
+  // malformed, in which case status() tells what went wrong.
+  bool Next(ColumnarSample* sample);
+  const absl::Status& status() const { return status_; }
+
+ private:
+  bool ReadVarint(std::string_view* column, int64_t* value);
+  bool ReadDelta(std::string_view* column, int64_t* value);
+  bool ReadBit(std::string_view column, bool* value);
+
+  int64_t remaining_samples_;
+  int64_t sample_index_ = 0;
+  ColumnarSample previous_;
+  std::string_view start_timestamp_deltas_;
+  std::string_view latencies_;
+  std::string_view latency_weight_deltas_;
+  std::string_view request_size_deltas_;
+  std::string_view response_size_deltas_;
+  std::string_view success_bits_;
+  std::string_view warmup_bits_;
+  std::string_view server_processing_ns_;
+  const bool has_server_processing_ns_;
+  absl::Status status_;
+};
+
+// Moves the RpcSamples of the log that have neither a trace_context nor
+// stage_timings into one more RpcSampleColumns block, the successful ones
+// first.
+void MoveRpcSamplesToColumns(RpcPerformanceLog* rpc_log);
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_DISTBENCH_SAMPLE_COLUMNS_H_
@@ -0,0 +1,159 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_sample_columns.h"
+
+#include "gtest/gtest.h"
+#include "gtest_utils.h"
+
+namespace distbench {
+
+TEST(RpcSampleColumns, RoundTrip) {
+  std::vector<ColumnarSample> samples;
+  for (int i = 0; i < 1000; ++i) {
+    ColumnarSample sample;
+    sample.start_timestamp_ns = 1'700'000'000'000'000'000 + i * 1000 - i % 7;
+    sample.latency_ns = (i * 7919) % 100'000;
+    sample.latency_weight = i % 3;
+    sample.request_size = 1024 + (i % 2) * 16;
+    sample.response_size = 4096 - i;
+    sample.success = i % 11 != 0;
+    sample.warmup = i < 20;
+    samples.push_back(sample);
+  }
+  RpcSampleColumnsWriter writer;
+  for (const auto& sample : samples) {
+    writer.Add(sample);
+  }
+  EXPECT_EQ(writer.size(), 1000);
+  RpcSampleColumns columns = writer.Finish();
+  EXPECT_EQ(writer.size(), 0);
+  EXPECT_EQ(columns.sample_count(), 1000);
+
+  RpcSampleColumnsReader reader(columns);
+  ColumnarSample sample;
+  size_t i = 0;
+  while (reader.Next(&sample)) {
+    ASSERT_LT(i, samples.size());
+    EXPECT_EQ(sample.start_timestamp_ns, samples[i].start_timestamp_ns);
+    EXPECT_EQ(sample.latency_ns, samples[i].latency_ns);
+    EXPECT_EQ(sample.latency_weight, samples[i].latency_weight);
+    EXPECT_EQ(sample.request_size, samples[i].request_size);
+    EXPECT_EQ(sample.response_size, samples[i].response_size);
+    EXPECT_EQ(sample.success, samples[i].success);
+    EXPECT_EQ(sample.warmup, samples[i].warmup);
+    ++i;
+  }
+  ASSERT_OK(reader.status());
+  EXPECT_EQ(i, samples.size());
+
+  // The deltas should be much smaller than the equivalent RpcSamples.
+  PeerPerformanceLog log;
+  for (const auto& s : samples) {
+    RpcSample* rpc_sample =
+        (*log.mutable_rpc_logs())[0].add_successful_rpc_samples();
+    rpc_sample->set_start_timestamp_ns(s.start_timestamp_ns);
+    rpc_sample->set_latency_ns(s.latency_ns);
+    rpc_sample->set_latency_weight(s.latency_weight);
+    rpc_sample->set_request_size(s.request_size);
+    rpc_sample->set_response_size(s.response_size);
+    rpc_sample->set_warmup(s.warmup);
+  }
+  EXPECT_LT(columns.ByteSizeLong() * 3, log.ByteSizeLong());
+}
+
+TEST(RpcSampleColumns, ServerProcessingTime) {
+  RpcSampleColumnsWriter writer;
+  ColumnarSample sample;
+  writer.Add(sample);
+  // No column is needed until a sample has a server_processing_ns:
+  RpcSampleColumnsWriter copy = writer;
+  EXPECT_FALSE(copy.Finish().has_server_processing_ns());
+  // The samples before the first one with a server_processing_ns read back
+  // without it:
+  for (int i = 1; i < 10; ++i) {
+    sample.server_processing_ns = i % 3 ? i * 1000 : -1;
+    writer.Add(sample);
+  }
+  RpcSampleColumns columns = writer.Finish();
+  RpcSampleColumnsReader reader(columns);
+  int i = 0;
+  while (reader.Next(&sample)) {
+    EXPECT_EQ(sample.server_processing_ns, i % 3 ? i * 1000 : -1);
+    ++i;
+  }
+  ASSERT_OK(reader.status());
+  EXPECT_EQ(i, 10);
+}
+
+TEST(RpcSampleColumns, Malformed) {
+  RpcSampleColumnsWriter writer;
+  ColumnarSample sample;
+  for (int i = 0; i < 10; ++i) {
+    sample.start_timestamp_ns = i;
+    sample.latency_ns = 1000 + i;
+    writer.Add(sample);
+  }
+  RpcSampleColumns columns = writer.Finish();
+
+  RpcSampleColumns truncated = columns;
+  truncated.set_sample_count(11);
+  RpcSampleColumnsReader reader(truncated);
+  int n = 0;
+  while (reader.Next(&sample)) ++n;
+  EXPECT_EQ(n, 10);
+  EXPECT_FALSE(reader.status().ok());
+
+  RpcSampleColumns bad_varint = columns;
+  bad_varint.set_latencies_ns(std::string(12, '\xff'));
+  RpcSampleColumnsReader bad_reader(bad_varint);
+  EXPECT_FALSE(bad_reader.Next(&sample));
+  EXPECT_FALSE(bad_reader.status().ok());
+}
+
+TEST(RpcSampleColumns, MoveRpcSamplesToColumns) {
+  RpcPerformanceLog rpc_log;
+  for (int i = 0; i < 5; ++i) {
+    auto* sample = rpc_log.add_successful_rpc_samples();
+    sample->set_start_timestamp_ns(100 * i);
+    sample->set_latency_ns(10 + i);
+    if (i == 2) sample->set_latency_weight(3);
+    if (i == 3) sample->mutable_trace_context()->set_span_id(7);
+  }
+  rpc_log.add_failed_rpc_samples()->set_latency_ns(99);
+
+  MoveRpcSamplesToColumns(&rpc_log);
+  // The traced sample stays an RpcSample:
+  ASSERT_EQ(rpc_log.successful_rpc_samples_size(), 1);
+  EXPECT_EQ(rpc_log.successful_rpc_samples(0).latency_ns(), 13);
+  EXPECT_EQ(rpc_log.failed_rpc_samples_size(), 0);
+  ASSERT_EQ(rpc_log.sample_columns_size(), 1);
+  EXPECT_EQ(rpc_log.sample_columns(0).sample_count(), 5);
+
+  RpcSampleColumnsReader reader(rpc_log.sample_columns(0));
+  std::vector<ColumnarSample> samples;
+  ColumnarSample sample;
+  while (reader.Next(&sample)) samples.push_back(sample);
+  ASSERT_OK(reader.status());
+  ASSERT_EQ(samples.size(), 5);
+  EXPECT_EQ(samples[0].latency_ns, 10);
+  EXPECT_EQ(samples[0].latency_weight, 0);
+  EXPECT_EQ(samples[2].latency_weight, 3);
+  EXPECT_EQ(samples[3].start_timestamp_ns, 400);
+  EXPECT_TRUE(samples[3].success);
+  EXPECT_EQ(samples[4].latency_ns, 99);
+  EXPECT_FALSE(samples[4].success);
+}
+
+}  // namespace distbench
@@ -14,26 +14,123 @@
 
 #include "distbench_summary.h"
 
+#include <algorithm>
+#include <set>
+#include <tuple>
+
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
+#include "absl/strings/str_join.h"
 #include "absl/strings/str_split.h"
+#include "distbench_histogram.h"
+#include "distbench_sample_columns.h"
+#include "distbench_utils.h"
 #include "glog/logging.h"
 
 namespace distbench {
 
 namespace {
 
-std::string LatencySummary(std::vector<int64_t> latencies) {
-  size_t N = latencies.size();
+using WeightedLatency = TestResultSummarizer::WeightedLatency;
+
+bool LatencyLess(const WeightedLatency& a, const WeightedLatency& b) {
+  return a.latency_ns < b.latency_ns;
+}
+
+// Returns the smallest latency such that the samples up to it, in latency
+// order, weigh at least target_weight. Only reorders [begin, end), in
+// expected linear time.
+int64_t WeightedLatencyAt(std::vector<WeightedLatency>::iterator begin,
+                          std::vector<WeightedLatency>::iterator end,
+                          double target_weight) {
+  while (end - begin > 1) {
+    auto middle = begin + (end - begin) / 2;
+    std::nth_element(begin, middle, end, LatencyLess);
+    double lower_weight = 0;
+    for (auto it = begin; it != middle; ++it) {
+      lower_weight += it->weight;
+    }
+    if (lower_weight >= target_weight) {
+      end = middle;
+    } else {
+      target_weight -= lower_weight;
+      begin = middle;
+    }
+  }
+  return begin->latency_ns;
+}
+
+// Reorders the latencies, rather than sorting them, to pick the percentiles.
+std::string LatencySummary(std::vector<WeightedLatency>* latencies,
+                           bool weighted) {
+  size_t N = latencies->size();
+  std::string ret;
+  absl::StrAppendFormat(&ret, "N: %ld", N);
+  if (N == 0) return ret;
+
+  auto [min, max] =
+      std::minmax_element(latencies->begin(), latencies->end(), LatencyLess);
+  int64_t min_latency = min->latency_ns;
+  int64_t max_latency = max->latency_ns;
+  double total_weight = 0;
+  if (weighted) {
+    for (const auto& latency : *latencies) {
+      total_weight += latency.weight;
+    }
+  }
+  // Each selection only has to partition what is above the previous one:
+  auto begin = latencies->begin();
+  auto percentile = [&](double fraction) {
+    if (weighted) {
+      return WeightedLatencyAt(latencies->begin(), latencies->end(),
+                               fraction * total_weight);
+    }
+    auto nth = latencies->begin() + static_cast<size_t>(N * fraction);
+    std::nth_element(begin, nth, latencies->end(), LatencyLess);
+    begin = nth;
+    return nth->latency_ns;
+  };
+  absl::StrAppendFormat(&ret, " min: %ldns", min_latency);
+  absl::StrAppendFormat(&ret, " median: %ldns", percentile(0.5));
+  absl::StrAppendFormat(&ret, " 90%%: %ldns", percentile(0.9));
+  absl::StrAppendFormat(&ret, " 99%%: %ldns", percentile(0.99));
+  absl::StrAppendFormat(&ret, " 99.9%%: %ldns", percentile(0.999));
+  absl::StrAppendFormat(&ret, " max: %ldns", max_latency);
+  return ret;
+}
+
+// The stages reported in the RPC stage summary, derived from RpcStageTimings:
+enum RpcStage {
+  kSerializeStage,
+  kSendStage,
+  kServerQueueingStage,
+  kHandlerStage,
+  kResponseStage,
+  kNetworkStage,
+  kCompletionStage,
+  kNumRpcStages,
+};
+
+constexpr const char* kRpcStageNames[kNumRpcStages] = {
+    "serialize", "send",    "server queueing", "handler",
+    "response",  "network", "completion",
+};
+
+// Same as above, but for the RPCs that were only recorded in histograms.
+std::string LatencySummary(const AtomicLatencyHistogram& histogram) {
+  int64_t N = histogram.Count();
   std::string ret;
   absl::StrAppendFormat(&ret, "N: %ld", N);
   if (N > 0) {
-    absl::StrAppendFormat(&ret, " min: %ldns", *latencies.begin());
-    absl::StrAppendFormat(&ret, " median: %ldns", latencies[N * 0.5]);
-    absl::StrAppendFormat(&ret, " 90%%: %ldns", latencies[N * 0.9]);
-    absl::StrAppendFormat(&ret, " 99%%: %ldns", latencies[N * 0.99]);
-    absl::StrAppendFormat(&ret, " 99.9%%: %ldns", latencies[N * 0.999]);
-    absl::StrAppendFormat(&ret, " max: %ldns", *latencies.rbegin());
+    absl::StrAppendFormat(&ret, " min: %ldns", histogram.MinLatency());
+    absl::StrAppendFormat(&ret, " median: %ldns",
+                          histogram.ValueAtFraction(0.5));
+    absl::StrAppendFormat(&ret, " 90%%: %ldns", histogram.ValueAtFraction(0.9));
+    absl::StrAppendFormat(&ret, " 99%%: %ldns",
+                          histogram.ValueAtFraction(0.99));
+    absl::StrAppendFormat(&ret, " 99.9%%: %ldns",
+                          histogram.ValueAtFraction(0.999));
+    absl::StrAppendFormat(&ret, " max: %ldns", histogram.MaxLatency());
   }
   return ret;
 }
@@ -51,9 +148,38 @@ struct instance_summary {
   int64_t rx_payload_bytes = 0;
 };
 
+// The IPC, and the events per RPC, or in total if there was no RPC.
+std::string PerfCountersSummary(const PerfCounters& counters,
+                                int64_t nb_rpcs) {
+  std::vector<std::string> parts;
+  if (counters.has_instructions() && counters.cycles()) {
+    parts.push_back(absl::StrFormat(
+        "IPC: %.2f", static_cast<double>(counters.instructions()) /
+                         counters.cycles()));
+  }
+  auto add_count = [&](std::string_view name, bool has_count, int64_t count) {
+    if (!has_count) return;
+    if (nb_rpcs) {
+      parts.push_back(absl::StrFormat("%s/RPC: %.1f", name,
+                                      static_cast<double>(count) / nb_rpcs));
+    } else {
+      parts.push_back(absl::StrFormat("%s: %d", name, count));
+    }
+  };
+  add_count("cycles", counters.has_cycles(), counters.cycles());
+  add_count("instructions", counters.has_instructions(),
+            counters.instructions());
+  add_count("LLC misses", counters.has_llc_misses(), counters.llc_misses());
+  add_count("branch misses", counters.has_branch_misses(),
+            counters.branch_misses());
+  add_count("context switches", counters.has_context_switches(),
+            counters.context_switches());
+  return absl::StrJoin(parts, " ");
+}
+
 void AddCommunicationSummaryTo(
     std::vector<std::string>& ret, double total_time_seconds,
-    std::map<t_string_pair, rpc_traffic_summary> perf_map) {
+    const std::map<t_string_pair, rpc_traffic_summary>& perf_map) {
   ret.push_back("Communication summary:");
   constexpr double MiB = 1024 * 1024;
   for (auto& perf_r : perf_map) {
@@ -71,11 +197,10 @@ void AddCommunicationSummaryTo(
   }
 }
 
-void AddInstanceSummaryTo(std::vector<std::string>& ret,
-                          double total_time_seconds,
-                          std::map<t_string_pair, rpc_traffic_summary> perf_map,
-                          int64_t nb_warmup_samples,
-                          int64_t nb_failed_samples) {
+void AddInstanceSummaryTo(
+    std::vector<std::string>& ret, double total_time_seconds,
+    const std::map<t_string_pair, rpc_traffic_summary>& perf_map,
+    int64_t nb_warmup_samples, int64_t nb_failed_samples) {
   std::map<std::string, instance_summary> instance_summary_map;
   int64_t total_rpcs = 0;
   int64_t total_tx_bytes = 0;
@@ -136,62 +261,556 @@ void AddInstanceSummaryTo(std::vector<std::string>& ret,
 
 }  // anonymous namespace
 
+std::vector<TraceChain> JoinTraceSpans(const std::vector<TraceSpan>& spans) {
+  using SpanKey = std::tuple<uint64_t, uint64_t, uint64_t>;
+  std::map<SpanKey, const TraceSpan*> spans_by_id;
+  for (const auto& span : spans) {
+    spans_by_id[{span.trace_id_high, span.trace_id_low, span.span_id}] = &span;
+  }
+  std::set<SpanKey> parents;
+  for (const auto& span : spans) {
+    parents.insert({span.trace_id_high, span.trace_id_low,
+                    span.parent_span_id});
+  }
+
+  std::vector<TraceChain> chains;
+  for (const auto& span : spans) {
+    if (parents.count({span.trace_id_high, span.trace_id_low, span.span_id})) {
+      continue;
+    }
+    TraceChain chain;
+    const TraceSpan* current = &span;
+    // The number of spans bounds the walk, should the ids form a cycle:
+    while (chain.spans.size() <= spans.size()) {
+      chain.spans.push_back(current);
+      if (!current->parent_span_id) break;
+      auto it = spans_by_id.find({current->trace_id_high,
+                                  current->trace_id_low,
+                                  current->parent_span_id});
+      if (it == spans_by_id.end()) {
+        chain.complete = false;
+        break;
+      }
+      current = it->second;
+    }
+    std::reverse(chain.spans.begin(), chain.spans.end());
+    chains.push_back(std::move(chain));
+  }
+  return chains;
+}
+
 std::vector<std::string> SummarizeTestResult(const TestResult& test_result) {
-  std::map<std::string, std::vector<int64_t>> latency_map;
+  TestResultSummarizer summarizer(test_result.traffic_config());
+  summarizer.AddServiceLogs(test_result.service_logs());
+  summarizer.AddPerfCounters(
+      test_result.resource_usage_logs().node_perf_counters());
+  return summarizer.Summarize();
+}
+
+TestResultSummarizer::TestResultSummarizer(
+    const DistributedSystemDescription& traffic_config)
+    : traffic_config_(traffic_config) {}
+
+void TestResultSummarizer::AddServiceLogs(const ServiceLogs& service_logs) {
+  // The map entries are created upfront, so that each pair can then be
+  // decoded by a different thread:
+  std::vector<std::pair<std::map<int32_t, RpcLogSummary>*,
+                        const PeerPerformanceLog*>>
+      peer_logs;
+  for (const auto& instance_log : service_logs.instance_logs()) {
+    for (const auto& peer_log : instance_log.second.peer_logs()) {
+      peer_logs.emplace_back(
+          &rpc_log_summaries_[std::make_pair(instance_log.first,
+                                             peer_log.first)],
+          &peer_log.second);
+    }
+  }
+  ParallelFor(peer_logs.size(), [&peer_logs](size_t i) {
+    AddPeerLogTo(peer_logs[i].first, *peer_logs[i].second);
+  });
+  for (const auto& instance_log : service_logs.instance_logs()) {
+    for (const auto& pacing_log : instance_log.second.pacing_logs()) {
+      PacingLog& merged = pacing_logs_[pacing_log.first];
+      merged.set_iterations(merged.iterations() +
+                            pacing_log.second.iterations());
+      merged.set_behind_schedule_iterations(
+          merged.behind_schedule_iterations() +
+          pacing_log.second.behind_schedule_iterations());
+      merged.set_total_slip_ns(merged.total_slip_ns() +
+                               pacing_log.second.total_slip_ns());
+      merged.set_max_slip_ns(
+          std::max(merged.max_slip_ns(), pacing_log.second.max_slip_ns()));
+    }
+    for (const auto& [rpc_name, churn_log] :
+         instance_log.second.connection_churn_logs()) {
+      auto& latencies = reconnect_latencies_[rpc_name];
+      for (const auto& reconnect : churn_log.reconnects()) {
+        latencies.push_back({reconnect.reconnect_latency_ns(), 1});
+      }
+    }
+  }
+}
+
+void TestResultSummarizer::AddPerfCounters(
+    const google::protobuf::Map<std::string, PerfCountersLog>&
+        node_perf_counters) {
+  for (const auto& [node, perf_counters] : node_perf_counters) {
+    node_perf_counters_[node] = perf_counters;
+  }
+}
+
+void TestResultSummarizer::AddPeerLog(std::string_view initiator,
+                                      std::string_view target,
+                                      const PeerPerformanceLog& peer_log) {
+  AddPeerLogTo(&rpc_log_summaries_[std::make_pair(std::string(initiator),
+                                                  std::string(target))],
+               peer_log);
+}
+
+void TestResultSummarizer::AddPeerLogTo(
+    std::map<int32_t, RpcLogSummary>* rpc_summaries,
+    const PeerPerformanceLog& peer_log) {
+  for (const auto& rpc_log : peer_log.rpc_logs()) {
+    RpcLogSummary& summary = (*rpc_summaries)[rpc_log.first];
+    absl::Status merge_status =
+        summary.histogram.MergeFrom(rpc_log.second.latency_histogram());
+    if (!merge_status.ok()) {
+      LOG(WARNING) << "Ignoring latency histogram of rpc " << rpc_log.first
+                   << ": " << merge_status;
+    }
+    if (rpc_log.second.has_reconnect_overlap_histogram()) {
+      merge_status = summary.reconnect_overlap_histogram.MergeFrom(
+          rpc_log.second.reconnect_overlap_histogram());
+      if (!merge_status.ok()) {
+        LOG(WARNING) << "Ignoring reconnect overlap histogram of rpc "
+                     << rpc_log.first << ": " << merge_status;
+      }
+    }
+    summary.nb_successful_samples +=
+        rpc_log.second.successful_rpc_samples().size();
+    summary.nb_failed_samples += rpc_log.second.failed_rpc_samples().size();
+    summary.latencies.reserve(summary.latencies.size() +
+                              rpc_log.second.successful_rpc_samples().size());
+    for (const auto& sample : rpc_log.second.successful_rpc_samples()) {
+      if (sample.trace_context().has_span_id()) {
+        const TraceContext& trace_context = sample.trace_context();
+        summary.trace_spans.push_back(
+            {trace_context.trace_id_high(), trace_context.trace_id_low(),
+             trace_context.span_id(), trace_context.parent_span_id(),
+             trace_context.depth(), rpc_log.first, "", "",
+             sample.start_timestamp_ns(), sample.latency_ns()});
+      }
+      summary.AddSuccessfulSample(
+          sample.start_timestamp_ns(), sample.latency_ns(),
+          sample.latency_weight(), sample.request_size(),
+          sample.response_size(), sample.warmup(),
+          sample.has_server_processing_ns() ? sample.server_processing_ns()
+                                            : -1);
+      if (sample.has_stage_timings() && !sample.warmup()) {
+        summary.AddStageTimings(sample.stage_timings(), sample.latency_ns());
+      }
+    }
+    for (const auto& columns : rpc_log.second.sample_columns()) {
+      summary.latencies.reserve(summary.latencies.size() +
+                                columns.sample_count());
+      RpcSampleColumnsReader reader(columns);
+      ColumnarSample sample;
+      while (reader.Next(&sample)) {
+        if (!sample.success) {
+          ++summary.nb_failed_samples;
+          continue;
+        }
+        ++summary.nb_successful_samples;
+        // The columns store the weight as 0 when the RpcSample would have
+        // left it to its default of 1:
+        summary.AddSuccessfulSample(
+            sample.start_timestamp_ns, sample.latency_ns,
+            std::max<int64_t>(sample.latency_weight, 1), sample.request_size,
+            sample.response_size, sample.warmup, sample.server_processing_ns);
+      }
+      if (!reader.status().ok()) {
+        LOG(WARNING) << "Ignoring the rest of a sample block of rpc "
+                     << rpc_log.first << ": " << reader.status();
+      }
+    }
+  }
+}
+
+void TestResultSummarizer::RpcLogSummary::AddSuccessfulSample(
+    int64_t rpc_start_timestamp_ns, int64_t rpc_latency_ns,
+    int64_t rpc_latency_weight, int64_t rpc_request_size,
+    int64_t rpc_response_size, bool warmup, int64_t server_processing_ns) {
+  if (warmup) {
+    ++nb_warmup_samples;
+    return;
+  }
+  start_timestamp_ns = std::min(rpc_start_timestamp_ns, start_timestamp_ns);
+  end_timestamp_ns =
+      std::max(rpc_start_timestamp_ns + rpc_latency_ns, end_timestamp_ns);
+  request_size += rpc_request_size;
+  response_size += rpc_response_size;
+  latencies.push_back({rpc_latency_ns, rpc_latency_weight});
+  if (server_processing_ns >= 0) {
+    network_latencies.push_back(
+        {rpc_latency_ns - server_processing_ns, rpc_latency_weight});
+  }
+  has_latency_weights |= rpc_latency_weight != 1;
+}
+
+// The client stages are measured from the start of the RPC, the server ones
+// from the arrival of the request; the network stage is what is left of the
+// time between sending the request and dequeuing the response once the
+// server time is taken out. Stages the protocol driver did not time are
+// skipped.
+void TestResultSummarizer::RpcLogSummary::AddStageTimings(
+    const RpcStageTimings& timings, int64_t rpc_latency_ns) {
+  if (stage_latencies.empty()) {
+    stage_latencies.resize(kNumRpcStages);
+  }
+  auto add = [this](RpcStage stage, int64_t duration_ns) {
+    stage_latencies[stage].push_back({duration_ns, 1});
+  };
+  int64_t request_sent_ns = 0;
+  if (timings.has_serialize_done_ns()) {
+    add(kSerializeStage, timings.serialize_done_ns());
+    request_sent_ns = timings.serialize_done_ns();
+  }
+  if (timings.has_sent_ns()) {
+    add(kSendStage, timings.sent_ns() - request_sent_ns);
+    request_sent_ns = timings.sent_ns();
+  }
+  if (timings.has_handler_start_ns()) {
+    add(kServerQueueingStage, timings.handler_start_ns());
+    if (timings.has_handler_end_ns()) {
+      add(kHandlerStage, timings.handler_end_ns() - timings.handler_start_ns());
+    }
+  }
+  if (timings.has_handler_end_ns() && timings.has_response_sent_ns()) {
+    add(kResponseStage, timings.response_sent_ns() - timings.handler_end_ns());
+  }
+  if (timings.has_completion_dequeued_ns()) {
+    if (timings.has_response_sent_ns()) {
+      add(kNetworkStage, timings.completion_dequeued_ns() - request_sent_ns -
+                             timings.response_sent_ns());
+    }
+    add(kCompletionStage, rpc_latency_ns - timings.completion_dequeued_ns());
+  }
+}
+
+std::vector<std::string> TestResultSummarizer::Summarize() {
+  // The logs of every pair, merged by rpc name:
+  struct RpcLatencies {
+    std::vector<WeightedLatency> latencies;
+    bool has_latency_weights = false;
+    AtomicLatencyHistogram histogram;
+    std::string summary;
+    std::string weighted_summary;
+    std::vector<WeightedLatency> network_latencies;
+    std::string network_summary;
+    std::vector<std::vector<WeightedLatency>> stage_latencies;
+    std::vector<std::string> stage_summaries;
+    AtomicLatencyHistogram reconnect_overlap_histogram;
+  };
+  std::map<std::string, RpcLatencies> latency_map;
+  // The RPCs of every rpc to each target instance, across the initiators, to
+  // see how evenly the fanout filters spread the load:
+  std::map<std::string, std::map<std::string, AtomicLatencyHistogram>>
+      target_histograms;
   std::map<t_string_pair, rpc_traffic_summary> perf_map;
   int64_t test_time = 0;
   int64_t nb_warmup_samples = 0;
   int64_t nb_failed_samples = 0;
+  std::vector<TraceSpan> trace_spans;
 
-  for (const auto& instance_log : test_result.service_logs().instance_logs()) {
-    const std::string& initiator_instance_name = instance_log.first;
-    for (const auto& peer_log : instance_log.second.peer_logs()) {
-      const std::string& target_instance_name = peer_log.first;
-      int64_t start_timestamp_ns = std::numeric_limits<int64_t>::max();
-      int64_t end_timestamp_ns = std::numeric_limits<int64_t>::min();
-      rpc_traffic_summary perf_record{};
-      for (const auto& rpc_log : peer_log.second.rpc_logs()) {
-        std::string rpc_name =
-            test_result.traffic_config().rpc_descriptions(rpc_log.first).name();
-        std::vector<int64_t>& latencies = latency_map[rpc_name];
-        perf_record.nb_rpcs += rpc_log.second.successful_rpc_samples().size();
-        nb_failed_samples += rpc_log.second.failed_rpc_samples().size();
-        for (const auto& sample : rpc_log.second.successful_rpc_samples()) {
-          int64_t rpc_start_timestamp_ns = sample.start_timestamp_ns();
-          int64_t rpc_latency_ns = sample.latency_ns();
-          int64_t rpc_request_size = sample.request_size();
-          int64_t rpc_response_size = sample.response_size();
-          if (sample.warmup()) {
-            ++nb_warmup_samples;
-            continue;
-          }
-
+  for (auto& peer_summaries : rpc_log_summaries_) {
+    int64_t start_timestamp_ns = std::numeric_limits<int64_t>::max();
+    int64_t end_timestamp_ns = std::numeric_limits<int64_t>::min();
+    rpc_traffic_summary perf_record{};
+    for (auto& rpc_summary : peer_summaries.second) {
+      std::string rpc_name =
+          traffic_config_.rpc_descriptions(rpc_summary.first).name();
+      RpcLatencies& rpc_latencies = latency_map[rpc_name];
+      RpcLogSummary& summary = rpc_summary.second;
+      for (auto& span : summary.trace_spans) {
+        span.initiator = peer_summaries.first.first;
+        span.target = peer_summaries.first.second;
+        trace_spans.push_back(std::move(span));
+      }
+      summary.trace_spans = {};
+      const AtomicLatencyHistogram& histogram = summary.histogram;
+      CHECK(rpc_latencies.histogram.MergeFrom(histogram.ToProto()).ok());
+      if (!summary.reconnect_overlap_histogram.Empty()) {
+        CHECK(rpc_latencies.reconnect_overlap_histogram
+                  .MergeFrom(summary.reconnect_overlap_histogram.ToProto())
+                  .ok());
+      }
+      AtomicLatencyHistogram& target_histogram =
+          target_histograms[rpc_name][peer_summaries.first.second];
+      // When reservoir sampling dropped some of the RPCs, the histogram is
+      // the only complete record of the traffic:
+      if (histogram.Count() + histogram.FailedCount() +
+              histogram.WarmupCount() >
+          summary.nb_successful_samples + summary.nb_failed_samples) {
+        CHECK(target_histogram.MergeFrom(histogram.ToProto()).ok());
+        perf_record.nb_rpcs += histogram.Count() + histogram.WarmupCount();
+        nb_failed_samples += histogram.FailedCount();
+        nb_warmup_samples += histogram.WarmupCount();
+        if (histogram.Count()) {
           start_timestamp_ns =
-              std::min(rpc_start_timestamp_ns, start_timestamp_ns);
-          end_timestamp_ns = std::max(rpc_start_timestamp_ns + rpc_latency_ns,
-                                      end_timestamp_ns);
-          perf_record.request_size += rpc_request_size;
-          perf_record.response_size += rpc_response_size;
-          latencies.push_back(rpc_latency_ns);
+              std::min(histogram.FirstStartTimestamp(), start_timestamp_ns);
+          end_timestamp_ns =
+              std::max(histogram.LastEndTimestamp(), end_timestamp_ns);
+          perf_record.request_size += histogram.TotalRequestSize();
+          perf_record.response_size += histogram.TotalResponseSize();
         }
+        continue;
+      }
+      perf_record.nb_rpcs += summary.nb_successful_samples;
+      nb_failed_samples += summary.nb_failed_samples;
+      nb_warmup_samples += summary.nb_warmup_samples;
+      start_timestamp_ns =
+          std::min(summary.start_timestamp_ns, start_timestamp_ns);
+      end_timestamp_ns = std::max(summary.end_timestamp_ns, end_timestamp_ns);
+      perf_record.request_size += summary.request_size;
+      perf_record.response_size += summary.response_size;
+      rpc_latencies.has_latency_weights |= summary.has_latency_weights;
+      for (const auto& latency : summary.latencies) {
+        target_histogram.Record(latency.latency_ns, 0, 0, 0);
       }
-      if (start_timestamp_ns != std::numeric_limits<int64_t>::max()) {
-        test_time = std::max(test_time, end_timestamp_ns - start_timestamp_ns);
+      if (rpc_latencies.latencies.empty()) {
+        rpc_latencies.latencies = std::move(summary.latencies);
+      } else {
+        rpc_latencies.latencies.insert(rpc_latencies.latencies.end(),
+                                       summary.latencies.begin(),
+                                       summary.latencies.end());
+      }
+      summary.latencies = {};
+      rpc_latencies.network_latencies.insert(
+          rpc_latencies.network_latencies.end(),
+          summary.network_latencies.begin(), summary.network_latencies.end());
+      summary.network_latencies = {};
+      if (rpc_latencies.stage_latencies.empty()) {
+        rpc_latencies.stage_latencies = std::move(summary.stage_latencies);
+      } else {
+        for (size_t i = 0; i < summary.stage_latencies.size(); ++i) {
+          rpc_latencies.stage_latencies[i].insert(
+              rpc_latencies.stage_latencies[i].end(),
+              summary.stage_latencies[i].begin(),
+              summary.stage_latencies[i].end());
+        }
       }
-      t_string_pair key_traffic_sum =
-          std::make_pair(initiator_instance_name, target_instance_name);
-      perf_map[key_traffic_sum] = perf_record;
+      summary.stage_latencies = {};
     }
+    if (start_timestamp_ns != std::numeric_limits<int64_t>::max()) {
+      test_time = std::max(test_time, end_timestamp_ns - start_timestamp_ns);
+    }
+    perf_map[peer_summaries.first] = perf_record;
+  }
+
+  // The percentiles of the different rpcs are computed in parallel:
+  std::vector<RpcLatencies*> rpcs;
+  for (auto& rpc_latencies : latency_map) {
+    rpcs.push_back(&rpc_latencies.second);
   }
+  ParallelFor(rpcs.size(), [&rpcs](size_t i) {
+    RpcLatencies& rpc = *rpcs[i];
+    for (auto& stage_latencies : rpc.stage_latencies) {
+      rpc.stage_summaries.push_back(
+          stage_latencies.empty()
+              ? ""
+              : LatencySummary(&stage_latencies, /*weighted=*/false));
+    }
+    rpc.stage_latencies = {};
+    if (!rpc.network_latencies.empty()) {
+      rpc.network_summary =
+          LatencySummary(&rpc.network_latencies, /*weighted=*/false);
+      rpc.network_latencies = {};
+    }
+    if (rpc.histogram.Count() > static_cast<int64_t>(rpc.latencies.size())) {
+      rpc.summary = LatencySummary(rpc.histogram);
+      return;
+    }
+    rpc.summary = LatencySummary(&rpc.latencies, /*weighted=*/false);
+    if (rpc.has_latency_weights) {
+      rpc.weighted_summary = LatencySummary(&rpc.latencies, /*weighted=*/true);
+    }
+    rpc.latencies = {};
+  });
 
   std::vector<std::string> ret;
   ret.push_back("RPC latency summary:");
-  for (auto& latencies : latency_map) {
-    std::string str{};
-    std::sort(latencies.second.begin(), latencies.second.end());
-    absl::StrAppendFormat(&str, "  %s: %s", latencies.first,
-                          LatencySummary(latencies.second));
-    ret.push_back(str);
+  bool has_weighted_summaries = false;
+  for (const auto& rpc_latencies : latency_map) {
+    ret.push_back(absl::StrFormat("  %s: %s", rpc_latencies.first,
+                                  rpc_latencies.second.summary));
+    has_weighted_summaries |= !rpc_latencies.second.weighted_summary.empty();
+  }
+  // Weighting the samples by latency_weight corrects for the RPCs that a
+  // slow closed loop RPC held back, i.e. for coordinated omission, and
+  // weights the open loop ones by the stretch of schedule they stand for:
+  if (has_weighted_summaries) {
+    ret.push_back("RPC latency summary (weighted by latency_weight):");
+    for (const auto& rpc_latencies : latency_map) {
+      if (rpc_latencies.second.weighted_summary.empty()) continue;
+      ret.push_back(absl::StrFormat("  %s: %s", rpc_latencies.first,
+                                    rpc_latencies.second.weighted_summary));
+    }
+  }
+
+  // The end-to-end latency less the time the server held the request, for
+  // the rpcs with record_server_processing_time:
+  bool has_network_summaries = false;
+  for (const auto& rpc_latencies : latency_map) {
+    has_network_summaries |= !rpc_latencies.second.network_summary.empty();
+  }
+  if (has_network_summaries) {
+    ret.push_back("RPC network + stack latency summary:");
+    for (const auto& rpc_latencies : latency_map) {
+      if (rpc_latencies.second.network_summary.empty()) continue;
+      ret.push_back(absl::StrFormat("  %s: %s", rpc_latencies.first,
+                                    rpc_latencies.second.network_summary));
+    }
+  }
+
+  // Only the rpcs with record_stage_timings have stage summaries:
+  bool has_stage_summaries = false;
+  for (const auto& rpc_latencies : latency_map) {
+    has_stage_summaries |= !rpc_latencies.second.stage_summaries.empty();
+  }
+  if (has_stage_summaries) {
+    ret.push_back("RPC stage summary:");
+    for (const auto& [rpc_name, rpc_latencies] : latency_map) {
+      for (size_t i = 0; i < rpc_latencies.stage_summaries.size(); ++i) {
+        if (rpc_latencies.stage_summaries[i].empty()) continue;
+        ret.push_back(absl::StrFormat("  %s %s: %s", rpc_name,
+                                      kRpcStageNames[i],
+                                      rpc_latencies.stage_summaries[i]));
+      }
+    }
+  }
+
+  // Only the rpcs that reached more than one instance are reported; an even
+  // spread has a max/mean close to 1 and close 99% latencies:
+  bool has_load_summaries = false;
+  for (const auto& [rpc_name, targets] : target_histograms) {
+    has_load_summaries |= targets.size() > 1;
+  }
+  if (has_load_summaries) {
+    ret.push_back("RPC load balance summary:");
+    for (const auto& [rpc_name, targets] : target_histograms) {
+      if (targets.size() < 2) continue;
+      int64_t total_rpcs = 0;
+      int64_t min_rpcs = std::numeric_limits<int64_t>::max();
+      int64_t max_rpcs = 0;
+      int64_t min_p99 = std::numeric_limits<int64_t>::max();
+      int64_t max_p99 = 0;
+      for (const auto& [target, histogram] : targets) {
+        total_rpcs += histogram.Count();
+        min_rpcs = std::min(min_rpcs, histogram.Count());
+        max_rpcs = std::max(max_rpcs, histogram.Count());
+        if (histogram.Count()) {
+          min_p99 = std::min(min_p99, histogram.ValueAtFraction(0.99));
+          max_p99 = std::max(max_p99, histogram.ValueAtFraction(0.99));
+        }
+      }
+      if (!total_rpcs) min_p99 = 0;
+      double mean_rpcs = static_cast<double>(total_rpcs) / targets.size();
+      ret.push_back(absl::StrFormat(
+          "  %s: targets: %d RPCs min: %d max: %d max/mean: %.2f "
+          "99%% min: %dns max: %dns",
+          rpc_name, targets.size(), min_rpcs, max_rpcs,
+          mean_rpcs ? max_rpcs / mean_rpcs : 0., min_p99, max_p99));
+    }
+  }
+
+  // The compact traces are only logged span by span, so their chains are
+  // joined here, and counted by the rpcs along them:
+  if (!trace_spans.empty()) {
+    std::vector<TraceChain> chains = JoinTraceSpans(trace_spans);
+    std::set<std::pair<uint64_t, uint64_t>> trace_ids;
+    for (const auto& span : trace_spans) {
+      trace_ids.insert({span.trace_id_high, span.trace_id_low});
+    }
+    size_t max_depth = 0;
+    int64_t nb_incomplete_chains = 0;
+    std::map<std::string, int64_t> chains_by_path;
+    for (const auto& chain : chains) {
+      max_depth = std::max(max_depth, chain.spans.size());
+      nb_incomplete_chains += !chain.complete;
+      std::vector<std::string> path;
+      for (const TraceSpan* span : chain.spans) {
+        path.push_back(
+            traffic_config_.rpc_descriptions(span->rpc_index).name());
+      }
+      ++chains_by_path[absl::StrJoin(path, " -> ")];
+    }
+    ret.push_back("Trace summary:");
+    ret.push_back(absl::StrFormat(
+        "  traces: %d spans: %d chains: %d max depth: %d incomplete: %d",
+        trace_ids.size(), trace_spans.size(), chains.size(), max_depth,
+        nb_incomplete_chains));
+    for (const auto& [path, nb_chains] : chains_by_path) {
+      ret.push_back(absl::StrFormat("  %s: %d", path, nb_chains));
+    }
+  }
+
+  // Iterations that started late mean the offered load was lower than the
+  // configured one:
+  if (!pacing_logs_.empty()) {
+    ret.push_back("Open loop pacing summary:");
+    for (const auto& [action_name, pacing_log] : pacing_logs_) {
+      int64_t mean_slip_ns =
+          pacing_log.iterations()
+              ? pacing_log.total_slip_ns() / pacing_log.iterations()
+              : 0;
+      ret.push_back(absl::StrFormat(
+          "  %s: N: %d behind schedule: %d mean slip: %dns max slip: %dns",
+          action_name, pacing_log.iterations(),
+          pacing_log.behind_schedule_iterations(), mean_slip_ns,
+          pacing_log.max_slip_ns()));
+    }
+  }
+
+  // The RPCs in flight during a reconnect are to be compared with the RPC
+  // latency summary of the same rpc:
+  if (!reconnect_latencies_.empty()) {
+    ret.push_back("Connection churn summary:");
+    for (auto& [rpc_name, latencies] : reconnect_latencies_) {
+      ret.push_back(absl::StrFormat(
+          "  %s reconnects: %s", rpc_name,
+          LatencySummary(&latencies, /*weighted=*/false)));
+    }
+    for (const auto& [rpc_name, rpc_latencies] : latency_map) {
+      const auto& histogram = rpc_latencies.reconnect_overlap_histogram;
+      if (histogram.Empty()) continue;
+      ret.push_back(absl::StrFormat(
+          "  %s in flight during a reconnect: %s failed: %d", rpc_name,
+          LatencySummary(histogram), histogram.FailedCount()));
+    }
+  }
+
+  // The events of each node are divided by all the RPCs of the test, so that
+  // they add up across the nodes:
+  if (!node_perf_counters_.empty()) {
+    int64_t nb_rpcs = nb_failed_samples;
+    for (const auto& [peers, perf_record] : perf_map) {
+      nb_rpcs += perf_record.nb_rpcs;
+    }
+    ret.push_back("Hardware counter summary:");
+    for (const auto& [node, perf_counters] : node_perf_counters_) {
+      if (perf_counters.has_error()) {
+        ret.push_back(absl::StrFormat("  %s: %s", node, perf_counters.error()));
+        continue;
+      }
+      ret.push_back(absl::StrFormat(
+          "  %s%s: %s", node,
+          perf_counters.node_threads_only() ? " (node threads only)" : "",
+          PerfCountersSummary(perf_counters.process(), nb_rpcs)));
+      for (const auto& [role, counters] : perf_counters.thread_roles()) {
+        ret.push_back(absl::StrFormat("  %s %s: %s", node, role,
+                                      PerfCountersSummary(counters, nb_rpcs)));
+      }
+    }
   }
 
   double total_time_seconds = (double)test_time / 1'000'000'000;
@@ -15,12 +15,132 @@
 #ifndef DISTBENCH_DISTBENCH_SUMMARY_H_
 #define DISTBENCH_DISTBENCH_SUMMARY_H_
 
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
 #include "distbench.pb.h"
+#include "distbench_histogram.h"
 
 namespace distbench {
 
 std::vector<std::string> SummarizeTestResult(const TestResult& test_result);
 
+// One RPC of a compact trace (see TraceContext.span_id), as logged by its
+// client.
+struct TraceSpan {
+  uint64_t trace_id_high = 0;
+  uint64_t trace_id_low = 0;
+  uint64_t span_id = 0;
+  uint64_t parent_span_id = 0;
+  int depth = 0;
+  int32_t rpc_index = -1;
+  std::string initiator;
+  std::string target;
+  int64_t start_timestamp_ns = 0;
+  int64_t latency_ns = 0;
+};
+
+// The spans from the root of a trace down to one of its leaves. If the
+// parent of the first span was not logged (e.g. it was dropped by reservoir
+// sampling), the chain is incomplete.
+struct TraceChain {
+  std::vector<const TraceSpan*> spans;
+  bool complete = true;
+};
+
+// Joins the spans back into the chains of their traces, one per leaf span.
+std::vector<TraceChain> JoinTraceSpans(const std::vector<TraceSpan>& spans);
+
+// Builds the same summary as SummarizeTestResult, from logs that are added
+// piece by piece (e.g. while they are streamed from the node managers), so
+// that the full ServiceLogs never have to be held in memory. Only the
+// latencies of the samples are kept.
+class TestResultSummarizer {
+ public:
+  struct WeightedLatency {
+    int64_t latency_ns;
+    // RpcSample.latency_weight, used to correct the percentiles for
+    // coordinated omission.
+    int64_t weight;
+  };
+
+  explicit TestResultSummarizer(
+      const DistributedSystemDescription& traffic_config);
+
+  // Adds logs of the RPCs initiated by 'initiator' to 'target'. The logs of
+  // a given pair may be split across any number of calls. AddServiceLogs
+  // decodes the logs of the different pairs in parallel, and also accounts
+  // for the pacing logs of the open loop actions and for the connection
+  // churn logs.
+  void AddPeerLog(std::string_view initiator, std::string_view target,
+                  const PeerPerformanceLog& peer_log);
+  void AddServiceLogs(const ServiceLogs& service_logs);
+  // Adds the hardware events counted by each node, which Summarize reports
+  // per RPC of the whole test.
+  void AddPerfCounters(
+      const google::protobuf::Map<std::string, PerfCountersLog>&
+          node_perf_counters);
+
+  std::vector<std::string> Summarize();
+
+ private:
+  // Aggregates of the logs of one rpc, for one (initiator, target) pair:
+  struct RpcLogSummary {
+    // Accounts for one sample of a successful RPC, except in
+    // nb_successful_samples.
+    void AddSuccessfulSample(int64_t rpc_start_timestamp_ns,
+                             int64_t rpc_latency_ns, int64_t rpc_latency_weight,
+                             int64_t rpc_request_size,
+                             int64_t rpc_response_size, bool warmup,
+                             int64_t server_processing_ns);
+    // Accounts for the stage timings of a successful, non warmup, RPC.
+    void AddStageTimings(const RpcStageTimings& timings,
+                         int64_t rpc_latency_ns);
+
+    int64_t nb_successful_samples = 0;  // Including the warmup ones.
+    int64_t nb_failed_samples = 0;
+    int64_t nb_warmup_samples = 0;
+    int64_t request_size = 0;
+    int64_t response_size = 0;
+    int64_t start_timestamp_ns = std::numeric_limits<int64_t>::max();
+    int64_t end_timestamp_ns = std::numeric_limits<int64_t>::min();
+    std::vector<WeightedLatency> latencies;
+    // Whether some samples have a latency_weight other than 1, i.e. the
+    // weighted percentiles differ from the plain ones:
+    bool has_latency_weights = false;
+    // The latencies less the server processing time, for the samples that
+    // have it:
+    std::vector<WeightedLatency> network_latencies;
+    AtomicLatencyHistogram histogram;
+    // The durations of each RPC stage, indexed like kRpcStageNames in
+    // distbench_summary.cc, empty if no sample has stage timings:
+    std::vector<std::vector<WeightedLatency>> stage_latencies;
+    // The samples of compact traces, without initiator and target:
+    std::vector<TraceSpan> trace_spans;
+    // The RPCs in flight during a reconnect of the connection churn:
+    AtomicLatencyHistogram reconnect_overlap_histogram;
+  };
+
+  static void AddPeerLogTo(std::map<int32_t, RpcLogSummary>* rpc_summaries,
+                           const PeerPerformanceLog& peer_log);
+
+  const DistributedSystemDescription& traffic_config_;
+  // Keyed by (initiator, target), then by rpc index:
+  std::map<std::pair<std::string, std::string>,
+           std::map<int32_t, RpcLogSummary>>
+      rpc_log_summaries_;
+  // Keyed by action name, merged across the instances:
+  std::map<std::string, PacingLog> pacing_logs_;
+  // The reconnect latencies of the connection churn, keyed by rpc name:
+  std::map<std::string, std::vector<WeightedLatency>> reconnect_latencies_;
+  // Keyed by node alias:
+  std::map<std::string, PerfCountersLog> node_perf_counters_;
+};
+
 }  // namespace distbench
 
 #endif  // DISTBENCH_DISTBENCH_SUMMARY_H_
@@ -0,0 +1,259 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_summary.h"
+
+#include "gtest/gtest.h"
+
+namespace distbench {
+
+namespace {
+
+TestResult MakeTestResult(int nb_instances) {
+  TestResult result;
+  auto* rpc = result.mutable_traffic_config()->add_rpc_descriptions();
+  rpc->set_name("echo");
+  auto& instance_logs =
+      *result.mutable_service_logs()->mutable_instance_logs();
+  for (int i = 0; i < nb_instances; ++i) {
+    auto& peer_log = (*instance_logs["client/" + std::to_string(i)]
+                           .mutable_peer_logs())["server/0"];
+    auto& rpc_log = (*peer_log.mutable_rpc_logs())[0];
+    // Latencies 1000..100'000ns, in a scrambled order:
+    for (int j = 0; j < 100; ++j) {
+      auto* sample = rpc_log.add_successful_rpc_samples();
+      sample->set_start_timestamp_ns(j * 1'000'000);
+      sample->set_latency_ns(((j * 37) % 100 + 1) * 1000);
+      sample->set_request_size(10);
+      sample->set_response_size(20);
+    }
+  }
+  return result;
+}
+
+}  // anonymous namespace
+
+TEST(SummarizeTestResult, Percentiles) {
+  std::vector<std::string> summary = SummarizeTestResult(MakeTestResult(4));
+  ASSERT_GT(summary.size(), 2);
+  EXPECT_EQ(summary[0], "RPC latency summary:");
+  EXPECT_EQ(summary[1],
+            "  echo: N: 400 min: 1000ns median: 51000ns 90%: 91000ns "
+            "99%: 100000ns 99.9%: 100000ns max: 100000ns");
+  EXPECT_EQ(summary[2], "Communication summary:");
+}
+
+TEST(SummarizeTestResult, WeightedPercentiles) {
+  TestResult result = MakeTestResult(1);
+  auto& rpc_log = (*result.mutable_service_logs()
+                        ->mutable_instance_logs()
+                        ->at("client/0")
+                        .mutable_peer_logs())["server/0"]
+                      .mutable_rpc_logs()
+                      ->at(0);
+  // The slowest RPC delayed the ones that should have started after it,
+  // so it accounts for as much time as all the others together:
+  for (auto& sample : *rpc_log.mutable_successful_rpc_samples()) {
+    if (sample.latency_ns() == 100'000) {
+      sample.set_latency_weight(99);
+    }
+  }
+  std::vector<std::string> summary = SummarizeTestResult(result);
+  ASSERT_GT(summary.size(), 3);
+  EXPECT_EQ(summary[1],
+            "  echo: N: 100 min: 1000ns median: 51000ns 90%: 91000ns "
+            "99%: 100000ns 99.9%: 100000ns max: 100000ns");
+  EXPECT_EQ(summary[2], "RPC latency summary (weighted by latency_weight):");
+  EXPECT_EQ(summary[3],
+            "  echo: N: 100 min: 1000ns median: 99000ns 90%: 100000ns "
+            "99%: 100000ns 99.9%: 100000ns max: 100000ns");
+}
+
+TEST(SummarizeTestResult, PacingLogs) {
+  TestResult result = MakeTestResult(2);
+  for (auto& instance_log :
+       *result.mutable_service_logs()->mutable_instance_logs()) {
+    auto& pacing_log = (*instance_log.second.mutable_pacing_logs())["ping"];
+    pacing_log.set_iterations(100);
+    pacing_log.set_behind_schedule_iterations(
+        instance_log.first == "client/0" ? 0 : 10);
+    pacing_log.set_total_slip_ns(100'000);
+    pacing_log.set_max_slip_ns(instance_log.first == "client/0" ? 5000 : 9000);
+  }
+  std::vector<std::string> summary = SummarizeTestResult(result);
+  ASSERT_GT(summary.size(), 3);
+  EXPECT_EQ(summary[2], "Open loop pacing summary:");
+  EXPECT_EQ(summary[3],
+            "  ping: N: 200 behind schedule: 10 mean slip: 1000ns "
+            "max slip: 9000ns");
+  EXPECT_EQ(summary[4], "Communication summary:");
+}
+
+TEST(SummarizeTestResult, ServerProcessingTime) {
+  TestResult result = MakeTestResult(1);
+  auto& rpc_log = (*result.mutable_service_logs()
+                        ->mutable_instance_logs()
+                        ->at("client/0")
+                        .mutable_peer_logs())["server/0"]
+                      .mutable_rpc_logs()
+                      ->at(0);
+  // The server held every RPC for all but 500ns of its latency:
+  for (auto& sample : *rpc_log.mutable_successful_rpc_samples()) {
+    sample.set_server_processing_ns(sample.latency_ns() - 500);
+  }
+  std::vector<std::string> summary = SummarizeTestResult(result);
+  ASSERT_GT(summary.size(), 3);
+  EXPECT_EQ(summary[2], "RPC network + stack latency summary:");
+  EXPECT_EQ(summary[3],
+            "  echo: N: 100 min: 500ns median: 500ns 90%: 500ns "
+            "99%: 500ns 99.9%: 500ns max: 500ns");
+}
+
+TEST(SummarizeTestResult, StageTimings) {
+  TestResult result = MakeTestResult(1);
+  auto& rpc_log = (*result.mutable_service_logs()
+                        ->mutable_instance_logs()
+                        ->at("client/0")
+                        .mutable_peer_logs())["server/0"]
+                      .mutable_rpc_logs()
+                      ->at(0);
+  for (auto& sample : *rpc_log.mutable_successful_rpc_samples()) {
+    auto* timings = sample.mutable_stage_timings();
+    timings->set_serialize_done_ns(100);
+    timings->set_sent_ns(300);
+    timings->set_handler_start_ns(50);
+    timings->set_handler_end_ns(550);
+    timings->set_response_sent_ns(600);
+    timings->set_completion_dequeued_ns(sample.latency_ns() - 100);
+  }
+  std::vector<std::string> summary = SummarizeTestResult(result);
+  ASSERT_GT(summary.size(), 9);
+  EXPECT_EQ(summary[2], "RPC stage summary:");
+  EXPECT_EQ(summary[3],
+            "  echo serialize: N: 100 min: 100ns median: 100ns 90%: 100ns "
+            "99%: 100ns 99.9%: 100ns max: 100ns");
+  EXPECT_EQ(summary[4],
+            "  echo send: N: 100 min: 200ns median: 200ns 90%: 200ns "
+            "99%: 200ns 99.9%: 200ns max: 200ns");
+  EXPECT_EQ(summary[5],
+            "  echo server queueing: N: 100 min: 50ns median: 50ns 90%: 50ns "
+            "99%: 50ns 99.9%: 50ns max: 50ns");
+  EXPECT_EQ(summary[6],
+            "  echo handler: N: 100 min: 500ns median: 500ns 90%: 500ns "
+            "99%: 500ns 99.9%: 500ns max: 500ns");
+  EXPECT_EQ(summary[7],
+            "  echo response: N: 100 min: 50ns median: 50ns 90%: 50ns "
+            "99%: 50ns 99.9%: 50ns max: 50ns");
+  // What is left of the latency once the other stages are taken out:
+  EXPECT_EQ(summary[8],
+            "  echo network: N: 100 min: 0ns median: 50000ns 90%: 90000ns "
+            "99%: 99000ns 99.9%: 99000ns max: 99000ns");
+  EXPECT_EQ(summary[9],
+            "  echo completion: N: 100 min: 100ns median: 100ns 90%: 100ns "
+            "99%: 100ns 99.9%: 100ns max: 100ns");
+}
+
+TEST(SummarizeTestResult, LoadBalance) {
+  TestResult result;
+  auto* rpc = result.mutable_traffic_config()->add_rpc_descriptions();
+  rpc->set_name("echo");
+  auto& peer_logs = *(*result.mutable_service_logs()
+                           ->mutable_instance_logs())["client/0"]
+                         .mutable_peer_logs();
+  // 100 RPCs of 100ns to server/0, and 300 of 120ns to server/1:
+  for (int i = 0; i < 2; ++i) {
+    auto& rpc_log =
+        (*peer_logs["server/" + std::to_string(i)].mutable_rpc_logs())[0];
+    for (int j = 0; j < 100 * (2 * i + 1); ++j) {
+      auto* sample = rpc_log.add_successful_rpc_samples();
+      sample->set_start_timestamp_ns(j * 1'000);
+      sample->set_latency_ns(100 + 20 * i);
+    }
+  }
+  std::vector<std::string> summary = SummarizeTestResult(result);
+  ASSERT_GT(summary.size(), 3);
+  EXPECT_EQ(summary[2], "RPC load balance summary:");
+  EXPECT_EQ(summary[3],
+            "  echo: targets: 2 RPCs min: 100 max: 300 max/mean: 1.50 "
+            "99% min: 100ns max: 120ns");
+}
+
+// A single target is not reported:
+TEST(SummarizeTestResult, NoLoadBalanceForSingleTarget) {
+  std::vector<std::string> summary = SummarizeTestResult(MakeTestResult(4));
+  for (const auto& line : summary) {
+    EXPECT_NE(line, "RPC load balance summary:");
+  }
+}
+
+TEST(SummarizeTestResult, PerfCounters) {
+  TestResult result = MakeTestResult(2);
+  auto& node_perf_counters =
+      *result.mutable_resource_usage_logs()->mutable_node_perf_counters();
+  auto& node0 = node_perf_counters["node0"];
+  node0.mutable_process()->set_cycles(2'000'000);
+  node0.mutable_process()->set_instructions(3'000'000);
+  node0.mutable_process()->set_context_switches(50);
+  auto& thread_pool = (*node0.mutable_thread_roles())["ThreadPool"];
+  thread_pool.set_cycles(1'000'000);
+  thread_pool.set_instructions(1'000'000);
+  node_perf_counters["node1"].set_error("perf_event_open failed");
+  auto& node2 = node_perf_counters["node2"];
+  node2.set_node_threads_only(true);
+  node2.mutable_process()->set_context_switches(100);
+  std::vector<std::string> summary = SummarizeTestResult(result);
+  ASSERT_GT(summary.size(), 6);
+  EXPECT_EQ(summary[2], "Hardware counter summary:");
+  EXPECT_EQ(summary[3],
+            "  node0: IPC: 1.50 cycles/RPC: 10000.0 instructions/RPC: 15000.0 "
+            "context switches/RPC: 0.2");
+  EXPECT_EQ(summary[4],
+            "  node0 ThreadPool: IPC: 1.00 cycles/RPC: 5000.0 "
+            "instructions/RPC: 5000.0");
+  EXPECT_EQ(summary[5], "  node1: perf_event_open failed");
+  EXPECT_EQ(summary[6],
+            "  node2 (node threads only): context switches/RPC: 0.5");
+}
+
+TEST(JoinTraceSpans, Chains) {
+  // A root with two children, one of which has a child, and a span whose
+  // parent was not logged, in another trace:
+  std::vector<TraceSpan> spans(5);
+  spans[0].span_id = 1;
+  spans[1].span_id = 2;
+  spans[1].parent_span_id = 1;
+  spans[2].span_id = 3;
+  spans[2].parent_span_id = 1;
+  spans[3].span_id = 4;
+  spans[3].parent_span_id = 3;
+  spans[4].trace_id_low = 1;
+  spans[4].span_id = 5;
+  spans[4].parent_span_id = 1;
+  std::vector<TraceChain> chains = JoinTraceSpans(spans);
+  ASSERT_EQ(chains.size(), 3);
+  EXPECT_TRUE(chains[0].complete);
+  ASSERT_EQ(chains[0].spans.size(), 2);
+  EXPECT_EQ(chains[0].spans[0], &spans[0]);
+  EXPECT_EQ(chains[0].spans[1], &spans[1]);
+  EXPECT_TRUE(chains[1].complete);
+  ASSERT_EQ(chains[1].spans.size(), 3);
+  EXPECT_EQ(chains[1].spans[0], &spans[0]);
+  EXPECT_EQ(chains[1].spans[1], &spans[2]);
+  EXPECT_EQ(chains[1].spans[2], &spans[3]);
+  EXPECT_FALSE(chains[2].complete);
+  ASSERT_EQ(chains[2].spans.size(), 1);
+  EXPECT_EQ(chains[2].spans[0], &spans[4]);
+}
+
+}  // namespace distbench
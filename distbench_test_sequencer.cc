@@ -14,14 +14,215 @@
 
 #include "distbench_test_sequencer.h"
 
+#include <cmath>
+#include <optional>
+
 #include "absl/strings/match.h"
+#include "absl/strings/str_format.h"
 #include "absl/strings/str_join.h"
+#include "distbench_histogram.h"
 #include "distbench_summary.h"
 #include "distbench_utils.h"
 #include "glog/logging.h"
 
 namespace distbench {
 
+namespace {
+
+// Moves the partial logs in 'from' into 'to'. Unlike MergeFrom, this merges
+// the logs of the instances and peers that are already present in 'to',
+// rather than replacing them.
+void MergeServiceLogs(ServiceLogs* from, ServiceLogs* to) {
+  for (auto& instance_log : *from->mutable_instance_logs()) {
+    auto& to_instance_log =
+        (*to->mutable_instance_logs())[instance_log.first];
+    for (auto& peer_log : *instance_log.second.mutable_peer_logs()) {
+      auto& to_peer_log =
+          (*to_instance_log.mutable_peer_logs())[peer_log.first];
+      for (auto& rpc_log : *peer_log.second.mutable_rpc_logs()) {
+        auto& to_rpc_logs = *to_peer_log.mutable_rpc_logs();
+        auto it = to_rpc_logs.find(rpc_log.first);
+        if (it == to_rpc_logs.end()) {
+          to_rpc_logs[rpc_log.first] = std::move(rpc_log.second);
+        } else {
+          it->second.MergeFrom(rpc_log.second);
+        }
+      }
+    }
+    for (auto& activity_log : *instance_log.second.mutable_activity_logs()) {
+      (*to_instance_log.mutable_activity_logs())[activity_log.first] =
+          std::move(activity_log.second);
+    }
+    for (auto& pacing_log : *instance_log.second.mutable_pacing_logs()) {
+      (*to_instance_log.mutable_pacing_logs())[pacing_log.first] =
+          std::move(pacing_log.second);
+    }
+    for (auto& churn_log :
+         *instance_log.second.mutable_connection_churn_logs()) {
+      (*to_instance_log.mutable_connection_churn_logs())[churn_log.first] =
+          std::move(churn_log.second);
+    }
+  }
+}
+
+// Returns why the traffic should be cancelled, or an empty string.
+std::string CheckLiveMetrics(const LiveMetrics& metrics,
+                             const LiveMetricsConfig& config) {
+  for (const auto& rpc_metrics : metrics.rpc_metrics()) {
+    if (!config.rpc_name().empty() &&
+        rpc_metrics.rpc_name() != config.rpc_name()) {
+      continue;
+    }
+    const LatencyHistogram& window = rpc_metrics.window_histogram();
+    const int64_t completed =
+        window.successful_rpc_count() + window.warmup_rpc_count();
+    const int64_t failed = window.failed_rpc_count();
+    if (completed + failed == 0 ||
+        completed + failed < config.min_interval_rpcs()) {
+      continue;
+    }
+    const double failure_rate = 1.0 * failed / (completed + failed);
+    if (config.max_failure_rate() > 0 &&
+        failure_rate > config.max_failure_rate()) {
+      return absl::StrCat(rpc_metrics.service_instance(), " ",
+                          rpc_metrics.rpc_name(), " failure rate ",
+                          failure_rate, " over ", config.max_failure_rate());
+    }
+    if (config.max_p99_latency_ns() > 0 && window.successful_rpc_count()) {
+      AtomicLatencyHistogram histogram;
+      CHECK(histogram.MergeFrom(window).ok());
+      const int64_t p99 = histogram.ValueAtFraction(0.99);
+      if (p99 > config.max_p99_latency_ns()) {
+        return absl::StrCat(rpc_metrics.service_instance(), " ",
+                            rpc_metrics.rpc_name(), " p99 latency ", p99,
+                            "ns over ", config.max_p99_latency_ns(), "ns");
+      }
+    }
+  }
+  return "";
+}
+
+}  // anonymous namespace
+
+absl::StatusOr<std::optional<double>> SearchMaxSustainableLoad(
+    const ThroughputSearch& search, bool integer_load,
+    const std::function<absl::StatusOr<bool>(double load)>& run_step) {
+  if (!(search.min_load() > 0) || search.max_load() < search.min_load()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("throughput_search needs 0 < min_load <= max_load, not ",
+                     search.min_load(), " and ", search.max_load()));
+  }
+  if (search.strategy() != "binary" && search.strategy() != "ramp") {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "throughput_search strategy must be binary or ramp, not ",
+        search.strategy()));
+  }
+  if (search.strategy() == "ramp" && !(search.ramp_factor() > 1)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "throughput_search ramp_factor must be over 1, not ",
+        search.ramp_factor()));
+  }
+  auto round_load = [integer_load](double load) {
+    return integer_load ? std::max(1.0, std::round(load)) : load;
+  };
+  double low = round_load(search.min_load());
+  double high = std::max(low, round_load(search.max_load()));
+  int steps = 0;
+  auto sustainable = [&](double load) {
+    ++steps;
+    return run_step(load);
+  };
+
+  auto low_sustainable = sustainable(low);
+  if (!low_sustainable.ok()) return low_sustainable.status();
+  if (!*low_sustainable) return std::nullopt;
+
+  if (search.strategy() == "ramp") {
+    while (low < high && steps < search.max_steps()) {
+      double load = round_load(low * search.ramp_factor());
+      // Integer loads grow by at least 1:
+      if (integer_load) load = std::max(load, low + 1);
+      load = std::min(high, load);
+      auto load_sustainable = sustainable(load);
+      if (!load_sustainable.ok()) return load_sustainable.status();
+      if (!*load_sustainable) break;
+      low = load;
+    }
+    return low;
+  }
+
+  if (low == high || steps >= search.max_steps()) return low;
+  auto high_sustainable = sustainable(high);
+  if (!high_sustainable.ok()) return high_sustainable.status();
+  if (*high_sustainable) return high;
+  // Invariant: low is sustainable and high is not.
+  while (steps < search.max_steps()) {
+    double load;
+    if (integer_load) {
+      if (high - low <= 1) break;
+      load = std::floor((low + high) / 2);
+    } else {
+      if (high <= low * (1 + search.precision())) break;
+      // The rates span orders of magnitude, so bisect their logarithm:
+      load = std::sqrt(low * high);
+    }
+    auto load_sustainable = sustainable(load);
+    if (!load_sustainable.ok()) return load_sustainable.status();
+    (*load_sustainable ? low : high) = load;
+  }
+  return low;
+}
+
+void EvaluateThroughputSearchStep(const TestResult& result, int rpc_index,
+                                  const ThroughputSearch& search,
+                                  bool open_loop, int client_instances,
+                                  std::string abort_reason,
+                                  ThroughputSearchStep* step) {
+  AtomicLatencyHistogram histogram;
+  for (const auto& [instance_name, instance_log] :
+       result.service_logs().instance_logs()) {
+    for (const auto& [peer_name, peer_log] : instance_log.peer_logs()) {
+      auto it = peer_log.rpc_logs().find(rpc_index);
+      if (it == peer_log.rpc_logs().end()) continue;
+      if (!it->second.has_latency_histogram()) continue;
+      CHECK(histogram.MergeFrom(it->second.latency_histogram()).ok());
+    }
+  }
+  const int64_t total = histogram.Count() + histogram.FailedCount();
+  step->set_failure_rate(total ? 1.0 * histogram.FailedCount() / total : 0);
+  step->set_p99_latency_ns(
+      histogram.Count() ? histogram.ValueAtFraction(0.99) : 0);
+  const int64_t duration_ns =
+      histogram.LastEndTimestamp() - histogram.FirstStartTimestamp();
+  step->set_achieved_qps(
+      histogram.Count() && duration_ns > 0
+          ? 1e9 * histogram.Count() / duration_ns
+          : 0);
+
+  std::string reason = std::move(abort_reason);
+  if (!reason.empty()) {
+    // Cancelled by the live metrics.
+  } else if (!histogram.Count()) {
+    reason = "no successful RPCs";
+  } else if (search.max_p99_latency_ns() > 0 &&
+             step->p99_latency_ns() > search.max_p99_latency_ns()) {
+    reason = absl::StrCat("p99 latency ", step->p99_latency_ns(), "ns over ",
+                          search.max_p99_latency_ns(), "ns");
+  } else if (search.max_failure_rate() > 0 &&
+             step->failure_rate() > search.max_failure_rate()) {
+    reason = absl::StrCat("failure rate ", step->failure_rate(), " over ",
+                          search.max_failure_rate());
+  } else if (open_loop && step->achieved_qps() < search.min_rate_fraction() *
+                                                     step->load() *
+                                                     client_instances) {
+    reason = absl::StrCat("achieved ", step->achieved_qps(), " qps, under ",
+                          search.min_rate_fraction(), " of the load of ",
+                          client_instances, " client instances");
+  }
+  step->set_sustainable(reason.empty());
+  if (!reason.empty()) step->set_reason(reason);
+}
+
 grpc::Status TestSequencer::RegisterNode(grpc::ServerContext* context,
                                          const NodeRegistration* request,
                                          NodeConfig* response) {
@@ -89,6 +290,27 @@ grpc::Status TestSequencer::RegisterNode(grpc::ServerContext* context,
 grpc::Status TestSequencer::RunTestSequence(grpc::ServerContext* context,
                                             const TestSequence* request,
                                             TestSequenceResults* response) {
+  return RunExclusiveTestSequence(
+      context, request, [response](TestResult result) {
+        *response->add_test_results() = std::move(result);
+      });
+}
+
+grpc::Status TestSequencer::RunTestSequenceStream(
+    grpc::ServerContext* context, const TestSequence* request,
+    grpc::ServerWriter<TestResult>* writer) {
+  return RunExclusiveTestSequence(
+      context, request, [writer](TestResult result) {
+        if (!writer->Write(result)) {
+          LOG(WARNING) << "Could not stream the result of test "
+                       << result.traffic_config().name();
+        }
+      });
+}
+
+grpc::Status TestSequencer::RunExclusiveTestSequence(
+    grpc::ServerContext* context, const TestSequence* request,
+    const AddTestResult& add_result) {
   std::shared_ptr<absl::Notification> prior_notification;
   CancelTraffic();
   mutex_.Lock();
@@ -108,7 +330,7 @@ grpc::Status TestSequencer::RunTestSequence(grpc::ServerContext* context,
   auto notification = running_test_notification_ =
       std::make_shared<absl::Notification>();
   mutex_.Unlock();
-  grpc::Status result = DoRunTestSequence(context, request, response);
+  grpc::Status result = DoRunTestSequence(context, request, add_result);
   LOG(INFO) << "DoRunTestSequence status: " << result;
   notification->Notify();
   mutex_.Lock();
@@ -157,49 +379,229 @@ void TestSequencer::CancelTraffic() {
   }
 }
 
+bool TestSequencer::TestSequenceCancelled() {
+  absl::ReaderMutexLock m(&mutex_);
+  return running_test_sequence_context_->IsCancelled();
+}
+
 grpc::Status TestSequencer::DoRunTestSequence(grpc::ServerContext* context,
                                               const TestSequence* request,
-                                              TestSequenceResults* response) {
-  for (const auto& test : request->tests()) {
-    {
-      absl::MutexLock m(&mutex_);
-      if (running_test_sequence_context_->IsCancelled()) {
-        return grpc::Status(grpc::StatusCode::ABORTED,
-                            "Cancelled by new test sequence.");
+                                              const AddTestResult& add_result) {
+  const TestsSetting& settings = request->tests_setting();
+  if (settings.max_concurrent_tests() > 1) {
+    grpc::Status status = DoRunConcurrentTests(context, request, add_result);
+    if (status.ok() && settings.shutdown_after_tests()) {
+      shutdown_requested_.TryToNotify();
+    }
+    return status;
+  }
+  // The placement of the previous test, if its engines were kept:
+  std::optional<std::map<std::string, std::set<std::string>>> kept_services;
+  for (int i = 0; i < request->tests_size(); ++i) {
+    const DistributedSystemDescription& test = request->tests(i);
+    if (TestSequenceCancelled()) {
+      return grpc::Status(grpc::StatusCode::ABORTED,
+                          "Cancelled by new test sequence.");
+    }
+    absl::StatusOr<TestResult> maybe_result;
+    absl::Time placement_start = absl::Now();
+    auto maybe_map = PlaceServices(test, settings);
+    const absl::Duration placement_time = absl::Now() - placement_start;
+    if (maybe_map.ok()) {
+      // The engines are only reused when every node keeps the same services,
+      // so that all of them keep their connections:
+      const bool reuse_engines = kept_services == *maybe_map;
+      const bool keep_services = settings.reuse_engines() &&
+                                 i + 1 < request->tests_size() &&
+                                 !test.has_throughput_search();
+      if (test.has_throughput_search()) {
+        maybe_result = DoRunThroughputSearch(context, test, *maybe_map,
+                                             settings.keep_instance_log());
+      } else {
+        maybe_result =
+            DoRunTest(context, test, *maybe_map, settings.keep_instance_log(),
+                      reuse_engines, keep_services);
+      }
+      ReleaseNodes(*maybe_map);
+      kept_services.reset();
+      if (keep_services && maybe_result.ok()) kept_services = *maybe_map;
+      if (maybe_result.ok()) {
+        maybe_result->mutable_setup_timings()->set_placement_ns(
+            absl::ToInt64Nanoseconds(placement_time));
       }
+    } else {
+      maybe_result = maybe_map.status();
     }
-    auto maybe_result = DoRunTest(context, test);
     LOG(INFO) << "DoRunTest status: " << maybe_result.status();
     if (!maybe_result.ok()) {
       return grpc::Status(grpc::StatusCode::ABORTED,
                           std::string(maybe_result.status().message()));
     }
-    auto& result = maybe_result.value();
-    auto summary = SummarizeTestResult(result);
-    for (const auto& s : summary) {
-      maybe_result->add_log_summary(s);
+    add_result(std::move(maybe_result.value()));
+  }
+  if (settings.shutdown_after_tests()) {
+    shutdown_requested_.TryToNotify();
+  }
+  return grpc::Status::OK;
+}
+
+grpc::Status TestSequencer::DoRunConcurrentTests(
+    grpc::ServerContext* context, const TestSequence* request,
+    const AddTestResult& add_result) {
+  const TestsSetting& settings = request->tests_setting();
+  const int max_concurrent_tests = settings.max_concurrent_tests();
+  // Indexed by test; empty for the tests that were not started:
+  std::vector<std::optional<absl::StatusOr<TestResult>>> results(
+      request->tests_size());
+  std::vector<std::thread> threads;
+  absl::Mutex scheduling_mutex;
+  int running_tests = 0;
+  int finished_tests = 0;
+  bool failed = false;
+  // The results are passed on in order, as soon as the ones before them are,
+  // without holding scheduling_mutex while add_result runs:
+  absl::Mutex add_result_mutex;
+  size_t next_result = 0;
+  auto add_ready_results = [&]() {
+    absl::MutexLock add_result_lock(&add_result_mutex);
+    while (true) {
+      TestResult result;
+      {
+        absl::MutexLock m(&scheduling_mutex);
+        if (next_result == results.size() ||
+            !results[next_result].has_value() || !results[next_result]->ok()) {
+          return;
+        }
+        result = std::move(results[next_result]->value());
+        ++next_result;
+      }
+      add_result(std::move(result));
     }
-    if (!request->tests_setting().keep_instance_log()) {
-      result.mutable_service_logs()->clear_instance_logs();
+  };
+  for (int i = 0; i < request->tests_size(); ++i) {
+    const DistributedSystemDescription& test = request->tests(i);
+    bool started = false;
+    while (!started) {
+      int finished_before_placement;
+      {
+        absl::MutexLock m(&scheduling_mutex);
+        auto slot_available = [&]() {
+          return failed || running_tests < max_concurrent_tests;
+        };
+        scheduling_mutex.Await(absl::Condition(&slot_available));
+        if (failed) break;
+        finished_before_placement = finished_tests;
+      }
+      if (TestSequenceCancelled()) {
+        absl::MutexLock m(&scheduling_mutex);
+        results[i] = absl::AbortedError("Cancelled by new test sequence.");
+        failed = true;
+        break;
+      }
+      absl::Time placement_start = absl::Now();
+      auto maybe_map = PlaceServices(test, settings);
+      const absl::Duration placement_time = absl::Now() - placement_start;
+      absl::MutexLock m(&scheduling_mutex);
+      if (maybe_map.ok()) {
+        ++running_tests;
+        started = true;
+        threads.push_back(RunRegisteredThread(
+            "RunTest",
+            [this, context, &test, &settings, &results, &scheduling_mutex,
+             &running_tests, &finished_tests, &failed, &add_ready_results, i,
+             placement_time,
+             node_service_map = std::move(maybe_map.value())]() {
+              auto maybe_result =
+                  test.has_throughput_search()
+                      ? DoRunThroughputSearch(context, test, node_service_map,
+                                              settings.keep_instance_log())
+                      : DoRunTest(context, test, node_service_map,
+                                  settings.keep_instance_log(),
+                                  /*reuse_engines=*/false,
+                                  /*keep_services=*/false);
+              if (maybe_result.ok()) {
+                maybe_result->mutable_setup_timings()->set_placement_ns(
+                    absl::ToInt64Nanoseconds(placement_time));
+              }
+              LOG(INFO) << "DoRunTest " << i
+                        << " status: " << maybe_result.status();
+              ReleaseNodes(node_service_map);
+              {
+                absl::MutexLock m(&scheduling_mutex);
+                if (!maybe_result.ok()) failed = true;
+                results[i] = std::move(maybe_result);
+                --running_tests;
+                ++finished_tests;
+              }
+              add_ready_results();
+            }));
+      } else if (finished_tests != finished_before_placement) {
+        // Some nodes were just released, retry right away.
+      } else if (running_tests == 0) {
+        // Not for want of the nodes used by the other tests:
+        results[i] = maybe_map.status();
+        failed = true;
+      } else {
+        // Retry once another test has released its nodes:
+        auto test_finished = [&]() {
+          return failed || finished_tests != finished_before_placement;
+        };
+        scheduling_mutex.Await(absl::Condition(&test_finished));
+      }
+      if (failed) break;
     }
-    *response->add_test_results() = std::move(result);
+    if (!started) break;
   }
-  if (request->tests_setting().shutdown_after_tests()) {
-    shutdown_requested_.TryToNotify();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (auto& result : results) {
+    if (!result.has_value()) continue;
+    if (!result->ok()) {
+      return grpc::Status(grpc::StatusCode::ABORTED,
+                          std::string(result->status().message()));
+    }
   }
   return grpc::Status::OK;
 }
 
 absl::StatusOr<std::map<std::string, std::set<std::string>>>
-TestSequencer::PlaceServices(const DistributedSystemDescription& test) {
-  absl::MutexLock m(&mutex_);
+TestSequencer::PlaceServices(const DistributedSystemDescription& test,
+                             const TestsSetting& settings) {
+  absl::ReaderMutexLock m(&mutex_);
+  absl::MutexLock placement_lock(&placement_mutex_);
+  const bool concurrent_tests = settings.max_concurrent_tests() > 1;
+  std::set<std::pair<std::string, std::string>> reserved_attributes;
+  if (concurrent_tests) {
+    const std::set<std::string> isolation_attributes(
+        settings.isolation_attributes().begin(),
+        settings.isolation_attributes().end());
+    for (int node_id : reserved_nodes_) {
+      const auto& node = registered_nodes_[node_id];
+      for (const auto& attribute : node.registration.attributes()) {
+        if (isolation_attributes.count(attribute.name())) {
+          reserved_attributes.emplace(attribute.name(), attribute.value());
+        }
+      }
+    }
+  }
   std::vector<std::string> all_services;
   std::set<std::string> unplaced_services;
   std::set<std::string> idle_nodes;
-  for (const auto& node : registered_nodes_) {
-    if (!node.still_pending) {
-      idle_nodes.insert(node.node_alias);
+  for (size_t node_id = 0; node_id < registered_nodes_.size(); ++node_id) {
+    const auto& node = registered_nodes_[node_id];
+    if (node.still_pending) continue;
+    if (concurrent_tests) {
+      if (reserved_nodes_.contains(node_id)) continue;
+      bool shares_reserved_attribute = false;
+      for (const auto& attribute : node.registration.attributes()) {
+        if (reserved_attributes.count({attribute.name(), attribute.value()})) {
+          shares_reserved_attribute = true;
+        }
+      }
+      if (shares_reserved_attribute) continue;
     }
+    idle_nodes.insert(node.node_alias);
   }
 
   int total_services = 0;
@@ -275,10 +677,13 @@ TestSequencer::PlaceServices(const DistributedSystemDescription& test) {
 
   // Make sure there is an entry for every registered node:
   for (const auto& node : registered_nodes_) {
-    if (!node.still_pending) {
+    if (!node.still_pending && !concurrent_tests) {
       node_service_map[node.node_alias];
     }
   }
+  for (const auto& node : node_service_map) {
+    reserved_nodes_.insert(node_alias_id_map_.at(node.first));
+  }
 
   LOG(INFO) << "Service Placement:";
   for (const auto& node : node_service_map) {
@@ -289,41 +694,82 @@ TestSequencer::PlaceServices(const DistributedSystemDescription& test) {
   return node_service_map;
 }
 
+void TestSequencer::ReleaseNodes(
+    const std::map<std::string, std::set<std::string>>& node_service_map) {
+  absl::ReaderMutexLock m(&mutex_);
+  absl::MutexLock placement_lock(&placement_mutex_);
+  for (const auto& node : node_service_map) {
+    reserved_nodes_.erase(node_alias_id_map_.at(node.first));
+  }
+}
+
 absl::StatusOr<TestResult> TestSequencer::DoRunTest(
-    grpc::ServerContext* context, const DistributedSystemDescription& test) {
+    grpc::ServerContext* context, const DistributedSystemDescription& test,
+    const std::map<std::string, std::set<std::string>>& node_service_map,
+    bool keep_instance_log, bool reuse_engines, bool keep_services,
+    std::string* abort_reason_out) {
   if (test.services().empty()) {
     return absl::InvalidArgumentError("No services defined.");
   }
 
   struct rusage rusage_start_test = DoGetRusage();
 
-  auto maybe_map = PlaceServices(test);
-  if (!maybe_map.ok()) return maybe_map.status();
-
-  std::map<std::string, std::set<std::string>> node_service_map =
-      maybe_map.value();
-
+  TestSetupTimings setup_timings;
+  absl::Time phase_start = absl::Now();
   ServiceEndpointMap service_map;
-  auto maybe_service_map = ConfigureNodes(node_service_map, test);
+  auto maybe_service_map =
+      ConfigureNodes(node_service_map, test, reuse_engines);
   if (!maybe_service_map.ok()) return maybe_service_map.status();
   service_map = *maybe_service_map;
+  setup_timings.set_configure_nodes_ns(
+      absl::ToInt64Nanoseconds(absl::Now() - phase_start));
 
+  phase_start = absl::Now();
   auto ipret = IntroducePeers(node_service_map, service_map);
   LOG(INFO) << "IntroducePeers status: " << ipret;
   if (!ipret.ok()) return ipret;
+  setup_timings.set_introduce_peers_ns(
+      absl::ToInt64Nanoseconds(absl::Now() - phase_start));
+  LOG(INFO) << "Test setup timings: " << setup_timings.ShortDebugString();
 
   auto maybe_timeout = GetNamedAttributeInt64(test, "test_timeout", 3600);
   if (!maybe_timeout.ok()) return maybe_timeout.status();
-  auto maybe_logs = RunTraffic(node_service_map, *maybe_timeout);
+  TestResultSummarizer summarizer(test);
+  std::string abort_reason;
+  auto maybe_logs = RunTraffic(
+      node_service_map, *maybe_timeout, &summarizer, keep_instance_log,
+      /*clear_services=*/!keep_services,
+      test.has_live_metrics() ? &test.live_metrics() : nullptr,
+      &abort_reason);
   LOG(INFO) << "RunTraffic status: " << maybe_logs.status();
   if (!maybe_logs.ok()) return maybe_logs.status();
 
   TestResult ret;
   *ret.mutable_traffic_config() = test;
   *ret.mutable_placement() = service_map;
-  *ret.mutable_service_logs() = maybe_logs.value().service_logs();
+  *ret.mutable_setup_timings() = setup_timings;
+  if (keep_instance_log) {
+    *ret.mutable_service_logs() =
+        std::move(*maybe_logs.value().mutable_service_logs());
+  } else {
+    ret.mutable_service_logs();
+  }
   *ret.mutable_resource_usage_logs()->mutable_node_usages() =
       maybe_logs.value().node_usages();
+  *ret.mutable_resource_usage_logs()->mutable_node_thread_placements() =
+      maybe_logs.value().node_thread_placements();
+  *ret.mutable_resource_usage_logs()->mutable_node_perf_counters() =
+      maybe_logs.value().node_perf_counters();
+  *ret.mutable_resource_usage_logs()->mutable_node_wait_times() =
+      maybe_logs.value().node_wait_times();
+  summarizer.AddPerfCounters(maybe_logs.value().node_perf_counters());
+  if (!abort_reason.empty()) {
+    ret.add_log_summary(absl::StrCat("Test aborted early: ", abort_reason));
+  }
+  if (abort_reason_out) *abort_reason_out = abort_reason;
+  for (const auto& s : summarizer.Summarize()) {
+    ret.add_log_summary(s);
+  }
   RUsageStats rusage_stats =
       GetRUsageStatsFromStructs(rusage_start_test, DoGetRusage());
   *ret.mutable_resource_usage_logs()->mutable_test_sequencer_usage() =
@@ -331,10 +777,119 @@ absl::StatusOr<TestResult> TestSequencer::DoRunTest(
   return ret;
 }
 
+absl::StatusOr<TestResult> TestSequencer::DoRunThroughputSearch(
+    grpc::ServerContext* context, const DistributedSystemDescription& test,
+    const std::map<std::string, std::set<std::string>>& node_service_map,
+    bool keep_instance_log) {
+  const ThroughputSearch& search = test.throughput_search();
+  int action_index = -1;
+  for (int i = 0; i < test.actions_size(); ++i) {
+    if (test.actions(i).name() == search.action_name()) action_index = i;
+  }
+  if (action_index == -1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("throughput_search action_name ", search.action_name(),
+                     " is not an action of the test"));
+  }
+  const Action& action = test.actions(action_index);
+  const std::string rpc_name =
+      search.rpc_name().empty() ? action.rpc_name() : search.rpc_name();
+  int rpc_index = -1;
+  for (int i = 0; i < test.rpc_descriptions_size(); ++i) {
+    if (test.rpc_descriptions(i).name() == rpc_name) rpc_index = i;
+  }
+  if (rpc_index == -1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("throughput_search rpc_name '", rpc_name,
+                     "' is not an rpc of the test"));
+  }
+  const bool open_loop = action.iterations().has_open_loop_interval_ns();
+  // Each instance of the client of the rpc runs the action at the load:
+  int client_instances = 1;
+  for (const auto& service : test.services()) {
+    if (service.name() == test.rpc_descriptions(rpc_index).client()) {
+      client_instances = std::max(1, service.count());
+    }
+  }
+
+  ThroughputSearchResult search_result;
+  // The result of the step at the highest sustainable load so far, or of
+  // the first step:
+  std::optional<TestResult> reported_result;
+  auto run_step = [&](double load) -> absl::StatusOr<bool> {
+    if (TestSequenceCancelled()) {
+      return absl::AbortedError("Cancelled by new test sequence.");
+    }
+    DistributedSystemDescription step_test = test;
+    step_test.clear_throughput_search();
+    Iterations* iterations =
+        step_test.mutable_actions(action_index)->mutable_iterations();
+    if (open_loop) {
+      iterations->set_open_loop_interval_ns(
+          std::max<int64_t>(1, std::llround(1e9 / load)));
+    } else {
+      iterations->set_max_parallel_iterations(std::llround(load));
+    }
+    // Each step is cancelled as soon as the rpc misses the limits:
+    LiveMetricsConfig* live_metrics = step_test.mutable_live_metrics();
+    live_metrics->set_rpc_name(rpc_name);
+    live_metrics->set_max_p99_latency_ns(search.max_p99_latency_ns());
+    live_metrics->set_max_failure_rate(search.max_failure_rate());
+    std::string abort_reason;
+    auto maybe_result = DoRunTest(context, step_test, node_service_map,
+                                  /*keep_instance_log=*/true,
+                                  /*reuse_engines=*/false,
+                                  /*keep_services=*/false, &abort_reason);
+    if (!maybe_result.ok()) return maybe_result.status();
+    ThroughputSearchStep* step = search_result.add_steps();
+    step->set_load(load);
+    EvaluateThroughputSearchStep(*maybe_result, rpc_index, search, open_loop,
+                                 client_instances, abort_reason, step);
+    LOG(INFO) << "Throughput search step: " << step->ShortDebugString();
+    if (step->sustainable() || !reported_result.has_value()) {
+      reported_result = std::move(maybe_result.value());
+    }
+    return step->sustainable();
+  };
+  auto maybe_load = SearchMaxSustainableLoad(search, !open_loop, run_step);
+  if (!maybe_load.ok()) return maybe_load.status();
+
+  TestResult ret = std::move(reported_result.value());
+  *ret.mutable_traffic_config() = test;
+  if (!keep_instance_log) {
+    ret.clear_service_logs();
+    ret.mutable_service_logs();
+  }
+  ret.add_log_summary(absl::StrCat("Throughput search of ", rpc_name, ":"));
+  for (const auto& step : search_result.steps()) {
+    ret.add_log_summary(absl::StrFormat(
+        "  load %g: %.1f qps p99: %dns failure rate: %.4f: %s", step.load(),
+        step.achieved_qps(), step.p99_latency_ns(), step.failure_rate(),
+        step.sustainable() ? "sustainable" : step.reason()));
+  }
+  if (maybe_load->has_value()) {
+    const double load = **maybe_load;
+    search_result.set_max_sustainable_load(load);
+    for (const auto& step : search_result.steps()) {
+      if (step.load() == load) {
+        search_result.set_max_sustainable_qps(step.achieved_qps());
+      }
+    }
+    ret.add_log_summary(
+        absl::StrFormat("  max sustainable load: %g (%.1f qps)", load,
+                        search_result.max_sustainable_qps()));
+  } else {
+    ret.add_log_summary(absl::StrFormat(
+        "  not sustainable at min_load %g", search_result.steps(0).load()));
+  }
+  *ret.mutable_throughput_search_result() = std::move(search_result);
+  return ret;
+}
+
 absl::StatusOr<ServiceEndpointMap> TestSequencer::ConfigureNodes(
     const std::map<std::string, std::set<std::string>>& node_service_map,
-    const DistributedSystemDescription& test) {
-  absl::MutexLock m(&mutex_);
+    const DistributedSystemDescription& test, bool reuse_engines) {
+  absl::ReaderMutexLock m(&mutex_);
   grpc::CompletionQueue cq;
   struct PendingRpc {
     grpc::ClientContext context;
@@ -356,6 +911,7 @@ absl::StatusOr<ServiceEndpointMap> TestSequencer::ConfigureNodes(
     ++rpc_count;
     rpc_state.node_name = node_services.first;
     *rpc_state.request.mutable_traffic_config() = test;
+    rpc_state.request.set_reuse_engines(reuse_engines);
     for (const auto& service : node_services.second) {
       rpc_state.request.add_services(service);
     }
@@ -397,7 +953,7 @@ absl::Status TestSequencer::IntroducePeers(
     const std::map<std::string, std::set<std::string>>& node_service_map,
     ServiceEndpointMap service_map) {
   LOG(INFO) << "Broadcasting service map:\n" << service_map.DebugString();
-  absl::MutexLock m(&mutex_);
+  absl::ReaderMutexLock m(&mutex_);
   grpc::CompletionQueue cq;
   struct PendingRpc {
     grpc::ClientContext context;
@@ -442,7 +998,9 @@ absl::Status TestSequencer::IntroducePeers(
 
 absl::StatusOr<GetTrafficResultResponse> TestSequencer::RunTraffic(
     const std::map<std::string, std::set<std::string>>& node_service_map,
-    int64_t timeout_seconds) {
+    int64_t timeout_seconds, TestResultSummarizer* summarizer,
+    bool keep_instance_logs, bool clear_services,
+    const LiveMetricsConfig* live_metrics, std::string* abort_reason) {
   absl::ReaderMutexLock m(&mutex_);
   grpc::CompletionQueue cq;
   struct RunTrafficPendingRpc {
@@ -469,6 +1027,74 @@ absl::StatusOr<GetTrafficResultResponse> TestSequencer::RunTraffic(
         node.stub->AsyncRunTraffic(&rpc_state.context, rpc_state.request, &cq);
     rpc_state.rpc->Finish(&rpc_state.response, &rpc_state.status, &rpc_state);
   }
+
+  // While the traffic runs, each node streams its live metrics to a thread
+  // of its own, which cancels the traffic on all the nodes at the first
+  // breach of the limits. mutex_ cannot be taken again from these threads,
+  // so the nodes are looked up beforehand.
+  struct LiveMetricsStream {
+    grpc::ClientContext context;
+    RegisteredNode* node;
+  };
+  std::vector<RegisteredNode*> running_nodes;
+  for (const auto& node_services : node_service_map) {
+    auto it = node_alias_id_map_.find(node_services.first);
+    CHECK(it != node_alias_id_map_.end());
+    running_nodes.push_back(&registered_nodes_[it->second]);
+  }
+  absl::Mutex abort_mutex;
+  std::vector<LiveMetricsStream> live_streams(
+      live_metrics ? running_nodes.size() : 0);
+  std::vector<std::thread> live_threads;
+  for (size_t i = 0; i < live_streams.size(); ++i) {
+    auto& stream = live_streams[i];
+    stream.node = running_nodes[i];
+    live_threads.push_back(RunRegisteredThread("LiveMetrics", [&]() {
+      LiveMetricsRequest request;
+      request.set_interval_ms(live_metrics->interval_ms());
+      auto reader = stream.node->stub->GetLiveMetrics(&stream.context, request);
+      LiveMetrics metrics;
+      while (reader->Read(&metrics)) {
+        for (const auto& rpc_metrics : metrics.rpc_metrics()) {
+          AtomicLatencyHistogram window;
+          CHECK(window.MergeFrom(rpc_metrics.window_histogram()).ok());
+          LOG(INFO) << "Live metrics " << metrics.node_alias() << " "
+                    << rpc_metrics.service_instance() << " "
+                    << rpc_metrics.rpc_name() << ": completed "
+                    << rpc_metrics.completed_rpc_count() << " failed "
+                    << rpc_metrics.failed_rpc_count() << " in flight "
+                    << rpc_metrics.in_flight_rpc_count() << " p99 "
+                    << (window.Count() ? window.ValueAtFraction(0.99) : 0)
+                    << "ns";
+        }
+        std::string reason = CheckLiveMetrics(metrics, *live_metrics);
+        if (reason.empty()) continue;
+        {
+          absl::MutexLock m(&abort_mutex);
+          if (!abort_reason->empty()) break;
+          *abort_reason = reason;
+        }
+        LOG(WARNING) << "Cancelling the traffic: " << reason;
+        for (RegisteredNode* node : running_nodes) {
+          grpc::ClientContext context;
+          CancelTrafficRequest cancel_request;
+          CancelTrafficResult cancel_result;
+          SetGrpcClientContextDeadline(&context, /*max_time_s=*/60);
+          grpc::Status cancel_status =
+              node->stub->CancelTraffic(&context, cancel_request,
+                                        &cancel_result);
+          if (!cancel_status.ok()) {
+            LOG(ERROR) << "Cancelling traffic " << cancel_status << " on "
+                       << node->node_alias;
+          }
+        }
+        break;
+      }
+      stream.context.TryCancel();
+      reader->Finish();
+    }));
+  }
+
   while (rpc_count) {
     bool ok;
     void* tag;
@@ -484,6 +1110,12 @@ absl::StatusOr<GetTrafficResultResponse> TestSequencer::RunTraffic(
       }
     }
   }
+  for (auto& stream : live_streams) {
+    stream.context.TryCancel();
+  }
+  for (auto& thread : live_threads) {
+    thread.join();
+  }
 
   if (!status.ok()) {
     LOG(ERROR) << "RunTraffic aborted before collecting results: " << status;
@@ -491,47 +1123,69 @@ absl::StatusOr<GetTrafficResultResponse> TestSequencer::RunTraffic(
   }
   LOG(INFO) << "RunTraffic: all done -- collecting results";
 
-  struct GetResultPendingRpc {
+  // The results are streamed from all the nodes in parallel, and fed to the
+  // summarizer as they arrive, so that the logs are only kept in memory if
+  // keep_instance_logs is set:
+  struct GetResultStream {
     grpc::ClientContext context;
-    std::unique_ptr<grpc::ClientAsyncResponseReader<GetTrafficResultResponse>>
-        rpc;
     grpc::Status status;
-    GetTrafficResultRequest request;
-    GetTrafficResultResponse response;
     RegisteredNode* node;
     std::string node_name;
   };
-  std::vector<GetResultPendingRpc> pending_rpcs2(node_service_map.size());
+  GetTrafficResultResponse ret;
+  absl::Mutex ret_mutex;
+  std::vector<GetResultStream> streams(node_service_map.size());
+  std::vector<std::thread> threads;
+  threads.reserve(node_service_map.size());
   for (const auto& node_services : node_service_map) {
-    auto& rpc_state = pending_rpcs2[rpc_count];
-    ++rpc_count;
-    rpc_state.node_name = node_services.first;
+    auto& stream = streams[threads.size()];
+    stream.node_name = node_services.first;
     auto it = node_alias_id_map_.find(node_services.first);
     CHECK(it != node_alias_id_map_.end());
-    rpc_state.node = &registered_nodes_[it->second];
-    SetGrpcClientContextDeadline(&rpc_state.context, /*max_time_s=*/600);
-    rpc_state.request.set_clear_services(true);
-    rpc_state.rpc = rpc_state.node->stub->AsyncGetTrafficResult(
-        &rpc_state.context, rpc_state.request, &cq);
-    rpc_state.rpc->Finish(&rpc_state.response, &rpc_state.status, &rpc_state);
-  }
-  GetTrafficResultResponse ret;
-  while (rpc_count) {
-    bool ok;
-    void* tag;
-    cq.Next(&tag, &ok);
-    if (ok) {
-      --rpc_count;
-      GetResultPendingRpc* finished_rpc =
-          static_cast<GetResultPendingRpc*>(tag);
-      if (!finished_rpc->status.ok()) {
-        status = Annotate(finished_rpc->status,
-                          absl::StrCat("AsyncGetTrafficResult to ",
-                                       finished_rpc->node_name, " failed: "));
+    stream.node = &registered_nodes_[it->second];
+    SetGrpcClientContextDeadline(&stream.context, /*max_time_s=*/600);
+    threads.push_back(RunRegisteredThread("GetTrafficResult", [&]() {
+      GetTrafficResultRequest request;
+      request.set_clear_services(clear_services);
+      auto reader =
+          stream.node->stub->GetTrafficResultStream(&stream.context, request);
+      GetTrafficResultResponse response;
+      while (reader->Read(&response)) {
+        absl::MutexLock m(&ret_mutex);
+        summarizer->AddServiceLogs(response.service_logs());
+        if (keep_instance_logs) {
+          MergeServiceLogs(response.mutable_service_logs(),
+                           ret.mutable_service_logs());
+        }
+        for (const auto& node_usage : response.node_usages()) {
+          (*ret.mutable_node_usages())[node_usage.first] = node_usage.second;
+        }
+        for (const auto& placement : response.node_thread_placements()) {
+          (*ret.mutable_node_thread_placements())[placement.first] =
+              placement.second;
+        }
+        for (const auto& perf_counters : response.node_perf_counters()) {
+          (*ret.mutable_node_perf_counters())[perf_counters.first] =
+              perf_counters.second;
+        }
+        for (const auto& wait_times : response.node_wait_times()) {
+          (*ret.mutable_node_wait_times())[wait_times.first] =
+              wait_times.second;
+        }
       }
-      ret.MergeFrom(finished_rpc->response);
-      finished_rpc->node->idle = true;
+      stream.status = reader->Finish();
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (auto& stream : streams) {
+    if (!stream.status.ok()) {
+      status = Annotate(stream.status,
+                        absl::StrCat("GetTrafficResultStream to ",
+                                     stream.node_name, " failed: "));
     }
+    stream.node->idle = true;
   }
 
   if (!status.ok()) {
@@ -15,11 +15,15 @@
 #ifndef DISTBENCH_DISTBENCH_TEST_SEQUENCER_H_
 #define DISTBENCH_DISTBENCH_TEST_SEQUENCER_H_
 
+#include <functional>
+#include <optional>
 #include <set>
 
+#include "absl/container/flat_hash_set.h"
 #include "absl/status/statusor.h"
 #include "absl/synchronization/notification.h"
 #include "distbench.grpc.pb.h"
+#include "distbench_summary.h"
 #include "distbench_utils.h"
 
 namespace distbench {
@@ -32,6 +36,24 @@ struct RegisteredNode {
   bool still_pending = true;
 };
 
+// Returns the highest load from search.min_load() to search.max_load() at
+// which run_step returns true, following search.strategy(), or nullopt if it
+// returns false at min_load. The loads are rounded to integers if
+// integer_load is set.
+absl::StatusOr<std::optional<double>> SearchMaxSustainableLoad(
+    const ThroughputSearch& search, bool integer_load,
+    const std::function<absl::StatusOr<bool>(double load)>& run_step);
+
+// Measures the rpc in the logs of a step at step->load(), and checks it
+// against the limits of the search. The load is the rate of each of the
+// client_instances that run the action, while the achieved_qps is the rate
+// of all of them. abort_reason is why the live metrics cancelled the step.
+void EvaluateThroughputSearchStep(const TestResult& result, int rpc_index,
+                                  const ThroughputSearch& search,
+                                  bool open_loop, int client_instances,
+                                  std::string abort_reason,
+                                  ThroughputSearchStep* step);
+
 struct TestSequencerOpts {
   std::string control_plane_device;
   int* port;
@@ -54,33 +76,89 @@ class TestSequencer final : public DistBenchTestSequencer::Service {
                                const TestSequence* request,
                                TestSequenceResults* response) override;
 
+  grpc::Status RunTestSequenceStream(
+      grpc::ServerContext* context, const TestSequence* request,
+      grpc::ServerWriter<TestResult>* writer) override;
+
  private:
+  // Passes the result of each test to add_result, in the order of the
+  // tests, as soon as it is available.
+  using AddTestResult = std::function<void(TestResult result)>;
+
+  // Cancels the running test sequence, if any, and runs this one.
+  grpc::Status RunExclusiveTestSequence(grpc::ServerContext* context,
+                                        const TestSequence* request,
+                                        const AddTestResult& add_result);
+
   grpc::Status DoRunTestSequence(grpc::ServerContext* context,
                                  const TestSequence* request,
-                                 TestSequenceResults* response);
+                                 const AddTestResult& add_result);
+
+  // Runs the tests on disjoint sets of nodes, up to max_concurrent_tests at
+  // a time, starting them in order as soon as they can be placed.
+  grpc::Status DoRunConcurrentTests(grpc::ServerContext* context,
+                                    const TestSequence* request,
+                                    const AddTestResult& add_result);
 
+  bool TestSequenceCancelled() ABSL_LOCKS_EXCLUDED(mutex_);
+
+  // If reuse_engines is set, the nodes keep the engines of the previous test
+  // when they can run this one. If keep_services is set, the engines are
+  // kept after the test, for the next one to reuse.
+  // If the live metrics cancel the traffic, abort_reason is set to why.
   absl::StatusOr<TestResult> DoRunTest(
-      grpc::ServerContext* context, const DistributedSystemDescription& test);
+      grpc::ServerContext* context, const DistributedSystemDescription& test,
+      const std::map<std::string, std::set<std::string>>& node_service_map,
+      bool keep_instance_log, bool reuse_engines, bool keep_services,
+      std::string* abort_reason = nullptr);
 
+  // Runs the steps of the throughput_search of the test; see
+  // ThroughputSearch.
+  absl::StatusOr<TestResult> DoRunThroughputSearch(
+      grpc::ServerContext* context, const DistributedSystemDescription& test,
+      const std::map<std::string, std::set<std::string>>& node_service_map,
+      bool keep_instance_log);
+
+  // Places the services of the test on the nodes and reserves these, until
+  // ReleaseNodes. When tests run concurrently, only the nodes that are not
+  // reserved, nor share an isolation attribute with a reserved node, are
+  // used, and only these get an entry in the map. Otherwise every registered
+  // node gets one, to clear the services of the previous test.
   absl::StatusOr<std::map<std::string, std::set<std::string>>> PlaceServices(
-      const DistributedSystemDescription& test);
+      const DistributedSystemDescription& test, const TestsSetting& settings)
+      ABSL_LOCKS_EXCLUDED(mutex_, placement_mutex_);
+
+  void ReleaseNodes(
+      const std::map<std::string, std::set<std::string>>& node_service_map)
+      ABSL_LOCKS_EXCLUDED(mutex_, placement_mutex_);
 
   absl::StatusOr<ServiceEndpointMap> ConfigureNodes(
       const std::map<std::string, std::set<std::string>>& node_service_map,
-      const DistributedSystemDescription& test);
+      const DistributedSystemDescription& test, bool reuse_engines);
 
   absl::Status IntroducePeers(
       const std::map<std::string, std::set<std::string>>& node_service_map,
       ServiceEndpointMap service_map);
 
+  // Runs the traffic and streams the results into 'summarizer'. The logs are
+  // only returned if keep_instance_logs is true. The services are cleared
+  // afterwards if clear_services is true. If live_metrics is set, the
+  // traffic is followed while it runs, and cancelled as soon as it breaks
+  // one of the limits of live_metrics, with the reason in abort_reason.
   absl::StatusOr<GetTrafficResultResponse> RunTraffic(
       const std::map<std::string, std::set<std::string>>& node_service_map,
-      int64_t timeout_seconds);
+      int64_t timeout_seconds, TestResultSummarizer* summarizer,
+      bool keep_instance_logs, bool clear_services,
+      const LiveMetricsConfig* live_metrics, std::string* abort_reason);
 
   void CancelTraffic() ABSL_LOCKS_EXCLUDED(mutex_);
 
   absl::Mutex mutex_;
+  // Taken after mutex_, to reserve nodes while holding mutex_ as a reader:
+  absl::Mutex placement_mutex_;
   std::vector<RegisteredNode> registered_nodes_ ABSL_GUARDED_BY(mutex_);
+  // The ids of the nodes that a test is placed on:
+  absl::flat_hash_set<int> reserved_nodes_ ABSL_GUARDED_BY(placement_mutex_);
   std::map<std::string, int> node_alias_id_map_ ABSL_GUARDED_BY(mutex_);
   std::map<std::string, int> node_registration_id_map_ ABSL_GUARDED_BY(mutex_);
   grpc::ServerContext* running_test_sequence_context_ ABSL_GUARDED_BY(mutex_) =
@@ -14,8 +14,17 @@
 
 #include "distbench_test_sequencer.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <set>
+
 #include "absl/strings/str_replace.h"
+#include "distbench_histogram.h"
 #include "distbench_node_manager.h"
+#include "distbench_sample_columns.h"
 #include "distbench_utils.h"
 #include "glog/logging.h"
 #include "gtest/gtest.h"
@@ -32,7 +41,9 @@ std::unique_ptr<grpc::ClientContext> CreateContextWithDeadline(int max_time_s) {
 
 struct DistBenchTester {
   ~DistBenchTester();
-  absl::Status Initialize(int num_nodes);
+  // node_attributes, if not empty, holds the attributes of each node.
+  absl::Status Initialize(int num_nodes,
+                          std::vector<std::string> node_attributes = {});
 
   std::unique_ptr<TestSequencer> test_sequencer;
   std::unique_ptr<DistBenchTestSequencer::Stub> test_sequencer_stub;
@@ -52,7 +63,8 @@ DistBenchTester::~DistBenchTester() {
   }
 }
 
-absl::Status DistBenchTester::Initialize(int num_nodes) {
+absl::Status DistBenchTester::Initialize(
+    int num_nodes, std::vector<std::string> node_attributes) {
   test_sequencer = std::make_unique<TestSequencer>();
   distbench::TestSequencerOpts ts_opts = {};
   int port = 0;
@@ -68,6 +80,9 @@ absl::Status DistBenchTester::Initialize(int num_nodes) {
     }
     nm_opts.port = &port;
     nm_opts.test_sequencer_service_address = test_sequencer->service_address();
+    if (!node_attributes.empty()) {
+      nm_opts.node_attributes = node_attributes[i];
+    }
     nodes[i] = std::make_unique<NodeManager>();
     auto ret = nodes[i]->Initialize(nm_opts);
     if (!ret.ok()) return ret;
@@ -300,13 +315,23 @@ TEST(DistBenchTestSequencer, TestReservoirSampling) {
   // => Probability less than 1 in a million this fails:
   EXPECT_GT(warmup_samples, 275);
   EXPECT_LT(warmup_samples, 392);
+
+  // The histogram still accounts for the samples that were dropped:
+  const auto& histogram = it3->second.latency_histogram();
+  EXPECT_EQ(histogram.successful_rpc_count(), 2000);
+  EXPECT_EQ(histogram.warmup_rpc_count(), 1000);
+  EXPECT_EQ(histogram.failed_rpc_count(), 0);
+  const auto& latency_summary = results.test_results(0).log_summary()[1];
+  EXPECT_NE(latency_summary.find("N: 2000 "), std::string::npos)
+      << latency_summary;
 }
 
-TEST(DistBenchTestSequencer, TestWarmupSampling) {
+TEST(DistBenchTestSequencer, TestSummaryWithoutInstanceLogs) {
   DistBenchTester tester;
-  ASSERT_OK(tester.Initialize(3));
+  ASSERT_OK(tester.Initialize(2));
 
   TestSequence test_sequence;
+  test_sequence.mutable_tests_setting()->set_keep_instance_log(false);
   auto* test = test_sequence.add_tests();
   test->set_default_protocol("grpc");
   auto* s1 = test->add_services();
@@ -315,208 +340,1908 @@ TEST(DistBenchTestSequencer, TestWarmupSampling) {
   auto* s2 = test->add_services();
   s2->set_name("s2");
   s2->set_count(1);
-  auto* s3 = test->add_services();
-  s3->set_name("s3");
-  s3->set_count(1);
 
   auto* l1 = test->add_action_lists();
   l1->set_name("s1");
   l1->add_action_names("s1/ping");
-  l1->set_max_rpc_samples(1000);
 
   auto a1 = test->add_actions();
   a1->set_name("s1/ping");
-  a1->set_rpc_name("echo_and_forward");
-  a1->mutable_iterations()->set_max_parallel_iterations(100);
-  a1->mutable_iterations()->set_max_iteration_count(3000);
-  a1->mutable_iterations()->set_warmup_iterations(1000);
+  a1->set_rpc_name("echo");
+  a1->mutable_iterations()->set_max_iteration_count(500);
 
   auto* r1 = test->add_rpc_descriptions();
-  r1->set_name("echo_and_forward");
+  r1->set_name("echo");
   r1->set_client("s1");
   r1->set_server("s2");
 
   auto* l2 = test->add_action_lists();
-  l2->set_name("echo_and_forward");
-  l2->add_action_names("s2/async_ping");
+  l2->set_name("echo");
 
-  auto a2 = test->add_actions();
-  a2->set_name("s2/async_ping");
-  a2->set_action_list_name("async_echo_action_list");
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  EXPECT_EQ(test_result.service_logs().instance_logs_size(), 0);
+  // The summary is still computed from the logs streamed by the nodes:
+  ASSERT_GT(test_result.log_summary_size(), 1);
+  EXPECT_NE(test_result.log_summary(1).find("echo: N: 500 "),
+            std::string::npos)
+      << test_result.log_summary(1);
+}
 
-  auto* l3 = test->add_action_lists();
-  l3->set_name("async_echo_action_list");
-  l3->add_action_names("s2/ping");
+TEST(DistBenchTestSequencer, TestLiveMetricsEarlyAbort) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
 
-  auto a3 = test->add_actions();
-  a3->set_name("s2/ping");
-  a3->set_rpc_name("async_echo");
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("grpc");
+  auto* s1 = test->add_services();
+  s1->set_name("s1");
+  s1->set_count(1);
+  auto* s2 = test->add_services();
+  s2->set_name("s2");
+  s2->set_count(1);
 
-  auto* r2 = test->add_rpc_descriptions();
-  r2->set_name("async_echo");
-  r2->set_client("s2");
-  r2->set_server("s3");
+  auto* l1 = test->add_action_lists();
+  l1->set_name("s1");
+  l1->add_action_names("s1/ping");
 
-  auto* l4 = test->add_action_lists();
-  l4->set_name("async_echo");
+  // Runs for a minute unless the live metrics cut it short:
+  auto a1 = test->add_actions();
+  a1->set_name("s1/ping");
+  a1->set_rpc_name("echo");
+  a1->mutable_iterations()->set_max_duration_us(60'000'000);
+
+  auto* r1 = test->add_rpc_descriptions();
+  r1->set_name("echo");
+  r1->set_client("s1");
+  r1->set_server("s2");
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("echo");
+
+  // No RPC can meet this:
+  auto* live_metrics = test->mutable_live_metrics();
+  live_metrics->set_interval_ms(100);
+  live_metrics->set_max_p99_latency_ns(1);
+  live_metrics->set_min_interval_rpcs(10);
 
   TestSequenceResults results;
-  auto context = CreateContextWithDeadline(/*max_time_s=*/200);
+  auto context = CreateContextWithDeadline(/*max_time_s=*/45);
   grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
       context.get(), test_sequence, &results);
-  LOG(INFO) << status.error_message();
   ASSERT_OK(status);
   ASSERT_EQ(results.test_results_size(), 1);
-  ASSERT_EQ(results.test_results(0).service_logs().instance_logs_size(), 2);
-  auto it = results.test_results(0).service_logs().instance_logs().find("s1/0");
-  ASSERT_NE(it, results.test_results(0).service_logs().instance_logs().end());
-  ASSERT_EQ(it->second.peer_logs_size(), 1);
-  auto it2 = it->second.peer_logs().begin();
-  EXPECT_EQ(it2->first, "s2/0");
-  ASSERT_EQ(it2->second.rpc_logs_size(), 1);
-  auto it3 = it2->second.rpc_logs().begin();
-  EXPECT_EQ(it3->first, 0);
-  EXPECT_EQ(it3->second.successful_rpc_samples_size(), 1000);
-  EXPECT_EQ(it3->second.failed_rpc_samples_size(), 0);
-  int warmup_samples = 0;
-  for (const auto& sample : it3->second.successful_rpc_samples()) {
-    if (sample.warmup()) {
-      warmup_samples++;
-    }
-  }
-  // Hypergeometric distribution total population=3000
-  //                             warmup population=1000
-  //                             samples=1000
-  // => Expected value is 333
-  // => Probability less than 1 in a million this fails:
-  EXPECT_GT(warmup_samples, 275);
-  EXPECT_LT(warmup_samples, 392);
+  const auto& test_result = results.test_results(0);
+  ASSERT_GT(test_result.log_summary_size(), 0);
+  EXPECT_EQ(test_result.log_summary(0).find("Test aborted early: s1/0 echo "
+                                            "p99 latency "),
+            0)
+      << test_result.log_summary(0);
+}
 
-  it = results.test_results(0).service_logs().instance_logs().find("s2/0");
-  ASSERT_NE(it, results.test_results(0).service_logs().instance_logs().end());
-  ASSERT_EQ(it->second.peer_logs_size(), 1);
-  it2 = it->second.peer_logs().begin();
-  EXPECT_EQ(it2->first, "s3/0");
-  ASSERT_EQ(it2->second.rpc_logs_size(), 1);
-  it3 = it2->second.rpc_logs().begin();
-  EXPECT_EQ(it3->first, 1);
-  EXPECT_EQ(it3->second.successful_rpc_samples_size(), 3000);
-  EXPECT_EQ(it3->second.failed_rpc_samples_size(), 0);
-  warmup_samples = 0;
-  for (const auto& sample : it3->second.successful_rpc_samples()) {
-    if (sample.warmup()) {
-      warmup_samples++;
+void AddTimedPingTest(TestSequence* test_sequence, std::string name,
+                      int duration_ms, int client_count = 1) {
+  auto* test = test_sequence->add_tests();
+  test->set_name(name);
+  test->set_default_protocol("grpc");
+  auto* s1 = test->add_services();
+  s1->set_name("s1");
+  s1->set_count(client_count);
+  auto* s2 = test->add_services();
+  s2->set_name("s2");
+  s2->set_count(1);
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("s1");
+  l1->add_action_names("s1/ping");
+
+  auto a1 = test->add_actions();
+  a1->set_name("s1/ping");
+  a1->set_rpc_name("echo");
+  a1->mutable_iterations()->set_max_duration_us(duration_ms * 1000);
+  a1->mutable_iterations()->set_open_loop_interval_ns(10'000'000);
+
+  auto* r1 = test->add_rpc_descriptions();
+  r1->set_name("echo");
+  r1->set_client("s1");
+  r1->set_server("s2");
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("echo");
+}
+
+TEST(DistBenchTestSequencer, TestConcurrentTests) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(4));
+
+  TestSequence test_sequence;
+  test_sequence.mutable_tests_setting()->set_max_concurrent_tests(2);
+  AddTimedPingTest(&test_sequence, "first", 2000);
+  AddTimedPingTest(&test_sequence, "second", 2000);
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 2);
+  EXPECT_EQ(results.test_results(0).traffic_config().name(), "first");
+  EXPECT_EQ(results.test_results(1).traffic_config().name(), "second");
+  // When the RPCs of each test started and ended:
+  std::vector<std::pair<int64_t, int64_t>> traffic_intervals;
+  for (const auto& test_result : results.test_results()) {
+    EXPECT_EQ(test_result.placement().service_endpoints_size(), 2);
+    ASSERT_EQ(test_result.service_logs().instance_logs_size(), 1);
+    const auto& instance_log =
+        test_result.service_logs().instance_logs().begin()->second;
+    int64_t first_start_ns = std::numeric_limits<int64_t>::max();
+    int64_t last_end_ns = std::numeric_limits<int64_t>::min();
+    for (const auto& [peer, peer_log] : instance_log.peer_logs()) {
+      for (const auto& [rpc, rpc_log] : peer_log.rpc_logs()) {
+        for (const auto& sample : rpc_log.successful_rpc_samples()) {
+          first_start_ns =
+              std::min(first_start_ns, sample.start_timestamp_ns());
+          last_end_ns = std::max(
+              last_end_ns, sample.start_timestamp_ns() + sample.latency_ns());
+        }
+      }
     }
+    ASSERT_LT(first_start_ns, last_end_ns);
+    traffic_intervals.emplace_back(first_start_ns, last_end_ns);
   }
-  EXPECT_EQ(warmup_samples, 1000);
+  // Each test had nodes of its own, so their traffic overlapped:
+  EXPECT_LT(traffic_intervals[0].first, traffic_intervals[1].second);
+  EXPECT_LT(traffic_intervals[1].first, traffic_intervals[0].second);
 }
 
-TEST(DistBenchTestSequencer, RunIntenseTrafficMaxDurationGrpc) {
-  RunIntenseTrafficMaxDuration("grpc");
-}
+TEST(DistBenchTestSequencer, TestRunTestSequenceStream) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(4));
 
-TEST(DistBenchTestSequencer, RunIntenseTrafficMaxDurationGrpcAsyncCallback) {
-  RunIntenseTrafficMaxDuration("grpc_async_callback");
+  TestSequence test_sequence;
+  test_sequence.mutable_tests_setting()->set_max_concurrent_tests(2);
+  // The second test is done first, but streamed after the first one:
+  AddTimedPingTest(&test_sequence, "first", 2000);
+  AddTimedPingTest(&test_sequence, "second", 500);
+  AddTimedPingTest(&test_sequence, "third", 500);
+
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  auto reader =
+      tester.test_sequencer_stub->RunTestSequenceStream(context.get(),
+                                                        test_sequence);
+  std::vector<std::string> names;
+  TestResult test_result;
+  while (reader->Read(&test_result)) {
+    names.push_back(test_result.traffic_config().name());
+    EXPECT_EQ(test_result.service_logs().instance_logs_size(), 1);
+  }
+  ASSERT_OK(reader->Finish());
+  EXPECT_EQ(names, (std::vector<std::string>{"first", "second", "third"}));
 }
 
-TEST(DistBenchTestSequencer, RunIntenseTrafficMaxIterationGrpc) {
-  RunIntenseTrafficMaxIteration("grpc");
+TEST(DistBenchTestSequencer, TestConcurrentTestsIsolation) {
+  // There are enough nodes for both tests, but all in the same rack:
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(
+      4, {"rack=r0", "rack=r0,zone=z0", "rack=r0", "zone=z1,rack=r0"}));
+
+  TestSequence test_sequence;
+  test_sequence.mutable_tests_setting()->set_max_concurrent_tests(2);
+  test_sequence.mutable_tests_setting()->add_isolation_attributes("rack");
+  AddTimedPingTest(&test_sequence, "first", 2000);
+  AddTimedPingTest(&test_sequence, "second", 2000);
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  absl::Time start = absl::Now();
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  absl::Duration elapsed = absl::Now() - start;
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 2);
+  EXPECT_EQ(results.test_results(0).traffic_config().name(), "first");
+  EXPECT_EQ(results.test_results(1).traffic_config().name(), "second");
+  // The tests ran one after the other, and would have taken about 2s
+  // together otherwise:
+  EXPECT_GE(elapsed, absl::Milliseconds(3500));
 }
 
-TEST(DistBenchTestSequencer, RunIntenseTrafficMaxIterationGrpcAsyncCallback) {
-  RunIntenseTrafficMaxIteration("grpc_async_callback");
+// Searches with a step that is sustainable up to a load of threshold.
+std::vector<double> SearchSteps(const ThroughputSearch& search,
+                                bool integer_load, double threshold,
+                                std::optional<double>* max_load) {
+  std::vector<double> steps;
+  auto maybe_load = SearchMaxSustainableLoad(
+      search, integer_load, [&](double load) -> absl::StatusOr<bool> {
+        steps.push_back(load);
+        return load <= threshold;
+      });
+  EXPECT_TRUE(maybe_load.ok()) << maybe_load.status();
+  if (maybe_load.ok()) *max_load = *maybe_load;
+  return steps;
 }
 
-TEST(DistBenchTestSequencer, RunIntenseTrafficMaxDurationMaxIterationGrpc) {
-  RunIntenseTrafficMaxDurationMaxIteration("grpc");
+TEST(ThroughputSearch, BinarySearch) {
+  ThroughputSearch search;
+  search.set_min_load(100);
+  search.set_max_load(1'000'000);
+  search.set_precision(0.01);
+  std::optional<double> max_load;
+  auto steps = SearchSteps(search, /*integer_load=*/false, 12345, &max_load);
+  ASSERT_TRUE(max_load.has_value());
+  EXPECT_LE(*max_load, 12345);
+  EXPECT_GT(*max_load, 12345 / 1.01);
+  ASSERT_GE(steps.size(), 3);
+  EXPECT_EQ(steps[0], 100);
+  EXPECT_EQ(steps[1], 1'000'000);
+  EXPECT_LE(steps.size(), search.max_steps());
 }
 
-TEST(DistBenchTestSequencer,
-     RunIntenseTrafficMaxDurationMaxIterationGrpcAsyncCallback) {
-  RunIntenseTrafficMaxDurationMaxIteration("grpc_async_callback");
+TEST(ThroughputSearch, BinarySearchIntegerLoad) {
+  ThroughputSearch search;
+  search.set_min_load(1);
+  search.set_max_load(64);
+  std::optional<double> max_load;
+  auto steps = SearchSteps(search, /*integer_load=*/true, 37, &max_load);
+  ASSERT_TRUE(max_load.has_value());
+  EXPECT_EQ(*max_load, 37);
+  for (double load : steps) {
+    EXPECT_EQ(load, std::floor(load));
+  }
 }
 
-#ifdef WITH_MERCURY
-TEST(DistBenchTestSequencer, RunIntenseTrafficMaxDurationMercury) {
-  RunIntenseTrafficMaxDuration("mercury");
+TEST(ThroughputSearch, RampSearch) {
+  ThroughputSearch search;
+  search.set_strategy("ramp");
+  search.set_ramp_factor(2);
+  search.set_min_load(10);
+  search.set_max_load(1000);
+  std::optional<double> max_load;
+  auto steps = SearchSteps(search, /*integer_load=*/false, 100, &max_load);
+  ASSERT_TRUE(max_load.has_value());
+  EXPECT_EQ(*max_load, 80);
+  EXPECT_EQ(steps, (std::vector<double>{10, 20, 40, 80, 160}));
+
+  // The last step is capped at max_load:
+  steps = SearchSteps(search, /*integer_load=*/false, 5000, &max_load);
+  EXPECT_EQ(*max_load, 1000);
+  EXPECT_EQ(steps.back(), 1000);
 }
 
-TEST(DistBenchTestSequencer, RunIntenseTrafficMaxIterationMercury) {
-  RunIntenseTrafficMaxIteration("mercury");
+TEST(ThroughputSearch, NotSustainableAtMinLoad) {
+  ThroughputSearch search;
+  search.set_min_load(10);
+  search.set_max_load(1000);
+  std::optional<double> max_load = 1;
+  auto steps = SearchSteps(search, /*integer_load=*/false, 5, &max_load);
+  EXPECT_FALSE(max_load.has_value());
+  EXPECT_EQ(steps, (std::vector<double>{10}));
 }
 
-TEST(DistBenchTestSequencer, RunIntenseTrafficMaxDurationMaxIterationMercury) {
-  RunIntenseTrafficMaxDurationMaxIteration("mercury");
+TEST(ThroughputSearch, InvalidSearch) {
+  ThroughputSearch search;
+  search.set_strategy("random");
+  auto run_step = [](double load) -> absl::StatusOr<bool> { return true; };
+  EXPECT_FALSE(SearchMaxSustainableLoad(search, false, run_step).ok());
+  search.set_strategy("ramp");
+  search.set_ramp_factor(1);
+  EXPECT_FALSE(SearchMaxSustainableLoad(search, false, run_step).ok());
+  search.set_strategy("binary");
+  search.set_min_load(10);
+  search.set_max_load(5);
+  EXPECT_FALSE(SearchMaxSustainableLoad(search, false, run_step).ok());
 }
-#endif
 
-struct TestSequenceParams {
-  int nb_cliques = 2;
-  bool open_loop = true;
-  std::string activity_name = "";
-  std::string activity_name_2 = "";
-  std::string activity_func = "";
-  std::string activity_func_2 = "";
-  bool duplicate_activity_config = false;
-  bool activity_with_same_config = false;
-  bool invalid_config = false;
-  int array_size = 0;
-  int max_iteration_count = -1;
-};
+// A step result where each of the client_instances sent 100 RPCs of rpc 0
+// over one second.
+TestResult ThroughputSearchStepResult(int client_instances) {
+  TestResult result;
+  for (int i = 0; i < client_instances; ++i) {
+    AtomicLatencyHistogram histogram;
+    for (int j = 0; j < 100; ++j) {
+      histogram.Record(1'000'000, 16, 16, 1'000'000'000 + j * 10'000'000);
+    }
+    auto& instance_log =
+        (*result.mutable_service_logs()
+              ->mutable_instance_logs())[absl::StrCat("s1/", i)];
+    *(*(*instance_log.mutable_peer_logs())["s2/0"].mutable_rpc_logs())[0]
+         .mutable_latency_histogram() = histogram.ToProto();
+  }
+  return result;
+}
 
-void AddActivity(DistributedSystemDescription* test, ActionList* action_list,
-                 std::string activity_name, std::string activity_func,
-                 TestSequenceParams params) {
-  auto activity_config = absl::StrCat(activity_name, "_Config");
+TEST(ThroughputSearch, EvaluateStepScalesLoadByClientInstances) {
+  ThroughputSearch search;
+  ThroughputSearchStep step;
+  // Three clients each sending ~100 RPCs/s sustain a load of 100 each:
+  step.set_load(100);
+  EvaluateThroughputSearchStep(ThroughputSearchStepResult(3), 0, search,
+                               /*open_loop=*/true, /*client_instances=*/3, "",
+                               &step);
+  EXPECT_GT(step.achieved_qps(), 290);
+  EXPECT_TRUE(step.sustainable()) << step.DebugString();
+
+  // But not a load of 200 each, although together they exceed 200 RPCs/s:
+  step.Clear();
+  step.set_load(200);
+  EvaluateThroughputSearchStep(ThroughputSearchStepResult(3), 0, search,
+                               /*open_loop=*/true, /*client_instances=*/3, "",
+                               &step);
+  EXPECT_FALSE(step.sustainable());
+  EXPECT_NE(step.reason().find("3 client instances"), std::string::npos)
+      << step.reason();
+
+  // Closed loop loads are not rates:
+  step.Clear();
+  step.set_load(200);
+  EvaluateThroughputSearchStep(ThroughputSearchStepResult(3), 0, search,
+                               /*open_loop=*/false, /*client_instances=*/3, "",
+                               &step);
+  EXPECT_TRUE(step.sustainable()) << step.DebugString();
+}
 
-  // Add activity-action to action list.
-  action_list->add_action_names(activity_name);
-  if (params.activity_with_same_config)
-    action_list->add_action_names(activity_name + "_duplicate");
+TEST(DistBenchTestSequencer, TestThroughputSearch) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
 
-  if (activity_name == "unknown_activity") return;
+  TestSequence test_sequence;
+  AddTimedPingTest(&test_sequence, "search", 500);
+  auto* search = test_sequence.mutable_tests(0)->mutable_throughput_search();
+  search->set_action_name("s1/ping");
+  search->set_max_p99_latency_ns(1'000'000'000);
+  search->set_min_load(20);
+  search->set_max_load(200);
 
-  // Add the description of activity.
-  auto a = test->add_actions();
-  a->set_name(activity_name);
-  a->set_activity_config_name(activity_config);
-  if (params.max_iteration_count != -1) {
-    a->mutable_iterations()->set_max_iteration_count(
-        params.max_iteration_count);
-  } else {
-    a->mutable_iterations()->set_max_duration_us(600'000'000);
-  }
-  if (params.activity_with_same_config) {
-    auto a = test->add_actions();
-    a->set_name(activity_name + "_duplicate");
-    a->set_activity_config_name(activity_config);
-    a->mutable_iterations()->set_max_duration_us(600'000'000);
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  ASSERT_TRUE(test_result.has_throughput_search_result());
+  const auto& search_result = test_result.throughput_search_result();
+  // Both ends of the range are sustainable:
+  ASSERT_EQ(search_result.steps_size(), 2) << search_result.DebugString();
+  EXPECT_EQ(search_result.steps(0).load(), 20);
+  EXPECT_EQ(search_result.steps(1).load(), 200);
+  EXPECT_EQ(search_result.max_sustainable_load(), 200);
+  EXPECT_GT(search_result.max_sustainable_qps(), 180);
+  // The reported result is the one of the highest load:
+  EXPECT_EQ(test_result.service_logs().instance_logs_size(), 1);
+  EXPECT_TRUE(test_result.traffic_config().has_throughput_search());
+  bool found_summary = false;
+  for (const auto& line : test_result.log_summary()) {
+    if (line.find("max sustainable load: 200 ") != std::string::npos) {
+      found_summary = true;
+    }
   }
-
-  if (activity_name == "known_activity_unknown_config") return;
-
-  // Add the settings of activity.
-  auto* ac = test->add_activity_configs();
-  ac->set_name(activity_config);
-  AddActivitySettingStringTo(ac, "activity_func", activity_func);
-  if (params.invalid_config)
-    AddActivitySettingIntTo(ac, "array_size", -1);
-  else
-    AddActivitySettingIntTo(ac, "array_size", params.array_size);
+  EXPECT_TRUE(found_summary);
 }
 
-TestSequence GetCliqueTestSequence(const TestSequenceParams& params) {
-  int nb_cliques = params.nb_cliques;
-  bool open_loop = params.open_loop;
-  std::string activity_name = params.activity_name;
-  std::string activity_name_2 = params.activity_name_2;
-  std::string activity_func = params.activity_func;
-  std::string activity_func_2 = params.activity_func_2;
+TEST(DistBenchTestSequencer, TestThroughputSearchMultipleClients) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(4));
+
   TestSequence test_sequence;
-  auto* test = test_sequence.add_tests();
+  AddTimedPingTest(&test_sequence, "search", 500, /*client_count=*/3);
+  auto* search = test_sequence.mutable_tests(0)->mutable_throughput_search();
+  search->set_action_name("s1/ping");
+  search->set_max_p99_latency_ns(1'000'000'000);
+  search->set_min_load(20);
+  search->set_max_load(100);
 
-  auto* lo_opts = test->add_protocol_driver_options();
-  lo_opts->set_name("lo_opts");
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& search_result =
+      results.test_results(0).throughput_search_result();
+  ASSERT_EQ(search_result.steps_size(), 2) << search_result.DebugString();
+  EXPECT_EQ(search_result.max_sustainable_load(), 100);
+  // The load is the rate of each of the 3 clients:
+  EXPECT_GT(search_result.max_sustainable_qps(), 270);
+}
+
+TEST(DistBenchTestSequencer, TestThroughputSearchNotSustainable) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  AddTimedPingTest(&test_sequence, "search", 500);
+  auto* search = test_sequence.mutable_tests(0)->mutable_throughput_search();
+  search->set_action_name("s1/ping");
+  // No RPC can meet this:
+  search->set_max_p99_latency_ns(1);
+  search->set_min_load(20);
+  search->set_max_load(200);
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& search_result =
+      results.test_results(0).throughput_search_result();
+  ASSERT_EQ(search_result.steps_size(), 1);
+  EXPECT_FALSE(search_result.steps(0).sustainable());
+  EXPECT_FALSE(search_result.has_max_sustainable_load());
+}
+
+TEST(DistBenchTestSequencer, TestThroughputSearchUnknownAction) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  AddTimedPingTest(&test_sequence, "search", 500);
+  auto* search = test_sequence.mutable_tests(0)->mutable_throughput_search();
+  search->set_action_name("s1/pong");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  EXPECT_EQ(status.error_code(), grpc::ABORTED);
+  EXPECT_NE(status.error_message().find("action_name s1/pong"),
+            std::string::npos)
+      << status.error_message();
+}
+
+TEST(DistBenchTestSequencer, TestSetupTimings) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(5));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("grpc");
+  // The connections to the servers are set up one at a time:
+  (*test->mutable_attributes())["connection_setup_parallelism"] = "1";
+  auto* s1 = test->add_services();
+  s1->set_name("s1");
+  s1->set_count(1);
+  auto* s2 = test->add_services();
+  s2->set_name("s2");
+  s2->set_count(4);
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("s1");
+  l1->add_action_names("s1/ping");
+
+  auto a1 = test->add_actions();
+  a1->set_name("s1/ping");
+  a1->set_rpc_name("echo");
+  a1->mutable_iterations()->set_max_iteration_count(10);
+
+  auto* r1 = test->add_rpc_descriptions();
+  r1->set_name("echo");
+  r1->set_client("s1");
+  r1->set_server("s2");
+  r1->set_fanout_filter("all");
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("echo");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_results = results.test_results(0);
+  ASSERT_EQ(test_results.service_logs().instance_logs_size(), 1);
+  const auto& instance_log =
+      test_results.service_logs().instance_logs().begin()->second;
+  EXPECT_EQ(instance_log.peer_logs_size(), 4);
+  const auto& setup_timings = test_results.setup_timings();
+  EXPECT_GT(setup_timings.placement_ns(), 0);
+  EXPECT_GT(setup_timings.configure_nodes_ns(), 0);
+  EXPECT_GT(setup_timings.introduce_peers_ns(), 0);
+}
+
+TEST(DistBenchTestSequencer, TestReuseEngines) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  test_sequence.mutable_tests_setting()->set_reuse_engines(true);
+  auto add_test = [&](std::string client, std::string server,
+                      int iterations) {
+    auto* test = test_sequence.add_tests();
+    test->set_default_protocol("grpc");
+    auto* s1 = test->add_services();
+    s1->set_name("s1");
+    s1->set_count(1);
+    auto* s2 = test->add_services();
+    s2->set_name("s2");
+    s2->set_count(1);
+
+    auto* l1 = test->add_action_lists();
+    l1->set_name(client);
+    l1->add_action_names("ping");
+
+    auto a1 = test->add_actions();
+    a1->set_name("ping");
+    a1->set_rpc_name("echo");
+    a1->mutable_iterations()->set_max_iteration_count(iterations);
+
+    auto* r1 = test->add_rpc_descriptions();
+    r1->set_name("echo");
+    r1->set_client(client);
+    r1->set_server(server);
+
+    auto* l2 = test->add_action_lists();
+    l2->set_name("echo");
+  };
+  add_test("s1", "s2", 10);
+  // Only the traffic changes, so the engines are reused:
+  add_test("s1", "s2", 20);
+  // The RPCs go the other way, so new connections are needed:
+  add_test("s2", "s1", 30);
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 3);
+  auto rpc_count = [&](int test, std::string client, std::string server) {
+    const auto& instance_logs =
+        results.test_results(test).service_logs().instance_logs();
+    auto it = instance_logs.find(client);
+    if (it == instance_logs.end()) return -1;
+    auto it2 = it->second.peer_logs().find(server);
+    if (it2 == it->second.peer_logs().end()) return -1;
+    return it2->second.rpc_logs().at(0).successful_rpc_samples_size();
+  };
+  EXPECT_EQ(rpc_count(0, "s1/0", "s2/0"), 10);
+  EXPECT_EQ(rpc_count(1, "s1/0", "s2/0"), 20);
+  EXPECT_EQ(rpc_count(2, "s2/0", "s1/0"), 30);
+
+  auto endpoint = [&](int test, std::string service) {
+    return results.test_results(test)
+        .placement()
+        .service_endpoints()
+        .at(service)
+        .endpoint_address();
+  };
+  EXPECT_EQ(endpoint(0, "s1/0"), endpoint(1, "s1/0"));
+  EXPECT_EQ(endpoint(0, "s2/0"), endpoint(1, "s2/0"));
+}
+
+TEST(DistBenchTestSequencer, TestColumnarRpcSamples) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("grpc");
+  auto* s1 = test->add_services();
+  s1->set_name("s1");
+  s1->set_count(1);
+  auto* s2 = test->add_services();
+  s2->set_name("s2");
+  s2->set_count(1);
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("s1");
+  l1->add_action_names("s1/ping");
+  l1->set_columnar_rpc_samples(true);
+
+  auto a1 = test->add_actions();
+  a1->set_name("s1/ping");
+  a1->set_rpc_name("echo");
+  a1->mutable_iterations()->set_max_iteration_count(500);
+  a1->mutable_iterations()->set_warmup_iterations(100);
+
+  auto* r1 = test->add_rpc_descriptions();
+  r1->set_name("echo");
+  r1->set_client("s1");
+  r1->set_server("s2");
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("echo");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& instance_logs =
+      results.test_results(0).service_logs().instance_logs();
+  ASSERT_EQ(instance_logs.count("s1/0"), 1);
+  const auto& peer_logs = instance_logs.at("s1/0").peer_logs();
+  ASSERT_EQ(peer_logs.count("s2/0"), 1);
+  const auto& rpc_log = peer_logs.at("s2/0").rpc_logs().at(0);
+  EXPECT_EQ(rpc_log.successful_rpc_samples_size(), 0);
+  EXPECT_EQ(rpc_log.failed_rpc_samples_size(), 0);
+  ASSERT_GT(rpc_log.sample_columns_size(), 0);
+
+  int64_t nb_samples = 0;
+  int64_t nb_warmup_samples = 0;
+  for (const auto& columns : rpc_log.sample_columns()) {
+    // Each block is in completion order:
+    int64_t previous_end_timestamp_ns = 0;
+    RpcSampleColumnsReader reader(columns);
+    ColumnarSample sample;
+    while (reader.Next(&sample)) {
+      EXPECT_TRUE(sample.success);
+      EXPECT_GT(sample.latency_ns, 0);
+      EXPECT_GE(sample.start_timestamp_ns + sample.latency_ns,
+                previous_end_timestamp_ns);
+      previous_end_timestamp_ns = sample.start_timestamp_ns + sample.latency_ns;
+      ++nb_samples;
+      nb_warmup_samples += sample.warmup;
+    }
+    ASSERT_OK(reader.status());
+  }
+  EXPECT_EQ(nb_samples, 500);
+  EXPECT_EQ(nb_warmup_samples, 100);
+  const auto& log_summary = results.test_results(0).log_summary();
+  ASSERT_GT(log_summary.size(), 1);
+  EXPECT_NE(log_summary[1].find("echo: N: 400 "), std::string::npos)
+      << log_summary[1];
+}
+
+TEST(DistBenchTestSequencer, TestWarmupSampling) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(3));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("grpc");
+  auto* s1 = test->add_services();
+  s1->set_name("s1");
+  s1->set_count(1);
+  auto* s2 = test->add_services();
+  s2->set_name("s2");
+  s2->set_count(1);
+  auto* s3 = test->add_services();
+  s3->set_name("s3");
+  s3->set_count(1);
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("s1");
+  l1->add_action_names("s1/ping");
+  l1->set_max_rpc_samples(1000);
+
+  auto a1 = test->add_actions();
+  a1->set_name("s1/ping");
+  a1->set_rpc_name("echo_and_forward");
+  a1->mutable_iterations()->set_max_parallel_iterations(100);
+  a1->mutable_iterations()->set_max_iteration_count(3000);
+  a1->mutable_iterations()->set_warmup_iterations(1000);
+
+  auto* r1 = test->add_rpc_descriptions();
+  r1->set_name("echo_and_forward");
+  r1->set_client("s1");
+  r1->set_server("s2");
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("echo_and_forward");
+  l2->add_action_names("s2/async_ping");
+
+  auto a2 = test->add_actions();
+  a2->set_name("s2/async_ping");
+  a2->set_action_list_name("async_echo_action_list");
+
+  auto* l3 = test->add_action_lists();
+  l3->set_name("async_echo_action_list");
+  l3->add_action_names("s2/ping");
+
+  auto a3 = test->add_actions();
+  a3->set_name("s2/ping");
+  a3->set_rpc_name("async_echo");
+
+  auto* r2 = test->add_rpc_descriptions();
+  r2->set_name("async_echo");
+  r2->set_client("s2");
+  r2->set_server("s3");
+
+  auto* l4 = test->add_action_lists();
+  l4->set_name("async_echo");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/200);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  LOG(INFO) << status.error_message();
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  ASSERT_EQ(results.test_results(0).service_logs().instance_logs_size(), 2);
+  auto it = results.test_results(0).service_logs().instance_logs().find("s1/0");
+  ASSERT_NE(it, results.test_results(0).service_logs().instance_logs().end());
+  ASSERT_EQ(it->second.peer_logs_size(), 1);
+  auto it2 = it->second.peer_logs().begin();
+  EXPECT_EQ(it2->first, "s2/0");
+  ASSERT_EQ(it2->second.rpc_logs_size(), 1);
+  auto it3 = it2->second.rpc_logs().begin();
+  EXPECT_EQ(it3->first, 0);
+  EXPECT_EQ(it3->second.successful_rpc_samples_size(), 1000);
+  EXPECT_EQ(it3->second.failed_rpc_samples_size(), 0);
+  int warmup_samples = 0;
+  for (const auto& sample : it3->second.successful_rpc_samples()) {
+    if (sample.warmup()) {
+      warmup_samples++;
+    }
+  }
+  // Hypergeometric distribution total population=3000
+  //                             warmup population=1000
+  //                             samples=1000
+  // => Expected value is 333
+  // => Probability less than 1 in a million this fails:
+  EXPECT_GT(warmup_samples, 275);
+  EXPECT_LT(warmup_samples, 392);
+
+  it = results.test_results(0).service_logs().instance_logs().find("s2/0");
+  ASSERT_NE(it, results.test_results(0).service_logs().instance_logs().end());
+  ASSERT_EQ(it->second.peer_logs_size(), 1);
+  it2 = it->second.peer_logs().begin();
+  EXPECT_EQ(it2->first, "s3/0");
+  ASSERT_EQ(it2->second.rpc_logs_size(), 1);
+  it3 = it2->second.rpc_logs().begin();
+  EXPECT_EQ(it3->first, 1);
+  EXPECT_EQ(it3->second.successful_rpc_samples_size(), 3000);
+  EXPECT_EQ(it3->second.failed_rpc_samples_size(), 0);
+  warmup_samples = 0;
+  for (const auto& sample : it3->second.successful_rpc_samples()) {
+    if (sample.warmup()) {
+      warmup_samples++;
+    }
+  }
+  EXPECT_EQ(warmup_samples, 1000);
+}
+
+TEST(DistBenchTestSequencer, TestActionDependencies) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("grpc");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(1);
+
+  auto* rpc_a = test->add_rpc_descriptions();
+  rpc_a->set_name("rpc_a");
+  rpc_a->set_client("client");
+  rpc_a->set_server("server");
+  auto* rpc_b = test->add_rpc_descriptions();
+  rpc_b->set_name("rpc_b");
+  rpc_b->set_client("client");
+  rpc_b->set_server("server");
+
+  // first -> second (open loop) -> third, with third also depending on
+  // first directly:
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("first");
+  l1->add_action_names("second");
+  l1->add_action_names("third");
+
+  auto* first = test->add_actions();
+  first->set_name("first");
+  first->set_rpc_name("rpc_a");
+  first->mutable_iterations()->set_max_iteration_count(10);
+
+  auto* second = test->add_actions();
+  second->set_name("second");
+  second->set_rpc_name("rpc_b");
+  second->add_dependencies("first");
+  second->mutable_iterations()->set_max_iteration_count(20);
+  second->mutable_iterations()->set_open_loop_interval_ns(1'000'000);
+
+  auto* third = test->add_actions();
+  third->set_name("third");
+  third->set_rpc_name("rpc_a");
+  third->add_dependencies("first");
+  third->add_dependencies("second");
+  third->mutable_iterations()->set_max_iteration_count(5);
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("rpc_a");
+  auto* l3 = test->add_action_lists();
+  l3->set_name("rpc_b");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  auto it = results.test_results(0).service_logs().instance_logs().find(
+      "client/0");
+  ASSERT_NE(it, results.test_results(0).service_logs().instance_logs().end());
+  ASSERT_EQ(it->second.peer_logs_size(), 1);
+  const auto& rpc_logs = it->second.peer_logs().begin()->second.rpc_logs();
+  ASSERT_EQ(rpc_logs.size(), 2);
+  const auto& a_samples = rpc_logs.at(0).successful_rpc_samples();
+  const auto& b_samples = rpc_logs.at(1).successful_rpc_samples();
+  ASSERT_EQ(a_samples.size(), 15);
+  ASSERT_EQ(b_samples.size(), 20);
+
+  // Each action only starts once all of its dependencies have finished:
+  std::vector<RpcSample> a(a_samples.begin(), a_samples.end());
+  std::sort(a.begin(), a.end(), [](const RpcSample& x, const RpcSample& y) {
+    return x.start_timestamp_ns() < y.start_timestamp_ns();
+  });
+  int64_t first_end = 0;
+  for (int i = 0; i < 10; ++i) {
+    first_end =
+        std::max(first_end, a[i].start_timestamp_ns() + a[i].latency_ns());
+  }
+  int64_t second_start = std::numeric_limits<int64_t>::max();
+  int64_t second_end = 0;
+  for (const auto& sample : b_samples) {
+    second_start = std::min(second_start, sample.start_timestamp_ns());
+    second_end = std::max(second_end,
+                          sample.start_timestamp_ns() + sample.latency_ns());
+  }
+  EXPECT_LE(first_end, second_start);
+  EXPECT_LE(second_end, a[10].start_timestamp_ns());
+  // The open loop iterations are paced 1ms apart:
+  EXPECT_GE(second_end - second_start, 19'000'000);
+}
+
+TEST(DistBenchTestSequencer, TestExponentialOpenLoop) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("grpc");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(1);
+
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_max_iteration_count(1000);
+  action->mutable_iterations()->set_open_loop_interval_ns(100'000);
+  action->mutable_iterations()->set_open_loop_interval_distribution(
+      "exponential");
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  auto it = test_result.service_logs().instance_logs().find("client/0");
+  ASSERT_NE(it, test_result.service_logs().instance_logs().end());
+
+  auto pacing_it = it->second.pacing_logs().find("run_queries");
+  ASSERT_NE(pacing_it, it->second.pacing_logs().end());
+  EXPECT_EQ(pacing_it->second.iterations(), 1000);
+  bool has_pacing_summary = false;
+  for (const auto& line : test_result.log_summary()) {
+    has_pacing_summary |= line == "Open loop pacing summary:";
+  }
+  EXPECT_TRUE(has_pacing_summary);
+
+  ASSERT_EQ(it->second.peer_logs_size(), 1);
+  const auto& rpc_logs = it->second.peer_logs().begin()->second.rpc_logs();
+  const auto& samples = rpc_logs.at(0).successful_rpc_samples();
+  ASSERT_EQ(samples.size(), 1000);
+  std::vector<int64_t> starts;
+  for (const auto& sample : samples) {
+    starts.push_back(sample.start_timestamp_ns());
+  }
+  std::sort(starts.begin(), starts.end());
+  // The mean interval is 100us, so the 999 intervals add up to ~100ms,
+  // and ~40% of them are shorter than 50us:
+  EXPECT_GT(starts.back() - starts.front(), 80'000'000);
+  int short_intervals = 0;
+  for (size_t i = 1; i < starts.size(); ++i) {
+    short_intervals += starts[i] - starts[i - 1] < 50'000;
+  }
+  EXPECT_GT(short_intervals, 200);
+}
+
+// An open loop that cannot keep to its schedule reports its slip, and
+// measures the latency of its RPCs from when they were due:
+TEST(DistBenchTestSequencer, OpenLoopBehindSchedule) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("grpc");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(1);
+
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_max_iteration_count(2000);
+  action->mutable_iterations()->set_open_loop_interval_ns(1'000);
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  auto it = test_result.service_logs().instance_logs().find("client/0");
+  ASSERT_NE(it, test_result.service_logs().instance_logs().end());
+
+  // Nothing can start an RPC every microsecond:
+  auto pacing_it = it->second.pacing_logs().find("run_queries");
+  ASSERT_NE(pacing_it, it->second.pacing_logs().end());
+  EXPECT_GT(pacing_it->second.behind_schedule_iterations(), 0);
+
+  ASSERT_EQ(it->second.peer_logs_size(), 1);
+  const auto& rpc_logs = it->second.peer_logs().begin()->second.rpc_logs();
+  const auto& samples = rpc_logs.at(0).successful_rpc_samples();
+  ASSERT_EQ(samples.size(), 2000);
+  int64_t max_latency = 0;
+  for (const auto& sample : samples) {
+    // Each RPC stands for one interval of the schedule:
+    EXPECT_EQ(sample.latency_weight(), 1'000);
+    max_latency = std::max(max_latency, sample.latency_ns());
+  }
+  // The latest RPC waited for the pacer before it was even sent:
+  EXPECT_GE(max_latency, pacing_it->second.max_slip_ns());
+  EXPECT_NE(std::find(test_result.log_summary().begin(),
+                      test_result.log_summary().end(),
+                      "RPC latency summary (weighted by latency_weight):"),
+            test_result.log_summary().end());
+}
+
+TEST(DistBenchTestSequencer, UnknownOpenLoopIntervalDistribution) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(1));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("client");
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_open_loop_interval_ns(100'000);
+  action->mutable_iterations()->set_open_loop_interval_distribution(
+      "poisson");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  EXPECT_FALSE(status.ok());
+}
+
+void RunConnectionChurn(std::string_view protocol_name,
+                        std::string_view client_type = "") {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(3));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  auto* pd_options = test->add_protocol_driver_options();
+  pd_options->set_name("churning");
+  pd_options->set_protocol_name(std::string(protocol_name));
+  pd_options->set_netdev_name("lo");
+  if (!client_type.empty()) {
+    auto* client_type_setting = pd_options->add_client_settings();
+    client_type_setting->set_name("client_type");
+    client_type_setting->set_string_value(std::string(client_type));
+  }
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  client->set_protocol_driver_options_name("churning");
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(2);
+  server->set_protocol_driver_options_name("churning");
+
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+  rpc->set_connection_churn_rate(10);
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_max_duration_us(500'000);
+  action->mutable_iterations()->set_max_parallel_iterations(10);
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  auto it = test_result.service_logs().instance_logs().find("client/0");
+  ASSERT_NE(it, test_result.service_logs().instance_logs().end());
+
+  // Each connection is re-established every 100ms, i.e. ~10 reconnects in
+  // 500ms, in turn:
+  auto churn_it = it->second.connection_churn_logs().find("ping");
+  ASSERT_NE(churn_it, it->second.connection_churn_logs().end());
+  const auto& reconnects = churn_it->second.reconnects();
+  EXPECT_GE(reconnects.size(), 4);
+  EXPECT_LE(reconnects.size(), 12);
+  std::set<std::string> peers;
+  for (const auto& reconnect : reconnects) {
+    peers.insert(reconnect.peer());
+    EXPECT_GT(reconnect.reconnect_latency_ns(), 0);
+  }
+  EXPECT_EQ(peers, std::set<std::string>({"server/0", "server/1"}));
+
+  // The RPCs complete on their old connections:
+  int64_t overlapping_rpcs = 0;
+  for (const auto& [peer_name, peer_log] : it->second.peer_logs()) {
+    const auto& rpc_log = peer_log.rpc_logs().at(0);
+    EXPECT_EQ(rpc_log.failed_rpc_samples_size(), 0);
+    overlapping_rpcs +=
+        rpc_log.reconnect_overlap_histogram().successful_rpc_count();
+  }
+  EXPECT_GT(overlapping_rpcs, 0);
+  bool has_churn_summary = false;
+  for (const auto& line : test_result.log_summary()) {
+    has_churn_summary |= line == "Connection churn summary:";
+  }
+  EXPECT_TRUE(has_churn_summary);
+}
+
+TEST(DistBenchTestSequencer, ConnectionChurnGrpcPolling) {
+  RunConnectionChurn("grpc", "polling");
+}
+
+TEST(DistBenchTestSequencer, ConnectionChurnGrpcCallback) {
+  RunConnectionChurn("grpc", "callback");
+}
+
+TEST(DistBenchTestSequencer, ConnectionChurnTcp) { RunConnectionChurn("tcp"); }
+
+// The shm driver has no connection to re-establish:
+TEST(DistBenchTestSequencer, ConnectionChurnUnsupported) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  auto* pd_options = test->add_protocol_driver_options();
+  pd_options->set_name("shm");
+  pd_options->set_protocol_name("shm");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  client->set_protocol_driver_options_name("shm");
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(1);
+  server->set_protocol_driver_options_name("shm");
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+  rpc->set_connection_churn_rate(10);
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  test->add_action_lists()->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  EXPECT_FALSE(status.ok());
+  EXPECT_NE(status.error_message().find("cannot churn"), std::string::npos)
+      << status.error_message();
+}
+
+TEST(DistBenchTestSequencer, NegativeConnectionChurnRate) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(1));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("client");
+  rpc->set_connection_churn_rate(-1);
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  EXPECT_FALSE(status.ok());
+}
+
+TEST(DistBenchTestSequencer, RpcBatching) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(3));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("grpc");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(2);
+
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+  rpc->set_fanout_filter("round_robin");
+  rpc->set_batch_size(4);
+  rpc->set_batch_delay_us(1000);
+  rpc->set_record_server_processing_time(true);
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_max_iteration_count(1000);
+  action->mutable_iterations()->set_max_parallel_iterations(16);
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  auto it = test_result.service_logs().instance_logs().find("client/0");
+  ASSERT_NE(it, test_result.service_logs().instance_logs().end());
+  ASSERT_EQ(it->second.peer_logs_size(), 2);
+
+  // Each RPC of a batch is logged on its own:
+  int64_t rpcs = 0;
+  int64_t batched_rpcs = 0;
+  int64_t batches = 0;
+  for (const auto& [peer_name, peer_log] : it->second.peer_logs()) {
+    const auto& rpc_log = peer_log.rpc_logs().at(0);
+    EXPECT_EQ(rpc_log.failed_rpc_samples_size(), 0);
+    rpcs += rpc_log.successful_rpc_samples_size();
+    for (const auto& sample : rpc_log.successful_rpc_samples()) {
+      EXPECT_TRUE(sample.has_server_processing_ns());
+    }
+    for (const auto& [size, count] : rpc_log.batch_sizes()) {
+      EXPECT_GE(size, 1);
+      EXPECT_LE(size, 4);
+      batched_rpcs += size * count;
+      batches += count;
+    }
+  }
+  EXPECT_EQ(rpcs, 1000);
+  EXPECT_EQ(batched_rpcs, 1000);
+  EXPECT_LT(batches, 1000);
+}
+
+TEST(DistBenchTestSequencer, InvalidBatchSize) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(1));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("client");
+  rpc->set_batch_size(0);
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  EXPECT_FALSE(status.ok());
+}
+
+// Every RPC takes two network delays and a server delay of virtual time, so
+// that 10s of traffic runs in much less.
+TEST(DistBenchTestSequencer, SimulatedClosedLoop) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("simulated");
+  auto* pd_options = test->add_protocol_driver_options();
+  pd_options->set_name("simulated_delays");
+  pd_options->set_protocol_name("simulated");
+  auto* setting = pd_options->add_server_settings();
+  setting->set_name("network_delay_ns");
+  setting->set_int64_value(1'000'000);
+  setting = pd_options->add_server_settings();
+  setting->set_name("server_delay_ns");
+  setting->set_int64_value(3'000'000);
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  client->set_protocol_driver_options_name("simulated_delays");
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(1);
+  server->set_protocol_driver_options_name("simulated_delays");
+
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_max_duration_us(10'000'000);
+  action->mutable_iterations()->set_max_parallel_iterations(2);
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  const absl::Time start = absl::Now();
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  EXPECT_LT(absl::Now() - start, absl::Seconds(5));
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  auto it = test_result.service_logs().instance_logs().find("client/0");
+  ASSERT_NE(it, test_result.service_logs().instance_logs().end());
+  ASSERT_EQ(it->second.peer_logs_size(), 1);
+  const auto& rpc_log =
+      it->second.peer_logs().begin()->second.rpc_logs().at(0);
+  EXPECT_EQ(rpc_log.failed_rpc_samples_size(), 0);
+  // Two RPCs at a time, 5ms each, for 10s:
+  EXPECT_GE(rpc_log.successful_rpc_samples_size(), 3990);
+  EXPECT_LE(rpc_log.successful_rpc_samples_size(), 4010);
+  for (const auto& sample : rpc_log.successful_rpc_samples()) {
+    ASSERT_EQ(sample.latency_ns(), 5'000'000);
+  }
+}
+
+// The open loop timers fire right on time in virtual time, and the network
+// delays follow their distribution.
+TEST(DistBenchTestSequencer, SimulatedOpenLoop) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("simulated");
+  auto* pd_options = test->add_protocol_driver_options();
+  pd_options->set_name("simulated_delays");
+  pd_options->set_protocol_name("simulated");
+  auto* distribution = pd_options->add_distribution_config();
+  distribution->set_name("network");
+  for (int delay_ns : {1'000'000, 2'000'000}) {
+    auto* pmf_point = distribution->add_pmf_points();
+    pmf_point->set_pmf(0.5);
+    pmf_point->add_data_points()->set_exact(delay_ns);
+  }
+  auto* setting = pd_options->add_server_settings();
+  setting->set_name("network_delay_distribution");
+  setting->set_string_value("network");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  client->set_protocol_driver_options_name("simulated_delays");
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(1);
+  server->set_protocol_driver_options_name("simulated_delays");
+
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_max_iteration_count(1000);
+  action->mutable_iterations()->set_open_loop_interval_ns(1'000'000);
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  auto it = test_result.service_logs().instance_logs().find("client/0");
+  ASSERT_NE(it, test_result.service_logs().instance_logs().end());
+
+  auto pacing_it = it->second.pacing_logs().find("run_queries");
+  ASSERT_NE(pacing_it, it->second.pacing_logs().end());
+  EXPECT_EQ(pacing_it->second.iterations(), 1000);
+  EXPECT_EQ(pacing_it->second.max_slip_ns(), 0);
+
+  ASSERT_EQ(it->second.peer_logs_size(), 1);
+  const auto& rpc_log =
+      it->second.peer_logs().begin()->second.rpc_logs().at(0);
+  ASSERT_EQ(rpc_log.successful_rpc_samples_size(), 1000);
+  std::map<int64_t, int> latency_counts;
+  for (const auto& sample : rpc_log.successful_rpc_samples()) {
+    ++latency_counts[sample.latency_ns()];
+  }
+  ASSERT_EQ(latency_counts.size(), 3);
+  EXPECT_GT(latency_counts[2'000'000], 150);
+  EXPECT_GT(latency_counts[3'000'000], 350);
+  EXPECT_GT(latency_counts[4'000'000], 150);
+}
+
+// The open loop iterations overlap and reuse each other's state, on a
+// fanout that changes size:
+TEST(DistBenchTestSequencer, SimulatedOpenLoopStochasticFanout) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(5));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("simulated");
+  auto* pd_options = test->add_protocol_driver_options();
+  pd_options->set_name("simulated_delays");
+  pd_options->set_protocol_name("simulated");
+  auto* setting = pd_options->add_server_settings();
+  setting->set_name("network_delay_ns");
+  setting->set_int64_value(3'000'000);
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  client->set_protocol_driver_options_name("simulated_delays");
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(4);
+  server->set_protocol_driver_options_name("simulated_delays");
+
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+  rpc->set_fanout_filter("stochastic{0.5:1,0.5:4}");
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_max_iteration_count(500);
+  action->mutable_iterations()->set_open_loop_interval_ns(1'000'000);
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  auto it = test_result.service_logs().instance_logs().find("client/0");
+  ASSERT_NE(it, test_result.service_logs().instance_logs().end());
+
+  int64_t sample_count = 0;
+  for (const auto& [peer_name, peer_log] : it->second.peer_logs()) {
+    const auto& rpc_log = peer_log.rpc_logs().at(0);
+    EXPECT_EQ(rpc_log.failed_rpc_samples_size(), 0);
+    for (const auto& sample : rpc_log.successful_rpc_samples()) {
+      EXPECT_EQ(sample.latency_ns(), 6'000'000);
+      // The iterations start on time, one interval after the prior one:
+      EXPECT_EQ(sample.latency_weight(), 1'000'000);
+      ++sample_count;
+    }
+  }
+  // Each iteration sends one or four RPCs:
+  EXPECT_GT(sample_count, 500);
+  EXPECT_LT(sample_count, 2000);
+  EXPECT_EQ((sample_count - 500) % 3, 0);
+}
+
+TEST(DistBenchTestSequencer, SimulatedUnknownDistribution) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(1));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  auto* pd_options = test->add_protocol_driver_options();
+  pd_options->set_name("simulated_delays");
+  pd_options->set_protocol_name("simulated");
+  auto* setting = pd_options->add_server_settings();
+  setting->set_name("server_delay_distribution");
+  setting->set_string_value("missing");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  client->set_protocol_driver_options_name("simulated_delays");
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  EXPECT_FALSE(status.ok());
+}
+
+// An activity limited only by its duration would never let virtual time
+// advance.
+TEST(DistBenchTestSequencer, SimulatedActivityWithoutMaxIterationCount) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(1));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_default_protocol("simulated");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("consume_cpu");
+  auto* action = test->add_actions();
+  action->set_name("consume_cpu");
+  action->set_activity_config_name("ConsumeCpuConfig");
+  action->mutable_iterations()->set_max_duration_us(1'000'000);
+  auto* ac = test->add_activity_configs();
+  ac->set_name("ConsumeCpuConfig");
+  AddActivitySettingStringTo(ac, "activity_func", "ConsumeCpu");
+  AddActivitySettingIntTo(ac, "array_size", 10);
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  EXPECT_FALSE(status.ok());
+  EXPECT_NE(status.error_message().find("max_iteration_count"),
+            std::string::npos)
+      << status.error_message();
+}
+
+TEST(DistBenchTestSequencer, PerfCounters) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_perf_counters("thread_role");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(1);
+
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_max_iteration_count(100);
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  const auto& node_perf_counters =
+      test_result.resource_usage_logs().node_perf_counters();
+  ASSERT_EQ(node_perf_counters.size(), 2);
+  for (const auto& [node, perf_counters] : node_perf_counters) {
+    if (perf_counters.has_error()) continue;
+    // The nodes of the tester share its process:
+    EXPECT_TRUE(perf_counters.node_threads_only());
+    EXPECT_TRUE(perf_counters.process().has_context_switches());
+    EXPECT_FALSE(perf_counters.thread_roles().empty());
+  }
+  EXPECT_NE(std::find(test_result.log_summary().begin(),
+                      test_result.log_summary().end(),
+                      "Hardware counter summary:"),
+            test_result.log_summary().end());
+}
+
+TEST(DistBenchTestSequencer, UnknownPerfCountersMode) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(1));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_perf_counters("per_cpu");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  EXPECT_FALSE(status.ok());
+}
+
+TEST(DistBenchTestSequencer, WaitTimes) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  auto* pd_options = test->add_protocol_driver_options();
+  pd_options->set_name("spinning_tcp");
+  pd_options->set_protocol_name("tcp");
+  pd_options->set_netdev_name("lo");
+  auto* setting = pd_options->add_server_settings();
+  setting->set_name("reactor_wait_policy");
+  setting->set_string_value("spin");
+  setting = pd_options->add_server_settings();
+  setting->set_name("reactor_wait_spin_budget");
+  setting->set_int64_value(1000);
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  client->set_protocol_driver_options_name("spinning_tcp");
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(1);
+  server->set_protocol_driver_options_name("spinning_tcp");
+
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_max_iteration_count(100);
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& node_wait_times =
+      results.test_results(0).resource_usage_logs().node_wait_times();
+  ASSERT_EQ(node_wait_times.size(), 2);
+  for (const auto& [node, wait_times] : node_wait_times) {
+    auto it = wait_times.thread_roles().find("TcpReactor");
+    ASSERT_NE(it, wait_times.thread_roles().end()) << node;
+    EXPECT_GT(it->second.spin_wakeups() + it->second.blocked_waits(), 0);
+  }
+}
+
+TEST(DistBenchTestSequencer, InvalidWaitPolicy) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(1));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  auto* pd_options = test->add_protocol_driver_options();
+  pd_options->set_name("sleeping_tcp");
+  pd_options->set_protocol_name("tcp");
+  pd_options->set_netdev_name("lo");
+  auto* setting = pd_options->add_server_settings();
+  setting->set_name("reactor_wait_policy");
+  setting->set_string_value("sleep");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  client->set_protocol_driver_options_name("sleeping_tcp");
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  EXPECT_FALSE(status.ok());
+}
+
+TEST(DistBenchTestSequencer, HistogramsOnlyResults) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_results_level("histograms_only");
+  auto& bundle = (*test->mutable_node_service_bundles())["node0"];
+  bundle.add_services("client/0");
+  bundle.add_services("client/1");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(2);
+  auto* server = test->add_services();
+  server->set_name("server");
+  server->set_count(1);
+
+  auto* rpc = test->add_rpc_descriptions();
+  rpc->set_name("ping");
+  rpc->set_client("client");
+  rpc->set_server("server");
+
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+  l1->add_action_names("run_queries");
+
+  auto* action = test->add_actions();
+  action->set_name("run_queries");
+  action->set_rpc_name("ping");
+  action->mutable_iterations()->set_max_iteration_count(50);
+
+  auto* l2 = test->add_action_lists();
+  l2->set_name("ping");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results_size(), 1);
+  const auto& test_result = results.test_results(0);
+  const auto& instance_logs = test_result.service_logs().instance_logs();
+  ASSERT_EQ(instance_logs.size(), 1);
+  const RpcPerformanceLog& rpc_log = instance_logs.at("client@node0")
+                                         .peer_logs()
+                                         .at("server/0")
+                                         .rpc_logs()
+                                         .at(0);
+  EXPECT_EQ(rpc_log.successful_rpc_samples_size(), 0);
+  EXPECT_EQ(rpc_log.latency_histogram().successful_rpc_count(), 100);
+  ASSERT_GT(test_result.log_summary_size(), 1);
+  EXPECT_NE(test_result.log_summary(1).find("ping: N: 100 "),
+            std::string::npos)
+      << test_result.log_summary(1);
+}
+
+TEST(DistBenchTestSequencer, UnknownResultsLevel) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(1));
+
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+  test->set_results_level("none");
+  auto* client = test->add_services();
+  client->set_name("client");
+  client->set_count(1);
+  auto* l1 = test->add_action_lists();
+  l1->set_name("client");
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  EXPECT_FALSE(status.ok());
+}
+
+TEST(DistBenchTestSequencer, RunIntenseTrafficMaxDurationGrpc) {
+  RunIntenseTrafficMaxDuration("grpc");
+}
+
+TEST(DistBenchTestSequencer, RunIntenseTrafficMaxDurationGrpcAsyncCallback) {
+  RunIntenseTrafficMaxDuration("grpc_async_callback");
+}
+
+TEST(DistBenchTestSequencer, RunIntenseTrafficMaxIterationGrpc) {
+  RunIntenseTrafficMaxIteration("grpc");
+}
+
+TEST(DistBenchTestSequencer, RunIntenseTrafficMaxIterationGrpcAsyncCallback) {
+  RunIntenseTrafficMaxIteration("grpc_async_callback");
+}
+
+TEST(DistBenchTestSequencer, RunIntenseTrafficMaxDurationMaxIterationGrpc) {
+  RunIntenseTrafficMaxDurationMaxIteration("grpc");
+}
+
+TEST(DistBenchTestSequencer,
+     RunIntenseTrafficMaxDurationMaxIterationGrpcAsyncCallback) {
+  RunIntenseTrafficMaxDurationMaxIteration("grpc_async_callback");
+}
+
+#ifdef WITH_MERCURY
+TEST(DistBenchTestSequencer, RunIntenseTrafficMaxDurationMercury) {
+  RunIntenseTrafficMaxDuration("mercury");
+}
+
+TEST(DistBenchTestSequencer, RunIntenseTrafficMaxIterationMercury) {
+  RunIntenseTrafficMaxIteration("mercury");
+}
+
+TEST(DistBenchTestSequencer, RunIntenseTrafficMaxDurationMaxIterationMercury) {
+  RunIntenseTrafficMaxDurationMaxIteration("mercury");
+}
+#endif
+
+struct TestSequenceParams {
+  int nb_cliques = 2;
+  bool open_loop = true;
+  std::string activity_name = "";
+  std::string activity_name_2 = "";
+  std::string activity_func = "";
+  std::string activity_func_2 = "";
+  bool duplicate_activity_config = false;
+  bool activity_with_same_config = false;
+  bool invalid_config = false;
+  int array_size = 0;
+  int max_iteration_count = -1;
+};
+
+void AddActivity(DistributedSystemDescription* test, ActionList* action_list,
+                 std::string activity_name, std::string activity_func,
+                 TestSequenceParams params) {
+  auto activity_config = absl::StrCat(activity_name, "_Config");
+
+  // Add activity-action to action list.
+  action_list->add_action_names(activity_name);
+  if (params.activity_with_same_config)
+    action_list->add_action_names(activity_name + "_duplicate");
+
+  if (activity_name == "unknown_activity") return;
+
+  // Add the description of activity.
+  auto a = test->add_actions();
+  a->set_name(activity_name);
+  a->set_activity_config_name(activity_config);
+  if (params.max_iteration_count != -1) {
+    a->mutable_iterations()->set_max_iteration_count(
+        params.max_iteration_count);
+  } else {
+    a->mutable_iterations()->set_max_duration_us(600'000'000);
+  }
+  if (params.activity_with_same_config) {
+    auto a = test->add_actions();
+    a->set_name(activity_name + "_duplicate");
+    a->set_activity_config_name(activity_config);
+    a->mutable_iterations()->set_max_duration_us(600'000'000);
+  }
+
+  if (activity_name == "known_activity_unknown_config") return;
+
+  // Add the settings of activity.
+  auto* ac = test->add_activity_configs();
+  ac->set_name(activity_config);
+  AddActivitySettingStringTo(ac, "activity_func", activity_func);
+  if (params.invalid_config)
+    AddActivitySettingIntTo(ac, "array_size", -1);
+  else
+    AddActivitySettingIntTo(ac, "array_size", params.array_size);
+}
+
+TestSequence GetCliqueTestSequence(const TestSequenceParams& params) {
+  int nb_cliques = params.nb_cliques;
+  bool open_loop = params.open_loop;
+  std::string activity_name = params.activity_name;
+  std::string activity_name_2 = params.activity_name_2;
+  std::string activity_func = params.activity_func;
+  std::string activity_func_2 = params.activity_func_2;
+  TestSequence test_sequence;
+  auto* test = test_sequence.add_tests();
+
+  auto* lo_opts = test->add_protocol_driver_options();
+  lo_opts->set_name("lo_opts");
   lo_opts->set_netdev_name("lo");
 
   auto* s1 = test->add_services();
@@ -929,36 +2654,366 @@ TEST(DistBenchTestSequencer, ConsumeCpuWithMaxIterationCount) {
   auto test_sequence = GetCliqueTestSequence(params);
 
   TestSequenceResults results;
-  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+
+  CheckCpuConsumeIterationCnt(results, 10, 1, true);
+
+  // The remainder of this test checks the same
+  // things as CliqueTest.
+  ASSERT_EQ(results.test_results().size(), 1);
+  auto& test_results = results.test_results(0);
+
+  const auto& log_summary = test_results.log_summary();
+  const auto& latency_summary = log_summary[1];
+  size_t pos = latency_summary.find("N: ") + 3;
+  ASSERT_NE(pos, std::string::npos);
+  const std::string N_value = latency_summary.substr(pos);
+
+  std::string N_value2 = N_value.substr(0, N_value.find(' '));
+  int N;
+  ASSERT_EQ(absl::SimpleAtoi(N_value2, &N), true);
+  int min = 100 * (nb_cliques * (nb_cliques - 1));
+  ASSERT_GE(N, min);
+  LOG(INFO) << "Total N is: " << N;
+
+  ASSERT_EQ(test_results.service_logs().instance_logs_size(), nb_cliques);
+  const auto& instance_results_it =
+      test_results.service_logs().instance_logs().find("clique/0");
+  ASSERT_NE(instance_results_it,
+            test_results.service_logs().instance_logs().end());
+}
+
+namespace {
+
+// Runs 20 iterations of an activity with the given settings and distribution
+// configs, and returns the activity metrics of worker/0.
+absl::StatusOr<std::map<std::string, int64_t>> RunActivityTest(
+    std::string_view activity_func, std::string_view activity_settings,
+    std::string_view distribution_configs = "",
+    std::string_view iterations = "max_iteration_count: 20") {
+  DistBenchTester tester;
+  absl::Status init_status = tester.Initialize(2);
+  if (!init_status.ok()) return init_status;
+
+  // The engines need a peer, so there are two workers:
+  const std::string proto = absl::StrCat(R"(
+tests {
+  services {
+    name: "worker"
+    count: 2
+  }
+  action_lists {
+    name: "worker"
+    action_names: "activity"
+  }
+  actions {
+    name: "activity"
+    activity_config_name: "activity_config"
+    iterations {
+      )",
+                                         iterations, R"(
+    }
+  }
+  activity_configs {
+    name: "activity_config"
+    activity_settings {
+      name: "activity_func"
+      string_value: ")",
+                                         activity_func, R"("
+    }
+    )",
+                                         activity_settings, R"(
+  }
+  )",
+                                         distribution_configs, R"(
+})");
+  auto test_sequence = ParseTestSequenceTextProto(proto);
+  if (!test_sequence.ok()) return test_sequence.status();
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/30);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), *test_sequence, &results);
+  if (!status.ok()) return grpcStatusToAbslStatus(status);
+
+  std::map<std::string, int64_t> metrics;
+  const auto& instance_log =
+      results.test_results(0).service_logs().instance_logs().at("worker/0");
+  for (const auto& metric :
+       instance_log.activity_logs().at("activity_config").activity_metrics()) {
+    metrics[metric.name()] = metric.value_int();
+  }
+  return metrics;
+}
+
+}  // namespace
+
+TEST(DistBenchTestSequencer, ConsumeCpuTimeFixed) {
+  const std::string settings = R"(
+    activity_settings {
+      name: "cpu_time_ns"
+      int64_value: 200000
+    })";
+  auto metrics = RunActivityTest("ConsumeCpuTime", settings);
+  ASSERT_OK(metrics.status());
+  EXPECT_EQ((*metrics)["iteration_count"], 20);
+  EXPECT_EQ((*metrics)["requested_cpu_time_ns"], 20 * 200'000);
+  EXPECT_GE((*metrics)["achieved_cpu_time_ns"], 20 * 200'000);
+  // Each iteration overshoots by a slice of spinning and a clock read, and
+  // possibly a preemption, which is far less than doubling the CPU time:
+  EXPECT_LE((*metrics)["achieved_cpu_time_ns"], 2 * 20 * 200'000);
+}
+
+TEST(DistBenchTestSequencer, ConsumeCpuTimeOpenLoop) {
+  const std::string settings = R"(
+    activity_settings {
+      name: "cpu_time_ns"
+      int64_value: 1000
+    })";
+  auto metrics = RunActivityTest("ConsumeCpuTime", settings, "", R"(
+      max_duration_us: 200000
+      open_loop_interval_ns: 10000000)");
+  ASSERT_OK(metrics.status());
+  // One iteration every 10ms for 200ms, rather than back to back:
+  EXPECT_GE((*metrics)["iteration_count"], 5);
+  EXPECT_LE((*metrics)["iteration_count"], 21);
+}
+
+TEST(DistBenchTestSequencer, ConsumeCpuTimeFromDistribution) {
+  const std::string settings = R"(
+    activity_settings {
+      name: "distribution_config_name"
+      string_value: "cpu_time_dist"
+    })";
+  const std::string distribution_configs = R"(
+  distribution_config {
+    name: "cpu_time_dist"
+    field_names: "cpu_time_ns"
+    pmf_points {
+      pmf: 0.5
+      data_points { exact: 100000 }
+    }
+    pmf_points {
+      pmf: 0.5
+      data_points { exact: 300000 }
+    }
+  })";
+  auto metrics =
+      RunActivityTest("ConsumeCpuTime", settings, distribution_configs);
+  ASSERT_OK(metrics.status());
+  int64_t requested = (*metrics)["requested_cpu_time_ns"];
+  EXPECT_EQ(requested % 100'000, 0);
+  EXPECT_GE(requested, 20 * 100'000);
+  EXPECT_LE(requested, 20 * 300'000);
+  EXPECT_GE((*metrics)["achieved_cpu_time_ns"], requested);
+}
+
+TEST(DistBenchTestSequencer, ConsumeCpuTimeFromDistributionFieldsOutOfOrder) {
+  const std::string settings = R"(
+    activity_settings {
+      name: "distribution_config_name"
+      string_value: "rpc_dist"
+    })";
+  const std::string distribution_configs = R"(
+  distribution_config {
+    name: "rpc_dist"
+    field_names: "cpu_time_ns"
+    field_names: "request_payload_size"
+    pmf_points {
+      pmf: 1
+      data_points { exact: 200000 }
+      data_points { exact: 10 }
+    }
+  })";
+  auto metrics =
+      RunActivityTest("ConsumeCpuTime", settings, distribution_configs);
+  ASSERT_OK(metrics.status());
+  EXPECT_EQ((*metrics)["requested_cpu_time_ns"], 20 * 200'000);
+}
+
+TEST(DistBenchTestSequencer, ConsumeCpuTimeNeedsCpuTimeDistribution) {
+  const std::string settings = R"(
+    activity_settings {
+      name: "distribution_config_name"
+      string_value: "payload_dist"
+    })";
+  const std::string distribution_configs = R"(
+  distribution_config {
+    name: "payload_dist"
+    field_names: "request_payload_size"
+    pmf_points {
+      pmf: 1
+      data_points { exact: 100 }
+    }
+  })";
+  auto metrics =
+      RunActivityTest("ConsumeCpuTime", settings, distribution_configs);
+  EXPECT_FALSE(metrics.ok());
+}
+
+TEST(DistBenchTestSequencer, ConsumeMemoryBandwidthCopy) {
+  const std::string settings = R"(
+    activity_settings {
+      name: "array_size"
+      int64_value: 1048576
+    }
+    activity_settings {
+      name: "kernel"
+      string_value: "copy"
+    }
+    activity_settings {
+      name: "bytes_per_iteration"
+      int64_value: 4194304
+    })";
+  auto metrics = RunActivityTest("ConsumeMemoryBandwidth", settings);
+  ASSERT_OK(metrics.status());
+  EXPECT_EQ((*metrics)["iteration_count"], 20);
+  // 16 bytes per element, which divides bytes_per_iteration:
+  EXPECT_EQ((*metrics)["bytes_moved"], 20 * 4194304);
+  EXPECT_GT((*metrics)["busy_ns"], 0);
+}
+
+TEST(DistBenchTestSequencer, ConsumeMemoryBandwidthUnknownKernel) {
+  const std::string settings = R"(
+    activity_settings {
+      name: "kernel"
+      string_value: "scale"
+    })";
+  EXPECT_FALSE(RunActivityTest("ConsumeMemoryBandwidth", settings).ok());
+}
+
+TEST(DistBenchTestSequencer, StorageIoMixed) {
+  const std::string settings = absl::StrCat(R"(
+    activity_settings {
+      name: "directory"
+      string_value: ")",
+                                            ::testing::TempDir(), R"("
+    }
+    activity_settings {
+      name: "file_size"
+      int64_value: 1048576
+    }
+    activity_settings {
+      name: "queue_depth"
+      int64_value: 4
+    }
+    activity_settings {
+      name: "ops_per_iteration"
+      int64_value: 16
+    }
+    activity_settings {
+      name: "write_percent"
+      int64_value: 50
+    })");
+  auto metrics = RunActivityTest("StorageIo", settings);
+  ASSERT_OK(metrics.status());
+  EXPECT_EQ((*metrics)["iteration_count"], 20);
+  EXPECT_EQ((*metrics)["ops"], 20 * 16);
+  EXPECT_EQ((*metrics)["failed_ops"], 0);
+  EXPECT_EQ((*metrics)["bytes_read"] + (*metrics)["bytes_written"],
+            20 * 16 * 4096);
+  EXPECT_GT((*metrics)["total_op_latency_ns"], 0);
+  EXPECT_GT((*metrics)["op_latency_p50_ns"], 0);
+  EXPECT_LE((*metrics)["op_latency_p50_ns"], (*metrics)["op_latency_p99_ns"]);
+  EXPECT_LE((*metrics)["op_latency_p99_ns"], (*metrics)["op_latency_max_ns"]);
+  EXPECT_LE((*metrics)["op_latency_max_ns"], (*metrics)["total_op_latency_ns"]);
+}
+
+TEST(DistBenchTestSequencer, StorageIoInRpcHandler) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  const std::string proto = absl::StrCat(R"(
+tests {
+  services {
+    name: "client"
+    count: 1
+  }
+  services {
+    name: "server"
+    count: 1
+  }
+  rpc_descriptions {
+    name: "client_server_rpc"
+    client: "client"
+    server: "server"
+  }
+  action_lists {
+    name: "client"
+    action_names: "run_queries"
+  }
+  actions {
+    name: "run_queries"
+    rpc_name: "client_server_rpc"
+    iterations {
+      max_iteration_count: 10
+      max_parallel_iterations: 2
+    }
+  }
+  action_lists {
+    name: "client_server_rpc"
+    action_names: "read_blocks"
+  }
+  actions {
+    name: "read_blocks"
+    activity_config_name: "storage_io_config"
+    iterations {
+      max_iteration_count: 1
+    }
+  }
+  activity_configs {
+    name: "storage_io_config"
+    activity_settings {
+      name: "activity_func"
+      string_value: "StorageIo"
+    }
+    activity_settings {
+      name: "directory"
+      string_value: ")",
+                                         ::testing::TempDir(), R"("
+    }
+    activity_settings {
+      name: "file_size"
+      int64_value: 1048576
+    }
+    activity_settings {
+      name: "ops_per_iteration"
+      int64_value: 8
+    }
+  }
+})");
+  auto test_sequence = ParseTestSequenceTextProto(proto);
+  ASSERT_TRUE(test_sequence.ok());
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/30);
   grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
-      context.get(), test_sequence, &results);
+      context.get(), *test_sequence, &results);
   ASSERT_OK(status);
 
-  CheckCpuConsumeIterationCnt(results, 10, 1, true);
-
-  // The remainder of this test checks the same
-  // things as CliqueTest.
-  ASSERT_EQ(results.test_results().size(), 1);
-  auto& test_results = results.test_results(0);
-
-  const auto& log_summary = test_results.log_summary();
-  const auto& latency_summary = log_summary[1];
-  size_t pos = latency_summary.find("N: ") + 3;
-  ASSERT_NE(pos, std::string::npos);
-  const std::string N_value = latency_summary.substr(pos);
-
-  std::string N_value2 = N_value.substr(0, N_value.find(' '));
-  int N;
-  ASSERT_EQ(absl::SimpleAtoi(N_value2, &N), true);
-  int min = 100 * (nb_cliques * (nb_cliques - 1));
-  ASSERT_GE(N, min);
-  LOG(INFO) << "Total N is: " << N;
-
-  ASSERT_EQ(test_results.service_logs().instance_logs_size(), nb_cliques);
-  const auto& instance_results_it =
-      test_results.service_logs().instance_logs().find("clique/0");
-  ASSERT_NE(instance_results_it,
-            test_results.service_logs().instance_logs().end());
+  // Each of the 10 RPCs ran the activity once:
+  std::map<std::string, int64_t> metrics;
+  for (const auto& metric : results.test_results(0)
+                                .service_logs()
+                                .instance_logs()
+                                .at("server/0")
+                                .activity_logs()
+                                .at("storage_io_config")
+                                .activity_metrics()) {
+    metrics[metric.name()] = metric.value_int();
+  }
+  EXPECT_EQ(metrics["iteration_count"], 10);
+  EXPECT_EQ(metrics["ops"], 10 * 8);
+  EXPECT_EQ(metrics["failed_ops"], 0);
+  EXPECT_EQ(metrics["bytes_read"], 10 * 8 * 4096);
+  // The percentiles cover the ops of all the RPCs, rather than being summed
+  // up across them:
+  EXPECT_GT(metrics["op_latency_p50_ns"], 0);
+  EXPECT_LE(metrics["op_latency_p50_ns"], metrics["op_latency_max_ns"]);
+  EXPECT_LE(metrics["op_latency_max_ns"], metrics["total_op_latency_ns"]);
 }
 
 TEST(DistBenchTestSequencer, TwoActivitiesWithSameActivityConfig) {
@@ -1184,11 +3239,286 @@ TEST(DistBenchTestSequencer, VariablePayloadSizeTest) {
   ASSERT_EQ(num_samples, 20);
 }
 
+// Distribution configs may set the size of only one of the payloads, the
+// other one coming from the PayloadSpec of the RPC:
+TEST(DistBenchTestSequencer, OneFieldPayloadDistributionTest) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  TestSequence test_sequence;
+  for (std::string field_name :
+       {"request_payload_size", "response_payload_size"}) {
+    auto* test = test_sequence.add_tests();
+    auto* client = test->add_services();
+    client->set_name("client");
+    client->set_count(1);
+    auto* server = test->add_services();
+    server->set_name("server");
+    server->set_count(1);
+
+    auto* request_payload = test->add_payload_descriptions();
+    request_payload->set_name("request_payload");
+    request_payload->set_size(5);
+    auto* response_payload = test->add_payload_descriptions();
+    response_payload->set_name("response_payload");
+    response_payload->set_size(7);
+
+    auto* rpc_desc = test->add_rpc_descriptions();
+    rpc_desc->set_name("client_server_rpc");
+    rpc_desc->set_client("client");
+    rpc_desc->set_server("server");
+    rpc_desc->set_request_payload_name("request_payload");
+    rpc_desc->set_response_payload_name("response_payload");
+    rpc_desc->set_distribution_config_name("MyPayloadDistribution");
+
+    auto* client_al = test->add_action_lists();
+    client_al->set_name("client");
+    client_al->add_action_names("run_queries");
+    auto* server_al = test->add_action_lists();
+    server_al->set_name("client_server_rpc");
+
+    auto* dist = test->add_distribution_config();
+    dist->set_name("MyPayloadDistribution");
+    for (int i = 1; i < 5; i++) {
+      auto* pmf_point = dist->add_pmf_points();
+      pmf_point->set_pmf(0.25);
+      pmf_point->add_data_points()->set_exact(i * 11);
+    }
+    dist->add_field_names(field_name);
+
+    auto action = test->add_actions();
+    action->set_name("run_queries");
+    action->set_rpc_name("client_server_rpc");
+    action->mutable_iterations()->set_max_iteration_count(20);
+  }
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), test_sequence, &results);
+  ASSERT_OK(status);
+  ASSERT_EQ(results.test_results().size(), 2);
+  for (int i = 0; i < 2; ++i) {
+    const auto& instance_logs =
+        results.test_results(i).service_logs().instance_logs();
+    ASSERT_EQ(instance_logs.count("client/0"), 1);
+    const auto& samples = instance_logs.at("client/0")
+                              .peer_logs()
+                              .at("server/0")
+                              .rpc_logs()
+                              .at(0)
+                              .successful_rpc_samples();
+    ASSERT_EQ(samples.size(), 20);
+    for (const auto& rpc_sample : samples) {
+      if (i == 0) {
+        EXPECT_EQ(rpc_sample.request_size() % 11, 0);
+        EXPECT_NE(rpc_sample.request_size(), 0);
+        EXPECT_EQ(rpc_sample.response_size(), 7);
+      } else {
+        EXPECT_EQ(rpc_sample.request_size(), 5);
+        EXPECT_EQ(rpc_sample.response_size() % 11, 0);
+        EXPECT_NE(rpc_sample.response_size(), 0);
+      }
+    }
+  }
+}
+
 TEST(DistBenchTestSequencer, StochasticTest) {
   DistBenchTester tester;
-  ASSERT_OK(tester.Initialize(6));
+  ASSERT_OK(tester.Initialize(6));
+
+  const std::string proto = R"(
+tests {
+  services {
+    name: "client"
+    count: 1
+  }
+  services {
+    name: "server"
+    count: 5
+  }
+  rpc_descriptions {
+    name: "client_server_rpc"
+    client: "client"
+    server: "server"
+    request_payload_name: "request_payload"
+    response_payload_name: "response_payload"
+    fanout_filter: "stochastic{0.7:1,0.3:4}"
+  }
+  payload_descriptions {
+    name: "request_payload"
+    size: 196
+  }
+  payload_descriptions {
+    name: "response_payload"
+    size: 262144
+  }
+  action_lists {
+    name: "client"
+    action_names: "run_queries"
+  }
+  actions {
+    name: "run_queries"
+    rpc_name: "client_server_rpc"
+    iterations {
+      max_iteration_count: 1000
+    }
+  }
+  action_lists {
+    name: "client_server_rpc"
+  }
+})";
+  auto test_sequence = ParseTestSequenceTextProto(proto);
+  ASSERT_TRUE(test_sequence.ok());
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), *test_sequence, &results);
+  ASSERT_OK(status);
+
+  auto& test_results = results.test_results(0);
+  ASSERT_EQ(test_results.service_logs().instance_logs_size(), 1);
+
+  const auto& log_summary = test_results.log_summary();
+  const auto& latency_summary = log_summary[1];
+  size_t pos = latency_summary.find("N: ") + 3;
+  ASSERT_NE(pos, std::string::npos);
+  const std::string N_value = latency_summary.substr(pos);
+
+  std::string N_value2 = N_value.substr(0, N_value.find(' '));
+  int N;
+  ASSERT_EQ(absl::SimpleAtoi(N_value2, &N), true);
+  ASSERT_LE(N, 2300);
+  ASSERT_GE(N, 1500);
+}
+
+TEST(DistBenchTestSequencer, ProtocolDriverOptionsTest) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(2));
+
+  const std::string proto = R"(
+tests {
+  services {
+    name: "client"
+    count: 1
+  }
+  services {
+    name: "server"
+    count: 1
+    protocol_driver_options_name: "loopback_pd"
+  }
+  rpc_descriptions {
+    name: "client_server_rpc"
+    client: "client"
+    server: "server"
+  }
+  action_lists {
+    name: "client"
+    action_names: "run_queries"
+  }
+  actions {
+    name: "run_queries"
+    rpc_name: "client_server_rpc"
+    iterations {
+      max_iteration_count: 1000
+    }
+  }
+  action_lists {
+    name: "client_server_rpc"
+  }
+  protocol_driver_options {
+    name: "loopback_pd"
+    netdev_name: "lo"
+  }
+})";
+  auto test_sequence = ParseTestSequenceTextProto(proto);
+  ASSERT_TRUE(test_sequence.ok());
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/15);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), *test_sequence, &results);
+  ASSERT_OK(status);
+
+  auto& test_results = results.test_results(0);
+  ASSERT_EQ(test_results.service_logs().instance_logs_size(), 1);
+}
+
+TEST(DistBenchTestSequencer, FanoutRoundRobinTest) {
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(5));
+
+  const std::string proto = R"(
+tests {
+  services {
+    name: "client"
+    count: 1
+  }
+  services {
+    name: "server"
+    count: 4
+    protocol_driver_options_name: "loopback_pd"
+  }
+  rpc_descriptions {
+    name: "client_server_rpc"
+    client: "client"
+    server: "server"
+    fanout_filter: "round_robin"
+  }
+  action_lists {
+    name: "client"
+    action_names: "run_queries"
+  }
+  actions {
+    name: "run_queries"
+    rpc_name: "client_server_rpc"
+    iterations {
+      max_iteration_count: 1024
+    }
+  }
+  action_lists {
+    name: "client_server_rpc"
+  }
+  protocol_driver_options {
+    name: "loopback_pd"
+    netdev_name: "lo"
+  }
+})";
+  auto test_sequence = ParseTestSequenceTextProto(proto);
+  ASSERT_TRUE(test_sequence.ok());
+
+  TestSequenceResults results;
+  auto context = CreateContextWithDeadline(/*max_time_s=*/15);
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), *test_sequence, &results);
+  ASSERT_OK(status);
+
+  auto& test_results = results.test_results(0);
+  ASSERT_EQ(test_results.service_logs().instance_logs_size(), 1);
+
+  auto serv_log_it =
+      test_results.service_logs().instance_logs().find("client/0");
+  for (int i = 0; i < 4; i++) {
+    auto peer_log_it =
+        serv_log_it->second.peer_logs().find(absl::StrCat("server/", i));
+    auto rpc_log_it = peer_log_it->second.rpc_logs().find(0);
+    ASSERT_EQ(rpc_log_it->second.successful_rpc_samples_size(), 256);
+  }
+}
+
+namespace {
+
+// Runs 1024 RPCs from a client to 4 servers with the given fanout filter, and
+// returns how many each server got. With slow_server_0, server/0 spends 2ms
+// of CPU time on each RPC, while the others reply right away.
+absl::StatusOr<std::vector<int>> RunFanoutFilterTest(
+    std::string_view fanout_filter, bool slow_server_0 = false) {
+  DistBenchTester tester;
+  absl::Status init = tester.Initialize(5);
+  if (!init.ok()) return init;
 
-  const std::string proto = R"(
+  std::string proto = absl::StrCat(R"(
 tests {
   services {
     name: "client"
@@ -1196,23 +3526,15 @@ tests {
   }
   services {
     name: "server"
-    count: 5
+    count: 4
+    protocol_driver_options_name: "loopback_pd"
   }
   rpc_descriptions {
     name: "client_server_rpc"
     client: "client"
     server: "server"
-    request_payload_name: "request_payload"
-    response_payload_name: "response_payload"
-    fanout_filter: "stochastic{0.7:1,0.3:4}"
-  }
-  payload_descriptions {
-    name: "request_payload"
-    size: 196
-  }
-  payload_descriptions {
-    name: "response_payload"
-    size: 262144
+    fanout_filter: ")",
+                                   fanout_filter, R"("
   }
   action_lists {
     name: "client"
@@ -1222,39 +3544,153 @@ tests {
     name: "run_queries"
     rpc_name: "client_server_rpc"
     iterations {
-      max_iteration_count: 1000
+      max_iteration_count: 1024
+      max_parallel_iterations: 8
     }
   }
+  protocol_driver_options {
+    name: "loopback_pd"
+    netdev_name: "lo"
+  }
+)");
+  if (slow_server_0) {
+    absl::StrAppend(&proto, R"(
   action_lists {
     name: "client_server_rpc"
+    action_names: "slow_down"
+  }
+  actions {
+    name: "slow_down"
+    activity_config_name: "slow_down_config"
+  }
+  activity_configs {
+    name: "slow_down_config"
+    activity_settings {
+      name: "activity_func"
+      string_value: "ConsumeCpuTime"
+    }
+    activity_settings {
+      name: "cpu_time_ns"
+      int64_value: 2000000
+    }
+    activity_settings {
+      name: "instances"
+      string_value: "0"
+    }
+  }
+})");
+  } else {
+    absl::StrAppend(&proto, R"(
+  action_lists {
+    name: "client_server_rpc"
+  }
+})");
   }
-})";
   auto test_sequence = ParseTestSequenceTextProto(proto);
-  ASSERT_TRUE(test_sequence.ok());
+  if (!test_sequence.ok()) return test_sequence.status();
 
   TestSequenceResults results;
-  auto context = CreateContextWithDeadline(/*max_time_s=*/75);
+  auto context = CreateContextWithDeadline(/*max_time_s=*/15);
   grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
       context.get(), *test_sequence, &results);
-  ASSERT_OK(status);
+  if (!status.ok()) return grpcStatusToAbslStatus(status);
 
-  auto& test_results = results.test_results(0);
-  ASSERT_EQ(test_results.service_logs().instance_logs_size(), 1);
+  const auto& instance_logs =
+      results.test_results(0).service_logs().instance_logs();
+  auto serv_log_it = instance_logs.find("client/0");
+  if (serv_log_it == instance_logs.end()) {
+    return absl::NotFoundError("No log for client/0");
+  }
+  std::vector<int> rpcs_per_server(4);
+  for (int i = 0; i < 4; i++) {
+    auto peer_log_it =
+        serv_log_it->second.peer_logs().find(absl::StrCat("server/", i));
+    if (peer_log_it == serv_log_it->second.peer_logs().end()) continue;
+    auto rpc_log_it = peer_log_it->second.rpc_logs().find(0);
+    if (rpc_log_it == peer_log_it->second.rpc_logs().end()) continue;
+    rpcs_per_server[i] = rpc_log_it->second.successful_rpc_samples_size();
+  }
+  return rpcs_per_server;
+}
 
-  const auto& log_summary = test_results.log_summary();
-  const auto& latency_summary = log_summary[1];
-  size_t pos = latency_summary.find("N: ") + 3;
-  ASSERT_NE(pos, std::string::npos);
-  const std::string N_value = latency_summary.substr(pos);
+}  // namespace
+
+TEST(DistBenchTestSequencer, FanoutLeastPendingTest) {
+  auto rpcs_per_server = RunFanoutFilterTest("least_pending");
+  ASSERT_OK(rpcs_per_server.status());
+  ASSERT_EQ(rpcs_per_server->size(), 4);
+  EXPECT_EQ(
+      std::accumulate(rpcs_per_server->begin(), rpcs_per_server->end(), 0),
+      1024);
+  for (int rpcs : *rpcs_per_server) {
+    EXPECT_GT(rpcs, 0);
+  }
+}
 
-  std::string N_value2 = N_value.substr(0, N_value.find(' '));
-  int N;
-  ASSERT_EQ(absl::SimpleAtoi(N_value2, &N), true);
-  ASSERT_LE(N, 2300);
-  ASSERT_GE(N, 1500);
+TEST(DistBenchTestSequencer, FanoutLeastPendingAvoidsSlowServer) {
+  auto rpcs_per_server =
+      RunFanoutFilterTest("least_pending", /*slow_server_0=*/true);
+  ASSERT_OK(rpcs_per_server.status());
+  ASSERT_EQ(rpcs_per_server->size(), 4);
+  EXPECT_EQ(
+      std::accumulate(rpcs_per_server->begin(), rpcs_per_server->end(), 0),
+      1024);
+  // An even spread would send 256 RPCs to each server; server/0 keeps some
+  // RPCs pending almost all the time, so it only gets a few:
+  EXPECT_LT((*rpcs_per_server)[0], 128);
+  for (int i = 1; i < 4; ++i) {
+    EXPECT_GT((*rpcs_per_server)[i], (*rpcs_per_server)[0]);
+  }
 }
 
-TEST(DistBenchTestSequencer, ProtocolDriverOptionsTest) {
+TEST(DistBenchTestSequencer, FanoutPowerOfTwoChoicesTest) {
+  auto rpcs_per_server = RunFanoutFilterTest("p2c");
+  ASSERT_OK(rpcs_per_server.status());
+  ASSERT_EQ(rpcs_per_server->size(), 4);
+  EXPECT_EQ(
+      std::accumulate(rpcs_per_server->begin(), rpcs_per_server->end(), 0),
+      1024);
+  for (int rpcs : *rpcs_per_server) {
+    EXPECT_GT(rpcs, 0);
+  }
+}
+
+TEST(DistBenchTestSequencer, FanoutPowerOfTwoChoicesAvoidsSlowServer) {
+  auto rpcs_per_server = RunFanoutFilterTest("p2c", /*slow_server_0=*/true);
+  ASSERT_OK(rpcs_per_server.status());
+  ASSERT_EQ(rpcs_per_server->size(), 4);
+  EXPECT_EQ(
+      std::accumulate(rpcs_per_server->begin(), rpcs_per_server->end(), 0),
+      1024);
+  // server/0 is only picked when paired with a server with as many pending
+  // RPCs, far less than the 256 of an even spread:
+  EXPECT_LT((*rpcs_per_server)[0], 192);
+  for (int i = 1; i < 4; ++i) {
+    EXPECT_GT((*rpcs_per_server)[i], (*rpcs_per_server)[0]);
+  }
+}
+
+TEST(DistBenchTestSequencer, FanoutWeightedTest) {
+  auto rpcs_per_server = RunFanoutFilterTest("weighted{0,1,3,0}");
+  ASSERT_OK(rpcs_per_server.status());
+  ASSERT_EQ(rpcs_per_server->size(), 4);
+  EXPECT_EQ((*rpcs_per_server)[0], 0);
+  EXPECT_EQ((*rpcs_per_server)[3], 0);
+  EXPECT_EQ((*rpcs_per_server)[1] + (*rpcs_per_server)[2], 1024);
+  // 256 and 768 are expected:
+  EXPECT_GT((*rpcs_per_server)[2], 2 * (*rpcs_per_server)[1]);
+}
+
+TEST(DistBenchTestSequencer, FanoutWeightedNeedsOneWeightPerInstance) {
+  auto rpcs_per_server = RunFanoutFilterTest("weighted{1,1}");
+  ASSERT_FALSE(rpcs_per_server.ok());
+  EXPECT_NE(rpcs_per_server.status().message().find(
+                "need one weight per instance of server (4)"),
+            std::string::npos)
+      << rpcs_per_server.status();
+}
+
+TEST(DistBenchTestSequencer, ProtocolDriverOptionsGrpcInlineCallbackTest) {
   DistBenchTester tester;
   ASSERT_OK(tester.Initialize(2));
 
@@ -1263,11 +3699,12 @@ tests {
   services {
     name: "client"
     count: 1
+    protocol_driver_options_name: "grpc_client_cb_server_normal"
   }
   services {
     name: "server"
     count: 1
-    protocol_driver_options_name: "loopback_pd"
+    protocol_driver_options_name: "grpc_client_cb_server_normal"
   }
   rpc_descriptions {
     name: "client_server_rpc"
@@ -1289,8 +3726,17 @@ tests {
     name: "client_server_rpc"
   }
   protocol_driver_options {
-    name: "loopback_pd"
+    name: "grpc_client_cb_server_normal"
+    protocol_name: "grpc"
     netdev_name: "lo"
+    server_settings {
+      name: "server_type"
+      string_value: "inline"
+    }
+    client_settings {
+      name: "client_type"
+      string_value: "callback"
+    }
   }
 })";
   auto test_sequence = ParseTestSequenceTextProto(proto);
@@ -1306,26 +3752,26 @@ tests {
   ASSERT_EQ(test_results.service_logs().instance_logs_size(), 1);
 }
 
-TEST(DistBenchTestSequencer, FanoutRoundRobinTest) {
+TEST(DistBenchTestSequencer, ProtocolDriverOptionsGrpcHandoffPollingTest) {
   DistBenchTester tester;
-  ASSERT_OK(tester.Initialize(5));
+  ASSERT_OK(tester.Initialize(2));
 
   const std::string proto = R"(
 tests {
   services {
     name: "client"
     count: 1
+    protocol_driver_options_name: "grpc_client_cq_server_cb"
   }
   services {
     name: "server"
-    count: 4
-    protocol_driver_options_name: "loopback_pd"
+    count: 1
+    protocol_driver_options_name: "grpc_client_cq_server_cb"
   }
   rpc_descriptions {
     name: "client_server_rpc"
     client: "client"
     server: "server"
-    fanout_filter: "round_robin"
   }
   action_lists {
     name: "client"
@@ -1335,59 +3781,80 @@ tests {
     name: "run_queries"
     rpc_name: "client_server_rpc"
     iterations {
-      max_iteration_count: 1024
+      max_iteration_count: 1000
     }
   }
   action_lists {
     name: "client_server_rpc"
   }
   protocol_driver_options {
-    name: "loopback_pd"
+    name: "grpc_client_cq_server_cb"
+    protocol_name: "grpc"
     netdev_name: "lo"
+    server_settings {
+      name: "server_type"
+      string_value: "handoff"
+    }
+    client_settings {
+      name: "client_type"
+      string_value: "polling"
+    }
   }
 })";
   auto test_sequence = ParseTestSequenceTextProto(proto);
   ASSERT_TRUE(test_sequence.ok());
 
   TestSequenceResults results;
-  auto context = CreateContextWithDeadline(/*max_time_s=*/15);
+  auto context = CreateContextWithDeadline(/*max_time_s=*/30);
   grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
       context.get(), *test_sequence, &results);
   ASSERT_OK(status);
 
   auto& test_results = results.test_results(0);
   ASSERT_EQ(test_results.service_logs().instance_logs_size(), 1);
-
-  auto serv_log_it =
-      test_results.service_logs().instance_logs().find("client/0");
-  for (int i = 0; i < 4; i++) {
-    auto peer_log_it =
-        serv_log_it->second.peer_logs().find(absl::StrCat("server/", i));
-    auto rpc_log_it = peer_log_it->second.rpc_logs().find(0);
-    ASSERT_EQ(rpc_log_it->second.successful_rpc_samples_size(), 256);
-  }
 }
 
-TEST(DistBenchTestSequencer, ProtocolDriverOptionsGrpcInlineCallbackTest) {
+
+// Runs 100 RPCs with 4 KiB payloads of the given content, compressed with
+// the given algorithm, and returns the log of the client.
+absl::StatusOr<RpcPerformanceLog> RunPayloadContentTest(
+    std::string_view content, std::string_view compression_algorithm) {
   DistBenchTester tester;
-  ASSERT_OK(tester.Initialize(2));
+  absl::Status init_status = tester.Initialize(2);
+  if (!init_status.ok()) return init_status;
 
-  const std::string proto = R"(
+  const std::string proto = absl::StrCat(R"(
 tests {
   services {
     name: "client"
     count: 1
-    protocol_driver_options_name: "grpc_client_cb_server_normal"
+    protocol_driver_options_name: "compressed_grpc"
   }
   services {
     name: "server"
     count: 1
-    protocol_driver_options_name: "grpc_client_cb_server_normal"
+    protocol_driver_options_name: "compressed_grpc"
   }
   rpc_descriptions {
     name: "client_server_rpc"
     client: "client"
     server: "server"
+    request_payload_name: "request_payload"
+    response_payload_name: "response_payload"
+  }
+  payload_descriptions {
+    name: "request_payload"
+    size: 4096
+    content: ")",
+                                         content, R"("
+    compression_ratio: 4
+  }
+  payload_descriptions {
+    name: "response_payload"
+    size: 4096
+    content: ")",
+                                         content, R"("
+    compression_ratio: 4
   }
   action_lists {
     name: "client"
@@ -1397,60 +3864,101 @@ tests {
     name: "run_queries"
     rpc_name: "client_server_rpc"
     iterations {
-      max_iteration_count: 1000
+      max_iteration_count: 100
     }
   }
   action_lists {
     name: "client_server_rpc"
   }
   protocol_driver_options {
-    name: "grpc_client_cb_server_normal"
+    name: "compressed_grpc"
     protocol_name: "grpc"
     netdev_name: "lo"
     server_settings {
-      name: "server_type"
-      string_value: "inline"
+      name: "compression_algorithm"
+      string_value: ")",
+                                         compression_algorithm, R"("
+    }
+    server_settings {
+      name: "compression_level"
+      string_value: "high"
     }
     client_settings {
-      name: "client_type"
-      string_value: "callback"
+      name: "compression_algorithm"
+      string_value: ")",
+                                         compression_algorithm, R"("
     }
   }
-})";
+})");
   auto test_sequence = ParseTestSequenceTextProto(proto);
-  ASSERT_TRUE(test_sequence.ok());
+  if (!test_sequence.ok()) return test_sequence.status();
 
   TestSequenceResults results;
-  auto context = CreateContextWithDeadline(/*max_time_s=*/15);
+  auto context = CreateContextWithDeadline(/*max_time_s=*/30);
   grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
       context.get(), *test_sequence, &results);
-  ASSERT_OK(status);
+  if (!status.ok()) return grpcStatusToAbslStatus(status);
+  return results.test_results(0)
+      .service_logs()
+      .instance_logs()
+      .at("client/0")
+      .peer_logs()
+      .at("server/0")
+      .rpc_logs()
+      .at(0);
+}
 
-  auto& test_results = results.test_results(0);
-  ASSERT_EQ(test_results.service_logs().instance_logs_size(), 1);
+TEST(DistBenchTestSequencer, PayloadContentWithCompression) {
+  for (std::string_view content :
+       {"repeated", "zeros", "random", "text", "compressible"}) {
+    auto rpc_log = RunPayloadContentTest(content, "gzip");
+    ASSERT_TRUE(rpc_log.ok()) << content << ": " << rpc_log.status();
+    EXPECT_EQ(rpc_log->successful_rpc_samples_size(), 100) << content;
+    EXPECT_EQ(rpc_log->failed_rpc_samples_size(), 0) << content;
+    for (const auto& sample : rpc_log->successful_rpc_samples()) {
+      EXPECT_EQ(sample.request_size(), 4096) << content;
+      EXPECT_EQ(sample.response_size(), 4096) << content;
+    }
+  }
 }
 
-TEST(DistBenchTestSequencer, ProtocolDriverOptionsGrpcHandoffPollingTest) {
+TEST(DistBenchTestSequencer, UnknownPayloadContent) {
+  EXPECT_FALSE(RunPayloadContentTest("ones", "none").ok());
+}
+
+TEST(DistBenchTestSequencer, UnknownCompressionAlgorithm) {
+  EXPECT_FALSE(RunPayloadContentTest("random", "zstd").ok());
+}
+
+TEST(DistBenchTestSequencer, ProtocolDriverOptionsGrpcShardedPollingServer) {
   DistBenchTester tester;
-  ASSERT_OK(tester.Initialize(2));
+  ASSERT_OK(tester.Initialize(3));
 
   const std::string proto = R"(
 tests {
   services {
     name: "client"
     count: 1
-    protocol_driver_options_name: "grpc_client_cq_server_cb"
   }
   services {
     name: "server"
     count: 1
-    protocol_driver_options_name: "grpc_client_cq_server_cb"
+    protocol_driver_options_name: "grpc_sharded_polling_server"
+  }
+  services {
+    name: "backend"
+    count: 1
   }
   rpc_descriptions {
     name: "client_server_rpc"
     client: "client"
     server: "server"
   }
+  rpc_descriptions {
+    name: "server_backend_rpc"
+    client: "server"
+    server: "backend"
+  }
   action_lists {
     name: "client"
     action_names: "run_queries"
@@ -1459,24 +3967,41 @@ tests {
     name: "run_queries"
     rpc_name: "client_server_rpc"
     iterations {
-      max_iteration_count: 1000
+      max_iteration_count: 200
+      max_parallel_iterations: 10
     }
   }
   action_lists {
     name: "client_server_rpc"
+    action_names: "query_backend"
+  }
+  actions {
+    name: "query_backend"
+    rpc_name: "server_backend_rpc"
+  }
+  action_lists {
+    name: "server_backend_rpc"
   }
   protocol_driver_options {
-    name: "grpc_client_cq_server_cb"
+    name: "grpc_sharded_polling_server"
     protocol_name: "grpc"
     netdev_name: "lo"
     server_settings {
       name: "server_type"
-      string_value: "handoff"
-    }
-    client_settings {
-      name: "client_type"
       string_value: "polling"
     }
+    server_settings {
+      name: "server_cq_count"
+      int64_value: 2
+    }
+    server_settings {
+      name: "server_cq_pending_requests"
+      int64_value: 4
+    }
+    server_settings {
+      name: "server_cq_dispatch"
+      string_value: "handoff"
+    }
   }
 })";
   auto test_sequence = ParseTestSequenceTextProto(proto);
@@ -1488,8 +4013,15 @@ tests {
       context.get(), *test_sequence, &results);
   ASSERT_OK(status);
 
-  auto& test_results = results.test_results(0);
-  ASSERT_EQ(test_results.service_logs().instance_logs_size(), 1);
+  const auto& instance_logs =
+      results.test_results(0).service_logs().instance_logs();
+  ASSERT_EQ(instance_logs.size(), 2);
+  const auto& client_log =
+      instance_logs.at("client/0").peer_logs().at("server/0").rpc_logs();
+  EXPECT_EQ(client_log.at(0).successful_rpc_samples_size(), 200);
+  const auto& server_log =
+      instance_logs.at("server/0").peer_logs().at("backend/0").rpc_logs();
+  EXPECT_EQ(server_log.at(1).successful_rpc_samples_size(), 200);
 }
 
 TEST(DistBenchTestSequencer, RPCTraceSimple) {
@@ -1704,4 +4236,121 @@ tests {
   }
 }
 
+TEST(DistBenchTestSequencer, RPCTraceCompactTwoLevels) {
+  const std::string proto = R"(
+tests {
+  name: "rpc_trace_compact_two_levels"
+  services {
+    name: "load_balancer"
+    count: 1
+  }
+  services {
+    name: "root"
+    count: 2
+  }
+  services {
+    name: "leaf"
+    count: 3
+  }
+  action_lists {
+    name: "load_balancer"
+    action_names: "load_balancer/do_queries"
+  }
+  actions {
+    name: "load_balancer/do_queries"
+    iterations {
+      max_parallel_iterations: 5
+      max_iteration_count: 10
+    }
+    rpc_name: "root_query"
+  }
+  rpc_descriptions {
+    name: "root_query"
+    client: "load_balancer"
+    server: "root"
+    fanout_filter: "round_robin"
+    tracing_interval: 1
+    compact_tracing: true
+  }
+  action_lists {
+    name: "root_query"
+    action_names: "root/root_query_fanout"
+  }
+  actions {
+    name: "root/root_query_fanout"
+    rpc_name: "leaf_query"
+  }
+  rpc_descriptions {
+    name: "leaf_query"
+    client: "root"
+    server: "leaf"
+    fanout_filter: "all"
+  }
+  action_lists {
+    name: "leaf_query"
+    # no actions, NOP
+  }
+})";
+  auto test_sequence = ParseTestSequenceTextProto(proto);
+  ASSERT_TRUE(test_sequence.ok());
+
+  auto context = CreateContextWithDeadline(/*max_time_s=*/30);
+  DistBenchTester tester;
+  ASSERT_OK(tester.Initialize(6));
+  TestSequenceResults results;
+  grpc::Status status = tester.test_sequencer_stub->RunTestSequence(
+      context.get(), *test_sequence, &results);
+  ASSERT_OK(status);
+  auto& test_results = results.test_results(0);
+  const auto& instance_logs = test_results.service_logs().instance_logs();
+  ASSERT_EQ(instance_logs.size(), 3);
+
+  // The root spans start the traces:
+  std::set<uint64_t> root_spans;
+  for (int i = 0; i < 2; ++i) {
+    const auto& root_log = instance_logs.at("load_balancer/0")
+                               .peer_logs()
+                               .at(absl::StrCat("root/", i))
+                               .rpc_logs()
+                               .at(0);
+    ASSERT_EQ(root_log.successful_rpc_samples_size(), 5);
+    for (const auto& rpc : root_log.successful_rpc_samples()) {
+      const auto& trace_context = rpc.trace_context();
+      EXPECT_TRUE(trace_context.engine_ids().empty());
+      EXPECT_NE(trace_context.span_id(), 0);
+      EXPECT_EQ(trace_context.parent_span_id(), 0);
+      EXPECT_EQ(trace_context.depth(), 0);
+      root_spans.insert(trace_context.span_id());
+    }
+  }
+  EXPECT_EQ(root_spans.size(), 10);
+
+  // The leaf spans are children of the root ones, with a context of the
+  // same size:
+  for (int i = 0; i < 2; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      const auto& leaf_log = instance_logs.at(absl::StrCat("root/", i))
+                                 .peer_logs()
+                                 .at(absl::StrCat("leaf/", j))
+                                 .rpc_logs()
+                                 .at(1);
+      ASSERT_EQ(leaf_log.successful_rpc_samples_size(), 5);
+      for (const auto& rpc : leaf_log.successful_rpc_samples()) {
+        const auto& trace_context = rpc.trace_context();
+        EXPECT_TRUE(trace_context.engine_ids().empty());
+        EXPECT_EQ(trace_context.depth(), 1);
+        EXPECT_TRUE(root_spans.count(trace_context.parent_span_id()));
+      }
+    }
+  }
+
+  const auto& log_summary = test_results.log_summary();
+  auto it = std::find(log_summary.begin(), log_summary.end(), "Trace summary:");
+  ASSERT_NE(it, log_summary.end());
+  ASSERT_LT(it + 2, log_summary.end());
+  EXPECT_EQ(*(it + 1),
+            "  traces: 10 spans: 40 chains: 30 max depth: 2 incomplete: 0");
+  EXPECT_EQ(*(it + 2), "  root_query -> leaf_query: 30");
+}
+
 }  // namespace distbench
@@ -14,68 +14,378 @@
 
 #include "distbench_threadpool.h"
 
+#include <algorithm>
+
+#include "absl/base/internal/sysinfo.h"
+#include "absl/strings/str_cat.h"
+#include "glog/logging.h"
+
 namespace distbench {
 
+namespace {
+
+std::string_view ResolveThreadpoolType(std::string_view threadpool_type) {
+  if (!threadpool_type.empty()) return threadpool_type;
 #ifdef USE_DISTBENCH_THREADPOOL
+  return "simple";
+#else
+  return "cthread";
+#endif
+}
+
+}  // anonymous namespace
+
+WaitPolicy DefaultThreadpoolWaitPolicy(std::string_view threadpool_type) {
+  if (ResolveThreadpoolType(threadpool_type) == "work_stealing") {
+    return {WaitPolicy::kSpinThenBlock, /*spin_budget=*/4096};
+  }
+  return {WaitPolicy::kBusyPoll, /*spin_budget=*/0};
+}
+
+absl::StatusOr<std::unique_ptr<AbstractThreadpool>> CreateThreadpool(
+    std::string_view threadpool_type, int nb_threads) {
+  return CreateThreadpool(threadpool_type, nb_threads,
+                          DefaultThreadpoolWaitPolicy(threadpool_type));
+}
+
+absl::StatusOr<std::unique_ptr<AbstractThreadpool>> CreateThreadpool(
+    std::string_view threadpool_type, int nb_threads,
+    const WaitPolicy& wait_policy) {
+  if (nb_threads < 1) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Threadpool size (", nb_threads, ") must be a positive integer."));
+  }
+  threadpool_type = ResolveThreadpoolType(threadpool_type);
+  if (threadpool_type == "simple") {
+    return std::make_unique<SimpleThreadpool>(nb_threads, wait_policy);
+  } else if (threadpool_type == "cthread") {
+    return std::make_unique<CThreadpool>(nb_threads);
+  } else if (threadpool_type == "work_stealing") {
+    return std::make_unique<WorkStealingThreadpool>(nb_threads, wait_policy);
+  }
+  return absl::InvalidArgumentError(
+      absl::StrCat("Unknown threadpool_type: '", threadpool_type, "'."));
+}
+
+absl::StatusOr<std::unique_ptr<AbstractThreadpool>>
+CreateThreadpoolFromSettings(const ProtocolDriverOptions& pd_opts) {
+  auto threadpool_size = GetNamedServerSettingInt64(
+      pd_opts, "threadpool_size", absl::base_internal::NumCPUs());
+  auto threadpool_type =
+      GetNamedServerSettingString(pd_opts, "threadpool_type", "");
+  auto maybe_wait_policy =
+      GetWaitPolicy(pd_opts.server_settings(), "threadpool_",
+                    DefaultThreadpoolWaitPolicy(threadpool_type));
+  if (!maybe_wait_policy.ok()) return maybe_wait_policy.status();
+  return CreateThreadpool(threadpool_type, threadpool_size,
+                          maybe_wait_policy.value());
+}
+
+// SimpleThreadpool ===========================================================
 
-DistbenchThreadpool::DistbenchThreadpool(int nb_threads) {
+SimpleThreadpool::SimpleThreadpool(int nb_threads,
+                                   const WaitPolicy& wait_policy) {
   for (int i = 0; i < nb_threads; i++) {
-    auto task_runner = [&, i]() {
-      do {
-        std::function<void()> task;
-        {
-          absl::MutexLock m(&mutex_);
-          if (work_queue_.empty()) {
-            // All threads except thread-0 relinquish CPU
-            // if there is no work.
-            if (i != 0) sched_yield();
-            if (shutdown_.HasBeenNotified()) return;
-            continue;
-          }
-          task = work_queue_.front();
-          work_queue_.pop();
+    auto task_runner = [this, wait_policy]() {
+      WaitTimeCounters* wait_times = GetWaitTimeCounters("ThreadPool");
+      ThreadpoolTask task;
+      // Takes the next task, and returns whether the wait is over, i.e. if
+      // there was one or the threadpool shuts down:
+      auto take_task = [this, &task]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+        if (work_queue_.empty()) return shutdown_;
+        task = std::move(work_queue_.front());
+        work_queue_.pop();
+        queued_tasks_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      };
+      auto poll = [this, &take_task]() {
+        if (!queued_tasks_.load(std::memory_order_relaxed) &&
+            !shutting_down_.load(std::memory_order_relaxed)) {
+          return false;
         }
+        absl::MutexLock m(&mutex_);
+        return take_task();
+      };
+      auto has_work = [this]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_) {
+        return !work_queue_.empty() || shutdown_;
+      };
+      auto block = [this, &take_task, &has_work]() {
+        absl::MutexLock m(&mutex_, absl::Condition(&has_work));
+        return take_task();
+      };
+      while (true) {
+        if (!poll()) WaitWithPolicy(wait_policy, wait_times, poll, block);
+        // Only shutting down once all the tasks ran:
+        if (!task) return;
         task();
-      } while (true);
+        task = nullptr;
+      }
     };
     threads_.push_back(RunRegisteredThread("ThreadPool", task_runner));
   }
 }
 
-DistbenchThreadpool::~DistbenchThreadpool() {
-  shutdown_.Notify();
+SimpleThreadpool::~SimpleThreadpool() {
+  {
+    absl::MutexLock m(&mutex_);
+    shutdown_ = true;
+    shutting_down_.store(true, std::memory_order_relaxed);
+  }
   for (auto& thread : threads_) {
     thread.join();
   }
 }
 
-void DistbenchThreadpool::AddWork(std::function<void()> function) {
+void SimpleThreadpool::AddWork(ThreadpoolTask task) {
   absl::MutexLock m(&mutex_);
-  work_queue_.push(function);
+  work_queue_.push(std::move(task));
+  queued_tasks_.fetch_add(1, std::memory_order_relaxed);
 }
 
-#else
+// CThreadpool ================================================================
 
-DistbenchThreadpool::DistbenchThreadpool(int nb_threads) {
-  thpool_ = thpool_init(nb_threads);
-}
+CThreadpool::CThreadpool(int nb_threads) { thpool_ = thpool_init(nb_threads); }
 
-DistbenchThreadpool::~DistbenchThreadpool() {
+CThreadpool::~CThreadpool() {
   thpool_wait(thpool_);
   thpool_destroy(thpool_);
 }
 
-void Trampoline(void* function) {
-  auto f = reinterpret_cast<std::function<void()>*>(function);
-  (*f)();
-  delete f;
+namespace {
+void Trampoline(void* task) {
+  auto t = reinterpret_cast<ThreadpoolTask*>(task);
+  (*t)();
+  delete t;
 }
+}  // anonymous namespace
 
-void DistbenchThreadpool::AddWork(std::function<void()> function) {
-  auto* fpointer = new std::function<void()>(function);
-  thpool_add_work(thpool_, Trampoline, fpointer);
+void CThreadpool::AddWork(ThreadpoolTask task) {
+  auto* tpointer = new ThreadpoolTask(std::move(task));
+  thpool_add_work(thpool_, Trampoline, tpointer);
 }
 
-#endif
+// WorkStealingThreadpool =====================================================
+
+namespace {
+
+// Capacity of each per-worker queue; must be a power of 2.
+constexpr size_t kTaskQueueCapacity = 1024;
+
+// With a kSpinThenBlock WaitPolicy, idle workers first spin, checking for
+// work between cpu pauses, then park. The spin budget adapts per worker, up
+// to the one of the policy: it grows each time spinning finds work and
+// shrinks each time the worker has to park.
+constexpr int64_t kMinSpins = 16;
+
+// Parked workers are woken up explicitly by AddWork; the timeout is only a
+// backstop.
+constexpr absl::Duration kMaxParkTime = absl::Milliseconds(10);
+
+// Identifies the worker (if any) running on the current thread, so that work
+// added from inside the pool goes to the local queue first.
+thread_local const WorkStealingThreadpool* current_pool = nullptr;
+thread_local int current_worker = -1;
+
+}  // anonymous namespace
+
+WorkStealingThreadpool::TaskQueue::TaskQueue(size_t capacity)
+    : cells_(new Cell[capacity]), mask_(capacity - 1) {
+  CHECK_EQ(capacity & mask_, 0UL) << "capacity must be a power of 2";
+  for (size_t i = 0; i < capacity; ++i) {
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+bool WorkStealingThreadpool::TaskQueue::TryPush(ThreadpoolTask& task) {
+  size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells_[pos & mask_];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (enqueue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;  // Full.
+    } else {
+      pos = enqueue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  cell->task = std::move(task);
+  cell->sequence.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool WorkStealingThreadpool::TaskQueue::TryPop(ThreadpoolTask* task) {
+  size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &cells_[pos & mask_];
+    size_t seq = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff =
+        static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+    if (diff == 0) {
+      if (dequeue_pos_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;  // Empty.
+    } else {
+      pos = dequeue_pos_.load(std::memory_order_relaxed);
+    }
+  }
+  *task = std::move(cell->task);
+  cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+  return true;
+}
+
+bool WorkStealingThreadpool::TaskQueue::LooksEmpty() const {
+  return dequeue_pos_.load(std::memory_order_acquire) >=
+         enqueue_pos_.load(std::memory_order_acquire);
+}
+
+WorkStealingThreadpool::WorkStealingThreadpool(int nb_threads,
+                                               const WaitPolicy& wait_policy)
+    : wait_policy_(wait_policy) {
+  queues_.reserve(nb_threads);
+  for (int i = 0; i < nb_threads; i++) {
+    queues_.push_back(std::make_unique<TaskQueue>(kTaskQueueCapacity));
+  }
+  for (int i = 0; i < nb_threads; i++) {
+    threads_.push_back(
+        RunRegisteredThread("ThreadPool", [this, i]() { WorkerLoop(i); }));
+  }
+}
+
+WorkStealingThreadpool::~WorkStealingThreadpool() {
+  shutdown_.store(true, std::memory_order_release);
+  {
+    // Releasing the mutex makes the parked workers re-evaluate their wakeup
+    // condition, which includes shutdown_.
+    absl::MutexLock m(&park_mutex_);
+  }
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void WorkStealingThreadpool::AddWork(ThreadpoolTask task) {
+  const size_t nb_queues = queues_.size();
+  size_t start;
+  if (current_pool == this) {
+    start = current_worker;
+  } else {
+    start = next_queue_.fetch_add(1, std::memory_order_relaxed) % nb_queues;
+  }
+  bool queued = false;
+  for (size_t i = 0; i < nb_queues; ++i) {
+    if (queues_[(start + i) % nb_queues]->TryPush(task)) {
+      queued = true;
+      break;
+    }
+  }
+  if (!queued) {
+    absl::MutexLock m(&overflow_mutex_);
+    overflow_queue_.push_back(std::move(task));
+    overflow_size_.fetch_add(1, std::memory_order_release);
+  }
+  // Pairs with the fence in Park(): either the parking worker sees the new
+  // task, or we see that it is parked and wake it up.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (parked_workers_.load(std::memory_order_relaxed) > 0) {
+    WakeOneWorker();
+  }
+}
+
+bool WorkStealingThreadpool::TryGetTask(int worker_index,
+                                        ThreadpoolTask* task) {
+  const size_t nb_queues = queues_.size();
+  for (size_t i = 0; i < nb_queues; ++i) {
+    if (queues_[(worker_index + i) % nb_queues]->TryPop(task)) return true;
+  }
+  if (overflow_size_.load(std::memory_order_acquire)) {
+    absl::MutexLock m(&overflow_mutex_);
+    if (!overflow_queue_.empty()) {
+      *task = std::move(overflow_queue_.front());
+      overflow_queue_.pop_front();
+      overflow_size_.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WorkStealingThreadpool::LooksIdle() const {
+  if (overflow_size_.load(std::memory_order_acquire)) return false;
+  for (const auto& queue : queues_) {
+    if (!queue->LooksEmpty()) return false;
+  }
+  return true;
+}
+
+void WorkStealingThreadpool::WorkerLoop(int worker_index) {
+  current_pool = this;
+  current_worker = worker_index;
+  WaitTimeCounters* wait_times = GetWaitTimeCounters("ThreadPool");
+  WaitPolicy policy = wait_policy_;
+  const int64_t min_spins = std::min(kMinSpins, wait_policy_.spin_budget);
+  policy.spin_budget = min_spins;
+  ThreadpoolTask task;
+  bool stop = false;
+  // Tasks added before the destructor was called are still drained, since
+  // every queue was found empty after shutdown_ was set:
+  auto poll = [this, worker_index, &task, &stop]() {
+    const bool shutdown = shutdown_.load(std::memory_order_acquire);
+    if (TryGetTask(worker_index, &task)) return true;
+    stop = shutdown;
+    return shutdown;
+  };
+  auto block = [this, &poll]() {
+    Park();
+    return poll();
+  };
+  while (true) {
+    if (TryGetTask(worker_index, &task)) {
+      task();
+      task = nullptr;
+      continue;
+    }
+    const bool spun = WaitWithPolicy(policy, wait_times, poll, block);
+    if (spun) {
+      policy.spin_budget =
+          std::min(policy.spin_budget * 2, wait_policy_.spin_budget);
+    } else {
+      policy.spin_budget = std::max(policy.spin_budget / 2, min_spins);
+    }
+    if (stop) return;
+    task();
+    task = nullptr;
+  }
+}
+
+void WorkStealingThreadpool::Park() {
+  absl::MutexLock m(&park_mutex_);
+  parked_workers_.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (LooksIdle()) {
+    auto woken = [this]() {
+      return pending_wakeups_ > 0 || shutdown_.load(std::memory_order_acquire);
+    };
+    park_mutex_.AwaitWithTimeout(absl::Condition(&woken), kMaxParkTime);
+  }
+  if (pending_wakeups_ > 0) --pending_wakeups_;
+  parked_workers_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void WorkStealingThreadpool::WakeOneWorker() {
+  absl::MutexLock m(&park_mutex_);
+  if (pending_wakeups_ < parked_workers_.load(std::memory_order_relaxed)) {
+    ++pending_wakeups_;
+  }
+}
 
 }  // namespace distbench
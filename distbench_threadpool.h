@@ -15,36 +15,138 @@
 #ifndef DISTBENCH_DISTBENCH_THREADPOOL_H_
 #define DISTBENCH_DISTBENCH_THREADPOOL_H_
 
+#include <atomic>
+#include <deque>
 #include <queue>
 #include <thread>
 #include <vector>
 
+#include "absl/functional/any_invocable.h"
+#include "absl/status/statusor.h"
 #include "absl/synchronization/notification.h"
 #include "distbench_utils.h"
-
-#ifndef USE_DISTBENCH_THREADPOOL
+#include "distbench_wait_policy.h"
 #include "thpool.h"
-#endif
 
 namespace distbench {
 
-class DistbenchThreadpool {
+// Work items are move-only, so handing them to a threadpool never has to
+// copy the captured state.
+using ThreadpoolTask = absl::AnyInvocable<void()>;
+
+class AbstractThreadpool {
  public:
-  DistbenchThreadpool(int nb_threads);
-  ~DistbenchThreadpool();
-  void AddWork(std::function<void()> function);
+  virtual ~AbstractThreadpool() {}
+
+  // Queues 'task' to be run on one of the threads. All the tasks added before
+  // the threadpool is destroyed are run before the destructor returns.
+  virtual void AddWork(ThreadpoolTask task) = 0;
+};
+
+// Returns a threadpool of 'nb_threads' threads of the given type:
+// - "simple": a single queue protected by a mutex,
+// - "cthread": the C-Thread-Pool library
+//   (https://github.com/Pithikos/C-Thread-Pool),
+// - "work_stealing": lock-free per-thread queues with work stealing,
+// - "": the default selected at build time by --use-distbench-threadpool.
+absl::StatusOr<std::unique_ptr<AbstractThreadpool>> CreateThreadpool(
+    std::string_view threadpool_type, int nb_threads);
+// The same, with the wait policy of the idle threads. The "cthread"
+// threadpool ignores it.
+absl::StatusOr<std::unique_ptr<AbstractThreadpool>> CreateThreadpool(
+    std::string_view threadpool_type, int nb_threads,
+    const WaitPolicy& wait_policy);
+
+// The wait policy of the idle threads when none is given: "simple" busy
+// polls, and "work_stealing" spins up to 4096 times, then blocks.
+WaitPolicy DefaultThreadpoolWaitPolicy(std::string_view threadpool_type);
+
+// Creates the threadpool described by the threadpool_size (default: the
+// number of CPUs), threadpool_type, threadpool_wait_policy and
+// threadpool_wait_spin_budget server_settings of a protocol driver.
+absl::StatusOr<std::unique_ptr<AbstractThreadpool>>
+CreateThreadpoolFromSettings(const ProtocolDriverOptions& pd_opts);
+
+class SimpleThreadpool : public AbstractThreadpool {
+ public:
+  SimpleThreadpool(int nb_threads, const WaitPolicy& wait_policy);
+  ~SimpleThreadpool() override;
+  void AddWork(ThreadpoolTask task) override;
 
  private:
   mutable absl::Mutex mutex_;
-  absl::Notification shutdown_;
+  bool shutdown_ ABSL_GUARDED_BY(mutex_) = false;
   std::vector<std::thread> threads_;
-  std::queue<std::function<void()> > work_queue_;
+  std::queue<ThreadpoolTask> work_queue_ ABSL_GUARDED_BY(mutex_);
+  // Mirror work_queue_ and shutdown_, so that polling does not take the
+  // mutex while there is nothing to do:
+  std::atomic<size_t> queued_tasks_ = 0;
+  std::atomic<bool> shutting_down_ = false;
+};
 
-#ifndef USE_DISTBENCH_THREADPOOL
-  // This is the C-Threadpool from an external library.
-  // https://github.com/Pithikos/C-Thread-Pool
+class CThreadpool : public AbstractThreadpool {
+ public:
+  CThreadpool(int nb_threads);
+  ~CThreadpool() override;
+  void AddWork(ThreadpoolTask task) override;
+
+ private:
   threadpool thpool_;
-#endif
+};
+
+class WorkStealingThreadpool : public AbstractThreadpool {
+ public:
+  WorkStealingThreadpool(int nb_threads, const WaitPolicy& wait_policy);
+  ~WorkStealingThreadpool() override;
+  void AddWork(ThreadpoolTask task) override;
+
+ private:
+  // Bounded lock-free multi-producer/multi-consumer ring, after Dmitry
+  // Vyukov's design. Every worker owns one; tasks are pushed by any thread
+  // (not only the owner, since most work comes from RPC completion threads)
+  // and idle workers steal from the queues of their siblings.
+  class TaskQueue {
+   public:
+    explicit TaskQueue(size_t capacity);
+
+    // Moves 'task' into the queue, unless the queue is full.
+    bool TryPush(ThreadpoolTask& task);
+    bool TryPop(ThreadpoolTask* task);
+    bool LooksEmpty() const;
+
+   private:
+    struct Cell {
+      std::atomic<size_t> sequence;
+      ThreadpoolTask task;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    const size_t mask_;
+    alignas(64) std::atomic<size_t> enqueue_pos_ = 0;
+    alignas(64) std::atomic<size_t> dequeue_pos_ = 0;
+  };
+
+  void WorkerLoop(int worker_index);
+  bool TryGetTask(int worker_index, ThreadpoolTask* task);
+  bool LooksIdle() const;
+  void Park();
+  void WakeOneWorker();
+
+  const WaitPolicy wait_policy_;
+  std::vector<std::unique_ptr<TaskQueue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<size_t> next_queue_ = 0;
+  std::atomic<bool> shutdown_ = false;
+
+  // Tasks that did not fit in any of the queues.
+  absl::Mutex overflow_mutex_;
+  std::deque<ThreadpoolTask> overflow_queue_ ABSL_GUARDED_BY(overflow_mutex_);
+  std::atomic<size_t> overflow_size_ = 0;
+
+  // Workers that ran out of work sleep here, after spinning for a while.
+  absl::Mutex park_mutex_;
+  int pending_wakeups_ ABSL_GUARDED_BY(park_mutex_) = 0;
+  std::atomic<int> parked_workers_ = 0;
 };
 
 }  // namespace distbench
@@ -14,39 +14,164 @@
 
 #include "distbench_threadpool.h"
 
+#include "benchmark/benchmark.h"
 #include "gtest/gtest.h"
 #include "gtest_utils.h"
 
-namespace {
+namespace distbench {
 
-TEST(DistBenchThreadPool, Constructor) {
-  distbench::DistbenchThreadpool dtp{4};
+class DistBenchThreadPool : public testing::TestWithParam<std::string> {};
+
+TEST_P(DistBenchThreadPool, Constructor) {
+  auto dtp = CreateThreadpool(GetParam(), 4);
+  ASSERT_OK(dtp.status());
 };
 
-TEST(DistBenchThreadPool, PerformSimpleWork) {
+TEST_P(DistBenchThreadPool, PerformSimpleWork) {
   std::atomic<int> work_counter = 0;
   {
-    distbench::DistbenchThreadpool dtp{4};
+    auto dtp = CreateThreadpool(GetParam(), 4);
+    ASSERT_OK(dtp.status());
     for (int i = 0; i < 1000; i++) {
-      dtp.AddWork([&]() { ++work_counter; });
+      dtp.value()->AddWork([&]() { ++work_counter; });
     }
   }  // Complete the work of dtp.
   ASSERT_EQ(work_counter, 1000);
 };
 
-TEST(DistBenchThreadPool, ParallelAddTest) {
+TEST_P(DistBenchThreadPool, ParallelAddTest) {
   std::atomic<int> work_counter = 0;
   {
-    distbench::DistbenchThreadpool dtp_work_performer{4};
+    auto dtp_work_performer = CreateThreadpool(GetParam(), 4);
+    ASSERT_OK(dtp_work_performer.status());
     {
-      distbench::DistbenchThreadpool dtp_work_generator{4};
+      auto dtp_work_generator = CreateThreadpool(GetParam(), 4);
+      ASSERT_OK(dtp_work_generator.status());
       for (int i = 0; i < 1000; i++) {
-        dtp_work_generator.AddWork(
-            [&]() { dtp_work_performer.AddWork([&]() { ++work_counter; }); });
+        dtp_work_generator.value()->AddWork([&]() {
+          dtp_work_performer.value()->AddWork([&]() { ++work_counter; });
+        });
       }
     }  // Complete the work of dtp_work_generator.
   }    // Complete the work of dtp_work_performer.
   ASSERT_EQ(work_counter, 1000);
 }
 
-}  // namespace
+TEST_P(DistBenchThreadPool, RecursiveAddTest) {
+  std::atomic<int> work_counter = 0;
+  {
+    auto dtp = CreateThreadpool(GetParam(), 4);
+    ASSERT_OK(dtp.status());
+    AbstractThreadpool* pool = dtp.value().get();
+    for (int i = 0; i < 100; i++) {
+      pool->AddWork([&]() {
+        for (int j = 0; j < 100; j++) {
+          pool->AddWork([&]() { ++work_counter; });
+        }
+      });
+    }
+  }  // Complete the work of dtp, including the work it added itself.
+  ASSERT_EQ(work_counter, 10000);
+}
+
+TEST_P(DistBenchThreadPool, MoveOnlyTask) {
+  std::atomic<int> work_counter = 0;
+  {
+    auto dtp = CreateThreadpool(GetParam(), 4);
+    ASSERT_OK(dtp.status());
+    auto increment = std::make_unique<int>(3);
+    dtp.value()->AddWork([&work_counter, increment = std::move(increment)]() {
+      work_counter += *increment;
+    });
+  }
+  ASSERT_EQ(work_counter, 3);
+}
+
+TEST(DistBenchThreadPoolConfig, InvalidType) {
+  auto dtp = CreateThreadpool("plenty_of_threads", 4);
+  ASSERT_FALSE(dtp.ok());
+}
+
+TEST(DistBenchThreadPoolConfig, InvalidSize) {
+  auto dtp = CreateThreadpool("simple", 0);
+  ASSERT_FALSE(dtp.ok());
+}
+
+INSTANTIATE_TEST_SUITE_P(DistBenchThreadPoolTests, DistBenchThreadPool,
+                         testing::Values("", "simple", "cthread",
+                                         "work_stealing"));
+
+// Adds state.range(0) tasks from a single thread, and waits for all of them
+// to complete.
+void ThreadpoolThroughput(benchmark::State& state, std::string type) {
+  auto maybe_dtp = CreateThreadpool(type, 4);
+  ASSERT_OK(maybe_dtp.status());
+  auto& dtp = maybe_dtp.value();
+  const int nb_tasks = state.range(0);
+  for (auto s : state) {
+    std::atomic<int> work_counter = 0;
+    for (int i = 0; i < nb_tasks; i++) {
+      dtp->AddWork([&]() { ++work_counter; });
+    }
+    while (work_counter != nb_tasks) {
+      sched_yield();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * nb_tasks);
+}
+
+// Adds tasks from inside the pool, as the DistBenchEngine does when fanning
+// out from handler threads.
+void ThreadpoolFanout(benchmark::State& state, std::string type) {
+  auto maybe_dtp = CreateThreadpool(type, 4);
+  ASSERT_OK(maybe_dtp.status());
+  auto& dtp = maybe_dtp.value();
+  const int nb_tasks = state.range(0);
+  for (auto s : state) {
+    std::atomic<int> work_counter = 0;
+    for (int i = 0; i < 4; i++) {
+      dtp->AddWork([&]() {
+        for (int j = 0; j < nb_tasks / 4; j++) {
+          dtp->AddWork([&]() { ++work_counter; });
+        }
+      });
+    }
+    while (work_counter != nb_tasks / 4 * 4) {
+      sched_yield();
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * (nb_tasks / 4 * 4));
+}
+
+void BM_SimpleThroughput(benchmark::State& state) {
+  ThreadpoolThroughput(state, "simple");
+}
+
+void BM_CThreadThroughput(benchmark::State& state) {
+  ThreadpoolThroughput(state, "cthread");
+}
+
+void BM_WorkStealingThroughput(benchmark::State& state) {
+  ThreadpoolThroughput(state, "work_stealing");
+}
+
+void BM_SimpleFanout(benchmark::State& state) {
+  ThreadpoolFanout(state, "simple");
+}
+
+void BM_CThreadFanout(benchmark::State& state) {
+  ThreadpoolFanout(state, "cthread");
+}
+
+void BM_WorkStealingFanout(benchmark::State& state) {
+  ThreadpoolFanout(state, "work_stealing");
+}
+
+BENCHMARK(BM_SimpleThroughput)->Arg(1000)->Arg(100000)->UseRealTime();
+BENCHMARK(BM_CThreadThroughput)->Arg(1000)->Arg(100000)->UseRealTime();
+BENCHMARK(BM_WorkStealingThroughput)->Arg(1000)->Arg(100000)->UseRealTime();
+BENCHMARK(BM_SimpleFanout)->Arg(1000)->Arg(100000)->UseRealTime();
+BENCHMARK(BM_CThreadFanout)->Arg(1000)->Arg(100000)->UseRealTime();
+BENCHMARK(BM_WorkStealingFanout)->Arg(1000)->Arg(100000)->UseRealTime();
+
+}  // namespace distbench
@@ -15,15 +15,27 @@
 #include "distbench_utils.h"
 
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
 #include <fstream>
+#include <map>
+#include <set>
 #include <streambuf>
 
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "absl/synchronization/mutex.h"
 #include "distbench_netutils.h"
 #include "glog/logging.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
@@ -65,9 +77,326 @@ std::shared_ptr<grpc::ServerCredentials> MakeServerCredentials() {
   return grpc::InsecureServerCredentials();
 }
 
+namespace {
+
+// Set by ThreadPlacerScope, and inherited by the registered threads:
+thread_local ThreadPlacer* current_thread_placer = nullptr;
+
+absl::StatusOr<std::vector<int>> ReadCpuListFile(const std::string& path) {
+  std::ifstream in(path);
+  std::string cpu_list;
+  if (!(in >> cpu_list)) {
+    return absl::NotFoundError(absl::StrCat("Could not read ", path));
+  }
+  return ParseCpuList(cpu_list);
+}
+
+absl::StatusOr<std::vector<int>> NumaNodeCpus(int numa_node) {
+  return ReadCpuListFile(absl::StrCat("/sys/devices/system/node/node",
+                                      numa_node, "/cpulist"));
+}
+
+// Returns -1 if the NUMA node is unknown, e.g. on single socket machines.
+int NumaNodeForDevice(std::string_view netdev) {
+  std::string device(netdev);
+  if (device.empty()) {
+    auto maybe_ip = IpAddressForDevice(netdev);
+    if (!maybe_ip.ok()) return -1;
+    device = maybe_ip.value().netdevice();
+  }
+  std::ifstream in(absl::StrCat("/sys/class/net/", device, "/device/numa_node"));
+  int numa_node = -1;
+  if (!(in >> numa_node)) return -1;
+  return numa_node;
+}
+
+std::vector<int> CpusExcept(std::vector<int> cpus,
+                            const std::vector<int>& excluded) {
+  cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+                            [&](int cpu) {
+                              return std::find(excluded.begin(),
+                                               excluded.end(),
+                                               cpu) != excluded.end();
+                            }),
+             cpus.end());
+  return cpus;
+}
+
+}  // anonymous namespace
+
+ThreadPlacer* CurrentThreadPlacer() {
+  static auto* process_thread_placer = new ThreadPlacer;
+  return current_thread_placer ? current_thread_placer : process_thread_placer;
+}
+
+ThreadPlacerScope::ThreadPlacerScope(ThreadPlacer* placer)
+    : previous_placer_(current_thread_placer) {
+  current_thread_placer = placer;
+}
+
+ThreadPlacerScope::~ThreadPlacerScope() {
+  current_thread_placer = previous_placer_;
+}
+
 std::thread RunRegisteredThread(const std::string& thread_name,
                                 std::function<void()> f) {
-  return std::thread([=]() { f(); });
+  return std::thread([=, placer = CurrentThreadPlacer()]() {
+    // Named after its role, e.g. for the thread_role perf counters; the
+    // kernel keeps the first 15 characters:
+    pthread_setname_np(pthread_self(), thread_name.substr(0, 15).c_str());
+    current_thread_placer = placer;
+    std::shared_ptr<void> registration =
+        placer->RegisterCurrentThread(thread_name);
+    f();
+  });
+}
+
+void ParallelFor(size_t n, const std::function<void(size_t)>& fn) {
+  size_t nb_threads =
+      std::min<size_t>(n, std::max(1U, std::thread::hardware_concurrency()));
+  std::atomic<size_t> next_index = 0;
+  auto worker = [&]() {
+    for (size_t i = next_index++; i < n; i = next_index++) {
+      fn(i);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nb_threads; ++i) {
+    threads.push_back(RunRegisteredThread("ParallelFor", worker));
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+absl::StatusOr<ThreadPlacer::RuleMap> ThreadPlacer::ParseRules(
+    std::string_view rules, std::string_view netdev,
+    const std::vector<int>& reserved_cpus) {
+  RuleMap ret;
+  for (absl::string_view rule :
+       absl::StrSplit(rules, ';', absl::SkipWhitespace())) {
+    std::vector<absl::string_view> parts =
+        absl::StrSplit(rule, absl::MaxSplits('=', 1));
+    if (parts.size() != 2 || parts[0].empty()) {
+      return absl::InvalidArgumentError(absl::StrCat(
+          "Thread placement rules look like thread_name=cpus, not: ", rule));
+    }
+    Rule placement_rule;
+    placement_rule.spec = std::string(parts[1]);
+    absl::string_view cpus = parts[1];
+    placement_rule.pin = absl::ConsumePrefix(&cpus, "pin:");
+    absl::StatusOr<std::vector<int>> maybe_cpus;
+    bool explicit_cpus = false;
+    int numa_node;
+    if (cpus == "nic") {
+      numa_node = NumaNodeForDevice(netdev);
+      if (numa_node < 0) {
+        LOG(WARNING) << "NUMA node of '" << netdev
+                     << "' is unknown; not restricting " << parts[0];
+        maybe_cpus = ReadCpuListFile("/sys/devices/system/cpu/online");
+      } else {
+        maybe_cpus = NumaNodeCpus(numa_node);
+      }
+    } else if (absl::ConsumePrefix(&cpus, "numa")) {
+      if (!absl::SimpleAtoi(cpus, &numa_node) || numa_node < 0) {
+        return absl::InvalidArgumentError(
+            absl::StrCat("Invalid NUMA node in thread placement rule: ", rule));
+      }
+      maybe_cpus = NumaNodeCpus(numa_node);
+    } else {
+      explicit_cpus = true;
+      maybe_cpus = ParseCpuList(cpus);
+    }
+    if (!maybe_cpus.ok()) return maybe_cpus.status();
+    placement_rule.cpus = explicit_cpus
+                              ? std::move(maybe_cpus.value())
+                              : CpusExcept(std::move(maybe_cpus.value()),
+                                           reserved_cpus);
+    if (placement_rule.cpus.empty()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Thread placement rule leaves no CPU: ", rule));
+    }
+    ret[std::string(parts[0])] = std::move(placement_rule);
+  }
+  return ret;
+}
+
+void ThreadPlacer::PlaceCurrentThread(const std::string& thread_name) {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  {
+    absl::MutexLock m(&mutex_);
+    std::vector<int> cpus;
+    std::string spec;
+    auto it = rules_.find(thread_name);
+    if (it == rules_.end()) it = rules_.find("*");
+    if (it != rules_.end()) {
+      Rule& rule = it->second;
+      spec = rule.spec;
+      if (rule.pin) {
+        cpus.push_back(rule.cpus[rule.next_cpu++ % rule.cpus.size()]);
+      } else {
+        cpus = rule.cpus;
+      }
+    } else if (!unreserved_cpus_.empty()) {
+      spec = "unreserved";
+      cpus = unreserved_cpus_;
+    } else {
+      return;
+    }
+    PlacedThreads& placed = placed_threads_[thread_name];
+    placed.rule = spec;
+    ++placed.thread_count;
+    for (int cpu : cpus) {
+      placed.cpus.insert(cpu);
+      if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &cpu_set);
+    }
+  }
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  if (error) {
+    LOG(WARNING) << strerror(error) << " placing a " << thread_name
+                 << " thread";
+  }
+}
+
+std::shared_ptr<void> ThreadPlacer::RegisterCurrentThread(
+    const std::string& thread_name) {
+  PlaceCurrentThread(thread_name);
+  const pid_t tid = syscall(SYS_gettid);
+  {
+    absl::MutexLock m(&live_threads_->mutex);
+    live_threads_->tids.insert(tid);
+  }
+  return std::shared_ptr<void>(
+      nullptr, [live_threads = live_threads_, tid](void*) {
+        absl::MutexLock m(&live_threads->mutex);
+        live_threads->tids.erase(tid);
+      });
+}
+
+std::vector<pid_t> ThreadPlacer::ThreadIds() {
+  absl::MutexLock m(&live_threads_->mutex);
+  return std::vector<pid_t>(live_threads_->tids.begin(),
+                            live_threads_->tids.end());
+}
+
+absl::Status ThreadPlacer::SetNodeRules(std::string_view rules,
+                                        std::string_view reserved_cpus,
+                                        std::string_view netdev) {
+  std::vector<int> reserved;
+  std::vector<int> unreserved;
+  if (!reserved_cpus.empty()) {
+    auto maybe_reserved = ParseCpuList(reserved_cpus);
+    if (!maybe_reserved.ok()) return maybe_reserved.status();
+    reserved = std::move(maybe_reserved.value());
+    auto maybe_online = ReadCpuListFile("/sys/devices/system/cpu/online");
+    if (!maybe_online.ok()) return maybe_online.status();
+    unreserved = CpusExcept(std::move(maybe_online.value()), reserved);
+    if (unreserved.empty()) {
+      return absl::InvalidArgumentError("Cannot reserve all the CPUs");
+    }
+  }
+  auto maybe_rules = ParseRules(rules, netdev, reserved);
+  if (!maybe_rules.ok()) return maybe_rules.status();
+  int nic_numa_node = NumaNodeForDevice(netdev);
+
+  absl::MutexLock m(&mutex_);
+  node_rules_ = std::move(maybe_rules.value());
+  rules_ = node_rules_;
+  reserved_cpus_ = std::move(reserved);
+  unreserved_cpus_ = std::move(unreserved);
+  nic_numa_node_ = nic_numa_node;
+  placed_threads_.clear();
+  return absl::OkStatus();
+}
+
+absl::Status ThreadPlacer::AddRules(std::string_view rules,
+                                    std::string_view netdev) {
+  std::vector<int> reserved;
+  {
+    absl::MutexLock m(&mutex_);
+    reserved = reserved_cpus_;
+  }
+  auto maybe_rules = ParseRules(rules, netdev, reserved);
+  if (!maybe_rules.ok()) return maybe_rules.status();
+  absl::MutexLock m(&mutex_);
+  for (auto& [thread_name, rule] : maybe_rules.value()) {
+    rules_[thread_name] = std::move(rule);
+  }
+  return absl::OkStatus();
+}
+
+void ThreadPlacer::Reset() {
+  absl::MutexLock m(&mutex_);
+  rules_ = node_rules_;
+  placed_threads_.clear();
+}
+
+ThreadPlacementLog ThreadPlacer::GetLog() {
+  absl::MutexLock m(&mutex_);
+  ThreadPlacementLog log;
+  for (const auto& [thread_name, placed] : placed_threads_) {
+    ThreadPlacement* placement = log.add_threads();
+    placement->set_thread_name(thread_name);
+    placement->set_rule(placed.rule);
+    placement->set_cpus(FormatCpuList(
+        std::vector<int>(placed.cpus.begin(), placed.cpus.end())));
+    placement->set_thread_count(placed.thread_count);
+  }
+  if (!reserved_cpus_.empty()) {
+    log.set_reserved_cpus(FormatCpuList(reserved_cpus_));
+  }
+  log.set_nic_numa_node(nic_numa_node_);
+  return log;
+}
+
+absl::StatusOr<std::vector<int>> ParseCpuList(absl::string_view cpu_list) {
+  std::vector<int> cpus;
+  for (absl::string_view range : absl::StrSplit(cpu_list, ',')) {
+    std::vector<absl::string_view> bounds = absl::StrSplit(range, '-');
+    int first, last;
+    if (bounds.size() > 2 || !absl::SimpleAtoi(bounds.front(), &first) ||
+        !absl::SimpleAtoi(bounds.back(), &last) || first < 0 ||
+        last < first) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid CPU list: '", cpu_list, "'"));
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+absl::Status SetCurrentThreadAffinity(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    return absl::InvalidArgumentError(absl::StrCat("Invalid CPU: ", cpu));
+  }
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  CPU_SET(cpu, &cpu_set);
+  int error = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+  if (error) {
+    return absl::UnknownError(absl::StrCat(
+        strerror(error), " pinning the thread to CPU ", cpu));
+  }
+  return absl::OkStatus();
+}
+
+std::string FormatCpuList(std::vector<int> cpus) {
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  std::string ret;
+  for (size_t i = 0; i < cpus.size();) {
+    size_t j = i;
+    while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+    if (!ret.empty()) ret += ",";
+    absl::StrAppend(&ret, cpus[i]);
+    if (j > i) absl::StrAppend(&ret, "-", cpus[j]);
+    i = j + 1;
+  }
+  return ret;
 }
 
 void InitLibs(const char* argv0) {
@@ -399,6 +728,50 @@ absl::StatusOr<TestSequence> ParseTestSequenceProtoFromFile(
       "modes");
 }
 
+absl::StatusOr<TestSequenceResults> ParseTestSequenceResultsFromFile(
+    const std::string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "Error opening the result proto file: ", filename, "; ",
+        std::strerror(errno)));
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) < 0) {
+    close(fd);
+    return absl::InvalidArgumentError(
+        absl::StrCat("Error reading the result proto file: ", filename, "; ",
+                     std::strerror(errno)));
+  }
+  size_t size = file_stat.st_size;
+  void* data = nullptr;
+  if (size) {
+    data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Error mapping the result proto file: ", filename, "; ",
+                     std::strerror(errno)));
+  }
+  if (size) madvise(data, size, MADV_SEQUENTIAL);
+
+  TestSequenceResults results;
+  bool parsed = results.ParseFromArray(data, size);
+  if (!parsed) {
+    results.Clear();
+    ::google::protobuf::io::ArrayInputStream stream(data, size);
+    parsed = ::google::protobuf::TextFormat::Parse(&stream, &results);
+  }
+  if (size) munmap(data, size);
+  if (!parsed) {
+    return absl::InvalidArgumentError(
+        "Error parsing the TestSequenceResults proto file (both in binary "
+        "and text modes)");
+  }
+  return results;
+}
+
 // Write TestSequenceResults protos.
 absl::Status SaveResultProtoToFile(
     const std::string& filename, const distbench::TestSequenceResults& result) {
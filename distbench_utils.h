@@ -17,10 +17,13 @@
 
 #include <sys/resource.h>
 
+#include <map>
 #include <memory>
+#include <set>
 #include <thread>
 
 #include "absl/status/statusor.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/synchronization/notification.h"
 #include "distbench.pb.h"
 #include "distbench_netutils.h"
@@ -63,6 +66,101 @@ std::shared_ptr<grpc::ChannelCredentials> MakeChannelCredentials();
 std::shared_ptr<grpc::ServerCredentials> MakeServerCredentials();
 std::thread RunRegisteredThread(const std::string& thread_name,
                                 std::function<void()> f);
+// Runs fn(0) .. fn(n - 1) on up to one thread per core.
+void ParallelFor(size_t n, const std::function<void(size_t)>& fn);
+
+// Parses a list of CPUs such as "0-3,8,10-11".
+absl::StatusOr<std::vector<int>> ParseCpuList(absl::string_view cpu_list);
+// Pins the calling thread to the given CPU.
+absl::Status SetCurrentThreadAffinity(int cpu);
+// Formats a list of CPUs as ParseCpuList expects it.
+std::string FormatCpuList(std::vector<int> cpus);
+
+// Places the threads started by RunRegisteredThread by rules keyed by their
+// name (e.g. "GrpcClientCq", "ThreadPool", or "*" for any thread), such as
+// "GrpcClientCq=pin:2-5;ThreadPool=nic;*=numa1". The CPUs of a rule are a
+// CPU list, "numaN" (the CPUs of NUMA node N) or "nic" (the CPUs of the NUMA
+// node of netdev). With "pin:", each thread is pinned to the next one of the
+// CPUs in turn; otherwise the threads may run on any of them. The reserved
+// CPUs are left to the rules that list them explicitly.
+//
+// Each node manager has its own, so that the nodes that share a process keep
+// their own rules and report their own threads.
+class ThreadPlacer {
+ public:
+  // Sets the rules of the node, and forgets the ones added since.
+  absl::Status SetNodeRules(std::string_view rules,
+                            std::string_view reserved_cpus,
+                            std::string_view netdev);
+  // Adds the rules of a protocol driver, replacing those for the same
+  // threads, until Reset.
+  absl::Status AddRules(std::string_view rules, std::string_view netdev);
+  // Goes back to the rules of the node, and forgets the placed threads.
+  void Reset();
+  // Returns where the threads were placed since the last reset.
+  ThreadPlacementLog GetLog();
+  // Applies the rule of the thread, if any, to the calling thread, which
+  // then counts among the ThreadIds until the returned handle is released.
+  // The handle may outlive the placer.
+  std::shared_ptr<void> RegisterCurrentThread(const std::string& thread_name);
+  // The threads registered with the placer that are still running, e.g. to
+  // count the events of the threads of one node, see PerfCounterSet:
+  std::vector<pid_t> ThreadIds();
+
+ private:
+  struct Rule {
+    // As written after "thread_name=":
+    std::string spec;
+    bool pin = false;
+    std::vector<int> cpus;
+    // The CPU of the next pinned thread:
+    size_t next_cpu = 0;
+  };
+  struct PlacedThreads {
+    std::string rule;
+    std::set<int> cpus;
+    int64_t thread_count = 0;
+  };
+  using RuleMap = std::map<std::string, Rule, std::less<>>;
+  struct LiveThreads {
+    absl::Mutex mutex;
+    std::set<pid_t> tids ABSL_GUARDED_BY(mutex);
+  };
+
+  static absl::StatusOr<RuleMap> ParseRules(
+      std::string_view rules, std::string_view netdev,
+      const std::vector<int>& reserved_cpus);
+  void PlaceCurrentThread(const std::string& thread_name);
+
+  absl::Mutex mutex_;
+  RuleMap node_rules_ ABSL_GUARDED_BY(mutex_);
+  RuleMap rules_ ABSL_GUARDED_BY(mutex_);
+  std::vector<int> reserved_cpus_ ABSL_GUARDED_BY(mutex_);
+  // Where the threads without a rule go, if some CPUs are reserved:
+  std::vector<int> unreserved_cpus_ ABSL_GUARDED_BY(mutex_);
+  int nic_numa_node_ ABSL_GUARDED_BY(mutex_) = -1;
+  std::map<std::string, PlacedThreads> placed_threads_
+      ABSL_GUARDED_BY(mutex_);
+  // Shared with the handles of the registered threads:
+  const std::shared_ptr<LiveThreads> live_threads_ =
+      std::make_shared<LiveThreads>();
+};
+
+// Returns the ThreadPlacer of the calling thread, which RunRegisteredThread
+// passes on to the threads it starts. The threads started outside of any
+// ThreadPlacerScope share a process-wide one.
+ThreadPlacer* CurrentThreadPlacer();
+
+// Makes the calling thread, and the threads it starts meanwhile, use placer
+// until the scope ends.
+class ThreadPlacerScope {
+ public:
+  explicit ThreadPlacerScope(ThreadPlacer* placer);
+  ~ThreadPlacerScope();
+
+ private:
+  ThreadPlacer* previous_placer_;
+};
 
 std::string ServiceInstanceName(std::string_view service_type, int instance);
 std::map<std::string, int> EnumerateServiceSizes(
@@ -136,6 +234,11 @@ absl::StatusOr<distbench::TestSequence> ParseTestSequenceTextProto(
 absl::StatusOr<TestSequence> ParseTestSequenceProtoFromFile(
     const std::string& filename);
 
+// Read TestSequenceResults protos, binary or text. The file is mapped
+// rather than copied into a string, as results can be large.
+absl::StatusOr<TestSequenceResults> ParseTestSequenceResultsFromFile(
+    const std::string& filename);
+
 // Write TestSequenceResults protos.
 absl::Status SaveResultProtoToFile(
     const std::string& filename, const distbench::TestSequenceResults& result);
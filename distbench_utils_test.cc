@@ -0,0 +1,123 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_utils.h"
+
+#include "gtest/gtest.h"
+#include "gtest_utils.h"
+
+namespace distbench {
+
+namespace {
+
+void RunThread(const std::string& thread_name) {
+  RunRegisteredThread(thread_name, []() {}).join();
+}
+
+}  // anonymous namespace
+
+TEST(CpuList, ParseAndFormat) {
+  auto maybe_cpus = ParseCpuList("0-3,8,10-11");
+  ASSERT_OK(maybe_cpus.status());
+  EXPECT_EQ(maybe_cpus.value(), std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_EQ(FormatCpuList(maybe_cpus.value()), "0-3,8,10-11");
+
+  EXPECT_EQ(FormatCpuList({11, 3, 0, 2, 1, 3, 10}), "0-3,10-11");
+  EXPECT_EQ(FormatCpuList({5}), "5");
+  EXPECT_EQ(FormatCpuList({}), "");
+
+  EXPECT_FALSE(ParseCpuList("").ok());
+  EXPECT_FALSE(ParseCpuList("3-1").ok());
+  EXPECT_FALSE(ParseCpuList("1-2-3").ok());
+  EXPECT_FALSE(ParseCpuList("-1").ok());
+  EXPECT_FALSE(ParseCpuList("a").ok());
+}
+
+TEST(ThreadPlacer, InvalidRules) {
+  ThreadPlacer placer;
+  EXPECT_FALSE(placer.SetNodeRules("ThreadPool", "", "").ok());
+  EXPECT_FALSE(placer.SetNodeRules("=0", "", "").ok());
+  EXPECT_FALSE(placer.SetNodeRules("ThreadPool=", "", "").ok());
+  EXPECT_FALSE(placer.SetNodeRules("ThreadPool=pin:", "", "").ok());
+  EXPECT_FALSE(placer.SetNodeRules("ThreadPool=numa", "", "").ok());
+  EXPECT_FALSE(placer.SetNodeRules("ThreadPool=numa-1", "", "").ok());
+  EXPECT_FALSE(placer.SetNodeRules("ThreadPool=2-1", "", "").ok());
+  EXPECT_FALSE(placer.AddRules("ThreadPool=x", "").ok());
+  EXPECT_TRUE(placer.SetNodeRules("ThreadPool=0;*=pin:0;", "", "").ok());
+}
+
+TEST(ThreadPlacer, PlacesByThreadName) {
+  ThreadPlacer placer;
+  ASSERT_OK(placer.SetNodeRules("Pinned=pin:0;Floating=0", "", ""));
+  {
+    ThreadPlacerScope placer_scope(&placer);
+    RunThread("Pinned");
+    RunThread("Pinned");
+    RunThread("Floating");
+    RunThread("Unplaced");
+  }
+  ThreadPlacementLog log = placer.GetLog();
+  ASSERT_EQ(log.threads_size(), 2);
+  EXPECT_EQ(log.threads(0).thread_name(), "Floating");
+  EXPECT_EQ(log.threads(0).rule(), "0");
+  EXPECT_EQ(log.threads(0).cpus(), "0");
+  EXPECT_EQ(log.threads(0).thread_count(), 1);
+  EXPECT_EQ(log.threads(1).thread_name(), "Pinned");
+  EXPECT_EQ(log.threads(1).rule(), "pin:0");
+  EXPECT_EQ(log.threads(1).thread_count(), 2);
+
+  // The rules added by the protocol drivers last until the reset:
+  ASSERT_OK(placer.AddRules("Unplaced=0", ""));
+  {
+    ThreadPlacerScope placer_scope(&placer);
+    RunThread("Unplaced");
+  }
+  EXPECT_EQ(placer.GetLog().threads_size(), 3);
+  placer.Reset();
+  EXPECT_EQ(placer.GetLog().threads_size(), 0);
+  {
+    ThreadPlacerScope placer_scope(&placer);
+    RunThread("Unplaced");
+  }
+  EXPECT_EQ(placer.GetLog().threads_size(), 0);
+}
+
+// The nodes that share a process each place their own threads, and the
+// threads started by a registered thread keep the placer of their parent:
+TEST(ThreadPlacer, PlacersAreIndependent) {
+  ThreadPlacer placer1;
+  ThreadPlacer placer2;
+  ASSERT_OK(placer1.SetNodeRules("Worker=0", "", ""));
+  ASSERT_OK(placer2.SetNodeRules("", "", ""));
+  {
+    ThreadPlacerScope placer_scope(&placer2);
+    RunThread("Worker");
+  }
+  EXPECT_EQ(placer1.GetLog().threads_size(), 0);
+  EXPECT_EQ(placer2.GetLog().threads_size(), 0);
+
+  std::thread parent;
+  {
+    ThreadPlacerScope placer_scope(&placer1);
+    parent = RunRegisteredThread("Parent", []() { RunThread("Worker"); });
+  }
+  parent.join();
+  ThreadPlacementLog log = placer1.GetLog();
+  ASSERT_EQ(log.threads_size(), 1);
+  EXPECT_EQ(log.threads(0).thread_name(), "Worker");
+  EXPECT_EQ(placer2.GetLog().threads_size(), 0);
+  EXPECT_NE(CurrentThreadPlacer(), &placer1);
+}
+
+}  // namespace distbench
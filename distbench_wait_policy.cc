@@ -0,0 +1,130 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_wait_policy.h"
+
+#include <map>
+#include <memory>
+#include <string>
+
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "distbench_utils.h"
+
+namespace distbench {
+
+namespace {
+
+absl::Mutex wait_time_counters_mutex(absl::kConstInit);
+
+using WaitTimeCountersByRole =
+    std::map<std::string, std::unique_ptr<WaitTimeCounters>, std::less<>>;
+
+// By node, i.e. by the ThreadPlacer of the node manager, then by role.
+// Never freed, as the threads may record their waits until the very end;
+// a node whose placer reuses the address of a gone one starts from its
+// counts, which the deltas of WaitTimesLogDelta cancel out.
+std::map<const ThreadPlacer*, WaitTimeCountersByRole>& WaitTimeCountersByNode()
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(wait_time_counters_mutex) {
+  static auto* counters =
+      new std::map<const ThreadPlacer*, WaitTimeCountersByRole>;
+  return *counters;
+}
+
+}  // anonymous namespace
+
+absl::StatusOr<WaitPolicy> GetWaitPolicy(
+    const ::google::protobuf::RepeatedPtrField<NamedSetting>& settings,
+    std::string_view prefix, WaitPolicy default_policy) {
+  WaitPolicy policy = default_policy;
+  const std::string mode_name = absl::StrCat(prefix, "wait_policy");
+  const std::string mode = GetNamedSettingString(settings, mode_name, "");
+  if (mode == "block") {
+    policy.mode = WaitPolicy::kBlock;
+  } else if (mode == "busy_poll") {
+    policy.mode = WaitPolicy::kBusyPoll;
+  } else if (mode == "spin") {
+    policy.mode = WaitPolicy::kSpinThenBlock;
+  } else if (!mode.empty()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat(mode_name, " must be block, busy_poll or spin, not ",
+                     mode));
+  }
+  const std::string budget_name = absl::StrCat(prefix, "wait_spin_budget");
+  policy.spin_budget =
+      GetNamedSettingInt64(settings, budget_name, policy.spin_budget);
+  if (policy.spin_budget < 0) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        budget_name, " (", policy.spin_budget, ") must not be negative."));
+  }
+  return policy;
+}
+
+WaitTimes WaitTimeCounters::ToProto() const {
+  WaitTimes times;
+  times.set_spin_ns(spin_ns_.load(std::memory_order_relaxed));
+  times.set_blocked_ns(blocked_ns_.load(std::memory_order_relaxed));
+  times.set_spin_wakeups(spin_wakeups_.load(std::memory_order_relaxed));
+  times.set_blocked_waits(blocked_waits_.load(std::memory_order_relaxed));
+  return times;
+}
+
+WaitTimeCounters* GetWaitTimeCounters(std::string_view thread_role) {
+  absl::MutexLock m(&wait_time_counters_mutex);
+  auto& counters_by_role = WaitTimeCountersByNode()[CurrentThreadPlacer()];
+  auto it = counters_by_role.find(thread_role);
+  if (it == counters_by_role.end()) {
+    it = counters_by_role
+             .emplace(std::string(thread_role),
+                      std::make_unique<WaitTimeCounters>())
+             .first;
+  }
+  return it->second.get();
+}
+
+WaitTimesLog GetWaitTimesLog(const ThreadPlacer* node) {
+  WaitTimesLog log;
+  absl::MutexLock m(&wait_time_counters_mutex);
+  const auto& counters_by_node = WaitTimeCountersByNode();
+  auto it = counters_by_node.find(node);
+  if (it == counters_by_node.end()) {
+    return log;
+  }
+  for (const auto& [role, counters] : it->second) {
+    (*log.mutable_thread_roles())[role] = counters->ToProto();
+  }
+  return log;
+}
+
+WaitTimesLog WaitTimesLogDelta(const WaitTimesLog& end,
+                               const WaitTimesLog& start) {
+  WaitTimesLog delta;
+  for (const auto& [role, end_times] : end.thread_roles()) {
+    WaitTimes times = end_times;
+    auto it = start.thread_roles().find(role);
+    if (it != start.thread_roles().end()) {
+      times.set_spin_ns(times.spin_ns() - it->second.spin_ns());
+      times.set_blocked_ns(times.blocked_ns() - it->second.blocked_ns());
+      times.set_spin_wakeups(times.spin_wakeups() - it->second.spin_wakeups());
+      times.set_blocked_waits(times.blocked_waits() -
+                              it->second.blocked_waits());
+    }
+    if (times.spin_wakeups() || times.blocked_waits()) {
+      (*delta.mutable_thread_roles())[role] = times;
+    }
+  }
+  return delta;
+}
+
+}  // namespace distbench
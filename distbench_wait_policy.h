@@ -0,0 +1,130 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_DISTBENCH_WAIT_POLICY_H_
+#define DISTBENCH_DISTBENCH_WAIT_POLICY_H_
+
+#include <sched.h>
+
+#include <atomic>
+#include <string_view>
+
+#include "absl/status/statusor.h"
+#include "absl/time/clock.h"
+#include "distbench.pb.h"
+#include "distbench_utils.h"
+#include "traffic_config.pb.h"
+
+namespace distbench {
+
+inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// How a thread waits for its next event, e.g. a completion or a task:
+// - kBlock: blocks right away, e.g. in the kernel,
+// - kBusyPoll: polls until the event comes, never blocking,
+// - kSpinThenBlock: polls spin_budget times, then blocks.
+// Spinning trades CPU time for the latency of the wakeup.
+struct WaitPolicy {
+  enum Mode { kBlock, kBusyPoll, kSpinThenBlock };
+
+  Mode mode = kBlock;
+  int64_t spin_budget = 0;
+};
+
+// Reads the <prefix>wait_policy ("block", "busy_poll" or "spin") and
+// <prefix>wait_spin_budget settings, e.g. the server_settings of a protocol
+// driver, falling back to default_policy for the ones that are not set.
+absl::StatusOr<WaitPolicy> GetWaitPolicy(
+    const ::google::protobuf::RepeatedPtrField<NamedSetting>& settings,
+    std::string_view prefix, WaitPolicy default_policy);
+
+// The time that the threads of a role spent waiting, see WaitTimes.
+class WaitTimeCounters {
+ public:
+  void RecordSpin(int64_t spin_ns) {
+    spin_ns_.fetch_add(spin_ns, std::memory_order_relaxed);
+    spin_wakeups_.fetch_add(1, std::memory_order_relaxed);
+  }
+  void RecordBlock(int64_t spin_ns, int64_t blocked_ns) {
+    spin_ns_.fetch_add(spin_ns, std::memory_order_relaxed);
+    blocked_ns_.fetch_add(blocked_ns, std::memory_order_relaxed);
+    blocked_waits_.fetch_add(1, std::memory_order_relaxed);
+  }
+  WaitTimes ToProto() const;
+
+ private:
+  std::atomic<int64_t> spin_ns_ = 0;
+  std::atomic<int64_t> blocked_ns_ = 0;
+  std::atomic<int64_t> spin_wakeups_ = 0;
+  std::atomic<int64_t> blocked_waits_ = 0;
+};
+
+// Returns the counters of the threads named thread_role, see
+// RunRegisteredThread, of the node of the calling thread, i.e. of its
+// CurrentThreadPlacer, so that the nodes sharing a process keep their waits
+// apart. They live as long as the process.
+WaitTimeCounters* GetWaitTimeCounters(std::string_view thread_role);
+
+// The counters of all the roles of the node whose threads run with the
+// ThreadPlacer node so far:
+WaitTimesLog GetWaitTimesLog(const ThreadPlacer* node);
+
+// The waits between two GetWaitTimesLog, for the roles that waited.
+WaitTimesLog WaitTimesLogDelta(const WaitTimesLog& end,
+                               const WaitTimesLog& start);
+
+// Waits for an event as the policy says, and records the time spent
+// spinning and blocked in counters. poll checks for the event without
+// waiting, and block waits for it; both return whether the wait is over,
+// i.e. whether the event came or the thread has to stop. Some of the polls
+// yield the CPU, so that spinning threads still let the others run on a
+// machine with fewer CPUs than threads. Returns whether the wait ended
+// while spinning.
+template <typename Poll, typename Block>
+bool WaitWithPolicy(const WaitPolicy& policy, WaitTimeCounters* counters,
+                    Poll&& poll, Block&& block) {
+  constexpr int64_t kPollsPerYield = 64;
+  const int64_t start_ns = absl::GetCurrentTimeNanos();
+  if (policy.mode != WaitPolicy::kBlock) {
+    for (int64_t i = 0;
+         policy.mode == WaitPolicy::kBusyPoll || i < policy.spin_budget;
+         ++i) {
+      if (poll()) {
+        counters->RecordSpin(absl::GetCurrentTimeNanos() - start_ns);
+        return true;
+      }
+      if (i % kPollsPerYield == kPollsPerYield - 1) {
+        sched_yield();
+      } else {
+        CpuRelax();
+      }
+    }
+  }
+  const int64_t block_start_ns = absl::GetCurrentTimeNanos();
+  while (!block()) {
+  }
+  counters->RecordBlock(block_start_ns - start_ns,
+                        absl::GetCurrentTimeNanos() - block_start_ns);
+  return false;
+}
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_DISTBENCH_WAIT_POLICY_H_
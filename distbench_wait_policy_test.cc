@@ -0,0 +1,108 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "distbench_wait_policy.h"
+
+#include "gtest/gtest.h"
+#include "gtest_utils.h"
+
+namespace distbench {
+
+namespace {
+
+google::protobuf::RepeatedPtrField<NamedSetting> Settings(
+    std::string_view policy, int64_t spin_budget) {
+  google::protobuf::RepeatedPtrField<NamedSetting> settings;
+  NamedSetting* setting = settings.Add();
+  setting->set_name("test_wait_policy");
+  setting->set_string_value(std::string(policy));
+  setting = settings.Add();
+  setting->set_name("test_wait_spin_budget");
+  setting->set_int64_value(spin_budget);
+  return settings;
+}
+
+}  // anonymous namespace
+
+TEST(WaitPolicy, ParseSettings) {
+  auto maybe_policy = GetWaitPolicy(Settings("spin", 10), "test_", {});
+  ASSERT_OK(maybe_policy.status());
+  EXPECT_EQ(maybe_policy->mode, WaitPolicy::kSpinThenBlock);
+  EXPECT_EQ(maybe_policy->spin_budget, 10);
+
+  maybe_policy = GetWaitPolicy(
+      {}, "test_", {WaitPolicy::kBusyPoll, /*spin_budget=*/5});
+  ASSERT_OK(maybe_policy.status());
+  EXPECT_EQ(maybe_policy->mode, WaitPolicy::kBusyPoll);
+  EXPECT_EQ(maybe_policy->spin_budget, 5);
+
+  EXPECT_FALSE(GetWaitPolicy(Settings("sleep", 10), "test_", {}).ok());
+  EXPECT_FALSE(GetWaitPolicy(Settings("spin", -1), "test_", {}).ok());
+}
+
+TEST(WaitPolicy, SpinsThenBlocks) {
+  const WaitTimesLog start = GetWaitTimesLog(CurrentThreadPlacer());
+  WaitTimeCounters* counters = GetWaitTimeCounters("WaitPolicyTest");
+  const WaitPolicy policy = {WaitPolicy::kSpinThenBlock, /*spin_budget=*/4};
+  int polls = 0;
+  int blocks = 0;
+  auto poll = [&polls]() { return ++polls == 3; };
+  auto block = [&blocks]() { return ++blocks == 2; };
+  EXPECT_TRUE(WaitWithPolicy(policy, counters, poll, block));
+  EXPECT_EQ(polls, 3);
+  EXPECT_EQ(blocks, 0);
+
+  polls = 0;
+  auto never = [&polls]() {
+    ++polls;
+    return false;
+  };
+  EXPECT_FALSE(WaitWithPolicy(policy, counters, never, block));
+  EXPECT_EQ(polls, 4);
+  EXPECT_EQ(blocks, 2);
+
+  blocks = 0;
+  const WaitPolicy block_policy = {WaitPolicy::kBlock, /*spin_budget=*/4};
+  polls = 0;
+  EXPECT_FALSE(WaitWithPolicy(block_policy, counters, never, block));
+  EXPECT_EQ(polls, 0);
+
+  const WaitTimesLog delta = WaitTimesLogDelta(GetWaitTimesLog(CurrentThreadPlacer()), start);
+  ASSERT_EQ(delta.thread_roles().size(), 1);
+  const WaitTimes& times = delta.thread_roles().at("WaitPolicyTest");
+  EXPECT_EQ(times.spin_wakeups(), 1);
+  EXPECT_EQ(times.blocked_waits(), 2);
+}
+
+TEST(WaitPolicy, CountsEachNodeApart) {
+  ThreadPlacer node1;
+  ThreadPlacer node2;
+  const WaitPolicy policy = {WaitPolicy::kBlock, /*spin_budget=*/0};
+  auto block = []() { return true; };
+  {
+    ThreadPlacerScope scope(&node1);
+    WaitWithPolicy(policy, GetWaitTimeCounters("NodeTest"), block, block);
+    WaitWithPolicy(policy, GetWaitTimeCounters("NodeTest"), block, block);
+  }
+  {
+    ThreadPlacerScope scope(&node2);
+    WaitWithPolicy(policy, GetWaitTimeCounters("NodeTest"), block, block);
+  }
+  EXPECT_EQ(
+      GetWaitTimesLog(&node1).thread_roles().at("NodeTest").blocked_waits(), 2);
+  EXPECT_EQ(
+      GetWaitTimesLog(&node2).thread_roles().at("NodeTest").blocked_waits(), 1);
+}
+
+}  // namespace distbench
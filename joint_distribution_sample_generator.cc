@@ -14,8 +14,21 @@
 
 #include "joint_distribution_sample_generator.h"
 
+#include "absl/random/random.h"
+#include "glog/logging.h"
+
 namespace distbench {
 
+namespace {
+
+// The probabilities of the alias table are fractions of 2^32:
+constexpr uint64_t kAliasScale = uint64_t{1} << 32;
+
+// Seeding a BitGen is expensive, so each thread keeps its own:
+thread_local absl::InsecureBitGen sample_bitgen;
+
+}  // anonymous namespace
+
 absl::Status ValidatePmfConfig(const DistributionConfig& config) {
   float cdf = 0;
   int num_variables = -1;
@@ -157,60 +170,104 @@ absl::Status DistributionSampleGenerator::InitializeWithPmf(
   auto status = ValidatePmfConfig(config);
   if (!status.ok()) return status;
 
-  unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-  generator_ = std::default_random_engine(seed);
-  std::vector<float> pmf;
   num_dimensions_ = config.pmf_points(0).data_points_size();
-  exact_value_.resize(num_dimensions_);
-  range_.resize(num_dimensions_);
-  is_exact_value_.resize(num_dimensions_);
+  const int num_points = config.pmf_points_size();
+  values_.clear();
+  values_.reserve(num_points * num_dimensions_);
+  double total_pmf = 0;
   for (const auto& point : config.pmf_points()) {
-    for (int i = 0; i < point.data_points_size(); i++) {
-      if (point.data_points(i).has_exact()) {
-        exact_value_[i].push_back(point.data_points(i).exact());
-        range_[i].push_back(std::uniform_int_distribution<>());
-        is_exact_value_[i].push_back(true);
+    for (const auto& data_point : point.data_points()) {
+      if (data_point.has_exact()) {
+        values_.push_back({.lower = data_point.exact(), .span = 1});
       } else {
-        exact_value_[i].push_back(0);
-        range_[i].push_back(std::uniform_int_distribution<>(
-            point.data_points(i).lower(), point.data_points(i).upper()));
-        is_exact_value_[i].push_back(false);
+        const int64_t span =
+            int64_t{data_point.upper()} - data_point.lower() + 1;
+        values_.push_back({.lower = data_point.lower(),
+                           .span = static_cast<uint64_t>(std::max<int64_t>(
+                               1, span))});
       }
     }
-    pmf.push_back(point.pmf());
+    total_pmf += point.pmf();
   }
 
-  distribution_array_ = std::discrete_distribution<int>(pmf.begin(), pmf.end());
+  // Vose's method: the points more likely than average give the excess of
+  // their probability to the less likely ones, one at a time.
+  std::vector<double> scaled_pmf(num_points);
+  std::vector<int> small;
+  std::vector<int> large;
+  for (int i = 0; i < num_points; ++i) {
+    scaled_pmf[i] = config.pmf_points(i).pmf() * num_points / total_pmf;
+    (scaled_pmf[i] < 1 ? small : large).push_back(i);
+  }
+  alias_threshold_.assign(num_points, kAliasScale);
+  alias_index_.resize(num_points);
+  for (int i = 0; i < num_points; ++i) {
+    alias_index_[i] = i;
+  }
+  while (!small.empty() && !large.empty()) {
+    const int less_likely = small.back();
+    small.pop_back();
+    const int more_likely = large.back();
+    alias_threshold_[less_likely] = scaled_pmf[less_likely] * kAliasScale;
+    alias_index_[less_likely] = more_likely;
+    scaled_pmf[more_likely] -= 1 - scaled_pmf[less_likely];
+    if (scaled_pmf[more_likely] < 1) {
+      large.pop_back();
+      small.push_back(more_likely);
+    }
+  }
+  // The points left over are only off by rounding errors, and keep a
+  // probability of 1.
   return absl::OkStatus();
 };
 
 absl::Status DistributionSampleGenerator::Initialize(
     const DistributionConfig& config) {
-  std::random_device rd;
-  mersenne_twister_prng_ = std::mt19937(rd());
   if (config.cdf_points_size()) return InitializeWithCdf(config);
   if (config.pmf_points_size()) return InitializeWithPmf(config);
   return absl::InvalidArgumentError(
       absl::StrCat("Add CDF or PMF to '", config.name(), "'."));
 };
 
-std::vector<int> DistributionSampleGenerator::GetRandomSample(
-    std::default_random_engine* generator) {
-  auto index = distribution_array_(*generator);
-  std::vector<int> sample;
-
-  for (int dim = 0; dim < num_dimensions_; dim++) {
-    if (is_exact_value_[dim][index]) {
-      sample.push_back(exact_value_[dim][index]);
+template <typename NextRandom>
+void DistributionSampleGenerator::FillSample(NextRandom&& next_random,
+                                             absl::Span<int> sample) const {
+  // The high half of the random bits picks the point, and the low half
+  // whether to keep it or take its alias:
+  const uint64_t random = next_random();
+  size_t point = ((random >> 32) * alias_index_.size()) >> 32;
+  if ((random & (kAliasScale - 1)) >= alias_threshold_[point]) {
+    point = alias_index_[point];
+  }
+  const ValueRange* values = &values_[point * num_dimensions_];
+  for (int dim = 0; dim < num_dimensions_; ++dim) {
+    if (values[dim].span == 1) {
+      sample[dim] = values[dim].lower;
     } else {
-      sample.push_back(range_[dim][index](mersenne_twister_prng_));
+      sample[dim] =
+          values[dim].lower + (((next_random() >> 32) * values[dim].span) >> 32);
     }
   }
+}
+
+void DistributionSampleGenerator::GetRandomSample(
+    absl::Span<int> sample) const {
+  CHECK_EQ(sample.size(), static_cast<size_t>(num_dimensions_));
+  FillSample([]() -> uint64_t { return sample_bitgen(); }, sample);
+}
+
+std::vector<int> DistributionSampleGenerator::GetRandomSample(
+    std::default_random_engine* generator) {
+  std::vector<int> sample(num_dimensions_);
+  std::uniform_int_distribution<uint64_t> random_bits;
+  FillSample([&]() { return random_bits(*generator); }, absl::MakeSpan(sample));
   return sample;
 };
 
 std::vector<int> DistributionSampleGenerator::GetRandomSample() {
-  return GetRandomSample(&generator_);
+  std::vector<int> sample(num_dimensions_);
+  GetRandomSample(absl::MakeSpan(sample));
+  return sample;
 };
 
 }  // namespace distbench
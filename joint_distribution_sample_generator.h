@@ -21,6 +21,7 @@
 #include <random>
 
 #include "absl/status/statusor.h"
+#include "absl/types/span.h"
 #include "joint_distribution.pb.h"
 
 namespace distbench {
@@ -34,21 +35,35 @@ class DistributionSampleGenerator {
   ~DistributionSampleGenerator(){};
 
   absl::Status Initialize(const DistributionConfig& config);
+  int num_dimensions() const { return num_dimensions_; }
+
+  // Draws a sample into 'sample', which must hold num_dimensions() values,
+  // in constant time and without allocating. Each thread draws from a PRNG
+  // of its own, so this may be called from multiple threads.
+  void GetRandomSample(absl::Span<int> sample) const;
   std::vector<int> GetRandomSample();
   std::vector<int> GetRandomSample(std::default_random_engine* generator);
 
  private:
-  int num_dimensions_;
+  // The values of one dimension of a PmfPoint: [lower, lower + span).
+  struct ValueRange {
+    int64_t lower;
+    uint64_t span;
+  };
 
-  std::default_random_engine generator_;
-  std::discrete_distribution<int> distribution_array_;
+  template <typename NextRandom>
+  void FillSample(NextRandom&& next_random, absl::Span<int> sample) const;
 
-  std::vector<std::vector<int>> exact_value_;
+  int num_dimensions_;
 
-  std::vector<std::vector<std::uniform_int_distribution<>>> range_;
-  std::mt19937 mersenne_twister_prng_;
+  // Walker's alias table: the PmfPoint picked uniformly, i, is kept with
+  // probability alias_threshold_[i] / 2^32, and replaced by alias_index_[i]
+  // otherwise.
+  std::vector<uint64_t> alias_threshold_;
+  std::vector<int> alias_index_;
 
-  std::vector<std::vector<bool>> is_exact_value_;
+  // Indexed by PmfPoint * num_dimensions_ + dimension.
+  std::vector<ValueRange> values_;
 
   absl::Status InitializeWithPmf(const DistributionConfig& config);
   absl::Status InitializeWithCdf(const DistributionConfig& config);
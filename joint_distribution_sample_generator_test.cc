@@ -14,6 +14,10 @@
 
 #include "joint_distribution_sample_generator.h"
 
+#include <thread>
+
+#include "benchmark/benchmark.h"
+#include "glog/logging.h"
 #include "gtest/gtest.h"
 
 namespace distbench {
@@ -565,4 +569,100 @@ TEST(DistributionSampleGeneratorTest, PmfPointDifferentVariableNumbers) {
                 "The size of data_points must be same in all PmfPoints."));
 }
 
+TEST(DistributionSampleGeneratorTest, SpanSamplesFromThreads) {
+  DistributionConfig config;
+  config.set_name("MyReqPayloadDC");
+  const float kPmfs[] = {0.5, 0.25, 0.25, 0};
+  for (int i = 0; i < 4; i++) {
+    auto* pmf_point = config.add_pmf_points();
+    pmf_point->set_pmf(kPmfs[i]);
+    auto* data_point = pmf_point->add_data_points();
+    data_point->set_exact(i);
+    data_point = pmf_point->add_data_points();
+    data_point->set_lower(i * 100);
+    data_point->set_upper(i * 100 + 99);
+  }
+
+  auto maybe_sg = AllocateSampleGenerator(config);
+  ASSERT_EQ(maybe_sg.ok(), true);
+  auto sg = std::move(maybe_sg.value());
+  ASSERT_EQ(sg->num_dimensions(), 2);
+
+  const int kThreads = 4;
+  const int kReps = 50000;
+  std::vector<std::array<int, 4>> sample_counts(kThreads);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; t++) {
+    threads.push_back(std::thread([&, t]() {
+      sample_counts[t] = {};
+      int sample[2];
+      for (int i = 0; i < kReps; i++) {
+        sg->GetRandomSample(absl::MakeSpan(sample));
+        ASSERT_GE(sample[0], 0);
+        ASSERT_LT(sample[0], 4);
+        ASSERT_GE(sample[1], sample[0] * 100);
+        ASSERT_LE(sample[1], sample[0] * 100 + 99);
+        sample_counts[t][sample[0]]++;
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  const int kTolerance = kReps / 100;
+  for (int t = 0; t < kThreads; t++) {
+    for (int i = 0; i < 4; i++) {
+      ASSERT_LT(abs(sample_counts[t][i] - EstimateCount(kReps, kPmfs[i])),
+                kTolerance);
+    }
+  }
+  // Points with a pmf of 0 are never picked:
+  for (int t = 0; t < kThreads; t++) {
+    ASSERT_EQ(sample_counts[t][3], 0);
+  }
+}
+
+// A skewed PMF of num_points points, whose pmfs still add up to exactly 1 in
+// floating point, as the validation requires.
+std::unique_ptr<DistributionSampleGenerator> MakeLargePmfSampleGenerator(
+    int num_points) {
+  DistributionConfig config;
+  config.set_name("LargePmf");
+  for (int i = 0; i < num_points; i++) {
+    auto* pmf_point = config.add_pmf_points();
+    pmf_point->set_pmf((i % 2 ? 0.5 : 1.5) / num_points);
+    pmf_point->add_data_points()->set_exact(i);
+    auto* data_point = pmf_point->add_data_points();
+    data_point->set_lower(i);
+    data_point->set_upper(i + 1000);
+  }
+  auto maybe_sg = AllocateSampleGenerator(config);
+  CHECK(maybe_sg.ok()) << maybe_sg.status();
+  return std::move(maybe_sg.value());
+}
+
+void BM_GetRandomSampleSpan(benchmark::State& state) {
+  auto sg = MakeLargePmfSampleGenerator(state.range(0));
+  int sample[2];
+  for (auto s : state) {
+    sg->GetRandomSample(absl::MakeSpan(sample));
+    benchmark::DoNotOptimize(sample);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_GetRandomSampleVector(benchmark::State& state) {
+  auto sg = MakeLargePmfSampleGenerator(state.range(0));
+  std::default_random_engine generator;
+  for (auto s : state) {
+    benchmark::DoNotOptimize(sg->GetRandomSample(&generator));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_GetRandomSampleSpan)->Range(16, 1 << 20);
+BENCHMARK(BM_GetRandomSampleSpan)->Arg(1 << 20)->Threads(4)->UseRealTime();
+BENCHMARK(BM_GetRandomSampleVector)->Range(16, 1 << 20);
+
 }  // namespace distbench
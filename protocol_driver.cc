@@ -25,10 +25,45 @@ void ServerRpcState::SetSendResponseFunction(
 
 void ServerRpcState::SendResponseIfSet() const {
   if (send_response_function_) {
+    if (request->record_stage_timings()) {
+      handler_end_time_ = Now();
+    }
     send_response_function_();
   }
 }
 
+bool ServerRpcState::RecordsServerTimings() const {
+  return request->record_stage_timings() ||
+         request->record_server_processing_time();
+}
+
+void ServerRpcState::RecordServerTimings() {
+  if (!RecordsServerTimings()) return;
+  // Drivers that cannot tell when the request arrived report the queueing
+  // as part of the network time:
+  absl::Time base =
+      receive_time != absl::InfinitePast() ? receive_time : handler_start_time;
+  int64_t processing_ns = absl::ToInt64Nanoseconds(Now() - base);
+  if (request->record_server_processing_time()) {
+    response.set_server_processing_ns(processing_ns);
+  }
+  if (!request->record_stage_timings()) return;
+  RpcStageTimings* timings = response.mutable_server_stage_timings();
+  if (handler_start_time != absl::InfinitePast()) {
+    timings->set_handler_start_ns(
+        absl::ToInt64Nanoseconds(handler_start_time - base));
+  }
+  if (handler_end_time_ != absl::InfinitePast()) {
+    timings->set_handler_end_ns(
+        absl::ToInt64Nanoseconds(handler_end_time_ - base));
+  }
+  timings->set_response_sent_ns(processing_ns);
+}
+
+absl::Time ServerRpcState::Now() const {
+  return clock ? clock->Now() : absl::Now();
+}
+
 void ServerRpcState::SetFreeStateFunction(
     std::function<void(void)> free_state_function) {
   free_state_function_ = free_state_function;
@@ -25,30 +25,63 @@
 
 namespace distbench {
 
+class SimpleClock;
+
 struct ClientRpcState {
   GenericRequest request;
   GenericResponse response;
   absl::Time prior_start_time = absl::InfinitePast();
   absl::Time start_time = absl::InfinitePast();
+  // For the open loop RPCs, when their iteration was due. Their latency is
+  // measured from then, so that it includes how late the pacer started them:
+  absl::Time due_time = absl::InfinitePast();
   absl::Time end_time;
   bool success;
+
+  // Stage timestamps, filled by the drivers that can observe them when
+  // request.record_stage_timings() is set, and left at InfinitePast otherwise:
+  absl::Time serialize_done_time = absl::InfinitePast();
+  absl::Time sent_time = absl::InfinitePast();
+  absl::Time completion_dequeued_time = absl::InfinitePast();
 };
 
 struct ServerRpcState {
   const GenericRequest* request;
   GenericResponse response;
   bool have_dedicated_thread = false;
+  // Set by the drivers that would rather start the handler action list on
+  // another thread than the one that received the RPC; the handler returns
+  // it as remaining work instead of starting it inline.
+  bool defer_action_lists = false;
+
+  // Stage timestamps, only recorded when RecordsServerTimings(). The driver
+  // sets receive_time, the handler sets handler_start_time.
+  absl::Time receive_time = absl::InfinitePast();
+  absl::Time handler_start_time = absl::InfinitePast();
+  // The clock of these timestamps, if not the real time:
+  SimpleClock* clock = nullptr;
+  // Whether the request asks for the server stage timings or processing time.
+  bool RecordsServerTimings() const;
 
   void SetSendResponseFunction(
       std::function<void(void)> send_response_function);
+  // Also marks the end of the handler for the stage timings.
   void SendResponseIfSet() const;
 
+  // Stores the server stage timings and/or processing time in response, as
+  // durations since receive_time. Called by the drivers just before sending
+  // the response.
+  void RecordServerTimings();
+
   void SetFreeStateFunction(std::function<void(void)> free_state_function);
   void FreeStateIfSet() const;
 
  private:
   std::function<void(void)> send_response_function_;
+  absl::Time Now() const;
+
   std::function<void(void)> free_state_function_;
+  mutable absl::Time handler_end_time_ = absl::InfinitePast();
 };
 
 struct TransportStat {
@@ -66,6 +99,33 @@ class SimpleClock {
                                          const absl::Condition& condition,
                                          absl::Time deadline)
       ABSL_EXCLUSIVE_LOCK_FUNCTION(mu) = 0;
+  // A simulated clock only advances while the threads that wait on it are
+  // waiting, so they must not busy-wait for Now() to reach a deadline.
+  virtual bool IsSimulated() { return false; }
+  // Between Hold and the matching Release, a simulated clock does not
+  // advance, as it would for a thread waiting on it that woke up. The
+  // threads that start work without waiting on the clock first, e.g. the
+  // main thread of an engine, hold it meanwhile, so that all the work
+  // starts at the same virtual time. Real clocks ignore this.
+  virtual void Hold() {}
+  virtual void Release() {}
+  // Holds the clock on behalf of a thread about to start, which takes the
+  // hold over by calling AdoptHold first thing. Waiting on the clock then
+  // releases it, as does Release.
+  virtual void HoldForNewThread() {}
+  virtual void AdoptHold() {}
+};
+
+// Holds the clock for the scope of the object.
+class ClockHold {
+ public:
+  explicit ClockHold(SimpleClock* clock) : clock_(clock) { clock_->Hold(); }
+  ~ClockHold() { clock_->Release(); }
+  ClockHold(const ClockHold&) = delete;
+  ClockHold& operator=(const ClockHold&) = delete;
+
+ private:
+  SimpleClock* clock_;
 };
 
 class ProtocolDriverClient {
@@ -89,7 +149,15 @@ class ProtocolDriverClient {
                                      int peer) = 0;
   virtual void InitiateRpc(int peer_index, ClientRpcState* state,
                            std::function<void(void)> done_callback) = 0;
+  // Tears down the connection to the peer and establishes a new one, and
+  // only returns once the new connection can carry RPCs, so that the caller
+  // can time the reconnect. The RPCs already in flight may either complete
+  // on the old connection or fail. May be called concurrently with
+  // InitiateRpc, see RpcSpec.connection_churn_rate.
   virtual void ChurnConnection(int peer) = 0;
+  // Drivers whose ChurnConnection cannot re-establish their connections
+  // return false, and the tests using them cannot set connection_churn_rate.
+  virtual bool SupportsConnectionChurn() { return true; }
   virtual void ShutdownClient() = 0;
 
   // Misc interface ===========================================================
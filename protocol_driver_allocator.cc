@@ -15,9 +15,14 @@
 #include "protocol_driver_allocator.h"
 
 #include "composable_rpc_counter.h"
+#include "distbench_utils.h"
 #include "glog/logging.h"
 #include "protocol_driver_double_barrel.h"
 #include "protocol_driver_grpc.h"
+#include "protocol_driver_local_shm.h"
+#include "protocol_driver_shm.h"
+#include "protocol_driver_simulated.h"
+#include "protocol_driver_tcp.h"
 #ifdef WITH_HOMA
 #include "protocol_driver_homa.h"
 #endif
@@ -45,6 +50,13 @@ absl::StatusOr<std::unique_ptr<ProtocolDriver>> AllocateProtocolDriver(
         absl::StrCat("Tree cannot be deeper than max depth of: ",
                      max_protocol_driver_tree_depth_, "."));
   }
+  std::string thread_placement =
+      GetNamedServerSettingString(opts, "thread_placement", "");
+  if (!thread_placement.empty()) {
+    absl::Status status =
+        CurrentThreadPlacer()->AddRules(thread_placement, opts.netdev_name());
+    if (!status.ok()) return status;
+  }
   std::unique_ptr<ProtocolDriver> pd;
   if (opts.protocol_name() == "grpc" ||
       opts.protocol_name() == "grpc_async_callback") {
@@ -53,6 +65,14 @@ absl::StatusOr<std::unique_ptr<ProtocolDriver>> AllocateProtocolDriver(
     pd = std::make_unique<ProtocolDriverDoubleBarrel>(tree_depth);
   } else if (opts.protocol_name() == "composable_rpc_counter") {
     pd = std::make_unique<ComposableRpcCounter>(tree_depth);
+  } else if (opts.protocol_name() == "tcp") {
+    pd = std::make_unique<ProtocolDriverTcp>();
+  } else if (opts.protocol_name() == "shm") {
+    pd = std::make_unique<ProtocolDriverShm>();
+  } else if (opts.protocol_name() == "local_shm") {
+    pd = std::make_unique<ProtocolDriverLocalShm>(tree_depth);
+  } else if (opts.protocol_name() == "simulated") {
+    pd = std::make_unique<ProtocolDriverSimulated>();
 #ifdef WITH_HOMA
   } else if (opts.protocol_name() == "homa") {
     pd = std::make_unique<ProtocolDriverHoma>();
@@ -124,6 +124,11 @@ void ProtocolDriverDoubleBarrel::ChurnConnection(int peer) {
   instance_2_->ChurnConnection(peer);
 }
 
+bool ProtocolDriverDoubleBarrel::SupportsConnectionChurn() {
+  return instance_1_->SupportsConnectionChurn() &&
+         instance_2_->SupportsConnectionChurn();
+}
+
 void ProtocolDriverDoubleBarrel::ShutdownClient() {
   instance_1_->ShutdownClient();
   instance_2_->ShutdownClient();
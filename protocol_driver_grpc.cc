@@ -14,9 +14,12 @@
 
 #include "protocol_driver_grpc.h"
 
+#include <chrono>
+#include <limits>
 #include <memory>
+#include <optional>
 
-#include "absl/base/internal/sysinfo.h"
+#include "distbench_object_pool.h"
 #include "distbench_utils.h"
 #include "glog/logging.h"
 
@@ -33,8 +36,12 @@ namespace distbench {
 
 namespace {
 
+// If channel_index is set, the channel gets a connection of its own rather
+// than sharing one with the other channels to the same address.
 std::shared_ptr<grpc::Channel> CreateClientChannel(
-    const std::string& socket_address, std::string_view transport) {
+    const std::string& socket_address, std::string_view transport,
+    grpc_compression_algorithm compression_algorithm,
+    std::optional<int> channel_index = std::nullopt) {
   if (transport == "homa") {
 #if WITH_HOMA_GRPC
     return HomaClient::createInsecureChannel(socket_address.data());
@@ -43,9 +50,63 @@ std::shared_ptr<grpc::Channel> CreateClientChannel(
 #endif
   } else {
     std::shared_ptr<grpc::ChannelCredentials> creds = MakeChannelCredentials();
-    return grpc::CreateCustomChannel(socket_address, creds,
-                                     DistbenchCustomChannelArguments());
+    grpc::ChannelArguments args = DistbenchCustomChannelArguments();
+    args.SetCompressionAlgorithm(compression_algorithm);
+    if (channel_index.has_value()) {
+      args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+      args.SetInt("distbench.channel_index", *channel_index);
+    }
+    return grpc::CreateCustomChannel(socket_address, creds, args);
+  }
+}
+
+absl::StatusOr<grpc_compression_algorithm> ParseCompressionAlgorithm(
+    std::string_view name) {
+  if (name == "none") return GRPC_COMPRESS_NONE;
+  if (name == "deflate") return GRPC_COMPRESS_DEFLATE;
+  if (name == "gzip") return GRPC_COMPRESS_GZIP;
+  return absl::InvalidArgumentError(absl::StrCat(
+      "compression_algorithm must be none, deflate or gzip, not ", name));
+}
+
+// The requests are compressed with the compression_algorithm of the
+// client_settings, on every channel of the client.
+absl::StatusOr<grpc_compression_algorithm> GetClientCompressionAlgorithm(
+    const ProtocolDriverOptions& pd_opts) {
+  return ParseCompressionAlgorithm(
+      GetNamedClientSettingString(pd_opts, "compression_algorithm", "none"));
+}
+
+// The responses are compressed with the compression_algorithm of the
+// server_settings or, if compression_level is set, with the algorithm that
+// gRPC picks for that level among the ones the client accepts.
+absl::Status ApplyServerCompressionSettings(
+    grpc::ServerBuilder* builder, const ProtocolDriverOptions& pd_opts) {
+  std::string algorithm_name =
+      GetNamedServerSettingString(pd_opts, "compression_algorithm", "");
+  if (!algorithm_name.empty()) {
+    auto maybe_algorithm = ParseCompressionAlgorithm(algorithm_name);
+    if (!maybe_algorithm.ok()) return maybe_algorithm.status();
+    builder->SetDefaultCompressionAlgorithm(maybe_algorithm.value());
   }
+  std::string level_name =
+      GetNamedServerSettingString(pd_opts, "compression_level", "");
+  if (level_name.empty()) return absl::OkStatus();
+  grpc_compression_level level;
+  if (level_name == "none") {
+    level = GRPC_COMPRESS_LEVEL_NONE;
+  } else if (level_name == "low") {
+    level = GRPC_COMPRESS_LEVEL_LOW;
+  } else if (level_name == "med") {
+    level = GRPC_COMPRESS_LEVEL_MED;
+  } else if (level_name == "high") {
+    level = GRPC_COMPRESS_LEVEL_HIGH;
+  } else {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "compression_level must be none, low, med or high, not ", level_name));
+  }
+  builder->SetDefaultCompressionLevel(level);
+  return absl::OkStatus();
 }
 
 std::shared_ptr<grpc::ServerCredentials> CreateServerCreds(
@@ -63,75 +124,293 @@ std::shared_ptr<grpc::ServerCredentials> CreateServerCreds(
 
 }  // anonymous namespace
 
+// Client channels ============================================================
+absl::Status GrpcClientChannels::Initialize(
+    const ProtocolDriverOptions& pd_opts) {
+  channels_per_peer_ =
+      GetNamedClientSettingInt64(pd_opts, "channels_per_peer", 1);
+  if (channels_per_peer_ < 1) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "channels_per_peer (", channels_per_peer_,
+        ") must be a positive integer."));
+  }
+  std::string selection =
+      GetNamedClientSettingString(pd_opts, "channel_selection", "round_robin");
+  if (selection == "least_outstanding") {
+    least_outstanding_ = true;
+  } else if (selection != "round_robin") {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "channel_selection must be round_robin or least_outstanding, not ",
+        selection));
+  }
+  return absl::OkStatus();
+}
+
+void GrpcClientChannels::SetNumPeers(int num_peers) {
+  peers_.resize(num_peers);
+  for (auto& peer : peers_) {
+    if (!peer) peer = std::make_unique<PeerChannels>();
+  }
+}
+
+void GrpcClientChannels::Connect(
+    int peer, const std::string& socket_address, std::string_view transport,
+    grpc_compression_algorithm compression_algorithm) {
+  CHECK_GE(peer, 0);
+  CHECK_LT(static_cast<size_t>(peer), peers_.size());
+  transport_ = transport;
+  compression_algorithm_ = compression_algorithm;
+  peers_[peer]->socket_address = socket_address;
+  auto& channels = peers_[peer]->channels;
+  channels.clear();
+  for (int i = 0; i < channels_per_peer_; ++i) {
+    channels.push_back(std::make_unique<Channel>());
+    channels.back()->stub = Traffic::NewStub(CreateClientChannel(
+        socket_address, transport, compression_algorithm,
+        channels_per_peer_ > 1 ? std::optional<int>(i) : std::nullopt));
+  }
+}
+
+void GrpcClientChannels::Reconnect(int peer) {
+  CHECK_GE(peer, 0);
+  CHECK_LT(static_cast<size_t>(peer), peers_.size());
+  const PeerChannels& peer_channels = *peers_[peer];
+  for (size_t i = 0; i < peer_channels.channels.size(); ++i) {
+    // A local subchannel pool, even with a single channel per peer, as the
+    // new channel would otherwise reuse the connection of the old one:
+    std::shared_ptr<grpc::Channel> channel =
+        CreateClientChannel(peer_channels.socket_address, transport_,
+                            compression_algorithm_, static_cast<int>(i));
+    if (!channel) return;
+    if (!channel->WaitForConnected(std::chrono::system_clock::now() +
+                                   std::chrono::seconds(10))) {
+      LOG(ERROR) << "Reconnecting to " << peer_channels.socket_address
+                 << " timed out";
+    }
+    std::shared_ptr<Traffic::Stub> stub = Traffic::NewStub(channel);
+    std::atomic_store(&peer_channels.channels[i]->stub, std::move(stub));
+  }
+}
+
+GrpcClientChannels::Channel* GrpcClientChannels::PickChannel(int peer) {
+  CHECK_GE(peer, 0);
+  CHECK_LT(static_cast<size_t>(peer), peers_.size());
+  PeerChannels& peer_channels = *peers_[peer];
+  const auto& channels = peer_channels.channels;
+  CHECK(!channels.empty()) << "Peer " << peer << " is not connected";
+  size_t index = 0;
+  if (channels.size() > 1) {
+    // The round robin position also breaks the ties of least_outstanding:
+    const size_t start =
+        peer_channels.next_channel.fetch_add(1, std::memory_order_relaxed);
+    index = start % channels.size();
+    if (least_outstanding_) {
+      int64_t least = std::numeric_limits<int64_t>::max();
+      for (size_t i = 0; i < channels.size(); ++i) {
+        const size_t j = (start + i) % channels.size();
+        const int64_t outstanding =
+            channels[j]->outstanding_rpcs.load(std::memory_order_relaxed);
+        if (outstanding < least) {
+          least = outstanding;
+          index = j;
+        }
+      }
+    }
+  }
+  Channel* channel = channels[index].get();
+  channel->rpc_count.fetch_add(1, std::memory_order_relaxed);
+  const int64_t outstanding =
+      channel->outstanding_rpcs.fetch_add(1, std::memory_order_relaxed) + 1;
+  int64_t max = channel->max_outstanding_rpcs.load(std::memory_order_relaxed);
+  while (outstanding > max &&
+         !channel->max_outstanding_rpcs.compare_exchange_weak(
+             max, outstanding, std::memory_order_relaxed)) {
+  }
+  return channel;
+}
+
+std::vector<TransportStat> GrpcClientChannels::GetTransportStats() {
+  std::vector<TransportStat> stats;
+  if (channels_per_peer_ == 1) return stats;
+  for (size_t peer = 0; peer < peers_.size(); ++peer) {
+    const auto& channels = peers_[peer]->channels;
+    for (size_t i = 0; i < channels.size(); ++i) {
+      const std::string prefix = absl::StrCat("peer", peer, "/channel", i);
+      stats.push_back({absl::StrCat(prefix, "/rpc_cnt"),
+                       channels[i]->rpc_count.load()});
+      stats.push_back({absl::StrCat(prefix, "/max_outstanding_rpcs"),
+                       channels[i]->max_outstanding_rpcs.load()});
+    }
+  }
+  return stats;
+}
+
+void GrpcClientChannels::ReleaseStubs() {
+  for (auto& peer : peers_) {
+    for (auto& channel : peer->channels) {
+      std::atomic_store(&channel->stub, std::shared_ptr<Traffic::Stub>());
+    }
+  }
+}
+
 // Client =====================================================================
 GrpcPollingClientDriver::GrpcPollingClientDriver() {}
 GrpcPollingClientDriver::~GrpcPollingClientDriver() { ShutdownClient(); }
 
 absl::Status GrpcPollingClientDriver::Initialize(
     const ProtocolDriverOptions& pd_opts) {
-  cq_poller_ = std::thread(&GrpcPollingClientDriver::RpcCompletionThread, this);
   transport_ =
       GetNamedServerSettingString(pd_opts, "transport", DEFAULT_TRANSPORT);
+  auto maybe_algorithm = GetClientCompressionAlgorithm(pd_opts);
+  if (!maybe_algorithm.ok()) return maybe_algorithm.status();
+  compression_algorithm_ = maybe_algorithm.value();
+  absl::Status status = channels_.Initialize(pd_opts);
+  if (!status.ok()) return status;
+  int64_t cq_count = GetNamedClientSettingInt64(pd_opts, "client_cq_count", 1);
+  if (cq_count < 1) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "client_cq_count (", cq_count, ") must be a positive integer."));
+  }
+  std::string sharding =
+      GetNamedClientSettingString(pd_opts, "client_cq_sharding", "peer");
+  if (sharding == "round_robin") {
+    round_robin_cq_sharding_ = true;
+  } else if (sharding != "peer") {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "client_cq_sharding must be peer or round_robin, not ", sharding));
+  }
+  auto maybe_wait_policy =
+      GetWaitPolicy(pd_opts.client_settings(), "client_cq_", {});
+  if (!maybe_wait_policy.ok()) return maybe_wait_policy.status();
+  wait_policy_ = maybe_wait_policy.value();
+  std::vector<int> poller_cpus;
+  std::string cpu_list =
+      GetNamedClientSettingString(pd_opts, "client_cq_cpus", "");
+  if (!cpu_list.empty()) {
+    auto maybe_cpus = ParseCpuList(cpu_list);
+    if (!maybe_cpus.ok()) return maybe_cpus.status();
+    poller_cpus = std::move(maybe_cpus.value());
+  }
+  for (int64_t i = 0; i < cq_count; ++i) {
+    cq_shards_.push_back(std::make_unique<CompletionQueueShard>());
+    grpc::CompletionQueue* cq = &cq_shards_.back()->cq;
+    int cpu = poller_cpus.empty() ? -1 : poller_cpus[i % poller_cpus.size()];
+    cq_shards_.back()->poller =
+        RunRegisteredThread("GrpcClientCq", [this, cq, cpu]() {
+          if (cpu >= 0) {
+            absl::Status status = SetCurrentThreadAffinity(cpu);
+            if (!status.ok()) LOG(WARNING) << status;
+          }
+          RpcCompletionThread(cq);
+        });
+  }
   return absl::OkStatus();
 }
 
 void GrpcPollingClientDriver::SetNumPeers(int num_peers) {
-  grpc_client_stubs_.resize(num_peers);
+  channels_.SetNumPeers(num_peers);
 }
 
 absl::Status GrpcPollingClientDriver::HandleConnect(
     std::string remote_connection_info, int peer) {
-  CHECK_GE(peer, 0);
-  CHECK_LT(static_cast<size_t>(peer), grpc_client_stubs_.size());
   ServerAddress addr;
   addr.ParseFromString(remote_connection_info);
-  std::shared_ptr<grpc::Channel> channel =
-      CreateClientChannel(addr.socket_address(), transport_);
-  grpc_client_stubs_[peer] = Traffic::NewStub(channel);
+  channels_.Connect(peer, addr.socket_address(), transport_,
+                    compression_algorithm_);
   return absl::OkStatus();
 }
 
 std::vector<TransportStat> GrpcPollingClientDriver::GetTransportStats() {
-  return {};
+  return channels_.GetTransportStats();
 }
 
 namespace {
+// PendingRpcs are recycled through an ObjectPool, so that the request and
+// response keep their buffers from one RPC to the next. A ClientContext
+// cannot be reused, so a new one is constructed in place for each RPC.
 struct PendingRpc {
-  grpc::ClientContext context;
+  std::optional<grpc::ClientContext> context;
   std::unique_ptr<grpc::ClientAsyncResponseReader<GenericResponse>> rpc;
   grpc::Status status;
   GenericRequest request;
   GenericResponse response;
   std::function<void(void)> done_callback;
   ClientRpcState* state;
+  GrpcClientChannels::Channel* channel;
+  // Keeps the channel the RPC was started on open, should its peer be
+  // reconnected in the meantime:
+  std::shared_ptr<Traffic::Stub> stub;
 };
+
+PendingRpc* AllocatePendingRpc() {
+  PendingRpc* rpc = ObjectPool<PendingRpc>::Get();
+  rpc->context.emplace();
+  return rpc;
+}
+
+void FreePendingRpc(PendingRpc* rpc) {
+  rpc->rpc.reset();
+  rpc->context.reset();
+  rpc->status = grpc::Status();
+  rpc->request.Clear();
+  rpc->response.Clear();
+  rpc->done_callback = nullptr;
+  rpc->state = nullptr;
+  rpc->channel = nullptr;
+  rpc->stub.reset();
+  ObjectPool<PendingRpc>::Release(rpc);
+}
 }  // anonymous namespace
 
 void GrpcPollingClientDriver::InitiateRpc(
     int peer_index, ClientRpcState* state,
     std::function<void(void)> done_callback) {
   CHECK_GE(peer_index, 0);
-  CHECK_LT(static_cast<size_t>(peer_index), grpc_client_stubs_.size());
+  CHECK_LT(static_cast<size_t>(peer_index), channels_.num_peers());
 
   ++pending_rpcs_;
-  PendingRpc* new_rpc = new PendingRpc;
+  PendingRpc* new_rpc = AllocatePendingRpc();
   new_rpc->done_callback = done_callback;
   new_rpc->state = state;
   new_rpc->request = std::move(state->request);
-  new_rpc->rpc = grpc_client_stubs_[peer_index]->AsyncGenericRpc(
-      &new_rpc->context, new_rpc->request, &cq_);
+  new_rpc->channel = channels_.PickChannel(peer_index);
+  new_rpc->stub = std::atomic_load(&new_rpc->channel->stub);
+  size_t shard = round_robin_cq_sharding_
+                     ? next_cq_shard_.fetch_add(1, std::memory_order_relaxed)
+                     : peer_index;
+  grpc::CompletionQueue* cq = &cq_shards_[shard % cq_shards_.size()]->cq;
+  new_rpc->rpc = new_rpc->stub->AsyncGenericRpc(
+      &*new_rpc->context, new_rpc->request, cq);
+  // AsyncGenericRpc serializes and starts sending the request. This must be
+  // recorded before Finish, after which the RPC may complete at any time:
+  if (new_rpc->request.record_stage_timings()) {
+    state->sent_time = absl::Now();
+  }
   new_rpc->rpc->Finish(&new_rpc->response, &new_rpc->status, new_rpc);
 }
 
-void GrpcPollingClientDriver::RpcCompletionThread() {
+void GrpcPollingClientDriver::RpcCompletionThread(grpc::CompletionQueue* cq) {
+  WaitTimeCounters* wait_times = GetWaitTimeCounters("GrpcClientCq");
+  bool ok;
+  void* tag;
+  auto poll = [cq, &tag, &ok]() {
+    return cq->AsyncNext(&tag, &ok, gpr_time_0(GPR_CLOCK_MONOTONIC)) !=
+           grpc::CompletionQueue::TIMEOUT;
+  };
+  auto block = [cq, &tag, &ok]() {
+    cq->Next(&tag, &ok);
+    return true;
+  };
   while (!shutdown_.HasBeenNotified()) {
-    bool ok;
-    void* tag;
     tag = nullptr;
     ok = false;
-    cq_.Next(&tag, &ok);
+    if (!poll()) WaitWithPolicy(wait_policy_, wait_times, poll, block);
     if (ok) {
       PendingRpc* finished_rpc = static_cast<PendingRpc*>(tag);
+      GrpcClientChannels::RpcDone(finished_rpc->channel);
+      if (finished_rpc->request.record_stage_timings()) {
+        finished_rpc->state->completion_dequeued_time = absl::Now();
+      }
       finished_rpc->state->success = finished_rpc->status.ok();
       if (finished_rpc->state->success) {
         finished_rpc->state->request = std::move(finished_rpc->request);
@@ -143,25 +422,31 @@ void GrpcPollingClientDriver::RpcCompletionThread() {
       finished_rpc->done_callback();
 
       // Free before allowing the shutdown of the client
-      delete finished_rpc;
+      FreePendingRpc(finished_rpc);
       --pending_rpcs_;
     }
   }
 }
 
-void GrpcPollingClientDriver::ChurnConnection(int peer) {}
+void GrpcPollingClientDriver::ChurnConnection(int peer) {
+  channels_.Reconnect(peer);
+}
 
 void GrpcPollingClientDriver::ShutdownClient() {
   while (pending_rpcs_) {
   }
   if (!shutdown_.HasBeenNotified()) {
     shutdown_.Notify();
-    cq_.Shutdown();
-    if (cq_poller_.joinable()) {
-      cq_poller_.join();
+    for (auto& shard : cq_shards_) {
+      shard->cq.Shutdown();
+    }
+    for (auto& shard : cq_shards_) {
+      if (shard->poller.joinable()) {
+        shard->poller.join();
+      }
     }
   }
-  grpc_client_stubs_.clear();
+  channels_.ReleaseStubs();
 }
 
 // Server =====================================================================
@@ -182,8 +467,13 @@ class TrafficService : public Traffic::Service {
     ServerRpcState rpc_state;
     rpc_state.have_dedicated_thread = true;
     rpc_state.request = request;
-    rpc_state.SetSendResponseFunction(
-        [&]() { *response = std::move(rpc_state.response); });
+    if (rpc_state.RecordsServerTimings()) {
+      rpc_state.receive_time = absl::Now();
+    }
+    rpc_state.SetSendResponseFunction([&]() {
+      rpc_state.RecordServerTimings();
+      *response = std::move(rpc_state.response);
+    });
     handler_set_.WaitForNotification();
     if (handler_) {
       auto remaining_work = handler_(&rpc_state);
@@ -222,6 +512,9 @@ absl::Status GrpcInlineServerDriver::Initialize(
   builder.AddListeningPort(server_socket_address_, server_creds, port);
   builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, 0);
   ApplyServerSettingsToGrpcBuilder(&builder, pd_opts);
+  absl::Status compression_status =
+      ApplyServerCompressionSettings(&builder, pd_opts);
+  if (!compression_status.ok()) return compression_status;
   builder.RegisterService(traffic_service_.get());
   server_ = builder.BuildAndStart();
 
@@ -295,10 +588,8 @@ absl::Status ProtocolDriverGrpc::Initialize(
     server_ =
         std::unique_ptr<ProtocolDriverServer>(new GrpcHandoffServerDriver());
   } else if (server_type == "polling") {
-    auto threadpool_size = GetNamedServerSettingInt64(
-        pd_opts, "threadpool_size", absl::base_internal::NumCPUs());
-    server_ = std::unique_ptr<ProtocolDriverServer>(
-        new GrpcPollingServerDriver(threadpool_size));
+    server_ =
+        std::unique_ptr<ProtocolDriverServer>(new GrpcPollingServerDriver());
   } else {
     return absl::InvalidArgumentError("Invalid GRPC server_type");
   }
@@ -372,43 +663,49 @@ absl::Status GrpcCallbackClientDriver::Initialize(
     const ProtocolDriverOptions& pd_opts) {
   transport_ =
       GetNamedServerSettingString(pd_opts, "transport", DEFAULT_TRANSPORT);
-  return absl::OkStatus();
+  auto maybe_algorithm = GetClientCompressionAlgorithm(pd_opts);
+  if (!maybe_algorithm.ok()) return maybe_algorithm.status();
+  compression_algorithm_ = maybe_algorithm.value();
+  return channels_.Initialize(pd_opts);
 }
 
 void GrpcCallbackClientDriver::SetNumPeers(int num_peers) {
-  grpc_client_stubs_.resize(num_peers);
+  channels_.SetNumPeers(num_peers);
 }
 
 absl::Status GrpcCallbackClientDriver::HandleConnect(
     std::string remote_connection_info, int peer) {
-  CHECK_GE(peer, 0);
-  CHECK_LT(static_cast<size_t>(peer), grpc_client_stubs_.size());
   ServerAddress addr;
   addr.ParseFromString(remote_connection_info);
-  std::shared_ptr<grpc::Channel> channel =
-      CreateClientChannel(addr.socket_address(), transport_);
-  grpc_client_stubs_[peer] = Traffic::NewStub(channel);
+  channels_.Connect(peer, addr.socket_address(), transport_,
+                    compression_algorithm_);
   return absl::OkStatus();
 }
 
 std::vector<TransportStat> GrpcCallbackClientDriver::GetTransportStats() {
-  return {};
+  return channels_.GetTransportStats();
 }
 
 void GrpcCallbackClientDriver::InitiateRpc(
     int peer_index, ClientRpcState* state,
     std::function<void(void)> done_callback) {
   CHECK_GE(peer_index, 0);
-  CHECK_LT(static_cast<size_t>(peer_index), grpc_client_stubs_.size());
+  CHECK_LT(static_cast<size_t>(peer_index), channels_.num_peers());
 
   ++pending_rpcs_;
-  PendingRpc* new_rpc = new PendingRpc;
+  PendingRpc* new_rpc = AllocatePendingRpc();
   new_rpc->done_callback = done_callback;
   new_rpc->state = state;
   new_rpc->request = std::move(state->request);
+  new_rpc->channel = channels_.PickChannel(peer_index);
+  new_rpc->stub = std::atomic_load(&new_rpc->channel->stub);
 
   auto callback_fct = [this, new_rpc,
                        done_callback](const grpc::Status& status) {
+    GrpcClientChannels::RpcDone(new_rpc->channel);
+    if (new_rpc->request.record_stage_timings()) {
+      new_rpc->state->completion_dequeued_time = absl::Now();
+    }
     new_rpc->status = status;
     new_rpc->state->success = status.ok();
     if (new_rpc->state->success) {
@@ -420,20 +717,25 @@ void GrpcCallbackClientDriver::InitiateRpc(
     new_rpc->done_callback();
 
     // Free before allowing the shutdown of the client
-    delete new_rpc;
+    FreePendingRpc(new_rpc);
     --pending_rpcs_;
   };
 
-  grpc_client_stubs_[peer_index]->experimental_async()->GenericRpc(
-      &new_rpc->context, &new_rpc->request, &new_rpc->response, callback_fct);
+  // The callback may run before GenericRpc returns, so only the completion
+  // of the RPC can be timed here.
+  new_rpc->stub->experimental_async()->GenericRpc(
+      &*new_rpc->context, &new_rpc->request, &new_rpc->response,
+      callback_fct);
 }
 
-void GrpcCallbackClientDriver::ChurnConnection(int peer) {}
+void GrpcCallbackClientDriver::ChurnConnection(int peer) {
+  channels_.Reconnect(peer);
+}
 
 void GrpcCallbackClientDriver::ShutdownClient() {
   while (pending_rpcs_) {
   }
-  grpc_client_stubs_.clear();
+  channels_.ReleaseStubs();
 }
 
 // Server =====================================================================
@@ -441,8 +743,8 @@ namespace {
 class TrafficServiceAsyncCallback
     : public Traffic::ExperimentalCallbackService {
  public:
-  TrafficServiceAsyncCallback(int threadpool_size)
-      : thread_pool_(threadpool_size) {}
+  TrafficServiceAsyncCallback(std::unique_ptr<AbstractThreadpool> thread_pool)
+      : thread_pool_(std::move(thread_pool)) {}
   ~TrafficServiceAsyncCallback() override { handler_set_.TryToNotify(); }
 
   void SetHandler(
@@ -455,18 +757,25 @@ class TrafficServiceAsyncCallback
                                        const GenericRequest* request,
                                        GenericResponse* response) override {
     auto* reactor = context->DefaultReactor();
-    ServerRpcState* rpc_state = new ServerRpcState;
+    ServerRpcState* rpc_state = ObjectPool<ServerRpcState>::Get();
     rpc_state->request = request;
+    if (rpc_state->RecordsServerTimings()) {
+      rpc_state->receive_time = absl::Now();
+    }
     rpc_state->SetSendResponseFunction([=]() {
+      rpc_state->RecordServerTimings();
       *response = std::move(rpc_state->response);
       reactor->Finish(grpc::Status::OK);
     });
-    rpc_state->SetFreeStateFunction([=]() { delete rpc_state; });
+    rpc_state->SetFreeStateFunction([=]() {
+      rpc_state->response.Clear();
+      ObjectPool<ServerRpcState>::Release(rpc_state);
+    });
     handler_set_.WaitForNotification();
     if (handler_) {
       auto remaining_work = handler_(rpc_state);
       if (remaining_work) {
-        thread_pool_.AddWork(remaining_work);
+        thread_pool_->AddWork(std::move(remaining_work));
       }
     }
     return reactor;
@@ -475,7 +784,7 @@ class TrafficServiceAsyncCallback
  private:
   SafeNotification handler_set_;
   std::function<std::function<void()>(ServerRpcState* state)> handler_;
-  distbench::DistbenchThreadpool thread_pool_;
+  std::unique_ptr<AbstractThreadpool> thread_pool_;
 };
 }  // anonymous namespace
 
@@ -491,10 +800,10 @@ absl::Status GrpcHandoffServerDriver::Initialize(
   if (!maybe_ip.ok()) return maybe_ip.status();
   server_ip_address_ = maybe_ip.value();
   server_socket_address_ = SocketAddressForIp(server_ip_address_, *port);
-  auto threadpool_size = GetNamedServerSettingInt64(
-      pd_opts, "threadpool_size", absl::base_internal::NumCPUs());
-  traffic_service_ =
-      std::make_unique<TrafficServiceAsyncCallback>(threadpool_size);
+  auto maybe_thread_pool = CreateThreadpoolFromSettings(pd_opts);
+  if (!maybe_thread_pool.ok()) return maybe_thread_pool.status();
+  traffic_service_ = std::make_unique<TrafficServiceAsyncCallback>(
+      std::move(maybe_thread_pool.value()));
   grpc::ServerBuilder builder;
   builder.SetMaxMessageSize(std::numeric_limits<int32_t>::max());
   std::shared_ptr<grpc::ServerCredentials> server_creds =
@@ -502,6 +811,9 @@ absl::Status GrpcHandoffServerDriver::Initialize(
   builder.AddListeningPort(server_socket_address_, server_creds, port);
   builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, 0);
   ApplyServerSettingsToGrpcBuilder(&builder, pd_opts);
+  absl::Status compression_status =
+      ApplyServerCompressionSettings(&builder, pd_opts);
+  if (!compression_status.ok()) return compression_status;
   builder.RegisterService(traffic_service_.get());
   server_ = builder.BuildAndStart();
 
@@ -551,12 +863,13 @@ class PollingRpcHandlerFsm {
   PollingRpcHandlerFsm(
       Traffic::AsyncService* service, grpc::ServerCompletionQueue* cq,
       std::function<std::function<void()>(ServerRpcState* state)>* handler,
-      DistbenchThreadpool* thread_pool)
+      AbstractThreadpool* thread_pool, bool defer_action_lists)
       : service_(service),
         cq_(cq),
         handler_(handler),
         responder_(&ctx_),
         thread_pool_(thread_pool),
+        defer_action_lists_(defer_action_lists),
         state_(AWAITING_REQUEST) {
     CHECK(thread_pool_);
     RpcHandlerFsm();
@@ -577,8 +890,13 @@ class PollingRpcHandlerFsm {
 
   void HandleRpc() {
     rpc_state_.have_dedicated_thread = false;
+    rpc_state_.defer_action_lists = defer_action_lists_;
     rpc_state_.request = &request_;
+    if (rpc_state_.RecordsServerTimings()) {
+      rpc_state_.receive_time = absl::Now();
+    }
     rpc_state_.SetSendResponseFunction([&]() {
+      rpc_state_.RecordServerTimings();
       response_ = std::move(rpc_state_.response);
       responder_.Finish(response_, grpc::Status::OK, this);
     });
@@ -587,7 +905,7 @@ class PollingRpcHandlerFsm {
     if (*handler_) {
       auto remaining_work = (*handler_)(&rpc_state_);
       if (remaining_work) {
-        thread_pool_->AddWork(remaining_work);
+        thread_pool_->AddWork(std::move(remaining_work));
       }
     }
   }
@@ -601,7 +919,8 @@ class PollingRpcHandlerFsm {
     } else if (state_ == PROCESSING_REQUEST) {
       next_state = FINISHED_SENDING_RESPONSE;
       if (post_new_handler) {
-        new PollingRpcHandlerFsm(service_, cq_, handler_, thread_pool_);
+        new PollingRpcHandlerFsm(service_, cq_, handler_, thread_pool_,
+                                 defer_action_lists_);
       }
       HandleRpc();
     } else if (state_ == FINISHED_SENDING_RESPONSE) {
@@ -627,7 +946,8 @@ class PollingRpcHandlerFsm {
   std::function<std::function<void()>(ServerRpcState* state)>* handler_;
   grpc::ServerAsyncResponseWriter<GenericResponse> responder_;
   grpc::ServerContext ctx_;
-  DistbenchThreadpool* thread_pool_;
+  AbstractThreadpool* thread_pool_;
+  bool defer_action_lists_;
   CallState state_;
   ServerRpcState rpc_state_;
   std::atomic<int> refcnt_ = 1;
@@ -635,8 +955,7 @@ class PollingRpcHandlerFsm {
 }  // anonymous namespace
 
 // Server =====================================================================
-GrpcPollingServerDriver::GrpcPollingServerDriver(int threadpool_size)
-    : thread_pool_(threadpool_size) {}
+GrpcPollingServerDriver::GrpcPollingServerDriver() {}
 
 GrpcPollingServerDriver::~GrpcPollingServerDriver() { ShutdownServer(); }
 
@@ -649,6 +968,41 @@ absl::Status GrpcPollingServerDriver::Initialize(
   if (!maybe_ip.ok()) return maybe_ip.status();
   server_ip_address_ = maybe_ip.value();
   server_socket_address_ = SocketAddressForIp(server_ip_address_, *port);
+  auto maybe_thread_pool = CreateThreadpoolFromSettings(pd_opts);
+  if (!maybe_thread_pool.ok()) return maybe_thread_pool.status();
+  thread_pool_ = std::move(maybe_thread_pool.value());
+  int64_t cq_count = GetNamedServerSettingInt64(pd_opts, "server_cq_count", 1);
+  if (cq_count < 1) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "server_cq_count (", cq_count, ") must be a positive integer."));
+  }
+  int64_t pending_requests =
+      GetNamedServerSettingInt64(pd_opts, "server_cq_pending_requests", 1);
+  if (pending_requests < 1) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("server_cq_pending_requests (", pending_requests,
+                     ") must be a positive integer."));
+  }
+  std::string dispatch =
+      GetNamedServerSettingString(pd_opts, "server_cq_dispatch", "inline");
+  if (dispatch == "handoff") {
+    defer_action_lists_ = true;
+  } else if (dispatch != "inline") {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "server_cq_dispatch must be inline or handoff, not ", dispatch));
+  }
+  auto maybe_wait_policy =
+      GetWaitPolicy(pd_opts.server_settings(), "server_cq_", {});
+  if (!maybe_wait_policy.ok()) return maybe_wait_policy.status();
+  wait_policy_ = maybe_wait_policy.value();
+  std::vector<int> handler_cpus;
+  std::string cpu_list =
+      GetNamedServerSettingString(pd_opts, "server_cq_cpus", "");
+  if (!cpu_list.empty()) {
+    auto maybe_cpus = ParseCpuList(cpu_list);
+    if (!maybe_cpus.ok()) return maybe_cpus.status();
+    handler_cpus = std::move(maybe_cpus.value());
+  }
   traffic_async_service_ = std::make_unique<Traffic::AsyncService>();
   grpc::ServerBuilder builder;
   builder.SetMaxMessageSize(std::numeric_limits<int32_t>::max());
@@ -657,8 +1011,14 @@ absl::Status GrpcPollingServerDriver::Initialize(
   builder.AddListeningPort(server_socket_address_, server_creds, port);
   builder.AddChannelArgument(GRPC_ARG_ALLOW_REUSEPORT, 0);
   ApplyServerSettingsToGrpcBuilder(&builder, pd_opts);
+  absl::Status compression_status =
+      ApplyServerCompressionSettings(&builder, pd_opts);
+  if (!compression_status.ok()) return compression_status;
   builder.RegisterService(traffic_async_service_.get());
-  server_cq_ = builder.AddCompletionQueue();
+  for (int64_t i = 0; i < cq_count; ++i) {
+    cq_shards_.push_back(std::make_unique<ServerCompletionQueueShard>());
+    cq_shards_.back()->cq = builder.AddCompletionQueue();
+  }
   server_ = builder.BuildAndStart();
 
   server_port_ = *port;
@@ -667,9 +1027,25 @@ absl::Status GrpcPollingServerDriver::Initialize(
     return absl::UnknownError("Grpc Traffic service failed to start");
   }
 
-  // Proceed to the server's main loop.
-  handle_rpcs_ = RunRegisteredThread("RpcHandler", [=]() { HandleRpcs(); });
-  handle_rpcs_started_.WaitForNotification();
+  // Make sure the completion queues are nonempty before allowing Initialize
+  // to return, then proceed to the server's main loops.
+  for (size_t i = 0; i < cq_shards_.size(); ++i) {
+    ServerCompletionQueueShard* shard = cq_shards_[i].get();
+    for (int64_t j = 0; j < pending_requests; ++j) {
+      new PollingRpcHandlerFsm(traffic_async_service_.get(), shard->cq.get(),
+                               &handler_, thread_pool_.get(),
+                               defer_action_lists_);
+    }
+    int cpu = handler_cpus.empty() ? -1 : handler_cpus[i % handler_cpus.size()];
+    shard->handle_rpcs =
+        RunRegisteredThread("RpcHandler", [this, shard, cpu]() {
+          if (cpu >= 0) {
+            absl::Status status = SetCurrentThreadAffinity(cpu);
+            if (!status.ok()) LOG(WARNING) << status;
+          }
+          HandleRpcs(shard);
+        });
+  }
   return absl::OkStatus();
 }
 
@@ -697,13 +1073,19 @@ void GrpcPollingServerDriver::ShutdownServer() {
   handler_set_.TryToNotify();
   if (server_) {
     server_->Shutdown();
-    server_shutdown_detected_.WaitForNotification();
+    for (auto& shard : cq_shards_) {
+      shard->server_shutdown_detected.WaitForNotification();
+    }
   }
-  if (server_cq_) {
-    server_cq_->Shutdown();
+  for (auto& shard : cq_shards_) {
+    if (shard->cq) {
+      shard->cq->Shutdown();
+    }
   }
-  if (handle_rpcs_.joinable()) {
-    handle_rpcs_.join();
+  for (auto& shard : cq_shards_) {
+    if (shard->handle_rpcs.joinable()) {
+      shard->handle_rpcs.join();
+    }
   }
 }
 
@@ -711,20 +1093,29 @@ std::vector<TransportStat> GrpcPollingServerDriver::GetTransportStats() {
   return {};
 }
 
-void GrpcPollingServerDriver::HandleRpcs() {
-  new PollingRpcHandlerFsm(traffic_async_service_.get(), server_cq_.get(),
-                           &handler_, &thread_pool_);
-  // Make sure the completion queue is nonempty before allowing Initialize
-  // to return:
-  handle_rpcs_started_.Notify();
+void GrpcPollingServerDriver::HandleRpcs(ServerCompletionQueueShard* shard) {
   void* tag;
   bool ok;
   bool post_new_handler = true;
   handler_set_.WaitForNotification();
-  while (server_cq_->Next(&tag, &ok)) {
+  WaitTimeCounters* wait_times = GetWaitTimeCounters("RpcHandler");
+  grpc::CompletionQueue::NextStatus status;
+  auto poll = [shard, &tag, &ok, &status]() {
+    status =
+        shard->cq->AsyncNext(&tag, &ok, gpr_time_0(GPR_CLOCK_MONOTONIC));
+    return status != grpc::CompletionQueue::TIMEOUT;
+  };
+  auto block = [shard, &tag, &ok, &status]() {
+    status = shard->cq->Next(&tag, &ok) ? grpc::CompletionQueue::GOT_EVENT
+                                        : grpc::CompletionQueue::SHUTDOWN;
+    return true;
+  };
+  while (true) {
+    if (!poll()) WaitWithPolicy(wait_policy_, wait_times, poll, block);
+    if (status == grpc::CompletionQueue::SHUTDOWN) break;
     PollingRpcHandlerFsm* rpc_fsm = static_cast<PollingRpcHandlerFsm*>(tag);
     if (!ok) {
-      server_shutdown_detected_.TryToNotify();
+      shard->server_shutdown_detected.TryToNotify();
       post_new_handler = false;
       rpc_fsm->DecRefAndMaybeDelete();
       continue;
@@ -15,13 +15,72 @@
 #ifndef DISTBENCH_PROTOCOL_DRIVER_GRPC_H_
 #define DISTBENCH_PROTOCOL_DRIVER_GRPC_H_
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include "distbench.grpc.pb.h"
 #include "distbench_threadpool.h"
 #include "distbench_utils.h"
+#include "distbench_wait_policy.h"
 #include "protocol_driver.h"
 
 namespace distbench {
 
+// The channels of a gRPC client driver to its peers. With the
+// channels_per_peer client setting, each peer gets several channels, each
+// with a connection (and HTTP/2 flow control window) of its own, and the
+// RPCs are spread over them following the channel_selection client setting:
+// round_robin (the default) or least_outstanding.
+class GrpcClientChannels {
+ public:
+  struct Channel {
+    // Replaced by Reconnect, so only accessed with std::atomic_load and
+    // std::atomic_store; the RPCs keep the stub they were started on.
+    std::shared_ptr<Traffic::Stub> stub;
+    std::atomic<int64_t> outstanding_rpcs = 0;
+    std::atomic<int64_t> max_outstanding_rpcs = 0;
+    std::atomic<int64_t> rpc_count = 0;
+  };
+
+  absl::Status Initialize(const ProtocolDriverOptions& pd_opts);
+  void SetNumPeers(int num_peers);
+  size_t num_peers() const { return peers_.size(); }
+  void Connect(int peer, const std::string& socket_address,
+               std::string_view transport,
+               grpc_compression_algorithm compression_algorithm);
+
+  // Returns the channel of the next RPC to the peer, which must be passed
+  // to RpcDone once the RPC completes.
+  Channel* PickChannel(int peer);
+  static void RpcDone(Channel* channel) {
+    channel->outstanding_rpcs.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Replaces the channels to the peer by new ones, each with a connection
+  // of its own, and returns once they are connected. The RPCs in flight
+  // complete on the old channels, which are closed after the last one.
+  void Reconnect(int peer);
+
+  // The RPC counts of each channel, if there are several per peer.
+  std::vector<TransportStat> GetTransportStats();
+  // Closes the channels, but keeps their stats.
+  void ReleaseStubs();
+
+ private:
+  struct PeerChannels {
+    std::vector<std::unique_ptr<Channel>> channels;
+    std::atomic<size_t> next_channel = 0;
+    std::string socket_address;
+  };
+
+  int channels_per_peer_ = 1;
+  std::string transport_;
+  grpc_compression_algorithm compression_algorithm_ = GRPC_COMPRESS_NONE;
+  bool least_outstanding_ = false;
+  std::vector<std::unique_ptr<PeerChannels>> peers_;
+};
+
 class GrpcPollingClientDriver : public ProtocolDriverClient {
  public:
   GrpcPollingClientDriver();
@@ -48,14 +107,26 @@ class GrpcPollingClientDriver : public ProtocolDriverClient {
   virtual std::vector<TransportStat> GetTransportStats() override;
 
  private:
-  void RpcCompletionThread();
+  struct CompletionQueueShard {
+    grpc::CompletionQueue cq;
+    std::thread poller;
+  };
+
+  void RpcCompletionThread(grpc::CompletionQueue* cq);
 
   std::string transport_;
+  grpc_compression_algorithm compression_algorithm_ = GRPC_COMPRESS_NONE;
   absl::Notification shutdown_;
   std::atomic<int> pending_rpcs_ = 0;
-  std::vector<std::unique_ptr<Traffic::Stub>> grpc_client_stubs_;
-  std::thread cq_poller_;
-  grpc::CompletionQueue cq_;
+  GrpcClientChannels channels_;
+  // client_cq_count completion queues, each drained by its own poller. The
+  // RPCs are sharded by peer, or round-robin if client_cq_sharding is
+  // round_robin:
+  std::vector<std::unique_ptr<CompletionQueueShard>> cq_shards_;
+  bool round_robin_cq_sharding_ = false;
+  std::atomic<size_t> next_cq_shard_ = 0;
+  // How the pollers wait, see client_cq_wait_policy:
+  WaitPolicy wait_policy_;
 };
 
 class GrpcInlineServerDriver : public ProtocolDriverServer {
@@ -144,8 +215,9 @@ class GrpcCallbackClientDriver : public ProtocolDriverClient {
 
  private:
   std::atomic<int> pending_rpcs_ = 0;
-  std::vector<std::unique_ptr<Traffic::Stub>> grpc_client_stubs_;
+  GrpcClientChannels channels_;
   std::string transport_;
+  grpc_compression_algorithm compression_algorithm_ = GRPC_COMPRESS_NONE;
 };
 
 class GrpcHandoffServerDriver : public ProtocolDriverServer {
@@ -176,8 +248,7 @@ class GrpcHandoffServerDriver : public ProtocolDriverServer {
 
 class GrpcPollingServerDriver : public ProtocolDriverServer {
  public:
-  // TODO: Add a struct of threadpool options in future.
-  GrpcPollingServerDriver(int threadpool_size);
+  GrpcPollingServerDriver();
   ~GrpcPollingServerDriver() override;
 
   absl::Status Initialize(const ProtocolDriverOptions& pd_opts,
@@ -191,22 +262,29 @@ class GrpcPollingServerDriver : public ProtocolDriverServer {
   void HandleConnectFailure(std::string_view local_connection_info) override;
 
   std::vector<TransportStat> GetTransportStats() override;
-  void ProcessGenericRpc(GenericRequest* request, GenericResponse* response);
-  void HandleRpcs();
-  std::thread handle_rpcs_;
 
  private:
+  struct ServerCompletionQueueShard {
+    std::unique_ptr<grpc::ServerCompletionQueue> cq;
+    std::thread handle_rpcs;
+    SafeNotification server_shutdown_detected;
+  };
+
+  void HandleRpcs(ServerCompletionQueueShard* shard);
+
   std::unique_ptr<grpc::Server> server_;
   int server_port_ = 0;
   DeviceIpAddress server_ip_address_;
   std::string server_socket_address_;
-  std::unique_ptr<grpc::ServerCompletionQueue> server_cq_;
+  // server_cq_count completion queues, each with its own HandleRpcs loop and
+  // server_cq_pending_requests requests posted at all times:
+  std::vector<std::unique_ptr<ServerCompletionQueueShard>> cq_shards_;
+  bool defer_action_lists_ = false;
+  // How the HandleRpcs loops wait, see server_cq_wait_policy:
+  WaitPolicy wait_policy_;
   std::unique_ptr<Traffic::AsyncService> traffic_async_service_;
-  grpc::ServerContext context;
   std::function<std::function<void()>(ServerRpcState* state)> handler_;
-  DistbenchThreadpool thread_pool_;
-  SafeNotification server_shutdown_detected_;
-  absl::Notification handle_rpcs_started_;
+  std::unique_ptr<AbstractThreadpool> thread_pool_;
   SafeNotification handler_set_;
   std::string transport_;
 };
@@ -6,9 +6,60 @@
 #include "distbench_utils.h"
 #include "external/homa_module/homa.h"
 #include "glog/logging.h"
+#include "google/protobuf/io/zero_copy_stream.h"
 
 namespace distbench {
 
+namespace {
+
+// Homa can't send a 0 byte message, so every message starts with one byte:
+constexpr char kRequestPrefix = '?';
+constexpr char kResponsePrefix = '!';
+// Sent instead of a response that Homa cannot carry:
+constexpr char kFailedResponsePrefix = 'X';
+
+// Reads the message held by a homa::receiver straight out of its buffer
+// pages, without copying it. The stream is only valid until the next
+// receive() on the receiver.
+class HomaMessageInputStream
+    : public ::google::protobuf::io::ZeroCopyInputStream {
+ public:
+  // Skips the prefix byte of the msg_length bytes message.
+  HomaMessageInputStream(const homa::receiver* receiver, ssize_t msg_length)
+      : receiver_(receiver), offset_(1), end_(msg_length) {}
+
+  bool Next(const void** data, int* size) override {
+    if (offset_ >= end_) return false;
+    size_t contiguous = std::min(receiver_->contiguous(offset_),
+                                 static_cast<size_t>(end_ - offset_));
+    if (!contiguous) return false;
+    *data = receiver_->get<char>(offset_);
+    *size = contiguous;
+    offset_ += contiguous;
+    return true;
+  }
+
+  void BackUp(int count) override { offset_ -= count; }
+
+  bool Skip(int count) override {
+    if (count > end_ - offset_) {
+      offset_ = end_;
+      return false;
+    }
+    offset_ += count;
+    return true;
+  }
+
+  int64_t ByteCount() const override { return offset_ - 1; }
+
+ private:
+  const homa::receiver* receiver_;
+  int64_t offset_;
+  const int64_t end_;
+};
+
+}  // anonymous namespace
+
 ///////////////////////////////////
 // ProtocolDriverHoma Methods //
 ///////////////////////////////////
@@ -34,12 +85,36 @@ absl::Status ProtocolDriverHoma::Initialize(
         return absl::InvalidArgumentError(
             "server_threads int64_value field must be positive ");
       }
+    } else if (setting.name() == "server_type") {
+      if (setting.string_value() == "handoff") {
+        handoff_ = true;
+      } else if (setting.string_value() != "inline") {
+        return absl::InvalidArgumentError(absl::StrCat(
+            "server_type must be inline or handoff, not ",
+            setting.string_value()));
+      }
+    } else if (setting.name() == "threadpool_size" ||
+               setting.name() == "threadpool_type" ||
+               setting.name() == "threadpool_wait_policy" ||
+               setting.name() == "threadpool_wait_spin_budget") {
+      // Handled by CreateThreadpoolFromSettings.
+    } else if (setting.name() == "wait_policy" ||
+               setting.name() == "wait_spin_budget") {
+      // Handled by GetWaitPolicy.
     } else {
       return absl::InvalidArgumentError(
           absl::StrCat("unknown protocol driver option: ", setting.name()));
     }
   }
 
+  auto maybe_wait_policy = GetWaitPolicy(pd_opts.server_settings(), "", {});
+  if (!maybe_wait_policy.ok()) return maybe_wait_policy.status();
+  wait_policy_ = maybe_wait_policy.value();
+
+  auto maybe_thread_pool = CreateThreadpoolFromSettings(pd_opts);
+  if (!maybe_thread_pool.ok()) return maybe_thread_pool.status();
+  thread_pool_ = std::move(maybe_thread_pool.value());
+
   auto maybe_ip = IpAddressForDevice(netdev_name_);
   if (!maybe_ip.ok()) return maybe_ip.status();
   server_ip_address_ = maybe_ip.value();
@@ -70,8 +145,10 @@ absl::Status ProtocolDriverHoma::Initialize(
   arg.length = kHomaBufferSize;
   setsockopt(homa_server_sock_, IPPROTO_HOMA, SO_HOMA_SET_BUF, &arg,
              sizeof(arg));
-  server_receiver_ =
-      std::make_unique<homa::receiver>(homa_server_sock_, server_buffer_);
+  for (int i = 0; i < server_run_threads_; ++i) {
+    server_receivers_.push_back(
+        std::make_unique<homa::receiver>(homa_server_sock_, server_buffer_));
+  }
 
   sockaddr_in_union bind_addr = {};
   int bind_err = 0;
@@ -116,8 +193,11 @@ absl::Status ProtocolDriverHoma::Initialize(
 
   client_completion_thread_ = RunRegisteredThread(
       "HomaClient", [=]() { this->ClientCompletionThread(); });
-  server_thread_ =
-      RunRegisteredThread("HomaServer", [=]() { this->ServerThread(); });
+  for (auto& receiver : server_receivers_) {
+    homa::receiver* r = receiver.get();
+    server_threads_.push_back(
+        RunRegisteredThread("HomaServer", [=]() { this->ServerThread(r); }));
+  }
   return absl::OkStatus();
 }
 
@@ -186,14 +266,17 @@ std::vector<TransportStat> ProtocolDriverHoma::GetTransportStats() {
 }
 
 void ProtocolDriverHoma::ChurnConnection(int peer) {
-  // Not required for Homa.
+  // Never called, see SupportsConnectionChurn: Homa is connectionless, all
+  // the peers share the client socket, so there is no connection to
+  // re-establish.
 }
 
 void ProtocolDriverHoma::ShutdownServer() {
   handler_set_.TryToNotify();
   if (shutting_down_server_.TryToNotify()) {
-    if (server_thread_.joinable()) {
-      // Initiate RPC to our own server sock, to wake up the server_thread_:
+    if (!server_threads_.empty()) {
+      // Initiate one RPC to our own server sock per server thread, to wake
+      // them all up:
       char buf[1] = {};
       uint64_t kernel_rpc_number;
       sockaddr_in_union loopback;
@@ -208,15 +291,25 @@ void ProtocolDriverHoma::ShutdownServer() {
         loopback.in4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
       }
 
-      int64_t res = homa_send(homa_server_sock_, buf, 1, &loopback,
-                              &kernel_rpc_number, 0);
-      if (res < 0) {
-        LOG(INFO) << "homa_send result: " << res << " errno: " << errno
-                  << " kernel_rpc_number " << kernel_rpc_number;
+      for (size_t i = 0; i < server_threads_.size(); ++i) {
+        int64_t res = homa_send(homa_server_sock_, buf, 1, &loopback,
+                                &kernel_rpc_number, 0);
+        if (res < 0) {
+          LOG(INFO) << "homa_send result: " << res << " errno: " << errno
+                    << " kernel_rpc_number " << kernel_rpc_number;
+        }
+      }
+      for (auto& thread : server_threads_) {
+        thread.join();
       }
-      server_thread_.join();
+      server_threads_.clear();
     }
-    server_receiver_.reset();
+    while (pending_server_rpcs_) {
+      sched_yield();
+    }
+    // Runs the work that is still queued:
+    thread_pool_.reset();
+    server_receivers_.clear();
     if (server_buffer_) {
       munmap(server_buffer_, kHomaBufferSize);
       server_buffer_ = nullptr;
@@ -273,10 +366,21 @@ void ProtocolDriverHoma::InitiateRpc(int peer_index, ClientRpcState* state,
 
   new_rpc->done_callback = done_callback;
   new_rpc->state = state;
-  new_rpc->serialized_request = "?";  // Homa can't send a 0 byte message :(
+  new_rpc->serialized_request = kRequestPrefix;
   state->request.AppendToString(&new_rpc->serialized_request);
+  if (state->request.record_stage_timings()) {
+    state->serialize_done_time = absl::Now();
+  }
   const char* const buf = new_rpc->serialized_request.data();
   const size_t buflen = new_rpc->serialized_request.size();
+  if (buflen > HOMA_MAX_MESSAGE_LENGTH) {
+    LOG(ERROR) << "request of " << buflen << " bytes exceeds the "
+               << HOMA_MAX_MESSAGE_LENGTH << " bytes Homa can send";
+    delete new_rpc;
+    state->success = false;
+    done_callback();
+    return;
+  }
 #ifdef THREAD_SANITIZER
   __tsan_release(new_rpc);
 #endif
@@ -293,20 +397,34 @@ void ProtocolDriverHoma::InitiateRpc(int peer_index, ClientRpcState* state,
     delete new_rpc;
     state->success = false;
     done_callback();
+    --pending_rpcs_;
   }
 }
 
-void ProtocolDriverHoma::ServerThread() {
-  std::atomic<int> pending_actionlist_threads = 0;
-
+void ProtocolDriverHoma::ServerThread(homa::receiver* receiver) {
   handler_set_.WaitForNotification();
-  while (1) {
+  WaitTimeCounters* wait_times = GetWaitTimeCounters("HomaServer");
+  ssize_t msg_length;
+  int recv_errno;
+  auto receive = [receiver, &msg_length, &recv_errno](int flags) {
     errno = 0;
-    ssize_t msg_length = server_receiver_->receive(HOMA_RECVMSG_REQUEST, 0);
+    msg_length = receiver->receive(HOMA_RECVMSG_REQUEST | flags, 0);
+    recv_errno = errno;
+  };
+  auto poll = [this, &receive, &msg_length, &recv_errno]() {
+    receive(HOMA_RECVMSG_NONBLOCKING);
+    return msg_length >= 0 || recv_errno != EAGAIN ||
+           shutting_down_server_.HasBeenNotified();
+  };
+  auto block = [&receive]() {
+    receive(0);
+    return true;
+  };
+  while (1) {
+    if (!poll()) WaitWithPolicy(wait_policy_, wait_times, poll, block);
     if (shutting_down_server_.HasBeenNotified()) {
       break;
     }
-    int recv_errno = errno;
     if (msg_length < 0) {
       if (recv_errno != EINTR && recv_errno != EAGAIN) {
         LOG(ERROR) << "server homa_recv had an error: " << strerror(recv_errno);
@@ -317,49 +435,90 @@ void ProtocolDriverHoma::ServerThread() {
       LOG(ERROR) << "server homa_recv got zero length request.";
       continue;
     }
-    CHECK(server_receiver_->is_request());
-    const sockaddr_in_union src_addr = *server_receiver_->src_addr();
-    const uint64_t rpc_id = server_receiver_->id();
+    CHECK(receiver->is_request());
+    const sockaddr_in_union src_addr = *receiver->src_addr();
+    const uint64_t rpc_id = receiver->id();
+    absl::Time receive_time = absl::Now();
 
     GenericRequest* request = new GenericRequest;
-    char rx_buf[1048576];
-    server_receiver_->copy_out((void*)rx_buf, 0, sizeof(rx_buf));
-    if (!request->ParseFromArray(rx_buf + 1, msg_length - 1)) {
-      LOG(ERROR) << "rx_buf did not parse as a GenericRequest";
+    HomaMessageInputStream request_stream(receiver, msg_length);
+    if (!request->ParseFromZeroCopyStream(&request_stream)) {
+      // The handler must not see a partially parsed request:
+      LOG(ERROR) << "request did not parse as a GenericRequest";
+      delete request;
+      const char failed_response = kFailedResponsePrefix;
+      if (homa_reply(homa_server_sock_, &failed_response, 1, &src_addr,
+                     rpc_id)) {
+        LOG(ERROR) << "homa_reply for " << rpc_id
+                   << " returned error: " << strerror(errno);
+      }
+      continue;
     }
     ServerRpcState* rpc_state = new ServerRpcState;
     rpc_state->request = request;
+    if (rpc_state->RecordsServerTimings()) {
+      rpc_state->receive_time = receive_time;
+    }
     rpc_state->SetFreeStateFunction([=]() {
       delete rpc_state->request;
       delete rpc_state;
     });
-    rpc_state->SetSendResponseFunction([=, &pending_actionlist_threads]() {
-      std::string txbuf = "!";  // Homa can't send a 0 byte message :(
+    rpc_state->SetSendResponseFunction([=]() {
+      rpc_state->RecordServerTimings();
+      std::string txbuf(1, kResponsePrefix);
       rpc_state->response.AppendToString(&txbuf);
+      if (txbuf.length() > HOMA_MAX_MESSAGE_LENGTH) {
+        LOG(ERROR) << "response of " << txbuf.length() << " bytes exceeds the "
+                   << HOMA_MAX_MESSAGE_LENGTH << " bytes Homa can send";
+        txbuf.assign(1, kFailedResponsePrefix);
+      }
       int64_t error = homa_reply(homa_server_sock_, txbuf.c_str(),
                                  txbuf.length(), &src_addr, rpc_id);
       if (error) {
         LOG(ERROR) << "homa_reply for " << rpc_id
                    << " returned error: " << strerror(errno);
       }
-      --pending_actionlist_threads;
+      --pending_server_rpcs_;
     });
-    auto fct_action_list_thread = rpc_handler_(rpc_state);
-    ++pending_actionlist_threads;
-    if (fct_action_list_thread)
-      RunRegisteredThread("DedicatedActionListThread", fct_action_list_thread)
-          .detach();
+    ++pending_server_rpcs_;
+    if (handoff_) {
+      thread_pool_->AddWork([this, rpc_state]() { HandleRequest(rpc_state); });
+    } else {
+      HandleRequest(rpc_state);
+    }
   }
-  while (pending_actionlist_threads) {
-    sched_yield();
+}
+
+void ProtocolDriverHoma::HandleRequest(ServerRpcState* rpc_state) {
+  auto remaining_work = rpc_handler_(rpc_state);
+  if (!remaining_work) return;
+  if (handoff_) {
+    // Already on a thread of the pool:
+    remaining_work();
+  } else {
+    thread_pool_->AddWork(std::move(remaining_work));
   }
 }
 
 void ProtocolDriverHoma::ClientCompletionThread() {
-  while (!shutting_down_client_.HasBeenNotified() || pending_rpcs_) {
+  WaitTimeCounters* wait_times = GetWaitTimeCounters("HomaClient");
+  ssize_t msg_length;
+  int recv_errno;
+  auto receive = [this, &msg_length, &recv_errno](int flags) {
     errno = 0;
-    ssize_t msg_length = client_receiver_->receive(HOMA_RECVMSG_RESPONSE, 0);
-    int recv_errno = errno;
+    msg_length = client_receiver_->receive(HOMA_RECVMSG_RESPONSE | flags, 0);
+    recv_errno = errno;
+  };
+  auto poll = [&receive, &msg_length, &recv_errno]() {
+    receive(HOMA_RECVMSG_NONBLOCKING);
+    return msg_length >= 0 || recv_errno != EAGAIN;
+  };
+  auto block = [&receive]() {
+    receive(0);
+    return true;
+  };
+  while (!shutting_down_client_.HasBeenNotified() || pending_rpcs_) {
+    if (!poll()) WaitWithPolicy(wait_policy_, wait_times, poll, block);
     if (msg_length < 0) {
       if (recv_errno != EINTR && recv_errno != EAGAIN) {
         LOG(ERROR) << "homa_recv had an error: " << strerror(recv_errno);
@@ -373,16 +532,20 @@ void ProtocolDriverHoma::ClientCompletionThread() {
     __tsan_acquire(pending_rpc);
 #endif
     CHECK(pending_rpc) << "Completion cookie was NULL";
-    if (recv_errno || !msg_length) {
+    if (pending_rpc->state->request.record_stage_timings()) {
+      pending_rpc->state->completion_dequeued_time = absl::Now();
+    }
+    if (recv_errno || !msg_length ||
+        *client_receiver_->get<char>(0) == kFailedResponsePrefix) {
       pending_rpc->state->success = false;
     } else {
       pending_rpc->state->success = true;
-      char rx_buf[1048576];
       CHECK(!client_receiver_->is_request());
-      client_receiver_->copy_out((void*)rx_buf, 0, sizeof(rx_buf));
-      if (!pending_rpc->state->response.ParseFromArray(rx_buf + 1,
-                                                       msg_length - 1)) {
-        LOG(ERROR) << "rx_buf did not parse as a GenericResponse";
+      HomaMessageInputStream response_stream(client_receiver_.get(),
+                                             msg_length);
+      if (!pending_rpc->state->response.ParseFromZeroCopyStream(
+              &response_stream)) {
+        LOG(ERROR) << "response did not parse as a GenericResponse";
       }
     }
     pending_rpc->done_callback();
@@ -1,7 +1,9 @@
 #ifndef DISTBENCH_PROTOCOL_DRIVER_HOMA_H_
 #define DISTBENCH_PROTOCOL_DRIVER_HOMA_H_
 
+#include "distbench_threadpool.h"
 #include "distbench_utils.h"
+#include "distbench_wait_policy.h"
 #include "external/homa_module/homa.h"
 #include "external/homa_module/homa_receiver.h"
 #include "protocol_driver.h"
@@ -40,6 +42,7 @@ class ProtocolDriverHoma : public ProtocolDriver {
                    std::function<void(void)> done_callback) override;
 
   void ChurnConnection(int peer) override;
+  bool SupportsConnectionChurn() override { return false; }
 
   void ShutdownServer() override;
 
@@ -47,13 +50,15 @@ class ProtocolDriverHoma : public ProtocolDriver {
 
  private:
   void ClientCompletionThread();
-  void ServerThread();
+  void ServerThread(homa::receiver* receiver);
+  void HandleRequest(ServerRpcState* rpc_state);
 
   const size_t kHomaBufferSize = 1000 * HOMA_BPAGE_SIZE;
   void* client_buffer_ = nullptr;
   void* server_buffer_ = nullptr;
   std::unique_ptr<homa::receiver> client_receiver_;
-  std::unique_ptr<homa::receiver> server_receiver_;
+  // One per server thread; they all share server_buffer_.
+  std::vector<std::unique_ptr<homa::receiver>> server_receivers_;
 
   int homa_client_sock_ = -1;
   int homa_server_sock_ = -1;
@@ -61,8 +66,19 @@ class ProtocolDriverHoma : public ProtocolDriver {
   DeviceIpAddress server_ip_address_;
   std::string my_server_socket_address_;
 
+  // How the server threads and the client completion thread wait for their
+  // next message, see wait_policy:
+  WaitPolicy wait_policy_;
+
   // Homa RPC Server.
   int server_run_threads_ = 1;
+  // With server_type=handoff every request is handled by thread_pool_;
+  // otherwise the handlers run inline on the receive threads, and only the
+  // work they hand back goes to thread_pool_.
+  bool handoff_ = false;
+  std::unique_ptr<AbstractThreadpool> thread_pool_;
+  // The requests whose response has not been sent yet:
+  std::atomic<int> pending_server_rpcs_ = 0;
 
   // Homa RPC Client.
   int client_run_threads_ = 1;
@@ -70,7 +86,7 @@ class ProtocolDriverHoma : public ProtocolDriver {
 
   std::string netdev_name_;
   std::thread client_completion_thread_;
-  std::thread server_thread_;
+  std::vector<std::thread> server_threads_;
   SafeNotification handler_set_;
   SafeNotification shutting_down_server_;
   SafeNotification shutting_down_client_;
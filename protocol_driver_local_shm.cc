@@ -0,0 +1,189 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protocol_driver_local_shm.h"
+
+#include "absl/strings/str_cat.h"
+#include "distbench_utils.h"
+#include "glog/logging.h"
+#include "protocol_driver_allocator.h"
+
+namespace distbench {
+
+// ProtocolDriver ===============================================
+ProtocolDriverLocalShm::ProtocolDriverLocalShm(int tree_depth) {
+  tree_depth_ = tree_depth;
+}
+
+ProtocolDriverLocalShm::~ProtocolDriverLocalShm() {}
+
+absl::Status ProtocolDriverLocalShm::Initialize(
+    const ProtocolDriverOptions& pd_opts, int* port) {
+  auto pdo = pd_opts;
+  pdo.set_protocol_name("grpc");
+  auto server_settings = pdo.mutable_server_settings();
+  for (auto it = server_settings->begin(); it != server_settings->end(); it++) {
+    if (it->name() == "next_protocol_driver") {
+      pdo.set_protocol_name(it->string_value());
+      server_settings->erase(it);
+      break;
+    }
+  }
+
+  auto maybe_network = AllocateProtocolDriver(pdo, port, tree_depth_ + 1);
+  if (!maybe_network.ok()) return maybe_network.status();
+  network_ = std::move(maybe_network.value());
+
+  pdo.set_protocol_name("shm");
+  int shm_port = 0;
+  auto maybe_shm = AllocateProtocolDriver(pdo, &shm_port, tree_depth_ + 1);
+  if (!maybe_shm.ok()) return maybe_shm.status();
+  shm_ = std::move(maybe_shm.value());
+
+  return absl::OkStatus();
+}
+
+void ProtocolDriverLocalShm::SetHandler(
+    std::function<std::function<void()>(ServerRpcState* state)> handler) {
+  shm_->SetHandler(handler);
+  network_->SetHandler(handler);
+}
+
+void ProtocolDriverLocalShm::SetNumPeers(int num_peers) {
+  shm_->SetNumPeers(num_peers);
+  network_->SetNumPeers(num_peers);
+  peer_uses_shm_.assign(num_peers, false);
+}
+
+absl::StatusOr<std::string> ProtocolDriverLocalShm::Preconnect() {
+  LocalShmConnectionInfo info;
+  auto maybe_shm_info = shm_->Preconnect();
+  if (!maybe_shm_info.ok()) return maybe_shm_info.status();
+  info.set_shm_info(maybe_shm_info.value());
+  auto maybe_network_info = network_->Preconnect();
+  if (!maybe_network_info.ok()) return maybe_network_info.status();
+  info.set_network_info(maybe_network_info.value());
+  return info.SerializeAsString();
+}
+
+absl::StatusOr<std::string> ProtocolDriverLocalShm::HandlePreConnect(
+    std::string_view remote_connection_info, int peer) {
+  LocalShmConnectionInfo initiator_info;
+  if (!initiator_info.ParseFromArray(remote_connection_info.data(),
+                                     remote_connection_info.size())) {
+    return absl::InvalidArgumentError("initiator_info did not parse");
+  }
+  LocalShmConnectionInfo responder_info;
+  if (initiator_info.has_shm_info()) {
+    auto maybe_shm_info =
+        shm_->HandlePreConnect(initiator_info.shm_info(), peer);
+    if (maybe_shm_info.ok()) {
+      responder_info.set_shm_info(maybe_shm_info.value());
+      return responder_info.SerializeAsString();
+    }
+    // The initiator runs on another host:
+    if (!absl::IsFailedPrecondition(maybe_shm_info.status())) {
+      return maybe_shm_info.status();
+    }
+  }
+  auto maybe_network_info =
+      network_->HandlePreConnect(initiator_info.network_info(), peer);
+  if (!maybe_network_info.ok()) return maybe_network_info.status();
+  responder_info.set_network_info(maybe_network_info.value());
+  return responder_info.SerializeAsString();
+}
+
+absl::Status ProtocolDriverLocalShm::HandleConnect(
+    std::string remote_connection_info, int peer) {
+  CHECK_GE(peer, 0);
+  CHECK_LT(static_cast<size_t>(peer), peer_uses_shm_.size());
+  LocalShmConnectionInfo info;
+  if (!info.ParseFromString(remote_connection_info)) {
+    return absl::UnknownError(absl::StrCat(
+        "remote_connection_info did not parse: ", remote_connection_info));
+  }
+  peer_uses_shm_[peer] = info.has_shm_info();
+  if (peer_uses_shm_[peer]) {
+    return shm_->HandleConnect(info.shm_info(), peer);
+  }
+  return network_->HandleConnect(info.network_info(), peer);
+}
+
+void ProtocolDriverLocalShm::HandleConnectFailure(
+    std::string_view local_connection_info) {
+  LocalShmConnectionInfo info;
+  if (!info.ParseFromArray(local_connection_info.data(),
+                           local_connection_info.size())) {
+    return;
+  }
+  shm_->HandleConnectFailure(info.shm_info());
+  network_->HandleConnectFailure(info.network_info());
+}
+
+std::vector<TransportStat> ProtocolDriverLocalShm::GetTransportStats() {
+  std::vector<TransportStat> transport_stats;
+
+  std::string prefix = "";
+  auto add_prefix = [&](TransportStat& ts) { ts.name.insert(0, prefix); };
+
+  prefix = "shm/";
+  auto shm_stats = shm_->GetTransportStats();
+  std::for_each(shm_stats.begin(), shm_stats.end(), add_prefix);
+  transport_stats.insert(transport_stats.end(), shm_stats.begin(),
+                         shm_stats.end());
+
+  prefix = "network/";
+  auto network_stats = network_->GetTransportStats();
+  std::for_each(network_stats.begin(), network_stats.end(), add_prefix);
+  transport_stats.insert(transport_stats.end(), network_stats.begin(),
+                         network_stats.end());
+
+  return transport_stats;
+}
+
+void ProtocolDriverLocalShm::InitiateRpc(
+    int peer_index, ClientRpcState* state,
+    std::function<void(void)> done_callback) {
+  if (peer_uses_shm_[peer_index]) {
+    shm_->InitiateRpc(peer_index, state, done_callback);
+  } else {
+    network_->InitiateRpc(peer_index, state, done_callback);
+  }
+}
+
+void ProtocolDriverLocalShm::ChurnConnection(int peer) {
+  if (peer_uses_shm_[peer]) {
+    shm_->ChurnConnection(peer);
+  } else {
+    network_->ChurnConnection(peer);
+  }
+}
+
+// Which driver a peer uses is only known once it is connected:
+bool ProtocolDriverLocalShm::SupportsConnectionChurn() {
+  return shm_->SupportsConnectionChurn() &&
+         network_->SupportsConnectionChurn();
+}
+
+void ProtocolDriverLocalShm::ShutdownClient() {
+  shm_->ShutdownClient();
+  network_->ShutdownClient();
+}
+
+void ProtocolDriverLocalShm::ShutdownServer() {
+  shm_->ShutdownServer();
+  network_->ShutdownServer();
+}
+
+}  // namespace distbench
@@ -0,0 +1,66 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_PROTOCOL_DRIVER_LOCAL_SHM_H_
+#define DISTBENCH_PROTOCOL_DRIVER_LOCAL_SHM_H_
+
+#include "protocol_driver.h"
+
+namespace distbench {
+
+// Talks to the peers on the same host with the shm protocol driver, and to
+// the other ones with the next_protocol_driver (default: grpc).
+class ProtocolDriverLocalShm : public ProtocolDriver {
+ public:
+  ProtocolDriverLocalShm(int tree_depth);
+  ~ProtocolDriverLocalShm() override;
+
+  absl::Status Initialize(const ProtocolDriverOptions& pd_opts,
+                          int* port) override;
+
+  void SetHandler(std::function<std::function<void()>(ServerRpcState* state)>
+                      handler) override;
+  void SetNumPeers(int num_peers) override;
+
+  // Returns the initiator info of both drivers.
+  absl::StatusOr<std::string> Preconnect() override;
+
+  // Connects with the driver picked by the responder.
+  absl::Status HandleConnect(std::string remote_connection_info,
+                             int peer) override;
+
+  // Picks the shm driver if the initiator runs on this host.
+  absl::StatusOr<std::string> HandlePreConnect(
+      std::string_view remote_connection_info, int peer) override;
+  void HandleConnectFailure(std::string_view local_connection_info) override;
+
+  std::vector<TransportStat> GetTransportStats() override;
+  void InitiateRpc(int peer_index, ClientRpcState* state,
+                   std::function<void(void)> done_callback) override;
+  void ChurnConnection(int peer) override;
+  bool SupportsConnectionChurn() override;
+  void ShutdownServer() override;
+  void ShutdownClient() override;
+
+ private:
+  std::unique_ptr<distbench::ProtocolDriver> shm_;
+  std::unique_ptr<distbench::ProtocolDriver> network_;
+  int tree_depth_;
+  // Indexed by peer:
+  std::vector<bool> peer_uses_shm_;
+};
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_PROTOCOL_DRIVER_LOCAL_SHM_H_
@@ -19,6 +19,9 @@
 #include <mercury_macros.h>
 #include <mercury_proc_string.h>
 
+#include <cstring>
+#include <iterator>
+
 #include "absl/base/const_init.h"
 #include "absl/strings/str_replace.h"
 #include "absl/synchronization/mutex.h"
@@ -47,6 +50,17 @@ absl::Status ProtocolDriverMercury::Initialize(
                             "ofi+tcp://__SERVER_IP__");
   info_string = absl::StrReplaceAll(
       info_string, {{"__SERVER_IP__", server_socket_address_}});
+  bulk_threshold_ =
+      GetNamedSettingInt64(pd_opts.server_settings(), "bulk_threshold", 0);
+  bulk_response_capacity_ = GetNamedSettingInt64(
+      pd_opts.server_settings(), "bulk_response_capacity", 0);
+  if (bulk_threshold_ < 0 || bulk_response_capacity_ < 0) {
+    return absl::InvalidArgumentError(
+        "bulk_threshold and bulk_response_capacity must not be negative");
+  }
+  auto maybe_wait_policy = GetWaitPolicy(pd_opts.server_settings(), "", {});
+  if (!maybe_wait_policy.ok()) return maybe_wait_policy.status();
+  wait_policy_ = maybe_wait_policy.value();
   {
     absl::MutexLock l(&mercury_init_mutex);
     hg_class_ = HG_Init(info_string.c_str(), /*listen=*/true);
@@ -107,7 +121,9 @@ void ProtocolDriverMercury::SetHandler(
 }
 
 void ProtocolDriverMercury::SetNumPeers(int num_peers) {
+  absl::MutexLock m(&remote_addresses_mutex_);
   remote_addresses_.resize(num_peers);
+  remote_connection_info_.resize(num_peers);
 }
 
 ProtocolDriverMercury::~ProtocolDriverMercury() {
@@ -115,6 +131,12 @@ ProtocolDriverMercury::~ProtocolDriverMercury() {
   ShutdownClient();
   {
     absl::MutexLock l(&mercury_init_mutex);
+    absl::MutexLock m(&bulk_buffers_mutex_);
+    for (MercuryBulkBuffer* buffer : free_bulk_buffers_) {
+      HG_Bulk_free(buffer->handle);
+      delete buffer;
+    }
+    free_bulk_buffers_.clear();
     if (hg_class_ != nullptr) {
       HG_Deregister(hg_class_, mercury_generic_rpc_id_);
     }
@@ -135,20 +157,66 @@ absl::StatusOr<std::string> ProtocolDriverMercury::HandlePreConnect(
 absl::Status ProtocolDriverMercury::HandleConnect(
     std::string remote_connection_info, int peer) {
   CHECK_GE(peer, 0);
-  CHECK_LT((size_t)peer, remote_addresses_.size());
+  CHECK_LT((size_t)peer, remote_connection_info_.size());
 
+  hg_addr_t address;
   hg_return_t hg_ret;
-  hg_ret = HG_Addr_lookup2(hg_class_, remote_connection_info.c_str(),
-                           &remote_addresses_[peer]);
+  hg_ret =
+      HG_Addr_lookup2(hg_class_, remote_connection_info.c_str(), &address);
   if (hg_ret != HG_SUCCESS) {
     return absl::UnknownError("HG_Addr_lookup: failed");
   }
+  remote_connection_info_[peer] = std::move(remote_connection_info);
+  absl::MutexLock m(&remote_addresses_mutex_);
+  remote_addresses_[peer] = address;
 
   return absl::OkStatus();
 }
 
 std::vector<TransportStat> ProtocolDriverMercury::GetTransportStats() {
-  return {};
+  absl::MutexLock m(&bulk_buffers_mutex_);
+  return {
+      {"bulk_request_bytes", bulk_request_bytes_},
+      {"bulk_response_bytes", bulk_response_bytes_},
+      {"bulk_registered_bytes", registered_bulk_bytes_},
+  };
+}
+
+MercuryBulkBuffer* ProtocolDriverMercury::GetBulkBuffer(int64_t size) {
+  {
+    absl::MutexLock m(&bulk_buffers_mutex_);
+    for (auto it = free_bulk_buffers_.rbegin(); it != free_bulk_buffers_.rend();
+         ++it) {
+      if (static_cast<int64_t>((*it)->data.size()) >= size) {
+        MercuryBulkBuffer* buffer = *it;
+        free_bulk_buffers_.erase(std::next(it).base());
+        return buffer;
+      }
+    }
+  }
+  // Round up, so that buffers can be reused for similar sizes:
+  size_t capacity = 4096;
+  while (capacity < static_cast<size_t>(size)) capacity *= 2;
+  auto* buffer = new MercuryBulkBuffer;
+  buffer->data.resize(capacity);
+  void* buf_ptr = buffer->data.data();
+  hg_size_t buf_size = capacity;
+  hg_return_t hg_ret = HG_Bulk_create(hg_class_, 1, &buf_ptr, &buf_size,
+                                      HG_BULK_READWRITE, &buffer->handle);
+  if (hg_ret != HG_SUCCESS) {
+    LOG(ERROR) << "HG_Bulk_create: failed with " << hg_ret;
+    delete buffer;
+    return nullptr;
+  }
+  absl::MutexLock m(&bulk_buffers_mutex_);
+  registered_bulk_bytes_ += capacity;
+  return buffer;
+}
+
+void ProtocolDriverMercury::ReleaseBulkBuffer(MercuryBulkBuffer* buffer) {
+  if (buffer == nullptr) return;
+  absl::MutexLock m(&bulk_buffers_mutex_);
+  free_bulk_buffers_.push_back(buffer);
 }
 
 void ProtocolDriverMercury::PrintMercuryVersion() {
@@ -173,6 +241,8 @@ struct PendingRpc {
   ProtocolDriverMercury* this_pd;
   mercury_generic_rpc_string_t encoded_request;
   hg_handle_t hg_handle;
+  MercuryBulkBuffer* request_buffer = nullptr;
+  MercuryBulkBuffer* response_buffer = nullptr;
 };
 }  // anonymous namespace
 
@@ -180,14 +250,17 @@ void ProtocolDriverMercury::InitiateRpc(
     int peer_index, ClientRpcState* state,
     std::function<void(void)> done_callback) {
   CHECK_GE(peer_index, 0);
-  CHECK_LT((size_t)peer_index, remote_addresses_.size());
+  CHECK_LT((size_t)peer_index, remote_connection_info_.size());
 
   ++pending_rpcs_;
 
   hg_handle_t target_handle;
   hg_return_t hg_ret;
-  hg_ret = HG_Create(hg_context_, remote_addresses_[peer_index],
-                     mercury_generic_rpc_id_, &target_handle);
+  {
+    absl::ReaderMutexLock m(&remote_addresses_mutex_);
+    hg_ret = HG_Create(hg_context_, remote_addresses_[peer_index],
+                       mercury_generic_rpc_id_, &target_handle);
+  }
   if (hg_ret != HG_SUCCESS) {
     LOG(ERROR) << "HG_Create: failed";
     return;
@@ -200,7 +273,35 @@ void ProtocolDriverMercury::InitiateRpc(
   new_rpc->this_pd = this;
   new_rpc->hg_handle = target_handle;
 
-  new_rpc->request.SerializeToString(&new_rpc->encoded_request.string);
+  int64_t payload_size = new_rpc->request.payload().size();
+  if (bulk_threshold_ && payload_size >= bulk_threshold_) {
+    new_rpc->request_buffer = GetBulkBuffer(payload_size);
+  }
+  if (new_rpc->request_buffer) {
+    // Serialize everything but the payload, which is pulled by the server:
+    std::string payload = std::move(*new_rpc->request.mutable_payload());
+    new_rpc->request.clear_payload();
+    new_rpc->request.SerializeToString(&new_rpc->encoded_request.string);
+    memcpy(new_rpc->request_buffer->data.data(), payload.data(), payload_size);
+    new_rpc->request.set_payload(std::move(payload));
+    new_rpc->encoded_request.request_bulk = new_rpc->request_buffer->handle;
+    new_rpc->encoded_request.request_bulk_size = payload_size;
+  } else {
+    new_rpc->request.SerializeToString(&new_rpc->encoded_request.string);
+  }
+  if (new_rpc->request.record_stage_timings()) {
+    state->serialize_done_time = absl::Now();
+  }
+  int64_t response_capacity = new_rpc->request.has_response_payload_size()
+                                  ? new_rpc->request.response_payload_size()
+                                  : bulk_response_capacity_;
+  if (bulk_threshold_ && response_capacity >= bulk_threshold_) {
+    new_rpc->response_buffer = GetBulkBuffer(response_capacity);
+    if (new_rpc->response_buffer) {
+      new_rpc->encoded_request.response_bulk = new_rpc->response_buffer->handle;
+      new_rpc->encoded_request.response_bulk_size = response_capacity;
+    }
+  }
 
   hg_ret = HG_Forward(target_handle, StaticClientCallback, new_rpc,
                       &new_rpc->encoded_request);
@@ -209,7 +310,32 @@ void ProtocolDriverMercury::InitiateRpc(
   }
 }
 
-void ProtocolDriverMercury::ChurnConnection(int peer) {}
+void ProtocolDriverMercury::ChurnConnection(int peer) {
+  CHECK_GE(peer, 0);
+  CHECK_LT((size_t)peer, remote_connection_info_.size());
+
+  // Drops the old address from the address cache, so that the lookup sets
+  // up a new connection rather than returning the cached one:
+  {
+    absl::ReaderMutexLock m(&remote_addresses_mutex_);
+    HG_Addr_set_remove(hg_class_, remote_addresses_[peer]);
+  }
+  hg_addr_t new_address;
+  hg_return_t hg_ret = HG_Addr_lookup2(
+      hg_class_, remote_connection_info_[peer].c_str(), &new_address);
+  if (hg_ret != HG_SUCCESS) {
+    LOG(ERROR) << "HG_Addr_lookup: failed to reconnect peer " << peer;
+    return;
+  }
+  hg_addr_t old_address;
+  {
+    absl::MutexLock m(&remote_addresses_mutex_);
+    old_address = remote_addresses_[peer];
+    remote_addresses_[peer] = new_address;
+  }
+  // The RPCs in flight keep the old connection until they complete:
+  HG_Addr_free(hg_class_, old_address);
+}
 
 void ProtocolDriverMercury::ShutdownServer() {}
 
@@ -222,15 +348,27 @@ void ProtocolDriverMercury::ShutdownClient() {
       progress_thread_.join();
     }
   }
+  absl::MutexLock m(&remote_addresses_mutex_);
   for (hg_addr_t addr : remote_addresses_) {
     HG_Addr_free(hg_class_, addr);
   }
   remote_addresses_.resize(0);
+  remote_connection_info_.resize(0);
 }
 
 void ProtocolDriverMercury::RpcCompletionThread() {
+  WaitTimeCounters* wait_times = GetWaitTimeCounters("MercuryProgress");
+  hg_return_t hg_ret;
+  auto poll = [this, &hg_ret]() {
+    hg_ret = HG_Progress(hg_context_, /*timeout_ms=*/0);
+    return hg_ret != HG_TIMEOUT || shutdown_.HasBeenNotified();
+  };
+  // Returns after at most 1ms, to run the callbacks and notice the shutdown:
+  auto block = [this, &hg_ret]() {
+    hg_ret = HG_Progress(hg_context_, /*timeout_ms=*/1);
+    return true;
+  };
   while (!shutdown_.HasBeenNotified()) {
-    hg_return_t hg_ret;
     unsigned int actual_count = 0;
 
     // Process callbacks based on the network event received
@@ -242,7 +380,7 @@ void ProtocolDriverMercury::RpcCompletionThread() {
     }
 
     // Process network events
-    hg_ret = HG_Progress(hg_context_, /*timeout_ms=*/1);
+    if (!poll()) WaitWithPolicy(wait_policy_, wait_times, poll, block);
     if (hg_ret != HG_SUCCESS && hg_ret != HG_TIMEOUT) {
       LOG(ERROR) << "HG_Progress: failed with " << hg_ret
                  << " actual_count:" << actual_count;
@@ -273,6 +411,20 @@ hg_return_t ProtocolDriverMercury::StaticRpcServerSerialize(hg_proc_t proc,
   hg_ret = hg_proc_bytes(proc, &struct_data->string[0], slen);
   if (hg_ret != HG_SUCCESS) {
     LOG(ERROR) << "Serialization error (data)";
+    return hg_ret;
+  }
+  hg_ret = hg_proc_hg_bulk_t(proc, &struct_data->request_bulk);
+  if (hg_ret == HG_SUCCESS) {
+    hg_ret = hg_proc_hg_int64_t(proc, &struct_data->request_bulk_size);
+  }
+  if (hg_ret == HG_SUCCESS) {
+    hg_ret = hg_proc_hg_bulk_t(proc, &struct_data->response_bulk);
+  }
+  if (hg_ret == HG_SUCCESS) {
+    hg_ret = hg_proc_hg_int64_t(proc, &struct_data->response_bulk_size);
+  }
+  if (hg_ret != HG_SUCCESS) {
+    LOG(ERROR) << "Serialization error (bulk)";
   }
   return hg_ret;
 }
@@ -284,6 +436,28 @@ hg_return_t ProtocolDriverMercury::StaticRpcServerCallback(hg_handle_t handle) {
   return this_pd->RpcServerCallback(handle);
 }
 
+struct ProtocolDriverMercury::ServerRpc {
+  ProtocolDriverMercury* this_pd;
+  hg_handle_t handle;
+  ServerRpcState rpc_state;
+  GenericRequest request;
+  // The client buffers holding the request payload and waiting for the
+  // response payload, if they are transferred in bulk:
+  hg_bulk_t remote_request_bulk = HG_BULK_NULL;
+  int64_t request_bulk_size = 0;
+  MercuryBulkBuffer* request_buffer = nullptr;
+  hg_bulk_t remote_response_bulk = HG_BULK_NULL;
+  int64_t response_bulk_capacity = 0;
+};
+
+struct ProtocolDriverMercury::ServerResponse {
+  ProtocolDriverMercury* this_pd;
+  hg_handle_t handle;
+  mercury_generic_rpc_string_t output;
+  hg_bulk_t remote_response_bulk = HG_BULK_NULL;
+  MercuryBulkBuffer* response_buffer = nullptr;
+};
+
 hg_return_t ProtocolDriverMercury::RpcServerCallback(hg_handle_t handle) {
   mercury_generic_rpc_string_t input;
   hg_return_t hg_ret;
@@ -293,37 +467,87 @@ hg_return_t ProtocolDriverMercury::RpcServerCallback(hg_handle_t handle) {
     LOG(ERROR) << "HG_Get_input: failed";
   }
 
-  ServerRpcState* rpc_state = new ServerRpcState();
-  rpc_state->have_dedicated_thread = false;
-
-  distbench::GenericRequest* request = new distbench::GenericRequest();
-  bool success = request->ParseFromString(input.string);
+  ServerRpc* server_rpc = new ServerRpc();
+  server_rpc->this_pd = this;
+  server_rpc->handle = handle;
+  bool success = server_rpc->request.ParseFromString(input.string);
   if (!success) {
     LOG(ERROR) << "Unable to decode payload !";
   }
+  // Keep the bulk handles of the client past HG_Free_input:
+  if (input.request_bulk != HG_BULK_NULL && input.request_bulk_size > 0) {
+    HG_Bulk_ref_incr(input.request_bulk);
+    server_rpc->remote_request_bulk = input.request_bulk;
+    server_rpc->request_bulk_size = input.request_bulk_size;
+  }
+  if (input.response_bulk != HG_BULK_NULL) {
+    HG_Bulk_ref_incr(input.response_bulk);
+    server_rpc->remote_response_bulk = input.response_bulk;
+    server_rpc->response_bulk_capacity = input.response_bulk_size;
+  }
   hg_ret = HG_Free_input(handle, &input);
   if (hg_ret != HG_SUCCESS) {
     LOG(ERROR) << "HG_Free_input: failed";
   }
-  hg_ret = HG_Destroy(handle);
-  if (hg_ret != HG_SUCCESS) {
-    LOG(ERROR) << "HG_Destroy: failed";
+
+  if (server_rpc->remote_request_bulk == HG_BULK_NULL) {
+    HandleServerRpc(server_rpc);
+    return HG_SUCCESS;
+  }
+
+  // Pull the request payload before handling the RPC:
+  server_rpc->request_buffer = GetBulkBuffer(server_rpc->request_bulk_size);
+  if (server_rpc->request_buffer) {
+    hg_ret = HG_Bulk_transfer(
+        hg_context_, StaticRequestPullDone, /*arg=*/server_rpc, HG_BULK_PULL,
+        HG_Get_info(handle)->addr, server_rpc->remote_request_bulk,
+        /*origin_offset=*/0, server_rpc->request_buffer->handle,
+        /*local_offset=*/0, server_rpc->request_bulk_size, HG_OP_ID_IGNORE);
+    if (hg_ret == HG_SUCCESS) return HG_SUCCESS;
+    LOG(ERROR) << "HG_Bulk_transfer: failed with " << hg_ret;
+    ReleaseBulkBuffer(server_rpc->request_buffer);
+    server_rpc->request_buffer = nullptr;
   }
+  HG_Bulk_free(server_rpc->remote_request_bulk);
+  server_rpc->remote_request_bulk = HG_BULK_NULL;
+  HandleServerRpc(server_rpc);
+  return HG_SUCCESS;
+}
 
-  rpc_state->request = request;
-  rpc_state->SetSendResponseFunction([rpc_state, handle]() {
-    mercury_generic_rpc_string_t* result = new mercury_generic_rpc_string_t();
-    rpc_state->response.SerializeToString(&result->string);
-    hg_return_t hg_ret;
-    hg_ret =
-        HG_Respond(handle, StaticRpcServerDoneCallback, /*arg=*/result, result);
-    if (hg_ret != HG_SUCCESS) {
-      LOG(ERROR) << "HG_Respond: failed";
+hg_return_t ProtocolDriverMercury::StaticRequestPullDone(
+    const struct hg_cb_info* callback_info) {
+  ServerRpc* server_rpc = (ServerRpc*)callback_info->arg;
+  ProtocolDriverMercury* this_pd = server_rpc->this_pd;
+  if (callback_info->ret != HG_SUCCESS) {
+    LOG(ERROR) << "Bulk pull of the request failed with "
+               << callback_info->ret;
+  } else {
+    server_rpc->request.set_payload(server_rpc->request_buffer->data.data(),
+                                    server_rpc->request_bulk_size);
+    this_pd->bulk_request_bytes_ += server_rpc->request_bulk_size;
+  }
+  HG_Bulk_free(server_rpc->remote_request_bulk);
+  server_rpc->remote_request_bulk = HG_BULK_NULL;
+  this_pd->ReleaseBulkBuffer(server_rpc->request_buffer);
+  server_rpc->request_buffer = nullptr;
+  this_pd->HandleServerRpc(server_rpc);
+  return HG_SUCCESS;
+}
+
+void ProtocolDriverMercury::HandleServerRpc(ServerRpc* server_rpc) {
+  ServerRpcState* rpc_state = &server_rpc->rpc_state;
+  rpc_state->have_dedicated_thread = false;
+  rpc_state->request = &server_rpc->request;
+  if (rpc_state->RecordsServerTimings()) {
+    rpc_state->receive_time = absl::Now();
+  }
+  rpc_state->SetSendResponseFunction(
+      [this, server_rpc]() { SendServerResponse(server_rpc); });
+  rpc_state->SetFreeStateFunction([server_rpc]() {
+    if (server_rpc->remote_response_bulk != HG_BULK_NULL) {
+      HG_Bulk_free(server_rpc->remote_response_bulk);
     }
-  });
-  rpc_state->SetFreeStateFunction([rpc_state]() {
-    delete rpc_state->request;
-    delete rpc_state;
+    delete server_rpc;
   });
 
   auto fct_action_list_thread = handler_(rpc_state);
@@ -331,24 +555,99 @@ hg_return_t ProtocolDriverMercury::RpcServerCallback(hg_handle_t handle) {
     RunRegisteredThread("DedicatedActionListThread", fct_action_list_thread)
         .detach();
   }
+}
+
+void ProtocolDriverMercury::SendServerResponse(ServerRpc* server_rpc) {
+  ServerResponse* server_response = new ServerResponse();
+  server_response->this_pd = this;
+  server_response->handle = server_rpc->handle;
+  server_rpc->rpc_state.RecordServerTimings();
+  GenericResponse& response = server_rpc->rpc_state.response;
+  int64_t payload_size = response.payload().size();
+  if (server_rpc->remote_response_bulk != HG_BULK_NULL && bulk_threshold_ &&
+      payload_size >= bulk_threshold_ &&
+      payload_size <= server_rpc->response_bulk_capacity) {
+    server_response->response_buffer = GetBulkBuffer(payload_size);
+  }
+  if (!server_response->response_buffer) {
+    response.SerializeToString(&server_response->output.string);
+    RespondToServerRpc(server_response);
+    return;
+  }
+
+  // Push the payload to the client buffer, then respond with the rest:
+  memcpy(server_response->response_buffer->data.data(),
+         response.payload().data(), payload_size);
+  response.clear_payload();
+  response.SerializeToString(&server_response->output.string);
+  server_response->output.response_bulk_size = payload_size;
+  server_response->remote_response_bulk = server_rpc->remote_response_bulk;
+  server_rpc->remote_response_bulk = HG_BULK_NULL;
+  hg_return_t hg_ret = HG_Bulk_transfer(
+      hg_context_, StaticResponsePushDone, /*arg=*/server_response,
+      HG_BULK_PUSH, HG_Get_info(server_response->handle)->addr,
+      server_response->remote_response_bulk, /*origin_offset=*/0,
+      server_response->response_buffer->handle, /*local_offset=*/0,
+      payload_size, HG_OP_ID_IGNORE);
+  if (hg_ret != HG_SUCCESS) {
+    LOG(ERROR) << "HG_Bulk_transfer: failed with " << hg_ret;
+    server_response->output.response_bulk_size = -1;
+    RespondToServerRpc(server_response);
+  }
+}
+
+hg_return_t ProtocolDriverMercury::StaticResponsePushDone(
+    const struct hg_cb_info* callback_info) {
+  ServerResponse* server_response = (ServerResponse*)callback_info->arg;
+  ProtocolDriverMercury* this_pd = server_response->this_pd;
+  if (callback_info->ret != HG_SUCCESS) {
+    LOG(ERROR) << "Bulk push of the response failed with "
+               << callback_info->ret;
+    // Tell the client that its response buffer is not valid:
+    server_response->output.response_bulk_size = -1;
+  } else {
+    this_pd->bulk_response_bytes_ += server_response->output.response_bulk_size;
+  }
+  this_pd->RespondToServerRpc(server_response);
   return HG_SUCCESS;
 }
 
+void ProtocolDriverMercury::RespondToServerRpc(
+    ServerResponse* server_response) {
+  hg_return_t hg_ret =
+      HG_Respond(server_response->handle, StaticRpcServerDoneCallback,
+                 /*arg=*/server_response, &server_response->output);
+  if (hg_ret != HG_SUCCESS) {
+    LOG(ERROR) << "HG_Respond: failed";
+  }
+}
+
 hg_return_t ProtocolDriverMercury::StaticRpcServerDoneCallback(
     const struct hg_cb_info* hg_cb_info) {
   if (hg_cb_info->ret != HG_SUCCESS) {
     LOG(ERROR) << "StaticRpcServerDoneCallback with non success ret="
                << hg_cb_info->ret;
   }
-  mercury_generic_rpc_string_t* result =
-      (mercury_generic_rpc_string_t*)hg_cb_info->arg;
-  delete result;
+  ServerResponse* server_response = (ServerResponse*)hg_cb_info->arg;
+  if (server_response->remote_response_bulk != HG_BULK_NULL) {
+    HG_Bulk_free(server_response->remote_response_bulk);
+  }
+  server_response->this_pd->ReleaseBulkBuffer(
+      server_response->response_buffer);
+  hg_return_t hg_ret = HG_Destroy(server_response->handle);
+  if (hg_ret != HG_SUCCESS) {
+    LOG(ERROR) << "HG_Destroy: failed";
+  }
+  delete server_response;
   return HG_SUCCESS;
 }
 
 hg_return_t ProtocolDriverMercury::RpcClientCallback(
     const struct hg_cb_info* callback_info) {
   struct PendingRpc* rpc = (struct PendingRpc*)callback_info->arg;
+  if (rpc->request.record_stage_timings()) {
+    rpc->state->completion_dequeued_time = absl::Now();
+  }
   rpc->state->success = (callback_info->ret == 0);
   mercury_generic_rpc_string_t result;
   hg_return_t hg_ret = HG_Get_output(rpc->hg_handle, &result);
@@ -360,7 +659,19 @@ hg_return_t ProtocolDriverMercury::RpcClientCallback(
   bool success = rpc->response.ParseFromString(result.string);
   if (!success) {
     LOG(ERROR) << "Unable to decode payload";
-  } else {
+  } else if (result.response_bulk_size) {
+    // The payload was pushed to the response buffer:
+    success = rpc->response_buffer && result.response_bulk_size > 0 &&
+              static_cast<size_t>(result.response_bulk_size) <=
+                  rpc->response_buffer->data.size();
+    if (success) {
+      rpc->response.set_payload(rpc->response_buffer->data.data(),
+                                result.response_bulk_size);
+    } else {
+      LOG(ERROR) << "Bulk transfer of the response failed";
+    }
+  }
+  if (success) {
     rpc->state->request = std::move(rpc->request);
     rpc->state->response = std::move(rpc->response);
   }
@@ -377,6 +688,8 @@ hg_return_t ProtocolDriverMercury::RpcClientCallback(
     LOG(ERROR) << "HG_Destroy: failed";
   }
 
+  ReleaseBulkBuffer(rpc->request_buffer);
+  ReleaseBulkBuffer(rpc->response_buffer);
   delete rpc;
   --pending_rpcs_;
   return HG_SUCCESS;
@@ -20,15 +20,33 @@
 #include <mercury_macros.h>
 #include <mercury_proc_string.h>
 
+#include "absl/synchronization/mutex.h"
 #include "distbench_utils.h"
+#include "distbench_wait_policy.h"
 #include "protocol_driver.h"
 
 namespace distbench {
 
+// The message exchanged in the RPC itself. Payloads of at least
+// bulk_threshold bytes are left out of the serialized string and moved with
+// bulk transfers instead: the request carries the handle of the client
+// buffer holding the request payload and the handle of a buffer for the
+// response payload; the response tells how many bytes were pushed to it.
 typedef struct {
   std::string string;
+  hg_bulk_t request_bulk = HG_BULK_NULL;
+  int64_t request_bulk_size = 0;
+  hg_bulk_t response_bulk = HG_BULK_NULL;
+  int64_t response_bulk_size = 0;
 } mercury_generic_rpc_string_t;
 
+// A buffer registered for bulk transfers. The buffers are recycled, so that
+// their memory is registered only once.
+struct MercuryBulkBuffer {
+  std::string data;
+  hg_bulk_t handle = HG_BULK_NULL;
+};
+
 class ProtocolDriverMercury : public ProtocolDriver {
  public:
   ProtocolDriverMercury();
@@ -60,8 +78,17 @@ class ProtocolDriverMercury : public ProtocolDriver {
   void RpcCompletionThread();
   void PrintMercuryVersion();
 
+  struct ServerRpc;
+  struct ServerResponse;
+
+  MercuryBulkBuffer* GetBulkBuffer(int64_t size);
+  void ReleaseBulkBuffer(MercuryBulkBuffer* buffer);
+
   hg_return_t RpcClientCallback(const struct hg_cb_info* callback_info);
   hg_return_t RpcServerCallback(hg_handle_t handle);
+  void HandleServerRpc(ServerRpc* server_rpc);
+  void SendServerResponse(ServerRpc* server_rpc);
+  void RespondToServerRpc(ServerResponse* server_response);
 
   static hg_return_t StaticRpcServerCallback(hg_handle_t handle);
   static hg_return_t StaticRpcServerDoneCallback(
@@ -69,6 +96,10 @@ class ProtocolDriverMercury : public ProtocolDriver {
   static hg_return_t StaticRpcServerSerialize(hg_proc_t proc, void* data);
   static hg_return_t StaticClientCallback(
       const struct hg_cb_info* callback_info);
+  static hg_return_t StaticRequestPullDone(
+      const struct hg_cb_info* callback_info);
+  static hg_return_t StaticResponsePushDone(
+      const struct hg_cb_info* callback_info);
 
   std::atomic<int> pending_rpcs_ = 0;
   SafeNotification shutdown_;
@@ -80,9 +111,31 @@ class ProtocolDriverMercury : public ProtocolDriver {
   hg_class_t* hg_class_ = nullptr;
 
   hg_id_t mercury_generic_rpc_id_;
-  std::vector<hg_addr_t> remote_addresses_;
+  // Replaced by ChurnConnection, so the RPCs take a reader lock to create
+  // their handles, which hold references of their own to the address.
+  absl::Mutex remote_addresses_mutex_;
+  std::vector<hg_addr_t> remote_addresses_
+      ABSL_GUARDED_BY(remote_addresses_mutex_);
+  // The connection strings of the peers, looked up again by ChurnConnection:
+  std::vector<std::string> remote_connection_info_;
 
   std::function<std::function<void()>(ServerRpcState* state)> handler_;
+
+  // How the progress thread waits for network events, see wait_policy:
+  WaitPolicy wait_policy_;
+
+  // Payloads smaller than this are serialized in the RPC; 0 disables the
+  // bulk transfers.
+  int64_t bulk_threshold_ = 0;
+  // Size of the buffer offered for the response payload when the request
+  // does not specify response_payload_size.
+  int64_t bulk_response_capacity_ = 0;
+  absl::Mutex bulk_buffers_mutex_;
+  std::vector<MercuryBulkBuffer*> free_bulk_buffers_
+      ABSL_GUARDED_BY(bulk_buffers_mutex_);
+  int64_t registered_bulk_bytes_ ABSL_GUARDED_BY(bulk_buffers_mutex_) = 0;
+  std::atomic<int64_t> bulk_request_bytes_ = 0;
+  std::atomic<int64_t> bulk_response_bytes_ = 0;
 };
 
 }  // namespace distbench
@@ -0,0 +1,679 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protocol_driver_shm.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <new>
+
+#include "absl/strings/str_cat.h"
+#include "glog/logging.h"
+
+namespace distbench {
+
+namespace {
+
+// Identifies the segments set up by this driver:
+constexpr uint64_t kSegmentMagic = 0x64697374'73686d31;
+// Every message is preceded by this; the rpc id is chosen by the client and
+// echoed in the response.
+struct FrameHeader {
+  uint32_t length;
+  uint32_t flags;
+  uint64_t rpc_id;
+};
+// Sent instead of a response that cannot be framed:
+constexpr uint32_t kFailedResponseFlag = 1;
+// The tag of the payload field (1, length delimited) of GenericRequest and
+// GenericResponse:
+constexpr char kPayloadTag = 0x0a;
+// The consumer sleeps in futex_wait at most this long, so that it notices a
+// peer that went away without closing the connection.
+constexpr timespec kMaxFutexWait = {0, 100'000'000};
+
+constexpr size_t kHeaderSpace = 64;
+constexpr size_t kRingHeaderSpace = sizeof(ShmRing);
+static_assert(sizeof(ShmSegmentHeader) <= kHeaderSpace);
+// Ring 0 carries the requests, ring 1 the responses.
+size_t RingOffset(uint64_t ring_size, int ring) {
+  return kHeaderSpace + ring * (kRingHeaderSpace + ring_size);
+}
+size_t SegmentSize(uint64_t ring_size) { return RingOffset(ring_size, 2); }
+
+// Peers can only share memory if they run under the same kernel:
+std::string LocalHostId() {
+  char hostname[256] = {};
+  gethostname(hostname, sizeof(hostname) - 1);
+  std::string boot_id;
+  std::ifstream("/proc/sys/kernel/random/boot_id") >> boot_id;
+  return absl::StrCat(hostname, "/", boot_id);
+}
+
+// Serializes all of the message but its payload in head, followed by the tag
+// and length of the payload, which is written to the ring straight from the
+// message.
+template <typename Message>
+std::string EncodeMessageHead(Message* message) {
+  std::string head;
+  bool has_payload = message->has_payload();
+  std::string payload;
+  message->mutable_payload()->swap(payload);
+  message->AppendToString(&head);
+  message->mutable_payload()->swap(payload);
+  if (!has_payload) {
+    message->clear_payload();
+    return head;
+  }
+  head.push_back(kPayloadTag);
+  uint64_t size = message->payload().size();
+  while (size >= 0x80) {
+    head.push_back(static_cast<char>(size | 0x80));
+    size >>= 7;
+  }
+  head.push_back(static_cast<char>(size));
+  return head;
+}
+
+void* MapSegment(int fd, size_t size) {
+  void* mapping =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return mapping == MAP_FAILED ? nullptr : mapping;
+}
+
+}  // anonymous namespace
+
+// ShmRingView ================================================================
+void ShmRingView::Attach(ShmRing* ring, char* data, uint64_t size,
+                         bool use_futex, std::atomic<uint32_t>* closed) {
+  ring_ = ring;
+  data_ = data;
+  size_ = size;
+  use_futex_ = use_futex;
+  closed_ = closed;
+}
+
+bool ShmRingView::Write(const Piece* pieces, int num_pieces,
+                        int64_t* ring_full_waits) {
+  if (closed_->load(std::memory_order_acquire)) return false;
+  uint64_t tail = ring_->tail.load(std::memory_order_relaxed);
+  bool waited = false;
+  for (int i = 0; i < num_pieces; ++i) {
+    const char* src = pieces[i].data;
+    size_t left = pieces[i].size;
+    while (left) {
+      uint64_t head = ring_->head.load(std::memory_order_acquire);
+      uint64_t space = size_ - (tail - head);
+      if (space == 0) {
+        // Let the consumer make room:
+        ring_->tail.store(tail, std::memory_order_release);
+        Wake();
+        if (closed_->load(std::memory_order_acquire)) return false;
+        if (!waited) {
+          waited = true;
+          ++*ring_full_waits;
+        }
+        sched_yield();
+        continue;
+      }
+      size_t n = std::min<uint64_t>(space, left);
+      size_t offset = tail & (size_ - 1);
+      size_t first = std::min<size_t>(n, size_ - offset);
+      memcpy(data_ + offset, src, first);
+      memcpy(data_, src + first, n - first);
+      tail += n;
+      src += n;
+      left -= n;
+    }
+  }
+  ring_->tail.store(tail, std::memory_order_release);
+  Wake();
+  return true;
+}
+
+size_t ShmRingView::Read(std::string* buffer) {
+  uint64_t head = ring_->head.load(std::memory_order_relaxed);
+  uint64_t available = ring_->tail.load(std::memory_order_acquire) - head;
+  if (!available) return 0;
+  size_t offset = head & (size_ - 1);
+  size_t first = std::min<size_t>(available, size_ - offset);
+  buffer->append(data_ + offset, first);
+  buffer->append(data_, available - first);
+  ring_->head.store(head + available, std::memory_order_release);
+  return available;
+}
+
+bool ShmRingView::WaitForData(const WaitPolicy& wait_policy,
+                              WaitTimeCounters* wait_times,
+                              const std::atomic<bool>& stop) {
+  auto has_data = [this]() {
+    return ring_->tail.load(std::memory_order_acquire) !=
+           ring_->head.load(std::memory_order_relaxed);
+  };
+  auto stopping = [this, &stop]() {
+    return stop.load(std::memory_order_acquire) ||
+           closed_->load(std::memory_order_acquire);
+  };
+  auto poll = [&has_data, &stopping]() { return has_data() || stopping(); };
+  auto block = [this, &has_data, &stopping, &poll]() {
+    if (!use_futex_) {
+      sched_yield();
+      return poll();
+    }
+    uint32_t seq = ring_->data_futex.load(std::memory_order_acquire);
+    ring_->consumer_sleeping.store(1, std::memory_order_relaxed);
+    // Pairs with the fence in Wake; either the producer sees the consumer
+    // sleeping, or the consumer sees the new data.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!has_data() && !stopping()) {
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&ring_->data_futex),
+              FUTEX_WAIT, seq, &kMaxFutexWait, nullptr, 0);
+    }
+    ring_->consumer_sleeping.store(0, std::memory_order_relaxed);
+    return poll();
+  };
+  if (!poll()) WaitWithPolicy(wait_policy, wait_times, poll, block);
+  return has_data();
+}
+
+void ShmRingView::Wake() {
+  if (!use_futex_) return;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (ring_->consumer_sleeping.load(std::memory_order_relaxed)) {
+    ring_->data_futex.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&ring_->data_futex),
+            FUTEX_WAKE, 1, nullptr, nullptr, 0);
+  }
+}
+
+ShmConnection::~ShmConnection() {
+  if (mapping) munmap(mapping, mapping_size);
+}
+
+// ProtocolDriver =============================================================
+ProtocolDriverShm::ProtocolDriverShm() {}
+
+ProtocolDriverShm::~ProtocolDriverShm() {
+  ShutdownServer();
+  ShutdownClient();
+}
+
+absl::Status ProtocolDriverShm::Initialize(const ProtocolDriverOptions& pd_opts,
+                                           int* port) {
+  int64_t ring_size =
+      GetNamedServerSettingInt64(pd_opts, "ring_size", 1024 * 1024);
+  if (ring_size < 4096 || (ring_size & (ring_size - 1)) ||
+      ring_size > (int64_t{1} << 32)) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("ring_size (", ring_size,
+                     ") must be a power of two between 4KiB and 4GiB."));
+  }
+  ring_size_ = ring_size;
+  use_futex_ = GetNamedServerSettingInt64(pd_opts, "futex_wakeup", 1);
+  int64_t spin_iterations =
+      GetNamedServerSettingInt64(pd_opts, "spin_iterations", 1000);
+  if (spin_iterations < 0 ||
+      spin_iterations > std::numeric_limits<int>::max()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "spin_iterations (", spin_iterations, ") is out of range."));
+  }
+  auto maybe_wait_policy =
+      GetWaitPolicy(pd_opts.server_settings(), "",
+                    {WaitPolicy::kSpinThenBlock, spin_iterations});
+  if (!maybe_wait_policy.ok()) return maybe_wait_policy.status();
+  wait_policy_ = maybe_wait_policy.value();
+
+  auto maybe_thread_pool = CreateThreadpoolFromSettings(pd_opts);
+  if (!maybe_thread_pool.ok()) return maybe_thread_pool.status();
+  thread_pool_ = std::move(maybe_thread_pool.value());
+
+  host_id_ = LocalHostId();
+  // No network port is used:
+  *port = 0;
+  return absl::OkStatus();
+}
+
+void ProtocolDriverShm::SetHandler(
+    std::function<std::function<void()>(ServerRpcState* state)> handler) {
+  handler_ = handler;
+  handler_set_.TryToNotify();
+}
+
+void ProtocolDriverShm::SetNumPeers(int num_peers) {
+  client_connections_.resize(num_peers);
+}
+
+absl::StatusOr<std::string> ProtocolDriverShm::Preconnect() {
+  ShmConnectionInfo info;
+  info.set_host_id(host_id_);
+  return info.SerializeAsString();
+}
+
+absl::StatusOr<std::string> ProtocolDriverShm::HandlePreConnect(
+    std::string_view remote_connection_info, int peer) {
+  ShmConnectionInfo initiator_info;
+  if (!initiator_info.ParseFromArray(remote_connection_info.data(),
+                                     remote_connection_info.size())) {
+    return absl::InvalidArgumentError("initiator_info did not parse");
+  }
+  if (initiator_info.has_host_id() && initiator_info.host_id() != host_id_) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("shm peers must share the host, but ",
+                     initiator_info.host_id(), " is not ", host_id_));
+  }
+
+  auto connection = std::make_unique<ShmConnection>();
+  connection->segment_name =
+      absl::StrCat("/distbench_shm_", getpid(), "_",
+                   reinterpret_cast<uintptr_t>(this), "_", next_segment_id_++);
+  int fd = shm_open(connection->segment_name.c_str(),
+                    O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return absl::UnknownError(absl::StrCat(
+        strerror(errno), " creating ", connection->segment_name));
+  }
+  connection->mapping_size = SegmentSize(ring_size_);
+  if (ftruncate(fd, connection->mapping_size)) {
+    absl::Status status = absl::UnknownError(absl::StrCat(
+        strerror(errno), " sizing ", connection->segment_name));
+    close(fd);
+    shm_unlink(connection->segment_name.c_str());
+    return status;
+  }
+  connection->mapping = MapSegment(fd, connection->mapping_size);
+  close(fd);
+  if (!connection->mapping) {
+    shm_unlink(connection->segment_name.c_str());
+    return absl::UnknownError(absl::StrCat(
+        strerror(errno), " mapping ", connection->segment_name));
+  }
+  char* base = static_cast<char*>(connection->mapping);
+  auto* header = new (base) ShmSegmentHeader;
+  header->ring_size = ring_size_;
+  header->use_futex = use_futex_;
+  header->closed = 0;
+  ShmRing* rings[2];
+  for (int i = 0; i < 2; ++i) {
+    rings[i] = new (base + RingOffset(ring_size_, i)) ShmRing;
+    rings[i]->tail = 0;
+    rings[i]->head = 0;
+    rings[i]->data_futex = 0;
+    rings[i]->consumer_sleeping = 0;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = kSegmentMagic;
+  connection->header = header;
+  connection->receive_ring.Attach(rings[0], base + RingOffset(ring_size_, 0) +
+                                                kRingHeaderSpace,
+                                  ring_size_, use_futex_, &header->closed);
+  {
+    absl::MutexLock m(&connection->send_mutex);
+    connection->send_ring.Attach(rings[1], base + RingOffset(ring_size_, 1) +
+                                               kRingHeaderSpace,
+                                 ring_size_, use_futex_, &header->closed);
+  }
+
+  ShmConnectionInfo responder_info;
+  responder_info.set_host_id(host_id_);
+  responder_info.set_segment_name(connection->segment_name);
+  ShmConnection* c = connection.get();
+  {
+    absl::MutexLock m(&server_connections_mutex_);
+    server_connections_.push_back(std::move(connection));
+  }
+  c->receive_thread =
+      RunRegisteredThread("ShmServer", [this, c]() { ReceiveThread(c); });
+  return responder_info.SerializeAsString();
+}
+
+absl::Status ProtocolDriverShm::HandleConnect(
+    std::string remote_connection_info, int peer) {
+  CHECK_GE(peer, 0);
+  CHECK_LT(static_cast<size_t>(peer), client_connections_.size());
+  ShmConnectionInfo info;
+  if (!info.ParseFromString(remote_connection_info)) {
+    return absl::UnknownError(absl::StrCat(
+        "remote_connection_info did not parse: ", remote_connection_info));
+  }
+  if (info.host_id() != host_id_) {
+    return absl::FailedPreconditionError(
+        absl::StrCat("shm peers must share the host, but ", info.host_id(),
+                     " is not ", host_id_));
+  }
+  auto connection = std::make_unique<ShmConnection>();
+  connection->is_client = true;
+  connection->segment_name = info.segment_name();
+  int fd = shm_open(info.segment_name().c_str(), O_RDWR | O_CLOEXEC, 0);
+  if (fd < 0) {
+    return absl::UnknownError(
+        absl::StrCat(strerror(errno), " opening ", info.segment_name()));
+  }
+  // Nobody else needs the name now; the segment lives until both sides
+  // unmap it.
+  shm_unlink(info.segment_name().c_str());
+  struct stat st;
+  if (fstat(fd, &st) || static_cast<size_t>(st.st_size) < kHeaderSpace) {
+    close(fd);
+    return absl::UnknownError(
+        absl::StrCat("bad shared memory segment ", info.segment_name()));
+  }
+  connection->mapping_size = st.st_size;
+  connection->mapping = MapSegment(fd, connection->mapping_size);
+  close(fd);
+  if (!connection->mapping) {
+    return absl::UnknownError(
+        absl::StrCat(strerror(errno), " mapping ", info.segment_name()));
+  }
+  char* base = static_cast<char*>(connection->mapping);
+  auto* header = reinterpret_cast<ShmSegmentHeader*>(base);
+  uint64_t ring_size = header->ring_size;
+  if (header->magic != kSegmentMagic ||
+      SegmentSize(ring_size) != connection->mapping_size) {
+    return absl::UnknownError(
+        absl::StrCat("bad shared memory segment ", info.segment_name()));
+  }
+  connection->header = header;
+  bool use_futex = header->use_futex;
+  auto* request_ring =
+      reinterpret_cast<ShmRing*>(base + RingOffset(ring_size, 0));
+  auto* response_ring =
+      reinterpret_cast<ShmRing*>(base + RingOffset(ring_size, 1));
+  connection->receive_ring.Attach(
+      response_ring, base + RingOffset(ring_size, 1) + kRingHeaderSpace,
+      ring_size, use_futex, &header->closed);
+  {
+    absl::MutexLock m(&connection->send_mutex);
+    connection->send_ring.Attach(
+        request_ring, base + RingOffset(ring_size, 0) + kRingHeaderSpace,
+        ring_size, use_futex, &header->closed);
+  }
+  ShmConnection* c = connection.get();
+  client_connections_[peer] = std::move(connection);
+  c->receive_thread =
+      RunRegisteredThread("ShmClient", [this, c]() { ReceiveThread(c); });
+  return absl::OkStatus();
+}
+
+void ProtocolDriverShm::ReceiveThread(ShmConnection* connection) {
+  WaitTimeCounters* wait_times =
+      GetWaitTimeCounters(connection->is_client ? "ShmClient" : "ShmServer");
+  while (connection->receive_ring.WaitForData(wait_policy_, wait_times,
+                                              connection->stop)) {
+    bytes_received_ += connection->receive_ring.Read(&connection->receive_buffer);
+    HandleFrames(connection);
+  }
+  if (connection->is_client) FailPendingRpcs(connection);
+}
+
+void ProtocolDriverShm::HandleFrames(ShmConnection* connection) {
+  std::string& buffer = connection->receive_buffer;
+  size_t pos = 0;
+  while (buffer.size() - pos >= sizeof(FrameHeader)) {
+    FrameHeader header;
+    memcpy(&header, &buffer[pos], sizeof(header));
+    if (buffer.size() - pos - sizeof(header) < header.length) break;
+    const char* data = &buffer[pos + sizeof(header)];
+    if (connection->is_client) {
+      HandleResponse(connection, header.rpc_id, header.flags, data,
+                     header.length);
+    } else {
+      HandleRequest(connection, header.rpc_id, data, header.length);
+    }
+    pos += sizeof(header) + header.length;
+  }
+  buffer.erase(0, pos);
+}
+
+bool ProtocolDriverShm::SendMessage(ShmConnection* connection,
+                                    uint64_t rpc_id, uint32_t flags,
+                                    const std::string& head,
+                                    const std::string* payload) {
+  size_t payload_size = payload ? payload->size() : 0;
+  if (head.size() + payload_size > std::numeric_limits<uint32_t>::max()) {
+    return false;
+  }
+  FrameHeader header = {static_cast<uint32_t>(head.size() + payload_size),
+                        flags, rpc_id};
+  ShmRingView::Piece pieces[3] = {
+      {reinterpret_cast<const char*>(&header), sizeof(header)},
+      {head.data(), head.size()},
+      {payload ? payload->data() : nullptr, payload_size},
+  };
+  int64_t ring_full_waits = 0;
+  bool ok;
+  {
+    absl::MutexLock m(&connection->send_mutex);
+    ok = connection->send_ring.Write(pieces, payload ? 3 : 2,
+                                     &ring_full_waits);
+  }
+  ring_full_waits_ += ring_full_waits;
+  if (ok) bytes_sent_ += sizeof(header) + header.length;
+  return ok;
+}
+
+void ProtocolDriverShm::HandleRequest(ShmConnection* connection,
+                                      uint64_t rpc_id, const char* data,
+                                      size_t length) {
+  handler_set_.WaitForNotification();
+  // Counted first, so that ShutdownServer either waits for this RPC or
+  // this thread sees it shutting down:
+  ++pending_server_rpcs_;
+  if (!handler_ || shutting_down_server_.HasBeenNotified()) {
+    --pending_server_rpcs_;
+    return;
+  }
+  absl::Time receive_time = absl::Now();
+  GenericRequest* request = new GenericRequest;
+  if (!request->ParseFromArray(data, length)) {
+    // The handler must not see a partially parsed request, and the failed
+    // response is sent from the threadpool too, without blocking this one:
+    LOG(ERROR) << "request did not parse as a GenericRequest";
+    delete request;
+    thread_pool_->AddWork([this, connection, rpc_id]() {
+      SendMessage(connection, rpc_id, kFailedResponseFlag, "", nullptr);
+      --pending_server_rpcs_;
+    });
+    return;
+  }
+  ServerRpcState* rpc_state = new ServerRpcState;
+  rpc_state->request = request;
+  if (rpc_state->RecordsServerTimings()) {
+    rpc_state->receive_time = receive_time;
+  }
+  rpc_state->SetFreeStateFunction([=]() {
+    delete rpc_state->request;
+    delete rpc_state;
+  });
+  rpc_state->SetSendResponseFunction([this, rpc_state, rpc_id, connection]() {
+    rpc_state->RecordServerTimings();
+    std::string head = EncodeMessageHead(&rpc_state->response);
+    const std::string* payload = rpc_state->response.has_payload()
+                                     ? &rpc_state->response.payload()
+                                     : nullptr;
+    if (!SendMessage(connection, rpc_id, 0, head, payload) &&
+        !connection->header->closed.load(std::memory_order_acquire)) {
+      LOG(ERROR) << "response is too large to be framed";
+      SendMessage(connection, rpc_id, kFailedResponseFlag, "", nullptr);
+    }
+    --pending_server_rpcs_;
+  });
+  // The handler runs on the threadpool, so that this thread keeps draining
+  // the request ring while responses wait for space in theirs.
+  thread_pool_->AddWork([this, rpc_state]() {
+    auto remaining_work = handler_(rpc_state);
+    if (remaining_work) remaining_work();
+  });
+}
+
+void ProtocolDriverShm::HandleResponse(ShmConnection* connection,
+                                       uint64_t rpc_id, uint32_t flags,
+                                       const char* data, size_t length) {
+  PendingShmRpc* pending_rpc;
+  {
+    absl::MutexLock m(&connection->pending_rpcs_mutex);
+    auto it = connection->pending_rpcs.find(rpc_id);
+    if (it == connection->pending_rpcs.end()) {
+      LOG(ERROR) << "response to unknown rpc " << rpc_id;
+      return;
+    }
+    pending_rpc = it->second;
+    connection->pending_rpcs.erase(it);
+  }
+  ClientRpcState* state = pending_rpc->state;
+  if (state->request.record_stage_timings()) {
+    state->completion_dequeued_time = absl::Now();
+  }
+  if (flags & kFailedResponseFlag) {
+    state->success = false;
+  } else {
+    state->success = state->response.ParseFromArray(data, length);
+    if (!state->success) {
+      LOG(ERROR) << "response did not parse as a GenericResponse";
+    }
+  }
+  pending_rpc->done_callback();
+  delete pending_rpc;
+  --pending_rpcs_;
+}
+
+void ProtocolDriverShm::InitiateRpc(int peer_index, ClientRpcState* state,
+                                    std::function<void(void)> done_callback) {
+  CHECK_GE(peer_index, 0);
+  CHECK_LT(static_cast<size_t>(peer_index), client_connections_.size());
+  ShmConnection* connection = client_connections_[peer_index].get();
+  if (!connection) {
+    state->success = false;
+    done_callback();
+    return;
+  }
+  uint64_t rpc_id =
+      connection->next_rpc_id.fetch_add(1, std::memory_order_relaxed);
+  ++pending_rpcs_;
+  {
+    absl::MutexLock m(&connection->pending_rpcs_mutex);
+    if (connection->receive_thread_done) {
+      --pending_rpcs_;
+      state->success = false;
+      done_callback();
+      return;
+    }
+    connection->pending_rpcs[rpc_id] = new PendingShmRpc{state, done_callback};
+  }
+  std::string head = EncodeMessageHead(&state->request);
+  // The response may arrive as soon as the request is written, after which
+  // the state belongs to the completion, so the send itself is not timed.
+  if (state->request.record_stage_timings()) {
+    state->serialize_done_time = absl::Now();
+  }
+  const std::string* payload =
+      state->request.has_payload() ? &state->request.payload() : nullptr;
+  if (SendMessage(connection, rpc_id, 0, head, payload)) return;
+
+  // Fail the RPC, unless the receive thread did so already:
+  PendingShmRpc* pending_rpc = nullptr;
+  {
+    absl::MutexLock m(&connection->pending_rpcs_mutex);
+    auto it = connection->pending_rpcs.find(rpc_id);
+    if (it != connection->pending_rpcs.end()) {
+      pending_rpc = it->second;
+      connection->pending_rpcs.erase(it);
+    }
+  }
+  if (pending_rpc) {
+    state->success = false;
+    pending_rpc->done_callback();
+    delete pending_rpc;
+    --pending_rpcs_;
+  }
+}
+
+void ProtocolDriverShm::FailPendingRpcs(ShmConnection* connection) {
+  absl::flat_hash_map<uint64_t, PendingShmRpc*> pending_rpcs;
+  {
+    absl::MutexLock m(&connection->pending_rpcs_mutex);
+    connection->receive_thread_done = true;
+    pending_rpcs.swap(connection->pending_rpcs);
+  }
+  for (auto& [rpc_id, pending_rpc] : pending_rpcs) {
+    pending_rpc->state->success = false;
+    pending_rpc->done_callback();
+    delete pending_rpc;
+    --pending_rpcs_;
+  }
+}
+
+void ProtocolDriverShm::StopConnection(ShmConnection* connection) {
+  connection->header->closed.store(1, std::memory_order_release);
+  connection->stop.store(true, std::memory_order_release);
+  connection->receive_ring.Wake();
+  {
+    absl::MutexLock m(&connection->send_mutex);
+    connection->send_ring.Wake();
+  }
+  if (connection->receive_thread.joinable()) {
+    connection->receive_thread.join();
+  }
+}
+
+std::vector<TransportStat> ProtocolDriverShm::GetTransportStats() {
+  return {
+      {"shm_bytes_sent", bytes_sent_},
+      {"shm_bytes_received", bytes_received_},
+      {"shm_ring_full_waits", ring_full_waits_},
+  };
+}
+
+void ProtocolDriverShm::ChurnConnection(int peer) {
+  // Never called, see SupportsConnectionChurn.
+}
+
+void ProtocolDriverShm::ShutdownServer() {
+  handler_set_.TryToNotify();
+  if (shutting_down_server_.TryToNotify()) {
+    while (pending_server_rpcs_) {
+      sched_yield();
+    }
+    // Runs the work that is still queued:
+    thread_pool_.reset();
+    absl::MutexLock m(&server_connections_mutex_);
+    for (auto& connection : server_connections_) {
+      StopConnection(connection.get());
+      // In case the initiator never connected:
+      shm_unlink(connection->segment_name.c_str());
+    }
+    server_connections_.clear();
+  }
+}
+
+void ProtocolDriverShm::ShutdownClient() {
+  if (shutting_down_client_.TryToNotify()) {
+    while (pending_rpcs_) {
+      sched_yield();
+    }
+    for (auto& connection : client_connections_) {
+      if (connection) StopConnection(connection.get());
+    }
+    client_connections_.clear();
+  }
+}
+
+}  // namespace distbench
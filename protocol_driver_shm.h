@@ -0,0 +1,193 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_PROTOCOL_DRIVER_SHM_H_
+#define DISTBENCH_PROTOCOL_DRIVER_SHM_H_
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "distbench_threadpool.h"
+#include "distbench_utils.h"
+#include "distbench_wait_policy.h"
+#include "protocol_driver.h"
+
+namespace distbench {
+
+// The shared memory segment holds two of these, one per direction, each
+// followed by its data. head and tail count the bytes ever consumed and
+// produced, so that the ring is empty when they are equal.
+struct ShmRing {
+  alignas(64) std::atomic<uint64_t> tail;
+  alignas(64) std::atomic<uint64_t> head;
+  // Bumped by the producer to wake up a consumer sleeping in futex_wait:
+  alignas(64) std::atomic<uint32_t> data_futex;
+  std::atomic<uint32_t> consumer_sleeping;
+};
+
+struct ShmSegmentHeader {
+  uint64_t magic;
+  uint64_t ring_size;
+  uint32_t use_futex;
+  // Set by whichever side shuts down first:
+  std::atomic<uint32_t> closed;
+};
+
+// The local view of one direction of a connection. Only one thread at a time
+// may produce, and only one may consume.
+class ShmRingView {
+ public:
+  void Attach(ShmRing* ring, char* data, uint64_t size, bool use_futex,
+              std::atomic<uint32_t>* closed);
+
+  struct Piece {
+    const char* data;
+    size_t size;
+  };
+  // Copies the pieces into the ring, waiting for space as needed. Returns
+  // false if the connection was closed first.
+  bool Write(const Piece* pieces, int num_pieces, int64_t* ring_full_waits);
+  // Appends whatever is available to buffer without waiting.
+  size_t Read(std::string* buffer);
+  // Waits as wait_policy says until there is something to read, the
+  // connection is closed or stop is set. Returns false in the latter cases.
+  bool WaitForData(const WaitPolicy& wait_policy,
+                   WaitTimeCounters* wait_times,
+                   const std::atomic<bool>& stop);
+  // Wakes up the consumer, e.g. to notice that the connection is closed.
+  void Wake();
+
+ private:
+  ShmRing* ring_ = nullptr;
+  char* data_ = nullptr;
+  uint64_t size_ = 0;
+  bool use_futex_ = false;
+  std::atomic<uint32_t>* closed_ = nullptr;
+};
+
+struct PendingShmRpc {
+  ClientRpcState* state;
+  std::function<void(void)> done_callback;
+};
+
+struct ShmConnection {
+  ~ShmConnection();
+
+  std::string segment_name;
+  void* mapping = nullptr;
+  size_t mapping_size = 0;
+  ShmSegmentHeader* header = nullptr;
+  bool is_client = false;
+
+  absl::Mutex send_mutex;
+  ShmRingView send_ring ABSL_GUARDED_BY(send_mutex);
+  // Used only by receive_thread:
+  ShmRingView receive_ring;
+  std::string receive_buffer;
+  std::thread receive_thread;
+  std::atomic<bool> stop = false;
+
+  // Client connections only:
+  std::atomic<uint64_t> next_rpc_id = 0;
+  absl::Mutex pending_rpcs_mutex;
+  absl::flat_hash_map<uint64_t, PendingShmRpc*> pending_rpcs
+      ABSL_GUARDED_BY(pending_rpcs_mutex);
+  bool receive_thread_done ABSL_GUARDED_BY(pending_rpcs_mutex) = false;
+};
+
+// A protocol driver for peers running on the same host, exchanging
+// length-prefixed protobufs through a pair of single producer, single
+// consumer rings in a shared memory segment per connection.
+class ProtocolDriverShm : public ProtocolDriver {
+ public:
+  ProtocolDriverShm();
+  ~ProtocolDriverShm() override;
+
+  absl::Status Initialize(const ProtocolDriverOptions& pd_opts,
+                          int* port) override;
+
+  void SetHandler(std::function<std::function<void()>(ServerRpcState* state)>
+                      handler) override;
+
+  void SetNumPeers(int num_peers) override;
+
+  // Returns the id of the local host.
+  absl::StatusOr<std::string> Preconnect() override;
+
+  // Maps the segment created by the peer.
+  absl::Status HandleConnect(std::string remote_connection_info,
+                             int peer) override;
+
+  // Creates a segment for the initiator, which must be on the same host.
+  absl::StatusOr<std::string> HandlePreConnect(
+      std::string_view remote_connection_info, int peer) override;
+
+  std::vector<TransportStat> GetTransportStats() override;
+
+  void InitiateRpc(int peer_index, ClientRpcState* state,
+                   std::function<void(void)> done_callback) override;
+
+  void ChurnConnection(int peer) override;
+  bool SupportsConnectionChurn() override { return false; }
+
+  void ShutdownServer() override;
+
+  void ShutdownClient() override;
+
+ private:
+  void ReceiveThread(ShmConnection* connection);
+  void HandleFrames(ShmConnection* connection);
+  void HandleRequest(ShmConnection* connection, uint64_t rpc_id,
+                     const char* data, size_t length);
+  void HandleResponse(ShmConnection* connection, uint64_t rpc_id,
+                      uint32_t flags, const char* data, size_t length);
+  bool SendMessage(ShmConnection* connection, uint64_t rpc_id, uint32_t flags,
+                   const std::string& head, const std::string* payload);
+  void FailPendingRpcs(ShmConnection* connection);
+  void StopConnection(ShmConnection* connection);
+
+  std::string host_id_;
+  uint64_t ring_size_ = 0;
+  bool use_futex_ = true;
+  WaitPolicy wait_policy_;
+  std::atomic<int> next_segment_id_ = 0;
+
+  // Indexed by peer:
+  std::vector<std::unique_ptr<ShmConnection>> client_connections_;
+  std::atomic<int> pending_rpcs_ = 0;
+
+  absl::Mutex server_connections_mutex_;
+  std::vector<std::unique_ptr<ShmConnection>> server_connections_
+      ABSL_GUARDED_BY(server_connections_mutex_);
+  std::atomic<int> pending_server_rpcs_ = 0;
+  std::unique_ptr<AbstractThreadpool> thread_pool_;
+  std::function<std::function<void()>(ServerRpcState* state)> handler_;
+  SafeNotification handler_set_;
+
+  SafeNotification shutting_down_server_;
+  SafeNotification shutting_down_client_;
+
+  std::atomic<int64_t> bytes_sent_ = 0;
+  std::atomic<int64_t> bytes_received_ = 0;
+  std::atomic<int64_t> ring_full_waits_ = 0;
+};
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_PROTOCOL_DRIVER_SHM_H_
@@ -0,0 +1,476 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protocol_driver_simulated.h"
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "glog/logging.h"
+
+namespace distbench {
+
+// SimulatedClock =============================================
+
+// A thread blocked in MutexLockWhenWithDeadline.
+struct SimulatedClock::Waiter {
+  // Evaluated with mu held, possibly by the thread that releases it:
+  bool Ready() {
+    const bool ready =
+        expired.load(std::memory_order_acquire) || condition->Eval();
+    if (ready && !awake.exchange(true)) ++clock->busy_threads_;
+    if (!evaluated) {
+      // The wait is in place, i.e. whoever makes the condition true also
+      // evaluates it again, before the time can advance:
+      evaluated = true;
+      absl::MutexLock m(&clock->mu_);
+      --clock->registering_waiters_;
+    }
+    return ready;
+  }
+
+  SimulatedClock* clock;
+  absl::Mutex* mu;
+  const absl::Condition* condition;
+  std::atomic<bool> awake = false;
+  // Set by the thread of the clock once the virtual time reaches the
+  // deadline, after which it locks and unlocks mu, to have the condition
+  // evaluated again, and only then sets poked:
+  std::atomic<bool> expired = false;
+  std::atomic<bool> poked = false;
+  // Guarded by mu:
+  bool evaluated = false;
+  // Guarded by the mu_ of the clock:
+  bool has_timer = false;
+  std::multimap<absl::Time, Waiter*>::iterator timer = {};
+};
+
+struct SimulatedClock::ThreadState {
+  ~ThreadState() {
+    if (!tracked && !holds) return;
+    // The thread exits while busy:
+    SimulatedClock& clock = SimulatedClock::Get();
+    absl::MutexLock m(&clock.mu_);
+    --clock.busy_threads_;
+  }
+
+  // Once a thread waited on the clock, it holds the time whenever it is not
+  // waiting:
+  bool tracked = false;
+  bool runs_events = false;
+  // The Hold calls not released yet, which only count for the threads that
+  // are not tracked:
+  int holds = 0;
+};
+
+SimulatedClock& SimulatedClock::Get() {
+  // Never destroyed, as its thread runs until the process exits:
+  static SimulatedClock* clock = new SimulatedClock;
+  return *clock;
+}
+
+SimulatedClock::SimulatedClock() : now_ns_(absl::ToUnixNanos(absl::Now())) {
+  RunRegisteredThread("SimulatedClock", [this]() { RunEvents(); }).detach();
+}
+
+SimulatedClock::ThreadState& SimulatedClock::GetThreadState() {
+  thread_local ThreadState thread_state;
+  return thread_state;
+}
+
+absl::Time SimulatedClock::Now() {
+  return absl::FromUnixNanos(now_ns_.load(std::memory_order_acquire));
+}
+
+bool SimulatedClock::MutexLockWhenWithDeadline(absl::Mutex* mu,
+                                               const absl::Condition& condition,
+                                               absl::Time deadline) {
+  ThreadState& thread_state = GetThreadState();
+  CHECK(!thread_state.runs_events)
+      << "The events of a SimulatedClock cannot wait for it";
+  Waiter waiter{this, mu, &condition};
+  mu_.Lock();
+  if (deadline <= Now()) {
+    mu_.Unlock();
+    mu->Lock();
+    return condition.Eval();
+  }
+  ++registering_waiters_;
+  if (thread_state.tracked || thread_state.holds) --busy_threads_;
+  thread_state.tracked = true;
+  if (deadline != absl::InfiniteFuture()) {
+    waiter.timer = timers_.emplace(deadline, &waiter);
+    waiter.has_timer = true;
+  }
+  mu_.Unlock();
+
+  mu->LockWhen(absl::Condition(&waiter, &Waiter::Ready));
+  mu_.Lock();
+  if (waiter.has_timer) timers_.erase(waiter.timer);
+  mu_.Unlock();
+  // The waiter must outlive the poke of an expired timer:
+  while (waiter.expired.load(std::memory_order_acquire) &&
+         !waiter.poked.load(std::memory_order_acquire)) {
+    mu->Unlock();
+    sched_yield();
+    mu->Lock();
+  }
+  return condition.Eval();
+}
+
+void SimulatedClock::Hold() {
+  ThreadState& thread_state = GetThreadState();
+  // The time does not advance while the events run anyway:
+  if (thread_state.runs_events) return;
+  if (thread_state.holds++ || thread_state.tracked) return;
+  // Under mu_, so that the time either advances before the hold or waits:
+  absl::MutexLock m(&mu_);
+  ++busy_threads_;
+}
+
+void SimulatedClock::Release() {
+  ThreadState& thread_state = GetThreadState();
+  if (thread_state.runs_events) return;
+  CHECK_GT(thread_state.holds, 0);
+  if (--thread_state.holds || thread_state.tracked) return;
+  absl::MutexLock m(&mu_);
+  --busy_threads_;
+}
+
+void SimulatedClock::HoldForNewThread() {
+  absl::MutexLock m(&mu_);
+  ++busy_threads_;
+}
+
+void SimulatedClock::AdoptHold() {
+  ThreadState& thread_state = GetThreadState();
+  CHECK(!thread_state.tracked && !thread_state.holds);
+  thread_state.holds = 1;
+}
+
+void SimulatedClock::Schedule(absl::Time when, std::function<void()> event) {
+  absl::MutexLock m(&mu_);
+  events_.emplace(when, std::move(event));
+}
+
+bool SimulatedClock::CanAdvance() {
+  return busy_threads_.load(std::memory_order_acquire) == 0 &&
+         registering_waiters_ == 0 && (!events_.empty() || !timers_.empty());
+}
+
+void SimulatedClock::RunEvents() {
+  GetThreadState().runs_events = true;
+  std::vector<std::function<void()>> due_events;
+  std::vector<Waiter*> expired_waiters;
+  mu_.Lock();
+  while (true) {
+    mu_.Await(absl::Condition(this, &SimulatedClock::CanAdvance));
+    absl::Time next = absl::InfiniteFuture();
+    if (!events_.empty()) next = events_.begin()->first;
+    if (!timers_.empty()) next = std::min(next, timers_.begin()->first);
+    const absl::Time now = std::max(Now(), next);
+    now_ns_.store(absl::ToUnixNanos(now), std::memory_order_release);
+    while (!timers_.empty() && timers_.begin()->first <= now) {
+      Waiter* waiter = timers_.begin()->second;
+      timers_.erase(timers_.begin());
+      waiter->has_timer = false;
+      // Counted as busy right away, so that the time waits for it:
+      if (!waiter->awake.exchange(true)) ++busy_threads_;
+      waiter->expired.store(true, std::memory_order_release);
+      expired_waiters.push_back(waiter);
+    }
+    while (!events_.empty() && events_.begin()->first <= now) {
+      due_events.push_back(std::move(events_.begin()->second));
+      events_.erase(events_.begin());
+    }
+    mu_.Unlock();
+
+    for (Waiter* waiter : expired_waiters) {
+      waiter->mu->Lock();
+      waiter->mu->Unlock();
+      waiter->poked.store(true, std::memory_order_release);
+    }
+    expired_waiters.clear();
+    for (auto& event : due_events) {
+      event();
+    }
+    due_events.clear();
+    mu_.Lock();
+  }
+}
+
+// ProtocolDriver ===============================================
+
+namespace {
+
+// The simulated servers of the process that have a handler, by id:
+struct ServerRegistry {
+  absl::Mutex mutex;
+  int64_t next_id ABSL_GUARDED_BY(mutex) = 0;
+  absl::flat_hash_map<int64_t, ProtocolDriverSimulated*> servers
+      ABSL_GUARDED_BY(mutex);
+};
+
+ServerRegistry& GetServerRegistry() {
+  static ServerRegistry* registry = new ServerRegistry;
+  return *registry;
+}
+
+}  // anonymous namespace
+
+absl::Status ProtocolDriverSimulated::Delay::Initialize(
+    const ProtocolDriverOptions& pd_opts, std::string_view name,
+    int64_t default_ns) {
+  int64_t ns = GetNamedServerSettingInt64(pd_opts, absl::StrCat(name, "_ns"),
+                                          default_ns);
+  if (ns < 0) {
+    return absl::InvalidArgumentError(
+        absl::StrCat(name, "_ns (", ns, ") must not be negative."));
+  }
+  constant = absl::Nanoseconds(ns);
+  std::string distribution_name = GetNamedServerSettingString(
+      pd_opts, absl::StrCat(name, "_distribution"), "");
+  if (distribution_name.empty()) return absl::OkStatus();
+  for (const auto& config : pd_opts.distribution_config()) {
+    if (config.name() != distribution_name) continue;
+    auto maybe_distribution = AllocateSampleGenerator(config);
+    if (!maybe_distribution.ok()) return maybe_distribution.status();
+    if (maybe_distribution.value()->num_dimensions() != 1) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("The ", name, "_distribution ", distribution_name,
+                       " must have a single dimension."));
+    }
+    distribution = std::move(maybe_distribution.value());
+    return absl::OkStatus();
+  }
+  return absl::InvalidArgumentError(absl::StrCat(
+      "Unknown ", name, "_distribution: ", distribution_name));
+}
+
+absl::Duration ProtocolDriverSimulated::Delay::Sample() const {
+  if (!distribution) return constant;
+  int ns;
+  distribution->GetRandomSample(absl::MakeSpan(&ns, 1));
+  return absl::Nanoseconds(std::max(ns, 0));
+}
+
+ProtocolDriverSimulated::ProtocolDriverSimulated()
+    : clock_(SimulatedClock::Get()) {}
+
+ProtocolDriverSimulated::~ProtocolDriverSimulated() {
+  ShutdownServer();
+  ShutdownClient();
+}
+
+absl::Status ProtocolDriverSimulated::Initialize(
+    const ProtocolDriverOptions& pd_opts, int* port) {
+  absl::Status status =
+      network_delay_.Initialize(pd_opts, "network_delay", 50'000);
+  if (!status.ok()) return status;
+  status = server_delay_.Initialize(pd_opts, "server_delay", 0);
+  if (!status.ok()) return status;
+  {
+    ServerRegistry& registry = GetServerRegistry();
+    absl::MutexLock m(&registry.mutex);
+    server_id_ = registry.next_id++;
+  }
+  // No network port is used:
+  *port = 0;
+  return absl::OkStatus();
+}
+
+void ProtocolDriverSimulated::SetHandler(
+    std::function<std::function<void()>(ServerRpcState* state)> handler) {
+  ServerRegistry& registry = GetServerRegistry();
+  absl::MutexLock m(&registry.mutex);
+  if (shutting_down_server_.HasBeenNotified()) return;
+  handler_ = handler;
+  registry.servers[server_id_] = this;
+}
+
+void ProtocolDriverSimulated::SetNumPeers(int num_peers) {
+  peer_server_ids_.assign(num_peers, -1);
+}
+
+absl::StatusOr<std::string> ProtocolDriverSimulated::HandlePreConnect(
+    std::string_view remote_connection_info, int peer) {
+  return absl::StrCat(getpid(), ":", server_id_);
+}
+
+absl::Status ProtocolDriverSimulated::HandleConnect(
+    std::string remote_connection_info, int peer) {
+  CHECK_GE(peer, 0);
+  CHECK_LT(static_cast<size_t>(peer), peer_server_ids_.size());
+  std::vector<std::string_view> parts =
+      absl::StrSplit(remote_connection_info, ':');
+  int64_t pid;
+  int64_t server_id;
+  if (parts.size() != 2 || !absl::SimpleAtoi(parts[0], &pid) ||
+      !absl::SimpleAtoi(parts[1], &server_id)) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "remote_connection_info did not parse: ", remote_connection_info));
+  }
+  if (pid != getpid()) {
+    return absl::FailedPreconditionError(
+        "The simulated protocol driver needs all the services of the test "
+        "in one process");
+  }
+  peer_server_ids_[peer] = server_id;
+  return absl::OkStatus();
+}
+
+std::vector<TransportStat> ProtocolDriverSimulated::GetTransportStats() {
+  return {
+      {"simulated_requests_sent", requests_sent_},
+      {"simulated_requests_received", requests_received_},
+      {"simulated_failed_rpcs", failed_rpcs_},
+  };
+}
+
+void ProtocolDriverSimulated::InitiateRpc(
+    int peer_index, ClientRpcState* state,
+    std::function<void(void)> done_callback) {
+  CHECK_GE(peer_index, 0);
+  CHECK_LT(static_cast<size_t>(peer_index), peer_server_ids_.size());
+  ++pending_rpcs_;
+  const int64_t server_id = peer_server_ids_[peer_index];
+  if (server_id < 0) {
+    CompleteRpc(state, /*success=*/false, nullptr, done_callback);
+    return;
+  }
+  ++requests_sent_;
+  const absl::Time now = clock_.Now();
+  if (state->request.record_stage_timings()) {
+    state->serialize_done_time = now;
+    state->sent_time = now;
+  }
+  clock_.Schedule(now + network_delay_.Sample(), [this, server_id, state,
+                                                   done_callback]() {
+    ProtocolDriverSimulated* server = nullptr;
+    {
+      ServerRegistry& registry = GetServerRegistry();
+      absl::ReaderMutexLock m(&registry.mutex);
+      auto it = registry.servers.find(server_id);
+      if (it != registry.servers.end()) {
+        server = it->second;
+        // Counted under the lock, so that ShutdownServer waits for it:
+        ++server->pending_server_rpcs_;
+      }
+    }
+    if (!server) {
+      CompleteRpc(state, /*success=*/false, nullptr, done_callback);
+      return;
+    }
+    server->HandleRequest(this, state, done_callback);
+  });
+}
+
+// Runs on the thread of the clock, when the request arrives.
+void ProtocolDriverSimulated::HandleRequest(
+    ProtocolDriverSimulated* client, ClientRpcState* client_state,
+    std::function<void(void)> done_callback) {
+  ++requests_received_;
+  ServerRpcState* rpc_state = new ServerRpcState;
+  // The handler may outlive the RPC, e.g. after sending the response early,
+  // so it gets a copy of the request, as it would off the network:
+  rpc_state->request = new GenericRequest(client_state->request);
+  rpc_state->clock = &clock_;
+  if (rpc_state->RecordsServerTimings()) {
+    rpc_state->receive_time = clock_.Now();
+  }
+  rpc_state->SetFreeStateFunction([=]() {
+    delete rpc_state->request;
+    delete rpc_state;
+  });
+  rpc_state->SetSendResponseFunction(
+      [this, rpc_state, client, client_state, done_callback]() {
+        rpc_state->RecordServerTimings();
+        auto* response = new GenericResponse;
+        response->Swap(&rpc_state->response);
+        clock_.Schedule(
+            clock_.Now() + network_delay_.Sample(),
+            [client, client_state, response, done_callback]() {
+              client->CompleteRpc(client_state, /*success=*/true, response,
+                                  done_callback);
+            });
+        --pending_server_rpcs_;
+      });
+  auto run_handler = [this, rpc_state]() {
+    auto remaining_work = handler_(rpc_state);
+    if (remaining_work) remaining_work();
+  };
+  const absl::Duration server_delay = server_delay_.Sample();
+  if (server_delay == absl::ZeroDuration()) {
+    run_handler();
+  } else {
+    clock_.Schedule(clock_.Now() + server_delay, run_handler);
+  }
+}
+
+void ProtocolDriverSimulated::CompleteRpc(
+    ClientRpcState* state, bool success, GenericResponse* response,
+    const std::function<void(void)>& done_callback) {
+  if (response) {
+    state->response.Swap(response);
+    delete response;
+  }
+  if (state->request.record_stage_timings()) {
+    state->completion_dequeued_time = clock_.Now();
+  }
+  state->success = success;
+  if (!success) ++failed_rpcs_;
+  done_callback();
+  --pending_rpcs_;
+}
+
+void ProtocolDriverSimulated::ChurnConnection(int peer) {
+  // There is no connection to tear down, but setting up the new one takes a
+  // round trip:
+  absl::Mutex mu;
+  bool never = false;
+  clock_.MutexLockWhenWithDeadline(
+      &mu, absl::Condition(&never),
+      clock_.Now() + network_delay_.Sample() + network_delay_.Sample());
+  mu.Unlock();
+}
+
+void ProtocolDriverSimulated::ShutdownServer() {
+  if (shutting_down_server_.TryToNotify()) {
+    {
+      ServerRegistry& registry = GetServerRegistry();
+      absl::MutexLock m(&registry.mutex);
+      registry.servers.erase(server_id_);
+    }
+    // The RPCs that already arrived still get their response:
+    while (pending_server_rpcs_) {
+      sched_yield();
+    }
+  }
+}
+
+void ProtocolDriverSimulated::ShutdownClient() {
+  if (shutting_down_client_.TryToNotify()) {
+    while (pending_rpcs_) {
+      sched_yield();
+    }
+  }
+}
+
+}  // namespace distbench
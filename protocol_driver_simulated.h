@@ -0,0 +1,167 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_PROTOCOL_DRIVER_SIMULATED_H_
+#define DISTBENCH_PROTOCOL_DRIVER_SIMULATED_H_
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "absl/synchronization/mutex.h"
+#include "distbench_utils.h"
+#include "joint_distribution_sample_generator.h"
+#include "protocol_driver.h"
+
+namespace distbench {
+
+// A discrete-event clock: the virtual time only moves when nothing can
+// happen before the next event, and then jumps straight to it. The events
+// are the functions passed to Schedule, which run in time order on the
+// thread of the clock, and the deadlines of the threads waiting in
+// MutexLockWhenWithDeadline.
+//
+// The time cannot advance while a thread that waits on the clock is busy,
+// i.e. from the moment it wakes up until it waits again or exits, so that
+// what it does happens at the time it woke up at. The other threads hold the
+// clock while they start work, see SimpleClock::Hold; the time does not
+// wait for the threads that do neither, so it may advance between any two
+// of the events that they schedule.
+class SimulatedClock : public SimpleClock {
+ public:
+  // The clock shared by all the simulated protocol drivers of the process,
+  // starting from the real time.
+  static SimulatedClock& Get();
+
+  absl::Time Now() override;
+  bool MutexLockWhenWithDeadline(absl::Mutex* mu,
+                                 const absl::Condition& condition,
+                                 absl::Time deadline)
+      ABSL_EXCLUSIVE_LOCK_FUNCTION(mu) override;
+  bool IsSimulated() override { return true; }
+  void Hold() override;
+  void Release() override;
+  void HoldForNewThread() override;
+  void AdoptHold() override;
+
+  // Runs event on the thread of the clock, once the virtual time reaches
+  // when (or right away, if it did already). The event must not wait on the
+  // clock itself.
+  void Schedule(absl::Time when, std::function<void()> event);
+
+ private:
+  struct Waiter;
+  struct ThreadState;
+
+  SimulatedClock();
+  void RunEvents();
+  bool CanAdvance() ABSL_EXCLUSIVE_LOCKS_REQUIRED(mu_);
+  ThreadState& GetThreadState();
+
+  std::atomic<int64_t> now_ns_;
+  // The tracked threads that are not waiting on the clock, and the other
+  // threads that hold it:
+  std::atomic<int> busy_threads_ = 0;
+
+  absl::Mutex mu_;
+  std::multimap<absl::Time, std::function<void()>> events_
+      ABSL_GUARDED_BY(mu_);
+  std::multimap<absl::Time, Waiter*> timers_ ABSL_GUARDED_BY(mu_);
+  // The waiters whose condition was not evaluated yet, which the time waits
+  // for, as it may already hold:
+  int registering_waiters_ ABSL_GUARDED_BY(mu_) = 0;
+};
+
+// Runs all the services of a test in one process, on a SimulatedClock: the
+// RPCs never leave the process, and their network and server delays are
+// drawn from a distribution, or constant, instead. As the virtual time skips
+// ahead from event to event, large topologies simulate faster than they
+// would run, while the engines see the usual RPCs and the test still
+// produces a regular TestResult. This needs all the engines of the test in
+// one process, e.g. with "distbench test_sequencer --local_nodes=N".
+//
+// The CPU time of the handlers and activities takes no virtual time; the
+// server delay models it instead.
+class ProtocolDriverSimulated : public ProtocolDriver {
+ public:
+  ProtocolDriverSimulated();
+  ~ProtocolDriverSimulated() override;
+
+  absl::Status Initialize(const ProtocolDriverOptions& pd_opts,
+                          int* port) override;
+
+  void SetHandler(std::function<std::function<void()>(ServerRpcState* state)>
+                      handler) override;
+  void SetNumPeers(int num_peers) override;
+
+  // Looks up the server in the process.
+  absl::Status HandleConnect(std::string remote_connection_info,
+                             int peer) override;
+
+  // Returns the address of this server in the process.
+  absl::StatusOr<std::string> HandlePreConnect(
+      std::string_view remote_connection_info, int peer) override;
+
+  std::vector<TransportStat> GetTransportStats() override;
+  void InitiateRpc(int peer_index, ClientRpcState* state,
+                   std::function<void(void)> done_callback) override;
+  // Takes a network round trip of virtual time.
+  void ChurnConnection(int peer) override;
+  void ShutdownServer() override;
+  void ShutdownClient() override;
+
+  SimpleClock& GetClock() override { return clock_; }
+
+ private:
+  // A constant delay, unless a distribution of nanoseconds is given:
+  struct Delay {
+    absl::Status Initialize(const ProtocolDriverOptions& pd_opts,
+                            std::string_view name, int64_t default_ns);
+    absl::Duration Sample() const;
+
+    absl::Duration constant;
+    std::unique_ptr<DistributionSampleGenerator> distribution;
+  };
+
+  void HandleRequest(ProtocolDriverSimulated* client, ClientRpcState* state,
+                     std::function<void(void)> done_callback);
+  void CompleteRpc(ClientRpcState* state, bool success,
+                   GenericResponse* response,
+                   const std::function<void(void)>& done_callback);
+
+  SimulatedClock& clock_;
+  Delay network_delay_;
+  Delay server_delay_;
+  int64_t server_id_ = -1;
+
+  // Indexed by peer:
+  std::vector<int64_t> peer_server_ids_;
+  std::atomic<int> pending_rpcs_ = 0;
+
+  std::atomic<int> pending_server_rpcs_ = 0;
+  std::function<std::function<void()>(ServerRpcState* state)> handler_;
+
+  SafeNotification shutting_down_server_;
+  SafeNotification shutting_down_client_;
+
+  std::atomic<int64_t> requests_sent_ = 0;
+  std::atomic<int64_t> requests_received_ = 0;
+  std::atomic<int64_t> failed_rpcs_ = 0;
+};
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_PROTOCOL_DRIVER_SIMULATED_H_
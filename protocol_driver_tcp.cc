@@ -0,0 +1,884 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "protocol_driver_tcp.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <limits>
+
+#include "absl/strings/str_cat.h"
+#include "glog/logging.h"
+
+namespace distbench {
+
+namespace {
+
+// Every message is preceded by a header holding, in little endian order:
+//   uint32 length of the message (excluding the header)
+//   uint32 flags
+//   uint64 rpc id, chosen by the client and echoed in the response
+constexpr size_t kFrameHeaderSize = 16;
+// Sent instead of a response that cannot be framed:
+constexpr uint32_t kFailedResponseFlag = 1;
+// The tag of the payload field (1, length delimited) of GenericRequest and
+// GenericResponse:
+constexpr char kPayloadTag = 0x0a;
+constexpr size_t kMinReadSize = 64 * 1024;
+constexpr int kMaxIovecs = 64;
+constexpr int kMaxEpollEvents = 64;
+
+union SocketAddress {
+  sockaddr sa;
+  sockaddr_in in4;
+  sockaddr_in6 in6;
+};
+
+void StoreLittleEndian(char* dest, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    dest[i] = static_cast<char>(value >> (8 * i));
+  }
+}
+
+uint64_t LoadLittleEndian(const char* src, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; ++i) {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(src[i])) << (8 * i);
+  }
+  return value;
+}
+
+// Frames a GenericRequest or GenericResponse. The rest of the message is
+// serialized in the head of the frame, followed by the tag and length of
+// the payload; the payload itself is written from the message, which must
+// outlive the frame unless the payload is moved to owned_payload.
+template <typename Message>
+TcpFrame EncodeMessage(uint64_t rpc_id, Message* message) {
+  TcpFrame frame;
+  frame.head.resize(kFrameHeaderSize);
+  bool has_payload = message->has_payload();
+  std::string payload;
+  message->mutable_payload()->swap(payload);
+  message->AppendToString(&frame.head);
+  message->mutable_payload()->swap(payload);
+  if (!has_payload) message->clear_payload();
+  if (has_payload) {
+    frame.head.push_back(kPayloadTag);
+    uint64_t size = message->payload().size();
+    while (size >= 0x80) {
+      frame.head.push_back(static_cast<char>(size | 0x80));
+      size >>= 7;
+    }
+    frame.head.push_back(static_cast<char>(size));
+    frame.payload = message->payload().data();
+    frame.payload_size = message->payload().size();
+  }
+  uint64_t length = frame.size() - kFrameHeaderSize;
+  StoreLittleEndian(&frame.head[0], length, 4);
+  StoreLittleEndian(&frame.head[4], 0, 4);
+  StoreLittleEndian(&frame.head[8], rpc_id, 8);
+  return frame;
+}
+
+TcpFrame EncodeFailedResponse(uint64_t rpc_id) {
+  TcpFrame frame;
+  frame.head.resize(kFrameHeaderSize);
+  StoreLittleEndian(&frame.head[0], 0, 4);
+  StoreLittleEndian(&frame.head[4], kFailedResponseFlag, 4);
+  StoreLittleEndian(&frame.head[8], rpc_id, 8);
+  return frame;
+}
+
+bool FrameTooLarge(const TcpFrame& frame) {
+  return frame.size() - kFrameHeaderSize >
+         std::numeric_limits<uint32_t>::max();
+}
+
+absl::Status SetNonBlocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    return absl::UnknownError(
+        absl::StrCat(strerror(errno), " making socket non blocking"));
+  }
+  return absl::OkStatus();
+}
+
+}  // anonymous namespace
+
+ProtocolDriverTcp::ProtocolDriverTcp() {}
+
+ProtocolDriverTcp::~ProtocolDriverTcp() {
+  ShutdownServer();
+  ShutdownClient();
+}
+
+absl::Status ProtocolDriverTcp::Initialize(const ProtocolDriverOptions& pd_opts,
+                                           int* port) {
+  int64_t reactor_threads =
+      GetNamedServerSettingInt64(pd_opts, "reactor_threads", 1);
+  if (reactor_threads < 1) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "reactor_threads (", reactor_threads, ") must be a positive integer."));
+  }
+  server_socket_options_.tcp_nodelay =
+      GetNamedServerSettingInt64(pd_opts, "tcp_nodelay", 1);
+  server_socket_options_.busy_poll_us =
+      GetNamedServerSettingInt64(pd_opts, "busy_poll_us", 0);
+  client_socket_options_.tcp_nodelay =
+      GetNamedClientSettingInt64(pd_opts, "tcp_nodelay", 1);
+  client_socket_options_.busy_poll_us =
+      GetNamedClientSettingInt64(pd_opts, "busy_poll_us", 0);
+  if (server_socket_options_.busy_poll_us < 0 ||
+      client_socket_options_.busy_poll_us < 0) {
+    return absl::InvalidArgumentError("busy_poll_us must not be negative");
+  }
+  auto maybe_wait_policy =
+      GetWaitPolicy(pd_opts.server_settings(), "reactor_", {});
+  if (!maybe_wait_policy.ok()) return maybe_wait_policy.status();
+  reactor_wait_policy_ = maybe_wait_policy.value();
+
+  auto maybe_thread_pool = CreateThreadpoolFromSettings(pd_opts);
+  if (!maybe_thread_pool.ok()) return maybe_thread_pool.status();
+  thread_pool_ = std::move(maybe_thread_pool.value());
+
+  auto maybe_ip = IpAddressForDevice(pd_opts.netdev_name());
+  if (!maybe_ip.ok()) return maybe_ip.status();
+  server_ip_address_ = maybe_ip.value();
+  int af = server_ip_address_.Family();
+
+  listen_fd_ = socket(af, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    return absl::UnknownError(
+        absl::StrCat(strerror(errno), " creating server socket"));
+  }
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  SocketAddress bind_addr = {};
+  socklen_t bind_addr_len;
+  if (af == AF_INET) {
+    bind_addr.in4.sin_family = AF_INET;
+    bind_addr.in4.sin_port = htons(*port);
+    bind_addr.in4.sin_addr.s_addr = INADDR_ANY;
+    bind_addr_len = sizeof(bind_addr.in4);
+  } else {
+    bind_addr.in6.sin6_family = AF_INET6;
+    bind_addr.in6.sin6_port = htons(*port);
+    bind_addr.in6.sin6_addr = in6addr_any;
+    bind_addr_len = sizeof(bind_addr.in6);
+  }
+  if (bind(listen_fd_, &bind_addr.sa, bind_addr_len)) {
+    return absl::UnknownError(absl::StrCat(strerror(errno), " family:", af,
+                                           " binding server socket to port ",
+                                           *port));
+  }
+  if (listen(listen_fd_, SOMAXCONN)) {
+    return absl::UnknownError(
+        absl::StrCat(strerror(errno), " listening on server socket"));
+  }
+  SocketAddress server_sock_addr = {};
+  socklen_t len = sizeof(server_sock_addr);
+  if (getsockname(listen_fd_, &server_sock_addr.sa, &len) < 0) {
+    return absl::UnknownError(
+        absl::StrCat(strerror(errno), " getting sockname from server socket"));
+  }
+  if (server_sock_addr.sa.sa_family == AF_INET) {
+    *port = ntohs(server_sock_addr.in4.sin_port);
+  } else {
+    *port = ntohs(server_sock_addr.in6.sin6_port);
+  }
+  server_port_ = *port;
+  server_socket_address_ = SocketAddressForIp(server_ip_address_, *port);
+
+  for (int64_t i = 0; i < reactor_threads; ++i) {
+    auto reactor = std::make_unique<Reactor>();
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->wakeup_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reactor->epoll_fd < 0 || reactor->wakeup_fd < 0) {
+      return absl::UnknownError(
+          absl::StrCat(strerror(errno), " creating epoll reactor"));
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wakeup_fd,
+                  &event)) {
+      return absl::UnknownError(
+          absl::StrCat(strerror(errno), " adding the reactor wakeup fd"));
+    }
+    reactors_.push_back(std::move(reactor));
+  }
+  epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.ptr = &listen_fd_;
+  if (epoll_ctl(reactors_[0]->epoll_fd, EPOLL_CTL_ADD, listen_fd_, &event)) {
+    return absl::UnknownError(
+        absl::StrCat(strerror(errno), " adding the server socket"));
+  }
+  for (auto& reactor : reactors_) {
+    Reactor* r = reactor.get();
+    r->thread =
+        RunRegisteredThread("TcpReactor", [this, r]() { ReactorThread(r); });
+  }
+  return absl::OkStatus();
+}
+
+void ProtocolDriverTcp::SetHandler(
+    std::function<std::function<void()>(ServerRpcState* state)> handler) {
+  handler_ = handler;
+  handler_set_.TryToNotify();
+}
+
+void ProtocolDriverTcp::SetNumPeers(int num_peers) {
+  absl::MutexLock m(&client_connections_mutex_);
+  client_connections_.resize(num_peers);
+  peer_connection_infos_.resize(num_peers);
+}
+
+absl::StatusOr<std::string> ProtocolDriverTcp::HandlePreConnect(
+    std::string_view remote_connection_info, int peer) {
+  ServerAddress addr;
+  addr.set_ip_address(server_ip_address_.ip());
+  addr.set_port(server_port_);
+  addr.set_socket_address(server_socket_address_);
+  std::string ret;
+  addr.AppendToString(&ret);
+  return ret;
+}
+
+absl::Status ProtocolDriverTcp::HandleConnect(
+    std::string remote_connection_info, int peer) {
+  CHECK_GE(peer, 0);
+  auto maybe_connection = Connect(remote_connection_info);
+  if (!maybe_connection.ok()) return maybe_connection.status();
+  absl::MutexLock m(&client_connections_mutex_);
+  CHECK_LT(static_cast<size_t>(peer), client_connections_.size());
+  peer_connection_infos_[peer] = std::move(remote_connection_info);
+  client_connections_[peer] = std::move(maybe_connection.value());
+  return absl::OkStatus();
+}
+
+absl::StatusOr<std::shared_ptr<TcpConnection>> ProtocolDriverTcp::Connect(
+    const std::string& remote_connection_info) {
+  ServerAddress addr;
+  if (!addr.ParseFromString(remote_connection_info)) {
+    return absl::UnknownError(absl::StrCat(
+        "remote_connection_info did not parse: ", remote_connection_info));
+  }
+  SocketAddress peer_addr = {};
+  socklen_t peer_addr_len;
+  const char* const peer_ascii_addr = addr.ip_address().c_str();
+  if (!strchr(peer_ascii_addr, ':')) {
+    peer_addr.in4.sin_family = AF_INET;
+    peer_addr.in4.sin_port = htons(addr.port());
+    peer_addr_len = sizeof(peer_addr.in4);
+    if (!inet_pton(AF_INET, peer_ascii_addr, &peer_addr.in4.sin_addr)) {
+      return absl::UnknownError(
+          absl::StrCat("Peer address did not parse: ", peer_ascii_addr));
+    }
+  } else {
+    peer_addr.in6.sin6_family = AF_INET6;
+    peer_addr.in6.sin6_port = htons(addr.port());
+    peer_addr_len = sizeof(peer_addr.in6);
+    if (!inet_pton(AF_INET6, peer_ascii_addr, &peer_addr.in6.sin6_addr)) {
+      return absl::UnknownError(
+          absl::StrCat("Peer address did not parse: ", peer_ascii_addr));
+    }
+  }
+
+  int fd = socket(peer_addr.sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return absl::UnknownError(
+        absl::StrCat(strerror(errno), " creating client socket"));
+  }
+  if (connect(fd, &peer_addr.sa, peer_addr_len)) {
+    absl::Status status = absl::UnknownError(absl::StrCat(
+        strerror(errno), " connecting to ", addr.socket_address()));
+    close(fd);
+    return status;
+  }
+  absl::Status status = ApplySocketOptions(fd, client_socket_options_);
+  if (status.ok()) status = SetNonBlocking(fd);
+  if (!status.ok()) {
+    close(fd);
+    return status;
+  }
+  auto connection = std::make_shared<TcpConnection>();
+  connection->fd = fd;
+  connection->is_client = true;
+  AddConnection(connection);
+  return connection;
+}
+
+absl::Status ProtocolDriverTcp::ApplySocketOptions(
+    int fd, const SocketOptions& options) {
+  int nodelay = options.tcp_nodelay;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay))) {
+    return absl::UnknownError(
+        absl::StrCat(strerror(errno), " setting TCP_NODELAY"));
+  }
+  if (options.busy_poll_us) {
+    int busy_poll = options.busy_poll_us;
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+                   sizeof(busy_poll))) {
+      return absl::UnknownError(
+          absl::StrCat(strerror(errno), " setting SO_BUSY_POLL"));
+    }
+  }
+  return absl::OkStatus();
+}
+
+ProtocolDriverTcp::Reactor* ProtocolDriverTcp::NextReactor() {
+  size_t index = next_reactor_.fetch_add(1, std::memory_order_relaxed);
+  return reactors_[index % reactors_.size()].get();
+}
+
+void ProtocolDriverTcp::AddConnection(
+    std::shared_ptr<TcpConnection> connection) {
+  TcpConnection* c = connection.get();
+  c->epoll_fd = NextReactor()->epoll_fd;
+  if (!c->is_client) {
+    absl::MutexLock m(&server_connections_mutex_);
+    server_connections_[c] = std::move(connection);
+  }
+  epoll_event event = {};
+  event.events = EPOLLIN | EPOLLRDHUP;
+  event.data.ptr = c;
+  if (epoll_ctl(c->epoll_fd, EPOLL_CTL_ADD, c->fd, &event)) {
+    LOG(ERROR) << strerror(errno) << " adding a connection to a reactor";
+  }
+}
+
+void ProtocolDriverTcp::AcceptConnections() {
+  while (true) {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        LOG(ERROR) << strerror(errno) << " accepting a connection";
+      }
+      return;
+    }
+    absl::Status status = ApplySocketOptions(fd, server_socket_options_);
+    if (!status.ok()) LOG(WARNING) << status;
+    auto connection = std::make_shared<TcpConnection>();
+    connection->fd = fd;
+    AddConnection(std::move(connection));
+  }
+}
+
+void ProtocolDriverTcp::ReactorThread(Reactor* reactor) {
+  epoll_event events[kMaxEpollEvents];
+  WaitTimeCounters* wait_times = GetWaitTimeCounters("TcpReactor");
+  int n;
+  auto poll = [reactor, &events, &n]() {
+    n = epoll_wait(reactor->epoll_fd, events, kMaxEpollEvents, 0);
+    return n != 0;
+  };
+  auto block = [reactor, &events, &n]() {
+    n = epoll_wait(reactor->epoll_fd, events, kMaxEpollEvents, -1);
+    return n != 0;
+  };
+  bool stop = false;
+  while (!stop) {
+    if (!poll()) WaitWithPolicy(reactor_wait_policy_, wait_times, poll, block);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      LOG(ERROR) << strerror(errno) << " in epoll_wait";
+      return;
+    }
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.ptr == nullptr) {
+        stop = true;
+        continue;
+      }
+      if (events[i].data.ptr == &listen_fd_) {
+        AcceptConnections();
+        continue;
+      }
+      auto* connection = static_cast<TcpConnection*>(events[i].data.ptr);
+      if (events[i].events & EPOLLOUT) {
+        absl::MutexLock m(&connection->write_mutex);
+        FlushWriteQueue(connection);
+      }
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        if (!ReadFromConnection(connection)) {
+          CloseConnection(connection);
+        }
+      }
+    }
+  }
+}
+
+bool ProtocolDriverTcp::ReadFromConnection(TcpConnection* connection) {
+  std::string& buffer = connection->read_buffer;
+  while (true) {
+    if (buffer.size() - connection->read_buffer_length < kMinReadSize) {
+      buffer.resize(connection->read_buffer_length + kMinReadSize);
+    }
+    size_t space = buffer.size() - connection->read_buffer_length;
+    ssize_t n = read(connection->fd, &buffer[connection->read_buffer_length],
+                     space);
+    if (n > 0) {
+      connection->read_buffer_length += n;
+      bytes_received_ += n;
+      HandleFrames(connection);
+      if (connection->retired && IsIdle(connection)) return false;
+      // Level triggered: anything left will be read on the next round.
+      if (static_cast<size_t>(n) < space) return true;
+      continue;
+    }
+    if (n == 0) return false;
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+    if (errno != ECONNRESET) {
+      LOG(ERROR) << strerror(errno) << " reading from a connection";
+    }
+    return false;
+  }
+}
+
+bool ProtocolDriverTcp::IsIdle(TcpConnection* connection) {
+  absl::MutexLock m(&connection->pending_rpcs_mutex);
+  return connection->pending_rpcs.empty();
+}
+
+void ProtocolDriverTcp::HandleFrames(TcpConnection* connection) {
+  std::string& buffer = connection->read_buffer;
+  size_t length = connection->read_buffer_length;
+  size_t pos = 0;
+  size_t needed = 0;
+  while (length - pos >= kFrameHeaderSize) {
+    const char* header = &buffer[pos];
+    size_t message_length = LoadLittleEndian(header, 4);
+    if (length - pos - kFrameHeaderSize < message_length) {
+      needed = kFrameHeaderSize + message_length;
+      break;
+    }
+    uint32_t flags = LoadLittleEndian(header + 4, 4);
+    uint64_t rpc_id = LoadLittleEndian(header + 8, 8);
+    const char* data = header + kFrameHeaderSize;
+    if (connection->is_client) {
+      HandleResponse(connection, rpc_id, flags, data, message_length);
+    } else {
+      HandleRequest(connection, rpc_id, data, message_length);
+    }
+    pos += kFrameHeaderSize + message_length;
+  }
+  if (pos) {
+    memmove(&buffer[0], &buffer[pos], length - pos);
+    connection->read_buffer_length = length - pos;
+  }
+  // Make room for the whole of a large message at once:
+  if (needed > buffer.size()) {
+    buffer.resize(needed);
+  }
+}
+
+void ProtocolDriverTcp::HandleRequest(TcpConnection* connection,
+                                      uint64_t rpc_id, const char* data,
+                                      size_t length) {
+  handler_set_.WaitForNotification();
+  // Counted first, so that ShutdownServer either waits for this RPC or
+  // this thread sees it shutting down:
+  ++pending_server_rpcs_;
+  if (!handler_ || shutting_down_server_.HasBeenNotified()) {
+    --pending_server_rpcs_;
+    return;
+  }
+  absl::Time receive_time = absl::Now();
+  GenericRequest* request = new GenericRequest;
+  if (!request->ParseFromArray(data, length)) {
+    // The handler must not see a partially parsed request:
+    LOG(ERROR) << "request did not parse as a GenericRequest";
+    delete request;
+    SendFrame(connection, EncodeFailedResponse(rpc_id));
+    --pending_server_rpcs_;
+    return;
+  }
+  ServerRpcState* rpc_state = new ServerRpcState;
+  rpc_state->request = request;
+  if (rpc_state->RecordsServerTimings()) {
+    rpc_state->receive_time = receive_time;
+  }
+  rpc_state->SetFreeStateFunction([=]() {
+    delete rpc_state->request;
+    delete rpc_state;
+  });
+  rpc_state->SetSendResponseFunction(
+      [this, rpc_state, rpc_id,
+       connection = connection->shared_from_this()]() {
+        rpc_state->RecordServerTimings();
+        TcpFrame frame = EncodeMessage(rpc_id, &rpc_state->response);
+        // The response may be freed before the frame is written:
+        frame.owned_payload = std::move(*rpc_state->response.mutable_payload());
+        frame.payload = nullptr;
+        if (FrameTooLarge(frame)) {
+          LOG(ERROR) << "response of " << frame.size()
+                     << " bytes is too large to be framed";
+          frame = EncodeFailedResponse(rpc_id);
+        }
+        SendFrame(connection.get(), std::move(frame));
+        --pending_server_rpcs_;
+      });
+  auto remaining_work = handler_(rpc_state);
+  if (remaining_work) {
+    thread_pool_->AddWork(std::move(remaining_work));
+  }
+}
+
+void ProtocolDriverTcp::HandleResponse(TcpConnection* connection,
+                                       uint64_t rpc_id, uint32_t flags,
+                                       const char* data, size_t length) {
+  PendingTcpRpc* pending_rpc;
+  {
+    absl::MutexLock m(&connection->pending_rpcs_mutex);
+    auto it = connection->pending_rpcs.find(rpc_id);
+    if (it == connection->pending_rpcs.end()) {
+      LOG(ERROR) << "response to unknown rpc " << rpc_id;
+      return;
+    }
+    pending_rpc = it->second;
+    connection->pending_rpcs.erase(it);
+  }
+  ClientRpcState* state = pending_rpc->state;
+  if (state->request.record_stage_timings()) {
+    state->completion_dequeued_time = absl::Now();
+  }
+  if (flags & kFailedResponseFlag) {
+    state->success = false;
+  } else {
+    state->success = state->response.ParseFromArray(data, length);
+    if (!state->success) {
+      LOG(ERROR) << "response did not parse as a GenericResponse";
+    }
+  }
+  pending_rpc->done_callback();
+  delete pending_rpc;
+  --pending_rpcs_;
+}
+
+void ProtocolDriverTcp::InitiateRpc(int peer_index, ClientRpcState* state,
+                                    std::function<void(void)> done_callback) {
+  CHECK_GE(peer_index, 0);
+  std::shared_ptr<TcpConnection> connection;
+  TcpFrame frame;
+  uint64_t rpc_id;
+  ++pending_rpcs_;
+  while (true) {
+    {
+      // The reference keeps a connection that ChurnConnection retires, and
+      // its reactor then frees, valid until the request is sent:
+      absl::ReaderMutexLock m(&client_connections_mutex_);
+      CHECK_LT(static_cast<size_t>(peer_index), client_connections_.size());
+      connection = client_connections_[peer_index];
+    }
+    if (!connection) {
+      --pending_rpcs_;
+      state->success = false;
+      done_callback();
+      return;
+    }
+    rpc_id = connection->next_rpc_id.fetch_add(1, std::memory_order_relaxed);
+    // The request is written straight from state->request, which is left
+    // alone until the RPC completes:
+    frame = EncodeMessage(rpc_id, &state->request);
+    // The response may arrive as soon as the frame is queued, after which
+    // the state belongs to the completion, so the send itself is not timed.
+    if (state->request.record_stage_timings()) {
+      state->serialize_done_time = absl::Now();
+    }
+    if (FrameTooLarge(frame)) {
+      LOG(ERROR) << "request of " << frame.size()
+                 << " bytes is too large to be framed";
+      --pending_rpcs_;
+      state->success = false;
+      done_callback();
+      return;
+    }
+    absl::MutexLock m(&connection->pending_rpcs_mutex);
+    // Otherwise ChurnConnection replaced it since, so try the new one:
+    if (!connection->retired) {
+      connection->pending_rpcs[rpc_id] =
+          new PendingTcpRpc{state, done_callback};
+      break;
+    }
+  }
+  if (SendFrame(connection.get(), std::move(frame))) return;
+
+  // The connection is closed; fail the RPC unless that was done already:
+  PendingTcpRpc* pending_rpc = nullptr;
+  {
+    absl::MutexLock m(&connection->pending_rpcs_mutex);
+    auto it = connection->pending_rpcs.find(rpc_id);
+    if (it != connection->pending_rpcs.end()) {
+      pending_rpc = it->second;
+      connection->pending_rpcs.erase(it);
+    }
+  }
+  if (pending_rpc) {
+    state->success = false;
+    pending_rpc->done_callback();
+    delete pending_rpc;
+    --pending_rpcs_;
+  }
+}
+
+bool ProtocolDriverTcp::SendFrame(TcpConnection* connection, TcpFrame frame) {
+  absl::MutexLock m(&connection->write_mutex);
+  if (connection->closed) return false;
+  connection->write_queue.push_back(std::move(frame));
+  // Otherwise the reactor flushes the queue when the socket is writable:
+  if (!connection->waiting_for_epollout) {
+    FlushWriteQueue(connection);
+  }
+  return true;
+}
+
+void ProtocolDriverTcp::FlushWriteQueue(TcpConnection* connection) {
+  auto& queue = connection->write_queue;
+  while (!queue.empty() && !connection->closed) {
+    iovec iov[kMaxIovecs];
+    int iovcnt = 0;
+    for (auto it = queue.begin();
+         it != queue.end() && iovcnt + 2 <= kMaxIovecs; ++it) {
+      size_t offset = it->offset;
+      if (offset < it->head.size()) {
+        iov[iovcnt].iov_base = &it->head[offset];
+        iov[iovcnt].iov_len = it->head.size() - offset;
+        ++iovcnt;
+        offset = 0;
+      } else {
+        offset -= it->head.size();
+      }
+      if (it->payload_size > offset) {
+        iov[iovcnt].iov_base = const_cast<char*>(it->PayloadData() + offset);
+        iov[iovcnt].iov_len = it->payload_size - offset;
+        ++iovcnt;
+      }
+    }
+    // sendmsg rather than writev, for MSG_NOSIGNAL:
+    msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    ssize_t n = sendmsg(connection->fd, &msg, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        ++partial_writes_;
+        if (!connection->waiting_for_epollout) {
+          epoll_event event = {};
+          event.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+          event.data.ptr = connection;
+          epoll_ctl(connection->epoll_fd, EPOLL_CTL_MOD, connection->fd,
+                    &event);
+          connection->waiting_for_epollout = true;
+        }
+        return;
+      }
+      if (errno != EPIPE && errno != ECONNRESET) {
+        LOG(ERROR) << strerror(errno) << " writing to a connection";
+      }
+      // Let the reactor notice, and close the connection:
+      queue.clear();
+      shutdown(connection->fd, SHUT_RDWR);
+      return;
+    }
+    bytes_sent_ += n;
+    size_t written = n;
+    while (written) {
+      TcpFrame& frame = queue.front();
+      size_t left = frame.size() - frame.offset;
+      if (written < left) {
+        frame.offset += written;
+        break;
+      }
+      written -= left;
+      queue.pop_front();
+    }
+  }
+  if (connection->waiting_for_epollout) {
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = connection;
+    epoll_ctl(connection->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    connection->waiting_for_epollout = false;
+  }
+}
+
+void ProtocolDriverTcp::CloseConnection(TcpConnection* connection) {
+  {
+    absl::MutexLock m(&connection->write_mutex);
+    if (connection->closed) return;
+    connection->closed = true;
+    connection->write_queue.clear();
+    epoll_ctl(connection->epoll_fd, EPOLL_CTL_DEL, connection->fd, nullptr);
+    close(connection->fd);
+    connection->fd = -1;
+  }
+  if (connection->is_client) {
+    absl::flat_hash_map<uint64_t, PendingTcpRpc*> pending_rpcs;
+    {
+      absl::MutexLock m(&connection->pending_rpcs_mutex);
+      pending_rpcs.swap(connection->pending_rpcs);
+    }
+    for (auto& [rpc_id, pending_rpc] : pending_rpcs) {
+      pending_rpc->state->success = false;
+      pending_rpc->done_callback();
+      delete pending_rpc;
+      --pending_rpcs_;
+    }
+    // May delete the connection, if ChurnConnection retired it:
+    absl::MutexLock m(&client_connections_mutex_);
+    retired_client_connections_.erase(connection);
+  } else {
+    // May delete the connection:
+    absl::MutexLock m(&server_connections_mutex_);
+    server_connections_.erase(connection);
+  }
+}
+
+std::vector<TransportStat> ProtocolDriverTcp::GetTransportStats() {
+  return {
+      {"tcp_bytes_sent", bytes_sent_},
+      {"tcp_bytes_received", bytes_received_},
+      {"tcp_partial_writes", partial_writes_},
+  };
+}
+
+void ProtocolDriverTcp::ChurnConnection(int peer) {
+  std::string remote_connection_info;
+  {
+    absl::ReaderMutexLock m(&client_connections_mutex_);
+    remote_connection_info = peer_connection_infos_[peer];
+  }
+  if (remote_connection_info.empty()) return;
+  auto maybe_connection = Connect(remote_connection_info);
+  if (!maybe_connection.ok()) {
+    LOG(ERROR) << "Reconnecting to peer " << peer << ": "
+               << maybe_connection.status();
+    return;
+  }
+  std::shared_ptr<TcpConnection> old_connection;
+  {
+    absl::MutexLock m(&client_connections_mutex_);
+    old_connection = std::move(client_connections_[peer]);
+    client_connections_[peer] = std::move(maybe_connection.value());
+    if (old_connection) {
+      // Its reactor may still be reading from it:
+      retired_client_connections_[old_connection.get()] = old_connection;
+    }
+  }
+  if (!old_connection) return;
+  // The RPCs in flight complete on the old connection, and the reactor
+  // closes it after the last one; unless there are none:
+  {
+    absl::MutexLock m(&old_connection->pending_rpcs_mutex);
+    old_connection->retired = true;
+    if (!old_connection->pending_rpcs.empty()) return;
+  }
+  // The reactor then closes it when it reads the end of the stream, so that
+  // it does not free the connection while handling one of its events:
+  absl::MutexLock m(&old_connection->write_mutex);
+  if (!old_connection->closed) shutdown(old_connection->fd, SHUT_RDWR);
+}
+
+void ProtocolDriverTcp::ShutdownServer() {
+  handler_set_.TryToNotify();
+  if (shutting_down_server_.TryToNotify()) {
+    if (!reactors_.empty() && listen_fd_ >= 0) {
+      epoll_ctl(reactors_[0]->epoll_fd, EPOLL_CTL_DEL, listen_fd_, nullptr);
+    }
+    while (pending_server_rpcs_) {
+      sched_yield();
+    }
+    // Runs the work that is still queued:
+    thread_pool_.reset();
+    {
+      absl::MutexLock m(&shutdown_mutex_);
+      server_done_ = true;
+    }
+    StopReactorsIfDone();
+  }
+}
+
+void ProtocolDriverTcp::ShutdownClient() {
+  if (shutting_down_client_.TryToNotify()) {
+    while (pending_rpcs_) {
+      sched_yield();
+    }
+    {
+      absl::MutexLock m(&shutdown_mutex_);
+      client_done_ = true;
+    }
+    StopReactorsIfDone();
+  }
+}
+
+// The reactors serve both the client and the server connections, so they
+// keep running until both sides are shut down.
+void ProtocolDriverTcp::StopReactorsIfDone() {
+  absl::MutexLock m(&shutdown_mutex_);
+  if (!server_done_ || !client_done_ || reactors_stopped_) return;
+  reactors_stopped_ = true;
+  for (auto& reactor : reactors_) {
+    if (reactor->thread.joinable()) {
+      uint64_t one = 1;
+      if (write(reactor->wakeup_fd, &one, sizeof(one)) < 0) {
+        LOG(ERROR) << strerror(errno) << " waking up a reactor";
+      }
+      reactor->thread.join();
+    }
+  }
+  std::vector<std::shared_ptr<TcpConnection>> client_connections;
+  {
+    absl::MutexLock m(&client_connections_mutex_);
+    client_connections.swap(client_connections_);
+    for (auto& [ptr, connection] : retired_client_connections_) {
+      client_connections.push_back(connection);
+    }
+  }
+  for (auto& connection : client_connections) {
+    if (connection) CloseConnection(connection.get());
+  }
+  std::vector<std::shared_ptr<TcpConnection>> server_connections;
+  {
+    absl::MutexLock m(&server_connections_mutex_);
+    for (auto& [ptr, connection] : server_connections_) {
+      server_connections.push_back(connection);
+    }
+  }
+  for (auto& connection : server_connections) {
+    CloseConnection(connection.get());
+  }
+  for (auto& reactor : reactors_) {
+    if (reactor->epoll_fd >= 0) close(reactor->epoll_fd);
+    if (reactor->wakeup_fd >= 0) close(reactor->wakeup_fd);
+  }
+  reactors_.clear();
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    listen_fd_ = -1;
+  }
+}
+
+}  // namespace distbench
@@ -0,0 +1,195 @@
+// Copyright 2023 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef DISTBENCH_PROTOCOL_DRIVER_TCP_H_
+#define DISTBENCH_PROTOCOL_DRIVER_TCP_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/synchronization/mutex.h"
+#include "distbench_threadpool.h"
+#include "distbench_utils.h"
+#include "distbench_wait_policy.h"
+#include "protocol_driver.h"
+
+namespace distbench {
+
+struct PendingTcpRpc {
+  ClientRpcState* state;
+  std::function<void(void)> done_callback;
+};
+
+// A message waiting to be written to a connection. The payload is written
+// straight from the protobuf it belongs to (or from owned_payload, once that
+// protobuf is gone), rather than being serialized with the rest of the
+// message.
+struct TcpFrame {
+  std::string head;
+  const char* payload = nullptr;
+  size_t payload_size = 0;
+  std::string owned_payload;
+  // Number of bytes already written:
+  size_t offset = 0;
+
+  const char* PayloadData() const {
+    return owned_payload.empty() ? payload : owned_payload.data();
+  }
+  size_t size() const { return head.size() + payload_size; }
+};
+
+struct TcpConnection : public std::enable_shared_from_this<TcpConnection> {
+  int fd = -1;
+  bool is_client = false;
+  int epoll_fd = -1;
+  // Used only by the reactor thread that owns the connection:
+  std::string read_buffer;
+  size_t read_buffer_length = 0;
+
+  absl::Mutex write_mutex;
+  std::deque<TcpFrame> write_queue ABSL_GUARDED_BY(write_mutex);
+  bool closed ABSL_GUARDED_BY(write_mutex) = false;
+  bool waiting_for_epollout ABSL_GUARDED_BY(write_mutex) = false;
+
+  // Client connections only:
+  std::atomic<uint64_t> next_rpc_id = 0;
+  absl::Mutex pending_rpcs_mutex;
+  absl::flat_hash_map<uint64_t, PendingTcpRpc*> pending_rpcs
+      ABSL_GUARDED_BY(pending_rpcs_mutex);
+  // Set, under pending_rpcs_mutex, once ChurnConnection replaced the
+  // connection: it takes no new RPCs, and its reactor closes and frees it
+  // once the RPCs in flight complete.
+  std::atomic<bool> retired = false;
+};
+
+// A protocol driver sending length-prefixed protobufs over plain TCP
+// connections, as a baseline without the overhead of an RPC framework.
+class ProtocolDriverTcp : public ProtocolDriver {
+ public:
+  ProtocolDriverTcp();
+  ~ProtocolDriverTcp() override;
+
+  absl::Status Initialize(const ProtocolDriverOptions& pd_opts,
+                          int* port) override;
+
+  void SetHandler(std::function<std::function<void()>(ServerRpcState* state)>
+                      handler) override;
+
+  void SetNumPeers(int num_peers) override;
+
+  absl::Status HandleConnect(std::string remote_connection_info,
+                             int peer) override;
+
+  absl::StatusOr<std::string> HandlePreConnect(
+      std::string_view remote_connection_info, int peer) override;
+
+  std::vector<TransportStat> GetTransportStats() override;
+
+  void InitiateRpc(int peer_index, ClientRpcState* state,
+                   std::function<void(void)> done_callback) override;
+
+  void ChurnConnection(int peer) override;
+
+  void ShutdownServer() override;
+
+  void ShutdownClient() override;
+
+ private:
+  struct Reactor {
+    int epoll_fd = -1;
+    int wakeup_fd = -1;
+    std::thread thread;
+  };
+
+  struct SocketOptions {
+    bool tcp_nodelay = true;
+    int busy_poll_us = 0;
+  };
+
+  // Opens a client connection to the server described by
+  // remote_connection_info, and hands it to a reactor.
+  absl::StatusOr<std::shared_ptr<TcpConnection>> Connect(
+      const std::string& remote_connection_info);
+  absl::Status ApplySocketOptions(int fd, const SocketOptions& options);
+  void AddConnection(std::shared_ptr<TcpConnection> connection);
+  Reactor* NextReactor();
+  void ReactorThread(Reactor* reactor);
+  void AcceptConnections();
+  // Returns false if the connection was closed.
+  bool ReadFromConnection(TcpConnection* connection);
+  // Whether the connection has no RPCs in flight.
+  bool IsIdle(TcpConnection* connection);
+  void HandleFrames(TcpConnection* connection);
+  void HandleRequest(TcpConnection* connection, uint64_t rpc_id,
+                     const char* data, size_t length);
+  void HandleResponse(TcpConnection* connection, uint64_t rpc_id,
+                      uint32_t flags, const char* data, size_t length);
+  // Queues the frame and writes as much of the queue as possible.
+  bool SendFrame(TcpConnection* connection, TcpFrame frame);
+  void FlushWriteQueue(TcpConnection* connection)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(connection->write_mutex);
+  void CloseConnection(TcpConnection* connection);
+  void StopReactorsIfDone();
+
+  int listen_fd_ = -1;
+  int server_port_ = 0;
+  DeviceIpAddress server_ip_address_;
+  std::string server_socket_address_;
+  SocketOptions client_socket_options_;
+  SocketOptions server_socket_options_;
+
+  std::vector<std::unique_ptr<Reactor>> reactors_;
+  std::atomic<size_t> next_reactor_ = 0;
+  // How the reactors wait for events, see reactor_wait_policy:
+  WaitPolicy reactor_wait_policy_;
+
+  // Indexed by peer; replaced by ChurnConnection:
+  absl::Mutex client_connections_mutex_;
+  std::vector<std::shared_ptr<TcpConnection>> client_connections_
+      ABSL_GUARDED_BY(client_connections_mutex_);
+  std::vector<std::string> peer_connection_infos_
+      ABSL_GUARDED_BY(client_connections_mutex_);
+  // The connections replaced by ChurnConnection, kept until they are
+  // closed, since their reactor still refers to them:
+  absl::flat_hash_map<TcpConnection*, std::shared_ptr<TcpConnection>>
+      retired_client_connections_ ABSL_GUARDED_BY(client_connections_mutex_);
+  std::atomic<int> pending_rpcs_ = 0;
+
+  absl::Mutex server_connections_mutex_;
+  absl::flat_hash_map<TcpConnection*, std::shared_ptr<TcpConnection>>
+      server_connections_ ABSL_GUARDED_BY(server_connections_mutex_);
+  std::atomic<int> pending_server_rpcs_ = 0;
+  std::unique_ptr<AbstractThreadpool> thread_pool_;
+  std::function<std::function<void()>(ServerRpcState* state)> handler_;
+  SafeNotification handler_set_;
+
+  SafeNotification shutting_down_server_;
+  SafeNotification shutting_down_client_;
+  absl::Mutex shutdown_mutex_;
+  bool server_done_ ABSL_GUARDED_BY(shutdown_mutex_) = false;
+  bool client_done_ ABSL_GUARDED_BY(shutdown_mutex_) = false;
+  bool reactors_stopped_ ABSL_GUARDED_BY(shutdown_mutex_) = false;
+
+  std::atomic<int64_t> bytes_sent_ = 0;
+  std::atomic<int64_t> bytes_received_ = 0;
+  std::atomic<int64_t> partial_writes_ = 0;
+};
+
+}  // namespace distbench
+
+#endif  // DISTBENCH_PROTOCOL_DRIVER_TCP_H_
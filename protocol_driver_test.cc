@@ -12,6 +12,11 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <thread>
+
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/notification.h"
 #include "benchmark/benchmark.h"
 #include "distbench_utils.h"
 #include "glog/logging.h"
@@ -164,6 +169,39 @@ TEST_P(ProtocolDriverTest, SelfEcho) {
   EXPECT_EQ(client_rpc_count, 1);
 }
 
+TEST_P(ProtocolDriverTest, StageTimings) {
+  ProtocolDriverOptions pdo = PdoFromString(GetParam());
+  int port = 0;
+  auto maybe_pd = AllocateProtocolDriver(pdo, &port);
+  ASSERT_OK(maybe_pd.status());
+  auto& pd = maybe_pd.value();
+  pd->SetNumPeers(1);
+  pd->SetHandler([&](ServerRpcState* s) {
+    s->handler_start_time = pd->GetClock().Now();
+    s->SendResponseIfSet();
+    s->FreeStateIfSet();
+    return std::function<void()>();
+  });
+  std::string addr = pd->HandlePreConnect("", 0).value();
+  ASSERT_OK(pd->HandleConnect(addr, 0));
+
+  ClientRpcState rpc_state;
+  rpc_state.request.set_record_stage_timings(true);
+  rpc_state.request.set_record_server_processing_time(true);
+  pd->InitiateRpc(0, &rpc_state, [&]() {
+    ASSERT_TRUE(rpc_state.success);
+    EXPECT_NE(rpc_state.completion_dequeued_time, absl::InfinitePast());
+    const RpcStageTimings& timings = rpc_state.response.server_stage_timings();
+    ASSERT_TRUE(timings.has_response_sent_ns());
+    EXPECT_GE(timings.handler_start_ns(), 0);
+    EXPECT_GE(timings.handler_end_ns(), timings.handler_start_ns());
+    EXPECT_GE(timings.response_sent_ns(), timings.handler_end_ns());
+    EXPECT_EQ(rpc_state.response.server_processing_ns(),
+              timings.response_sent_ns());
+  });
+  pd->ShutdownClient();
+}
+
 TEST_P(ProtocolDriverTest, Echo) {
   ProtocolDriverOptions pdo = PdoFromString(GetParam());
   int port1 = 0;
@@ -208,6 +246,96 @@ TEST_P(ProtocolDriverTest, Echo) {
   EXPECT_EQ(client_rpc_count, 1);
 }
 
+TEST_P(ProtocolDriverTest, LargePayloads) {
+  ProtocolDriverOptions pdo = PdoFromString(GetParam());
+  int port = 0;
+  auto maybe_pd = AllocateProtocolDriver(pdo, &port);
+  ASSERT_OK(maybe_pd.status());
+  auto& pd = maybe_pd.value();
+  pd->SetNumPeers(1);
+  pd->SetHandler([&](ServerRpcState* s) {
+    s->response.set_payload(s->request->payload());
+    s->SendResponseIfSet();
+    s->FreeStateIfSet();
+    return std::function<void()>();
+  });
+  std::string addr = pd->HandlePreConnect("", 0).value();
+  ASSERT_OK(pd->HandleConnect(addr, 0));
+
+  // Homa messages are at most HOMA_MAX_MESSAGE_LENGTH (1'000'000) bytes, so
+  // the larger RPCs must fail cleanly rather than hang or be truncated:
+  const bool multi_mib_rpcs_work = pdo.protocol_name() != "homa";
+  const std::vector<int> payload_sizes = {900'000, 3 * 1024 * 1024};
+  std::vector<ClientRpcState> rpc_states(payload_sizes.size());
+  std::atomic<int> client_rpc_count = 0;
+  for (size_t i = 0; i < payload_sizes.size(); ++i) {
+    std::string payload(payload_sizes[i], 'a');
+    for (size_t j = 0; j < payload.size(); j += 4096) {
+      payload[j] = 'a' + j % 26;
+    }
+    rpc_states[i].request.set_payload(payload);
+    pd->InitiateRpc(0, &rpc_states[i], [&, i]() {
+      ++client_rpc_count;
+      if (payload_sizes[i] < 1'000'000 || multi_mib_rpcs_work) {
+        ASSERT_TRUE(rpc_states[i].success);
+        EXPECT_EQ(rpc_states[i].response.payload().size(), payload_sizes[i]);
+        EXPECT_EQ(rpc_states[i].response.payload(),
+                  rpc_states[i].request.payload());
+      } else {
+        EXPECT_FALSE(rpc_states[i].success);
+      }
+    });
+  }
+  pd->ShutdownClient();
+  EXPECT_EQ(client_rpc_count, payload_sizes.size());
+}
+
+// The RPCs started before, during and after a reconnect all complete, and
+// the ones after it use the new connection.
+TEST_P(ProtocolDriverTest, ChurnConnection) {
+  ProtocolDriverOptions pdo = PdoFromString(GetParam());
+  int port = 0;
+  auto maybe_pd = AllocateProtocolDriver(pdo, &port);
+  ASSERT_OK(maybe_pd.status());
+  auto& pd = maybe_pd.value();
+  if (!pd->SupportsConnectionChurn()) {
+    GTEST_SKIP() << "This driver cannot churn its connections";
+  }
+  pd->SetNumPeers(1);
+  pd->SetHandler([&](ServerRpcState* s) {
+    s->response.set_payload(s->request->payload());
+    s->SendResponseIfSet();
+    s->FreeStateIfSet();
+    return std::function<void()>();
+  });
+  std::string addr = pd->HandlePreConnect("", 0).value();
+  ASSERT_OK(pd->HandleConnect(addr, 0));
+
+  const int kRpcsPerRound = 10;
+  std::vector<ClientRpcState> rpc_states(3 * kRpcsPerRound);
+  std::atomic<int> client_rpc_count = 0;
+  auto start_rpcs = [&](int round) {
+    for (int i = round * kRpcsPerRound; i < (round + 1) * kRpcsPerRound; ++i) {
+      rpc_states[i].request.set_payload(absl::StrCat("ping", i));
+      pd->InitiateRpc(0, &rpc_states[i], [&, i]() {
+        ++client_rpc_count;
+        EXPECT_TRUE(rpc_states[i].success);
+        EXPECT_EQ(rpc_states[i].response.payload(), absl::StrCat("ping", i));
+      });
+    }
+  };
+  start_rpcs(0);
+  std::thread churn_thread([&]() { pd->ChurnConnection(0); });
+  start_rpcs(1);
+  churn_thread.join();
+  start_rpcs(2);
+  pd->ShutdownClient();
+  EXPECT_EQ(client_rpc_count, rpc_states.size());
+}
+
+// Echoes state.range(0) RPCs at a time between two drivers over loopback:
+// with one RPC in flight this measures the round trip latency, with more
+// the throughput.
 void Echo(benchmark::State& state, std::string opts_string) {
   ProtocolDriverOptions opts = PdoFromString(opts_string);
   int port1 = 0;
@@ -218,10 +346,8 @@ void Echo(benchmark::State& state, std::string opts_string) {
   auto maybe_pd2 = AllocateProtocolDriver(opts, &port2);
   ASSERT_OK(maybe_pd2.status());
   auto& pd2 = maybe_pd2.value();
-  std::atomic<int> server_rpc_count = 0;
   pd2->SetNumPeers(1);
   pd2->SetHandler([&](ServerRpcState* s) {
-    ++server_rpc_count;
     s->response.set_payload(s->request->payload());
     s->SendResponseIfSet();
     s->FreeStateIfSet();
@@ -239,17 +365,28 @@ void Echo(benchmark::State& state, std::string opts_string) {
   ASSERT_OK(pd1->HandleConnect(addr2, 0));
   ASSERT_OK(pd2->HandleConnect(addr1, 0));
 
-  std::atomic<int> client_rpc_count = 0;
-  ClientRpcState rpc_state;
-  rpc_state.request.set_payload("ping!");
+  const int rpcs_in_flight = state.range(0);
+  std::vector<ClientRpcState> rpc_states(rpcs_in_flight);
+  for (auto& rpc_state : rpc_states) {
+    rpc_state.request.set_payload("ping!");
+  }
+  int64_t failed_rpcs = 0;
   for (auto s : state) {
-    pd1->InitiateRpc(0, &rpc_state, [&]() {
-      ++client_rpc_count;
-      EXPECT_EQ(rpc_state.request.payload(), rpc_state.response.payload());
-      EXPECT_EQ(rpc_state.response.payload(), "ping!");
-    });
-    pd1->ShutdownClient();
+    std::atomic<int> remaining_rpcs = rpcs_in_flight;
+    absl::Notification done;
+    for (auto& rpc_state : rpc_states) {
+      pd1->InitiateRpc(0, &rpc_state, [&]() {
+        if (--remaining_rpcs == 0) done.Notify();
+      });
+    }
+    done.WaitForNotification();
+    for (const auto& rpc_state : rpc_states) {
+      failed_rpcs += !rpc_state.success;
+    }
   }
+  pd1->ShutdownClient();
+  EXPECT_EQ(failed_rpcs, 0);
+  state.SetItemsProcessed(state.iterations() * rpcs_in_flight);
 }
 
 std::string GrpcOptions() {
@@ -289,6 +426,46 @@ std::string GrpcPollingClientPollingServer() {
   return pdo.DebugString();
 }
 
+std::string GrpcShardedPollingClient(std::string sharding) {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("grpc");
+  AddClientStringOptionTo(pdo, "client_type", "polling");
+  AddClientStringOptionTo(pdo, "client_cq_sharding", sharding);
+  AddClientStringOptionTo(pdo, "client_cq_cpus", "0");
+  auto* ns = pdo.add_client_settings();
+  ns->set_name("client_cq_count");
+  ns->set_int64_value(4);
+  return pdo.DebugString();
+}
+
+std::string GrpcMultiChannelClient(std::string client_type,
+                                   std::string selection) {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("grpc");
+  AddClientStringOptionTo(pdo, "client_type", client_type);
+  AddClientStringOptionTo(pdo, "channel_selection", selection);
+  auto* ns = pdo.add_client_settings();
+  ns->set_name("channels_per_peer");
+  ns->set_int64_value(4);
+  return pdo.DebugString();
+}
+
+std::string GrpcShardedPollingServer(std::string dispatch) {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("grpc");
+  AddClientStringOptionTo(pdo, "client_type", "polling");
+  AddServerStringOptionTo(pdo, "server_type", "polling");
+  AddServerStringOptionTo(pdo, "server_cq_dispatch", dispatch);
+  AddServerStringOptionTo(pdo, "server_cq_cpus", "0");
+  auto* ns = pdo.add_server_settings();
+  ns->set_name("server_cq_count");
+  ns->set_int64_value(4);
+  ns = pdo.add_server_settings();
+  ns->set_name("server_cq_pending_requests");
+  ns->set_int64_value(8);
+  return pdo.DebugString();
+}
+
 std::string GrpcCallbackClientInlineServer() {
   ProtocolDriverOptions pdo;
   pdo.set_protocol_name("grpc");
@@ -303,6 +480,16 @@ std::string HomaOptions() {
   return pdo.DebugString();
 }
 
+std::string HomaHandoffServer() {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("homa");
+  AddServerStringOptionTo(pdo, "server_type", "handoff");
+  auto opt = pdo.add_server_settings();
+  opt->set_name("server_threads");
+  opt->set_int64_value(4);
+  return pdo.DebugString();
+}
+
 std::string HomaTransport(std::string pdo_in) {
   ProtocolDriverOptions pdo = PdoFromString(pdo_in);
   auto opt = pdo.add_server_settings();
@@ -311,20 +498,188 @@ std::string HomaTransport(std::string pdo_in) {
   return pdo.DebugString();
 }
 
+std::string WorkStealingThreadpool(std::string pdo_in) {
+  ProtocolDriverOptions pdo = PdoFromString(pdo_in);
+  AddServerStringOptionTo(pdo, "threadpool_type", "work_stealing");
+  return pdo.DebugString();
+}
+
+std::string TcpOptions() {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("tcp");
+  return pdo.DebugString();
+}
+
+std::string TcpMultiReactorOptions() {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("tcp");
+  auto* ns = pdo.add_server_settings();
+  ns->set_name("reactor_threads");
+  ns->set_int64_value(3);
+  ns = pdo.add_client_settings();
+  ns->set_name("tcp_nodelay");
+  ns->set_int64_value(0);
+  AddServerStringOptionTo(pdo, "threadpool_type", "work_stealing");
+  AddServerStringOptionTo(pdo, "thread_placement", "TcpReactor=nic");
+  return pdo.DebugString();
+}
+
+std::string ShmOptions() {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("shm");
+  return pdo.DebugString();
+}
+
+std::string SimulatedOptions() {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("simulated");
+  return pdo.DebugString();
+}
+
+std::string ShmSpinningSmallRingOptions() {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("shm");
+  auto* ns = pdo.add_server_settings();
+  ns->set_name("ring_size");
+  ns->set_int64_value(4096);
+  ns = pdo.add_server_settings();
+  ns->set_name("futex_wakeup");
+  ns->set_int64_value(0);
+  return pdo.DebugString();
+}
+
+std::string LocalShmOptions(std::string next_protocol_driver) {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("local_shm");
+  AddServerStringOptionTo(pdo, "next_protocol_driver", next_protocol_driver);
+  return pdo.DebugString();
+}
+
 std::string MercuryOptions() {
   ProtocolDriverOptions pdo;
   pdo.set_protocol_name("mercury");
   return pdo.DebugString();
 }
 
-void BM_GrpcEcho(benchmark::State& state) { Echo(state, GrpcOptions()); }
+std::string MercuryBulkOptions() {
+  ProtocolDriverOptions pdo;
+  pdo.set_protocol_name("mercury");
+  auto* ns = pdo.add_server_settings();
+  ns->set_name("bulk_threshold");
+  ns->set_int64_value(64 * 1024);
+  ns = pdo.add_server_settings();
+  ns->set_name("bulk_response_capacity");
+  ns->set_int64_value(4 * 1024 * 1024);
+  return pdo.DebugString();
+}
+
+// Every protocol driver that AllocateProtocolDriver can build, with one RPC
+// in flight (latency) and 64 (throughput):
+BENCHMARK_CAPTURE(Echo, grpc, GrpcOptions())->Arg(1)->Arg(64)->UseRealTime();
+BENCHMARK_CAPTURE(Echo, grpc_async_callback, GrpcAsynCallbackOptions())
+    ->Arg(1)
+    ->Arg(64)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(Echo, grpc_polling_client_handoff_server,
+                  GrpcPollingClientHandoffServer())
+    ->Arg(1)
+    ->Arg(64)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(Echo, grpc_polling_client_polling_server,
+                  GrpcPollingClientPollingServer())
+    ->Arg(1)
+    ->Arg(64)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(Echo, grpc_callback_client_inline_server,
+                  GrpcCallbackClientInlineServer())
+    ->Arg(1)
+    ->Arg(64)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(Echo, double_barrel, DoubleBarrelGrpc())
+    ->Arg(1)
+    ->Arg(64)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(Echo, tcp, TcpOptions())->Arg(1)->Arg(64)->UseRealTime();
+BENCHMARK_CAPTURE(Echo, shm, ShmOptions())->Arg(1)->Arg(64)->UseRealTime();
+BENCHMARK_CAPTURE(Echo, local_shm_grpc, LocalShmOptions("grpc"))
+    ->Arg(1)
+    ->Arg(64)
+    ->UseRealTime();
+BENCHMARK_CAPTURE(Echo, local_shm_tcp, LocalShmOptions("tcp"))
+    ->Arg(1)
+    ->Arg(64)
+    ->UseRealTime();
+#ifdef WITH_HOMA
+BENCHMARK_CAPTURE(Echo, homa, HomaOptions())->Arg(1)->Arg(64)->UseRealTime();
+#endif
+#ifdef WITH_MERCURY
+BENCHMARK_CAPTURE(Echo, mercury, MercuryOptions())
+    ->Arg(1)
+    ->Arg(64)
+    ->UseRealTime();
+#endif
+
+// Returns the sum of the transport stats whose name ends with suffix, and
+// checks that each of them is at least min_value.
+int64_t SumChannelStats(ProtocolDriver* pd, std::string_view suffix,
+                        int64_t min_value) {
+  int64_t sum = 0;
+  for (const auto& stat : pd->GetTransportStats()) {
+    if (!absl::EndsWith(stat.name, suffix)) continue;
+    EXPECT_GE(stat.value, min_value) << stat.name;
+    sum += stat.value;
+  }
+  return sum;
+}
+
+TEST(GrpcClientChannels, SpreadsRpcsOverChannels) {
+  for (std::string client_type : {"polling", "callback"}) {
+    for (std::string selection : {"round_robin", "least_outstanding"}) {
+      ProtocolDriverOptions pdo =
+          PdoFromString(GrpcMultiChannelClient(client_type, selection));
+      int port = 0;
+      auto maybe_pd = AllocateProtocolDriver(pdo, &port);
+      ASSERT_OK(maybe_pd.status());
+      auto& pd = maybe_pd.value();
+      pd->SetNumPeers(1);
+      pd->SetHandler([&](ServerRpcState* s) {
+        s->SendResponseIfSet();
+        s->FreeStateIfSet();
+        return std::function<void()>();
+      });
+      std::string addr = pd->HandlePreConnect("", 0).value();
+      ASSERT_OK(pd->HandleConnect(addr, 0));
 
-void BM_GrpcCallbackEcho(benchmark::State& state) {
-  Echo(state, GrpcAsynCallbackOptions());
+      const int kNumIterations = 1000;
+      std::vector<ClientRpcState> rpc_states(kNumIterations);
+      std::atomic<int> client_rpc_count = 0;
+      for (int i = 0; i < kNumIterations; ++i) {
+        pd->InitiateRpc(0, &rpc_states[i], [&, i]() {
+          if (rpc_states[i].success) ++client_rpc_count;
+        });
+      }
+      pd->ShutdownClient();
+      EXPECT_EQ(client_rpc_count, kNumIterations);
+      // Round robin gives each of the 4 channels a quarter of the RPCs:
+      const int64_t min_rpcs =
+          selection == "round_robin" ? kNumIterations / 4 : 0;
+      EXPECT_EQ(SumChannelStats(pd.get(), "/rpc_cnt", min_rpcs),
+                kNumIterations)
+          << selection;
+      EXPECT_GT(SumChannelStats(pd.get(), "/max_outstanding_rpcs", 0), 0);
+    }
+  }
 }
 
-BENCHMARK(BM_GrpcEcho);
-BENCHMARK(BM_GrpcCallbackEcho);
+TEST(GrpcClientChannels, InvalidSettings) {
+  ProtocolDriverOptions pdo =
+      PdoFromString(GrpcMultiChannelClient("polling", "random"));
+  int port = 0;
+  EXPECT_FALSE(AllocateProtocolDriver(pdo, &port).ok());
+  pdo = PdoFromString(GrpcMultiChannelClient("polling", "round_robin"));
+  pdo.mutable_client_settings(2)->set_int64_value(0);
+  EXPECT_FALSE(AllocateProtocolDriver(pdo, &port).ok());
+}
 
 // clang-format off
 INSTANTIATE_TEST_SUITE_P(ProtocolDriverTests, ProtocolDriverTest,
@@ -334,8 +689,28 @@ INSTANTIATE_TEST_SUITE_P(ProtocolDriverTests, ProtocolDriverTest,
                            GrpcPollingClientHandoffServer(),
                            GrpcPollingClientPollingServer(),
                            GrpcCallbackClientInlineServer(),
+                           GrpcShardedPollingClient("peer"),
+                           GrpcShardedPollingClient("round_robin"),
+                           GrpcMultiChannelClient("polling", "round_robin"),
+                           GrpcMultiChannelClient("callback",
+                                                  "least_outstanding"),
+                           GrpcShardedPollingServer("inline"),
+                           GrpcShardedPollingServer("handoff"),
+                           WorkStealingThreadpool(
+                               GrpcPollingClientHandoffServer()),
+                           WorkStealingThreadpool(
+                               GrpcPollingClientPollingServer()),
+                           TcpOptions(),
+                           TcpMultiReactorOptions(),
+                           ShmOptions(),
+                           ShmSpinningSmallRingOptions(),
+                           LocalShmOptions("grpc"),
+                           LocalShmOptions("tcp"),
+                           SimulatedOptions(),
 #ifdef WITH_HOMA
                            HomaOptions(),
+                           HomaHandoffServer(),
+                           WorkStealingThreadpool(HomaHandoffServer()),
 #endif
 #ifdef WITH_HOMA_GRPC
                            HomaTransport(GrpcOptions()),
@@ -346,6 +721,7 @@ INSTANTIATE_TEST_SUITE_P(ProtocolDriverTests, ProtocolDriverTest,
 #endif
 #ifdef WITH_MERCURY
                            MercuryOptions(),
+                           MercuryBulkOptions(),
 #endif
                            DoubleBarrelGrpc()
                            )